@@ -26,7 +26,9 @@
 #include "utils/contains.h"
 #include "utils/files.h"
 #include "utils/named_thread.h"
+#include "utils/step_timer.h"
 #include "vk/check.h"
+#include "vk/pipeline_cache.h"
 #include "wifi_lock.h"
 #include "xr/actionset.h"
 #include "xr/check.h"
@@ -36,6 +38,7 @@
 #include <chrono>
 #include <ctype.h>
 #include <exception>
+#include <future>
 #include <string>
 #include <thread>
 #include <vector>
@@ -51,6 +54,7 @@
 #include <android/native_activity.h>
 #include <sys/system_properties.h>
 
+#include "decoder/android/decoder_probe.h"
 #include "jnipp.h"
 #else
 #include "utils/xdg_base_directory.h"
@@ -67,6 +71,9 @@ struct interaction_profile
 	bool available;
 };
 
+static const char * eye_gaze_profile = "/interaction_profiles/ext/eye_gaze_interaction";
+static const char * eye_gaze_pose = "/user/eyes_ext/input/gaze_ext/pose";
+
 static std::vector<interaction_profile> interaction_profiles{
         interaction_profile{
                 "/interaction_profiles/khr/simple_controller",
@@ -250,6 +257,12 @@ static std::vector<interaction_profile> interaction_profiles{
                         "/user/hand/right/input/thumbstick/touch",
                         "/user/hand/right/input/thumbrest/touch",
                 }},
+        interaction_profile{
+                eye_gaze_profile,
+                {XR_EXT_EYE_GAZE_INTERACTION_EXTENSION_NAME},
+                {
+                        eye_gaze_pose,
+                }},
 };
 
 static const std::pair<std::string_view, XrActionType> action_suffixes[] =
@@ -389,9 +402,11 @@ void application::initialize_vulkan()
 	bool debug_utils_found = false;
 #endif
 	spdlog::info("Available Vulkan instance extensions:");
+	std::vector<std::string> available_instance_extensions;
 	for (vk::ExtensionProperties & i: vk_context.enumerateInstanceExtensionProperties(nullptr))
 	{
 		spdlog::info("    {} (version {})", i.extensionName, i.specVersion);
+		available_instance_extensions.push_back(i.extensionName);
 
 #ifndef NDEBUG
 		if (!strcmp(i.extensionName, VK_EXT_DEBUG_REPORT_EXTENSION_NAME))
@@ -425,6 +440,15 @@ void application::initialize_vulkan()
 	device_extensions.push_back(VK_KHR_GET_MEMORY_REQUIREMENTS_2_EXTENSION_NAME);
 	instance_extensions.push_back(VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME);
 	instance_extensions.push_back(VK_KHR_EXTERNAL_MEMORY_CAPABILITIES_EXTENSION_NAME);
+#else
+	bool external_memory_capabilities = true;
+	for (const char * i: {VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME, VK_KHR_EXTERNAL_MEMORY_CAPABILITIES_EXTENSION_NAME})
+	{
+		if (utils::contains(available_instance_extensions, std::string(i)))
+			instance_extensions.push_back(i);
+		else
+			external_memory_capabilities = false;
+	}
 #endif
 
 	vk::ApplicationInfo application_info{
@@ -479,10 +503,96 @@ void application::initialize_vulkan()
 	physical_device_properties = vk_physical_device.getProperties();
 
 	spdlog::info("Available Vulkan device extensions:");
+	std::vector<std::string> available_device_extensions;
 	for (vk::ExtensionProperties & i: vk_physical_device.enumerateDeviceExtensionProperties())
 	{
 		spdlog::info("    {}", i.extensionName);
+		available_device_extensions.push_back(i.extensionName);
+	}
+
+#ifndef __ANDROID__
+	// Optional extensions to import the dma-buf of hardware decoded frames
+	bool ycbcr_conversion_supported = false;
+	{
+		std::array dma_buf_extensions{
+		        VK_KHR_SAMPLER_YCBCR_CONVERSION_EXTENSION_NAME,
+		        VK_KHR_EXTERNAL_MEMORY_EXTENSION_NAME,
+		        VK_KHR_EXTERNAL_MEMORY_FD_EXTENSION_NAME,
+		        VK_EXT_EXTERNAL_MEMORY_DMA_BUF_EXTENSION_NAME,
+		        VK_EXT_IMAGE_DRM_FORMAT_MODIFIER_EXTENSION_NAME,
+		        VK_EXT_QUEUE_FAMILY_FOREIGN_EXTENSION_NAME,
+		        VK_KHR_IMAGE_FORMAT_LIST_EXTENSION_NAME,
+		        VK_KHR_DEDICATED_ALLOCATION_EXTENSION_NAME,
+		        VK_KHR_MAINTENANCE1_EXTENSION_NAME,
+		        VK_KHR_BIND_MEMORY_2_EXTENSION_NAME,
+		        VK_KHR_GET_MEMORY_REQUIREMENTS_2_EXTENSION_NAME,
+		};
+		bool available = true;
+		for (const char * i: dma_buf_extensions)
+			available = available and utils::contains(available_device_extensions, std::string(i));
+
+		if (available and external_memory_capabilities)
+		{
+			auto features = vk_physical_device.getFeatures2KHR<vk::PhysicalDeviceFeatures2, vk::PhysicalDeviceSamplerYcbcrConversionFeaturesKHR>();
+			ycbcr_conversion_supported = features.get<vk::PhysicalDeviceSamplerYcbcrConversionFeaturesKHR>().samplerYcbcrConversion;
+		}
+
+		if (ycbcr_conversion_supported)
+			device_extensions.insert(device_extensions.end(), dma_buf_extensions.begin(), dma_buf_extensions.end());
+		else
+			spdlog::info("Hardware decoded frames cannot be imported, they will be copied");
+	}
+#endif
+
+	// Optional extension to shade the periphery of the foveated stream at a lower rate
+	bool fragment_density_map_supported = false;
+#ifndef __ANDROID__
+	if (external_memory_capabilities)
+#endif
+	{
+		if (utils::contains(available_device_extensions, std::string(VK_EXT_FRAGMENT_DENSITY_MAP_EXTENSION_NAME)))
+		{
+			auto features = vk_physical_device.getFeatures2KHR<vk::PhysicalDeviceFeatures2, vk::PhysicalDeviceFragmentDensityMapFeaturesEXT>();
+			fragment_density_map_supported = features.get<vk::PhysicalDeviceFragmentDensityMapFeaturesEXT>().fragmentDensityMap;
+		}
+
+		if (fragment_density_map_supported)
+			device_extensions.push_back(VK_EXT_FRAGMENT_DENSITY_MAP_EXTENSION_NAME);
+	}
+
+	// Optional extension to render both eyes of the lobby in a single pass
+	bool multiview_supported = false;
+	if (utils::contains(available_device_extensions, std::string(VK_KHR_MULTIVIEW_EXTENSION_NAME)))
+	{
+		auto features = vk_physical_device.getFeatures2KHR<vk::PhysicalDeviceFeatures2, vk::PhysicalDeviceMultiviewFeaturesKHR>();
+		multiview_supported = features.get<vk::PhysicalDeviceMultiviewFeaturesKHR>().multiview;
+	}
+
+	if (multiview_supported)
+		device_extensions.push_back(VK_KHR_MULTIVIEW_EXTENSION_NAME);
+
+	// Optional extension to know how much memory is left before allocating the decoder and swapchain images
+	bool memory_budget_supported = utils::contains(available_device_extensions, std::string(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME));
+#ifndef __ANDROID__
+	memory_budget_supported = memory_budget_supported and external_memory_capabilities;
+#endif
+	if (memory_budget_supported)
+		device_extensions.push_back(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+
+#ifdef __ANDROID__
+	// Optional extensions to wait on the GPU for the fences of the decoded images
+	if (utils::contains(available_device_extensions, std::string(VK_KHR_EXTERNAL_SEMAPHORE_EXTENSION_NAME)) and
+	    utils::contains(available_device_extensions, std::string(VK_KHR_EXTERNAL_SEMAPHORE_FD_EXTENSION_NAME)))
+	{
+		device_extensions.push_back(VK_KHR_EXTERNAL_SEMAPHORE_EXTENSION_NAME);
+		device_extensions.push_back(VK_KHR_EXTERNAL_SEMAPHORE_FD_EXTENSION_NAME);
 	}
+#endif
+
+	// Optional extension so that the blit and reprojection are not delayed by the system UI and passthrough
+	bool global_priority_supported = utils::contains(available_device_extensions, std::string(VK_EXT_GLOBAL_PRIORITY_EXTENSION_NAME));
+	if (global_priority_supported)
+		device_extensions.push_back(VK_EXT_GLOBAL_PRIORITY_EXTENSION_NAME);
 
 	vk::PhysicalDeviceProperties prop = vk_physical_device.getProperties();
 	spdlog::info("Initializing Vulkan with device {}", prop.deviceName);
@@ -502,16 +612,26 @@ void application::initialize_vulkan()
 	}
 	assert(vk_queue_found);
 
-	float queuePriority = 0.0f;
+	float queuePriority = 1.0f;
+
+	vk::DeviceQueueGlobalPriorityCreateInfoEXT queue_global_priority{
+	        .globalPriority = vk::QueueGlobalPriorityEXT::eHigh,
+	};
 
 	vk::DeviceQueueCreateInfo queueCreateInfo{
+	        .pNext = global_priority_supported ? &queue_global_priority : nullptr,
 	        .queueFamilyIndex = vk_queue_family_index,
 	        .queueCount = 1,
 	        .pQueuePriorities = &queuePriority,
 	};
 
+	// Block compressed formats for the transcoded KTX2 textures
+	vk::PhysicalDeviceFeatures supported_features = vk_physical_device.getFeatures();
 	vk::PhysicalDeviceFeatures device_features{
 	        // .samplerAnisotropy = true,
+	        .textureCompressionETC2 = supported_features.textureCompressionETC2,
+	        .textureCompressionASTC_LDR = supported_features.textureCompressionASTC_LDR,
+	        .textureCompressionBC = supported_features.textureCompressionBC,
 	};
 
 	vk::StructureChain device_create_info{
@@ -522,35 +642,56 @@ void application::initialize_vulkan()
 	                .ppEnabledExtensionNames = device_extensions.data(),
 	                .pEnabledFeatures = &device_features,
 	        },
-#ifdef __ANDROID__
 	        vk::PhysicalDeviceSamplerYcbcrConversionFeaturesKHR{
 	                .samplerYcbcrConversion = VK_TRUE,
 	        },
-#endif
+	        vk::PhysicalDeviceFragmentDensityMapFeaturesEXT{
+	                .fragmentDensityMap = VK_TRUE,
+	        },
+	        vk::PhysicalDeviceMultiviewFeaturesKHR{
+	                .multiview = VK_TRUE,
+	        },
 	};
+#ifndef __ANDROID__
+	if (not ycbcr_conversion_supported)
+		device_create_info.unlink<vk::PhysicalDeviceSamplerYcbcrConversionFeaturesKHR>();
+#endif
+	if (not fragment_density_map_supported)
+		device_create_info.unlink<vk::PhysicalDeviceFragmentDensityMapFeaturesEXT>();
+	if (not multiview_supported)
+		device_create_info.unlink<vk::PhysicalDeviceMultiviewFeaturesKHR>();
 
-	vk_device = xr_system_id.create_device(vk_physical_device, device_create_info.get());
-
-	vk_queue = vk_device.getQueue(vk_queue_family_index, 0);
-
-	vk::PipelineCacheCreateInfo pipeline_cache_info;
-	std::vector<std::byte> pipeline_cache_bytes;
+	for (const char * i: device_extensions)
+		vk_device_extensions.push_back(i);
 
 	try
 	{
-		// TODO Robust pipeline cache serialization
-		// https://zeux.io/2019/07/17/serializing-pipeline-cache/
-		pipeline_cache_bytes = utils::read_whole_file<std::byte>(cache_path / "pipeline_cache");
-
-		pipeline_cache_info.setInitialData<std::byte>(pipeline_cache_bytes);
+		vk_device = xr_system_id.create_device(vk_physical_device, device_create_info.get());
 	}
-	catch (...)
+	catch (std::exception & e)
 	{
+		// The driver may refuse a high priority queue to unprivileged applications
+		if (not queueCreateInfo.pNext)
+			throw;
+		spdlog::warn("Cannot create a high priority queue ({}), using the default priority", e.what());
+		queueCreateInfo.pNext = nullptr;
+		vk_device = xr_system_id.create_device(vk_physical_device, device_create_info.get());
 	}
 
+	vk_queue = vk_device.getQueue(vk_queue_family_index, 0);
+
+	vk::PipelineCacheCreateInfo pipeline_cache_info;
+	std::vector<std::byte> pipeline_cache_bytes = read_pipeline_cache(cache_path / "pipeline_cache", physical_device_properties);
+
+	if (pipeline_cache_bytes.empty())
+		spdlog::info("No valid pipeline cache for this device");
+	else
+		pipeline_cache_info.setInitialData<std::byte>(pipeline_cache_bytes);
+
 	pipeline_cache = vk::raii::PipelineCache(vk_device, pipeline_cache_info);
 
 	allocator.emplace(VmaAllocatorCreateInfo{
+	        .flags = memory_budget_supported ? VMA_ALLOCATOR_CREATE_EXT_MEMORY_BUDGET_BIT : VmaAllocatorCreateFlags{},
 	        .physicalDevice = *vk_physical_device,
 	        .device = *vk_device,
 	        .instance = *vk_instance,
@@ -614,6 +755,8 @@ void application::initialize_actions()
 	for (auto & profile: interaction_profiles)
 	{
 		profile.available = utils::contains_all(xr_extensions, profile.required_extensions);
+		if (profile.profile_name == eye_gaze_profile)
+			profile.available = profile.available and eye_gaze_supported;
 
 		if (!profile.available)
 			continue;
@@ -648,6 +791,8 @@ void application::initialize_actions()
 			right_grip_space = xr_session.create_action_space(a);
 		else if (name == "/user/hand/right/input/aim/pose")
 			right_aim_space = xr_session.create_action_space(a);
+		else if (name == eye_gaze_pose)
+			eye_gaze_space = xr_session.create_action_space(a);
 	}
 
 	// Build an action set for each scene
@@ -716,6 +861,11 @@ void application::initialize_actions()
 
 void application::initialize()
 {
+	utils::step_timer timer("Startup");
+
+	// The translations do not depend on OpenXR or Vulkan, load them while the instance and device are created
+	auto locale = std::async(std::launch::async, [this]() { return initialize_locale(); });
+
 	// LogLayersAndExtensions
 	assert(!xr_instance);
 	xr_extensions.clear();
@@ -729,6 +879,12 @@ void application::initialize()
 	opt_extensions.push_back(XR_EXT_HAND_TRACKING_EXTENSION_NAME);
 	opt_extensions.push_back(XR_FB_PASSTHROUGH_EXTENSION_NAME);
 	opt_extensions.push_back(XR_HTC_PASSTHROUGH_EXTENSION_NAME);
+	opt_extensions.push_back(XR_KHR_COMPOSITION_LAYER_DEPTH_EXTENSION_NAME);
+	opt_extensions.push_back(XR_EXT_PERFORMANCE_SETTINGS_EXTENSION_NAME);
+	opt_extensions.push_back(XR_KHR_VISIBILITY_MASK_EXTENSION_NAME);
+#ifdef XR_KHR_locate_spaces
+	opt_extensions.push_back(XR_KHR_LOCATE_SPACES_EXTENSION_NAME);
+#endif
 
 	for (const auto & i: interaction_profiles)
 	{
@@ -758,6 +914,7 @@ void application::initialize()
 #endif
 
 	spdlog::info("Created OpenXR instance, runtime {}, version {}", xr_instance.get_runtime_name(), xr_instance.get_runtime_version());
+	timer.step("OpenXR instance");
 
 	xr_system_id = xr::system(xr_instance, app_info.formfactor);
 	spdlog::info("Created OpenXR system for form factor {}", xr::to_string(app_info.formfactor));
@@ -781,6 +938,30 @@ void application::initialize()
 		hand_tracking_supported = hand_tracking_properties.supportsHandTracking;
 	}
 
+	if (utils::contains(xr_extensions, XR_EXT_EYE_GAZE_INTERACTION_EXTENSION_NAME))
+	{
+#ifdef __ANDROID__
+		// Quest runtimes only track the gaze once the permission is granted
+		{
+			jni::object<""> act(app_info.native_app->activity->clazz);
+			auto app = act.call<jni::object<"android/app/Application">>("getApplication");
+			auto ctx = app.call<jni::object<"android/content/Context">>("getApplicationContext");
+
+			jni::string permission("com.oculus.permission.EYE_TRACKING");
+			auto result = ctx.call<jni::Int>("checkSelfPermission", permission);
+			if (result != 0 /*PERMISSION_GRANTED*/)
+			{
+				spdlog::info("EYE_TRACKING permission not granted, requesting it");
+				jni::array permissions(permission);
+				act.call<void>("requestPermissions", permissions, jni::Int(0));
+			}
+		}
+#endif
+		XrSystemEyeGazeInteractionPropertiesEXT eye_gaze_properties = xr_system_id.eye_gaze_interaction_properties();
+		spdlog::info("    Eye gaze support: {}", (bool)eye_gaze_properties.supportsEyeGazeInteraction);
+		eye_gaze_supported = eye_gaze_properties.supportsEyeGazeInteraction;
+	}
+
 	switch (xr_system_id.passthrough_supported())
 	{
 		case xr::system::passthrough_type::no_passthrough:
@@ -796,10 +977,13 @@ void application::initialize()
 
 	// Log view configurations and blend modes
 	log_views();
+	timer.step("OpenXR system");
 
 	initialize_vulkan();
+	timer.step("Vulkan device");
 
 	xr_session = xr::session(xr_instance, xr_system_id, vk_instance, vk_physical_device, vk_device, vk_queue_family_index);
+	timer.step("OpenXR session");
 
 	auto spaces = xr_session.get_reference_spaces();
 	spdlog::info("{} reference spaces", spaces.size());
@@ -813,6 +997,10 @@ void application::initialize()
 	// world_space = xr_session.create_reference_space(XR_REFERENCE_SPACE_TYPE_LOCAL);
 
 	config.emplace(xr_system_id);
+#ifdef __ANDROID__
+	// Before any connection, so that the measurement does not compete with a stream
+	wivrn::android::decoder_probe::start(cache_path);
+#endif
 	try
 	{
 		xr_session.set_refresh_rate(config->preferred_refresh_rate);
@@ -839,6 +1027,19 @@ void application::initialize()
 
 	interaction_profile_changed();
 
+	timer.step("actions");
+
+	std::locale::global(locale.get());
+	timer.step("waiting for the translations");
+}
+
+std::locale application::initialize_locale()
+{
+#ifdef __ANDROID__
+	setup_jni();
+#endif
+	utils::step_timer timer("Translations");
+
 	gen.add_messages_domain("wivrn");
 	std::locale loc = gen("");
 
@@ -884,7 +1085,11 @@ void application::initialize()
 
 	loc = std::locale(loc, boost::locale::gnu_gettext::create_messages_facet<char>(messages_info));
 
-	std::locale::global(loc);
+#ifdef __ANDROID__
+	jni::jni_thread::detach();
+#endif
+
+	return loc;
 }
 
 std::pair<XrAction, XrActionType> application::get_action(const std::string & requested_name)
@@ -1022,8 +1227,18 @@ void application::cleanup()
 
 application::~application()
 {
-	auto pipeline_cache_bytes = pipeline_cache.getData();
-	utils::write_whole_file(cache_path / "pipeline_cache", pipeline_cache_bytes);
+#ifdef __ANDROID__
+	wivrn::android::decoder_probe::stop();
+#endif
+	try
+	{
+		if (*pipeline_cache)
+			write_pipeline_cache(cache_path / "pipeline_cache", physical_device_properties, pipeline_cache.getData());
+	}
+	catch (std::exception & e)
+	{
+		spdlog::warn("Cannot save pipeline cache: {}", e.what());
+	}
 
 	cleanup();
 }
@@ -1380,6 +1595,16 @@ void application::poll_events()
 					spdlog::info("    XR_PASSTHROUGH_STATE_CHANGED_RESTORED_ERROR_BIT_FB");
 			}
 			break;
+			case XR_TYPE_EVENT_DATA_PERF_SETTINGS_EXT: {
+				spdlog::info("Performance notification: {} {}, {} -> {}",
+				             xr::to_string(e.perf_settings.domain),
+				             xr::to_string(e.perf_settings.subDomain),
+				             xr::to_string(e.perf_settings.fromLevel),
+				             xr::to_string(e.perf_settings.toLevel));
+				if (std::shared_ptr<scene> s = current_scene())
+					s->on_perf_settings(e.perf_settings);
+			}
+			break;
 			default:
 				spdlog::info("Received event type {}", xr::to_string(e.header.type));
 				break;
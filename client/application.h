@@ -25,6 +25,7 @@
 #include <android_native_app_glue.h>
 #endif
 
+#include "utils/contains.h"
 #include "utils/singleton.h"
 #include "vk/vk_allocator.h"
 #include "xr/xr.h"
@@ -39,6 +40,7 @@
 #include <mutex>
 #include <optional>
 #include <spdlog/spdlog.h>
+#include <string>
 #include <unordered_map>
 #include <unordered_set>
 #include <vulkan/vulkan_raii.hpp>
@@ -83,6 +85,7 @@ class application : public singleton<application>
 	void log_views();
 
 	void initialize();
+	std::locale initialize_locale();
 	void cleanup();
 
 	void poll_events();
@@ -101,6 +104,7 @@ class application : public singleton<application>
 	vk::raii::CommandPool vk_cmdpool = nullptr;
 	vk::raii::PipelineCache pipeline_cache = nullptr;
 	vk::PhysicalDeviceProperties physical_device_properties;
+	std::vector<std::string> vk_device_extensions;
 
 	// Vulkan memory allocator stuff
 	std::optional<vk_allocator> allocator;
@@ -121,8 +125,10 @@ class application : public singleton<application>
 	xr::space left_aim_space;
 	xr::space right_grip_space;
 	xr::space right_aim_space;
+	xr::space eye_gaze_space;
 
 	bool hand_tracking_supported = false;
+	bool eye_gaze_supported = false;
 	xr::hand_tracker left_hand;
 	xr::hand_tracker right_hand;
 
@@ -304,6 +310,11 @@ public:
 	{
 		return instance().right_aim_space;
 	};
+	// Null if the headset has no eye tracking
+	static XrSpace eye_gaze()
+	{
+		return instance().eye_gaze_space;
+	};
 
 	static void ignore_debug_reports_for(void * object)
 	{
@@ -369,6 +380,11 @@ public:
 		return instance().physical_device_properties;
 	}
 
+	static bool vulkan_device_extension_enabled(const std::string & name)
+	{
+		return utils::contains(instance().vk_device_extensions, name);
+	}
+
 	static vk::raii::Device & get_device()
 	{
 		return instance().vk_device;
@@ -19,41 +19,109 @@
 
 #include "asset.h"
 #include "application.h"
-#include "utils/files.h"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
 #include <filesystem>
-#include <fstream>
 #include <spdlog/spdlog.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <unistd.h>
+#include <utility>
 
 #ifdef __ANDROID__
 #include <android/asset_manager.h>
+#endif
 
-asset::asset(const std::filesystem::path & path)
+void asset::map(int fd, off_t offset, size_t size)
 {
-	spdlog::debug("Loading Android asset {}", path.string());
-	android_asset = AAssetManager_open(application::asset_manager(), path.c_str(), AASSET_MODE_BUFFER);
+	if (size == 0)
+		return;
 
-	if (!android_asset)
-		throw std::runtime_error("Cannot open Android asset " + path.string());
+	// mmap offsets must be aligned on a page
+	static const size_t page_size = sysconf(_SC_PAGESIZE);
+	off_t aligned_offset = offset - offset % page_size;
+	size_t delta = offset - aligned_offset;
 
-	bytes = std::span<const std::byte>{reinterpret_cast<const std::byte *>(AAsset_getBuffer(android_asset)), (size_t)AAsset_getLength64(android_asset)};
+	mapping_size = delta + size;
+	mapping = mmap(nullptr, mapping_size, PROT_READ, MAP_PRIVATE, fd, aligned_offset);
+	if (mapping == MAP_FAILED)
+	{
+		mapping = nullptr;
+		throw std::system_error(errno, std::system_category(), "mmap");
+	}
+
+	bytes = std::span<const std::byte>{reinterpret_cast<const std::byte *>(mapping) + delta, size};
+
+	// The rest of the last page is mapped too
+	padding_ = (page_size - mapping_size % page_size) % page_size;
 }
 
 asset::asset(asset && other) :
-        android_asset(other.android_asset)
+#ifdef __ANDROID__
+        android_asset(std::exchange(other.android_asset, nullptr)),
+#endif
+        mapping(std::exchange(other.mapping, nullptr)),
+        mapping_size(std::exchange(other.mapping_size, 0)),
+        padding_(std::exchange(other.padding_, 0)),
+        bytes(std::exchange(other.bytes, {}))
 {
-	other.android_asset = nullptr;
 }
 
 asset & asset::operator=(asset && other)
 {
+#ifdef __ANDROID__
 	std::swap(android_asset, other.android_asset);
+#endif
+	std::swap(mapping, other.mapping);
+	std::swap(mapping_size, other.mapping_size);
+	std::swap(padding_, other.padding_);
+	std::swap(bytes, other.bytes);
 	return *this;
 }
 
 asset::~asset()
 {
+	if (mapping)
+		munmap(mapping, mapping_size);
+
+#ifdef __ANDROID__
 	if (android_asset)
 		AAsset_close(android_asset);
+#endif
+}
+
+#ifdef __ANDROID__
+asset::asset(const std::filesystem::path & path)
+{
+	spdlog::debug("Loading Android asset {}", path.string());
+	android_asset = AAssetManager_open(application::asset_manager(), path.c_str(), AASSET_MODE_STREAMING);
+
+	if (!android_asset)
+		throw std::runtime_error("Cannot open Android asset " + path.string());
+
+	// Uncompressed assets are mapped directly from the APK
+	off64_t start;
+	off64_t length;
+	if (int fd = AAsset_openFileDescriptor64(android_asset, &start, &length); fd >= 0)
+	{
+		try
+		{
+			map(fd, start, length);
+			::close(fd);
+			AAsset_close(android_asset);
+			android_asset = nullptr;
+			return;
+		}
+		catch (std::exception & e)
+		{
+			spdlog::debug("Cannot map asset {}: {}", path.string(), e.what());
+			::close(fd);
+		}
+	}
+
+	bytes = std::span<const std::byte>{reinterpret_cast<const std::byte *>(AAsset_getBuffer(android_asset)), (size_t)AAsset_getLength64(android_asset)};
 }
 
 #else
@@ -98,19 +166,40 @@ asset::asset(const std::filesystem::path & path)
 {
 	assert(path.is_relative());
 
-	// TODO mmap
 	// TODO load only once if it is already loaded
 
 	spdlog::debug("Loading file asset {}", path.string());
 
+	std::filesystem::path full_path;
 	if (path.native().starts_with("locale/"))
+		full_path = locale_root() / path.native().substr(7);
+	else
+		full_path = asset_root() / path;
+
+	int fd = open(full_path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		throw std::system_error(errno, std::system_category(), "Cannot open " + full_path.string());
+
+	struct stat st;
+	if (fstat(fd, &st) < 0)
 	{
-		bytes = utils::read_whole_file<std::byte>(locale_root() / path.native().substr(7));
+		int error = errno;
+		::close(fd);
+		throw std::system_error(error, std::system_category(), "Cannot stat " + full_path.string());
 	}
-	else
+
+	try
+	{
+		map(fd, 0, st.st_size);
+	}
+	catch (...)
 	{
-		bytes = utils::read_whole_file<std::byte>(asset_root() / path);
+		::close(fd);
+		throw;
 	}
+
+	// The mapping stays valid after the file is closed
+	::close(fd);
 }
 
 #endif
@@ -22,35 +22,38 @@
 #include <cstddef>
 #include <filesystem>
 #include <span>
-#include <vector>
+#include <string>
+#include <sys/types.h>
 
 #ifdef __ANDROID__
 struct AAsset;
 #endif
 
+// Read-only view of an asset, memory mapped whenever possible so that the loaders can parse it without a copy
 class asset
 {
 #ifdef __ANDROID__
+	// Only kept open for compressed assets, which cannot be mapped
 	AAsset * android_asset = nullptr;
-	std::span<const std::byte> bytes;
 #else
 	static std::filesystem::path asset_root();
 	static std::filesystem::path locale_root();
-	std::vector<std::byte> bytes;
 #endif
+	void * mapping = nullptr;
+	size_t mapping_size = 0;
+	size_t padding_ = 0;
+
+	std::span<const std::byte> bytes;
+
+	void map(int fd, off_t offset, size_t size);
 
 public:
 	asset() = default;
 	asset(const std::filesystem::path & path);
 
-#ifdef __ANDROID__
 	asset(asset && other);
 	asset & operator=(asset && other);
 	~asset();
-#else
-	asset(asset && other) = default;
-	asset & operator=(asset && other) = default;
-#endif
 
 	asset(const asset &) = delete;
 	asset & operator=(const asset &) = delete;
@@ -65,6 +68,12 @@ public:
 		return bytes.size();
 	}
 
+	// Number of readable bytes after the end of the data, parsers which need some padding can skip their copy
+	size_t padding() const
+	{
+		return padding_;
+	}
+
 	operator std::span<const std::byte>() const
 	{
 		return bytes;
@@ -23,6 +23,63 @@
 
 #include "spdlog/spdlog.h"
 #include <aaudio/AAudio.h>
+#include <algorithm>
+#include <ctime>
+#include <span>
+
+namespace
+{
+// Jitter buffer depth, in ms
+const double min_buffer = 20;
+const double max_buffer = 150;
+// Samples later than the target latency by more than this are dropped, in ms
+const double max_excess = 100;
+// The latency target jumps when it must increase by more than this, in ms, otherwise it changes with this time constant, in s
+const double latency_step = 5;
+const double latency_time_constant = 10;
+// Added to the target after an underrun, in ms, and removed over time, in ms/s
+const double underrun_step = 10;
+const double margin_decay = 1;
+// Playback speed change per ms of latency error, and its limit
+const double correction_rate = 0.0005;
+const double max_correction = 0.01;
+// Clock drift measurement window and limit
+const XrDuration drift_min_window = 10'000'000'000;
+const XrDuration drift_max_window = 300'000'000'000;
+const XrDuration drift_max_gap = 1'000'000'000;
+const double max_drift = 0.005;
+// The output buffer starts with this many bursts, grows by a burst after each underrun of the
+// stream and shrinks by a burst after this duration without underruns
+const int32_t min_output_bursts = 2;
+const int64_t output_shrink_interval = 60'000'000'000;
+// Microphone samples are voice when louder than the noise floor by this ratio (10dB) and than
+// the absolute threshold (-60dBFS), transmission stops after this duration without voice
+const double voice_noise_ratio = 10;
+const double voice_min_power = 1e-6;
+const XrDuration voice_hangover = 500'000'000;
+// Relative noise floor increase per callback when it is below the signal, it drops immediately
+const double noise_floor_rise = 0.0002;
+
+void log_stream(const char * name, AAudioStream * stream)
+{
+	spdlog::info("{} stream: {}Hz, {} channels, {} sharing, {} performance mode, {} frames per burst, buffer {}/{} frames",
+	             name,
+	             AAudioStream_getSampleRate(stream),
+	             AAudioStream_getChannelCount(stream),
+	             AAudioStream_getSharingMode(stream) == AAUDIO_SHARING_MODE_EXCLUSIVE ? "exclusive" : "shared",
+	             AAudioStream_getPerformanceMode(stream) == AAUDIO_PERFORMANCE_MODE_LOW_LATENCY ? "low latency" : "default",
+	             AAudioStream_getFramesPerBurst(stream),
+	             AAudioStream_getBufferSizeInFrames(stream),
+	             AAudioStream_getBufferCapacityInFrames(stream));
+}
+
+int64_t monotonic_now()
+{
+	timespec now_ts;
+	clock_gettime(CLOCK_MONOTONIC, &now_ts);
+	return now_ts.tv_sec * 1'000'000'000ll + now_ts.tv_nsec;
+}
+} // namespace
 
 void wivrn::android::audio::exit()
 {
@@ -42,7 +99,6 @@ void wivrn::android::audio::exit()
 int32_t wivrn::android::audio::speaker_data_cb(AAudioStream * stream, void * userdata, void * audio_data_v, int32_t num_frames)
 {
 	auto self = (wivrn::android::audio *)userdata;
-	uint8_t * audio_data = (uint8_t *)audio_data_v;
 
 	if (self->exiting)
 	{
@@ -51,61 +107,160 @@ int32_t wivrn::android::audio::speaker_data_cb(AAudioStream * stream, void * use
 		return AAUDIO_CALLBACK_RESULT_STOP;
 	}
 
-	size_t frame_size = AAudioStream_getChannelCount(stream) * sizeof(uint16_t);
+	const int num_channels = AAudioStream_getChannelCount(stream);
+	const double sample_rate = AAudioStream_getSampleRate(stream);
+	auto & jb = self->speaker_jitter;
+	int16_t * output = (int16_t *)audio_data_v;
 
-	while (num_frames != 0)
+	// Duration of a server sample in the headset clock, in ns
+	const double drift = self->speaker_drift;
+	const double sample_ns = 1e9 / (sample_rate * drift);
+
+	while (auto packet = self->output_buffer.read())
 	{
-		// remaining bytes in existing buffer
-		ptrdiff_t tmp_remain = self->speaker_tmp.payload.size_bytes();
-		// limit to requested frames
-		tmp_remain = std::min<ptrdiff_t>(tmp_remain, num_frames * frame_size);
-		if (tmp_remain)
-		{
-			memcpy(audio_data, self->speaker_tmp.payload.data(), tmp_remain);
-			self->speaker_tmp.payload = self->speaker_tmp.payload.subspan(tmp_remain);
-			audio_data += tmp_remain;
-			num_frames -= tmp_remain / frame_size;
-			self->buffer_size_bytes.fetch_sub(tmp_remain);
-		}
+		// Timestamp of the first buffered sample according to this packet, smoothed to ignore the arrival jitter
+		double head = packet->timestamp - jb.samples.available() * sample_ns;
+		if (jb.head_timestamp and jb.samples.available() >= 1)
+			*jb.head_timestamp += (head - *jb.head_timestamp) / 16;
 		else
+			jb.head_timestamp = head;
+		jb.samples.push(std::span((const int16_t *)packet->payload.data(), packet->payload.size() / sizeof(int16_t)));
+	}
+
+	int64_t now = monotonic_now();
+
+	// Keep the output buffer as small as the underruns allow
+	auto & tuning = self->speaker_tuning;
+	int32_t xruns = AAudioStream_getXRunCount(stream);
+	int32_t burst = AAudioStream_getFramesPerBurst(stream);
+	int32_t size = AAudioStream_getBufferSizeInFrames(stream);
+	int32_t new_size = size;
+	if (xruns > tuning.xruns)
+	{
+		self->stats.xruns += xruns - tuning.xruns;
+		new_size = std::min(size + burst, AAudioStream_getBufferCapacityInFrames(stream));
+		tuning.last_change = now;
+	}
+	else if (size > min_output_bursts * burst and now - tuning.last_change > output_shrink_interval)
+	{
+		new_size = size - burst;
+		tuning.last_change = now;
+	}
+	tuning.xruns = std::max(tuning.xruns, xruns);
+	if (new_size != size)
+	{
+		// Returns the actual size, or a negative error
+		if (int32_t result = AAudioStream_setBufferSizeInFrames(stream, new_size); result > 0)
+			size = result;
+	}
+
+	// When the first frame of this callback will be played, in the XR display clock
+	int64_t position;
+	int64_t position_time;
+	double present;
+	if (AAudioStream_getTimestamp(stream, CLOCK_MONOTONIC, &position, &position_time) == AAUDIO_OK)
+		present = position_time + (AAudioStream_getFramesWritten(stream) - position) * 1e9 / sample_rate;
+	else
+		present = now + size * 1e9 / sample_rate;
+	const double output_latency = std::max(0., present - now) * 1e-6;
+	present += self->monotonic_to_xr;
+
+	// Keep enough samples to absorb the arrival jitter, with a margin raised after each underrun
+	double jitter = self->jitter_ns * 1e-6;
+	double depth = std::clamp(min_buffer + 4 * jitter + jb.underrun_margin, min_buffer, max_buffer);
+	jb.underrun_margin = std::max(0., jb.underrun_margin - margin_decay * num_frames / sample_rate);
+
+	// The latency only follows the network slowly so that the audio does not move relative to the video,
+	// except when it must increase to avoid underruns
+	double transit = self->transit_ns * 1e-6;
+	double min_latency = transit + output_latency + min_buffer;
+	double wanted = transit + output_latency + depth;
+	if (not jb.latency_target or wanted > *jb.latency_target + latency_step)
+		jb.latency_target = wanted;
+	else
+		*jb.latency_target += (wanted - *jb.latency_target) * std::min(1., num_frames / (sample_rate * latency_time_constant));
+	double target = std::max(*jb.latency_target + self->speaker_offset, min_latency);
+
+	auto drop = [&](double ms) {
+		size_t frames = std::min<size_t>(ms * 1e6 / sample_ns, jb.samples.available());
+		jb.samples.drop(frames);
+		*jb.head_timestamp += frames * sample_ns;
+	};
+
+	// How late the next sample is compared to its schedule, in ms
+	auto late = [&]() { return jb.head_timestamp ? (present - *jb.head_timestamp) * 1e-6 - target : 0; };
+
+	// After a burst, drop the excess instead of keeping the latency
+	if (not jb.starving and late() > max_excess)
+	{
+		spdlog::info("Audio sync: discard {:.0f}ms (target latency {:.0f}ms)", late(), target);
+		drop(late());
+		self->stats.overruns++;
+	}
+
+	// Output silence until the next sample is due, and start exactly on time
+	size_t start = 0;
+	if (jb.starving and jb.head_timestamp and jb.samples.available() >= 1)
+	{
+		double wait = -late() * sample_rate / 1000;
+		if (wait < num_frames)
 		{
-			if (auto tmp = self->output_buffer.read())
-			{
-				self->speaker_tmp = std::move(*tmp);
-			}
+			jb.starving = false;
+			if (wait > 0)
+				start = wait;
 			else
-			{
-				// Buffer underrun: add 5ms buffer
-				size_t target_buffer_size = frame_size * AAudioStream_getSampleRate(stream) * 0.005;
-				self->speaker_tmp.data.c.clear();
-				self->speaker_tmp.data.c.resize(target_buffer_size, 0);
-				self->speaker_tmp.payload = self->speaker_tmp.data.c;
-				self->buffer_size_bytes += target_buffer_size;
-			}
+				drop(-wait * 1000 / sample_rate);
 		}
 	}
 
-	// If we have more than 80ms of buffered data, discard some data
-	if (self->buffer_size_bytes > frame_size * AAudioStream_getSampleRate(stream) * 0.08)
+	// Follow the server clock, and play up to 1% faster or slower to converge to the target latency
+	double ratio = drift * (1 + std::clamp(late() * correction_rate, -max_correction, max_correction));
+
+	size_t frames = start;
+	if (not jb.starving)
 	{
-		// discard excess data until we only have 60ms left
-		size_t target_buffer_size = frame_size * AAudioStream_getSampleRate(stream) * 0.06;
-		while (self->buffer_size_bytes > target_buffer_size and self->output_buffer.size() > 1)
+		size_t played = jb.samples.read(std::span(output + start * num_channels, (num_frames - start) * num_channels), ratio);
+		*jb.head_timestamp += played * ratio * sample_ns;
+		frames += played;
+		if (frames < size_t(num_frames))
 		{
-			auto tmp = self->output_buffer.read();
-			if (not tmp)
-				break;
-			auto prev = self->buffer_size_bytes.fetch_sub(tmp->payload.size_bytes());
-			spdlog::info("Audio sync: discard {} bytes (buffer {} target {})",
-			             tmp->payload.size_bytes(),
-			             prev,
-			             target_buffer_size);
+			jb.starving = true;
+			jb.underrun_margin = std::min(jb.underrun_margin + underrun_step, max_buffer);
+			self->stats.underruns++;
 		}
 	}
+	std::fill(output, output + start * num_channels, 0);
+	std::fill(output + frames * num_channels, output + num_frames * num_channels, 0);
+
+	self->stats.latency = late() + target;
+	self->stats.target = target;
+	self->stats.buffer = jb.samples.available() * 1000 / sample_rate;
+	self->stats.jitter = jitter;
+	self->stats.drift = (drift - 1) * 1e6;
+	self->stats.output_latency = output_latency;
+	self->stats.output_buffer = size * 1000 / sample_rate;
 
 	return AAUDIO_CALLBACK_RESULT_CONTINUE;
 }
 
+bool wivrn::android::audio::voice_detector::update(std::span<const int16_t> samples, XrTime timestamp)
+{
+	if (samples.empty())
+		return active;
+
+	double power = 0;
+	for (int16_t sample: samples)
+		power += double(sample) * sample;
+	power /= samples.size() * 32768. * 32768.;
+
+	noise_floor = std::clamp(std::min(power, noise_floor * (1 + noise_floor_rise)), 1e-9, 1.);
+	if (power > noise_floor * voice_noise_ratio and power > voice_min_power)
+		last_voice = timestamp;
+
+	active = timestamp - last_voice < voice_hangover;
+	return active;
+}
+
 int32_t wivrn::android::audio::microphone_data_cb(AAudioStream * stream, void * userdata, void * audio_data_v, int32_t num_frames)
 {
 	auto self = (wivrn::android::audio *)userdata;
@@ -120,14 +275,56 @@ int32_t wivrn::android::audio::microphone_data_cb(AAudioStream * stream, void *
 
 	size_t frame_size = AAudioStream_getChannelCount(stream) * sizeof(uint16_t);
 
-	xrt::drivers::wivrn::audio_data packet{
-	        .timestamp = self->instance.now(),
-	        .payload = std::span(audio_data, frame_size * num_frames),
-	};
+	// Time of the end of the samples, from when they were captured rather than when they are delivered
+	XrTime timestamp = self->instance.now();
+	int64_t position;
+	int64_t position_time;
+	if (AAudioStream_getTimestamp(stream, CLOCK_MONOTONIC, &position, &position_time) == AAUDIO_OK)
+	{
+		int64_t captured = position_time + (AAudioStream_getFramesRead(stream) + num_frames - position) * 1'000'000'000 / AAudioStream_getSampleRate(stream);
+		int64_t latency = monotonic_now() - captured;
+		if (latency > 0 and latency < 1'000'000'000)
+		{
+			timestamp -= latency;
+			self->stats.microphone_latency = latency * 1e-6;
+		}
+	}
 
 	try
 	{
-		self->session.send_control(packet);
+		auto samples = std::span((const int16_t *)audio_data, num_frames * AAudioStream_getChannelCount(stream));
+		// Discontinuous transmission: the server fills the silence
+		if (self->microphone_vad)
+		{
+			bool was_active = self->microphone_vad->active;
+			if (not self->microphone_vad->update(samples, timestamp))
+			{
+				if (was_active)
+				{
+					if (self->microphone_encoder)
+						self->microphone_encoder->pause(timestamp, [&](xrt::drivers::wivrn::audio_data && packet) { self->session.send_stream(packet); });
+					else
+						self->session.send_control(xrt::drivers::wivrn::audio_data{.timestamp = timestamp});
+				}
+				return AAUDIO_CALLBACK_RESULT_CONTINUE;
+			}
+		}
+
+		if (self->microphone_encoder)
+		{
+			self->microphone_encoder->encode(
+			        samples,
+			        timestamp,
+			        [&](xrt::drivers::wivrn::audio_data && packet) { self->session.send_stream(packet); });
+		}
+		else
+		{
+			xrt::drivers::wivrn::audio_data packet{
+			        .timestamp = timestamp,
+			        .payload = std::span(audio_data, frame_size * num_frames),
+			};
+			self->session.send_control(packet);
+		}
 	}
 	catch (...)
 	{
@@ -139,14 +336,28 @@ int32_t wivrn::android::audio::microphone_data_cb(AAudioStream * stream, void *
 	return AAUDIO_CALLBACK_RESULT_CONTINUE;
 }
 
-wivrn::android::audio::audio(const xrt::drivers::wivrn::to_headset::audio_stream_description & desc, wivrn_session & session, xr::instance & instance) :
-        session(session), instance(instance)
+wivrn::android::audio::audio(const xrt::drivers::wivrn::to_headset::audio_stream_description & desc, wivrn_session & session, xr::instance & instance, audio_statistics & stats) :
+        stats(stats), session(session), instance(instance)
 {
 	AAudioStreamBuilder * builder;
 	aaudio_result_t result = AAudio_createStreamBuilder(&builder);
 	if (result != AAUDIO_OK)
 		throw std::runtime_error(std::string("Cannot create stream builder: ") + AAudio_convertResultToText(result));
 
+	if (desc.microphone and desc.microphone->codec == xrt::drivers::wivrn::audio_codec::opus)
+		microphone_encoder.emplace(*desc.microphone, OPUS_APPLICATION_VOIP);
+	if (desc.microphone and session.has_capability(xrt::drivers::wivrn::capability::microphone_dtx))
+		microphone_vad.emplace();
+	if (desc.speaker and desc.speaker->codec == xrt::drivers::wivrn::audio_codec::opus)
+		speaker_decoder.emplace(*desc.speaker);
+	if (desc.speaker)
+	{
+		speaker_jitter.samples = utils::resampler(desc.speaker->num_channels);
+		speaker_num_channels = desc.speaker->num_channels;
+		speaker_sample_rate = desc.speaker->sample_rate;
+		speaker_offset = desc.speaker->offset * 1e-6;
+	}
+
 	if (desc.microphone)
 	{
 		AAudioStreamBuilder_setDirection(builder, AAUDIO_DIRECTION_INPUT);
@@ -155,19 +366,25 @@ wivrn::android::audio::audio(const xrt::drivers::wivrn::to_headset::audio_stream
 		AAudioStreamBuilder_setPerformanceMode(builder, AAUDIO_PERFORMANCE_MODE_LOW_LATENCY);
 		AAudioStreamBuilder_setSharingMode(builder, AAUDIO_SHARING_MODE_EXCLUSIVE);
 		AAudioStreamBuilder_setFormat(builder, AAUDIO_FORMAT_PCM_I16);
+		// Voice processing disables the low latency (MMAP) path, voice performance keeps it
+		AAudioStreamBuilder_setInputPreset(builder, AAUDIO_INPUT_PRESET_VOICE_PERFORMANCE);
 
 		AAudioStreamBuilder_setDataCallback(builder, &microphone_data_cb, this);
 
 		result = AAudioStreamBuilder_openStream(builder, &microphone);
 		if (result != AAUDIO_OK)
+		{
+			microphone = nullptr;
 			spdlog::error("Cannot create input stream: {}", AAudio_convertResultToText(result));
-
-		result = AAudioStream_requestStart(microphone);
-		if (result == AAUDIO_OK)
-			spdlog::info("Microphone stream started");
+		}
+		else if (result = AAudioStream_requestStart(microphone); result == AAUDIO_OK)
+		{
+			log_stream("Microphone", microphone);
+		}
 		else
 		{
 			AAudioStream_close(microphone);
+			microphone = nullptr;
 			spdlog::warn("Microphone stream failed to start: {}", AAudio_convertResultToText(result));
 		}
 	}
@@ -185,15 +402,24 @@ wivrn::android::audio::audio(const xrt::drivers::wivrn::to_headset::audio_stream
 
 		result = AAudioStreamBuilder_openStream(builder, &speaker);
 		if (result != AAUDIO_OK)
+		{
+			speaker = nullptr;
 			spdlog::error("Cannot create output stream: {}", AAudio_convertResultToText(result));
-
-		AAudioStream_requestStart(speaker);
-		if (result == AAUDIO_OK)
-			spdlog::info("Speaker stream started");
+		}
 		else
 		{
-			AAudioStream_close(speaker);
-			spdlog::warn("Speaker stream failed to start: {}", AAudio_convertResultToText(result));
+			// The default size is often the whole capacity, the callback grows it after underruns
+			AAudioStream_setBufferSizeInFrames(speaker, min_output_bursts * AAudioStream_getFramesPerBurst(speaker));
+			speaker_tuning.last_change = monotonic_now();
+
+			if (result = AAudioStream_requestStart(speaker); result == AAUDIO_OK)
+				log_stream("Speaker", speaker);
+			else
+			{
+				AAudioStream_close(speaker);
+				speaker = nullptr;
+				spdlog::warn("Speaker stream failed to start: {}", AAudio_convertResultToText(result));
+			}
 		}
 	}
 	AAudioStreamBuilder_delete(builder);
@@ -212,7 +438,49 @@ wivrn::android::audio::~audio()
 
 void wivrn::android::audio::operator()(xrt::drivers::wivrn::audio_data && data)
 {
-	buffer_size_bytes.fetch_add(data.payload.size_bytes());
+	// Both clocks are the headset clock: variations of the transit time are the network jitter
+	int64_t transit = instance.now() - data.timestamp;
+	if (last_transit)
+	{
+		jitter_ns = jitter_ns + (std::abs(transit - *last_transit) - jitter_ns) / 16;
+		transit_ns = transit_ns + (transit - transit_ns) / 64;
+	}
+	else
+		transit_ns = transit;
+	last_transit = transit;
+
+	monotonic_to_xr = instance.now() - monotonic_now();
+
+	// Restart the measurement after a discontinuity, and regularly to follow changes.
+	// Reordered packets only move the estimate by a few packets over the whole window.
+	auto & clock = speaker_clock;
+	if (std::abs(data.timestamp - clock.last_timestamp) > drift_max_gap or
+	    data.timestamp - clock.first_timestamp > drift_max_window)
+	{
+		clock.first_timestamp = data.timestamp;
+		clock.last_timestamp = data.timestamp;
+		clock.frames = 0;
+	}
+	clock.last_timestamp = std::max(clock.last_timestamp, data.timestamp);
+	if (clock.last_timestamp - clock.first_timestamp > drift_min_window)
+	{
+		double duration = (data.timestamp - clock.first_timestamp) * 1e-9;
+		speaker_drift = std::clamp(clock.frames / (duration * speaker_sample_rate), 1 - max_drift, 1 + max_drift);
+	}
+
+	if (speaker_decoder)
+	{
+		speaker_decoder->decode(data, [&](std::span<const int16_t> samples) {
+			clock.frames += samples.size() / speaker_num_channels;
+			xrt::drivers::wivrn::audio_data pcm{.timestamp = data.timestamp};
+			auto bytes = std::as_bytes(samples);
+			pcm.data.c.assign((const uint8_t *)bytes.data(), (const uint8_t *)bytes.data() + bytes.size());
+			pcm.payload = pcm.data.c;
+			output_buffer.write(std::move(pcm));
+		});
+		return;
+	}
+	clock.frames += data.payload.size() / (speaker_num_channels * sizeof(int16_t));
 	output_buffer.write(std::move(data));
 }
 
@@ -232,7 +500,9 @@ void wivrn::android::audio::get_audio_description(xrt::drivers::wivrn::from_head
 	{
 		info.speaker = {
 		        .num_channels = (uint8_t)AAudioStream_getChannelCount(stream),
-		        .sample_rate = (uint32_t)AAudioStream_getSampleRate(stream)};
+		        .sample_rate = (uint32_t)AAudioStream_getSampleRate(stream),
+		        .codecs = {xrt::drivers::wivrn::audio_codec::opus},
+		};
 
 		AAudioStream_close(stream);
 	}
@@ -245,6 +515,7 @@ void wivrn::android::audio::get_audio_description(xrt::drivers::wivrn::from_head
 		info.microphone = {
 		        .num_channels = 1, // Some headsets report 2 channels but then fail
 		        .sample_rate = (uint32_t)AAudioStream_getSampleRate(stream),
+		        .codecs = {xrt::drivers::wivrn::audio_codec::opus},
 		};
 
 		AAudioStream_close(stream);
@@ -19,9 +19,15 @@
 
 #pragma once
 
+#include "../audio_statistics.h"
+#include "opus_codec.h"
+#include "utils/resampler.h"
 #include "utils/ring_buffer.h"
 #include "wivrn_packets.h"
 #include <atomic>
+#include <optional>
+#include <span>
+#include <vector>
 
 struct AAudioStreamStruct;
 class wivrn_session;
@@ -39,9 +45,74 @@ class audio
 	static int32_t microphone_data_cb(AAudioStreamStruct *, void *, void *, int32_t);
 
 	utils::ring_buffer<xrt::drivers::wivrn::audio_data, 100> output_buffer;
-	std::atomic<size_t> buffer_size_bytes;
 
-	xrt::drivers::wivrn::audio_data speaker_tmp;
+	// Jitter buffer, only used by the speaker callback
+	struct jitter_buffer
+	{
+		// Samples not played yet
+		utils::resampler samples{1};
+		// Extra depth added after underruns, in ms
+		double underrun_margin = 0;
+		// Waiting for the next sample to be due before playing
+		bool starving = true;
+		// Server timestamp of the next sample to play, estimated from the packet timestamps
+		std::optional<double> head_timestamp;
+		// Latency before the offset, follows the network and output latency slowly to keep audio and video in sync, in ms
+		std::optional<double> latency_target;
+	} speaker_jitter;
+
+	// Arrival jitter estimation (RFC 3550), updated by the network thread
+	std::optional<int64_t> last_transit;
+	std::atomic<double> jitter_ns = 0;
+	// Average transit time, updated by the network thread
+	std::atomic<double> transit_ns = 0;
+	// XrTime minus CLOCK_MONOTONIC, to convert the AAudio timestamps, updated by the network thread
+	std::atomic<XrDuration> monotonic_to_xr = 0;
+	// Requested by the server, added to the latency target, in ms
+	double speaker_offset = 0;
+
+	// Sample clock of the server relative to the headset clock, updated by the network thread.
+	// Measured with the packet timestamps, which the server converts to the headset clock with the clock offset slope.
+	struct drift_estimator
+	{
+		XrTime first_timestamp = 0;
+		XrTime last_timestamp = 0;
+		// Frames received since first_timestamp
+		uint64_t frames = 0;
+	} speaker_clock;
+	std::atomic<double> speaker_drift = 1;
+
+	// Output buffer size tuning, only used by the speaker callback
+	struct output_tuning
+	{
+		int32_t xruns = 0;
+		// CLOCK_MONOTONIC time of the last underrun or size change
+		int64_t last_change = 0;
+	} speaker_tuning;
+	int speaker_num_channels = 1;
+	double speaker_sample_rate = 48000;
+
+	audio_statistics & stats;
+
+	// Only used by the network thread
+	std::optional<xrt::drivers::wivrn::opus_decoder> speaker_decoder;
+	// Only used by the microphone callback
+	std::optional<xrt::drivers::wivrn::opus_encoder> microphone_encoder;
+
+	// Voice activity detection, only used by the microphone callback when the server supports silence markers
+	struct voice_detector
+	{
+		// Mean square of the background noise, relative to full scale
+		double noise_floor = 1e-4;
+		// Time of the last samples with voice
+		XrTime last_voice = 0;
+		// Samples are sent
+		bool active = true;
+
+		// Returns true if the samples must be sent
+		bool update(std::span<const int16_t> samples, XrTime timestamp);
+	};
+	std::optional<voice_detector> microphone_vad;
 	AAudioStreamStruct * speaker = nullptr;
 	std::atomic<bool> speaker_stop_ack = false;
 	AAudioStreamStruct * microphone = nullptr;
@@ -57,7 +128,7 @@ class audio
 public:
 	audio(const audio &) = delete;
 	audio & operator=(const audio &) = delete;
-	audio(const xrt::drivers::wivrn::to_headset::audio_stream_description &, wivrn_session &, xr::instance &);
+	audio(const xrt::drivers::wivrn::to_headset::audio_stream_description &, wivrn_session &, xr::instance &, audio_statistics &);
 	~audio();
 
 	void operator()(xrt::drivers::wivrn::audio_data &&);
@@ -19,6 +19,7 @@
 
 #pragma once
 
+#include "audio_statistics.h"
 #include "wivrn_client.h"
 #include "wivrn_packets.h"
 #include "xr/instance.h"
@@ -33,7 +34,7 @@ class audio
 public:
 	audio(const audio &) = delete;
 	audio & operator=(const audio &) = delete;
-	audio(const xrt::drivers::wivrn::to_headset::audio_stream_description &, wivrn_session &, xr::instance &) {}
+	audio(const xrt::drivers::wivrn::to_headset::audio_stream_description &, wivrn_session &, xr::instance &, audio_statistics &) {}
 	~audio() = default;
 
 	void operator()(xrt::drivers::wivrn::audio_data &&) {}
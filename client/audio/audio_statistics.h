@@ -0,0 +1,50 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+// Speaker jitter buffer state, written by the audio callback and read by the stats overlay
+struct audio_statistics
+{
+	// Times the buffer was empty while playing
+	std::atomic<uint32_t> underruns = 0;
+	// Times samples were dropped because the buffer was too long
+	std::atomic<uint32_t> overruns = 0;
+	// Time between the server timestamp of the samples and when they are played, and its target, in ms.
+	// Timestamps are on the display timeline, this is the audio delay relative to the video.
+	std::atomic<float> latency = 0;
+	std::atomic<float> target = 0;
+	// Buffered duration, in ms
+	std::atomic<float> buffer = 0;
+	// Arrival jitter of the packets, in ms
+	std::atomic<float> jitter = 0;
+	// Server sample clock relative to the headset clock, in ppm
+	std::atomic<float> drift = 0;
+	// Latency of the output stream alone, and buffer size it was tuned to, in ms
+	std::atomic<float> output_latency = 0;
+	std::atomic<float> output_buffer = 0;
+	// Underruns of the output stream reported by the system
+	std::atomic<uint32_t> xruns = 0;
+	// Time between the capture of the microphone samples and the callback, in ms
+	std::atomic<float> microphone_latency = 0;
+};
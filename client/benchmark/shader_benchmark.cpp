@@ -0,0 +1,689 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Runs the reprojection of the stream, which samples the decoded images, undoes the foveation and
+// writes the views in a single pass, on synthetic YCbCr images without a headset or a server.
+// The GPU time of each configuration is measured with timestamp queries and printed as one json
+// object per line.
+
+#include "scenes/stream_reprojection.h"
+#include "vk/allocation.h"
+#include "vk/vk_allocator.h"
+#include "wivrn_packets.h"
+
+#include <CLI/CLI.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <numeric>
+#include <optional>
+#include <string>
+#include <vector>
+
+using namespace xrt::drivers::wivrn;
+
+namespace
+{
+using foveation_item = to_headset::video_stream_description::foveation_parameter_item;
+
+// Same parameters as the server for a view whose projection centre is at c, see wivrn_hmd.cpp
+foveation_item make_foveation(double scale, double c)
+{
+	foveation_item result{.center = c, .scale = scale};
+	if (scale >= 1)
+		return result;
+
+	// foveate(-1) = -1 and foveate(1) = 1, eq is positive then decreases to -∞
+	auto eq = [&](double a) { return atan(a * (1 - c) / scale) + atan(a * (1 + c) / scale) - 2 * a; };
+	double a0 = 0;
+	double a1 = 1;
+	while (eq(a1) > 0)
+		a1 *= 2;
+	for (int n = 0; n < 100 and a1 - a0 > 1e-7; ++n)
+	{
+		double a = (a0 + a1) / 2;
+		(eq(a) > 0 ? a0 : a1) = a;
+	}
+
+	result.a = (a0 + a1) / 2;
+	result.b = atan(result.a * (1 - c) / scale) - result.a;
+	return result;
+}
+
+struct configuration
+{
+	// Size of the stream, with the views side by side
+	uint32_t width;
+	uint32_t height;
+	double scale_x;
+	double scale_y;
+	double center_x;
+	double center_y;
+	// The stream is split in horizontal bands, one per decoder
+	uint32_t decoders;
+	uint32_t iterations;
+	uint32_t warmup;
+	bool density_map;
+};
+
+struct distribution
+{
+	double mean;
+	double min;
+	double p50;
+	double p90;
+	double p99;
+	double max;
+};
+
+distribution make_distribution(std::vector<double> values)
+{
+	if (values.empty())
+		return {};
+	std::ranges::sort(values);
+	auto percentile = [&](double p) {
+		return values[std::min<size_t>(values.size() * p, values.size() - 1)];
+	};
+	return {
+	        .mean = std::accumulate(values.begin(), values.end(), 0.) / values.size(),
+	        .min = values.front(),
+	        .p50 = percentile(0.5),
+	        .p90 = percentile(0.9),
+	        .p99 = percentile(0.99),
+	        .max = values.back(),
+	};
+}
+
+// Decoded image of one decoder, in the format of the hardware decoders
+class ycbcr_image
+{
+	image_allocation image;
+	vk::raii::SamplerYcbcrConversion conversion = nullptr;
+	vk::raii::ImageView view = nullptr;
+
+public:
+	static constexpr vk::Format format = vk::Format::eG8B8R82Plane420Unorm;
+
+	vk::raii::Sampler sampler = nullptr;
+	vk::Extent2D extent;
+
+	ycbcr_image(vk::raii::Device & device, vk::raii::PhysicalDevice & physical_device, vk::Extent2D extent) :
+	        extent(extent)
+	{
+		vk::FormatFeatureFlags features = physical_device.getFormatProperties(format).optimalTilingFeatures;
+		if (not(features & vk::FormatFeatureFlagBits::eSampledImage))
+			throw std::runtime_error("NV12 images cannot be sampled");
+
+		vk::Filter filter = features & vk::FormatFeatureFlagBits::eSampledImageYcbcrConversionLinearFilter ? vk::Filter::eLinear : vk::Filter::eNearest;
+
+		conversion = vk::raii::SamplerYcbcrConversion(
+		        device,
+		        vk::SamplerYcbcrConversionCreateInfo{
+		                .format = format,
+		                .ycbcrModel = vk::SamplerYcbcrModelConversion::eYcbcr709,
+		                .ycbcrRange = vk::SamplerYcbcrRange::eItuNarrow,
+		                .xChromaOffset = features & vk::FormatFeatureFlagBits::eCositedChromaSamples ? vk::ChromaLocation::eCositedEven : vk::ChromaLocation::eMidpoint,
+		                .yChromaOffset = vk::ChromaLocation::eMidpoint,
+		                .chromaFilter = filter,
+		        });
+
+		vk::SamplerYcbcrConversionInfo conversion_info{
+		        .conversion = *conversion,
+		};
+
+		sampler = vk::raii::Sampler(
+		        device,
+		        vk::SamplerCreateInfo{
+		                .pNext = &conversion_info,
+		                .magFilter = filter,
+		                .minFilter = filter,
+		                .mipmapMode = vk::SamplerMipmapMode::eNearest,
+		                .addressModeU = vk::SamplerAddressMode::eClampToEdge,
+		                .addressModeV = vk::SamplerAddressMode::eClampToEdge,
+		                .addressModeW = vk::SamplerAddressMode::eClampToEdge,
+		                .borderColor = vk::BorderColor::eFloatOpaqueWhite,
+		        });
+
+		image = image_allocation(
+		        device,
+		        vk::ImageCreateInfo{
+		                .imageType = vk::ImageType::e2D,
+		                .format = format,
+		                .extent = {extent.width, extent.height, 1},
+		                .mipLevels = 1,
+		                .arrayLayers = 1,
+		                .samples = vk::SampleCountFlagBits::e1,
+		                .tiling = vk::ImageTiling::eOptimal,
+		                .usage = vk::ImageUsageFlagBits::eSampled | vk::ImageUsageFlagBits::eTransferDst,
+		                .sharingMode = vk::SharingMode::eExclusive,
+		                .initialLayout = vk::ImageLayout::eUndefined,
+		        },
+		        VmaAllocationCreateInfo{
+		                .usage = VMA_MEMORY_USAGE_AUTO,
+		        });
+
+		view = vk::raii::ImageView(
+		        device,
+		        vk::ImageViewCreateInfo{
+		                .pNext = &conversion_info,
+		                .image = image,
+		                .viewType = vk::ImageViewType::e2D,
+		                .format = format,
+		                .subresourceRange = {
+		                        .aspectMask = vk::ImageAspectFlagBits::eColor,
+		                        .levelCount = 1,
+		                        .layerCount = 1,
+		                },
+		        });
+	}
+
+	vk::ImageView image_view() const
+	{
+		return *view;
+	}
+
+	// Fills the planes with a pattern that has details at every scale, so that
+	// the texture cache behaves as with a real picture
+	void upload(vk::raii::CommandBuffer & cmd, buffer_allocation & staging, size_t offset)
+	{
+		uint8_t * luma = staging.data<uint8_t>() + offset;
+		for (uint32_t y = 0; y < extent.height; ++y)
+			for (uint32_t x = 0; x < extent.width; ++x)
+				*luma++ = 16 + ((x ^ y) + x * y / 64) % 220;
+
+		uint8_t * chroma = luma;
+		for (uint32_t y = 0; y < extent.height / 2; ++y)
+			for (uint32_t x = 0; x < extent.width / 2; ++x)
+			{
+				*chroma++ = 16 + 224 * x / extent.width;
+				*chroma++ = 16 + 224 * y / extent.height;
+			}
+
+		vk::ImageSubresourceRange range{
+		        .aspectMask = vk::ImageAspectFlagBits::eColor,
+		        .levelCount = 1,
+		        .layerCount = 1,
+		};
+
+		cmd.pipelineBarrier(
+		        vk::PipelineStageFlagBits::eTopOfPipe,
+		        vk::PipelineStageFlagBits::eTransfer,
+		        {},
+		        {},
+		        {},
+		        vk::ImageMemoryBarrier{
+		                .dstAccessMask = vk::AccessFlagBits::eTransferWrite,
+		                .oldLayout = vk::ImageLayout::eUndefined,
+		                .newLayout = vk::ImageLayout::eTransferDstOptimal,
+		                .image = image,
+		                .subresourceRange = range,
+		        });
+
+		cmd.copyBufferToImage(
+		        staging,
+		        image,
+		        vk::ImageLayout::eTransferDstOptimal,
+		        {
+		                vk::BufferImageCopy{
+		                        .bufferOffset = offset,
+		                        .imageSubresource = {.aspectMask = vk::ImageAspectFlagBits::ePlane0, .layerCount = 1},
+		                        .imageExtent = {extent.width, extent.height, 1},
+		                },
+		                vk::BufferImageCopy{
+		                        .bufferOffset = offset + size_t(extent.width) * extent.height,
+		                        .imageSubresource = {.aspectMask = vk::ImageAspectFlagBits::ePlane1, .layerCount = 1},
+		                        .imageExtent = {extent.width / 2, extent.height / 2, 1},
+		                },
+		        });
+
+		cmd.pipelineBarrier(
+		        vk::PipelineStageFlagBits::eTransfer,
+		        vk::PipelineStageFlagBits::eFragmentShader,
+		        {},
+		        {},
+		        {},
+		        vk::ImageMemoryBarrier{
+		                .srcAccessMask = vk::AccessFlagBits::eTransferWrite,
+		                .dstAccessMask = vk::AccessFlagBits::eShaderRead,
+		                .oldLayout = vk::ImageLayout::eTransferDstOptimal,
+		                .newLayout = vk::ImageLayout::eShaderReadOnlyOptimal,
+		                .image = image,
+		                .subresourceRange = range,
+		        });
+	}
+
+	size_t size() const
+	{
+		return size_t(extent.width) * extent.height * 3 / 2;
+	}
+};
+
+struct vulkan_context
+{
+	vk::raii::Context context;
+	vk::raii::Instance instance = nullptr;
+	vk::raii::PhysicalDevice physical_device = nullptr;
+	vk::raii::Device device = nullptr;
+	vk::raii::Queue queue = nullptr;
+	uint32_t queue_family_index;
+	bool density_map_supported = false;
+	std::optional<vk_allocator> allocator;
+
+	vulkan_context(size_t gpu)
+	{
+		vk::ApplicationInfo app_info{
+		        .pApplicationName = "wivrn-shader-benchmark",
+		        .apiVersion = VK_API_VERSION_1_1,
+		};
+		instance = vk::raii::Instance(context, vk::InstanceCreateInfo{.pApplicationInfo = &app_info});
+
+		auto physical_devices = instance.enumeratePhysicalDevices();
+		if (gpu >= physical_devices.size())
+			throw std::runtime_error("No Vulkan device " + std::to_string(gpu));
+		physical_device = std::move(physical_devices[gpu]);
+
+		auto queue_families = physical_device.getQueueFamilyProperties();
+		auto queue_family = std::ranges::find_if(queue_families, [](const vk::QueueFamilyProperties & props) {
+			return (props.queueFlags & vk::QueueFlagBits::eGraphics) and props.timestampValidBits > 0;
+		});
+		if (queue_family == queue_families.end())
+			throw std::runtime_error("No graphics queue with timestamps");
+		queue_family_index = queue_family - queue_families.begin();
+
+		std::vector<const char *> device_extensions;
+		for (auto & ext: physical_device.enumerateDeviceExtensionProperties())
+		{
+			if (std::string(ext.extensionName) == VK_EXT_FRAGMENT_DENSITY_MAP_EXTENSION_NAME)
+			{
+				device_extensions.push_back(VK_EXT_FRAGMENT_DENSITY_MAP_EXTENSION_NAME);
+				density_map_supported = true;
+			}
+		}
+
+		float queue_priority = 1;
+		vk::DeviceQueueCreateInfo queue_info{
+		        .queueFamilyIndex = queue_family_index,
+		        .queueCount = 1,
+		        .pQueuePriorities = &queue_priority,
+		};
+
+		vk::StructureChain device_info{
+		        vk::DeviceCreateInfo{
+		                .queueCreateInfoCount = 1,
+		                .pQueueCreateInfos = &queue_info,
+		                .enabledExtensionCount = uint32_t(device_extensions.size()),
+		                .ppEnabledExtensionNames = device_extensions.data(),
+		        },
+		        vk::PhysicalDeviceSamplerYcbcrConversionFeatures{
+		                .samplerYcbcrConversion = VK_TRUE,
+		        },
+		        vk::PhysicalDeviceFragmentDensityMapFeaturesEXT{
+		                .fragmentDensityMap = VK_TRUE,
+		        },
+		};
+		if (not density_map_supported)
+			device_info.unlink<vk::PhysicalDeviceFragmentDensityMapFeaturesEXT>();
+
+		device = vk::raii::Device(physical_device, device_info.get());
+		queue = device.getQueue(queue_family_index, 0);
+
+		allocator.emplace(VmaAllocatorCreateInfo{
+		        .physicalDevice = *physical_device,
+		        .device = *device,
+		        .instance = *instance,
+		});
+	}
+};
+
+distribution run(vulkan_context & vk, const configuration & config)
+{
+	const size_t view_count = 2;
+	auto & device = vk.device;
+
+	to_headset::video_stream_description description{
+	        .width = uint16_t(config.width),
+	        .height = uint16_t(config.height),
+	        .fps = 90,
+	};
+	for (auto & i: description.foveation)
+	{
+		i.x = make_foveation(config.scale_x, config.center_x);
+		i.y = make_foveation(config.scale_y, config.center_y);
+	}
+
+	// The views are the size the stream would have without foveation
+	const vk::Extent2D extent{
+	        uint32_t(std::lround(config.width / view_count / std::min(config.scale_x, 1.))),
+	        uint32_t(std::lround(config.height / std::min(config.scale_y, 1.))),
+	};
+	const vk::Format format = vk::Format::eR8G8B8A8Srgb;
+
+	std::vector<image_allocation> outputs;
+	std::vector<vk::Image> output_images;
+	for (size_t i = 0; i < view_count; ++i)
+	{
+		outputs.emplace_back(
+		        device,
+		        vk::ImageCreateInfo{
+		                .imageType = vk::ImageType::e2D,
+		                .format = format,
+		                .extent = {extent.width, extent.height, 1},
+		                .mipLevels = 1,
+		                .arrayLayers = 1,
+		                .samples = vk::SampleCountFlagBits::e1,
+		                .tiling = vk::ImageTiling::eOptimal,
+		                .usage = vk::ImageUsageFlagBits::eColorAttachment,
+		                .sharingMode = vk::SharingMode::eExclusive,
+		                .initialLayout = vk::ImageLayout::eUndefined,
+		        },
+		        VmaAllocationCreateInfo{
+		                .usage = VMA_MEMORY_USAGE_AUTO,
+		        });
+		output_images.push_back(outputs.back());
+	}
+
+	vk::raii::PipelineCache pipeline_cache(device, vk::PipelineCacheCreateInfo{});
+	stream_reprojection reprojector(
+	        device,
+	        vk.physical_device,
+	        view_count,
+	        1,
+	        output_images,
+	        {},
+	        extent,
+	        format,
+	        vk::Format::eUndefined,
+	        description,
+	        pipeline_cache,
+	        config.density_map);
+
+	// Horizontal bands of the stream, the height of NV12 images is even
+	const uint32_t band_height = (config.height / config.decoders + 1) & ~1u;
+	std::vector<std::unique_ptr<ycbcr_image>> images;
+	for (uint32_t y = 0; y < config.height; y += band_height)
+		images.push_back(std::make_unique<ycbcr_image>(device, vk.physical_device, vk::Extent2D{config.width, std::min(band_height, (config.height - y + 1) & ~1u)}));
+
+	std::vector<vk::raii::DescriptorSetLayout> set_layouts;
+	std::vector<vk::raii::PipelineLayout> pipeline_layouts;
+	std::vector<vk::raii::Pipeline> pipelines;
+	vk::DescriptorPoolSize pool_size{
+	        .type = vk::DescriptorType::eCombinedImageSampler,
+	        .descriptorCount = uint32_t(images.size()),
+	};
+	vk::raii::DescriptorPool descriptor_pool(
+	        device,
+	        vk::DescriptorPoolCreateInfo{
+	                .maxSets = uint32_t(images.size()),
+	                .poolSizeCount = 1,
+	                .pPoolSizes = &pool_size,
+	        });
+
+	std::vector<vk::DescriptorSet> descriptor_sets;
+	for (auto & image: images)
+	{
+		// Immutable sampler, as for the decoders
+		vk::Sampler sampler = *image->sampler;
+		vk::DescriptorSetLayoutBinding binding{
+		        .binding = 0,
+		        .descriptorType = vk::DescriptorType::eCombinedImageSampler,
+		        .descriptorCount = 1,
+		        .stageFlags = vk::ShaderStageFlagBits::eFragment,
+		        .pImmutableSamplers = &sampler,
+		};
+		set_layouts.emplace_back(device, vk::DescriptorSetLayoutCreateInfo{.bindingCount = 1, .pBindings = &binding});
+		pipeline_layouts.push_back(reprojector.create_pipeline_layout(*set_layouts.back()));
+		pipelines.push_back(reprojector.create_pipeline(pipeline_layouts.back()));
+
+		vk::DescriptorSet set = (*device).allocateDescriptorSets(vk::DescriptorSetAllocateInfo{
+		        .descriptorPool = *descriptor_pool,
+		        .descriptorSetCount = 1,
+		        .pSetLayouts = &*set_layouts.back(),
+		})[0];
+		descriptor_sets.push_back(set);
+
+		vk::DescriptorImageInfo image_info{
+		        .imageView = image->image_view(),
+		        .imageLayout = vk::ImageLayout::eShaderReadOnlyOptimal,
+		};
+		device.updateDescriptorSets(
+		        vk::WriteDescriptorSet{
+		                .dstSet = set,
+		                .dstBinding = 0,
+		                .descriptorCount = 1,
+		                .descriptorType = vk::DescriptorType::eCombinedImageSampler,
+		                .pImageInfo = &image_info,
+		        },
+		        {});
+	}
+
+	// Same regions as the stream scene for decoders without a source rectangle
+	const float view_width = float(config.width) / view_count;
+	std::vector<std::vector<stream_reprojection::source>> sources(view_count);
+	for (size_t view = 0; view < view_count; ++view)
+	{
+		for (size_t i = 0; i < images.size(); ++i)
+		{
+			float y0 = i * band_height;
+			float y1 = std::min<float>(y0 + images[i]->extent.height, config.height);
+			float view_x = view * view_width;
+			sources[view].push_back({
+			        .layout = *pipeline_layouts[i],
+			        .pipeline = *pipelines[i],
+			        .descriptor_set = descriptor_sets[i],
+			        .area = {
+			                .min = {0, y0 / config.height},
+			                .max = {1, y1 / config.height},
+			                .uv_scale = {view_width / images[i]->extent.width, float(config.height) / images[i]->extent.height},
+			                .uv_offset = {view_x / images[i]->extent.width, -y0 / images[i]->extent.height},
+			        },
+			});
+		}
+	}
+
+	vk::raii::CommandPool command_pool(device,
+	                                   {
+	                                           .flags = vk::CommandPoolCreateFlagBits::eResetCommandBuffer,
+	                                           .queueFamilyIndex = vk.queue_family_index,
+	                                   });
+	vk::raii::CommandBuffer cmd = std::move(device.allocateCommandBuffers({
+	        .commandPool = *command_pool,
+	        .commandBufferCount = 1,
+	})[0]);
+	vk::raii::Fence fence(device, vk::FenceCreateInfo{});
+
+	auto submit = [&]() {
+		cmd.end();
+		vk.queue.submit(vk::SubmitInfo{.commandBufferCount = 1, .pCommandBuffers = &*cmd}, *fence);
+		if (device.waitForFences(*fence, VK_TRUE, UINT64_MAX) == vk::Result::eTimeout)
+			throw std::runtime_error("Vulkan fence timeout");
+		device.resetFences(*fence);
+	};
+
+	size_t staging_size = 0;
+	for (auto & image: images)
+		staging_size += image->size();
+	{
+		buffer_allocation staging(
+		        device,
+		        vk::BufferCreateInfo{
+		                .size = staging_size,
+		                .usage = vk::BufferUsageFlagBits::eTransferSrc,
+		        },
+		        VmaAllocationCreateInfo{
+		                .flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT,
+		                .usage = VMA_MEMORY_USAGE_AUTO,
+		        });
+
+		cmd.begin(vk::CommandBufferBeginInfo{});
+		size_t offset = 0;
+		for (auto & image: images)
+		{
+			image->upload(cmd, staging, offset);
+			offset += image->size();
+		}
+		submit();
+	}
+
+	// Each batch is a single submission, the timestamps are around each view
+	const uint32_t batch = 100;
+	vk::raii::QueryPool query_pool(
+	        device,
+	        vk::QueryPoolCreateInfo{
+	                .queryType = vk::QueryType::eTimestamp,
+	                .queryCount = 2 * view_count * batch,
+	        });
+
+	const double period = vk.physical_device.getProperties().limits.timestampPeriod;
+	std::vector<double> times;
+	times.reserve(config.iterations);
+	for (uint32_t done = 0; done < config.warmup + config.iterations;)
+	{
+		uint32_t n = std::min(batch, config.warmup + config.iterations - done);
+		reprojector.set_frame(0);
+
+		cmd.begin(vk::CommandBufferBeginInfo{.flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
+		cmd.resetQueryPool(*query_pool, 0, 2 * view_count * n);
+		for (uint32_t i = 0; i < n; ++i)
+		{
+			for (size_t view = 0; view < view_count; ++view)
+			{
+				uint32_t query = 2 * (i * view_count + view);
+				cmd.writeTimestamp(vk::PipelineStageFlagBits::eTopOfPipe, *query_pool, query);
+				reprojector.reproject(cmd, sources[view], view, view);
+				cmd.writeTimestamp(vk::PipelineStageFlagBits::eBottomOfPipe, *query_pool, query + 1);
+			}
+		}
+		submit();
+
+		auto [res, timestamps] = query_pool.getResults<uint64_t>(
+		        0,
+		        2 * view_count * n,
+		        2 * view_count * n * sizeof(uint64_t),
+		        sizeof(uint64_t),
+		        vk::QueryResultFlagBits::e64 | vk::QueryResultFlagBits::eWait);
+		if (res != vk::Result::eSuccess)
+			throw std::runtime_error("Failed to read the timestamps: " + vk::to_string(res));
+
+		for (uint32_t i = 0; i < n; ++i, ++done)
+		{
+			if (done < config.warmup)
+				continue;
+			// ms for all the views of a frame
+			double total = 0;
+			for (size_t view = 0; view < view_count; ++view)
+			{
+				uint32_t query = 2 * (i * view_count + view);
+				total += (timestamps[query + 1] - timestamps[query]) * period / 1e6;
+			}
+			times.push_back(total);
+		}
+	}
+
+	return make_distribution(std::move(times));
+}
+
+} // namespace
+
+int main(int argc, char * argv[])
+{
+	CLI::App app{"Measure the GPU time of the stream reprojection shaders on synthetic YCbCr images"};
+
+	configuration config{
+	        .width = 3680,
+	        .height = 1920,
+	        .center_x = 0,
+	        .center_y = 0,
+	        .decoders = 1,
+	        .iterations = 1000,
+	        .warmup = 100,
+	};
+	std::vector<std::vector<double>> scales{{0.5}};
+	bool no_density_map = false;
+	size_t gpu = 0;
+
+	app.add_option("-W,--width", config.width, "width of the stream, with both views side by side")->capture_default_str();
+	app.add_option("-H,--height", config.height, "height of the stream")->capture_default_str();
+	app.add_option("-s,--scale", scales, "foveation scale, horizontal and optionally vertical, 1 for no foveation; a configuration is measured for each value")->expected(1, 2)->allow_extra_args(false);
+	app.add_option("--center-x", config.center_x, "horizontal centre of foveation, from -1 to 1")->capture_default_str();
+	app.add_option("--center-y", config.center_y, "vertical centre of foveation, from -1 to 1")->capture_default_str();
+	app.add_option("-d,--decoders", config.decoders, "number of decoders the stream is split into")->check(CLI::PositiveNumber)->capture_default_str();
+	app.add_option("-n,--iterations", config.iterations, "number of measured frames")->check(CLI::PositiveNumber)->capture_default_str();
+	app.add_option("--warmup", config.warmup, "number of frames rendered before measuring")->capture_default_str();
+	app.add_flag("--no-density-map", no_density_map, "do not use VK_EXT_fragment_density_map even if available");
+	app.add_option("--gpu", gpu, "index of the Vulkan physical device")->capture_default_str();
+
+	CLI11_PARSE(app, argc, argv);
+
+	if (config.width % 4 != 0 or config.height % 2 != 0)
+	{
+		fprintf(stderr, "The width must be a multiple of 4 and the height a multiple of 2\n");
+		return EXIT_FAILURE;
+	}
+
+	try
+	{
+		vulkan_context vk(gpu);
+		config.density_map = vk.density_map_supported and not no_density_map;
+
+		for (const auto & scale: scales)
+		{
+			config.scale_x = scale[0];
+			config.scale_y = scale.size() > 1 ? scale[1] : scale[0];
+			if (config.scale_x <= 0 or config.scale_y <= 0)
+			{
+				fprintf(stderr, "Invalid scale %f %f\n", config.scale_x, config.scale_y);
+				return EXIT_FAILURE;
+			}
+
+			distribution d = run(vk, config);
+			// GPU times in ms, for both views
+			printf("{\"benchmark\": \"reprojection\", \"device\": \"%s\", \"width\": %u, \"height\": %u, \"scale\": [%g, %g], \"center\": [%g, %g], "
+			       "\"decoders\": %u, \"density_map\": %s, \"iterations\": %u, "
+			       "\"gpu_time\": {\"mean\": %.4f, \"min\": %.4f, \"p50\": %.4f, \"p90\": %.4f, \"p99\": %.4f, \"max\": %.4f}}\n",
+			       vk.physical_device.getProperties().deviceName.data(),
+			       config.width,
+			       config.height,
+			       config.scale_x,
+			       config.scale_y,
+			       config.center_x,
+			       config.center_y,
+			       config.decoders,
+			       config.density_map ? "true" : "false",
+			       config.iterations,
+			       d.mean,
+			       d.min,
+			       d.p50,
+			       d.p90,
+			       d.p99,
+			       d.max);
+			fflush(stdout);
+		}
+	}
+	catch (std::exception & e)
+	{
+		fprintf(stderr, "%s\n", e.what());
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -20,7 +20,9 @@
 #include "configuration.h"
 
 #include "application.h"
+#include <arpa/inet.h>
 #include <fstream>
+#include <magic_enum.hpp>
 #include <simdjson.h>
 
 static std::string json_string(const std::string & in)
@@ -106,12 +108,35 @@ configuration::configuration(const std::string & path)
 		                .txt = {{"cookie", (std::string)i["cookie"]}}
 
 		        }};
+		if (auto protocol = i["protocol"]; protocol.is_string())
+			data.service.txt["protocol"] = (std::string)protocol;
+
+		if (auto address = i["last_address"]; address.is_string())
+		{
+			std::string str(address.get_string().value());
+			in_addr addr4;
+			in6_addr addr6;
+			if (inet_pton(AF_INET, str.c_str(), &addr4) == 1)
+				data.last_address = addr4;
+			else if (inet_pton(AF_INET6, str.c_str(), &addr6) == 1)
+				data.last_address = addr6;
+		}
+
 		servers.emplace(data.service.txt["cookie"], data);
 	}
 
 	if (auto val = root["show_performance_metrics"]; val.is_bool())
 		show_performance_metrics = val.get_bool();
 
+	if (auto val = root["performance_metrics_refresh_rate"]; val.is_number())
+		performance_metrics_refresh_rate = val.get_double();
+
+	if (auto val = root["hand_tracking_rate"]; val.is_number())
+		hand_tracking_rate = val.get_double();
+
+	if (auto val = root["reorder_window"]; val.is_int64())
+		reorder_window = val.get_int64();
+
 	if (auto val = root["preferred_refresh_rate"]; val.is_double())
 	{
 		preferred_refresh_rate = val.get_double();
@@ -127,6 +152,16 @@ configuration::configuration(const std::string & path)
 
 	if (auto val = root["passthrough_enabled"]; val.is_bool())
 		passthrough_enabled = val.get_bool();
+
+	if (auto val = root["decode_time"]; val.is_object())
+	{
+		for (auto [key, value]: simdjson::dom::object(val))
+		{
+			auto codec = magic_enum::enum_cast<xrt::drivers::wivrn::video_codec>(key);
+			if (codec and value.is_number())
+				decode_time[*codec] = value.get_double();
+		}
+	}
 }
 
 void configuration::save()
@@ -143,6 +178,17 @@ void configuration::save()
 			ss << "\"pretty_name\":" << json_string(server_data.service.name) << ",";
 			ss << "\"hostname\":" << json_string(server_data.service.hostname) << ",";
 			ss << "\"port\":" << server_data.service.port << ",";
+			if (server_data.last_address)
+			{
+				char buffer[INET6_ADDRSTRLEN];
+				std::visit([&](auto & address) {
+					inet_ntop(std::is_same_v<std::decay_t<decltype(address)>, in_addr> ? AF_INET : AF_INET6, &address, buffer, sizeof(buffer));
+				},
+				           *server_data.last_address);
+				ss << "\"last_address\":" << json_string(buffer) << ",";
+			}
+			if (auto protocol = server_data.service.txt.find("protocol"); protocol != server_data.service.txt.end())
+				ss << "\"protocol\":" << json_string(protocol->second) << ",";
 			ss << "\"cookie\":" << json_string(cookie);
 			ss << "},";
 		}
@@ -156,10 +202,24 @@ void configuration::save()
 
 	json << "{\"servers\":[" << servers_str << "],"
 	     << "\"show_performance_metrics\":" << std::boolalpha << show_performance_metrics;
+	json << ",\"performance_metrics_refresh_rate\":" << performance_metrics_refresh_rate;
+	json << ",\"hand_tracking_rate\":" << hand_tracking_rate;
+	json << ",\"reorder_window\":" << reorder_window;
 	if (preferred_refresh_rate != 0.)
 		json << ",\"preferred_refresh_rate\":" << preferred_refresh_rate;
 	json << ",\"resolution_scale\":" << resolution_scale;
 	json << ",\"microphone\":" << std::boolalpha << microphone;
 	json << ",\"passthrough_enabled\":" << std::boolalpha << passthrough_enabled;
+	if (not decode_time.empty())
+	{
+		json << ",\"decode_time\":{";
+		const char * separator = "";
+		for (auto [codec, time]: decode_time)
+		{
+			json << separator << json_string(std::string(magic_enum::enum_name(codec))) << ":" << time;
+			separator = ",";
+		}
+		json << "}";
+	}
 	json << "}";
 }
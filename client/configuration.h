@@ -20,6 +20,11 @@
 #pragma once
 
 #include "wivrn_discover.h"
+#include "wivrn_packets.h"
+
+#include <map>
+#include <optional>
+#include <variant>
 
 namespace xr
 {
@@ -37,14 +42,28 @@ public:
 		bool compatible;
 
 		wivrn_discover::service service;
+
+		// Address of the last successful connection, tried before the server is discovered again.
+		// service.txt["protocol"] is the protocol the server used then
+		std::optional<std::variant<in_addr, in6_addr>> last_address;
 	};
 
 	std::map<std::string, server_data> servers;
 	float preferred_refresh_rate = 0;
 	float resolution_scale = 1.0;
 	bool show_performance_metrics = true;
+	// Refresh rate of the performance metrics overlay in Hz, 0 to refresh it every frame
+	float performance_metrics_refresh_rate = 10;
 	bool microphone = true;
+	// Rate at which hand tracking is sent in Hz, 0 to send it with every tracking sample.
+	// Most runtimes track the hands at 30 to 90Hz, and unchanged hands are not sent again
+	float hand_tracking_rate = 90;
 	bool passthrough_enabled = true;
+	// Number of consecutive frames of each stream kept while their shards are received, so that
+	// shards reordered or retransmitted across frames can still complete them. At least 2.
+	int reorder_window = 4;
+	// average decoding time measured in previous sessions, in µs per megapixel
+	std::map<xrt::drivers::wivrn::video_codec, float> decode_time;
 
 private:
 	configuration(const std::string &);
@@ -19,18 +19,25 @@
 
 #include "android_decoder.h"
 #include "application.h"
+#include "decoder_probe.h"
+#include "jnipp.h"
 #include "scenes/stream.h"
 #include "utils/named_thread.h"
+#include "utils/performance_hint.h"
 #include <algorithm>
 #include <android/hardware_buffer.h>
 #include <cassert>
+#include <cstring>
 #include <media/NdkImage.h>
 #include <media/NdkImageReader.h>
 #include <media/NdkMediaCodec.h>
 #include <media/NdkMediaFormat.h>
 #include <mutex>
+#include <poll.h>
 #include <spdlog/spdlog.h>
+#include <string_view>
 #include <thread>
+#include <unistd.h>
 #include <vulkan/vulkan.hpp>
 #include <vulkan/vulkan_android.h>
 #include <vulkan/vulkan_raii.hpp>
@@ -43,17 +50,34 @@ struct wivrn::android::decoder::mapped_hardware_buffer
 	vk::raii::Image vimage = nullptr;
 	vk::raii::ImageView image_view = nullptr;
 	vk::ImageLayout layout = vk::ImageLayout::eUndefined;
+
+	// Reference held so that the address, used as key, is not reused by another buffer while mapped
+	AHardwareBuffer * buffer = nullptr;
+
+	~mapped_hardware_buffer()
+	{
+		if (buffer)
+			AHardwareBuffer_release(buffer);
+	}
 };
 
 namespace
 {
+const int image_reader_max_images = 5;
+// Buffers in the queue between the codec and the image reader, in addition to the acquired images
+const size_t max_mapped_hardware_buffers = 2 * image_reader_max_images;
+
 const char * mime(xrt::drivers::wivrn::video_codec codec)
 {
 	using c = xrt::drivers::wivrn::video_codec;
 	switch (codec)
 	{
+		case c::h264:
+			return "video/avc";
 		case c::h265:
 			return "video/hevc";
+		case c::av1:
+			return "video/av01";
 	}
 	assert(false);
 }
@@ -67,6 +91,14 @@ void check(media_status_t status, const char * msg)
 	}
 }
 
+namespace nal_h264
+{
+static const int sps = 7;
+static const int pps = 8;
+static const int aud = 9;
+static const int filler = 12;
+}; // namespace nal_h264
+
 namespace nal_h265
 {
 static const int vps = 32;
@@ -83,6 +115,22 @@ enum class nal_class
 	garbage
 };
 
+nal_class get_nal_class_h264(uint8_t * nal)
+{
+	uint8_t nal_type = (nal[2] == 0 ? nal[4] : nal[3]) & 0x1F;
+	switch (nal_type)
+	{
+		case nal_h264::sps:
+		case nal_h264::pps:
+			return nal_class::csd;
+		case nal_h264::aud:
+		case nal_h264::filler:
+			return nal_class::garbage;
+		default:
+			return nal_class::data;
+	}
+}
+
 nal_class get_nal_class_h265(uint8_t * nal)
 {
 	uint8_t nal_type = ((nal[2] == 0 ? nal[4] : nal[3]) >> 1) & 0x3F;
@@ -105,14 +153,91 @@ nal_class get_nal_class(uint8_t * nal, xrt::drivers::wivrn::video_codec codec)
 {
 	switch (codec)
 	{
+		case xrt::drivers::wivrn::video_codec::h264:
+			return get_nal_class_h264(nal);
 		case xrt::drivers::wivrn::video_codec::h265:
 			return get_nal_class_h265(nal);
+		case xrt::drivers::wivrn::video_codec::av1:
+			// AV1 has no NAL units
+			break;
 	}
+	assert(false);
+	return nal_class::data;
+}
+
+namespace obu_av1
+{
+static const int sequence_header = 1;
+static const int temporal_delimiter = 2;
+static const int padding = 15;
+}; // namespace obu_av1
+
+nal_class get_obu_class_av1(uint8_t obu_type)
+{
+	switch (obu_type)
+	{
+		case obu_av1::sequence_header:
+			return nal_class::csd;
+		case obu_av1::temporal_delimiter:
+		case obu_av1::padding:
+			return nal_class::garbage;
+		default:
+			return nal_class::data;
+	}
+}
+
+// AV1 uses the low overhead bitstream format: each OBU has a header and a leb128 size
+std::pair<std::vector<uint8_t>, std::vector<uint8_t>> filter_csd_av1(std::span<uint8_t> packet)
+{
+	std::pair<std::vector<uint8_t>, std::vector<uint8_t>> out;
+
+	size_t obu_start = 0;
+	while (obu_start < packet.size())
+	{
+		uint8_t header = packet[obu_start];
+		uint8_t obu_type = (header >> 3) & 0x0F;
+		bool has_extension = header & 0x04;
+		bool has_size = header & 0x02;
+
+		size_t pos = obu_start + 1 + has_extension;
+		size_t obu_end = packet.size();
+		if (has_size)
+		{
+			uint64_t size = 0;
+			for (int i = 0; i < 8 and pos < packet.size(); ++i)
+			{
+				uint8_t byte = packet[pos++];
+				size |= uint64_t(byte & 0x7F) << (7 * i);
+				if (not(byte & 0x80))
+					break;
+			}
+			obu_end = std::min<uint64_t>(pos + size, packet.size());
+		}
+
+		switch (get_obu_class_av1(obu_type))
+		{
+			case nal_class::csd:
+				out.first.insert(out.first.end(), packet.begin() + obu_start, packet.begin() + obu_end);
+				break;
+			case nal_class::data:
+				out.second.insert(out.second.end(), packet.begin() + obu_start, packet.begin() + obu_end);
+				break;
+			case nal_class::garbage:
+				break;
+		}
+
+		obu_start = obu_end;
+	}
+
+	return out;
 }
 
 std::pair<std::vector<uint8_t>, std::vector<uint8_t>> filter_csd(std::span<uint8_t> packet,
                                                                  xrt::drivers::wivrn::video_codec codec)
 {
+	if (codec == xrt::drivers::wivrn::video_codec::av1)
+		return filter_csd_av1(packet);
+
 	if (packet.size() < 4)
 		return {};
 
@@ -152,6 +277,95 @@ std::pair<std::vector<uint8_t>, std::vector<uint8_t>> filter_csd(std::span<uint8
 namespace wivrn::android
 {
 
+std::vector<xrt::drivers::wivrn::video_codec> decoder::supported_codecs()
+{
+	using c = xrt::drivers::wivrn::video_codec;
+	std::vector<c> result;
+	for (auto codec: {c::h264, c::h265, c::av1})
+	{
+		AMediaCodec_ptr media_codec(AMediaCodec_createDecoderByType(mime(codec)));
+		if (not media_codec)
+			continue;
+
+		// Software decoders are too slow for streaming
+		char * codec_name;
+		check(AMediaCodec_getName(media_codec.get(), &codec_name), "AMediaCodec_getName");
+		std::string_view name(codec_name);
+		bool software = name.starts_with("c2.android.") or name.starts_with("OMX.google.");
+		spdlog::info("Decoder for {}: {}{}", mime(codec), name, software ? " (software)" : "");
+		AMediaCodec_releaseName(media_codec.get(), codec_name);
+
+		if (not software)
+			result.push_back(codec);
+	}
+	return result;
+}
+
+void decoder::get_capabilities(xrt::drivers::wivrn::from_headset::headset_info_packet::decoder_info & info, uint32_t width, uint32_t height)
+{
+	std::string name;
+	{
+		AMediaCodec_ptr media_codec(AMediaCodec_createDecoderByType(mime(info.codec)));
+		if (not media_codec)
+			return;
+		char * codec_name;
+		check(AMediaCodec_getName(media_codec.get(), &codec_name), "AMediaCodec_getName");
+		name = codec_name;
+		AMediaCodec_releaseName(media_codec.get(), codec_name);
+	}
+
+	// The NDK does not expose the codec capabilities, they are read from MediaCodecInfo
+	auto & env = jni::jni_thread::env();
+	auto failed = [&]() {
+		if (not env.ExceptionCheck())
+			return false;
+		env.ExceptionClear();
+		return true;
+	};
+
+	auto java_codec = jni::klass("android/media/MediaCodec").call<jni::object<"android/media/MediaCodec">>("createByCodecName", jni::string(name.c_str()));
+	if (failed() or not java_codec)
+		return;
+	auto codec_info = java_codec.call<jni::object<"android/media/MediaCodecInfo">>("getCodecInfo");
+	auto capabilities = codec_info.call<jni::object<"android/media/MediaCodecInfo$CodecCapabilities">>("getCapabilitiesForType", jni::string(mime(info.codec)));
+	if (failed() or not capabilities)
+	{
+		java_codec.call<void>("release");
+		return;
+	}
+
+	info.max_instances = capabilities.call<jni::Int>("getMaxSupportedInstances");
+	info.low_latency = capabilities.call<jni::Bool>("isFeatureSupported", jni::string("low-latency"));
+
+	auto video = capabilities.call<jni::object<"android/media/MediaCodecInfo$VideoCapabilities">>("getVideoCapabilities");
+	auto upper = [](jni::object<"android/util/Range"> range) -> int {
+		return range.call<jni::object<"java/lang/Comparable">>("getUpper").call<jni::Int>("intValue");
+	};
+	if (video)
+	{
+		info.max_width = upper(video.call<jni::object<"android/util/Range">>("getSupportedWidths"));
+		info.max_height = upper(video.call<jni::object<"android/util/Range">>("getSupportedHeights"));
+
+		// Measured rates are more accurate, but not available for all the sizes
+		auto rates = video.call<jni::object<"android/util/Range">>("getAchievableFrameRatesFor", jni::Int(width), jni::Int(height));
+		if (failed() or not rates)
+			rates = video.call<jni::object<"android/util/Range">>("getSupportedFrameRatesFor", jni::Int(width), jni::Int(height));
+		if (not failed() and rates)
+			info.max_pixel_rate = float(upper(std::move(rates))) * width * height;
+	}
+	java_codec.call<void>("release");
+	failed();
+
+	spdlog::info("Decoder {} for {}: up to {}x{}, {} instances, {:.0f} Mpixel/s{}",
+	             name,
+	             mime(info.codec),
+	             info.max_width,
+	             info.max_height,
+	             info.max_instances,
+	             info.max_pixel_rate * 1e-6,
+	             info.low_latency ? ", low latency" : "");
+}
+
 void decoder::push_nals(std::span<std::span<const uint8_t>> data, int64_t timestamp, uint32_t flags)
 {
 	auto t1 = application::now();
@@ -172,7 +386,7 @@ void decoder::push_nals(std::span<std::span<const uint8_t>> data, int64_t timest
 
 	for (const auto & sub_data: data)
 	{
-		if (sub_data.size() > size)
+		if (data_size + sub_data.size() > size)
 		{
 			spdlog::error("data to decode is larger than decoder buffer, skipping frame");
 			return;
@@ -198,7 +412,8 @@ decoder::decoder(
         uint8_t stream_index,
         std::weak_ptr<scenes::stream> weak_scene,
         shard_accumulator * accumulator) :
-        description(description), fps(fps), device(device), weak_scene(weak_scene), accumulator(accumulator)
+        description(description), fps(fps), device(device), weak_scene(weak_scene), accumulator(accumulator),
+        import_fences(application::vulkan_device_extension_enabled(VK_KHR_EXTERNAL_SEMAPHORE_FD_EXTENSION_NAME))
 {
 	spdlog::info("hbm_mutex.native_handle() = {}", (void *)hbm_mutex.native_handle());
 
@@ -208,7 +423,7 @@ decoder::decoder(
 	              description.height,
 	              AIMAGE_FORMAT_PRIVATE,
 	              AHARDWAREBUFFER_USAGE_CPU_READ_NEVER | AHARDWAREBUFFER_USAGE_GPU_SAMPLED_IMAGE,
-	              5 /* maxImages */,
+	              image_reader_max_images,
 	              &ir),
 	      "AImageReader_newWithUsage");
 	image_reader.reset(ir, AImageReader_deleter{});
@@ -222,15 +437,26 @@ decoder::decoder(
 
 	output_releaser = utils::named_thread(
 	        "decoder-" + std::to_string(stream_index),
-	        [this]() {
+	        [this, stream_index]() {
+		        // Releasing a buffer makes the codec render it to the image reader, it must not wait for the CPU
+		        utils::performance_hint hint(("decoder " + std::to_string(stream_index)).c_str(), std::chrono::nanoseconds(int64_t(1e9 / fps / 2)));
 		        while (true)
 		        {
 			        try
 			        {
-				        auto index = output_buffers.pop();
-				        if (index == -1)
+				        auto output = output_buffers.pop();
+				        if (output.index == -1)
 					        return;
-				        auto status = AMediaCodec_releaseOutputBuffer(media_codec.get(), index, true);
+				        auto work = hint.measure();
+				        // Rendering superseded frames to the image reader would only add latency
+				        while (auto newer = output_buffers.try_pop())
+				        {
+					        skip_output_buffer(output);
+					        output = *newer;
+					        if (output.index == -1)
+						        return;
+				        }
+				        auto status = AMediaCodec_releaseOutputBuffer(media_codec.get(), output.index, true);
 				        // will trigger on_image_available through ImageReader
 				        if (status != AMEDIA_OK)
 					        spdlog::error("AMediaCodec_releaseOutputBuffer: MediaCodec error {}",
@@ -253,7 +479,7 @@ decoder::~decoder()
 	if (media_codec)
 	{
 		AMediaCodec_stop(media_codec.get());
-		output_buffers.push(-1);
+		output_buffers.push({.index = -1});
 		if (output_releaser.joinable())
 			output_releaser.join();
 	}
@@ -263,6 +489,12 @@ decoder::~decoder()
 	if (output_releaser.joinable())
 		output_releaser.join();
 
+	if (mapping_stats.count)
+		spdlog::info("Mapped {} hardware buffers in {}µs, longest {}µs",
+		             mapping_stats.count,
+		             std::chrono::duration_cast<std::chrono::microseconds>(mapping_stats.total).count(),
+		             std::chrono::duration_cast<std::chrono::microseconds>(mapping_stats.max).count());
+
 	spdlog::info("decoder::~decoder");
 }
 
@@ -282,13 +514,13 @@ void decoder::push_data(std::span<std::span<const uint8_t>> data, uint64_t frame
 
 		AMediaFormat_ptr format(AMediaFormat_new());
 		AMediaFormat_setString(format.get(), AMEDIAFORMAT_KEY_MIME, mime(description.codec));
-		// AMediaFormat_setInt32(format.get(), "vendor.qti-ext-dec-low-latency.enable", 1); // Qualcomm low
-		// latency mode
 		AMediaFormat_setInt32(format.get(), AMEDIAFORMAT_KEY_WIDTH, description.width);
 		AMediaFormat_setInt32(format.get(), AMEDIAFORMAT_KEY_HEIGHT, description.height);
-		AMediaFormat_setInt32(format.get(), AMEDIAFORMAT_KEY_OPERATING_RATE, std::ceil(fps));
-		AMediaFormat_setInt32(format.get(), AMEDIAFORMAT_KEY_PRIORITY, 0);
-		//  AMediaFormat_setBuffer(format.get(), AMEDIAFORMAT_KEY_CSD_0, csd.data(), csd.size());
+		const auto & profile = decoder_probe::best();
+		spdlog::info("Using decoder profile {}", profile.name);
+		profile.apply(format.get(), fps);
+		// csd-0 is left unset, the configuration found above is given in band with the first frame.
+		// For AV1 MediaCodec would expect an av1C record there, not the raw sequence header OBU.
 
 		media_codec.reset(AMediaCodec_createDecoderByType(mime(description.codec)));
 
@@ -316,8 +548,17 @@ void decoder::push_data(std::span<std::span<const uint8_t>> data, uint64_t frame
 		check(AMediaCodec_start(media_codec.get()), "AMediaCodec_start");
 	}
 
+	// The end of the previous frame was lost, terminate it so that its data is not merged with this frame.
+	// It has no frame info, its output is dropped.
+	if (partial_frame and *partial_frame != frame_index)
+		push_nals({}, *partial_frame * 10'000, 0);
+
 	uint64_t fake_timestamp_us = frame_index * 10'000;
 	push_nals(data, fake_timestamp_us, partial ? AMEDIACODEC_BUFFER_FLAG_PARTIAL_FRAME : 0);
+	if (partial)
+		partial_frame = frame_index;
+	else
+		partial_frame.reset();
 }
 
 void decoder::frame_completed(xrt::drivers::wivrn::from_headset::feedback & feedback, const xrt::drivers::wivrn::to_headset::video_stream_data_shard::timing_info_t & timing_info, const xrt::drivers::wivrn::to_headset::video_stream_data_shard::view_info_t & view_info)
@@ -338,6 +579,21 @@ void decoder::frame_completed(xrt::drivers::wivrn::from_headset::feedback & feed
 	});
 }
 
+void decoder::skip_output_buffer(const output_buffer & output)
+{
+	auto status = AMediaCodec_releaseOutputBuffer(media_codec.get(), output.index, false);
+	if (status != AMEDIA_OK)
+		spdlog::error("AMediaCodec_releaseOutputBuffer: MediaCodec error {}", (int)status);
+
+	// Report the frame as decoded but never displayed
+	auto info = frame_infos.pop_if([&](auto & x) { return x.feedback.frame_index == output.frame_index; });
+	if (not info)
+		return;
+	info->feedback.received_from_decoder = application::now();
+	if (auto scene = weak_scene.lock())
+		scene->send_feedback(info->feedback);
+}
+
 void decoder::on_image_available(void * context, AImageReader * reader)
 {
 	try
@@ -358,9 +614,12 @@ void decoder::on_image_available(AImageReader * reader)
 	decltype(blit_handle::aimage) image;
 	try
 	{
+		// Do not wait for the codec on the CPU, the render submission waits for the fence
 		AImage * tmp;
-		check(AImageReader_acquireLatestImage(image_reader.get(), &tmp), "AImageReader_acquireLatestImage");
+		int fence_fd = -1;
+		check(AImageReader_acquireLatestImageAsync(image_reader.get(), &tmp, &fence_fd), "AImageReader_acquireLatestImageAsync");
 		image.reset(tmp);
+		vk::raii::Semaphore semaphore = import_fence(fence_fd);
 
 		int64_t fake_timestamp_ns;
 		check(AImage_getTimestamp(image.get(), &fake_timestamp_ns), "AImage_getTimestamp");
@@ -389,7 +648,8 @@ void decoder::on_image_available(AImageReader * reader)
 		        &vk_data->layout,
 		        vk_data,
 		        image_reader,
-		        std::move(image));
+		        std::move(image),
+		        std::move(semaphore));
 
 		if (auto scene = weak_scene.lock())
 			scene->push_blit_handle(accumulator, std::move(handle));
@@ -399,6 +659,43 @@ void decoder::on_image_available(AImageReader * reader)
 	}
 }
 
+vk::raii::Semaphore decoder::import_fence(int fence_fd)
+{
+	// The image is ready
+	if (fence_fd < 0)
+		return nullptr;
+
+	if (import_fences)
+	{
+		try
+		{
+			vk::raii::Semaphore semaphore(device, vk::SemaphoreCreateInfo{});
+			device.importSemaphoreFdKHR(vk::ImportSemaphoreFdInfoKHR{
+			        .semaphore = *semaphore,
+			        .flags = vk::SemaphoreImportFlagBits::eTemporary,
+			        .handleType = vk::ExternalSemaphoreHandleTypeFlagBits::eSyncFd,
+			        .fd = fence_fd,
+			});
+			// The semaphore owns the file descriptor
+			return semaphore;
+		}
+		catch (std::exception & e)
+		{
+			spdlog::warn("Cannot import the decoder fences, waiting for them on the CPU: {}", e.what());
+			import_fences = false;
+		}
+	}
+
+	pollfd fd{
+	        .fd = fence_fd,
+	        .events = POLLIN,
+	};
+	if (poll(&fd, 1, -1) < 0)
+		spdlog::warn("Failed to wait for the decoder fence: {}", strerror(errno));
+	close(fence_fd);
+	return nullptr;
+}
+
 void decoder::create_sampler(const AHardwareBuffer_Desc & buffer_desc, vk::AndroidHardwareBufferFormatPropertiesANDROID & ahb_format)
 {
 	assert(ahb_format.externalFormat != 0);
@@ -497,7 +794,20 @@ std::shared_ptr<decoder::mapped_hardware_buffer> decoder::map_hardware_buffer(AI
 
 	auto it = hardware_buffer_map.find(hardware_buffer);
 	if (it != hardware_buffer_map.end())
-		return it->second;
+	{
+		it->second.last_used = ++hardware_buffer_use_count;
+		return it->second.mapping;
+	}
+
+	// The codec allocated new buffers (e.g. after a resolution change), forget the oldest ones.
+	// Mappings still held by a blit handle are destroyed when it is released.
+	if (hardware_buffer_map.size() >= max_mapped_hardware_buffers)
+	{
+		auto oldest = std::ranges::min_element(hardware_buffer_map, {}, [](const auto & i) { return i.second.last_used; });
+		hardware_buffer_map.erase(oldest);
+	}
+
+	auto start = std::chrono::steady_clock::now();
 
 	vk::StructureChain img_info{
 	        vk::ImageCreateInfo{
@@ -567,8 +877,17 @@ std::shared_ptr<decoder::mapped_hardware_buffer> decoder::map_hardware_buffer(AI
 	handle->vimage = std::move(vimage);
 	handle->image_view = std::move(image_view);
 	handle->memory = std::move(memory);
+	AHardwareBuffer_acquire(hardware_buffer);
+	handle->buffer = hardware_buffer;
+
+	hardware_buffer_map[hardware_buffer] = {handle, ++hardware_buffer_use_count};
+
+	auto duration = std::chrono::steady_clock::now() - start;
+	mapping_stats.count++;
+	mapping_stats.total += duration;
+	mapping_stats.max = std::max<std::chrono::nanoseconds>(mapping_stats.max, duration);
+	spdlog::debug("Mapped hardware buffer {} in {}µs, {} mapped", (void *)hardware_buffer, std::chrono::duration_cast<std::chrono::microseconds>(duration).count(), hardware_buffer_map.size());
 
-	hardware_buffer_map[hardware_buffer] = handle;
 	return handle;
 }
 
@@ -588,7 +907,10 @@ void decoder::on_media_input_available(AMediaCodec *, void * userdata, int32_t i
 void decoder::on_media_output_available(AMediaCodec * media_codec, void * userdata, int32_t index, AMediaCodecBufferInfo * bufferInfo)
 {
 	auto self = (decoder *)userdata;
-	self->output_buffers.push(index);
+	self->output_buffers.push({
+	        .index = index,
+	        .frame_index = uint64_t(bufferInfo->presentationTimeUs + 5'000) / 10'000,
+	});
 	// will be consumed by dedicated thread
 }
 
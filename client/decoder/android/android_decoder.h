@@ -21,10 +21,13 @@
 
 #include "utils/sync_queue.h"
 #include "wivrn_packets.h"
+#include <chrono>
 #include <memory>
+#include <optional>
 #include <span>
 #include <thread>
 #include <unordered_map>
+#include <vector>
 
 #include <media/NdkImage.h>
 #include <media/NdkImageReader.h>
@@ -77,6 +80,11 @@ public:
 
 		std::shared_ptr<AImageReader> image_reader;
 		AImage_ptr aimage;
+
+		// Signaled when the codec is done writing the image, null if it already was.
+		// Binary semaphore: only the first frame that samples the image waits for it
+		vk::raii::Semaphore semaphore = nullptr;
+		bool semaphore_waited = false;
 	};
 
 private:
@@ -99,11 +107,27 @@ private:
 
 	PFN_vkGetAndroidHardwareBufferPropertiesANDROID vkGetAndroidHardwareBufferPropertiesANDROID;
 
+	// The fences of the image reader are imported in semaphores, only used by the image reader thread
+	bool import_fences;
+	// Takes ownership of the fence, returns a semaphore with its payload or waits for it if it cannot be imported
+	vk::raii::Semaphore import_fence(int fence_fd);
+
 	void on_image_available(AImageReader * reader);
 	static void on_image_available(void * context, AImageReader * reader);
 
+	// input_buffers and output_buffers hold indices of the buffers owned by MediaCodec, they cannot grow
+	// beyond the number of buffers of the codec. They are not bounded here: dropping an index would leak
+	// the buffer until the codec is flushed, and blocking would stall the MediaCodec callback thread
 	utils::sync_queue<int32_t> input_buffers;
-	utils::sync_queue<int32_t> output_buffers;
+	struct output_buffer
+	{
+		// -1 to stop the output releaser thread
+		int32_t index;
+		uint64_t frame_index;
+	};
+	utils::sync_queue<output_buffer> output_buffers;
+	// Releases an output buffer without rendering it, a newer frame is already decoded
+	void skip_output_buffer(const output_buffer &);
 
 	struct frame_info
 	{
@@ -111,7 +135,8 @@ private:
 		xrt::drivers::wivrn::to_headset::video_stream_data_shard::timing_info_t timing_info;
 		xrt::drivers::wivrn::to_headset::video_stream_data_shard::view_info_t view_info;
 	};
-	utils::sync_queue<frame_info> frame_infos;
+	// Bounded so that a stalled decoder does not accumulate frame information
+	utils::sync_queue<frame_info> frame_infos{64, utils::overflow_policy::drop_oldest};
 
 	std::thread output_releaser;
 	static void on_media_error(AMediaCodec *, void * userdata, media_status_t error, int32_t actionCode, const char * detail);
@@ -120,8 +145,26 @@ private:
 	static void on_media_output_available(AMediaCodec *, void * userdata, int32_t index, AMediaCodecBufferInfo * bufferInfo);
 
 	void push_nals(std::span<std::span<const uint8_t>> data, int64_t timestamp, uint32_t flags);
+	// Frame whose last pushed data had the partial flag
+	std::optional<uint64_t> partial_frame;
+
+	// Bounded, least recently used mappings are evicted when the codec allocates new buffers.
+	// Locked by hbm_mutex
+	struct hardware_buffer_entry
+	{
+		std::shared_ptr<mapped_hardware_buffer> mapping;
+		uint64_t last_used;
+	};
+	std::unordered_map<AHardwareBuffer *, hardware_buffer_entry> hardware_buffer_map;
+	uint64_t hardware_buffer_use_count = 0;
 
-	std::unordered_map<AHardwareBuffer *, std::shared_ptr<mapped_hardware_buffer>> hardware_buffer_map;
+	// Time spent creating Vulkan images for hardware buffers, it happens on the first frames and after a format change
+	struct
+	{
+		uint32_t count = 0;
+		std::chrono::nanoseconds total{};
+		std::chrono::nanoseconds max{};
+	} mapping_stats;
 	vk::raii::RenderPass renderpass = nullptr;
 
 	void create_sampler(const AHardwareBuffer_Desc & buffer_desc, vk::AndroidHardwareBufferFormatPropertiesANDROID & ahb_format);
@@ -161,6 +204,12 @@ public:
 	{
 		return extent;
 	}
+
+	// codecs for which a decoder is available
+	static std::vector<xrt::drivers::wivrn::video_codec> supported_codecs();
+
+	// limits of the decoder for info.codec, for a stream of the given size
+	static void get_capabilities(xrt::drivers::wivrn::from_headset::headset_info_packet::decoder_info & info, uint32_t width, uint32_t height);
 };
 
 } // namespace wivrn::android
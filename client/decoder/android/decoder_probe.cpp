@@ -0,0 +1,368 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "decoder_probe.h"
+#include "android_decoder.h"
+#include "hardware.h"
+#include "utils/named_thread.h"
+
+#include <algorithm>
+#include <android/hardware_buffer.h>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <media/NdkImageReader.h>
+#include <media/NdkMediaCodec.h>
+#include <optional>
+#include <spdlog/spdlog.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+DEUGLIFY(AMediaFormat)
+
+using namespace std::chrono_literals;
+
+namespace wivrn::android
+{
+namespace
+{
+const std::array profiles{
+        codec_profile{.name = "default"},
+        codec_profile{.name = "low_latency", .low_latency = true},
+        codec_profile{.name = "vendor_low_latency", .low_latency = true, .vendor_low_latency = true},
+        codec_profile{.name = "max_operating_rate", .low_latency = true, .vendor_low_latency = true, .max_operating_rate = true},
+};
+
+// Synthetic stream: IDR frames of I_PCM macroblocks, which every H.264 decoder supports
+const int probe_size = 256;
+const int probe_frames = 40;
+// Frames decoded before the measurement starts
+const int probe_warmup = 10;
+const auto probe_interval = std::chrono::microseconds(1'000'000 / 90);
+// Profiles within this margin of the best one are considered equal, the one with fewer options is used
+const double probe_margin = 0.5;
+
+class bit_writer
+{
+	std::vector<uint8_t> data;
+	uint8_t current = 0;
+	int bits = 0;
+
+public:
+	void bit(int b)
+	{
+		current = (current << 1) | b;
+		if (++bits == 8)
+		{
+			data.push_back(current);
+			current = 0;
+			bits = 0;
+		}
+	}
+	void u(int n, uint32_t value)
+	{
+		for (int i = n - 1; i >= 0; --i)
+			bit((value >> i) & 1);
+	}
+	void ue(uint32_t value)
+	{
+		int len = std::bit_width(value + 1);
+		u(len - 1, 0);
+		u(len, value + 1);
+	}
+	void se(int32_t value)
+	{
+		ue(value <= 0 ? -2 * value : 2 * value - 1);
+	}
+	void align()
+	{
+		while (bits)
+			bit(0);
+	}
+	void trailing_bits()
+	{
+		bit(1);
+		align();
+	}
+	std::vector<uint8_t> & rbsp()
+	{
+		return data;
+	}
+};
+
+// Appends a NAL unit in Annex B format, with emulation prevention
+void write_nal(std::vector<uint8_t> & out, int ref_idc, int type, const std::vector<uint8_t> & rbsp)
+{
+	out.insert(out.end(), {0, 0, 0, 1, uint8_t(ref_idc << 5 | type)});
+	int zeros = 0;
+	for (uint8_t byte: rbsp)
+	{
+		if (zeros >= 2 and byte <= 3)
+		{
+			out.push_back(3);
+			zeros = 0;
+		}
+		out.push_back(byte);
+		zeros = byte == 0 ? zeros + 1 : 0;
+	}
+}
+
+std::vector<uint8_t> synthetic_frame(int index)
+{
+	const int mbs = probe_size / 16;
+	std::vector<uint8_t> out;
+
+	bit_writer sps;
+	sps.u(8, 66);          // profile_idc: baseline
+	sps.u(8, 0b0100'0000); // constraint_set1_flag: constrained baseline
+	sps.u(8, 30);          // level_idc
+	sps.ue(0);             // seq_parameter_set_id
+	sps.ue(0);             // log2_max_frame_num_minus4
+	sps.ue(2);             // pic_order_cnt_type: output order is decoding order
+	sps.ue(1);             // max_num_ref_frames
+	sps.bit(0);            // gaps_in_frame_num_value_allowed_flag
+	sps.ue(mbs - 1);       // pic_width_in_mbs_minus1
+	sps.ue(mbs - 1);       // pic_height_in_map_units_minus1
+	sps.bit(1);            // frame_mbs_only_flag
+	sps.bit(1);            // direct_8x8_inference_flag
+	sps.bit(0);            // frame_cropping_flag
+	sps.bit(0);            // vui_parameters_present_flag
+	sps.trailing_bits();
+	write_nal(out, 3, 7, sps.rbsp());
+
+	bit_writer pps;
+	pps.ue(0);   // pic_parameter_set_id
+	pps.ue(0);   // seq_parameter_set_id
+	pps.bit(0);  // entropy_coding_mode_flag: CAVLC
+	pps.bit(0);  // bottom_field_pic_order_in_frame_present_flag
+	pps.ue(0);   // num_slice_groups_minus1
+	pps.ue(0);   // num_ref_idx_l0_default_active_minus1
+	pps.ue(0);   // num_ref_idx_l1_default_active_minus1
+	pps.bit(0);  // weighted_pred_flag
+	pps.u(2, 0); // weighted_bipred_idc
+	pps.se(0);   // pic_init_qp_minus26
+	pps.se(0);   // pic_init_qs_minus26
+	pps.se(0);   // chroma_qp_index_offset
+	pps.bit(1);  // deblocking_filter_control_present_flag
+	pps.bit(0);  // constrained_intra_pred_flag
+	pps.bit(0);  // redundant_pic_cnt_present_flag
+	pps.trailing_bits();
+	write_nal(out, 3, 8, pps.rbsp());
+
+	bit_writer slice;
+	slice.ue(0);         // first_mb_in_slice
+	slice.ue(7);         // slice_type: I, for all slices of the picture
+	slice.ue(0);         // pic_parameter_set_id
+	slice.u(4, 0);       // frame_num
+	slice.ue(index % 2); // idr_pic_id, differs between consecutive IDR
+	slice.bit(0);        // no_output_of_prior_pics_flag
+	slice.bit(0);        // long_term_reference_flag
+	slice.se(0);         // slice_qp_delta
+	slice.ue(1);         // disable_deblocking_filter_idc
+	for (int mb = 0; mb < mbs * mbs; ++mb)
+	{
+		slice.ue(25); // mb_type: I_PCM
+		slice.align();
+		// 16x16 luma and 2 8x8 chroma samples
+		auto & rbsp = slice.rbsp();
+		rbsp.insert(rbsp.end(), 256, uint8_t(16 + (mb + index) % 200));
+		rbsp.insert(rbsp.end(), 128, 128);
+	}
+	slice.trailing_bits();
+	write_nal(out, 3, 5, slice.rbsp());
+
+	return out;
+}
+
+// Median time between queuing a frame and getting its output buffer, in ms
+std::optional<double> measure(const codec_profile & profile)
+{
+	AImageReader * tmp;
+	if (AImageReader_newWithUsage(probe_size, probe_size, AIMAGE_FORMAT_PRIVATE, AHARDWAREBUFFER_USAGE_GPU_SAMPLED_IMAGE, 4, &tmp) != AMEDIA_OK)
+		return std::nullopt;
+	AImageReader_ptr reader(tmp);
+	ANativeWindow * window;
+	if (AImageReader_getWindow(reader.get(), &window) != AMEDIA_OK)
+		return std::nullopt;
+
+	AMediaCodec_ptr codec(AMediaCodec_createDecoderByType("video/avc"));
+	if (not codec)
+		return std::nullopt;
+
+	AMediaFormat_ptr format(AMediaFormat_new());
+	AMediaFormat_setString(format.get(), AMEDIAFORMAT_KEY_MIME, "video/avc");
+	AMediaFormat_setInt32(format.get(), AMEDIAFORMAT_KEY_WIDTH, probe_size);
+	AMediaFormat_setInt32(format.get(), AMEDIAFORMAT_KEY_HEIGHT, probe_size);
+	profile.apply(format.get(), 90);
+
+	if (AMediaCodec_configure(codec.get(), format.get(), window, nullptr, 0) != AMEDIA_OK or
+	    AMediaCodec_start(codec.get()) != AMEDIA_OK)
+		return std::nullopt;
+
+	std::vector<std::chrono::steady_clock::time_point> queued(probe_frames);
+	std::vector<double> latencies;
+	auto drain = [&]() {
+		AMediaCodecBufferInfo info;
+		for (ssize_t index; (index = AMediaCodec_dequeueOutputBuffer(codec.get(), &info, 0)) != AMEDIACODEC_INFO_TRY_AGAIN_LATER;)
+		{
+			if (index < 0)
+				continue; // format or buffers changed
+			auto frame = info.presentationTimeUs / 1000;
+			if (frame >= probe_warmup and frame < probe_frames)
+				latencies.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - queued[frame]).count());
+			AMediaCodec_releaseOutputBuffer(codec.get(), index, true);
+		}
+		AImage * image;
+		while (AImageReader_acquireNextImage(reader.get(), &image) == AMEDIA_OK)
+			AImage_delete(image);
+	};
+
+	auto next = std::chrono::steady_clock::now();
+	for (int i = 0; i < probe_frames; ++i)
+	{
+		auto data = synthetic_frame(i);
+		ssize_t input = AMediaCodec_dequeueInputBuffer(codec.get(), 100'000);
+		if (input < 0)
+			break;
+		size_t size;
+		uint8_t * buffer = AMediaCodec_getInputBuffer(codec.get(), input, &size);
+		if (not buffer or size < data.size())
+			break;
+		memcpy(buffer, data.data(), data.size());
+		queued[i] = std::chrono::steady_clock::now();
+		AMediaCodec_queueInputBuffer(codec.get(), input, 0, data.size(), i * 1000, 0);
+
+		next += probe_interval;
+		while (std::chrono::steady_clock::now() < next)
+		{
+			drain();
+			std::this_thread::sleep_for(500us);
+		}
+	}
+	// Some decoders keep the last frames until more input is given
+	for (auto end = std::chrono::steady_clock::now() + 200ms; std::chrono::steady_clock::now() < end;)
+	{
+		drain();
+		std::this_thread::sleep_for(1ms);
+	}
+	AMediaCodec_stop(codec.get());
+
+	if (latencies.size() < (probe_frames - probe_warmup) / 2)
+		return std::nullopt;
+	auto median = latencies.begin() + latencies.size() / 2;
+	std::ranges::nth_element(latencies, median);
+	return *median;
+}
+
+std::atomic<const codec_profile *> best_profile = &profiles[0];
+std::atomic<bool> quit = false;
+std::thread probe_thread;
+
+void probe(std::filesystem::path cache_file, std::string model)
+{
+	const codec_profile * best = nullptr;
+	double best_latency = std::numeric_limits<double>::infinity();
+	for (const auto & profile: profiles)
+	{
+		if (quit)
+			return;
+		auto latency = measure(profile);
+		if (not latency)
+		{
+			spdlog::info("Decoder profile {}: failed", profile.name);
+			continue;
+		}
+		spdlog::info("Decoder profile {}: {:.1f}ms", profile.name, *latency);
+		if (*latency < best_latency - probe_margin)
+		{
+			best = &profile;
+			best_latency = *latency;
+		}
+	}
+	if (not best)
+		return;
+
+	spdlog::info("Using decoder profile {}", best->name);
+	best_profile = best;
+	std::ofstream cache(cache_file);
+	cache << model << "\n"
+	      << best->name << "\n";
+}
+} // namespace
+
+void codec_profile::apply(AMediaFormat * format, float fps) const
+{
+	AMediaFormat_setInt32(format, AMEDIAFORMAT_KEY_PRIORITY, 0); // realtime
+	AMediaFormat_setInt32(format, AMEDIAFORMAT_KEY_OPERATING_RATE, max_operating_rate ? std::numeric_limits<int16_t>::max() : int32_t(std::ceil(fps)));
+	if (low_latency)
+		AMediaFormat_setInt32(format, "low-latency", 1);
+	if (vendor_low_latency)
+	{
+		AMediaFormat_setInt32(format, "vendor.qti-ext-dec-low-latency.enable", 1);
+		AMediaFormat_setInt32(format, "vendor.qti-ext-dec-picture-order.enable", 1);
+		AMediaFormat_setInt32(format, "vendor.hisi-ext-low-latency-video-dec.video-scene-for-low-latency-req", 1);
+		AMediaFormat_setInt32(format, "vendor.rtc-ext-dec-low-latency.enable", 1);
+		AMediaFormat_setInt32(format, "vendor.low-latency.enable", 1);
+	}
+}
+
+void decoder_probe::start(const std::filesystem::path & cache_dir)
+{
+	auto cache_file = cache_dir / "decoder_profile";
+	auto model = device_model();
+
+	std::ifstream cache(cache_file);
+	std::string cached_model;
+	std::string cached_profile;
+	if (std::getline(cache, cached_model) and std::getline(cache, cached_profile) and cached_model == model)
+	{
+		for (const auto & profile: profiles)
+		{
+			if (profile.name == cached_profile)
+			{
+				spdlog::info("Using cached decoder profile {}", profile.name);
+				best_profile = &profile;
+				return;
+			}
+		}
+	}
+
+	quit = false;
+	probe_thread = utils::named_thread("decoder_probe", probe, cache_file, model);
+}
+
+void decoder_probe::stop()
+{
+	quit = true;
+	if (probe_thread.joinable())
+		probe_thread.join();
+}
+
+const codec_profile & decoder_probe::best()
+{
+	return *best_profile;
+}
+} // namespace wivrn::android
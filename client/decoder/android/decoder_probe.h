@@ -0,0 +1,53 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <filesystem>
+#include <media/NdkMediaFormat.h>
+
+namespace wivrn::android
+{
+// Options to reduce the decoding latency, their effect depends on the device
+struct codec_profile
+{
+	const char * name;
+	// KEY_LOW_LATENCY, Android 11 and later
+	bool low_latency;
+	// Low latency keys of the Qualcomm, HiSilicon, MediaTek and other decoders, ignored by the others
+	bool vendor_low_latency;
+	// Ask for the highest clocks instead of the stream frame rate
+	bool max_operating_rate;
+
+	void apply(AMediaFormat *, float fps) const;
+};
+
+// Measures the latency of each profile by decoding a short synthetic stream.
+// The best profile is cached for the device model, the probe only runs when it changes.
+namespace decoder_probe
+{
+// Loads the cached result, or starts the probe in the background
+void start(const std::filesystem::path & cache_dir);
+// Waits for the probe to finish
+void stop();
+// Profile to use, the default one while the probe is running
+const codec_profile & best();
+} // namespace decoder_probe
+} // namespace wivrn::android
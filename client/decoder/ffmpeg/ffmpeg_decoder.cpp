@@ -19,9 +19,16 @@
 
 #include "ffmpeg_decoder.h"
 
+#include "application.h"
 #include "scenes/stream.h"
 #include "spdlog/spdlog.h"
+#include <algorithm>
 #include <cassert>
+#include <cstdlib>
+#include <string_view>
+#include <strings.h>
+#include <system_error>
+#include <unistd.h>
 #include <vulkan/vulkan.hpp>
 
 extern "C"
@@ -29,7 +36,9 @@ extern "C"
 #include <libavcodec/avcodec.h>
 #include <libavutil/buffer.h>
 #include <libavutil/hwcontext.h>
+#include <libavutil/hwcontext_drm.h>
 #include <libavutil/hwcontext_vulkan.h>
+#include <libavutil/pixdesc.h>
 #include <libswscale/swscale.h>
 }
 
@@ -45,18 +54,72 @@ static void free_frame(AVFrame * frame)
 	av_frame_free(&frame);
 }
 
+// Tried in order, unless WIVRN_HWDEC is set to a device type or "none"
+static const AVHWDeviceType hw_device_types[] = {
+        AV_HWDEVICE_TYPE_VAAPI,
+        AV_HWDEVICE_TYPE_VULKAN,
+        AV_HWDEVICE_TYPE_CUDA,
+};
+
+static AVPixelFormat get_format(AVCodecContext * ctx, const AVPixelFormat * formats)
+{
+	int hw_pix_fmt = *(int *)ctx->opaque;
+	for (const AVPixelFormat * i = formats; *i != AV_PIX_FMT_NONE; ++i)
+	{
+		if (*i == hw_pix_fmt)
+			return *i;
+	}
+
+	spdlog::warn("Hardware decoding is not available for this stream, using software decoding");
+	return avcodec_default_get_format(ctx, formats);
+}
+
+static vk::Format vulkan_format(AVPixelFormat format)
+{
+	switch (format)
+	{
+		case AV_PIX_FMT_NV12:
+			return vk::Format::eG8B8R82Plane420Unorm;
+		case AV_PIX_FMT_P010:
+			return vk::Format::eG10X6B10X6R10X62Plane420Unorm3Pack16;
+		default:
+			return vk::Format::eUndefined;
+	}
+}
+
 static AVCodecID codec_id(xrt::drivers::wivrn::video_codec codec)
 {
 	using c = xrt::drivers::wivrn::video_codec;
 	switch (codec)
 	{
+		case c::h264:
+			return AV_CODEC_ID_H264;
 		case c::h265:
 			return AV_CODEC_ID_HEVC;
+		case c::av1:
+			return AV_CODEC_ID_AV1;
 	}
 	assert(false);
 	__builtin_unreachable();
 }
 
+std::vector<xrt::drivers::wivrn::video_codec> decoder::supported_codecs()
+{
+	using c = xrt::drivers::wivrn::video_codec;
+	std::vector<c> result;
+	for (auto codec: {c::h264, c::h265, c::av1})
+	{
+		if (avcodec_find_decoder(codec_id(codec)))
+			result.push_back(codec);
+	}
+	return result;
+}
+
+void decoder::get_capabilities(xrt::drivers::wivrn::from_headset::headset_info_packet::decoder_info & info, uint32_t width, uint32_t height)
+{
+	// libavcodec does not report limits, software decoding is only bound by the CPU
+}
+
 decoder::blit_handle::~blit_handle()
 {
 	std::unique_lock lock(self->mutex);
@@ -74,7 +137,7 @@ decoder::decoder(
         uint8_t stream_index,
         std::weak_ptr<scenes::stream> scene,
         shard_accumulator * accumulator) :
-        device(device), description(description), codec(nullptr, free_codec_context), sws(nullptr, sws_freeContext), weak_scene(scene), accumulator(accumulator)
+        device(device), physical_device(physical_device), description(description), codec(nullptr, free_codec_context), sws(nullptr, sws_freeContext), weak_scene(scene), accumulator(accumulator)
 {
 	free_images.resize(image_count);
 
@@ -101,7 +164,7 @@ decoder::decoder(
 		VmaAllocationCreateInfo alloc_info{
 		        .requiredFlags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT};
 
-		decoded_images[i].image = image_allocation(device, image_info, alloc_info);
+		decoded_images[i].image = image_allocation(device, image_info, alloc_info, memory_pool::frame, "decoded frame");
 
 		decoded_images[i].image.map();
 		extent = vk::Extent2D{description.width, description.height};
@@ -136,11 +199,21 @@ decoder::decoder(
 	}
 
 	codec.reset(avcodec_alloc_context3(avcodec));
+	init_hwaccel();
+
+	// Frame threading delays the output by as many frames as threads, slice threading does not
+	pool = thread_pool::shared();
+	codec->thread_type = FF_THREAD_SLICE;
+	codec->thread_count = pool->size();
+	codec->flags |= AV_CODEC_FLAG_LOW_DELAY;
 
 	int ret = avcodec_open2(codec.get(), avcodec, nullptr);
 	if (ret < 0)
 		throw std::runtime_error{"avcodec_open2 failed"};
 
+	if (codec->active_thread_type & FF_THREAD_SLICE)
+		pool->attach(*codec);
+
 	rgb_sampler = vk::raii::Sampler(
 	        device,
 	        {
@@ -153,10 +226,277 @@ decoder::decoder(
 	                .addressModeW = vk::SamplerAddressMode::eClampToEdge,
 	                .unnormalizedCoordinates = false,
 	        });
+
+	if (hw_pix_fmt < 0)
+		current_sampler = *rgb_sampler;
+}
+
+void decoder::init_hwaccel()
+{
+	std::vector<AVHWDeviceType> types;
+	if (const char * env = std::getenv("WIVRN_HWDEC"))
+	{
+		if (std::string_view(env) == "none")
+			return;
+
+		AVHWDeviceType type = av_hwdevice_find_type_by_name(env);
+		if (type == AV_HWDEVICE_TYPE_NONE)
+		{
+			spdlog::warn("Unknown hardware decoder {}, using software decoding", env);
+			return;
+		}
+		types.push_back(type);
+	}
+	else
+		types.assign(std::begin(hw_device_types), std::end(hw_device_types));
+
+	for (AVHWDeviceType type: types)
+	{
+		const AVCodecHWConfig * config = nullptr;
+		for (int i = 0; (config = avcodec_get_hw_config(codec->codec, i)); ++i)
+		{
+			if (config->device_type == type and config->methods & AV_CODEC_HW_CONFIG_METHOD_HW_DEVICE_CTX)
+				break;
+		}
+		if (not config)
+			continue;
+
+		AVBufferRef * hw_device = nullptr;
+		if (av_hwdevice_ctx_create(&hw_device, type, nullptr, nullptr, 0) < 0)
+		{
+			spdlog::info("Failed to create {} device for hardware decoding", av_hwdevice_get_type_name(type));
+			continue;
+		}
+
+		// Owned by the codec context
+		codec->hw_device_ctx = hw_device;
+		codec->get_format = get_format;
+		codec->opaque = &hw_pix_fmt;
+		// Decoded surfaces are held by the blit pipeline while displayed
+		codec->extra_hw_frames = image_count;
+		hw_pix_fmt = config->pix_fmt;
+
+		zero_copy = application::vulkan_device_extension_enabled(VK_EXT_IMAGE_DRM_FORMAT_MODIFIER_EXTENSION_NAME);
+		spdlog::info("Using {} hardware decoding, {}", av_hwdevice_get_type_name(type), zero_copy ? "frames are imported without copy" : "frames are copied");
+		return;
+	}
+
+	spdlog::info("No hardware decoder available, using software decoding");
+}
+
+void decoder::create_ycbcr_sampler(const AVFrame & frame)
+{
+	vk::FormatFeatureFlags features = physical_device.getFormatProperties(zero_copy_format).optimalTilingFeatures;
+
+	vk::Filter yuv_filter;
+	if (features & vk::FormatFeatureFlagBits::eSampledImageYcbcrConversionLinearFilter)
+		yuv_filter = vk::Filter::eLinear;
+	else
+		yuv_filter = vk::Filter::eNearest;
+
+	vk::SamplerYcbcrConversionCreateInfo ycbcr_create_info{
+	        .format = zero_copy_format,
+	        .ycbcrRange = frame.color_range == AVCOL_RANGE_JPEG ? vk::SamplerYcbcrRange::eItuFull : vk::SamplerYcbcrRange::eItuNarrow,
+	        .components = {},
+	        .xChromaOffset = features & vk::FormatFeatureFlagBits::eCositedChromaSamples ? vk::ChromaLocation::eCositedEven : vk::ChromaLocation::eMidpoint,
+	        .yChromaOffset = vk::ChromaLocation::eMidpoint,
+	        .chromaFilter = yuv_filter,
+	};
+
+	switch (frame.colorspace)
+	{
+		case AVCOL_SPC_BT709:
+			ycbcr_create_info.ycbcrModel = vk::SamplerYcbcrModelConversion::eYcbcr709;
+			break;
+		case AVCOL_SPC_BT2020_NCL:
+		case AVCOL_SPC_BT2020_CL:
+			ycbcr_create_info.ycbcrModel = vk::SamplerYcbcrModelConversion::eYcbcr2020;
+			break;
+		default:
+			ycbcr_create_info.ycbcrModel = vk::SamplerYcbcrModelConversion::eYcbcr601;
+			break;
+	}
+
+	if (description.range)
+		ycbcr_create_info.ycbcrRange = vk::SamplerYcbcrRange(*description.range);
+
+	if (description.color_model)
+		ycbcr_create_info.ycbcrModel = vk::SamplerYcbcrModelConversion(*description.color_model);
+
+	ycbcr_conversion = vk::raii::SamplerYcbcrConversion(device, ycbcr_create_info);
+
+	vk::StructureChain sampler_info{
+	        vk::SamplerCreateInfo{
+	                .magFilter = yuv_filter,
+	                .minFilter = yuv_filter,
+	                .mipmapMode = vk::SamplerMipmapMode::eNearest,
+	                .addressModeU = vk::SamplerAddressMode::eClampToEdge,
+	                .addressModeV = vk::SamplerAddressMode::eClampToEdge,
+	                .addressModeW = vk::SamplerAddressMode::eClampToEdge,
+	                .mipLodBias = 0.0f,
+	                .anisotropyEnable = VK_FALSE,
+	                .maxAnisotropy = 1,
+	                .compareEnable = VK_FALSE,
+	                .compareOp = vk::CompareOp::eNever,
+	                .minLod = 0.0f,
+	                .maxLod = 0.0f,
+	                .borderColor = vk::BorderColor::eFloatOpaqueWhite,
+	                .unnormalizedCoordinates = VK_FALSE,
+	        },
+	        vk::SamplerYcbcrConversionInfo{
+	                .conversion = *ycbcr_conversion,
+	        },
+	};
+
+	ycbcr_sampler = vk::raii::Sampler(device, sampler_info.get<vk::SamplerCreateInfo>());
+}
+
+std::shared_ptr<decoder::mapped_frame> decoder::import_drm(const AVDRMFrameDescriptor & desc, uint32_t width, uint32_t height)
+{
+	// All planes must be in a single dma-buf, disjoint images are not supported
+	std::vector<vk::SubresourceLayout> planes;
+	int object = -1;
+	for (int i = 0; i < desc.nb_layers; ++i)
+	{
+		for (int j = 0; j < desc.layers[i].nb_planes; ++j)
+		{
+			const AVDRMPlaneDescriptor & plane = desc.layers[i].planes[j];
+			if (object >= 0 and plane.object_index != object)
+				throw std::runtime_error("planes of the frame are in separate objects");
+			object = plane.object_index;
+			planes.push_back({
+			        .offset = (vk::DeviceSize)plane.offset,
+			        .rowPitch = (vk::DeviceSize)plane.pitch,
+			});
+		}
+	}
+	if (planes.size() != 2)
+		throw std::runtime_error("unexpected number of planes: " + std::to_string(planes.size()));
+
+	const AVDRMObjectDescriptor & dma_buf = desc.objects[object];
+
+	vk::StructureChain image_info{
+	        vk::ImageCreateInfo{
+	                .flags = {},
+	                .imageType = vk::ImageType::e2D,
+	                .format = zero_copy_format,
+	                .extent = {width, height, 1},
+	                .mipLevels = 1,
+	                .arrayLayers = 1,
+	                .samples = vk::SampleCountFlagBits::e1,
+	                .tiling = vk::ImageTiling::eDrmFormatModifierEXT,
+	                .usage = vk::ImageUsageFlagBits::eSampled,
+	                .sharingMode = vk::SharingMode::eExclusive,
+	                .initialLayout = vk::ImageLayout::eUndefined,
+	        },
+	        vk::ExternalMemoryImageCreateInfo{
+	                .handleTypes = vk::ExternalMemoryHandleTypeFlagBits::eDmaBufEXT,
+	        },
+	        vk::ImageDrmFormatModifierExplicitCreateInfoEXT{
+	                .drmFormatModifier = dma_buf.format_modifier,
+	                .drmFormatModifierPlaneCount = (uint32_t)planes.size(),
+	                .pPlaneLayouts = planes.data(),
+	        },
+	};
+
+	auto result = std::make_shared<mapped_frame>();
+	result->image = vk::raii::Image(device, image_info.get());
+
+	// Vulkan takes ownership of the file descriptor on success
+	int fd = dup(dma_buf.fd);
+	if (fd < 0)
+		throw std::system_error(errno, std::system_category(), "dup");
+
+	try
+	{
+		vk::MemoryFdPropertiesKHR fd_properties = device.getMemoryFdPropertiesKHR(vk::ExternalMemoryHandleTypeFlagBits::eDmaBufEXT, fd);
+		vk::MemoryRequirements requirements = result->image.getMemoryRequirements();
+		uint32_t memory_type_bits = fd_properties.memoryTypeBits & requirements.memoryTypeBits;
+		if (memory_type_bits == 0)
+			throw std::runtime_error("no memory type to import the frame");
+
+		vk::StructureChain mem_info{
+		        vk::MemoryAllocateInfo{
+		                .allocationSize = std::max<vk::DeviceSize>(dma_buf.size, requirements.size),
+		                .memoryTypeIndex = (uint32_t)(ffs(memory_type_bits) - 1),
+		        },
+		        vk::MemoryDedicatedAllocateInfo{
+		                .image = *result->image,
+		        },
+		        vk::ImportMemoryFdInfoKHR{
+		                .handleType = vk::ExternalMemoryHandleTypeFlagBits::eDmaBufEXT,
+		                .fd = fd,
+		        },
+		};
+
+		result->memory = vk::raii::DeviceMemory(device, mem_info.get());
+	}
+	catch (...)
+	{
+		close(fd);
+		throw;
+	}
+
+	result->image.bindMemory(*result->memory, 0);
+
+	vk::StructureChain iv_info{
+	        vk::ImageViewCreateInfo{
+	                .image = *result->image,
+	                .viewType = vk::ImageViewType::e2D,
+	                .format = zero_copy_format,
+	                .subresourceRange = {
+	                        .aspectMask = vk::ImageAspectFlagBits::eColor,
+	                        .baseMipLevel = 0,
+	                        .levelCount = 1,
+	                        .baseArrayLayer = 0,
+	                        .layerCount = 1,
+	                },
+	        },
+	        vk::SamplerYcbcrConversionInfo{
+	                .conversion = *ycbcr_conversion,
+	        },
+	};
+
+	result->image_view = vk::raii::ImageView(device, iv_info.get());
+	return result;
+}
+
+std::shared_ptr<decoder::mapped_frame> decoder::map_frame(AVFrame & frame)
+{
+	// Mapping also waits for the decoder to finish writing the surface
+	std::unique_ptr<AVFrame, void (*)(AVFrame *)> drm_frame(av_frame_alloc(), free_frame);
+	drm_frame->format = AV_PIX_FMT_DRM_PRIME;
+	if (int res = av_hwframe_map(drm_frame.get(), &frame, AV_HWFRAME_MAP_READ); res < 0)
+		throw std::runtime_error("av_hwframe_map failed: " + std::to_string(res));
+
+	if (not *ycbcr_sampler)
+	{
+		auto frames_ctx = (const AVHWFramesContext *)frame.hw_frames_ctx->data;
+		zero_copy_format = vulkan_format(frames_ctx->sw_format);
+		if (zero_copy_format == vk::Format::eUndefined)
+			throw std::runtime_error(std::string("unsupported pixel format ") + av_get_pix_fmt_name(frames_ctx->sw_format));
+		create_ycbcr_sampler(frame);
+		extent = vk::Extent2D(frame.width, frame.height);
+	}
+
+	const void * surface = frame.buf[0]->data;
+	if (auto it = mapped_frames.find(surface); it != mapped_frames.end())
+		return it->second;
+
+	// The pool of surfaces should be fixed, do not keep stale imports if it is not
+	if (mapped_frames.size() >= 2 * image_count)
+		mapped_frames.clear();
+
+	auto mapped = import_drm(*(const AVDRMFrameDescriptor *)drm_frame->data[0], frame.width, frame.height);
+	mapped_frames.emplace(surface, mapped);
+	return mapped;
 }
 
 void decoder::push_data(std::span<std::span<const uint8_t>> data, uint64_t frame_index, bool partial)
 {
+	// Slices are accumulated until frame_completed, discard those of a frame that was not completed
+	if (frame_index != this->frame_index)
+		packet.clear();
 	for (const auto & d: data)
 		packet.insert(packet.end(), d.begin(), d.end());
 	this->frame_index = frame_index;
@@ -185,7 +525,7 @@ void decoder::frame_completed(const xrt::drivers::wivrn::from_headset::feedback
 	if (res < 0)
 		throw std::runtime_error{"avcodec_send_packet failed"};
 
-	std::unique_ptr<AVFrame, void (*)(AVFrame *)> frame(av_frame_alloc(), free_frame);
+	std::shared_ptr<AVFrame> frame(av_frame_alloc(), free_frame);
 	res = avcodec_receive_frame(codec.get(), frame.get());
 	if (res == AVERROR(EAGAIN))
 		return;
@@ -194,6 +534,51 @@ void decoder::frame_completed(const xrt::drivers::wivrn::from_headset::feedback
 
 	this->packet.clear();
 
+	if (frame->format == hw_pix_fmt and zero_copy)
+	{
+		try
+		{
+			auto vk_data = map_frame(*frame);
+			auto handle = std::make_shared<decoder::blit_handle>(
+			        feedback,
+			        timing_info,
+			        view_info,
+			        vk_data->image_view,
+			        *vk_data->image,
+			        &vk_data->current_layout,
+			        -1,
+			        this,
+			        vk_data,
+			        frame);
+
+			current_sampler = *ycbcr_sampler;
+			if (auto scene = weak_scene.lock())
+				scene->push_blit_handle(accumulator, std::move(handle));
+			return;
+		}
+		catch (std::exception & e)
+		{
+			// The blit pipeline is created with the sampler of the first frame, it cannot change afterwards
+			if (current_sampler)
+			{
+				spdlog::warn("Failed to import hardware decoded frame: {}", e.what());
+				return;
+			}
+			spdlog::warn("Failed to import hardware decoded frame, frames will be copied: {}", e.what());
+			zero_copy = false;
+		}
+	}
+
+	if (frame->format == hw_pix_fmt)
+	{
+		std::shared_ptr<AVFrame> sw_frame(av_frame_alloc(), free_frame);
+		if (av_hwframe_transfer_data(sw_frame.get(), frame.get(), 0) < 0)
+			throw std::runtime_error{"av_hwframe_transfer_data failed"};
+		frame = std::move(sw_frame);
+	}
+
+	current_sampler = *rgb_sampler;
+
 	if (!sws)
 	{
 		sws.reset(sws_getContext(frame->width, frame->height, (AVPixelFormat)frame->format, description.width, description.height, AV_PIX_FMT_RGB0, SWS_BILINEAR, nullptr, nullptr, nullptr));
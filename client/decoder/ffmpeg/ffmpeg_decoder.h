@@ -19,11 +19,13 @@
 
 #pragma once
 
+#include "thread_pool.h"
 #include "vk/allocation.h"
 #include "wivrn_packets.h"
 #include <memory>
 #include <mutex>
 #include <span>
+#include <unordered_map>
 #include <vector>
 #include <vulkan/vulkan_raii.hpp>
 
@@ -33,6 +35,8 @@ extern "C"
 {
 	struct AVBufferRef;
 	struct AVCodecContext;
+	struct AVDRMFrameDescriptor;
+	struct AVFrame;
 	struct SwsContext;
 }
 
@@ -46,6 +50,15 @@ namespace ffmpeg
 class decoder
 {
 public:
+	// dma-buf of a hardware decoded frame imported in Vulkan
+	struct mapped_frame
+	{
+		vk::raii::Image image = nullptr;
+		vk::raii::DeviceMemory memory = nullptr;
+		vk::raii::ImageView image_view = nullptr;
+		vk::ImageLayout current_layout = vk::ImageLayout::eUndefined;
+	};
+
 	struct blit_handle
 	{
 		xrt::drivers::wivrn::from_headset::feedback feedback;
@@ -58,6 +71,14 @@ public:
 		int image_index;
 		decoder * self;
 
+		// Only for hardware decoded frames, the surface is not reused by the decoder while it is held
+		std::shared_ptr<mapped_frame> vk_data;
+		std::shared_ptr<AVFrame> frame;
+
+		// Always null, the images are complete when the handle is created
+		vk::raii::Semaphore semaphore = nullptr;
+		bool semaphore_waited = false;
+
 		~blit_handle();
 	};
 
@@ -73,14 +94,30 @@ private:
 	};
 
 	vk::raii::Device & device;
+	vk::raii::PhysicalDevice & physical_device;
 	vk::raii::Sampler rgb_sampler = nullptr;
 
+	// Sampler used by the blit pipeline, chosen when the first frame is decoded
+	vk::Sampler current_sampler = nullptr;
+
+	// Hardware decoding, AVPixelFormat of the frames or -1 for software decoding
+	int hw_pix_fmt = -1;
+	// Hardware frames are imported without copy, until an import fails
+	bool zero_copy = false;
+	vk::Format zero_copy_format = vk::Format::eUndefined;
+	vk::raii::SamplerYcbcrConversion ycbcr_conversion = nullptr;
+	vk::raii::Sampler ycbcr_sampler = nullptr;
+	// Keyed by the buffer of the hardware surface, surfaces are recycled by the decoder
+	std::unordered_map<const void *, std::shared_ptr<mapped_frame>> mapped_frames;
+
 	std::array<image, image_count> decoded_images;
 	vk::Extent2D extent{};
 	std::vector<int> free_images;
 
 	xrt::drivers::wivrn::to_headset::video_stream_description::item description;
 
+	// Decodes the slices of software decoded frames, kept alive until the codec context is freed
+	std::shared_ptr<thread_pool> pool;
 	std::unique_ptr<AVCodecContext, void (*)(AVCodecContext *)> codec;
 	std::unique_ptr<SwsContext, void (*)(SwsContext *)> sws;
 	std::vector<uint8_t> packet;
@@ -90,6 +127,11 @@ private:
 
 	std::mutex mutex;
 
+	void init_hwaccel();
+	void create_ycbcr_sampler(const AVFrame & frame);
+	std::shared_ptr<mapped_frame> import_drm(const AVDRMFrameDescriptor & desc, uint32_t width, uint32_t height);
+	std::shared_ptr<mapped_frame> map_frame(AVFrame & frame);
+
 public:
 	decoder(vk::raii::Device & device,
 	        vk::raii::PhysicalDevice & physical_device,
@@ -116,12 +158,18 @@ public:
 
 	vk::Sampler sampler()
 	{
-		return *rgb_sampler;
+		return current_sampler;
 	}
 
 	vk::Extent2D image_size()
 	{
 		return extent;
 	}
+
+	// codecs for which a decoder is available
+	static std::vector<xrt::drivers::wivrn::video_codec> supported_codecs();
+
+	// limits of the decoder for info.codec, for a stream of the given size
+	static void get_capabilities(xrt::drivers::wivrn::from_headset::headset_info_packet::decoder_info & info, uint32_t width, uint32_t height);
 };
 } // namespace ffmpeg
@@ -0,0 +1,179 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "thread_pool.h"
+
+#include <algorithm>
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+}
+
+namespace ffmpeg
+{
+namespace
+{
+// More threads than slices in a frame would be idle
+const int max_threads = 16;
+
+// The pool returned by thread_pool::shared, there is at most one at a time
+std::mutex shared_mutex;
+std::weak_ptr<thread_pool> shared_pool;
+thread_pool * current_pool = nullptr;
+
+struct batch
+{
+	std::function<void(int, int)> func;
+	int count;
+	std::atomic<int> next_job = 0;
+
+	std::mutex mutex;
+	std::condition_variable cv;
+	// Helpers currently running jobs
+	int active = 0;
+	// All jobs have been taken, helpers that did not start yet have nothing to do
+	bool closed = false;
+
+	batch(std::function<void(int, int)> func, int count) :
+	        func(std::move(func)), count(count) {}
+
+	void work(int thread)
+	{
+		for (int job; (job = next_job++) < count;)
+			func(job, thread);
+	}
+};
+
+int execute(AVCodecContext * ctx, int (*func)(AVCodecContext *, void *), void * arg, int * ret, int count, int size)
+{
+	current_pool->execute(count, [&](int job, int) {
+		int r = func(ctx, (char *)arg + job * size);
+		if (ret)
+			ret[job] = r;
+	});
+	return 0;
+}
+
+int execute2(AVCodecContext * ctx, int (*func)(AVCodecContext *, void *, int, int), void * arg, int * ret, int count)
+{
+	current_pool->execute(count, [&](int job, int thread) {
+		int r = func(ctx, arg, job, thread);
+		if (ret)
+			ret[job] = r;
+	});
+	return 0;
+}
+} // namespace
+
+thread_pool::thread_pool(int size)
+{
+	for (int i = 1; i < size; ++i)
+		threads.emplace_back([this]() { run(); });
+}
+
+thread_pool::~thread_pool()
+{
+	{
+		std::lock_guard lock(mutex);
+		quit = true;
+	}
+	cv.notify_all();
+	for (auto & thread: threads)
+		thread.join();
+	std::lock_guard lock(shared_mutex);
+	if (current_pool == this)
+		current_pool = nullptr;
+}
+
+void thread_pool::run()
+{
+	std::unique_lock lock(mutex);
+	while (true)
+	{
+		cv.wait(lock, [this]() { return quit or not tasks.empty(); });
+		if (quit)
+			return;
+		auto task = std::move(tasks.front());
+		tasks.pop_front();
+		lock.unlock();
+		task();
+		lock.lock();
+	}
+}
+
+void thread_pool::execute(int count, std::function<void(int job, int thread)> func)
+{
+	int helpers = std::min(count, size()) - 1;
+	if (helpers <= 0)
+	{
+		for (int job = 0; job < count; ++job)
+			func(job, 0);
+		return;
+	}
+
+	auto b = std::make_shared<batch>(std::move(func), count);
+	{
+		std::lock_guard lock(mutex);
+		for (int i = 1; i <= helpers; ++i)
+		{
+			tasks.push_back([b, i]() {
+				{
+					std::lock_guard lock(b->mutex);
+					if (b->closed)
+						return;
+					b->active++;
+				}
+				b->work(i);
+				std::lock_guard lock(b->mutex);
+				if (--b->active == 0)
+					b->cv.notify_all();
+			});
+		}
+	}
+	cv.notify_all();
+
+	// Do not wait for helpers busy with another decoder: the jobs left are done here
+	b->work(0);
+	std::unique_lock lock(b->mutex);
+	b->closed = true;
+	b->cv.wait(lock, [&]() { return b->active == 0; });
+}
+
+void thread_pool::attach(AVCodecContext & ctx)
+{
+	ctx.execute = ffmpeg::execute;
+	ctx.execute2 = ffmpeg::execute2;
+}
+
+std::shared_ptr<thread_pool> thread_pool::shared()
+{
+	std::lock_guard lock(shared_mutex);
+	auto pool = shared_pool.lock();
+	if (not pool)
+	{
+		int size = std::clamp<int>(std::thread::hardware_concurrency(), 1, max_threads);
+		pool = std::make_shared<thread_pool>(size);
+		shared_pool = pool;
+		current_pool = pool.get();
+	}
+	return pool;
+}
+} // namespace ffmpeg
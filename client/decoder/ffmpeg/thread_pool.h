@@ -0,0 +1,73 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+extern "C"
+{
+	struct AVCodecContext;
+}
+
+namespace ffmpeg
+{
+// Worker threads shared by the software decoders of all the stream items, used by libavcodec
+// to decode the slices of a frame in parallel instead of each decoder creating its own threads.
+class thread_pool
+{
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::deque<std::function<void()>> tasks;
+	bool quit = false;
+	std::vector<std::thread> threads;
+
+	void run();
+
+public:
+	explicit thread_pool(int size);
+	thread_pool(const thread_pool &) = delete;
+	thread_pool & operator=(const thread_pool &) = delete;
+	~thread_pool();
+
+	// Number of jobs that can run in parallel, including the calling thread
+	int size() const
+	{
+		return threads.size() + 1;
+	}
+
+	// Calls func(job, thread) for each job in [0, count) and returns when they are all done.
+	// The calling thread takes part, thread is in [0, size()) and unique among the jobs running concurrently.
+	void execute(int count, std::function<void(int job, int thread)> func);
+
+	// Created by the first decoder, destroyed with the last one
+	static std::shared_ptr<thread_pool> shared();
+
+	// Replaces the execute callbacks of a codec context opened with thread_count = size(),
+	// the pool must be the shared one
+	void attach(AVCodecContext & ctx);
+};
+} // namespace ffmpeg
@@ -19,23 +19,46 @@
 
 #include "shard_accumulator.h"
 #include "application.h"
+#include "reed_solomon.h"
 #include "scenes/stream.h"
 #include "spdlog/spdlog.h"
 
+#include <algorithm>
+#include <chrono>
+#include <limits>
+
 using namespace xrt::drivers::wivrn::to_headset;
 using shard_set = shard_accumulator::shard_set;
 using data_shard = shard_accumulator::data_shard;
+using parity_shard = shard_accumulator::parity_shard;
 
 shard_set::shard_set(uint8_t stream_index)
 {
 	feedback.stream_index = stream_index;
 }
 
+// Larger shards are invalid, so that a corrupted offset cannot allocate too much memory
+static const size_t max_frame_size = 64 * 1024 * 1024;
+
+// Gaps are only requested again after this delay, shards reordered by the network usually arrive within it
+static const XrDuration nack_delay = 2'000'000;
+
 void shard_set::reset(uint64_t frame_index)
 {
 	num_shards = 0;
-	min_for_reconstruction = -1;
-	data.clear();
+	frame_size = 0;
+	end_shard = 0;
+	std::ranges::fill(received, 0);
+	shards.clear();
+	view_info.reset();
+	timing_info.reset();
+	parity.clear();
+	blocks.clear();
+	contiguous_shards = 0;
+	next_slice_shard = 0;
+	next_expected_shard = 0;
+	gaps.clear();
+	non_reference = false;
 
 	uint8_t stream_index = feedback.stream_index;
 	feedback = {};
@@ -48,110 +71,455 @@ bool shard_set::empty() const
 	return num_shards == 0;
 }
 
-static bool is_complete(const shard_set & shards)
+bool shard_set::has(uint16_t shard_idx) const
+{
+	size_t word = shard_idx / 64;
+	return word < received.size() and (received[word] >> (shard_idx % 64)) & 1;
+}
+
+bool shard_set::complete() const
+{
+	if (end_shard == 0 or num_shards != end_shard)
+		return false;
+	size_t full_words = end_shard / 64;
+	for (size_t i = 0; i < full_words; ++i)
+	{
+		if (received[i] != ~uint64_t(0))
+			return false;
+	}
+	if (size_t remainder = end_shard % 64)
+		return received[full_words] == (uint64_t(1) << remainder) - 1;
+	return true;
+}
+
+bool shard_set::store(const data_shard & shard)
 {
-	const auto & frame = shards.data;
-	if (frame.empty())
+	auto idx = shard.shard_idx;
+	if (has(idx) or (end_shard and idx >= end_shard))
 		return false;
-	if (not(frame.back() and frame.back()->flags & video_stream_data_shard::end_of_frame))
+
+	size_t end = size_t(shard.offset) + shard.payload.size();
+	if (end > max_frame_size)
+	{
+		spdlog::warn("Invalid shard {} for frame {}: offset {}, size {}", idx, frame_index(), shard.offset, shard.payload.size());
 		return false;
-	for (const auto & shard: frame)
-		if (not shard)
+	}
+	if (shard.flags & video_stream_data_shard::end_of_frame)
+	{
+		// Shards after the end of frame cannot be valid
+		if (idx < shards.size())
+		{
+			spdlog::warn("Invalid end of frame shard {} for frame {}", idx, frame_index());
 			return false;
+		}
+		end_shard = idx + 1;
+		frame_size = end;
+	}
+
+	if (payload.size() < end)
+		payload.resize(std::max(end, 2 * payload.size()));
+	std::ranges::copy(shard.payload, payload.begin() + shard.offset);
+
+	if (idx / 64 >= received.size())
+		received.resize(idx / 64 + 1);
+	received[idx / 64] |= uint64_t(1) << (idx % 64);
+	if (idx >= shards.size())
+		shards.resize(idx + 1);
+	shards[idx] = {
+	        .offset = shard.offset,
+	        .size = uint16_t(shard.payload.size()),
+	        .flags = shard.flags,
+	};
+	if (shard.view_info)
+	{
+		view_info = shard.view_info;
+		view_info_shard = idx;
+	}
+	if (shard.timing_info)
+	{
+		timing_info = shard.timing_info;
+		timing_info_shard = idx;
+	}
+	if (shard.flags & video_stream_data_shard::non_reference)
+		non_reference = true;
+	++num_shards;
 	return true;
 }
 
 uint16_t shard_set::insert(data_shard && shard)
 {
 	XrTime now = application::now();
+	if (shard.receive_time)
+	{
+		// Time spent since the kernel received the datagram
+		int64_t monotonic = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+		now -= std::max<int64_t>(0, monotonic - shard.receive_time);
+	}
 	if (empty())
 		feedback.received_first_packet = now;
 	feedback.received_last_packet = now;
+	// Congestion Experienced
+	if (shard.ecn == 0x03)
+		++feedback.congestion_marks;
 
 	auto idx = shard.shard_idx;
-	if (idx >= data.size())
-		data.resize(idx + 1);
-	if (not data[idx])
-		++num_shards;
-	data[idx] = std::move(shard);
+	if (idx > next_expected_shard)
+	{
+		gaps.push_back({
+		        .first_shard = next_expected_shard,
+		        .shard_count = uint16_t(idx - next_expected_shard),
+		        .detected = now,
+		});
+	}
+	next_expected_shard = std::max<uint16_t>(next_expected_shard, idx + 1);
+
+	// The datagram buffer goes back to the pool when shard is destroyed
+	if (not store(shard))
+		return idx;
+
+	for (auto & block: blocks)
+	{
+		if (idx >= block.first_data_shard and idx < block.first_data_shard + block.data_shard_count)
+		{
+			++block.data_shards;
+			try_reconstruct(block);
+			break;
+		}
+	}
 	return idx;
 }
 
-static void debug_why_not_sent(const shard_set & shards)
+std::optional<uint16_t> shard_set::insert(parity_shard && shard)
 {
-	const auto & frame = shards.data;
-	if (frame.empty())
+	XrTime now = application::now();
+	if (empty())
+		feedback.received_first_packet = now;
+	feedback.received_last_packet = now;
+
+	if (shard.data_shard_count == 0)
+		return std::nullopt;
+
+	auto block = std::ranges::find(blocks, shard.first_data_shard, &parity_block::first_data_shard);
+	if (block == blocks.end())
 	{
-		spdlog::info("frame {} was not sent because no shard was received", shards.frame_index());
-		return;
+		uint8_t data_shards = 0;
+		for (size_t i = 0; i < shard.data_shard_count; ++i)
+			data_shards += has(shard.first_data_shard + i);
+		blocks.push_back({
+		        .first_data_shard = shard.first_data_shard,
+		        .data_shard_count = shard.data_shard_count,
+		        .data_shards = data_shards,
+		        .parity_shards = 0,
+		        .done = false,
+		});
+		block = std::prev(blocks.end());
+	}
+	else if (std::ranges::any_of(parity, [&](const parity_shard & p) { return p.first_data_shard == shard.first_data_shard and p.parity_idx == shard.parity_idx; }))
+		return std::nullopt;
+
+	++block->parity_shards;
+	parity.push_back(std::move(shard));
+	return try_reconstruct(*block);
+}
+
+bool shard_set::recoverable(uint16_t shard_idx) const
+{
+	for (const auto & block: blocks)
+	{
+		if (shard_idx >= block.first_data_shard and shard_idx < block.first_data_shard + block.data_shard_count)
+			return block.data_shards + block.parity_shards >= block.data_shard_count;
+	}
+	return false;
+}
+
+void shard_set::take_nacks(XrTime deadline, std::vector<xrt::drivers::wivrn::from_headset::video_stream_nack> & nacks)
+{
+	std::erase_if(gaps, [&](const gap & g) {
+		if (g.detected > deadline)
+			return false;
+
+		// Ranges of the gap that were neither received since nor can be rebuilt
+		std::optional<uint16_t> first;
+		const size_t end = size_t(g.first_shard) + g.shard_count;
+		for (size_t idx = g.first_shard; idx <= end; ++idx)
+		{
+			bool missing = idx < end and not has(idx) and not recoverable(idx);
+			if (missing and not first)
+				first = idx;
+			if (not missing and first)
+			{
+				nacks.push_back({
+				        .frame_index = frame_index(),
+				        .stream_index = feedback.stream_index,
+				        .first_shard = *first,
+				        .shard_count = uint16_t(idx - *first),
+				});
+				first.reset();
+			}
+		}
+		return true;
+	});
+}
+
+// Rebuilding the block is only worth it when the received data and parity shards
+// are enough to recover the missing ones, and the result does not change after that
+std::optional<uint16_t> shard_set::try_reconstruct(parity_block & block)
+{
+	if (block.done)
+		return std::nullopt;
+	if (block.data_shards >= block.data_shard_count)
+	{
+		block.done = true;
+		return std::nullopt;
+	}
+	if (block.data_shards + block.parity_shards < block.data_shard_count)
+		return std::nullopt;
+
+	block.done = true;
+	return reconstruct(block.first_data_shard);
+}
+
+std::optional<uint16_t> shard_set::reconstruct(uint16_t first_data_shard)
+{
+	size_t data_shard_count = 0;
+	size_t symbol_size = 0;
+	std::vector<std::pair<uint8_t, std::span<const uint8_t>>> block_parity;
+	for (const auto & p: parity)
+	{
+		if (p.first_data_shard != first_data_shard)
+			continue;
+		data_shard_count = p.data_shard_count;
+		symbol_size = std::max(symbol_size, p.payload.size());
+		block_parity.emplace_back(p.parity_idx, p.payload);
+	}
+
+	size_t missing = 0;
+	for (size_t i = 0; i < data_shard_count; ++i)
+	{
+		if (not has(first_data_shard + i))
+			++missing;
+	}
+	if (missing == 0 or missing > block_parity.size())
+		return std::nullopt;
+
+	// Data symbols are the serialized shards
+	std::vector<std::vector<uint8_t>> symbols(data_shard_count);
+	for (size_t i = 0; i < data_shard_count; ++i)
+	{
+		uint16_t idx = first_data_shard + i;
+		if (not has(idx))
+			continue;
+
+		const auto & info = shards[idx];
+		data_shard shard{
+		        .stream_item_idx = feedback.stream_index,
+		        .frame_idx = frame_index(),
+		        .shard_idx = idx,
+		        .flags = info.flags,
+		        .offset = info.offset,
+		        .payload = std::span(payload).subspan(info.offset, info.size),
+		};
+		if (view_info and view_info_shard == idx)
+			shard.view_info = view_info;
+		if (timing_info and timing_info_shard == idx)
+			shard.timing_info = timing_info;
+
+		xrt::drivers::wivrn::serialization_packet packet;
+		packet.serialize(shard);
+		symbols[i] = packet.flatten();
 	}
-	int frame_idx = -1;
-	size_t data = 0;
-	for (const auto & shard: frame)
+
+	if (not xrt::drivers::wivrn::reed_solomon::reconstruct(symbols, block_parity, symbol_size))
+		return std::nullopt;
+
+	std::optional<uint16_t> last_reconstructed;
+	for (size_t i = 0; i < data_shard_count; ++i)
 	{
-		if (shard)
+		uint16_t idx = first_data_shard + i;
+		if (has(idx))
+			continue;
+
+		try
 		{
-			frame_idx = shard->frame_idx;
-			++data;
+			xrt::drivers::wivrn::deserialization_packet packet(std::move(symbols[i]));
+			auto shard = packet.deserialize<data_shard>();
+			if (shard.shard_idx != 0)
+				shard.frame_idx = extend_frame_index(shard.frame_idx, frame_index());
+			if (shard.frame_idx != frame_index() or shard.shard_idx != idx)
+			{
+				spdlog::warn("Inconsistent reconstructed shard for frame {}", frame_index());
+				return std::nullopt;
+			}
+			if (store(shard))
+				last_reconstructed = idx;
 		}
+		catch (std::exception & e)
+		{
+			spdlog::warn("Failed to reconstruct shard {} for frame {}: {}", idx, frame_index(), e.what());
+			return std::nullopt;
+		}
+	}
+	return last_reconstructed;
+}
+
+static void debug_why_not_sent(const shard_set & shards)
+{
+	if (shards.empty())
+	{
+		spdlog::info("frame {} was not sent because no shard was received", shards.frame_index());
+		return;
 	}
 
-	spdlog::info("frame {} was not sent with {} data shards", frame_idx, data);
+	spdlog::info("frame {} was not sent with {} data shards", shards.frame_index(), shards.num_shards);
 }
 
 void shard_accumulator::advance()
 {
-	std::swap(current, next);
-	next.reset(current.frame_index() + 1);
+	uint64_t frame_index = frame(window.size() - 1).frame_index() + 1;
+	frame(0).reset(frame_index);
+	head = (head + 1) % window.size();
 }
 
-void shard_accumulator::push_shard(video_stream_data_shard && shard)
+template <typename Shard>
+void shard_accumulator::push(Shard && shard)
 {
-	assert(current.frame_index() + 1 == next.frame_index());
+	if (shard.frame_idx >= frame(0).frame_index() + 2 * window.size())
+	{
+		// We have lost all the frames of the window
+		for (size_t i = 0; i < window.size(); ++i)
+			send_feedback(frame(i).feedback);
+		for (size_t i = 0; i < window.size(); ++i)
+			frame(i).reset(shard.frame_idx + i);
+	}
+	// Make room for the frame, the oldest ones are lost
+	while (shard.frame_idx >= frame(0).frame_index() + window.size())
+	{
+		drop_frame();
+		// The new first frame may already be complete
+		try_submit_frame(0);
+	}
 
-	uint8_t frame_diff = shard.frame_idx - current.frame_index();
-	if (shard.frame_idx < current.frame_index())
+	if (shard.frame_idx < frame(0).frame_index())
 	{
 		// frame is in the past, drop it
+		return;
 	}
-	else if (frame_diff == 0)
-	{
-		auto shard_idx = current.insert(std::move(shard));
+
+	uint64_t frame_diff = shard.frame_idx - frame(0).frame_index();
+	auto & shards = frame(frame_diff);
+	auto shard_idx = shards.insert(std::move(shard));
+	send_nacks();
+	if (frame_diff == 0)
 		try_submit_frame(shard_idx);
-	}
-	else if (frame_diff == 1)
+	flush();
+}
+
+void shard_accumulator::flush()
+{
+	while (true)
 	{
-		next.insert(std::move(shard));
-		if (is_complete(next))
+		auto & current = frame(0);
+		bool later_complete = false;
+		bool later_sent = false;
+		XrTime begin = current.empty() ? std::numeric_limits<XrTime>::max() : current.feedback.received_first_packet;
+		for (size_t i = 1; i < window.size(); ++i)
 		{
-			debug_why_not_sent(current);
-			send_feedback(current.feedback);
+			const auto & later = frame(i);
+			later_complete = later_complete or later.complete();
+			later_sent = later_sent or later.end_shard;
+			if (not later.empty())
+				begin = std::min(begin, later.feedback.received_first_packet);
+		}
 
-			advance();
+		// The next frames do not depend on a non-reference frame: it is not waited for once a later one is fully sent.
+		// Other frames are waited for until their deadline, so that reordered or retransmitted shards can still complete them.
+		if (current.non_reference ? not later_sent : (not later_complete or application::now() < begin + reorder_timeout))
+			return;
 
-			try_submit_frame(0);
-		}
+		drop_frame();
+		try_submit_frame(0);
 	}
-	else if (frame_diff == 2)
+}
+
+void shard_accumulator::drop_frame()
+{
+	auto & current = frame(0);
+	// Nothing depends on a non-reference frame, the previous one is displayed instead
+	if (not desc().error_concealment or current.non_reference or not conceal(current))
 	{
 		debug_why_not_sent(current);
 		send_feedback(current.feedback);
+	}
+	advance();
+}
 
-		advance();
+bool shard_accumulator::conceal(shard_set & current)
+{
+	if (not current.view_info)
+		return false;
 
-		push_shard(std::move(shard));
-	}
-	else
+	// Slices after the missing shards, from their start of slice shard to their end of slice shard
+	uint16_t end = current.end_shard ? current.end_shard : uint16_t(current.shards.size());
+	std::vector<std::span<const uint8_t>> slices;
+	uint16_t lost_slices = 0;
+	bool gap = false;
+	for (uint16_t idx = current.next_slice_shard; idx < end;)
 	{
-		// We have lost more than one frame
-		send_feedback(current.feedback);
-		send_feedback(next.feedback);
+		if (not(current.has(idx) and (current.shards[idx].flags & video_stream_data_shard::start_of_slice)))
+		{
+			gap = true;
+			++idx;
+			continue;
+		}
+		uint16_t last = idx;
+		while (last < end and current.has(last) and not(current.shards[last].flags & video_stream_data_shard::end_of_slice))
+			++last;
+		if (last == end or not current.has(last))
+		{
+			gap = true;
+			idx = last + 1;
+			continue;
+		}
+		// At least one slice was lost since the previous complete one
+		lost_slices += gap;
+		gap = false;
+		size_t begin = current.shards[idx].offset;
+		slices.emplace_back(current.payload.data() + begin, current.shards[last].offset + current.shards[last].size - begin);
+		idx = last + 1;
+	}
+	// The end of the frame was lost, or the frame was cut before it
+	lost_slices += gap or not current.end_shard;
 
-		current.reset(shard.frame_idx);
-		next.reset(shard.frame_idx + 1);
+	if (slices.empty() and current.next_slice_shard == 0)
+		return false;
 
-		push_shard(std::move(shard));
-	}
+	spdlog::info("frame {} decoded with error concealment, {} slices lost", current.frame_index(), lost_slices);
+	if (not slices.empty())
+		decoder->push_data(slices, current.frame_index(), true);
+	decoder->push_data({}, current.frame_index(), false);
+
+	auto feedback = current.feedback;
+	feedback.lost_slices = std::max<uint16_t>(lost_slices, 1);
+	decoder->frame_completed(feedback, current.timing_info.value_or(data_shard::timing_info_t{}), *current.view_info);
+	return true;
+}
+
+void shard_accumulator::push_shard(video_stream_data_shard && shard)
+{
+	// Only the first shard of a frame has the full frame index
+	if (shard.shard_idx == 0)
+		frame_index_known = true;
+	else if (not frame_index_known)
+		return;
+	else
+		shard.frame_idx = extend_frame_index(shard.frame_idx, frame(0).frame_index());
+	push(std::move(shard));
+}
+
+void shard_accumulator::push_shard(video_stream_parity_shard && shard)
+{
+	frame_index_known = true;
+	push(std::move(shard));
 }
 
 void shard_accumulator::try_submit_frame(std::optional<uint16_t> shard_idx)
@@ -162,41 +530,56 @@ void shard_accumulator::try_submit_frame(std::optional<uint16_t> shard_idx)
 
 void shard_accumulator::try_submit_frame(uint16_t shard_idx)
 {
-	auto & data_shards = current.data;
-	// Do not submit if the frame is not complete
-	for (const auto & shard: data_shards)
-	{
-		if (not shard)
-			return;
-	}
-	if (not(data_shards.back()->flags & video_stream_data_shard::end_of_frame))
-		return;
-
-	uint64_t frame_index = data_shards[0]->frame_idx;
-	std::vector<std::span<const uint8_t>> payload;
-	payload.reserve(data_shards.size());
-
-	data_shard::timing_info_t timing_info{};
-	for (const auto & shard: data_shards)
+	auto & current = frame(0);
+	// Submit each slice as soon as all its shards are received, so that it is decoded while the rest of the frame is in flight
+	while (current.has(current.contiguous_shards))
 	{
-		if (shard->timing_info)
-			timing_info = *shard->timing_info;
+		const auto & last = current.shards[current.contiguous_shards++];
+		if (not(last.flags & video_stream_data_shard::end_of_slice))
+			continue;
 
-		payload.emplace_back(shard->payload);
+		size_t begin = current.shards[current.next_slice_shard].offset;
+		std::span<const uint8_t> payload(current.payload.data() + begin, last.offset + last.size - begin);
+		decoder->push_data(std::span(&payload, 1), current.frame_index(), not(last.flags & video_stream_data_shard::end_of_frame));
+		current.next_slice_shard = current.contiguous_shards;
 	}
-	decoder->push_data(payload, frame_index, false);
+
+	// Do not complete the frame until all slices are submitted
+	if (not current.complete())
+		return;
 
 	auto feedback = current.feedback;
-	if (not data_shards.front()->view_info)
+	if (not current.view_info)
 	{
 		spdlog::warn("first shard has no view_info");
 		return;
 	}
 
 	// Try to extract a frame
-	decoder->frame_completed(feedback, timing_info, *data_shards.front()->view_info);
+	decoder->frame_completed(feedback, current.timing_info.value_or(data_shard::timing_info_t{}), *current.view_info);
 
 	advance();
+	// The next frames of the window may already be complete
+	try_submit_frame(0);
+}
+
+void shard_accumulator::send_nacks()
+{
+	std::vector<xrt::drivers::wivrn::from_headset::video_stream_nack> nacks;
+	XrTime deadline = application::now() - nack_delay;
+	for (auto & shards: window)
+	{
+		if (not shards.gaps.empty())
+			shards.take_nacks(deadline, nacks);
+	}
+	if (nacks.empty())
+		return;
+
+	auto scene = weak_scene.lock();
+	if (not scene)
+		return;
+	for (const auto & nack: nacks)
+		scene->send_nack(nack);
 }
 
 void shard_accumulator::send_feedback(const xrt::drivers::wivrn::from_headset::feedback & feedback)
@@ -30,7 +30,9 @@ using decoder_impl = ::wivrn::android::decoder;
 using decoder_impl = ::ffmpeg::decoder;
 #endif
 
+#include "utils/ring_buffer.h"
 #include "wivrn_packets.h"
+#include <algorithm>
 #include <optional>
 #include <vector>
 
@@ -40,15 +42,71 @@ class shard_accumulator
 
 public:
 	using data_shard = xrt::drivers::wivrn::to_headset::video_stream_data_shard;
+	using parity_shard = xrt::drivers::wivrn::to_headset::video_stream_parity_shard;
+	// Shards of a frame. Buffers are kept when the set is reset, so that frames are received without allocations.
 	struct shard_set
 	{
+		// Received data shards
 		size_t num_shards = 0;
-		size_t min_for_reconstruction = -1;
-		std::vector<std::optional<data_shard>> data;
+		// Encoded frame, each shard is copied at its offset. Only grows.
+		std::vector<uint8_t> payload;
+		// Known when the end of frame shard is received, 0 before
+		size_t frame_size = 0;
+		uint16_t end_shard = 0;
+		// One bit per received data shard
+		std::vector<uint64_t> received;
+		// Header of the received data shards, to serialize them again for reconstruction
+		struct shard_info
+		{
+			uint32_t offset;
+			uint16_t size;
+			uint8_t flags;
+		};
+		std::vector<shard_info> shards;
+		std::optional<data_shard::view_info_t> view_info;
+		uint16_t view_info_shard = 0;
+		std::optional<data_shard::timing_info_t> timing_info;
+		uint16_t timing_info_shard = 0;
+		std::vector<parity_shard> parity;
+		// Blocks with received parity shards, to rebuild each one only once it can be recovered
+		struct parity_block
+		{
+			uint16_t first_data_shard;
+			uint8_t data_shard_count;
+			uint8_t data_shards;
+			uint8_t parity_shards;
+			// Reconstruction was attempted, or all the data shards were received
+			bool done;
+		};
+		std::vector<parity_block> blocks;
+		// All data shards before this one are received
+		uint16_t contiguous_shards = 0;
+		// First shard of the next slice to give to the decoder
+		uint16_t next_slice_shard = 0;
+		// Shards after the last received one, to detect gaps
+		uint16_t next_expected_shard = 0;
+		// Missing data shards not requested yet, reordered shards or parity may still recover them
+		struct gap
+		{
+			uint16_t first_shard;
+			uint16_t shard_count;
+			XrTime detected;
+		};
+		std::vector<gap> gaps;
+		// No other frame is predicted from this one
+		bool non_reference = false;
 		void reset(uint64_t frame_index);
 		bool empty() const;
+		bool has(uint16_t shard_idx) const;
+		// All data shards up to the end of frame were received
+		bool complete() const;
 
 		uint16_t insert(data_shard &&);
+		// Returns the index of the last reconstructed data shard, if any
+		std::optional<uint16_t> insert(parity_shard &&);
+
+		// Takes the gaps detected before deadline, and adds their shards the received parity cannot recover to nacks
+		void take_nacks(XrTime deadline, std::vector<xrt::drivers::wivrn::from_headset::video_stream_nack> & nacks);
 
 		xrt::drivers::wivrn::from_headset::feedback feedback{};
 
@@ -62,30 +120,54 @@ public:
 		{
 			return feedback.frame_index;
 		}
+
+	private:
+		// Returns false if the shard is a duplicate or invalid
+		bool store(const data_shard &);
+		std::optional<uint16_t> try_reconstruct(parity_block &);
+		// The received data and parity shards of its block are enough to rebuild the shard
+		bool recoverable(uint16_t shard_idx) const;
+		std::optional<uint16_t> reconstruct(uint16_t first_data_shard);
 	};
 
 private:
-	shard_set current;
-	shard_set next;
+	// Consecutive frames being received, starting with the one to decode next at window[head].
+	// Shards reordered across these frames are kept until the frames can be decoded or are given up.
+	std::vector<shard_set> window;
+	size_t head = 0;
+	// An incomplete frame is waited for at most this long after its first shard once a later frame is complete
+	XrDuration reorder_timeout;
+	// Set when a shard with the full frame index was received
+	bool frame_index_known = false;
 	std::weak_ptr<scenes::stream> weak_scene;
 
+	// i-th frame of the window, 0 is the one to decode next
+	shard_set & frame(size_t i)
+	{
+		return window[(head + i) % window.size()];
+	}
+
 public:
+	// window_size is the number of frames kept for reordering, at least 2
 	explicit shard_accumulator(
 	        vk::raii::Device & device,
 	        vk::raii::PhysicalDevice & physical_device,
 	        const xrt::drivers::wivrn::to_headset::video_stream_description::item & description,
 	        float fps,
 	        std::weak_ptr<scenes::stream> scene,
-	        uint8_t stream_index) :
+	        uint8_t stream_index,
+	        int window_size = 4) :
 	        decoder(std::make_shared<decoder_impl>(device, physical_device, description, fps, stream_index, scene, this)),
-	        current(stream_index),
-	        next(stream_index),
+	        window(std::max(window_size, 2), shard_set(stream_index)),
+	        reorder_timeout(1'000'000'000 / fps),
 	        weak_scene(scene)
 	{
-		next.reset(1);
+		for (size_t i = 0; i < window.size(); ++i)
+			window[i].reset(i);
 	}
 
 	void push_shard(xrt::drivers::wivrn::to_headset::video_stream_data_shard &&);
+	void push_shard(xrt::drivers::wivrn::to_headset::video_stream_parity_shard &&);
 
 	auto & desc() const
 	{
@@ -104,9 +186,25 @@ public:
 
 	using blit_handle = decoder_impl::blit_handle;
 
+	// Decoded frames, written by the decoder and read by the render thread without locking
+	utils::ring_buffer<std::shared_ptr<blit_handle>, 8> decoded_frames;
+
 private:
+	template <typename Shard>
+	void push(Shard &&);
 	void try_submit_frame(std::optional<uint16_t> shard_idx);
 	void try_submit_frame(uint16_t shard_idx);
+	// Gives up the incomplete frames at the start of the window that are no longer waited for
+	void flush();
+	// The first frame of the window is not waited for anymore: decode it with error concealment if
+	// enabled, or report it as lost
+	void drop_frame();
+	// Gives the complete slices that were not submitted to the decoder and completes the frame,
+	// returns false if nothing of the frame can be decoded
+	bool conceal(shard_set &);
 	void send_feedback(const xrt::drivers::wivrn::from_headset::feedback & feedback);
+	// Requests the shards still missing after the reorder delay, for all the frames of the window
+	void send_nacks();
+	// Gives up the first frame of the window and reuses its shard_set for the next frame after the window
 	void advance();
 };
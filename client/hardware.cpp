@@ -91,6 +91,15 @@ model guess_model()
 	return m;
 }
 
+std::string device_model()
+{
+#ifdef __ANDROID__
+	return get_property("ro.product.manufacturer") + " " + get_property("ro.product.model") + " (" + get_property("ro.product.device") + ")";
+#else
+	return {};
+#endif
+}
+
 static XrViewConfigurationView scale_view(XrViewConfigurationView view, uint32_t width)
 {
 	double ratio = double(width) / view.recommendedImageRectWidth;
@@ -19,6 +19,7 @@
 #pragma once
 
 #include <openxr/openxr.h>
+#include <string>
 
 enum class model
 {
@@ -35,4 +36,7 @@ enum class model
 
 model guess_model();
 
+// Identifies the device for cached measurements, empty if unknown
+std::string device_model();
+
 XrViewConfigurationView override_view(XrViewConfigurationView, model);
@@ -20,9 +20,12 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <memory>
 #include <string>
 #include <tuple>
+#include <type_traits>
 
 #include <jni.h>
 
@@ -32,6 +35,9 @@ class jni_thread
 {
 	JNIEnv * jni_env = nullptr;
 	JavaVM * vm = nullptr;
+	// VM of the first setup_thread, other threads are attached to it on their first JNI call
+	// and stay attached until they exit
+	inline static std::atomic<JavaVM *> default_vm = nullptr;
 
 	jni_thread() = default;
 	~jni_thread()
@@ -49,9 +55,14 @@ class jni_thread
 public:
 	static JNIEnv & env()
 	{
-		auto res = instance().jni_env;
-		assert(res);
-		return *res;
+		auto & inst = instance();
+		if (not inst.jni_env)
+		{
+			if (auto vm = default_vm.load())
+				setup_thread(vm);
+		}
+		assert(inst.jni_env);
+		return *inst.jni_env;
 	}
 
 	static void setup_thread(JavaVM * vm)
@@ -59,6 +70,8 @@ public:
 		auto & inst = instance();
 		if (inst.vm)
 			return;
+		JavaVM * expected = nullptr;
+		default_vm.compare_exchange_strong(expected, vm);
 		inst.vm = vm;
 		inst.vm->AttachCurrentThread(&inst.jni_env, nullptr);
 	}
@@ -135,6 +148,38 @@ struct type_map<void>
 
 template <typename T>
 using type_map_t = type_map<T>::type;
+
+inline jclass global_ref(JNIEnv & env, jclass local)
+{
+	auto global = (jclass)env.NewGlobalRef(local);
+	env.DeleteLocalRef(local);
+	return global;
+}
+
+// Method or field ID looked up on the first call of a call site, with the class it was found in.
+// IDs stay valid as long as the class is loaded, which the global reference guarantees.
+template <typename ID>
+struct cached_id
+{
+	jclass klass;
+	ID id;
+};
+
+// Wraps the result of a JNI call, releasing the local reference of returned objects:
+// threads that never return to Java would otherwise accumulate them
+template <typename R, typename Result>
+R wrap_result(JNIEnv & env, Result result)
+{
+	if constexpr (std::is_same_v<Result, jobject>)
+	{
+		R res(result);
+		if (result)
+			env.DeleteLocalRef(result);
+		return res;
+	}
+	else
+		return R(result);
+}
 } // namespace details
 
 struct klass
@@ -160,12 +205,34 @@ struct klass
 		assert(self.get());
 	}
 
+	// Class looked up by name on the first call only, for classes used periodically
+	template <details::string_literal Name>
+	static klass find()
+	{
+		static const jclass global = details::global_ref(jni_thread::env(), jni_thread::env().FindClass(Name.value));
+		assert(global);
+		return klass(global);
+	}
+
 	template <typename T>
 	T field(const std::string & name)
 	{
 		auto & env = jni_thread::env();
 		jfieldID id = env.GetStaticFieldID(*this, name.c_str(), T::type().c_str());
-		return T((env.*T::static_field)(*this, id));
+		return details::wrap_result<T>(env, (env.*T::static_field)(*this, id));
+	}
+
+	// Same as field, the field ID is looked up once for this call site
+	template <typename T, details::string_literal Name>
+	T field()
+	{
+		auto & env = jni_thread::env();
+		static const details::cached_id<jfieldID> cache{
+		        details::global_ref(env, (jclass)env.NewLocalRef(*this)),
+		        env.GetStaticFieldID(*this, Name.value, T::type().c_str()),
+		};
+		jfieldID id = env.IsSameObject(*this, cache.klass) ? cache.id : env.GetStaticFieldID(*this, Name.value, T::type().c_str());
+		return details::wrap_result<T>(env, (env.*T::static_field)(*this, id));
 	}
 
 	template <typename R, typename... Args>
@@ -176,11 +243,49 @@ struct klass
 		std::string signature = "(" + details::build_type(args...) + ")" + R1::type();
 		auto method_id = env.GetStaticMethodID(self.get(), method, signature.c_str());
 		assert(method_id);
+		return invoke<R>(env, method_id, std::forward<Args>(args)...);
+	}
+
+	// Same as call, the method ID is looked up once for this call site
+	template <typename R, details::string_literal Method, typename... Args>
+	auto call(Args &&... args)
+	{
+		using R1 = details::type_map_t<R>;
+		auto & env = jni_thread::env();
+		static const std::string signature = "(" + details::build_type(args...) + ")" + R1::type();
+		static const details::cached_id<jmethodID> cache{
+		        details::global_ref(env, (jclass)env.NewLocalRef(*this)),
+		        env.GetStaticMethodID(*this, Method.value, signature.c_str()),
+		};
+		auto method_id = env.IsSameObject(*this, cache.klass) ? cache.id : env.GetStaticMethodID(*this, Method.value, signature.c_str());
+		assert(method_id);
+		return invoke<R>(env, method_id, std::forward<Args>(args)...);
+	}
+
+private:
+	// Takes a new local reference to a class
+	explicit klass(jclass c) :
+	        self((jclass)jni_thread::env().NewLocalRef(c)) {}
+
+	template <typename R, typename... Args>
+	R invoke(JNIEnv & env, jmethodID method_id, Args &&... args)
+	{
+		using R1 = details::type_map_t<R>;
 		auto handles = details::handle(std::forward<Args>(args)...);
-		return R(std::apply([&](auto &... t) {
-			return (env.*R1::call_static_method)(*this, method_id, t...);
-		},
-		                    handles));
+		if constexpr (std::is_void_v<R>)
+		{
+			std::apply([&](auto &... t) {
+				(env.*R1::call_static_method)(*this, method_id, t...);
+			},
+			           handles);
+		}
+		else
+		{
+			return details::wrap_result<R>(env, std::apply([&](auto &... t) {
+				return (env.*R1::call_static_method)(*this, method_id, t...);
+			},
+			                                               handles));
+		}
 	}
 };
 
@@ -257,11 +362,27 @@ struct object
 		std::string signature = "(" + details::build_type(args...) + ")" + R1::type();
 		auto method_id = env.GetMethodID(klass(), method, signature.c_str());
 		assert(method_id);
-		auto handles = details::handle(std::forward<Args>(args)...);
-		return R(std::apply([&](auto &... t) {
-			return (env.*R1::call_method)(*this, method_id, t...);
-		},
-		                    handles));
+		return invoke<R>(env, method_id, std::forward<Args>(args)...);
+	}
+
+	// Same as call, the method ID is looked up once for this call site, in the class of the first object.
+	// Objects of other classes fall back to a lookup.
+	template <typename R, details::string_literal Method, typename... Args>
+	auto call(Args &&... args)
+	{
+		using R1 = details::type_map_t<R>;
+		auto & env = jni_thread::env();
+		static const std::string signature = "(" + details::build_type(args...) + ")" + R1::type();
+		static const details::cached_id<jmethodID> cache = [&] {
+			auto c = klass();
+			return details::cached_id<jmethodID>{
+			        details::global_ref(env, (jclass)env.NewLocalRef(c)),
+			        env.GetMethodID(c, Method.value, signature.c_str()),
+			};
+		}();
+		auto method_id = env.IsInstanceOf(*this, cache.klass) ? cache.id : env.GetMethodID(klass(), Method.value, signature.c_str());
+		assert(method_id);
+		return invoke<R>(env, method_id, std::forward<Args>(args)...);
 	}
 
 	jobject handle() const
@@ -278,6 +399,28 @@ struct object
 	{
 		return *this;
 	}
+
+private:
+	template <typename R, typename... Args>
+	R invoke(JNIEnv & env, jmethodID method_id, Args &&... args)
+	{
+		using R1 = details::type_map_t<R>;
+		auto handles = details::handle(std::forward<Args>(args)...);
+		if constexpr (std::is_void_v<R>)
+		{
+			std::apply([&](auto &... t) {
+				(env.*R1::call_method)(*this, method_id, t...);
+			},
+			           handles);
+		}
+		else
+		{
+			return details::wrap_result<R>(env, std::apply([&](auto &... t) {
+				return (env.*R1::call_method)(*this, method_id, t...);
+			},
+			                                               handles));
+		}
+	}
 };
 
 using string_t = object<"java/lang/String">;
@@ -19,6 +19,7 @@
 #include "growable_descriptor_pool.h"
 
 #include <algorithm>
+#include <cassert>
 #include <stdexcept>
 
 struct descriptor_set
@@ -29,14 +30,7 @@ struct descriptor_set
 
 	~descriptor_set()
 	{
-		for (auto & i: growable_pool.pools)
-		{
-			if (*i.descriptor_pool == pool)
-			{
-				i.free_count++;
-				return;
-			}
-		}
+		growable_pool.release(pool, std::move(ds));
 	}
 };
 
@@ -70,8 +64,49 @@ growable_descriptor_pool::growable_descriptor_pool(
 	layout_ = *layout;
 }
 
+growable_descriptor_pool::pool & growable_descriptor_pool::find_pool(vk::DescriptorPool handle)
+{
+	auto it = std::find_if(pools.begin(), pools.end(), [&](pool & i) { return *i.descriptor_pool == handle; });
+	assert(it != pools.end());
+	return *it;
+}
+
+void growable_descriptor_pool::release(vk::DescriptorPool handle, vk::raii::DescriptorSet && ds)
+{
+	std::unique_lock lock(mutex);
+
+	// Keep at most one pool worth of free sets
+	if (free_sets.size() < (size_t)descriptorsets_per_pool)
+	{
+		free_sets.push_back({handle, ds.release()});
+		return;
+	}
+
+	pool & p = find_pool(handle);
+	ds = nullptr;
+	p.free_count++;
+
+	// Keep the last pool to avoid creating it again on the next allocation
+	if (p.free_count == descriptorsets_per_pool and pools.size() > 1)
+		std::erase_if(pools, [&](pool & i) { return &i == &p; });
+}
+
 std::shared_ptr<vk::raii::DescriptorSet> growable_descriptor_pool::allocate()
 {
+	std::unique_lock lock(mutex);
+	allocated++;
+
+	if (not free_sets.empty())
+	{
+		recycled_set set = free_sets.back();
+		free_sets.pop_back();
+		recycled++;
+
+		auto ds = std::make_shared<descriptor_set>(*this, set.pool, vk::raii::DescriptorSet(device, static_cast<VkDescriptorSet>(set.ds), static_cast<VkDescriptorPool>(set.pool)));
+
+		return std::shared_ptr<vk::raii::DescriptorSet>(ds, &ds->ds);
+	}
+
 	vk::DescriptorSetAllocateInfo alloc_info{
 	        .descriptorSetCount = 1,
 	        .pSetLayouts = &layout_,
@@ -107,3 +142,35 @@ std::shared_ptr<vk::raii::DescriptorSet> growable_descriptor_pool::allocate()
 
 	return std::shared_ptr<vk::raii::DescriptorSet>(ds, &ds->ds);
 }
+
+void growable_descriptor_pool::trim()
+{
+	std::unique_lock lock(mutex);
+
+	for (recycled_set & set: free_sets)
+	{
+		// Frees the descriptor set when going out of scope
+		vk::raii::DescriptorSet ds(device, static_cast<VkDescriptorSet>(set.ds), static_cast<VkDescriptorPool>(set.pool));
+		find_pool(set.pool).free_count++;
+	}
+	free_sets.clear();
+
+	std::erase_if(pools, [&](pool & i) { return i.free_count == descriptorsets_per_pool; });
+}
+
+growable_descriptor_pool::statistics growable_descriptor_pool::get_statistics()
+{
+	std::unique_lock lock(mutex);
+
+	size_t used_sets = 0;
+	for (pool & i: pools)
+		used_sets += descriptorsets_per_pool - i.free_count;
+
+	return {
+	        .pools = pools.size(),
+	        .used_sets = used_sets - free_sets.size(),
+	        .free_sets = free_sets.size(),
+	        .allocated = allocated,
+	        .recycled = recycled,
+	};
+}
@@ -18,6 +18,9 @@
 
 #pragma once
 
+#include <cstddef>
+#include <memory>
+#include <mutex>
 #include <span>
 #include <vector>
 #include <vulkan/vulkan_raii.hpp>
@@ -32,15 +35,50 @@ class growable_descriptor_pool
 		vk::raii::DescriptorPool descriptor_pool;
 	};
 
+	struct recycled_set
+	{
+		vk::DescriptorPool pool;
+		vk::DescriptorSet ds;
+	};
+
 	vk::raii::Device & device;
 	vk::DescriptorSetLayout layout_;
 
 	int descriptorsets_per_pool;
 	std::vector<vk::DescriptorPoolSize> size;
+
+	// Protects everything below, the descriptor pools also need external synchronization
+	std::mutex mutex;
 	std::vector<pool> pools;
 
+	// Sets released by their owner but not returned to their pool, they all use the same layout so they can be
+	// handed out again without calling vkAllocateDescriptorSets
+	std::vector<recycled_set> free_sets;
+
+	size_t allocated = 0;
+	size_t recycled = 0;
+
+	void release(vk::DescriptorPool pool, vk::raii::DescriptorSet && ds);
+	pool & find_pool(vk::DescriptorPool pool);
+
 public:
+	struct statistics
+	{
+		size_t pools;
+		size_t used_sets;
+		size_t free_sets;
+		// Number of calls to allocate since the pool was created, and how many of them reused a free set
+		size_t allocated;
+		size_t recycled;
+	};
+
 	growable_descriptor_pool(vk::raii::Device & device, vk::raii::DescriptorSetLayout & layout, std::span<vk::DescriptorSetLayoutBinding> bindings, int descriptorsets_per_pool = 100);
 
+	// Thread safe, the descriptor sets can be released from any thread
 	std::shared_ptr<vk::raii::DescriptorSet> allocate();
+
+	// Returns the free sets to their pools and destroys the pools that are not used anymore
+	void trim();
+
+	statistics get_statistics();
 };
@@ -19,6 +19,7 @@
 
 #include "image_loader.h"
 
+#include <chrono>
 #include <cstdint>
 #include <ktxvulkan.h>
 #include <memory>
@@ -161,6 +162,17 @@ image_loader::image_loader(vk::raii::PhysicalDevice physical_device, vk::raii::D
         cb_pool(cb_pool)
 {
 	vdi = ktxVulkanDeviceInfo_Create(*physical_device, *device, *queue, *cb_pool, nullptr);
+
+	// The features are enabled on the device whenever they are supported
+	vk::PhysicalDeviceFeatures features = physical_device.getFeatures();
+	if (features.textureCompressionASTC_LDR)
+		transcode_format = KTX_TTF_ASTC_4x4_RGBA;
+	else if (features.textureCompressionETC2)
+		transcode_format = KTX_TTF_ETC2_RGBA;
+	else if (features.textureCompressionBC)
+		transcode_format = KTX_TTF_BC7_RGBA;
+	else
+		transcode_format = KTX_TTF_RGBA32;
 }
 
 image_loader::~image_loader()
@@ -397,6 +409,7 @@ void image_loader::do_load_raw(const void * pixels, vk::Extent3D extent, vk::For
 
 void image_loader::do_load_ktx(std::span<const std::byte> bytes)
 {
+	auto start = std::chrono::steady_clock::now();
 	ktxTexture * texture;
 	ktxVulkanTexture vk_texture;
 
@@ -410,7 +423,14 @@ void image_loader::do_load_ktx(std::span<const std::byte> bytes)
 
 	if (ktxTexture_NeedsTranscoding(texture))
 	{
-		// TODO
+		// Basis Universal textures are kept compressed on the GPU, with the mipmaps stored in the file
+		err = ktxTexture2_TranscodeBasis(reinterpret_cast<ktxTexture2 *>(texture), ktx_transcode_fmt_e(transcode_format), 0);
+		if (err != KTX_SUCCESS)
+		{
+			ktxTexture_Destroy(texture);
+			spdlog::info("ktxTexture2_TranscodeBasis: error {}", (int)err);
+			throw std::runtime_error("ktxTexture2_TranscodeBasis");
+		}
 	}
 
 	err = ktxTexture_VkUploadEx(texture, vdi, &vk_texture, VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_SAMPLED_BIT, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
@@ -427,6 +447,13 @@ void image_loader::do_load_ktx(std::span<const std::byte> bytes)
 	image_view_type = vk::ImageViewType(vk_texture.viewType);
 	num_mipmaps = texture->numLevels;
 
+	spdlog::debug("Uploaded KTX image {}x{}, format {}, {} bytes in {:.1f}ms",
+	              extent.width,
+	              extent.height,
+	              vk::to_string(format),
+	              ktxTexture_GetDataSize(texture),
+	              std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count());
+
 	ktxTexture_Destroy(texture);
 
 	auto r = std::make_shared<ktx_image_resources>();
@@ -458,15 +485,30 @@ static constexpr bool starts_with(std::span<const std::byte> data, std::span<con
 	return data.size() >= prefix.size() && !memcmp(data.data(), prefix.data(), prefix.size());
 }
 
-// Load a PNG/JPEG/KTX2 file
-void image_loader::load(std::span<const std::byte> bytes, bool srgb)
+static bool is_ktx(std::span<const std::byte> bytes)
 {
 	const uint8_t ktx1_magic[] = {0xAB, 0x4B, 0x54, 0x58, 0x20, 0x31, 0x31, 0xBB, 0x0D, 0x0A, 0x1A, 0x0A};
 	const uint8_t ktx2_magic[] = {0xAB, 0x4B, 0x54, 0x58, 0x20, 0x32, 0x30, 0xBB, 0x0D, 0x0A, 0x1A, 0x0A};
 
-	if (starts_with(bytes, ktx1_magic) || starts_with(bytes, ktx2_magic))
-	{
+	return starts_with(bytes, ktx1_magic) || starts_with(bytes, ktx2_magic);
+}
+
+// Load a PNG/JPEG/KTX2 file
+void image_loader::load(std::span<const std::byte> bytes, bool srgb)
+{
+	if (is_ktx(bytes))
 		do_load_ktx(bytes);
+	else
+		load(decode(bytes, srgb));
+}
+
+decoded_image image_loader::decode(std::span<const std::byte> bytes, bool srgb)
+{
+	decoded_image image;
+
+	if (is_ktx(bytes))
+	{
+		image.ktx.assign(bytes.begin(), bytes.end());
 	}
 	else
 	{
@@ -474,6 +516,7 @@ void image_loader::load(std::span<const std::byte> bytes, bool srgb)
 		size_t image_size = bytes.size();
 
 		int w, h, num_channels, channels_in_file;
+		vk::Format & format = image.format;
 		stbi_ptr pixels;
 
 		if (!stbi_info_from_memory(image_data, image_size, &w, &h, &num_channels))
@@ -500,12 +543,42 @@ void image_loader::load(std::span<const std::byte> bytes, bool srgb)
 			format = srgb ? get_format_srgb(num_channels) : get_format<uint8_t>(num_channels);
 		}
 
-		extent.width = w;
-		extent.height = h;
-		extent.depth = 1;
+		if (!pixels)
+			throw std::runtime_error(std::string("Cannot decode image: ") + stbi_failure_reason());
+
+		image.extent = vk::Extent3D{
+		        .width = uint32_t(w),
+		        .height = uint32_t(h),
+		        .depth = 1,
+		};
+		image.pixels = std::move(pixels);
+	}
+
+	return image;
+}
 
-		do_load_raw(pixels.get(), extent, format);
+void image_loader::load(const decoded_image & image)
+{
+	if (!image.pixels)
+	{
+		do_load_ktx(image.ktx);
+		return;
 	}
+
+	auto start = std::chrono::steady_clock::now();
+	extent = image.extent;
+	format = image.format;
+
+	do_load_raw(image.pixels.get(), extent, format);
+
+	// Include the mipmaps generated on the device
+	size_t size = extent.width * extent.height * extent.depth * bytes_per_pixel(format) * 4 / 3;
+	spdlog::debug("Uploaded image {}x{}, format {}, {} bytes in {:.1f}ms",
+	              extent.width,
+	              extent.height,
+	              vk::to_string(format),
+	              size,
+	              std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count());
 }
 
 // Load raw pixel data
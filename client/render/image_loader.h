@@ -27,10 +27,23 @@
 #include <glm/vec4.hpp>
 #include <memory>
 #include <span>
+#include <vector>
 #include <vulkan/vulkan.hpp>
 
 struct ktxVulkanDeviceInfo;
 
+// CPU side of an image file, can be produced on any thread
+struct decoded_image
+{
+	// Decoded pixels of PNG/JPEG images
+	std::shared_ptr<void> pixels;
+	vk::Extent3D extent;
+	vk::Format format;
+
+	// Copy of the file for KTX images, they are transcoded when uploaded
+	std::vector<std::byte> ktx;
+};
+
 struct image_loader
 {
 	vk::Image image;
@@ -47,6 +60,12 @@ struct image_loader
 	// Load a PNG/JPEG/KTX2 file
 	void load(std::span<const std::byte> bytes, bool srgb);
 
+	// Decode a PNG/JPEG/KTX2 file without uploading it
+	static decoded_image decode(std::span<const std::byte> bytes, bool srgb);
+
+	// Upload an image returned by decode
+	void load(const decoded_image & image);
+
 	// Load raw pixel data
 	void load(const void * pixels, size_t size, vk::Extent3D extent, vk::Format format);
 
@@ -72,6 +91,8 @@ struct image_loader
 
 private:
 	ktxVulkanDeviceInfo * vdi = nullptr;
+	// ktx_transcode_fmt_e used for Basis Universal textures, depends on the supported compressed formats
+	uint32_t transcode_format;
 
 	vk::raii::Device & device;
 	vk::raii::Queue & queue;
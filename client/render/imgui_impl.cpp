@@ -66,6 +66,58 @@
 // Automatically generated by CMakeLists
 extern std::map<std::string, std::vector<int>> glyph_set_per_language;
 
+namespace
+{
+// Last font atlas that was built, so that the glyphs are not rasterized again for each imgui context
+struct font_atlas_cache
+{
+	std::shared_ptr<ImFontAtlas> atlas;
+	ImFontGlyphRangesBuilder glyphs;
+	// Referenced by the atlas configuration
+	ImVector<ImWchar> ranges;
+	std::string language;
+	ImFont * large_font = nullptr;
+
+	bool covers(const ImFontGlyphRangesBuilder & wanted, const std::string & wanted_language) const
+	{
+		if (not atlas or language != wanted_language)
+			return false;
+
+		for (int i = 0; i < wanted.UsedChars.Size; ++i)
+		{
+			if (wanted.UsedChars[i] & ~glyphs.UsedChars[i])
+				return false;
+		}
+		return true;
+	}
+};
+
+std::shared_ptr<font_atlas_cache> font_cache = std::make_shared<font_atlas_cache>();
+
+uint32_t hash_draw_data(const ImDrawData & draw_data)
+{
+	uint32_t hash = ImHashData(&draw_data.DisplaySize, sizeof(draw_data.DisplaySize));
+
+	for (const ImDrawList * cmd_list: draw_data.CmdLists)
+	{
+		hash = ImHashData(cmd_list->VtxBuffer.Data, cmd_list->VtxBuffer.size_in_bytes(), hash);
+		hash = ImHashData(cmd_list->IdxBuffer.Data, cmd_list->IdxBuffer.size_in_bytes(), hash);
+
+		// Do not hash the whole command, its padding is not guaranteed to be initialized
+		for (const ImDrawCmd & cmd: cmd_list->CmdBuffer)
+		{
+			hash = ImHashData(&cmd.ClipRect, sizeof(cmd.ClipRect), hash);
+			hash = ImHashData(&cmd.TextureId, sizeof(cmd.TextureId), hash);
+			hash = ImHashData(&cmd.VtxOffset, sizeof(cmd.VtxOffset), hash);
+			hash = ImHashData(&cmd.IdxOffset, sizeof(cmd.IdxOffset), hash);
+			hash = ImHashData(&cmd.ElemCount, sizeof(cmd.ElemCount), hash);
+		}
+	}
+
+	return hash;
+}
+} // namespace
+
 static vk::raii::RenderPass create_renderpass(vk::raii::Device & device, vk::Format format, bool clear)
 {
 	vk::AttachmentDescription attachment{
@@ -235,7 +287,8 @@ imgui_context::imgui_context(vk::raii::PhysicalDevice physical_device, vk::raii:
         format(swapchain.format()),
         scale_(size.x, size.y),
         swapchain(swapchain),
-        context(ImGui::CreateContext()),
+        font_atlas(std::make_shared<ImFontAtlas>()),
+        context(ImGui::CreateContext(font_atlas.get())),
         plot_context(ImPlot::CreateContext()),
         io((ImGui::SetCurrentContext(context), ImGui::GetIO())),
         world(world)
@@ -256,6 +309,13 @@ imgui_context::imgui_context(vk::raii::PhysicalDevice physical_device, vk::raii:
 		cb.fence = device.createFence(vk::FenceCreateInfo{.flags = vk::FenceCreateFlagBits::eSignaled});
 	}
 
+	query_pool = vk::raii::QueryPool(
+	        device,
+	        vk::QueryPoolCreateInfo{
+	                .queryType = vk::QueryType::eTimestamp,
+	                .queryCount = uint32_t(2 * command_buffers.size()),
+	        });
+
 	ImGui_ImplVulkan_InitInfo init_info = {
 	        .Instance = *application::get_vulkan_instance(),
 	        .PhysicalDevice = *application::get_physical_device(),
@@ -428,8 +488,6 @@ static std::vector<std::string> find_font(const ImFontGlyphRangesBuilder & glyph
 
 void imgui_context::initialize_fonts()
 {
-	glyph_ranges.clear();
-
 	// Always include Basic Latin and Latin-1 Supplement without control characters
 	ImWchar default_ranges[] = {0x20, 0x7f, 0xa0, 0xff, 0};
 	glyph_range_builder.AddRanges(default_ranges);
@@ -448,28 +506,37 @@ void imgui_context::initialize_fonts()
 		break;
 	}
 
-	for (int i = 0; i < glyph_range_builder.UsedChars.Size; ++i)
+	const std::string & language = application::get_messages_info().language;
+	if (font_cache->covers(glyph_range_builder, language))
 	{
-		std::uint32_t used_chars = glyph_range_builder.UsedChars[i];
+		spdlog::debug("Reusing the font atlas");
+		font_atlas = font_cache->atlas;
+		glyph_range_builder = font_cache->glyphs;
+		large_font = font_cache->large_font;
+		io.Fonts = font_atlas.get();
+		glyph_range_dirty = false;
 
-		if (used_chars == 0)
-			continue;
+		ImGui_ImplVulkan_CreateFontsTexture();
+		font_texture = io.Fonts->TexID;
+		return;
+	}
 
-		for (int j = 0; j < 32; ++j)
-		{
-			ImWchar c = i * 32 + j;
-			if (used_chars & (1 << j))
-			{
-				char buf[8];
-				ImTextCharToUtf8(buf, c);
-			}
-		}
+	// Keep the glyphs of the previous atlas so that contexts with different strings do not rebuild it in turn
+	if (font_cache->atlas and font_cache->language == language)
+	{
+		for (int i = 0; i < glyph_range_builder.UsedChars.Size; ++i)
+			glyph_range_builder.UsedChars[i] |= font_cache->glyphs.UsedChars[i];
 	}
 
-	glyph_range_builder.BuildRanges(&glyph_ranges);
+	// The previous atlas may still be used by another context, build a new one
+	auto cache = std::make_shared<font_atlas_cache>();
+	cache->glyphs = glyph_range_builder;
+	cache->language = language;
+	cache->glyphs.BuildRanges(&cache->ranges);
+	ImVector<ImWchar> & glyph_ranges = cache->ranges;
 
 	// Load Fonts
-	auto fonts = find_font(glyph_range_builder, application::get_messages_info().language);
+	auto fonts = find_font(glyph_range_builder, language);
 	for (auto & i: fonts)
 	{
 		spdlog::info("Font {}", i);
@@ -478,8 +545,8 @@ void imgui_context::initialize_fonts()
 	asset font_awesome_regular("Font Awesome 6 Free-Regular-400.otf");
 	asset font_awesome_solid("Font Awesome 6 Free-Solid-900.otf");
 
-	IM_DELETE(io.Fonts);
-	io.Fonts = IM_NEW(ImFontAtlas);
+	font_atlas = std::make_shared<ImFontAtlas>();
+	io.Fonts = font_atlas.get();
 
 	{
 		ImFontConfig config;
@@ -511,7 +578,13 @@ void imgui_context::initialize_fonts()
 
 	glyph_range_dirty = false;
 
+	// Rasterizes the glyphs, contexts reusing this atlas only upload the pixels
 	ImGui_ImplVulkan_CreateFontsTexture();
+	font_texture = io.Fonts->TexID;
+
+	cache->atlas = font_atlas;
+	cache->large_font = large_font;
+	font_cache = cache;
 }
 
 void imgui_context::new_frame(XrTime display_time)
@@ -699,9 +772,12 @@ void imgui_context::new_frame(XrTime display_time)
 
 		ImGui_ImplVulkan_DestroyFontsTexture();
 		initialize_fonts();
-		ImGui_ImplVulkan_CreateFontsTexture();
+		invalidate();
 	}
 
+	// The atlas may be shared with another context, which uploaded it in its own descriptor set
+	io.Fonts->SetTexID(font_texture);
+
 	// Start the Dear ImGui frame
 	ImGui_ImplVulkan_NewFrame();
 
@@ -710,6 +786,10 @@ void imgui_context::new_frame(XrTime display_time)
 
 	// See ImGui_ImplSDL2_ProcessEvent
 
+	// Duplicate events are filtered by imgui, so the queue is only empty if the input did not change
+	if (context->InputEventsQueue.Size)
+		force_redraw = 2;
+
 	ImGui::NewFrame();
 
 	ImDrawList * draw_list = ImGui::GetForegroundDrawList();
@@ -732,31 +812,48 @@ void imgui_context::new_frame(XrTime display_time)
 		draw_list->AddCircleFilled(position_distance->first, radius, pressed ? color_pressed : color_unpressed);
 		draw_list->AddCircle(position_distance->first, radius * 1.2, ImGui::GetColorU32(ImVec4(0, 0, 0, alpha)), 0, radius * 0.4);
 	}
-
-	image_index = swapchain.acquire();
-	swapchain.wait();
 }
 
 XrCompositionLayerQuad imgui_context::end_frame()
 {
-	vk::Image destination = swapchain.images()[image_index].image;
-
 	ImGui::SetCurrentContext(context);
 	ImPlot::SetCurrentContext(plot_context);
 
 	ImGui::Render();
 
+	// Keep the previous swapchain image if nothing changed, the runtime displays the last released image
+	uint32_t hash = hash_draw_data(*ImGui::GetDrawData());
+	if (force_redraw > 0)
+		--force_redraw;
+	else if (last_draw_data_hash == hash)
+		return layer();
+	last_draw_data_hash = hash;
+
+	int image_index = swapchain.acquire();
+	swapchain.wait();
+	vk::Image destination = swapchain.images()[image_index].image;
+
 	current_command_buffer = (current_command_buffer + 1) % command_buffers.size();
 
 	auto & f = get_frame(destination);
 	auto & cb = get_command_buffer().command_buffer;
 	auto & fence = get_command_buffer().fence;
+	const uint32_t first_query = 2 * current_command_buffer;
 
 	if (auto result = device.waitForFences(*fence, true, 1'000'000'000); result != vk::Result::eSuccess)
 		throw std::runtime_error("vkWaitForfences: " + vk::to_string(result));
 	device.resetFences(*fence);
 
+	if (std::exchange(get_command_buffer().timestamps_written, false))
+	{
+		auto [res, timestamps] = query_pool.getResults<uint64_t>(first_query, 2, 2 * sizeof(uint64_t), sizeof(uint64_t), vk::QueryResultFlagBits::e64);
+		if (res == vk::Result::eSuccess)
+			last_gpu_time = (timestamps[1] - timestamps[0]) * application::get_physical_device_properties().limits.timestampPeriod / 1e9;
+	}
+
 	cb.begin({.flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
+	cb.resetQueryPool(*query_pool, first_query, 2);
+	cb.writeTimestamp(vk::PipelineStageFlagBits::eTopOfPipe, *query_pool, first_query);
 
 	vk::ClearValue clear{vk::ClearColorValue(0, 0, 0, 0)};
 
@@ -774,6 +871,8 @@ XrCompositionLayerQuad imgui_context::end_frame()
 
 	cb.endRenderPass();
 
+	cb.writeTimestamp(vk::PipelineStageFlagBits::eBottomOfPipe, *query_pool, first_query + 1);
+	get_command_buffer().timestamps_written = true;
 	cb.end();
 
 	queue.submit(vk::SubmitInfo{
@@ -784,6 +883,11 @@ XrCompositionLayerQuad imgui_context::end_frame()
 
 	swapchain.release();
 
+	return layer();
+}
+
+XrCompositionLayerQuad imgui_context::layer() const
+{
 	return XrCompositionLayerQuad{
 	        .type = XR_TYPE_COMPOSITION_LAYER_QUAD,
 	        .layerFlags = XR_COMPOSITION_LAYER_BLEND_TEXTURE_SOURCE_ALPHA_BIT,
@@ -800,6 +904,11 @@ XrCompositionLayerQuad imgui_context::end_frame()
 	};
 }
 
+void imgui_context::release_font_cache()
+{
+	font_cache = std::make_shared<font_atlas_cache>();
+}
+
 imgui_context::~imgui_context()
 {
 	ImGui::SetCurrentContext(context);
@@ -24,6 +24,7 @@
 #include <glm/gtc/quaternion.hpp>
 #include <imgui.h>
 #include <implot.h>
+#include <memory>
 #include <optional>
 #include <span>
 #include <unordered_map>
@@ -38,6 +39,7 @@ class imgui_context
 	{
 		vk::raii::CommandBuffer command_buffer = nullptr;
 		vk::raii::Fence fence = nullptr;
+		bool timestamps_written = false;
 	};
 
 	struct texture_data
@@ -108,6 +110,9 @@ private:
 	{
 		return command_buffers[current_command_buffer];
 	}
+	// 2 queries per command buffer, read when the command buffer is reused
+	vk::raii::QueryPool query_pool = nullptr;
+	std::optional<float> last_gpu_time;
 
 	vk::Extent2D size;
 	vk::Format format;
@@ -118,7 +123,15 @@ private:
 	glm::vec2 scale_;
 
 	xr::swapchain & swapchain;
-	int image_index;
+
+	// Hash of the last rendered draw data, the swapchain image is only rendered again when it changes
+	std::optional<uint32_t> last_draw_data_hash;
+	// Number of frames to render even if the draw data is unchanged, imgui may need a frame to react to the input
+	int force_redraw = 0;
+
+	// Shared with the other contexts built for the same glyphs, see initialize_fonts
+	std::shared_ptr<ImFontAtlas> font_atlas;
+	ImTextureID font_texture{};
 
 	ImGuiContext * context;
 	ImPlotContext * plot_context;
@@ -132,7 +145,6 @@ private:
 	bool button_pressed = false;
 
 	ImFontGlyphRangesBuilder glyph_range_builder;
-	ImVector<ImWchar> glyph_ranges;
 	bool glyph_range_dirty = true;
 
 	void initialize_fonts();
@@ -150,6 +162,9 @@ public:
 
 	~imgui_context();
 
+	// Drops the font atlas kept for the next context, the contexts still using it keep their reference
+	static void release_font_cache();
+
 	void set_position(glm::vec3 position, glm::quat orientation)
 	{
 		position_ = position;
@@ -202,7 +217,19 @@ public:
 	}
 
 	void new_frame(XrTime display_time);
+	// Renders the GUI if it changed since the last frame, the returned layer can be submitted in any case
 	XrCompositionLayerQuad end_frame();
+	// Layer showing the last rendered image, without starting a new frame
+	XrCompositionLayerQuad layer() const;
+	void invalidate()
+	{
+		last_draw_data_hash.reset();
+	}
+	// GPU time in seconds of the last finished render of the GUI, once per render
+	std::optional<float> take_gpu_time()
+	{
+		return std::exchange(last_gpu_time, std::nullopt);
+	}
 
 	ImFont * large_font;
 	size_t get_focused_controller() const
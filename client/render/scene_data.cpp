@@ -21,6 +21,7 @@
 
 #include "image_loader.h"
 #include "render/gpu_buffer.h"
+#include "render/texture_streamer.h"
 #include "utils/fmt_glm.h"
 #include "utils/ranges.h"
 #include <boost/pfr/core.hpp>
@@ -357,6 +358,23 @@ std::shared_ptr<vk::raii::ImageView> do_load_image(
 	}
 }
 
+// Block compressed KTX2 files whose format cannot be sampled are skipped in favour of the fallback image
+bool ktx_format_supported(vk::raii::PhysicalDevice & physical_device, std::span<const std::byte> image_data)
+{
+	const uint8_t ktx2_magic[] = {0xAB, 0x4B, 0x54, 0x58, 0x20, 0x32, 0x30, 0xBB, 0x0D, 0x0A, 0x1A, 0x0A};
+	if (not starts_with(image_data, ktx2_magic) or image_data.size() < sizeof(ktx2_magic) + sizeof(uint32_t))
+		return true;
+
+	// VK_FORMAT_UNDEFINED for Basis Universal textures, which are transcoded to a supported format
+	uint32_t format;
+	memcpy(&format, image_data.data() + sizeof(ktx2_magic), sizeof(format));
+	if (format == VK_FORMAT_UNDEFINED)
+		return true;
+
+	auto properties = physical_device.getFormatProperties(vk::Format(format));
+	return bool(properties.optimalTilingFeatures & vk::FormatFeatureFlagBits::eSampledImage);
+}
+
 class loader_context
 {
 	std::filesystem::path base_directory;
@@ -476,7 +494,28 @@ public:
 		return image;
 	}
 
-	std::vector<std::shared_ptr<scene_data::texture>> load_all_textures()
+	// Queue the image in the streamer, returns false if its type is not supported
+	bool stream_image(int index, bool srgb, const std::shared_ptr<scene_data::texture> & texture, texture_streamer & streamer)
+	{
+		auto [image_data, mime_type] = visit_source(gltf.images[index].data);
+		std::span<const std::byte> bytes{image_data.data(), image_data.size()};
+
+		switch (guess_mime_type(bytes))
+		{
+			case fastgltf::MimeType::JPEG:
+			case fastgltf::MimeType::PNG:
+			case fastgltf::MimeType::KTX2:
+				if (not ktx_format_supported(physical_device, bytes))
+					return false;
+				streamer.add(texture, bytes, srgb);
+				return true;
+
+			default:
+				return false;
+		}
+	}
+
+	std::vector<std::shared_ptr<scene_data::texture>> load_all_textures(texture_streamer * streamer, std::shared_ptr<vk::raii::ImageView> placeholder)
 	{
 		// Determine which texture is sRGB
 		std::vector<uint8_t> srgb_array;
@@ -502,6 +541,18 @@ public:
 				texture_ref.sampler = convert(sampler);
 			}
 
+			if (streamer)
+			{
+				texture_ref.image_view = placeholder;
+				if (gltf_texture.basisuImageIndex and stream_image(*gltf_texture.basisuImageIndex, srgb, textures.back(), *streamer))
+					continue;
+
+				if (gltf_texture.imageIndex and stream_image(*gltf_texture.imageIndex, srgb, textures.back(), *streamer))
+					continue;
+
+				throw std::runtime_error("Unsupported image type");
+			}
+
 			if (gltf_texture.basisuImageIndex)
 			{
 				texture_ref.image_view = load_image(*gltf_texture.basisuImageIndex, srgb);
@@ -797,7 +848,12 @@ scene_data scene_loader::operator()(const std::filesystem::path & gltf_path)
 
 	asset asset_file(gltf_path);
 	fastgltf::GltfDataBuffer data_buffer;
-	data_buffer.copyBytes(reinterpret_cast<const uint8_t *>(asset_file.data()), asset_file.size());
+
+	// Parse the mapped file directly if its last page leaves enough room for the padding required by simdjson
+	if (asset_file.padding() >= fastgltf::getGltfBufferPadding())
+		data_buffer.fromByteView(const_cast<uint8_t *>(reinterpret_cast<const uint8_t *>(asset_file.data())), asset_file.size(), asset_file.size() + asset_file.padding());
+	else
+		data_buffer.copyBytes(reinterpret_cast<const uint8_t *>(asset_file.data()), asset_file.size());
 
 	fastgltf::Asset asset = load_gltf_asset(data_buffer, gltf_path.parent_path());
 	loader_context ctx(gltf_path.parent_path(), asset, physical_device, device, queue, cb_pool);
@@ -813,11 +869,17 @@ scene_data scene_loader::operator()(const std::filesystem::path & gltf_path)
 	gpu_buffer staging_buffer(physical_device_properties, asset);
 
 	// Load all textures
-	auto textures = ctx.load_all_textures();
+	auto textures = ctx.load_all_textures(streamer, default_material->base_color_texture->image_view);
 
 	// Load all materials
 	auto materials = ctx.load_all_materials(textures, staging_buffer, *default_material);
 
+	if (streamer)
+	{
+		for (auto & material: materials)
+			streamer->add_users(material);
+	}
+
 	// Load all meshes
 	data.meshes = ctx.load_all_meshes(materials, staging_buffer);
 
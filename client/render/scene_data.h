@@ -109,7 +109,7 @@ struct scene_data
 		std::shared_ptr<vk::raii::DescriptorSet> ds;
 
 		// Set to true to update the descriptor set at the next frame
-		bool ds_dirty;
+		bool ds_dirty = false;
 
 		std::string name;
 		std::string shader_name = "lit";
@@ -183,8 +183,24 @@ struct scene_data
 	// TODO: lights
 	// TODO: skybox
 
+	// Transform of a node relative to the scene root, and the local transform it was computed from.
+	// Maintained by scene_renderer::render, only the nodes that moved and their children are recomputed
+	struct world_transform
+	{
+		bool valid = false;
+		size_t parent_id;
+		glm::vec3 position;
+		glm::quat orientation;
+		glm::vec3 scale;
+
+		glm::mat4 transform_to_root;
+		bool reverse_side;
+	};
+
 	std::vector<scene_data::mesh> meshes;
 	std::vector<scene_data::node> scene_nodes;
+	// Indexed like scene_nodes
+	std::vector<world_transform> world_transforms;
 
 	scene_data() = default;
 	scene_data(const scene_data &) = delete;
@@ -203,6 +219,8 @@ struct scene_data
 	std::shared_ptr<material> find_material(std::string_view name);
 };
 
+class texture_streamer;
+
 class scene_loader
 {
 	vk::raii::Device & device;
@@ -210,14 +228,17 @@ class scene_loader
 	vk::raii::Queue & queue;
 	uint32_t queue_family_index;
 	std::shared_ptr<scene_data::material> default_material;
+	// If set, the textures are decoded in the background and use the default base color until they are ready
+	texture_streamer * streamer;
 
 public:
-	scene_loader(vk::raii::Device & device, vk::raii::PhysicalDevice physical_device, vk::raii::Queue & queue, uint32_t queue_family_index, std::shared_ptr<scene_data::material> default_material) :
+	scene_loader(vk::raii::Device & device, vk::raii::PhysicalDevice physical_device, vk::raii::Queue & queue, uint32_t queue_family_index, std::shared_ptr<scene_data::material> default_material, texture_streamer * streamer = nullptr) :
 	        device(device),
 	        physical_device(physical_device),
 	        queue(queue),
 	        queue_family_index(queue_family_index),
-	        default_material(default_material)
+	        default_material(default_material),
+	        streamer(streamer)
 	{}
 
 	scene_data operator()(const std::filesystem::path & gltf_path);
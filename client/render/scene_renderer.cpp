@@ -30,10 +30,13 @@
 #include "vk/shader.h"
 #include <boost/pfr/core.hpp>
 #include <glm/gtc/matrix_access.hpp>
+#include <glm/gtc/matrix_inverse.hpp>
 #include <glm/gtc/type_ptr.hpp>
 #include <glm/gtx/quaternion.hpp>
+#include <algorithm>
 #include <map>
 #include <memory>
+#include <optional>
 #include <spdlog/spdlog.h>
 #include <vk_mem_alloc.h>
 
@@ -142,7 +145,7 @@ static std::array layout_bindings_0{
         },
         vk::DescriptorSetLayoutBinding{
                 .binding = 1,
-                .descriptorType = vk::DescriptorType::eUniformBuffer,
+                .descriptorType = vk::DescriptorType::eStorageBuffer,
                 .descriptorCount = 1,
                 .stageFlags = vk::ShaderStageFlagBits::eVertex | vk::ShaderStageFlagBits::eFragment,
         },
@@ -177,6 +180,7 @@ scene_renderer::scene_renderer(
         vk::Extent2D output_size,
         vk::Format output_format,
         std::span<vk::Format> depth_formats,
+        bool multiview,
         int frames_in_flight) :
         physical_device(physical_device),
         device(device),
@@ -194,6 +198,7 @@ scene_renderer::scene_renderer(
                                 1,
                         },
                         vk::ImageUsageFlagBits::eDepthStencilAttachment)),
+        view_count(multiview ? 2 : 1),
         layout_0(create_descriptor_set_layout(layout_bindings_0, vk::DescriptorSetLayoutCreateFlagBits::ePushDescriptorKHR)),
         layout_1(create_descriptor_set_layout(layout_bindings_1)),
         ds_pool_material(device, layout_1, layout_bindings_1, 100) // TODO tunable
@@ -232,6 +237,9 @@ scene_renderer::scene_renderer(
 scene_renderer::~scene_renderer()
 {
 	wait_idle();
+
+	auto stats = ds_pool_material.get_statistics();
+	spdlog::debug("Material descriptor sets: {} allocations, {} recycled, {} pools", stats.allocated, stats.recycled, stats.pools);
 }
 
 void scene_renderer::wait_idle()
@@ -326,19 +334,31 @@ vk::raii::RenderPass scene_renderer::create_renderpass()
 	                .dstSubpass = 0,
 	                .srcStageMask = vk::PipelineStageFlagBits::eColorAttachmentOutput,
 	                .dstStageMask = vk::PipelineStageFlagBits::eColorAttachmentOutput,
-	                .srcAccessMask{},
+	                .srcAccessMask = vk::AccessFlagBits::eColorAttachmentWrite,
 	                .dstAccessMask = vk::AccessFlagBits::eColorAttachmentWrite,
 	        },
+	        // The depth buffer is shared by consecutive render passes
 	        vk::SubpassDependency{
 	                .srcSubpass = vk::SubpassExternal,
 	                .dstSubpass = 0,
-	                .srcStageMask = vk::PipelineStageFlagBits::eEarlyFragmentTests,
-	                .dstStageMask = vk::PipelineStageFlagBits::eEarlyFragmentTests,
-	                .srcAccessMask{},
-	                .dstAccessMask = vk::AccessFlagBits::eDepthStencilAttachmentWrite,
+	                .srcStageMask = vk::PipelineStageFlagBits::eEarlyFragmentTests | vk::PipelineStageFlagBits::eLateFragmentTests,
+	                .dstStageMask = vk::PipelineStageFlagBits::eEarlyFragmentTests | vk::PipelineStageFlagBits::eLateFragmentTests,
+	                .srcAccessMask = vk::AccessFlagBits::eDepthStencilAttachmentWrite,
+	                .dstAccessMask = vk::AccessFlagBits::eDepthStencilAttachmentRead | vk::AccessFlagBits::eDepthStencilAttachmentWrite,
 	        }};
 	info.setDependencies(dependencies);
 
+	// All views are rendered by the same subpass and are spatially correlated
+	uint32_t view_mask = (1u << view_count) - 1;
+	vk::RenderPassMultiviewCreateInfo multiview_info{
+	        .subpassCount = 1,
+	        .pViewMasks = &view_mask,
+	        .correlationMaskCount = 1,
+	        .pCorrelationMasks = &view_mask,
+	};
+	if (view_count > 1)
+		info.pNext = &multiview_info;
+
 	return vk::raii::RenderPass(device, info);
 }
 
@@ -351,27 +371,9 @@ scene_renderer::output_image & scene_renderer::get_output_image_data(vk::Image o
 	return output_images.emplace(output, create_output_image_data(output)).first->second;
 }
 
-scene_renderer::output_image scene_renderer::create_output_image_data(vk::Image output)
+void scene_renderer::create_transient_attachments()
 {
-	output_image out;
-
-	// TODO: use image view from xr::swapchain
-	out.image_view = vk::raii::ImageView(
-	        device, vk::ImageViewCreateInfo{
-	                        .image = output,
-	                        .viewType = vk::ImageViewType::e2D,
-	                        .format = output_format,
-	                        .components{},
-	                        .subresourceRange = {
-	                                .aspectMask = vk::ImageAspectFlagBits::eColor,
-	                                .baseMipLevel = 0,
-	                                .levelCount = 1,
-	                                .baseArrayLayer = 0,
-	                                .layerCount = 1,
-	                        },
-	                });
-
-	out.depth_buffer = image_allocation{
+	depth_buffer = image_allocation{
 	        device,
 	        vk::ImageCreateInfo{
 	                .imageType = vk::ImageType::e2D,
@@ -382,20 +384,21 @@ scene_renderer::output_image scene_renderer::create_output_image_data(vk::Image
 	                        .depth = 1,
 	                },
 	                .mipLevels = 1,
-	                .arrayLayers = 1,
+	                .arrayLayers = view_count,
 	                .samples = MSAA_SAMPLES,
 	                .tiling = vk::ImageTiling::eOptimal,
 	                .usage = vk::ImageUsageFlagBits::eDepthStencilAttachment | vk::ImageUsageFlagBits::eTransientAttachment},
 	        VmaAllocationCreateInfo{
 	                .flags = VMA_ALLOCATION_CREATE_DEDICATED_MEMORY_BIT, .usage = VMA_MEMORY_USAGE_AUTO,
 	                .requiredFlags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, // TODO: check
+	                .preferredFlags = VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT,
 	        }};
 
-	out.depth_view = vk::raii::ImageView(
+	depth_view = vk::raii::ImageView(
 	        device,
 	        vk::ImageViewCreateInfo{
-	                .image = out.depth_buffer,
-	                .viewType = vk::ImageViewType::e2D,
+	                .image = depth_buffer,
+	                .viewType = view_count > 1 ? vk::ImageViewType::e2DArray : vk::ImageViewType::e2D,
 	                .format = depth_format,
 	                .components{},
 	                .subresourceRange = {
@@ -403,12 +406,12 @@ scene_renderer::output_image scene_renderer::create_output_image_data(vk::Image
 	                        .baseMipLevel = 0,
 	                        .levelCount = 1,
 	                        .baseArrayLayer = 0,
-	                        .layerCount = 1,
+	                        .layerCount = view_count,
 	                },
 	        });
 
 #ifdef MSAA_4x
-	out.multisample_image = image_allocation{vk::ImageCreateInfo{
+	multisample_image = image_allocation{device, vk::ImageCreateInfo{
 	                                                 .imageType = vk::ImageType::e2D,
 	                                                 .format = output_format,
 	                                                 .extent = {
@@ -429,8 +432,8 @@ scene_renderer::output_image scene_renderer::create_output_image_data(vk::Image
 	                                                 .preferredFlags = VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT,
 	                                         }};
 
-	out.multisample_view = vk::raii::ImageView(device, vk::ImageViewCreateInfo{
-	                                                           .image = out.multisample_image,
+	multisample_view = vk::raii::ImageView(device, vk::ImageViewCreateInfo{
+	                                                           .image = multisample_image,
 	                                                           .viewType = vk::ImageViewType::e2D,
 	                                                           .format = output_format,
 	                                                           .components{},
@@ -443,6 +446,30 @@ scene_renderer::output_image scene_renderer::create_output_image_data(vk::Image
 	                                                           },
 	                                                   });
 #endif
+}
+
+scene_renderer::output_image scene_renderer::create_output_image_data(vk::Image output)
+{
+	if (not depth_buffer)
+		create_transient_attachments();
+
+	output_image out;
+
+	// TODO: use image view from xr::swapchain
+	out.image_view = vk::raii::ImageView(
+	        device, vk::ImageViewCreateInfo{
+	                        .image = output,
+	                        .viewType = view_count > 1 ? vk::ImageViewType::e2DArray : vk::ImageViewType::e2D,
+	                        .format = output_format,
+	                        .components{},
+	                        .subresourceRange = {
+	                                .aspectMask = vk::ImageAspectFlagBits::eColor,
+	                                .baseMipLevel = 0,
+	                                .levelCount = 1,
+	                                .baseArrayLayer = 0,
+	                                .layerCount = view_count,
+	                        },
+	                });
 
 	vk::FramebufferCreateInfo fb_info{
 	        .renderPass = *renderpass,
@@ -453,14 +480,14 @@ scene_renderer::output_image scene_renderer::create_output_image_data(vk::Image
 
 #ifdef MSAA_4x
 	std::array attachments{
-	        vk::ImageView{*out.multisample_view},
-	        vk::ImageView{*out.depth_view},
+	        vk::ImageView{*multisample_view},
+	        vk::ImageView{*depth_view},
 	        vk::ImageView{*out.image_view},
 	};
 #else
 	std::array attachments{
 	        vk::ImageView{*out.image_view},
-	        vk::ImageView{*out.depth_view},
+	        vk::ImageView{*depth_view},
 	};
 #endif
 	fb_info.setAttachments(attachments);
@@ -499,8 +526,9 @@ vk::raii::Pipeline scene_renderer::create_pipeline(const pipeline_info & info)
 
 	spdlog::debug("Creating pipeline");
 
-	auto vertex_shader = load_shader(device, info.shader_name + ".vert");
-	auto fragment_shader = load_shader(device, info.shader_name + ".frag");
+	std::string shader_name = view_count > 1 ? info.shader_name + "_multiview" : info.shader_name;
+	auto vertex_shader = load_shader(device, shader_name + ".vert");
+	auto fragment_shader = load_shader(device, shader_name + ".frag");
 
 	std::array specialization_constants_desc{
 	        vk::SpecializationMapEntry{
@@ -668,7 +696,7 @@ void scene_renderer::start_frame()
 		        device,
 		        vk::BufferCreateInfo{
 		                .size = 1048576,
-		                .usage = vk::BufferUsageFlagBits::eUniformBuffer,
+		                .usage = vk::BufferUsageFlagBits::eUniformBuffer | vk::BufferUsageFlagBits::eStorageBuffer,
 		        },
 		        VmaAllocationCreateInfo{
 		                .flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT,
@@ -745,6 +773,7 @@ void scene_renderer::update_material_descriptor_set(scene_data::material & mater
 	};
 
 	device.updateDescriptorSets(write_ds, {});
+	material.ds_dirty = false;
 }
 
 // static void print_scene_hierarchy(const scene_data& scene, std::span<glm::mat4> model_matrices, size_t root = scene_data::node::root_id, int level = 0)
@@ -768,8 +797,11 @@ void scene_renderer::render(scene_data & scene, const std::array<float, 4> & cle
 {
 	per_frame_resources & resources = current_frame();
 
-	size_t buffer_alignment = std::max<size_t>(sizeof(glm::mat4), physical_device_properties.limits.minUniformBufferOffsetAlignment);
-	// size_t buffer_alignment = std::max<size_t>(sizeof(glm::mat4), physical_device_properties.limits.minStorageBufferOffsetAlignment);
+	size_t buffer_alignment = std::max<size_t>({
+	        sizeof(glm::mat4),
+	        physical_device_properties.limits.minUniformBufferOffsetAlignment,
+	        physical_device_properties.limits.minStorageBufferOffsetAlignment,
+	});
 
 	vk::raii::CommandBuffer & cb = resources.cb;
 
@@ -782,57 +814,201 @@ void scene_renderer::render(scene_data & scene, const std::array<float, 4> & cle
 
 	auto vertex_layout = scene_data::vertex::describe();
 
-	std::vector<glm::mat4> transform_to_root(scene.scene_nodes.size());
-	std::vector<bool> reverse_side(scene.scene_nodes.size());
-	std::vector<bool> visible(scene.scene_nodes.size());
+	const size_t node_count = scene.scene_nodes.size();
+	std::vector<scene_data::world_transform> & world = scene.world_transforms;
+	world.resize(node_count);
+	transform_changed.resize(node_count);
+	visible.resize(node_count);
+
+	for (size_t index = 0; index < node_count; index++)
+	{
+		const scene_data::node & object = scene.scene_nodes[index];
+		scene_data::world_transform & cached = world[index];
+		bool is_root = object.parent_id == scene_data::node::root_id;
+		assert(is_root or object.parent_id < index);
+
+		visible[index] = object.visible and (is_root or visible[object.parent_id]);
+
+		transform_changed[index] = not cached.valid or
+		                           (not is_root and transform_changed[object.parent_id]) or
+		                           cached.parent_id != object.parent_id or
+		                           cached.position != object.position or
+		                           cached.orientation != object.orientation or
+		                           cached.scale != object.scale;
+
+		if (not transform_changed[index])
+			continue;
+
+		// Same as translate * rotate * scale, without the matrix products
+		glm::mat3 rotation = glm::mat3_cast(object.orientation);
+		glm::mat4 transform_to_parent{
+		        glm::vec4(rotation[0] * object.scale.x, 0),
+		        glm::vec4(rotation[1] * object.scale.y, 0),
+		        glm::vec4(rotation[2] * object.scale.z, 0),
+		        glm::vec4(object.position, 1),
+		};
+		bool negative_scale = object.scale.x * object.scale.y * object.scale.z < 0;
+
+		cached = {
+		        .valid = true,
+		        .parent_id = object.parent_id,
+		        .position = object.position,
+		        .orientation = object.orientation,
+		        .scale = object.scale,
+		        .transform_to_root = is_root ? transform_to_parent : world[object.parent_id].transform_to_root * transform_to_parent,
+		        .reverse_side = is_root ? negative_scale : world[object.parent_id].reverse_side ^ negative_scale,
+		};
+	}
+
+	// print_scene_hierarchy(scene, world);
+
+	// Build the render list once for all views, the per-instance data only depends on the model matrix
+	struct draw_item
+	{
+		vk::Pipeline pipeline;
+		scene_data::material * material;
+		scene_data::mesh * mesh;
+		scene_data::primitive * primitive;
+		size_t node;
+		// Skinned primitives have their own joint matrices and are never merged
+		std::optional<vk::DeviceSize> joints_offset;
+	};
+	std::vector<draw_item> draw_list;
 
-	for (const auto & [index, object]: utils::enumerate(scene.scene_nodes))
+	for (const auto & [index, node]: utils::enumerate(scene.scene_nodes))
 	{
-		glm::mat4 transform_to_parent = glm::translate(glm::mat4(1), object.position) * (glm::mat4)object.orientation * glm::scale(glm::mat4(1), object.scale);
-		float det = object.scale.x * object.scale.y * object.scale.z;
+		if (!node.mesh_id)
+			continue;
+
+		if (!visible[index])
+			continue;
+
+		scene_data::mesh & mesh = scene.meshes.at(*node.mesh_id);
+		const glm::mat4 & transform = world[index].transform_to_root;
 
-		if (object.parent_id == scene_data::node::root_id)
+		std::optional<vk::DeviceSize> joints_ubo_offset;
+		if (!node.joints.empty())
 		{
-			transform_to_root[index] = transform_to_parent;
-			reverse_side[index] = det < 0;
-			visible[index] = object.visible;
+			joints_ubo_offset = resources.uniform_buffer_offset;
+			glm::mat4 * joint_matrices = reinterpret_cast<glm::mat4 *>(ubo + resources.uniform_buffer_offset);
+			resources.uniform_buffer_offset += utils::align_up(buffer_alignment, sizeof(glm::mat4) * 32);
+			assert(node.joints.size() <= 32);
+
+			// The node transforms are affine, the generic inverse is not needed
+			glm::mat4 inverse_transform = glm::affineInverse(transform);
+			for (auto && [idx, joint]: utils::enumerate(node.joints))
+			{
+				joint_matrices[idx] = inverse_transform * world[joint.first].transform_to_root * joint.second;
+			}
 		}
-		else
+
+		for (scene_data::primitive & primitive: mesh.primitives)
 		{
-			size_t parent = object.parent_id;
-			assert(parent < index);
+			// Get the material
+			std::shared_ptr<scene_data::material> material = primitive.material_ ? primitive.material_ : default_material;
+
+			if (material->ds_dirty || !material->ds)
+				update_material_descriptor_set(*material);
+
+			// Get the pipeline
+			pipeline_info info{
+			        .shader_name = material->shader_name,
+			        .cull_mode = primitive.cull_mode,
+			        .front_face = primitive.front_face,
+			        .topology = primitive.topology,
+			        .blend_enable = material->blend_enable,
+
+			        .nb_texcoords = 2, // TODO
+			        .skinning = !node.joints.empty(),
+			};
+
+			if (material->double_sided)
+				info.cull_mode = vk::CullModeFlagBits::eNone;
+
+			if (world[index].reverse_side)
+				info.front_face = reverse(info.front_face);
+
+			draw_list.push_back({
+			        .pipeline = *get_pipeline(info),
+			        .material = material.get(),
+			        .mesh = &mesh,
+			        .primitive = &primitive,
+			        .node = index,
+			        .joints_offset = joints_ubo_offset,
+			});
+		}
+	}
+
+	// Sort by pipeline, material and mesh so that state changes are minimized and identical primitives are contiguous
+	std::ranges::stable_sort(draw_list, [](const draw_item & a, const draw_item & b) {
+		return std::tie(a.pipeline, a.material, a.mesh, a.primitive) < std::tie(b.pipeline, b.material, b.mesh, b.primitive);
+	});
 
-			transform_to_root[index] = transform_to_root.at(parent) * transform_to_parent;
+	// Per-instance data, indexed with gl_InstanceIndex in the same order as the render list
+	vk::DeviceSize instance_ssbo_offset = resources.uniform_buffer_offset;
+	vk::DeviceSize instance_ssbo_size = std::max<size_t>(1, draw_list.size()) * sizeof(instance_gpu_data);
+	instance_gpu_data * instances = reinterpret_cast<instance_gpu_data *>(ubo + resources.uniform_buffer_offset);
+	resources.uniform_buffer_offset += utils::align_up(buffer_alignment, instance_ssbo_size);
 
-			reverse_side[index] = reverse_side[parent] ^ (det < 0);
+	for (auto && [idx, item]: utils::enumerate(draw_list))
+		instances[idx].model = world[item.node].transform_to_root;
 
-			visible[index] = visible[parent] && object.visible;
+	// Merge consecutive identical primitives into instanced draws
+	struct draw_batch
+	{
+		const draw_item * item;
+		uint32_t first_instance;
+		uint32_t instance_count;
+	};
+	std::vector<draw_batch> batches;
+
+	for (auto && [idx, item]: utils::enumerate(draw_list))
+	{
+		if (!batches.empty())
+		{
+			const draw_item & prev = *batches.back().item;
+			if (!item.joints_offset && !prev.joints_offset && item.pipeline == prev.pipeline && item.material == prev.material && item.primitive == prev.primitive)
+			{
+				batches.back().instance_count++;
+				continue;
+			}
 		}
-	}
 
-	// print_scene_hierarchy(scene, transform_to_root);
+		batches.push_back({
+		        .item = &item,
+		        .first_instance = uint32_t(idx),
+		        .instance_count = 1,
+		});
+	}
 
-	for (const auto && [frame_index, frame]: utils::enumerate(frames))
+	assert(frames.size() % view_count == 0);
+	for (size_t pass = 0; pass < frames.size(); pass += view_count)
 	{
-		scene_renderer::output_image & output = get_output_image_data(frame.destination);
-		glm::mat4 viewproj = frame.projection * frame.view;
+		std::span<frame_info> pass_frames = frames.subspan(pass, view_count);
+		scene_renderer::output_image & output = get_output_image_data(pass_frames[0].destination);
 
+		// One element per view of the pass, indexed with gl_ViewIndex
 		vk::DeviceSize frame_ubo_offset = resources.uniform_buffer_offset;
-		frame_gpu_data & frame_ubo = *reinterpret_cast<frame_gpu_data *>(ubo + resources.uniform_buffer_offset);
-		resources.uniform_buffer_offset += utils::align_up(buffer_alignment, sizeof(frame_gpu_data));
+		std::span<frame_gpu_data> frame_ubos{reinterpret_cast<frame_gpu_data *>(ubo + resources.uniform_buffer_offset), view_count};
+		resources.uniform_buffer_offset += utils::align_up(buffer_alignment, view_count * sizeof(frame_gpu_data));
+
+		for (auto && [frame_ubo, frame]: utils::zip(frame_ubos, pass_frames))
+		{
+			assert(frame.destination == pass_frames[0].destination);
 
-		// frame_ubo.ambient_color = glm::vec4(0.5,0.5,0.5,0); // TODO
-		// frame_ubo.light_color = glm::vec4(0.5,0.5,0.5,0); // TODO
+			// frame_ubo.ambient_color = glm::vec4(0.5,0.5,0.5,0); // TODO
+			// frame_ubo.light_color = glm::vec4(0.5,0.5,0.5,0); // TODO
 
-		// frame_ubo.ambient_color = glm::vec4(0.2,0.2,0.2,0); // TODO
-		// frame_ubo.light_color = glm::vec4(0.8,0.8,0.8,0); // TODO
+			// frame_ubo.ambient_color = glm::vec4(0.2,0.2,0.2,0); // TODO
+			// frame_ubo.light_color = glm::vec4(0.8,0.8,0.8,0); // TODO
 
-		frame_ubo.ambient_color = glm::vec4(0, 0, 0, 0);     // TODO
-		frame_ubo.light_color = glm::vec4(0.8, 0.8, 0.8, 0); // TODO
+			frame_ubo.ambient_color = glm::vec4(0, 0, 0, 0);     // TODO
+			frame_ubo.light_color = glm::vec4(0.8, 0.8, 0.8, 0); // TODO
 
-		frame_ubo.light_position = glm::vec4(1, 1, 1, 0); // TODO
-		frame_ubo.proj = frame.projection;
-		frame_ubo.view = frame.view;
+			frame_ubo.light_position = glm::vec4(1, 1, 1, 0); // TODO
+			frame_ubo.proj = frame.projection;
+			frame_ubo.view = frame.view;
+		}
 
 		cb.beginRenderPass(
 		        vk::RenderPassBeginInfo{
@@ -847,120 +1023,88 @@ void scene_renderer::render(scene_data & scene, const std::array<float, 4> & cle
 		        },
 		        vk::SubpassContents::eInline);
 
-		for (const auto & [index, node]: utils::enumerate(scene.scene_nodes))
-		{
-			if (!node.mesh_id)
-				continue;
+		auto push_descriptors = [&](vk::DeviceSize joints_ubo_offset) {
+			vk::DescriptorBufferInfo buffer_info_1{
+			        .buffer = resources.uniform_buffer,
+			        .offset = frame_ubo_offset,
+			        .range = view_count * sizeof(frame_gpu_data)
+
+			};
+			vk::DescriptorBufferInfo buffer_info_2{
+			        .buffer = resources.uniform_buffer,
+			        .offset = instance_ssbo_offset,
+			        .range = instance_ssbo_size};
+			vk::DescriptorBufferInfo buffer_info_3{
+			        .buffer = resources.uniform_buffer,
+			        .offset = joints_ubo_offset,
+			        .range = sizeof(glm::mat4) * 32};
+
+			std::array descriptors{
+			        vk::WriteDescriptorSet{
+			                .dstBinding = 0,
+			                .descriptorCount = 1,
+			                .descriptorType = vk::DescriptorType::eUniformBuffer,
+			                .pBufferInfo = &buffer_info_1,
+			        },
+			        vk::WriteDescriptorSet{
+			                .dstBinding = 1,
+			                .descriptorCount = 1,
+			                .descriptorType = vk::DescriptorType::eStorageBuffer,
+			                .pBufferInfo = &buffer_info_2,
+			        },
+			        vk::WriteDescriptorSet{
+			                .dstBinding = 2,
+			                .descriptorCount = 1,
+			                .descriptorType = vk::DescriptorType::eUniformBuffer,
+			                .pBufferInfo = &buffer_info_3,
+			        },
+			};
+
+			cb.pushDescriptorSetKHR(vk::PipelineBindPoint::eGraphics, *pipeline_layout, 0, descriptors);
+		};
 
-			if (!visible[index])
-				continue;
+		// Set 0 only changes for skinned primitives
+		push_descriptors(0);
 
-			scene_data::mesh & mesh = scene.meshes.at(*node.mesh_id);
-			glm::mat4 & transform = transform_to_root[index];
+		vk::Pipeline current_pipeline;
+		scene_data::material * current_material = nullptr;
+		scene_data::primitive * current_primitive = nullptr;
 
-			vk::DeviceSize instance_ubo_offset = resources.uniform_buffer_offset;
-			instance_gpu_data & object_ubo = *reinterpret_cast<instance_gpu_data *>(ubo + resources.uniform_buffer_offset);
-			resources.uniform_buffer_offset += utils::align_up(buffer_alignment, sizeof(frame_gpu_data));
+		for (const draw_batch & batch: batches)
+		{
+			const draw_item & item = *batch.item;
+			scene_data::primitive & primitive = *item.primitive;
 
-			vk::DeviceSize joints_ubo_offset = 0;
-			if (!node.joints.empty())
+			if (item.pipeline != current_pipeline)
 			{
-				joints_ubo_offset = resources.uniform_buffer_offset;
-				glm::mat4 * joint_matrices = reinterpret_cast<glm::mat4 *>(ubo + resources.uniform_buffer_offset);
-				resources.uniform_buffer_offset += utils::align_up(buffer_alignment, sizeof(glm::mat4) * 32);
-				assert(node.joints.size() <= 32);
-
-				for (auto && [idx, joint]: utils::enumerate(node.joints))
-				{
-					joint_matrices[idx] = glm::inverse(transform) * transform_to_root[joint.first] * joint.second;
-				}
+				cb.bindPipeline(vk::PipelineBindPoint::eGraphics, item.pipeline);
+				current_pipeline = item.pipeline;
 			}
 
-			object_ubo.model = transform;
-			object_ubo.modelview = frame.view * transform;
-			object_ubo.modelviewproj = viewproj * transform;
+			if (item.joints_offset)
+				push_descriptors(*item.joints_offset);
 
-			for (scene_data::primitive & primitive: mesh.primitives)
+			// Set 1: material
+			if (item.material != current_material)
 			{
-				// Get the material
-				std::shared_ptr<scene_data::material> material = primitive.material_ ? primitive.material_ : default_material;
-
-				if (material->ds_dirty || !material->ds)
-					update_material_descriptor_set(*material);
-
-				// Get the pipeline
-				pipeline_info info{
-				        .shader_name = material->shader_name,
-				        .cull_mode = primitive.cull_mode,
-				        .front_face = primitive.front_face,
-				        .topology = primitive.topology,
-				        .blend_enable = material->blend_enable,
-
-				        .nb_texcoords = 2, // TODO
-				        .skinning = !node.joints.empty(),
-				};
-
-				if (material->double_sided)
-					info.cull_mode = vk::CullModeFlagBits::eNone;
-
-				if (reverse_side[index])
-					info.front_face = reverse(info.front_face);
-
-				cb.bindPipeline(vk::PipelineBindPoint::eGraphics, *get_pipeline(info));
-
-				if (primitive.indexed)
-					cb.bindIndexBuffer(*mesh.buffer, primitive.index_offset, primitive.index_type);
-
-				cb.bindVertexBuffers(0, (vk::Buffer)*mesh.buffer, primitive.vertex_offset);
-
-				vk::DescriptorBufferInfo buffer_info_1{
-				        .buffer = resources.uniform_buffer,
-				        .offset = frame_ubo_offset,
-				        .range = sizeof(frame_gpu_data)
-
-				};
-				vk::DescriptorBufferInfo buffer_info_2{
-				        .buffer = resources.uniform_buffer,
-				        .offset = instance_ubo_offset,
-				        .range = sizeof(instance_gpu_data)};
-				vk::DescriptorBufferInfo buffer_info_3{
-				        .buffer = resources.uniform_buffer,
-				        .offset = joints_ubo_offset,
-				        .range = sizeof(glm::mat4) * 32};
-
-				std::array descriptors{
-				        vk::WriteDescriptorSet{
-				                .dstBinding = 0,
-				                .descriptorCount = 1,
-				                .descriptorType = vk::DescriptorType::eUniformBuffer,
-				                .pBufferInfo = &buffer_info_1,
-				        },
-				        vk::WriteDescriptorSet{
-				                .dstBinding = 1,
-				                .descriptorCount = 1,
-				                .descriptorType = vk::DescriptorType::eUniformBuffer,
-				                .pBufferInfo = &buffer_info_2,
-				        },
-				        vk::WriteDescriptorSet{
-				                .dstBinding = 2,
-				                .descriptorCount = 1,
-				                .descriptorType = vk::DescriptorType::eUniformBuffer,
-				                .pBufferInfo = &buffer_info_3,
-				        },
-				};
-
-				cb.pushDescriptorSetKHR(vk::PipelineBindPoint::eGraphics, *pipeline_layout, 0, descriptors);
-
-				// Set 1: material
-				cb.bindDescriptorSets(vk::PipelineBindPoint::eGraphics, *pipeline_layout, 1, **material->ds, {});
+				cb.bindDescriptorSets(vk::PipelineBindPoint::eGraphics, *pipeline_layout, 1, **item.material->ds, {});
+				resources.resources.push_back(item.material->ds);
+				current_material = item.material;
+			}
 
+			if (item.primitive != current_primitive)
+			{
 				if (primitive.indexed)
-					cb.drawIndexed(primitive.index_count, 1, 0, 0, 0);
-				else
-					cb.draw(primitive.vertex_count, 1, 0, 0);
+					cb.bindIndexBuffer(*item.mesh->buffer, primitive.index_offset, primitive.index_type);
 
-				resources.resources.push_back(material->ds);
+				cb.bindVertexBuffers(0, (vk::Buffer)*item.mesh->buffer, primitive.vertex_offset);
+				current_primitive = item.primitive;
 			}
+
+			if (primitive.indexed)
+				cb.drawIndexed(primitive.index_count, batch.instance_count, 0, 0, batch.first_instance);
+			else
+				cb.draw(primitive.vertex_count, batch.instance_count, 0, batch.first_instance);
 		}
 		cb.endRenderPass();
 	}
@@ -72,21 +72,26 @@ class scene_renderer
 	const vk::Extent2D output_size;
 	const vk::Format output_format;
 	const vk::Format depth_format;
+	// Views rendered in each render pass, 2 with multiview
+	const uint32_t view_count;
 
 	// Destination images
 	struct output_image
 	{
 		vk::raii::Framebuffer framebuffer = nullptr;
 		vk::raii::ImageView image_view = nullptr;
+	};
 
-		image_allocation depth_buffer;
-		vk::raii::ImageView depth_view = nullptr;
+	// Transient attachments, their content does not outlive a render pass so
+	// they are shared by the framebuffers of all the destination images
+	image_allocation depth_buffer;
+	vk::raii::ImageView depth_view = nullptr;
 
-		image_allocation multisample_image;
-		vk::raii::ImageView multisample_view = nullptr;
-	};
+	image_allocation multisample_image;
+	vk::raii::ImageView multisample_view = nullptr;
 
 	// Initialization functions
+	void create_transient_attachments();
 	output_image create_output_image_data(vk::Image output);
 	vk::raii::RenderPass create_renderpass();
 	vk::raii::PipelineLayout create_pipeline_layout(std::span<vk::DescriptorSetLayout> layouts);
@@ -103,7 +108,7 @@ class scene_renderer
 	output_image & get_output_image_data(vk::Image output);
 	vk::raii::Pipeline & get_pipeline(const pipeline_info & info);
 
-	vk::raii::DescriptorSetLayout layout_0; // Descriptor set 0: per-frame/view data (UBO) and per-instance data (UBO + SSBO)
+	vk::raii::DescriptorSetLayout layout_0; // Descriptor set 0: per-frame/view data (UBO) and per-instance data (SSBO) and joints (UBO)
 	vk::raii::DescriptorSetLayout layout_1; // Descriptor set 1: per-material data (5 combined image samplers and 1 uniform buffer)
 
 	// Descriptor set 1: per-material data (5 combined image samplers and 1 uniform buffer)
@@ -143,11 +148,10 @@ class scene_renderer
 		glm::vec4 light_color;
 	};
 
+	// Element of the per-instance SSBO, the view dependent matrices are computed in the vertex shader
 	struct instance_gpu_data
 	{
 		glm::mat4 model;
-		glm::mat4 modelview;
-		glm::mat4 modelviewproj;
 	};
 
 	struct per_frame_resources
@@ -165,6 +169,10 @@ class scene_renderer
 
 	std::vector<per_frame_resources> frame_resources;
 	int current_frame_index;
+
+	// Indexed like scene_data::scene_nodes, kept between frames to avoid allocating them each time
+	std::vector<uint8_t> transform_changed;
+	std::vector<uint8_t> visible;
 	vk::raii::QueryPool query_pool = nullptr;
 	double gpu_time_s = 0;
 
@@ -181,10 +189,12 @@ public:
 	        vk::Extent2D output_size,
 	        vk::Format output_format,
 	        std::span<vk::Format> depth_formats,
+	        bool multiview = false,
 	        int frames_in_flight = 2);
 
 	~scene_renderer();
 
+	// With multiview, each group of view_count consecutive frames is rendered in the layers of one destination image
 	struct frame_info
 	{
 		vk::Image destination;
@@ -0,0 +1,162 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "texture_streamer.h"
+
+#include "render/image_loader.h"
+#include <spdlog/spdlog.h>
+
+texture_streamer::texture_streamer(vk::raii::Device & device, vk::raii::PhysicalDevice physical_device, vk::raii::Queue & queue, uint32_t queue_family_index) :
+        device(device),
+        physical_device(physical_device),
+        queue(queue),
+        cb_pool(device, vk::CommandPoolCreateInfo{
+                                .flags = vk::CommandPoolCreateFlagBits::eTransient | vk::CommandPoolCreateFlagBits::eResetCommandBuffer,
+                                .queueFamilyIndex = queue_family_index,
+                        })
+{
+}
+
+texture_streamer::~texture_streamer()
+{
+	cancel();
+}
+
+bool texture_streamer::decode(utils::async_token<bool, int> token, std::shared_ptr<queues> shared)
+{
+	int count = 0;
+	while (not token.is_cancelled())
+	{
+		decode_request request;
+		{
+			std::unique_lock lock(shared->mutex);
+			if (shared->pending.empty())
+			{
+				shared->running = false;
+				break;
+			}
+			request = std::move(shared->pending.front());
+			shared->pending.pop_front();
+		}
+
+		std::shared_ptr<decoded_image> image;
+		try
+		{
+			image = std::make_shared<decoded_image>(image_loader::decode(request.bytes, request.srgb));
+		}
+		catch (std::exception & e)
+		{
+			spdlog::info("Cannot load image: {}", e.what());
+		}
+
+		std::unique_lock lock(shared->mutex);
+		shared->decoded.push_back({request.id, std::move(image)});
+		token.set_progress(++count);
+	}
+
+	return true;
+}
+
+void texture_streamer::add(std::shared_ptr<scene_data::texture> texture, std::span<const std::byte> bytes, bool srgb)
+{
+	textures[texture.get()].texture = texture;
+
+	std::unique_lock lock(shared->mutex);
+	shared->pending.push_back({
+	        .id = texture.get(),
+	        .bytes = {bytes.begin(), bytes.end()},
+	        .srgb = srgb,
+	});
+
+	if (not shared->running)
+	{
+		shared->running = true;
+		worker = utils::async<bool, int>(&texture_streamer::decode, shared);
+	}
+}
+
+void texture_streamer::add_users(const std::shared_ptr<scene_data::material> & material)
+{
+	for (auto & texture: {
+	             material->base_color_texture,
+	             material->metallic_roughness_texture,
+	             material->occlusion_texture,
+	             material->emissive_texture,
+	             material->normal_texture,
+	     })
+	{
+		if (auto it = textures.find(texture.get()); it != textures.end())
+			it->second.materials.push_back(material);
+	}
+}
+
+void texture_streamer::upload(std::chrono::nanoseconds budget)
+{
+	auto deadline = std::chrono::steady_clock::now() + budget;
+
+	while (not textures.empty() and std::chrono::steady_clock::now() < deadline)
+	{
+		decode_result result;
+		{
+			std::unique_lock lock(shared->mutex);
+			if (shared->decoded.empty())
+				return;
+			result = std::move(shared->decoded.front());
+			shared->decoded.pop_front();
+		}
+
+		auto node = textures.extract(result.id);
+		if (node.empty())
+			continue;
+
+		// The scene may have been destroyed in the meantime, the placeholder is kept if the image is invalid
+		auto texture = node.mapped().texture.lock();
+		if (not texture or not result.image)
+			continue;
+
+		try
+		{
+			image_loader loader(physical_device, device, queue, cb_pool);
+			loader.load(*result.image);
+			spdlog::debug("Streamed image {}x{}, format {}, {} mipmaps", loader.extent.width, loader.extent.height, vk::to_string(loader.format), loader.num_mipmaps);
+			texture->image_view = loader.image_view;
+		}
+		catch (std::exception & e)
+		{
+			spdlog::info("Cannot upload image: {}", e.what());
+			continue;
+		}
+
+		for (auto & weak_material: node.mapped().materials)
+		{
+			if (auto material = weak_material.lock())
+				material->ds_dirty = true;
+		}
+	}
+}
+
+void texture_streamer::cancel()
+{
+	worker.cancel();
+	textures.clear();
+
+	// The decoding thread may still be running, give it its own queues
+	shared = std::make_shared<queues>();
+}
@@ -0,0 +1,103 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "render/scene_data.h"
+#include "utils/async.h"
+#include <chrono>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <unordered_map>
+#include <vector>
+#include <vulkan/vulkan_raii.hpp>
+
+struct decoded_image;
+
+// Decodes the scene textures in the background so that the geometry can be displayed
+// before the images are ready: the textures use a placeholder image until then.
+class texture_streamer
+{
+	struct decode_request
+	{
+		const scene_data::texture * id;
+		std::vector<std::byte> bytes;
+		bool srgb;
+	};
+
+	struct decode_result
+	{
+		const scene_data::texture * id;
+		std::shared_ptr<decoded_image> image;
+	};
+
+	// Shared with the decoding thread
+	struct queues
+	{
+		std::mutex mutex;
+		std::deque<decode_request> pending;
+		std::deque<decode_result> decoded;
+		bool running = false;
+	};
+
+	struct pending_texture
+	{
+		std::weak_ptr<scene_data::texture> texture;
+		// Materials whose descriptor set must be updated when the texture is ready
+		std::vector<std::weak_ptr<scene_data::material>> materials;
+	};
+
+	vk::raii::Device & device;
+	vk::raii::PhysicalDevice physical_device;
+	vk::raii::Queue & queue;
+	vk::raii::CommandPool cb_pool;
+
+	std::shared_ptr<queues> shared = std::make_shared<queues>();
+	utils::future<bool, int> worker;
+
+	// Only accessed from the render thread
+	std::unordered_map<const scene_data::texture *, pending_texture> textures;
+
+	static bool decode(utils::async_token<bool, int> token, std::shared_ptr<queues> shared);
+
+public:
+	texture_streamer(vk::raii::Device & device, vk::raii::PhysicalDevice physical_device, vk::raii::Queue & queue, uint32_t queue_family_index);
+	~texture_streamer();
+
+	// Queue a PNG/JPEG/KTX2 file, the texture keeps its current image view until it is uploaded
+	void add(std::shared_ptr<scene_data::texture> texture, std::span<const std::byte> bytes, bool srgb);
+
+	// Mark the material to be updated when one of its textures is uploaded
+	void add_users(const std::shared_ptr<scene_data::material> & material);
+
+	// Upload the decoded textures, until the budget is exceeded, called from the render thread
+	void upload(std::chrono::nanoseconds budget);
+
+	// Drop all the textures that are not uploaded yet
+	void cancel();
+
+	bool done() const
+	{
+		return textures.empty();
+	}
+};
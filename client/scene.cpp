@@ -49,3 +49,4 @@ void scene::on_focused() {}
 void scene::on_interaction_profile_changed() {}
 void scene::on_reference_space_changed(XrReferenceSpaceType, XrTime) {}
 void scene::on_session_state_changed(XrSessionState) {}
+void scene::on_perf_settings(const XrEventDataPerfSettingsEXT &) {}
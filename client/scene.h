@@ -107,6 +107,8 @@ public:
 	virtual void on_interaction_profile_changed();
 	virtual void on_reference_space_changed(XrReferenceSpaceType space, XrTime);
 	virtual void on_session_state_changed(XrSessionState state);
+	// XR_EXT_performance_settings notification
+	virtual void on_perf_settings(const XrEventDataPerfSettingsEXT &);
 };
 
 template <typename T>
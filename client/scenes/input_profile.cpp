@@ -132,10 +132,11 @@ struct json_visual_response
 
 input_profile::input_profile(const std::filesystem::path & json_profile, scene_loader & loader, scene_data & scene)
 {
-	std::string json = asset(json_profile);
+	asset json(json_profile);
 
+	// simdjson only copies the document if the mapped file is not padded enough
 	simdjson::dom::parser parser;
-	simdjson::dom::element root = parser.parse(json);
+	simdjson::dom::element root = parser.parse(reinterpret_cast<const char *>(json.data()), json.size(), json.padding() < simdjson::SIMDJSON_PADDING);
 
 	id = std::string(root["profileId"]);
 
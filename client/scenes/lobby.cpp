@@ -28,6 +28,7 @@
 #include "render/scene_renderer.h"
 #include "stream.h"
 #include "utils/contains.h"
+#include "utils/step_timer.h"
 #include "version.h"
 #include "wifi_lock.h"
 #include "wivrn_client.h"
@@ -45,7 +46,9 @@
 #include <vulkan/vulkan_raii.hpp>
 
 #include <arpa/inet.h>
+#include <fcntl.h>
 #include <netdb.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 
@@ -143,6 +146,9 @@ scenes::lobby::lobby()
 		throw std::runtime_error(_("No supported swapchain format"));
 
 	spdlog::info("Using format {}", vk::to_string(swapchain_format));
+
+	// Start browsing before the session is focused, the servers are usually found by the time the lobby is shown
+	discover.emplace();
 }
 
 static std::string ip_address_to_string(const in_addr & addr)
@@ -159,6 +165,155 @@ static std::string ip_address_to_string(const in6_addr & addr)
 	return buf;
 }
 
+static int connect_nonblocking(const in_addr & address, int port)
+{
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		throw std::system_error(errno, std::generic_category());
+
+	sockaddr_in sa{
+	        .sin_family = AF_INET,
+	        .sin_port = htons(port),
+	        .sin_addr = address,
+	};
+	if (::connect(fd, (sockaddr *)&sa, sizeof(sa)) < 0 and errno != EINPROGRESS)
+	{
+		int err = errno;
+		::close(fd);
+		throw std::system_error(err, std::generic_category());
+	}
+	return fd;
+}
+
+static int connect_nonblocking(const in6_addr & address, int port)
+{
+	int fd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		throw std::system_error(errno, std::generic_category());
+
+	sockaddr_in6 sa{
+	        .sin6_family = AF_INET6,
+	        .sin6_port = htons(port),
+	        .sin6_addr = address,
+	};
+	if (::connect(fd, (sockaddr *)&sa, sizeof(sa)) < 0 and errno != EINPROGRESS)
+	{
+		int err = errno;
+		::close(fd);
+		throw std::system_error(err, std::generic_category());
+	}
+	return fd;
+}
+
+// Happy eyeballs (RFC 8305): start a connection attempt on the next address every 250ms without waiting
+// for the previous ones to fail, alternating between IPv6 and IPv4, and keep the first one that succeeds
+static std::pair<TCP, std::variant<in_addr, in6_addr>> race_connect(const wivrn_discover::service & service)
+{
+	using address_type = std::variant<in_addr, in6_addr>;
+	const auto attempt_delay = std::chrono::milliseconds(250);
+	const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+
+	std::vector<address_type> ipv4;
+	std::vector<address_type> ipv6;
+	for (const auto & address: service.addresses)
+		(std::holds_alternative<in_addr>(address) ? ipv4 : ipv6).push_back(address);
+
+	std::vector<address_type> candidates;
+	for (size_t i = 0; i < std::max(ipv4.size(), ipv6.size()); i++)
+	{
+		if (i < ipv6.size())
+			candidates.push_back(ipv6[i]);
+		if (i < ipv4.size())
+			candidates.push_back(ipv4[i]);
+	}
+
+	std::string error;
+	auto add_error = [&](const address_type & address, const std::string & message) {
+		std::string address_string = std::visit([](auto & address) { return ip_address_to_string(address); }, address);
+		spdlog::warn("Cannot connect to {} ({}): {}", service.hostname, address_string, message);
+		if (not error.empty())
+			error += "\n";
+		error += fmt::format(_F("Cannot connect to {} ({}): {}"), service.hostname, address_string, message);
+	};
+
+	std::vector<std::pair<int, address_type>> pending;
+	size_t next = 0;
+	auto next_attempt = std::chrono::steady_clock::now();
+
+	while (next < candidates.size() or not pending.empty())
+	{
+		auto now = std::chrono::steady_clock::now();
+		if (now >= deadline)
+		{
+			for (auto & [fd, address]: pending)
+			{
+				::close(fd);
+				add_error(address, _("Connection timed out"));
+			}
+			pending.clear();
+			break;
+		}
+
+		if (next < candidates.size() and (now >= next_attempt or pending.empty()))
+		{
+			const auto & address = candidates[next++];
+			try
+			{
+				spdlog::debug("Trying address {}", std::visit([](auto & address) { return ip_address_to_string(address); }, address));
+				int fd = std::visit([port = service.port](auto & address) { return connect_nonblocking(address, port); }, address);
+				pending.emplace_back(fd, address);
+			}
+			catch (std::exception & e)
+			{
+				add_error(address, e.what());
+			}
+			next_attempt = now + attempt_delay;
+			continue;
+		}
+
+		std::vector<pollfd> fds;
+		for (auto & [fd, address]: pending)
+			fds.push_back({.fd = fd, .events = POLLOUT});
+
+		auto wait_until = next < candidates.size() ? std::min(next_attempt, deadline) : deadline;
+		int timeout = std::max<int>(0, std::chrono::duration_cast<std::chrono::milliseconds>(wait_until - now).count());
+		if (::poll(fds.data(), fds.size(), timeout) < 0 and errno != EINTR)
+			throw std::system_error(errno, std::system_category());
+
+		for (size_t i = fds.size(); i-- > 0;)
+		{
+			if (not fds[i].revents)
+				continue;
+
+			auto [fd, address] = pending[i];
+			pending.erase(pending.begin() + i);
+
+			int err = 0;
+			socklen_t len = sizeof(err);
+			if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+				err = errno;
+
+			if (err)
+			{
+				::close(fd);
+				add_error(address, strerror(err));
+				continue;
+			}
+
+			// Connected: drop the other attempts, they are still in the server backlog at most
+			for (auto & [other_fd, other_address]: pending)
+				::close(other_fd);
+
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+			return {TCP(fd), address};
+		}
+	}
+
+	if (error.empty())
+		error = fmt::format(_F("Cannot connect to {}: no address"), service.hostname);
+	throw std::runtime_error(error);
+}
+
 std::unique_ptr<wivrn_session> connect_to_session(wivrn_discover::service service, bool manual_connection)
 {
 	if (!manual_connection)
@@ -212,34 +367,8 @@ std::unique_ptr<wivrn_session> connect_to_session(wivrn_discover::service servic
 		freeaddrinfo(addresses);
 	}
 
-	std::string error;
-	for (const auto & address: service.addresses)
-	{
-		std::string address_string = std::visit([](auto & address) {
-			return ip_address_to_string(address);
-		},
-		                                        address);
-
-		try
-		{
-			spdlog::debug("Trying address {}", address_string);
-
-			return std::visit([port = service.port](auto & address) {
-				return std::make_unique<wivrn_session>(address, port);
-			},
-			                  address);
-		}
-		catch (std::exception & e)
-		{
-			spdlog::warn("Cannot connect to {} ({}): {}", service.hostname, address_string, e.what());
-			std::string txt = fmt::format(_F("Cannot connect to {} ({}): {}"), service.hostname, address_string, e.what());
-			if (not error.empty())
-				error += "\n";
-			error += txt;
-		}
-	}
-
-	throw std::runtime_error(error);
+	auto [control, address] = race_connect(service);
+	return std::make_unique<wivrn_session>(std::move(control), address, service.port);
 }
 
 static glm::mat4 projection_matrix(XrFovf fov, float zn = 0.02)
@@ -273,10 +402,9 @@ static glm::mat4 view_matrix(XrPosef pose)
 
 void scenes::lobby::update_server_list()
 {
+	// Stopped in on_unfocused
 	if (application::is_focused() && !discover)
 		discover.emplace();
-	else if (!application::is_focused() && discover)
-		discover.reset();
 
 	if (!discover)
 		return;
@@ -342,12 +470,28 @@ void scenes::lobby::connect(const configuration::server_data & data)
 	server_name = data.service.name;
 	async_error.reset();
 
+	server_cookie.clear();
+	for (auto & [cookie, server]: application::get_config().servers)
+	{
+		if (&server == &data)
+			server_cookie = cookie;
+	}
+
+	// Do not wait for mDNS if the server was reached before
+	auto service = data.service;
+	connecting_to_cached_address = not data.visible and not data.manual and data.last_address;
+	if (connecting_to_cached_address)
+	{
+		spdlog::info("Connecting to {} at its last known address", data.service.name);
+		service.addresses = {*data.last_address};
+	}
+
 	async_session = utils::async<std::unique_ptr<wivrn_session>, std::string>(
 	        [](auto token, wivrn_discover::service service, bool manual) {
 		        token.set_progress(_("Waiting for connection"));
 		        return connect_to_session(service, manual);
 	        },
-	        data.service,
+	        service,
 	        data.manual);
 }
 
@@ -437,13 +581,23 @@ static std::vector<XrCompositionLayerProjectionView> render_layer(std::vector<Xr
 	std::vector<XrCompositionLayerProjectionView> layer_views;
 	layer_views.reserve(views.size());
 
-	for (auto && [view, swapchain]: utils::zip(views, swapchains))
+	std::vector<int> image_indices;
+	for (auto & swapchain: swapchains)
 	{
-		int image_index = swapchain.acquire();
+		image_indices.push_back(swapchain.acquire());
 		swapchain.wait();
+	}
+
+	// With multiview, a single swapchain has one layer per view
+	bool multiview = swapchains.size() < views.size();
+
+	for (auto && [view_index, view]: utils::enumerate(views))
+	{
+		size_t swapchain_index = multiview ? 0 : view_index;
+		xr::swapchain & swapchain = swapchains[swapchain_index];
 
 		frames.push_back({
-		        .destination = swapchain.images()[image_index].image,
+		        .destination = swapchain.images()[image_indices[swapchain_index]].image,
 		        .projection = projection_matrix(view.fov),
 		        .view = view_matrix(view.pose),
 		});
@@ -458,6 +612,7 @@ static std::vector<XrCompositionLayerProjectionView> render_layer(std::vector<Xr
 		                        .offset = {0, 0},
 		                        .extent = swapchain.extent(),
 		                },
+		                .imageArrayIndex = multiview ? uint32_t(view_index) : 0,
 		        },
 		});
 	}
@@ -486,15 +641,34 @@ void scenes::lobby::render(const XrFrameState & frame_state)
 		{
 			auto session = async_session.get();
 			if (session)
+			{
+				auto & config = application::get_config();
+				if (auto server = config.servers.find(server_cookie); server != config.servers.end() and not server->second.manual)
+				{
+					server->second.last_address = session->address;
+					config.save();
+				}
+
 				next_scene = stream::create(std::move(session), 1'000'000'000.f / frame_state.predictedDisplayPeriod);
+			}
 
 			async_session.reset();
 		}
 		catch (std::exception & e)
 		{
-			spdlog::error("Error connecting to server: {}", e.what());
 			async_session.cancel();
-			async_error = e.what();
+			auto & servers = application::get_config().servers;
+			if (auto server = servers.find(server_cookie); connecting_to_cached_address and server != servers.end())
+			{
+				// The server may have changed address, wait for it to be discovered
+				spdlog::info("Cannot connect to the last known address of {}: {}", server_name, e.what());
+				server->second.last_address.reset();
+			}
+			else
+			{
+				spdlog::error("Error connecting to server: {}", e.what());
+				async_error = e.what();
+			}
 		}
 	}
 
@@ -511,10 +685,16 @@ void scenes::lobby::render(const XrFrameState & frame_state)
 	imgui_ctx->set_current();
 	if (!async_session.valid() && !next_scene && !ImGui::IsPopupOpen("", ImGuiPopupFlags_AnyPopup))
 	{
+		char protocol_string[17];
+		sprintf(protocol_string, "%016lx", xrt::drivers::wivrn::protocol_version);
+
 		const auto & servers = application::get_config().servers;
 		for (auto && [cookie, data]: servers)
 		{
-			if (data.visible && (data.autoconnect || force_autoconnect) && data.compatible)
+			auto protocol = data.service.txt.find("protocol");
+			bool cached = not data.visible and not data.manual and data.last_address and protocol != data.service.txt.end() and protocol->second == protocol_string;
+
+			if ((data.visible or cached) && (data.autoconnect || force_autoconnect) && (data.compatible or cached))
 			{
 				connect(data);
 				break;
@@ -532,7 +712,7 @@ void scenes::lobby::render(const XrFrameState & frame_state)
 	session.begin_frame();
 
 	auto [flags, views] = session.locate_views(viewconfig, frame_state.predictedDisplayTime, world_space);
-	assert(views.size() == swapchains_lobby.size());
+	assert(views.size() == swapchains_lobby.size() or swapchains_lobby.size() == 1);
 
 	bool hide_left_controller = false;
 	bool hide_right_controller = false;
@@ -587,6 +767,20 @@ void scenes::lobby::render(const XrFrameState & frame_state)
 	XrCompositionLayerQuad imgui_layer = draw_gui(frame_state.predictedDisplayTime);
 
 	assert(renderer);
+
+	// Upload the textures decoded since the last frame
+	if (streamer and not streamer->done())
+		streamer->upload(std::chrono::milliseconds(2));
+
+	if (application::get_config().passthrough_enabled and lobby_scene)
+	{
+		// The environment is hidden by passthrough, free its buffers and textures
+		renderer->wait_idle();
+		lobby_scene.reset();
+	}
+	else if (not application::get_config().passthrough_enabled and not lobby_scene)
+		load_environment();
+
 	renderer->start_frame();
 	std::vector<XrCompositionLayerProjectionView> lobby_layer_views;
 	if (not application::get_config().passthrough_enabled)
@@ -651,6 +845,7 @@ void scenes::lobby::render(const XrFrameState & frame_state)
 
 void scenes::lobby::on_focused()
 {
+	utils::step_timer timer("Lobby loading");
 	recenter_gui = true;
 
 	auto views = system.view_configuration_views(viewconfig);
@@ -658,18 +853,33 @@ void scenes::lobby::on_focused()
 	uint32_t width = views[0].recommendedImageRectWidth;
 	uint32_t height = views[0].recommendedImageRectHeight;
 
-	swapchains_lobby.reserve(views.size());
-	swapchains_controllers.reserve(views.size());
+	// Render both eyes in a single pass, in the layers of an array swapchain
+	bool multiview = views.size() == 2 and application::vulkan_device_extension_enabled(VK_KHR_MULTIVIEW_EXTENSION_NAME);
+
 	for ([[maybe_unused]] auto view: views)
 	{
 		assert(view.recommendedImageRectWidth == width);
 		assert(view.recommendedImageRectHeight == height);
+	}
 
-		swapchains_lobby.emplace_back(session, device, swapchain_format, width, height);
-		swapchains_controllers.emplace_back(session, device, swapchain_format, width, height);
+	if (multiview)
+	{
+		auto usage = XR_SWAPCHAIN_USAGE_SAMPLED_BIT | XR_SWAPCHAIN_USAGE_COLOR_ATTACHMENT_BIT;
+		swapchains_lobby.emplace_back(session, device, swapchain_format, width, height, 1, usage, views.size());
+		swapchains_controllers.emplace_back(session, device, swapchain_format, width, height, 1, usage, views.size());
+	}
+	else
+	{
+		swapchains_lobby.reserve(views.size());
+		swapchains_controllers.reserve(views.size());
+		for (size_t i = 0; i < views.size(); i++)
+		{
+			swapchains_lobby.emplace_back(session, device, swapchain_format, width, height);
+			swapchains_controllers.emplace_back(session, device, swapchain_format, width, height);
+		}
 	}
 
-	spdlog::info("Created lobby swapchains: {}x{}", width, height);
+	spdlog::info("Created lobby swapchains: {}x{}{}", width, height, multiview ? " with multiview" : "");
 
 	vk::Extent2D output_size{width, height};
 
@@ -678,12 +888,15 @@ void scenes::lobby::on_focused()
 	        vk::Format::eD32Sfloat,
 	};
 
-	renderer.emplace(device, physical_device, queue, commandpool, output_size, swapchain_format, depth_formats);
+	renderer.emplace(device, physical_device, queue, commandpool, output_size, swapchain_format, depth_formats, multiview);
+	timer.step("renderer");
 
-	scene_loader loader(device, physical_device, queue, application::queue_family_index(), renderer->get_default_material());
+	streamer.emplace(device, physical_device, queue, application::queue_family_index());
+	scene_loader loader(device, physical_device, queue, application::queue_family_index(), renderer->get_default_material(), &*streamer);
 
-	lobby_scene.emplace();
-	lobby_scene->import(loader("ground.gltf"));
+	if (not application::get_config().passthrough_enabled)
+		load_environment();
+	timer.step("lobby scene");
 
 	controllers_scene.emplace();
 	input = input_profile("controllers/" + choose_webxr_profile() + "/profile.json", loader, *controllers_scene);
@@ -694,6 +907,7 @@ void scenes::lobby::on_focused()
 		left_hand.emplace("left-hand.glb", loader, *controllers_scene);
 		right_hand.emplace("right-hand.glb", loader, *controllers_scene);
 	}
+	timer.step("controller and hand models");
 
 	recenter_left_action = get_action("recenter_left").first;
 	recenter_right_action = get_action("recenter_right").first;
@@ -738,10 +952,20 @@ void scenes::lobby::on_focused()
 	{
 		about_picture = imgui_ctx->load_texture("wivrn.png");
 	}
+	timer.step("GUI");
 	setup_passthrough();
 	wifi_lock::want_multicast(true);
 }
 
+void scenes::lobby::load_environment()
+{
+	// The textures are decoded by the streamer, the geometry is displayed with the default material until then
+	scene_loader loader(device, physical_device, queue, application::queue_family_index(), renderer->get_default_material(), &*streamer);
+
+	lobby_scene.emplace();
+	lobby_scene->import(loader("ground.gltf"));
+}
+
 void scenes::lobby::setup_passthrough()
 {
 	auto & passthrough_enabled = application::get_config().passthrough_enabled;
@@ -771,6 +995,9 @@ void scenes::lobby::on_unfocused()
 {
 	discover.reset();
 
+	if (streamer)
+		streamer->cancel();
+
 	renderer->wait_idle(); // Must be before the scene data because the renderer uses its descriptor sets
 
 	about_picture = nullptr;
@@ -782,12 +1009,17 @@ void scenes::lobby::on_unfocused()
 	left_hand.reset();
 	right_hand.reset();
 
+	streamer.reset();
 	renderer.reset();
 	swapchains_lobby.clear();
 	swapchains_controllers.clear();
 	swapchain_imgui = xr::swapchain();
 	passthrough.emplace<std::monostate>();
 	wifi_lock::want_multicast(false);
+
+	// Without the performance overlay no GUI is shown while streaming, the glyphs are rasterized again when coming back
+	if (not application::get_config().show_performance_metrics)
+		imgui_context::release_font_cache();
 }
 
 void scenes::lobby::on_session_state_changed(XrSessionState state)
@@ -35,6 +35,7 @@
 #include "input_profile.h"
 #include "render/imgui_impl.h"
 #include "render/scene_renderer.h"
+#include "render/texture_streamer.h"
 #include "utils/async.h"
 
 class wivrn_session;
@@ -63,8 +64,12 @@ class lobby : public scene_impl<lobby>
 	std::optional<std::string> async_error;
 	std::shared_ptr<stream> next_scene;
 	std::string server_name;
+	std::string server_cookie;
+	// Connecting to the cached address of a server that is not discovered yet, do not show errors
+	bool connecting_to_cached_address = false;
 
 	std::optional<scene_renderer> renderer;
+	std::optional<texture_streamer> streamer;
 	std::optional<scene_data> lobby_scene;
 	std::optional<scene_data> controllers_scene;
 	std::optional<input_profile> input;
@@ -88,6 +93,9 @@ class lobby : public scene_impl<lobby>
 
 	void update_server_list();
 
+	// The environment is not loaded while passthrough hides it
+	void load_environment();
+
 	XrCompositionLayerQuad draw_gui(XrTime predicted_display_time);
 
 	XrAction recenter_left_action = XR_NULL_HANDLE;
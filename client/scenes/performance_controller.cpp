@@ -0,0 +1,162 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "performance_controller.h"
+
+#include "xr/session.h"
+#include "xr/xr.h"
+#include <algorithm>
+#include <spdlog/spdlog.h>
+
+using performance_state = xrt::drivers::wivrn::from_headset::performance_state;
+
+// The levels are evaluated on windows of this duration
+static const XrDuration window_duration = 2'000'000'000;
+static const size_t min_samples = 30;
+// Thresholds on the 90th percentile of the load
+static const float high_load = 0.8;
+static const float low_load = 0.5;
+// Low load windows needed before lowering a level, doubled each time the level had to be raised again
+static const int initial_windows_before_decrease = 5;
+static const int max_windows_before_decrease = 60;
+
+// Boost is not sustainable and power savings may drop frames
+static const XrPerfSettingsLevelEXT min_level = XR_PERF_SETTINGS_LEVEL_SUSTAINED_LOW_EXT;
+static const XrPerfSettingsLevelEXT max_level = XR_PERF_SETTINGS_LEVEL_SUSTAINED_HIGH_EXT;
+
+static performance_state::level to_level(XrPerfSettingsNotificationLevelEXT level)
+{
+	switch (level)
+	{
+		case XR_PERF_SETTINGS_NOTIF_LEVEL_NORMAL_EXT:
+			return performance_state::level::normal;
+		case XR_PERF_SETTINGS_NOTIF_LEVEL_WARNING_EXT:
+			return performance_state::level::warning;
+		default:
+			return performance_state::level::impaired;
+	}
+}
+
+performance_controller::performance_controller(xr::session & session) :
+        session(session)
+{
+	domains[cpu].id = XR_PERF_SETTINGS_DOMAIN_CPU_EXT;
+	domains[gpu].id = XR_PERF_SETTINGS_DOMAIN_GPU_EXT;
+	// Start high, so that the first frames are not late, then find the lowest stable level
+	for (auto & domain: domains)
+	{
+		domain.windows_before_decrease = initial_windows_before_decrease;
+		set_level(domain, max_level);
+	}
+}
+
+void performance_controller::set_level(domain_state & domain, XrPerfSettingsLevelEXT level)
+{
+	domain.level = level;
+	try
+	{
+		session.set_performance_level(domain.id, level);
+		spdlog::info("Performance level of {}: {}", xr::to_string(domain.id), xr::to_string(level));
+	}
+	catch (std::exception & e)
+	{
+		spdlog::warn("Cannot set performance level of {}: {}", xr::to_string(domain.id), e.what());
+	}
+}
+
+void performance_controller::add_sample(domain d, float load)
+{
+	if (load >= 0)
+		domains[d].load.push_back(load);
+}
+
+void performance_controller::adjust(domain_state & domain)
+{
+	if (domain.load.size() < min_samples)
+		return;
+
+	auto p90 = domain.load.begin() + domain.load.size() * 9 / 10;
+	std::ranges::nth_element(domain.load, p90);
+	float load = *p90;
+
+	// A higher level heats the headset more, the server lowers the bitrate instead
+	bool throttled = domain.notifications[XR_PERF_SETTINGS_SUB_DOMAIN_THERMAL_EXT - 1] != XR_PERF_SETTINGS_NOTIF_LEVEL_NORMAL_EXT;
+
+	if (load > high_load)
+	{
+		domain.idle_windows = 0;
+		if (domain.level < max_level and not throttled)
+		{
+			if (domain.decreased)
+				domain.windows_before_decrease = std::min(2 * domain.windows_before_decrease, max_windows_before_decrease);
+			domain.decreased = false;
+			set_level(domain, XrPerfSettingsLevelEXT(domain.level + 25));
+		}
+	}
+	else if (load < low_load)
+	{
+		if (++domain.idle_windows >= domain.windows_before_decrease and domain.level > min_level)
+		{
+			domain.idle_windows = 0;
+			domain.decreased = true;
+			set_level(domain, XrPerfSettingsLevelEXT(domain.level - 25));
+		}
+	}
+	else
+	{
+		domain.idle_windows = 0;
+		// The level is stable
+		domain.decreased = false;
+	}
+}
+
+void performance_controller::update(XrTime now)
+{
+	if (window_start == 0)
+		window_start = now;
+	if (now < window_start + window_duration)
+		return;
+	window_start = now;
+
+	for (auto & domain: domains)
+	{
+		adjust(domain);
+		domain.load.clear();
+	}
+}
+
+performance_state performance_controller::on_notification(const XrEventDataPerfSettingsEXT & event)
+{
+	for (auto & domain: domains)
+	{
+		if (domain.id == event.domain and event.subDomain >= 1 and event.subDomain <= domain.notifications.size())
+			domain.notifications[event.subDomain - 1] = event.toLevel;
+	}
+
+	performance_state state{};
+	for (auto & domain: domains)
+	{
+		state.thermal = std::max(state.thermal, to_level(domain.notifications[XR_PERF_SETTINGS_SUB_DOMAIN_THERMAL_EXT - 1]));
+		state.load = std::max(state.load, to_level(domain.notifications[XR_PERF_SETTINGS_SUB_DOMAIN_COMPOSITING_EXT - 1]));
+		state.load = std::max(state.load, to_level(domain.notifications[XR_PERF_SETTINGS_SUB_DOMAIN_RENDERING_EXT - 1]));
+	}
+
+	return state;
+}
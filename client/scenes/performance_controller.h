@@ -0,0 +1,76 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+
+#pragma once
+
+#include "wivrn_packets.h"
+#include <array>
+#include <openxr/openxr.h>
+#include <vector>
+
+namespace xr
+{
+class session;
+}
+
+// Holds the lowest CPU and GPU levels of XR_EXT_performance_settings at which
+// the frames are decoded and rendered in time, from the measured load of each frame
+class performance_controller
+{
+public:
+	enum domain
+	{
+		cpu,
+		gpu,
+	};
+
+private:
+	struct domain_state
+	{
+		XrPerfSettingsDomainEXT id;
+		XrPerfSettingsLevelEXT level;
+		// Fraction of the available time used by each frame in the current window
+		std::vector<float> load;
+		// Consecutive windows with a low load, and how many are needed to lower the level
+		int idle_windows = 0;
+		int windows_before_decrease;
+		bool decreased = false;
+		// Last notification of the runtime for each sub-domain
+		std::array<XrPerfSettingsNotificationLevelEXT, 3> notifications{};
+	};
+
+	xr::session & session;
+	std::array<domain_state, 2> domains;
+	XrTime window_start = 0;
+
+	void set_level(domain_state &, XrPerfSettingsLevelEXT);
+	void adjust(domain_state &);
+
+public:
+	performance_controller(xr::session &);
+
+	// Load of a frame, as a fraction of the time available for it
+	void add_sample(domain, float load);
+	// Called once per frame, adjusts the levels at the end of each window
+	void update(XrTime now);
+	// Returns the state from all the notifications received so far
+	xrt::drivers::wivrn::from_headset::performance_state on_notification(const XrEventDataPerfSettingsEXT &);
+};
@@ -22,7 +22,6 @@
 
 #include "application.h"
 #include "audio/audio.h"
-#include "boost/pfr/core.hpp"
 #include "decoder/shard_accumulator.h"
 #include "hardware.h"
 #include "spdlog/spdlog.h"
@@ -33,9 +32,15 @@
 #include "wifi_lock.h"
 #include "wivrn_packets.h"
 #include <algorithm>
+#include <cmath>
+#include <glm/gtc/quaternion.hpp>
+#include <limits>
+#include <magic_enum.hpp>
 #include <mutex>
 #include <ranges>
+#include <sys/eventfd.h>
 #include <thread>
+#include <unistd.h>
 #include <vulkan/vulkan_raii.hpp>
 
 using namespace xrt::drivers::wivrn;
@@ -74,6 +79,11 @@ static const std::array supported_formats =
                 vk::Format::eR8G8B8A8Srgb,
                 vk::Format::eB8G8R8A8Srgb};
 
+static const std::array supported_depth_formats =
+        {
+                vk::Format::eD16Unorm,
+                vk::Format::eD32Sfloat};
+
 std::shared_ptr<scenes::stream> scenes::stream::create(std::unique_ptr<wivrn_session> network_session, float guessed_fps)
 {
 	std::shared_ptr<stream> self{new stream};
@@ -104,6 +114,24 @@ std::shared_ptr<scenes::stream> scenes::stream::create(std::unique_ptr<wivrn_ses
 		j = i.fov;
 	}
 
+	if (self->instance.has_extension(XR_KHR_VISIBILITY_MASK_EXTENSION_NAME))
+	{
+		// The server gives it to the applications, they skip the pixels hidden by the lenses
+		for (auto [i, mask]: utils::enumerate(info.hidden_area))
+		{
+			try
+			{
+				auto [vertices, indices] = self->session.get_visibility_mask(self->viewconfig, i, XR_VISIBILITY_MASK_TYPE_HIDDEN_TRIANGLE_MESH_KHR);
+				if (not indices.empty())
+					mask = {std::move(vertices), std::move(indices)};
+			}
+			catch (std::exception & e)
+			{
+				spdlog::warn("Unable to get the visibility mask of view {}: {}", i, e.what());
+			}
+		}
+	}
+
 	if (self->instance.has_extension(XR_FB_DISPLAY_REFRESH_RATE_EXTENSION_NAME))
 	{
 		info.available_refresh_rates = self->session.get_refresh_rates();
@@ -121,22 +149,47 @@ std::shared_ptr<scenes::stream> scenes::stream::create(std::unique_ptr<wivrn_ses
 
 	info.hand_tracking = application::get_hand_tracking_supported();
 
+	const auto & decode_time = application::get_config().decode_time;
+	for (auto codec: decoder_impl::supported_codecs())
+	{
+		auto it = decode_time.find(codec);
+		info.decoders.push_back({
+		        .codec = codec,
+		        .decode_time = it == decode_time.end() ? 0 : it->second,
+		});
+		decoder_impl::get_capabilities(info.decoders.back(), info.recommended_eye_width * 2, info.recommended_eye_height);
+	}
+
+	info.capabilities = capability_bit(capability::parity_shards) |
+	                    capability_bit(capability::motion_vectors) |
+	                    capability_bit(capability::depth) |
+	                    capability_bit(capability::quad_layers) |
+	                    capability_bit(capability::microphone_dtx);
+
 	audio::get_audio_description(info);
 	if (not application::get_config().microphone)
 		info.microphone = {};
 
+	self->headset_info = info;
 	self->network_session->send_control(info);
 
 	self->update_local_floor(self->instance.now());
+	self->stream_packets_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (self->stream_packets_event < 0)
+		throw std::system_error(errno, std::system_category(), "eventfd");
 	self->network_thread = utils::named_thread("network_thread", &stream::process_packets, self.get());
+	self->video_thread = utils::named_thread("video_thread", &stream::receive_video, self.get());
 
-	self->command_buffer = std::move(self->device.allocateCommandBuffers({
+	auto command_buffers = self->device.allocateCommandBuffers({
 	        .commandPool = *self->commandpool,
 	        .level = vk::CommandBufferLevel::ePrimary,
-	        .commandBufferCount = 1,
-	})[0]);
-
-	self->fence = self->device.createFence({.flags = vk::FenceCreateFlagBits::eSignaled});
+	        .commandBufferCount = frames_in_flight,
+	});
+	for (auto [index, frame]: utils::enumerate(self->frames))
+	{
+		frame.command_buffer = std::move(command_buffers[index]);
+		frame.fence = self->device.createFence({.flags = vk::FenceCreateFlagBits::eSignaled});
+	}
 
 	// Look up the XrActions for haptics
 	self->haptics_actions[0].action = application::get_action("/user/hand/left/output/haptic").first;
@@ -177,11 +230,24 @@ std::shared_ptr<scenes::stream> scenes::stream::create(std::unique_ptr<wivrn_ses
 
 	spdlog::info("Using format {}", vk::to_string(self->swapchain_format));
 
+	if (utils::contains(application::get_xr_extensions(), XR_KHR_COMPOSITION_LAYER_DEPTH_EXTENSION_NAME))
+	{
+		for (auto format: self->session.get_swapchain_formats())
+		{
+			if (std::find(supported_depth_formats.begin(), supported_depth_formats.end(), format) != supported_depth_formats.end())
+			{
+				self->depth_format = format;
+				spdlog::info("Using depth format {}", vk::to_string(format));
+				break;
+			}
+		}
+	}
+
 	self->query_pool = vk::raii::QueryPool(
 	        self->device,
 	        vk::QueryPoolCreateInfo{
 	                .queryType = vk::QueryType::eTimestamp,
-	                .queryCount = size_gpu_timestamps,
+	                .queryCount = size_gpu_timestamps * frames_in_flight,
 	        });
 
 	return self;
@@ -233,44 +299,86 @@ scenes::stream::~stream()
 
 	if (network_thread.joinable())
 		network_thread.join();
+
+	if (video_thread.joinable())
+		video_thread.join();
+
+	if (stream_packets_event >= 0)
+		close(stream_packets_event);
+
+	wait_frames();
+
+	save_decode_times();
 }
 
-void scenes::stream::push_blit_handle(shard_accumulator * decoder, std::shared_ptr<shard_accumulator::blit_handle> handle)
+void scenes::stream::save_decode_times()
 {
-	std::shared_ptr<shard_accumulator::blit_handle> removed;
+	// The first frames include the decoder startup, ignore short sessions
+	static const uint64_t min_samples = 300;
 
+	std::unique_lock lock(decoder_mutex);
+	auto & config = application::get_config();
+	bool changed = false;
+	for (const auto & [codec, stats]: decode_times)
+	{
+		if (stats.count < min_samples)
+			continue;
+
+		float average = stats.sum / stats.count;
+		auto [it, inserted] = config.decode_time.emplace(codec, average);
+		if (not inserted)
+			it->second = (it->second + average) / 2;
+		spdlog::info("Decoding time for {}: {}µs per megapixel", magic_enum::enum_name(codec), it->second);
+		changed = true;
+	}
+	if (changed)
+		config.save();
+}
+
+void scenes::stream::push_blit_handle(shard_accumulator * decoder, std::shared_ptr<shard_accumulator::blit_handle> handle)
+{
 	if (!application::is_visible())
 		return;
 
+	handle->feedback.received_from_decoder = application::now();
+
+	// The render thread does not keep up, the frame will not be displayed
+	if (not decoder->decoded_frames.write(std::move(handle)))
+		send_feedback(handle->feedback);
+}
+
+void scenes::stream::collect_decoded_frames()
+{
+	for (auto & i: decoders)
 	{
-		std::unique_lock lock(decoder_mutex);
-		for (auto & i: decoders)
+		while (auto handle = i.decoder->decoded_frames.read())
 		{
-			if (i.decoder.get() == decoder)
+			auto & feedback = (*handle)->feedback;
+			if (feedback.sent_to_decoder > 0 and feedback.received_from_decoder > feedback.sent_to_decoder)
 			{
-				std::swap(removed, i.latest_frames[0]);
-				for (size_t j = 1; j < i.latest_frames.size(); ++j)
-				{
-					std::swap(i.latest_frames[j - 1], i.latest_frames[j]);
-				}
-				handle->feedback.received_from_decoder = application::now();
-				std::swap(i.latest_frames.back(), handle);
-				break;
+				const auto & desc = i.decoder->desc();
+				auto & stats = decode_times[desc.codec];
+				stats.sum += (feedback.received_from_decoder - feedback.sent_to_decoder) * 1e-3 / (desc.width * desc.height * 1e-6);
+				stats.count++;
+
+				if (perf_controller and decoder_frame_period > 0)
+					perf_controller->add_sample(performance_controller::cpu, float(feedback.received_from_decoder - feedback.sent_to_decoder) / decoder_frame_period);
 			}
-		}
 
-		if (state_ != state::streaming && std::all_of(decoders.begin(), decoders.end(), [](accumulator_images & i) {
-			    return i.latest_frames.back();
-		    }))
-		{
-			state_ = state::streaming;
-			spdlog::info("Stream scene ready at t={}", application::now());
+			if (i.latest_frames[0] and not i.latest_frames[0]->feedback.blitted)
+				send_feedback(i.latest_frames[0]->feedback);
+
+			std::ranges::rotate(i.latest_frames, i.latest_frames.begin() + 1);
+			i.latest_frames.back() = std::move(*handle);
 		}
 	}
 
-	if (removed and not removed->feedback.blitted)
+	if (state_ != state::streaming && std::all_of(decoders.begin(), decoders.end(), [](accumulator_images & i) {
+		    return i.latest_frames.back();
+	    }))
 	{
-		send_feedback(removed->feedback);
+		state_ = state::streaming;
+		spdlog::info("Stream scene ready at t={}", application::now());
 	}
 }
 
@@ -328,7 +436,42 @@ std::optional<uint64_t> scenes::stream::accumulator_images::common_frame(const s
 	return (*min)->feedback.frame_index;
 }
 
-std::shared_ptr<shard_accumulator::blit_handle> scenes::stream::accumulator_images::frame(std::optional<uint64_t> id)
+// Each decoder shows its frame closest to the display time, so that a late decoder does not hold back
+// the other ones. The frames are only mixed if they have the same foveation and at most max_skew between
+// their display times, which bounds the seams between the decoders. Otherwise all the decoders show the
+// same frame, see common_frame.
+std::vector<std::shared_ptr<shard_accumulator::blit_handle>> scenes::stream::accumulator_images::select_frames(const std::vector<accumulator_images> & sets, XrTime display_time, XrDuration max_skew)
+{
+	std::vector<std::shared_ptr<shard_accumulator::blit_handle>> result;
+	result.reserve(sets.size());
+	const shard_accumulator::blit_handle * newest = nullptr;
+	for (const auto & set: sets)
+	{
+		auto best = std::ranges::min_element(set.latest_frames, std::ranges::less{}, [display_time](const auto & frame) {
+			if (not frame)
+				return std::numeric_limits<XrTime>::max();
+			return std::abs(frame->view_info.display_time - display_time);
+		});
+		result.push_back(*best);
+		if (*best and (not newest or (*best)->feedback.frame_index > newest->feedback.frame_index))
+			newest = best->get();
+	}
+
+	bool independent = std::ranges::all_of(result, [&](const auto & frame) {
+		return not frame or (frame->view_info.foveation == newest->view_info.foveation and
+		                     newest->view_info.display_time - frame->view_info.display_time <= max_skew);
+	});
+	if (independent)
+		return result;
+
+	auto common = common_frame(sets, display_time);
+	result.clear();
+	for (const auto & set: sets)
+		result.push_back(set.frame(common));
+	return result;
+}
+
+std::shared_ptr<shard_accumulator::blit_handle> scenes::stream::accumulator_images::frame(std::optional<uint64_t> id) const
 {
 	for (auto it = latest_frames.rbegin(); it != latest_frames.rend(); ++it)
 	{
@@ -343,19 +486,39 @@ std::shared_ptr<shard_accumulator::blit_handle> scenes::stream::accumulator_imag
 	return nullptr;
 }
 
+// Homography of the view coordinates, y down, from a decoded image to the layer: the decoders may show
+// frames rendered with different poses, only the rotation between them is corrected
+static glm::mat3x4 pose_correction(const XrPosef & from, const XrFovf & from_fov, const XrPosef & to, const XrFovf & to_fov)
+{
+	// From the view coordinates to a direction in the view space
+	auto directions = [](const XrFovf & fov) {
+		float l = std::tan(fov.angleLeft);
+		float r = std::tan(fov.angleRight);
+		float u = std::tan(fov.angleUp);
+		float d = std::tan(fov.angleDown);
+		return glm::mat3(glm::vec3((r - l) / 2, 0, 0), glm::vec3(0, (d - u) / 2, 0), glm::vec3((r + l) / 2, (d + u) / 2, -1));
+	};
+
+	glm::quat from_orientation{from.orientation.w, from.orientation.x, from.orientation.y, from.orientation.z};
+	glm::quat to_orientation{to.orientation.w, to.orientation.x, to.orientation.y, to.orientation.z};
+	glm::mat3 rotation = glm::mat3_cast(glm::inverse(to_orientation) * from_orientation);
+
+	return glm::mat3x4(glm::inverse(directions(to_fov)) * rotation * directions(from_fov));
+}
+
 void scenes::stream::render(const XrFrameState & frame_state)
 {
 	if (exiting)
 		application::pop_scene();
 
 	std::shared_lock lock(decoder_mutex);
+	collect_decoded_frames();
 	if (decoders.empty() or not frame_state.shouldRender)
 	{
 		// TODO: stop/restart video stream
 		session.begin_frame();
 		session.end_frame(frame_state.predictedDisplayTime, {});
 
-		std::unique_lock lock(decoder_mutex);
 		for (auto & i: decoders)
 		{
 			for (auto & frame: i.latest_frames)
@@ -371,9 +534,12 @@ void scenes::stream::render(const XrFrameState & frame_state)
 	assert(not swapchains.empty());
 	for (auto & i: decoders)
 	{
-		if (auto sampler = i.decoder->sampler(); sampler and not *i.blit_pipeline)
+		auto sampler = i.decoder->sampler();
+		if (not sampler or *i.pipeline)
+			continue;
+
+		if (not *i.descriptor_set_layout)
 		{
-			// Create blit pipeline
 			// Create VkDescriptorSetLayout with an immutable sampler
 			vk::DescriptorSetLayoutBinding sampler_layout_binding{
 			        .binding = 0,
@@ -389,108 +555,53 @@ void scenes::stream::render(const XrFrameState & frame_state)
 			};
 
 			i.descriptor_set_layout = vk::raii::DescriptorSetLayout(device, layout_info);
-			i.descriptor_set = device.allocateDescriptorSets(
-			                                 vk::DescriptorSetAllocateInfo{
-			                                         .descriptorPool = *blit_descriptor_pool,
-			                                         .descriptorSetCount = 1,
-			                                         .pSetLayouts = &*i.descriptor_set_layout,
-			                                 })[0]
-			                           .release();
+			std::array<vk::DescriptorSetLayout, frames_in_flight> layouts;
+			layouts.fill(*i.descriptor_set_layout);
+			i.descriptor_sets = device.allocateDescriptorSets(
+			        vk::DescriptorSetAllocateInfo{
+			                .descriptorPool = *blit_descriptor_pool,
+			                .descriptorSetCount = frames_in_flight,
+			                .pSetLayouts = layouts.data(),
+			        });
 
 			const auto & description = i.decoder->desc();
 			vk::Extent2D image_size = i.decoder->image_size();
-			std::array useful_size{
-			        float(description.width) / image_size.width,
-			        float(description.height) / image_size.height,
-			};
 			spdlog::info("useful size: {}x{} with buffer {}x{}",
 			             description.width,
 			             description.height,
 			             image_size.width,
 			             image_size.height);
-
-			std::array specialization_constants_desc{
-			        vk::SpecializationMapEntry{
-			                .constantID = 0,
-			                .offset = 0,
-			                .size = sizeof(float),
-			        },
-			        vk::SpecializationMapEntry{
-			                .constantID = 1,
-			                .offset = sizeof(float),
-			                .size = sizeof(float),
-			        }};
-
-			vk::SpecializationInfo specialization_info;
-			specialization_info.setMapEntries(specialization_constants_desc);
-			specialization_info.setData<float>(useful_size);
-
-			// Create graphics pipeline
-			vk::raii::ShaderModule vertex_shader = load_shader(device, "stream.vert");
-			vk::raii::ShaderModule fragment_shader = load_shader(device, "stream.frag");
-
-			vk::PipelineLayoutCreateInfo pipeline_layout_info{
-			        .setLayoutCount = 1,
-			        .pSetLayouts = &*i.descriptor_set_layout,
-			};
-
-			i.blit_pipeline_layout = vk::raii::PipelineLayout(device, pipeline_layout_info);
-
-			vk::pipeline_builder pipeline_info{
-			        .flags = {},
-			        .Stages = {{
-			                           .stage = vk::ShaderStageFlagBits::eVertex,
-			                           .module = *vertex_shader,
-			                           .pName = "main",
-			                           .pSpecializationInfo = &specialization_info,
-			                   },
-			                   {
-			                           .stage = vk::ShaderStageFlagBits::eFragment,
-			                           .module = *fragment_shader,
-			                           .pName = "main",
-			                   }},
-			        .VertexInputState = {.flags = {}},
-			        .VertexBindingDescriptions = {},
-			        .VertexAttributeDescriptions = {},
-			        .InputAssemblyState = {{
-			                .topology = vk::PrimitiveTopology::eTriangleStrip,
-			        }},
-			        .ViewportState = {.flags = {}},
-			        .Viewports = {{}},
-			        .Scissors = {{}},
-			        .RasterizationState = {{
-			                .polygonMode = vk::PolygonMode::eFill,
-			                .lineWidth = 1,
-			        }},
-			        .MultisampleState = {{
-			                .rasterizationSamples = vk::SampleCountFlagBits::e1,
-			        }},
-			        .ColorBlendState = {.flags = {}},
-			        .ColorBlendAttachments = {{.colorWriteMask = vk::ColorComponentFlagBits::eR | vk::ColorComponentFlagBits::eG | vk::ColorComponentFlagBits::eB}},
-			        .DynamicState = {.flags = {}},
-			        .DynamicStates = {vk::DynamicState::eViewport, vk::DynamicState::eScissor},
-			        .layout = *i.blit_pipeline_layout,
-			        .renderPass = *blit_render_pass,
-			        .subpass = 0,
-			};
-
-			i.blit_pipeline = vk::raii::Pipeline(device, application::get_pipeline_cache(), pipeline_info);
 		}
+
+		// Create graphics pipeline
+		i.pipeline_layout = reprojector->create_pipeline_layout(*i.descriptor_set_layout);
+		i.pipeline = reprojector->create_pipeline(i.pipeline_layout);
 	}
 
-	if (device.waitForFences(*fence, VK_TRUE, UINT64_MAX) == vk::Result::eTimeout)
+	// Only wait for the oldest frame in flight, the other one may still run while this one is recorded
+	auto & frame = frames[current_frame];
+	if (device.waitForFences(*frame.fence, VK_TRUE, UINT64_MAX) == vk::Result::eTimeout)
 		throw std::runtime_error("Vulkan fence timeout");
 
-	device.resetFences(*fence);
-
 	// We don't need those after vkWaitForFences
-	current_blit_handles.clear();
+	frame.blit_handles.clear();
+
+	// Waiting for the previous frame is not work of the render thread
+	std::chrono::nanoseconds display_period(frame_state.predictedDisplayPeriod);
+	if (not render_hint)
+		render_hint.emplace("render thread", display_period);
+	render_hint->set_target(display_period);
+	auto render_work = render_hint->measure();
+
+	if (not perf_controller and utils::contains(application::get_xr_extensions(), XR_EXT_PERFORMANCE_SETTINGS_EXTENSION_NAME))
+		perf_controller.emplace(session);
 
+	const uint32_t first_query = current_frame * size_gpu_timestamps;
 	gpu_timestamps timestamps;
-	if (query_pool_filled)
+	if (frame.timestamps_written)
 	{
 		auto [res, timestamps2] = query_pool.getResults<uint64_t>(
-		        0,
+		        first_query,
 		        size_gpu_timestamps,
 		        size_gpu_timestamps * sizeof(uint64_t),
 		        sizeof(uint64_t),
@@ -498,12 +609,42 @@ void scenes::stream::render(const XrFrameState & frame_state)
 
 		if (res == vk::Result::eSuccess)
 		{
-			boost::pfr::for_each_field(timestamps, [n = 1, &timestamps2](float & t) mutable {
-				t = (timestamps2[n++] - timestamps2[0]) * application::get_physical_device_properties().limits.timestampPeriod / 1e9;
-			});
+			auto duration = [&](int begin, int end) -> float {
+				return (timestamps2[end] - timestamps2[begin]) * application::get_physical_device_properties().limits.timestampPeriod / 1e9;
+			};
+			timestamps.gpu_quad_layers = duration(0, 1);
+			timestamps.gpu_barrier = duration(1, 2);
+			timestamps.gpu_reproject_left = duration(2, 3);
+			timestamps.gpu_reproject_right = duration(3, 4);
+			timestamps.gpu_time = duration(0, size_gpu_timestamps - 1);
+
+			if (imgui_ctx)
+				timestamps.gpu_overlay = imgui_ctx->take_gpu_time().value_or(0);
+
+			if (perf_controller)
+				perf_controller->add_sample(performance_controller::gpu, timestamps.gpu_time * 1e9f / frame_state.predictedDisplayPeriod);
+
+			std::lock_guard lock(gpu_stats_mutex);
+			auto & sum = gpu_stats.sum;
+			sum.gpu_quad_layers += timestamps.gpu_quad_layers;
+			sum.gpu_barrier += timestamps.gpu_barrier;
+			sum.gpu_reproject_left += timestamps.gpu_reproject_left;
+			sum.gpu_reproject_right += timestamps.gpu_reproject_right;
+			sum.gpu_time += timestamps.gpu_time;
+			sum.gpu_overlay += timestamps.gpu_overlay;
+			gpu_stats.max_time = std::max(gpu_stats.max_time, timestamps.gpu_time);
+			++gpu_stats.frames;
+			gpu_stats.gpu_time.add(timestamps.gpu_time * 1e9);
+			gpu_stats.cpu_time.add(application::get_cpu_time().count());
 		}
 	}
 
+	if (perf_controller)
+	{
+		perf_controller->add_sample(performance_controller::cpu, float(application::get_cpu_time().count()) / frame_state.predictedDisplayPeriod);
+		perf_controller->update(frame_state.predictedDisplayTime);
+	}
+
 	session.begin_frame();
 
 	std::array<int, view_count> image_indices;
@@ -515,42 +656,78 @@ void scenes::stream::render(const XrFrameState & frame_state)
 		image_indices[swapchain_index] = image_index;
 	}
 
+	std::array<int, view_count> depth_indices{};
+	for (size_t swapchain_index = 0; swapchain_index < depth_swapchains.size(); swapchain_index++)
+	{
+		depth_indices[swapchain_index] = depth_swapchains[swapchain_index].acquire();
+		depth_swapchains[swapchain_index].wait();
+	}
+
+	auto & command_buffer = frame.command_buffer;
 	command_buffer.reset();
 
 	vk::CommandBufferBeginInfo begin_info;
 	begin_info.flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit;
 	command_buffer.begin(begin_info);
 
-	// Keep a reference to the resources needed to blit the images until vkWaitForFences
-	std::vector<std::shared_ptr<shard_accumulator::blit_handle>> current_blit_handles;
+	command_buffer.resetQueryPool(*query_pool, first_query, size_gpu_timestamps);
+	command_buffer.writeTimestamp(vk::PipelineStageFlagBits::eTopOfPipe, *query_pool, first_query);
+
+	update_quad_layers(command_buffer);
+	command_buffer.writeTimestamp(vk::PipelineStageFlagBits::eBottomOfPipe, *query_pool, first_query + 1);
 
-	command_buffer.resetQueryPool(*query_pool, 0, size_gpu_timestamps);
-	command_buffer.writeTimestamp(vk::PipelineStageFlagBits::eTopOfPipe, *query_pool, 0);
+	// Keep a reference to the resources needed to blit the images until vkWaitForFences
+	auto & current_blit_handles = frame.blit_handles;
 
 	std::array<XrPosef, 2> pose{};
 	std::array<XrFovf, 2> fov{};
+	std::optional<std::array<to_headset::video_stream_description::foveation_parameter, 2>> foveation;
+	// Frame displayed and its expected display time
+	std::optional<uint64_t> frame_index;
+	XrTime frame_display_time = 0;
+	// Decoders with an image for this frame, and the image
+	std::vector<const accumulator_images *> bound_decoders;
+	std::vector<const shard_accumulator::blit_handle *> bound_frames;
+	// Fences of the decoded images, waited for on the GPU
+	std::vector<vk::Semaphore> wait_semaphores;
+	bool reused_decoded_image = false;
 	{
-		// Search for frame with desired display time on all decoders
-		// If no such frame exists, use the latest frame for each decoder
-		auto common_frame = accumulator_images::common_frame(decoders, frame_state.predictedDisplayTime);
+		// Search for the frame closest to the display time on each decoder
+		auto displayed_frames = accumulator_images::select_frames(decoders, frame_state.predictedDisplayTime, 2 * decoder_frame_period);
 
-		// Blit images from the decoders
-		for (auto & i: decoders)
+		// The layer uses the pose of the newest frame, the images of the other frames are rotated to it
+		const shard_accumulator::blit_handle * newest = nullptr;
+		for (const auto & blit_handle: displayed_frames)
+		{
+			if (blit_handle and (not newest or blit_handle->feedback.frame_index > newest->feedback.frame_index))
+				newest = blit_handle.get();
+		}
+		if (newest)
+		{
+			pose = newest->view_info.pose;
+			fov = newest->view_info.fov;
+			foveation = newest->view_info.foveation;
+			frame_index = newest->feedback.frame_index;
+			frame_display_time = newest->view_info.display_time;
+		}
+
+		// Bind the images from the decoders
+		for (auto [index, i]: utils::enumerate(decoders))
 		{
-			auto blit_handle = i.frame(common_frame);
+			auto & blit_handle = displayed_frames[index];
 			if (not blit_handle)
 				continue;
 
 			current_blit_handles.push_back(blit_handle);
 
 			blit_handle->feedback.blitted = application::now();
-			if (blit_handle->feedback.blitted - blit_handle->feedback.received_from_decoder > 1'000'000'000)
+			if (blit_handle->feedback.blitted - blit_handle->feedback.received_from_decoder > 1'000'000'000 and not server_idle)
 				state_ = stream::state::stalled;
 			++blit_handle->feedback.times_displayed;
 			blit_handle->feedback.displayed = frame_state.predictedDisplayTime;
 
-			pose = blit_handle->view_info.pose;
-			fov = blit_handle->view_info.fov;
+			if (not *i.pipeline)
+				continue;
 
 			vk::DescriptorImageInfo image_info{
 			        .imageView = *blit_handle->image_view,
@@ -558,7 +735,7 @@ void scenes::stream::render(const XrFrameState & frame_state)
 			};
 
 			vk::WriteDescriptorSet descriptor_write{
-			        .dstSet = i.descriptor_set,
+			        .dstSet = *i.descriptor_sets[current_frame],
 			        .dstBinding = 0,
 			        .dstArrayElement = 0,
 			        .descriptorCount = 1,
@@ -585,93 +762,121 @@ void scenes::stream::render(const XrFrameState & frame_state)
 				command_buffer.pipelineBarrier(vk::PipelineStageFlagBits::eAllCommands, vk::PipelineStageFlagBits::eAllCommands, {}, {}, {}, barrier);
 				*blit_handle->current_layout = vk::ImageLayout::eGeneral;
 			}
-		}
-	}
 
-	uint16_t x_offset = 0;
-	for (auto & out: decoder_output)
-	{
-		command_buffer.beginRenderPass(
-		        {
-		                .renderPass = *blit_render_pass,
-		                .framebuffer = *out.frame_buffer,
-		                .renderArea = {
-		                        .offset = {0, 0},
-		                        .extent = out.size,
-		                },
-		                .clearValueCount = 0,
-		        },
-		        vk::SubpassContents::eInline);
-
-		for (const auto & decoder: decoders)
-		{
-			if (not *decoder.blit_pipeline)
-				continue;
-
-			command_buffer.bindPipeline(vk::PipelineBindPoint::eGraphics, *decoder.blit_pipeline);
-
-			const auto & description = decoder.decoder->desc();
-			int x0 = description.offset_x - x_offset;
-			int y0 = description.offset_y;
-			int x1 = x0 + description.width;
-			int y1 = y0 + description.height;
+			// Binary semaphores are only waited for once, later frames are ordered after the first one
+			if (*blit_handle->semaphore and not blit_handle->semaphore_waited)
+			{
+				wait_semaphores.push_back(*blit_handle->semaphore);
+				blit_handle->semaphore_waited = true;
+			}
+			else if (*blit_handle->semaphore)
+				reused_decoded_image = true;
 
-			vk::Viewport viewport{
-			        .x = (float)x0,
-			        .y = (float)y0,
-			        .width = (float)description.width,
-			        .height = (float)description.height,
-			        .minDepth = 0,
-			        .maxDepth = 1,
-			};
+			bound_decoders.push_back(&i);
+			bound_frames.push_back(blit_handle.get());
+		}
+	}
 
-			x0 = std::clamp<int>(x0, 0, out.size.width);
-			x1 = std::clamp<int>(x1, 0, out.size.width);
-			y0 = std::clamp<int>(y0, 0, out.size.height);
-			y1 = std::clamp<int>(y1, 0, out.size.height);
+	// The frame that waited for the decoder may still be in flight
+	if (reused_decoded_image)
+		command_buffer.pipelineBarrier(vk::PipelineStageFlagBits::eFragmentShader, vk::PipelineStageFlagBits::eFragmentShader, {}, {}, {}, {});
 
-			vk::Rect2D scissor{
-			        .offset = {.x = x0, .y = y0},
-			        .extent = {.width = (uint32_t)(x1 - x0), .height = (uint32_t)(y1 - y0)},
-			};
+	command_buffer.writeTimestamp(vk::PipelineStageFlagBits::eBottomOfPipe, *query_pool, first_query + 2);
 
-			command_buffer.setViewport(0, viewport);
-			command_buffer.setScissor(0, scissor);
+	// Sample the decoder images and unfoveate them to the real pose
+	reprojector->set_frame(current_frame);
+	if (foveation)
+		reprojector->set_foveation(*foveation);
 
-			command_buffer.bindDescriptorSets(
-			        vk::PipelineBindPoint::eGraphics,
-			        *decoder.blit_pipeline_layout,
-			        0,
-			        decoder.descriptor_set,
-			        nullptr);
-			command_buffer.draw(3, 1, 0, 0);
+	// A frame displayed after its time is extrapolated along its motion, for up to one frame interval
+	{
+		std::lock_guard lock(motion_mutex);
+		auto motion = std::ranges::find_if(motion_fields, [&](const auto & m) { return frame_index and m.frame_idx == *frame_index; });
+		if (motion != motion_fields.end() and motion->interval.count() > 0)
+		{
+			double factor = double(frame_state.predictedDisplayTime - frame_display_time) / motion->interval.count();
+			reprojector->set_motion(&*motion, std::clamp(factor, 0., 1.));
 		}
-		command_buffer.endRenderPass();
-		x_offset += out.size.width;
+		else
+			reprojector->set_motion(nullptr, 0);
 	}
 
-	command_buffer.writeTimestamp(vk::PipelineStageFlagBits::eBottomOfPipe, *query_pool, 1);
-
-	// Unfoveate the image to the real pose
+	std::array<bool, view_count> view_has_depth{};
+	if (not depth_swapchains.empty())
+	{
+		std::lock_guard lock(depth_mutex);
+		for (size_t view = 0; view < view_count; view++)
+		{
+			auto depth = std::ranges::find_if(depth_maps, [&](const auto & d) { return frame_index and d.frame_idx == *frame_index and d.view == view; });
+			view_has_depth[view] = reprojector->set_depth(view, depth != depth_maps.end() ? &*depth : nullptr);
+		}
+	}
+	const float view_width = video_stream_description->width / view_count;
+	const float view_height = video_stream_description->height;
+	std::vector<stream_reprojection::source> view_sources;
 	for (size_t view = 0; view < view_count; view++)
 	{
+		view_sources.clear();
+		for (auto [i, blit_handle]: utils::zip(bound_decoders, bound_frames))
+		{
+			// Part of the decoder inside this view, in pixels of the stream
+			const auto & description = i->decoder->desc();
+			vk::Extent2D image_size = i->decoder->image_size();
+			// Scaled items are a copy of another part of the stream, drawn under the others
+			auto source = description.source.value_or(to_headset::video_stream_description::item::source_rect{
+			        .offset_x = description.offset_x,
+			        .offset_y = description.offset_y,
+			        .width = description.width,
+			        .height = description.height,
+			});
+			glm::vec2 scale{float(description.width) / source.width, float(description.height) / source.height};
+			float view_x = view * view_width;
+			float x0 = std::max<float>(source.offset_x, view_x);
+			float x1 = std::min<float>(source.offset_x + source.width, view_x + view_width);
+			float y0 = std::max<float>(source.offset_y, 0);
+			float y1 = std::min<float>(source.offset_y + source.height, view_height);
+			if (x0 >= x1 or y0 >= y1)
+				continue;
+
+			view_sources.push_back({
+			        .layout = *i->pipeline_layout,
+			        .pipeline = *i->pipeline,
+			        .descriptor_set = *i->descriptor_sets[current_frame],
+			        .area = {
+			                .min = {(x0 - view_x) / view_width, y0 / view_height},
+			                .max = {(x1 - view_x) / view_width, y1 / view_height},
+			                .uv_scale = {view_width * scale.x / image_size.width, view_height * scale.y / image_size.height},
+			                .uv_offset = {(view_x - source.offset_x) * scale.x / image_size.width, -source.offset_y * scale.y / image_size.height},
+			                .correction = pose_correction(blit_handle->view_info.pose[view], blit_handle->view_info.fov[view], pose[view], fov[view]),
+			        },
+			});
+		}
+
 		size_t destination_index = view * swapchains[0].images().size() + image_indices[view];
-		reprojector->reproject(command_buffer, view, destination_index);
+		reprojector->reproject(command_buffer, view_sources, view, destination_index, depth_indices[view]);
+		command_buffer.writeTimestamp(vk::PipelineStageFlagBits::eBottomOfPipe, *query_pool, first_query + 3 + view);
 	}
 
-	command_buffer.writeTimestamp(vk::PipelineStageFlagBits::eBottomOfPipe, *query_pool, 2);
-
 	command_buffer.end();
 	vk::SubmitInfo submit_info;
 	submit_info.setCommandBuffers(*command_buffer);
-	queue.submit(submit_info, *fence);
+	// The layout of the decoded images is changed before they are sampled
+	std::vector<vk::PipelineStageFlags> wait_stages(wait_semaphores.size(), vk::PipelineStageFlagBits::eAllCommands);
+	submit_info.setWaitSemaphores(wait_semaphores);
+	submit_info.setWaitDstStageMask(wait_stages);
+	device.resetFences(*frame.fence);
+	queue.submit(submit_info, *frame.fence);
+	release_quad_layers();
 
 	std::vector<XrCompositionLayerBaseHeader *> layers_base;
 	std::vector<XrCompositionLayerProjectionView> layer_view(view_count);
+	std::vector<XrCompositionLayerDepthInfoKHR> depth_info(view_count);
 
 	for (size_t swapchain_index = 0; swapchain_index < view_count; swapchain_index++)
 	{
 		swapchains[swapchain_index].release();
+		if (not depth_swapchains.empty())
+			depth_swapchains[swapchain_index].release();
 
 		layer_view[swapchain_index] =
 		        {
@@ -690,6 +895,23 @@ void scenes::stream::render(const XrFrameState & frame_state)
 		                        },
 		                },
 		        };
+
+		if (view_has_depth[swapchain_index])
+		{
+			// Values are 1 - min_distance / distance
+			depth_info[swapchain_index] = {
+			        .type = XR_TYPE_COMPOSITION_LAYER_DEPTH_INFO_KHR,
+			        .subImage = {
+			                .swapchain = depth_swapchains[swapchain_index],
+			                .imageRect = layer_view[swapchain_index].subImage.imageRect,
+			        },
+			        .minDepth = 0,
+			        .maxDepth = 1,
+			        .nearZ = to_headset::video_stream_depth::min_distance,
+			        .farZ = std::numeric_limits<float>::infinity(),
+			};
+			layer_view[swapchain_index].next = &depth_info[swapchain_index];
+		}
 	}
 
 	XrCompositionLayerProjection layer{
@@ -701,15 +923,29 @@ void scenes::stream::render(const XrFrameState & frame_state)
 	};
 
 	XrCompositionLayerQuad imgui_layer;
-	if (imgui_ctx and plots_visible)
+	const bool show_plots = imgui_ctx and plots_visible and not thermal_pressure;
+	if (show_plots)
 	{
 		accumulate_metrics(frame_state.predictedDisplayTime, current_blit_handles, timestamps);
-		imgui_layer = plot_performance_metrics(frame_state.predictedDisplayTime);
+
+		// The metrics are still accumulated every frame, only the plots are throttled
+		float refresh_rate = application::get_config().performance_metrics_refresh_rate;
+		if (refresh_rate <= 0 or frame_state.predictedDisplayTime - last_plot_refresh >= 1e9 / refresh_rate)
+		{
+			imgui_layer = plot_performance_metrics(frame_state.predictedDisplayTime);
+			last_plot_refresh = frame_state.predictedDisplayTime;
+		}
+		else
+			imgui_layer = imgui_ctx->layer();
 	}
 
 	layers_base.push_back(reinterpret_cast<XrCompositionLayerBaseHeader *>(&layer));
 
-	if (imgui_ctx and plots_visible)
+	auto quads = quad_layer_composition();
+	for (auto & quad: quads)
+		layers_base.push_back(reinterpret_cast<XrCompositionLayerBaseHeader *>(&quad));
+
+	if (show_plots)
 		layers_base.push_back(reinterpret_cast<XrCompositionLayerBaseHeader *>(&imgui_layer));
 
 	session.end_frame(frame_state.predictedDisplayTime, layers_base);
@@ -734,10 +970,27 @@ void scenes::stream::render(const XrFrameState & frame_state)
 		CHECK_XR(xrGetActionStateBoolean(session, &get_info, &state_2));
 
 		if (state_1.currentState and state_2.currentState and (state_1.changedSinceLastSync or state_2.changedSinceLastSync))
+		{
 			plots_visible = not plots_visible;
+			// Do not show the plots from when they were hidden
+			last_plot_refresh = 0;
+		}
 	}
 
-	query_pool_filled = true;
+	frame.timestamps_written = true;
+	current_frame = (current_frame + 1) % frames_in_flight;
+}
+
+void scenes::stream::wait_frames()
+{
+	std::vector<vk::Fence> fences;
+	for (auto & frame: frames)
+	{
+		if (*frame.fence)
+			fences.push_back(*frame.fence);
+	}
+	if (not fences.empty() and device.waitForFences(fences, VK_TRUE, UINT64_MAX) == vk::Result::eTimeout)
+		throw std::runtime_error("Vulkan fence timeout");
 }
 
 void scenes::stream::exit()
@@ -749,7 +1002,23 @@ void scenes::stream::setup(const to_headset::video_stream_description & descript
 {
 	std::unique_lock lock(decoder_mutex);
 
+	// Same stream after a resumed connection: the server sends an IDR frame, the decoders can be kept
+	if (video_stream_description == description and not decoders.empty())
+	{
+		spdlog::info("Video stream unchanged, keeping decoders");
+		return;
+	}
+
+	// The released decoders and pipelines may be used by the frames in flight
+	wait_frames();
+
+	// Decoders are kept when their stream does not change, for instance when only the foveation
+	// or another stream is modified: configuring a hardware decoder takes a long time
+	std::vector<accumulator_images> previous = std::move(decoders);
 	decoders.clear();
+	periods_per_frame = std::max<int>(1, description.periods_per_frame);
+	if (periods_per_frame > 1)
+		spdlog::info("Each frame is displayed for {} refresh periods", periods_per_frame.load());
 
 	if (description.items.empty())
 	{
@@ -759,124 +1028,64 @@ void scenes::stream::setup(const to_headset::video_stream_description & descript
 
 	video_stream_description = description;
 
-	const uint32_t video_width = description.width / view_count;
-	const uint32_t video_height = description.height;
+	// The decoders only get one frame every periods_per_frame display periods
+	const float fps = description.fps / std::max<int>(1, description.periods_per_frame);
+	decoder_frame_period = std::chrono::nanoseconds(std::chrono::seconds(1)).count() / fps;
 
-	// Create renderpass
+	try
 	{
-		vk::AttachmentDescription color_desc{
-		        .format = vk::Format::eA8B8G8R8SrgbPack32,
-		        .samples = vk::SampleCountFlagBits::e1,
-		        .loadOp = vk::AttachmentLoadOp::eDontCare,
-		        .storeOp = vk::AttachmentStoreOp::eStore,
-		        .initialLayout = vk::ImageLayout::eUndefined,
-		        .finalLayout = vk::ImageLayout::eShaderReadOnlyOptimal,
-		};
-
-		vk::AttachmentReference color_ref{
-		        .attachment = 0,
-		        .layout = vk::ImageLayout::eColorAttachmentOptimal,
-		};
-
-		vk::SubpassDescription subpass{
-		        .pipelineBindPoint = vk::PipelineBindPoint::eGraphics,
-		};
-		subpass.setColorAttachments(color_ref);
-
-		vk::RenderPassCreateInfo renderpass_info{
-		        .flags = {},
-		};
-		renderpass_info.setAttachments(color_desc);
-		renderpass_info.setSubpasses(subpass);
-
-		blit_render_pass = vk::raii::RenderPass(device, renderpass_info);
-	}
-
-	// Create outputs for the decoders
-	vk::Extent3D decoder_out_size{video_width, video_height, 1};
-	for (size_t i = 0; i < view_count; i++)
-	{
-		decoder_output[i].format = vk::Format::eA8B8G8R8SrgbPack32;
-		decoder_output[i].size.width = video_width;
-		decoder_output[i].size.height = video_height;
-
-		vk::ImageCreateInfo image_info{
-		        .flags = vk::ImageCreateFlags{},
-		        .imageType = vk::ImageType::e2D,
-		        .format = vk::Format::eA8B8G8R8SrgbPack32,
-		        .extent = decoder_out_size,
-		        .mipLevels = 1,
-		        .arrayLayers = 1,
-		        .samples = vk::SampleCountFlagBits::e1,
-		        .tiling = vk::ImageTiling::eOptimal,
-		        .usage = vk::ImageUsageFlagBits::eSampled | vk::ImageUsageFlagBits::eColorAttachment,
-		        .sharingMode = vk::SharingMode::eExclusive,
-		        .initialLayout = vk::ImageLayout::eUndefined,
-		};
-
-		VmaAllocationCreateInfo alloc_info{
-		        .requiredFlags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-		};
-
-		decoder_output[i].image = image_allocation{device, image_info, alloc_info};
-
-		vk::ImageViewCreateInfo image_view_info{
-		        .image = vk::Image{decoder_output[i].image},
-		        .viewType = vk::ImageViewType::e2D,
-		        .format = vk::Format::eA8B8G8R8SrgbPack32,
-		        .components = {},
-		        .subresourceRange = {
-		                .aspectMask = vk::ImageAspectFlagBits::eColor,
-		                .baseMipLevel = 0,
-		                .levelCount = 1,
-		                .baseArrayLayer = 0,
-		                .layerCount = 1,
-		        },
-		};
-
-		decoder_output[i].image_view = vk::raii::ImageView(device, image_view_info);
-
-		decoder_output[i].frame_buffer = vk::raii::Framebuffer(
-		        device,
-		        vk::FramebufferCreateInfo{
-		                .renderPass = *blit_render_pass,
-		                .attachmentCount = 1,
-		                .pAttachments = &*decoder_output[i].image_view,
-		                .width = decoder_out_size.width,
-		                .height = decoder_out_size.height,
-		                .layers = 1,
-		        });
+		session.set_refresh_rate(description.fps);
+	}
+	catch (std::exception & e)
+	{
+		spdlog::warn("Failed to set refresh rate to {}: {}", description.fps, e.what());
 	}
 
+	if (blit_descriptor_pool_size < description.items.size())
 	{
+		// The kept decoders use descriptor sets from the previous pool
+		previous.clear();
+		blit_descriptor_pool = nullptr;
+		blit_descriptor_pool_size = description.items.size();
+
 		vk::DescriptorPoolSize pool_size{
 		        .type = vk::DescriptorType::eCombinedImageSampler,
-		        .descriptorCount = uint32_t(description.items.size()),
+		        .descriptorCount = blit_descriptor_pool_size * frames_in_flight,
 		};
 		blit_descriptor_pool = vk::raii::DescriptorPool(
 		        device,
 		        vk::DescriptorPoolCreateInfo{
-		                .maxSets = uint32_t(description.items.size()),
+		                .flags = vk::DescriptorPoolCreateFlagBits::eFreeDescriptorSet,
+		                .maxSets = blit_descriptor_pool_size * frames_in_flight,
 		                .poolSizeCount = 1,
 		                .pPoolSizes = &pool_size,
 		        });
 	}
 
+	// The decoder of a stream also depends on its index, which is in its feedback
+	std::vector<accumulator_images> kept(description.items.size());
 	for (const auto & [stream_index, item]: utils::enumerate(description.items))
 	{
-		spdlog::info("Creating decoder size {}x{} offset {},{}", item.width, item.height, item.offset_x, item.offset_y);
+		if (stream_index < previous.size() and previous[stream_index].decoder->desc() == item and previous[stream_index].fps == fps)
+			kept[stream_index] = std::move(previous[stream_index]);
+	}
+	// Release the other decoders before creating new ones, hardware decoders are limited
+	previous.clear();
 
-		try
-		{
-			session.set_refresh_rate(description.fps);
-		}
-		catch (std::exception & e)
+	for (const auto & [stream_index, item]: utils::enumerate(description.items))
+	{
+		if (kept[stream_index].decoder)
 		{
-			spdlog::warn("Failed to set refresh rate to {}: {}", description.fps, e.what());
+			spdlog::info("Keeping decoder size {}x{} offset {},{}", item.width, item.height, item.offset_x, item.offset_y);
+			decoders.push_back(std::move(kept[stream_index]));
+			continue;
 		}
 
+		spdlog::info("Creating decoder size {}x{} offset {},{}", item.width, item.height, item.offset_x, item.offset_y);
+
 		accumulator_images dec;
-		dec.decoder = std::make_unique<shard_accumulator>(device, physical_device, item, description.fps, shared_from_this(), stream_index);
+		dec.decoder = std::make_unique<shard_accumulator>(device, physical_device, item, fps, shared_from_this(), stream_index, application::get_config().reorder_window);
+		dec.fps = fps;
 
 		decoders.push_back(std::move(dec));
 	}
@@ -886,7 +1095,11 @@ void scenes::stream::setup_reprojection_swapchain()
 {
 	std::unique_lock lock(decoder_mutex);
 
+	// The swapchains and the reprojector may be used by the frames in flight
+	wait_frames();
+
 	swapchains.clear();
+	depth_swapchains.clear();
 	const uint32_t video_width = video_stream_description->width / view_count;
 	const uint32_t video_height = video_stream_description->height;
 	const uint32_t swapchain_width = video_width / video_stream_description->foveation[0].x.scale;
@@ -904,6 +1117,16 @@ void scenes::stream::setup_reprojection_swapchain()
 		swapchains.emplace_back(session, device, swapchain_format, extent.width, extent.height);
 
 		spdlog::info("Created stream swapchain {}: {}x{}", swapchains.size(), extent.width, extent.height);
+
+		if (depth_format != vk::Format::eUndefined)
+			depth_swapchains.emplace_back(session, device, depth_format, extent.width, extent.height, 1, XR_SWAPCHAIN_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT);
+	}
+
+	std::vector<vk::Image> depth_images;
+	for (auto & swapchain: depth_swapchains)
+	{
+		for (auto & image: swapchain.images())
+			depth_images.push_back(image.image);
 	}
 
 	spdlog::info("Initializing reprojector");
@@ -915,13 +1138,26 @@ void scenes::stream::setup_reprojection_swapchain()
 			swapchain_images.push_back(image.image);
 	}
 
-	std::vector<vk::Image> images;
-	for (renderpass_output & i: decoder_output)
+	// The decoder pipelines use the render pass of the reprojector
+	for (auto & i: decoders)
 	{
-		images.push_back(i.image);
+		i.pipeline = nullptr;
+		i.pipeline_layout = nullptr;
 	}
 
-	reprojector.emplace(device, physical_device, images, swapchain_images, extent, swapchains[0].format(), *video_stream_description);
+	reprojector.emplace(
+	        device,
+	        physical_device,
+	        view_count,
+	        frames_in_flight,
+	        swapchain_images,
+	        depth_images,
+	        extent,
+	        swapchains[0].format(),
+	        depth_format,
+	        *video_stream_description,
+	        application::get_pipeline_cache(),
+	        application::vulkan_device_extension_enabled(VK_EXT_FRAGMENT_DENSITY_MAP_EXTENSION_NAME));
 }
 
 scene::meta & scenes::stream::get_meta_scene()
@@ -990,3 +1226,35 @@ void scenes::stream::on_reference_space_changed(XrReferenceSpaceType space, XrTi
 {
 	update_local_floor(when);
 }
+
+void scenes::stream::on_perf_settings(const XrEventDataPerfSettingsEXT & event)
+{
+	if (not perf_controller)
+		return;
+
+	std::lock_guard lock(performance_state_mutex);
+	runtime_performance_state = perf_controller->on_notification(event);
+	send_performance_state();
+}
+
+void scenes::stream::send_performance_state()
+{
+	from_headset::performance_state state{
+	        .thermal = std::max(runtime_performance_state.thermal, android_thermal_level),
+	        .load = runtime_performance_state.load,
+	};
+	thermal_pressure = state.thermal != from_headset::performance_state::level::normal;
+
+	if (state.thermal == reported_performance_state.thermal and state.load == reported_performance_state.load)
+		return;
+
+	try
+	{
+		network_session->send_control(state);
+		reported_performance_state = state;
+	}
+	catch (std::exception & e)
+	{
+		spdlog::warn("Exception while sending performance state: {}", e.what());
+	}
+}
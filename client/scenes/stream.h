@@ -21,11 +21,17 @@
 
 #include "audio/audio.h"
 #include "decoder/shard_accumulator.h"
+#include "performance_controller.h"
 #include "render/imgui_impl.h"
 #include "scene.h"
 #include "stream_reprojection.h"
+#include "utils/performance_hint.h"
+#include "utils/quantile_sketch.h"
+#include "utils/thermal_monitor.h"
 #include "wivrn_client.h"
 #include "wivrn_packets.h"
+#include <deque>
+#include <map>
 #include <mutex>
 #include <shared_mutex>
 #include <thread>
@@ -45,53 +51,123 @@ public:
 
 private:
 	static const size_t view_count = 2;
+	// Frames recorded while the GPU executes the previous ones
+	static const size_t frames_in_flight = 2;
 
 	using stream_description = xrt::drivers::wivrn::to_headset::video_stream_description::item;
 
 	struct accumulator_images
 	{
 		std::unique_ptr<shard_accumulator> decoder;
+		// Frame rate the decoder was configured for
+		float fps = 0;
+		// The decoder images are sampled by the reprojection, see stream_reprojection::source
 		vk::raii::DescriptorSetLayout descriptor_set_layout = nullptr;
-		vk::DescriptorSet descriptor_set = nullptr;
-		vk::raii::PipelineLayout blit_pipeline_layout = nullptr;
-		vk::raii::Pipeline blit_pipeline = nullptr;
-		// latest frames from oldest to most recent
+		// One per frame in flight, the image is updated when the frame is recorded
+		std::vector<vk::raii::DescriptorSet> descriptor_sets;
+		vk::raii::PipelineLayout pipeline_layout = nullptr;
+		vk::raii::Pipeline pipeline = nullptr;
+		// latest frames from oldest to most recent, only accessed from the render thread
 		std::array<std::shared_ptr<shard_accumulator::blit_handle>, 3> latest_frames;
 
 		static std::optional<uint64_t> common_frame(const std::vector<accumulator_images> &, XrTime display_time);
-		std::shared_ptr<shard_accumulator::blit_handle> frame(std::optional<uint64_t> id);
+		// Frame of each decoder for the display time, see the implementation for the policy
+		static std::vector<std::shared_ptr<shard_accumulator::blit_handle>> select_frames(const std::vector<accumulator_images> &, XrTime display_time, XrDuration max_skew);
+		std::shared_ptr<shard_accumulator::blit_handle> frame(std::optional<uint64_t> id) const;
 		std::vector<uint64_t> frames() const;
 	};
 
-	struct renderpass_output
-	{
-		vk::Extent2D size;
-		vk::Format format;
-		image_allocation image;
-		vk::raii::ImageView image_view = nullptr;
-		vk::raii::Framebuffer frame_buffer = nullptr;
-	};
-
 	std::unique_ptr<wivrn_session> network_session;
+	// Sent again when the connection is resumed
+	from_headset::headset_info_packet headset_info;
 	std::atomic<bool> exiting = false;
+	// The connection was lost and the network thread is trying to resume it
+	std::atomic<bool> resuming = false;
+	// The server does not send video, keep displaying the last frame
+	std::atomic<bool> server_idle = false;
+	// Control, audio and low latency packets
 	std::thread network_thread;
+	// Video shards, fed to the decoders as soon as they are received
+	std::thread video_thread;
+	// Packets of the stream socket other than video shards, handled by the network thread.
+	// stream_packets_event (an eventfd) wakes it up when packets are added
+	std::mutex stream_packets_mutex;
+	std::vector<to_headset::packets> stream_packets; // Locked by stream_packets_mutex
+	int stream_packets_event = -1;
 	std::mutex local_floor_mutex;
 	xr::space local_floor;
+	// How far in the future the head and the other devices are sampled, from the server
 	std::atomic<std::chrono::nanoseconds::rep> tracking_prediction_offset;
+	std::atomic<std::chrono::nanoseconds::rep> hand_prediction_offset;
+	// Compositor wake ups sent by the server, the tracking thread samples just before them
+	struct wake_up_schedule
+	{
+		XrTime next_wake_up;
+		XrDuration wake_up_period;
+		XrDuration display_offset;
+		XrDuration uplink;
+		// When it was received, it is not used once the server stops sending it
+		XrTime received;
+	};
+	std::mutex tracking_schedule_mutex;
+	std::optional<wake_up_schedule> tracking_schedule; // Locked by tracking_schedule_mutex
+	// Time between two frames of the decoders, the budget of the threads that handle them
+	std::atomic<std::chrono::nanoseconds::rep> decoder_frame_period = 0;
 	std::optional<std::thread> tracking_thread;
 
 	std::shared_mutex decoder_mutex;
 	std::optional<to_headset::video_stream_description> video_stream_description;
-	std::vector<accumulator_images> decoders; // Locked by decoder_mutex
+	// From video_stream_description, for the statistics
+	std::atomic<int> periods_per_frame = 1;
+	// Declared before the decoders, which free their descriptor sets
 	vk::raii::DescriptorPool blit_descriptor_pool = nullptr;
-	vk::raii::RenderPass blit_render_pass = nullptr;
+	uint32_t blit_descriptor_pool_size = 0;
+	std::vector<accumulator_images> decoders; // Locked by decoder_mutex
+	struct decode_time_stats
+	{
+		double sum = 0; // µs per megapixel
+		uint64_t count = 0;
+	};
+	std::map<video_codec, decode_time_stats> decode_times; // Written by the render thread with decoder_mutex shared, read with it unique
 
-	std::array<renderpass_output, view_count> decoder_output{};
+	std::optional<stream_reprojection> reprojector; // Locked by decoder_mutex
 
-	std::optional<stream_reprojection> reprojector;
+	// Motion of the last frames, to extrapolate them when they are displayed after their time
+	std::mutex motion_mutex;
+	std::deque<to_headset::video_stream_motion> motion_fields; // Locked by motion_mutex
+
+	// Distance of the last frames, given to the runtime for its reprojection
+	std::mutex depth_mutex;
+	std::deque<to_headset::video_stream_depth> depth_maps; // Locked by depth_mutex
+
+	// Quad layers of the application, sent separately from the video stream
+	std::mutex quad_layers_mutex;
+	std::vector<to_headset::quad_layers> pending_quad_layers; // Locked by quad_layers_mutex
+	struct quad_layer
+	{
+		to_headset::quad_layers::item item;
+		xr::swapchain swapchain;
+		// Current content of the layer, copied to the swapchain when it changes
+		buffer_allocation pixels;
+		bool changed = false;
+		bool acquired = false;
+		// The swapchain has an image
+		bool ready = false;
+	};
+	std::vector<quad_layer> quad_layers; // From back to front, only accessed from the render thread
 
-	vk::raii::Fence fence = nullptr;
-	vk::raii::CommandBuffer command_buffer = nullptr;
+	// Resources of a frame in flight, reused once its fence is signaled
+	struct frame_resources
+	{
+		vk::raii::Fence fence = nullptr;
+		vk::raii::CommandBuffer command_buffer = nullptr;
+		// Keep a reference to the resources needed to blit the images until vkWaitForFences
+		std::vector<std::shared_ptr<shard_accumulator::blit_handle>> blit_handles;
+		// The GPU timestamps of this frame were written in the query pool
+		bool timestamps_written = false;
+	};
+	std::array<frame_resources, frames_in_flight> frames;
+	size_t current_frame = 0;
 
 	struct haptics_action
 	{
@@ -100,24 +176,42 @@ private:
 		std::atomic<float> amplitude;
 	};
 	std::array<haptics_action, 2> haptics_actions;
+	// Haptics waiting for their start time, started by the tracking thread
+	std::mutex haptics_mutex;
+	std::vector<to_headset::haptics> pending_haptics; // Locked by haptics_mutex
+	std::optional<uint32_t> last_haptics_sequence; // Locked by haptics_mutex
+	void apply_haptics(const to_headset::haptics &);
+	// Returns the start time of the next pending haptics, 0 if there are none
+	XrTime apply_pending_haptics(XrTime now);
 	std::vector<std::tuple<device_id, XrAction, XrActionType>> input_actions;
+	struct sent_input
+	{
+		from_headset::inputs::input_value value;
+		// Number of packets the value is still sent in, the stream socket may lose some
+		int repeats;
+	};
+	// Last sent value of each input, only the changed values are sent
+	std::map<device_id, sent_input> sent_inputs;
+	XrTime last_inputs_refresh = 0;
 
 	state state_ = state::initializing;
 
 	std::vector<xr::swapchain> swapchains;
+	// Empty if the depth cannot be submitted
+	std::vector<xr::swapchain> depth_swapchains;
+	vk::Format depth_format = vk::Format::eUndefined;
 	xr::swapchain swapchain_imgui;
 	vk::Format swapchain_format;
 
 	std::optional<audio> audio_handle;
+	audio_statistics audio_stats;
 
 	std::optional<imgui_context> imgui_ctx;
 	bool plots_visible = true;
+	XrTime last_plot_refresh = 0;
 	XrAction plots_toggle_1 = XR_NULL_HANDLE;
 	XrAction plots_toggle_2 = XR_NULL_HANDLE;
 
-	// Keep a reference to the resources needed to blit the images until vkWaitForFences
-	std::vector<std::shared_ptr<shard_accumulator::blit_handle>> current_blit_handles;
-
 	stream() = default;
 
 public:
@@ -131,16 +225,25 @@ public:
 
 	void operator()(to_headset::handshake &&){};
 	void operator()(to_headset::video_stream_data_shard &&);
+	void operator()(to_headset::video_stream_parity_shard &&);
 	void operator()(to_headset::haptics &&);
 	void operator()(to_headset::timesync_query &&);
 	void operator()(to_headset::prediction_offset &&);
 	void operator()(to_headset::audio_stream_description &&);
 	void operator()(to_headset::video_stream_description &&);
+	void operator()(to_headset::video_stream_idle &&);
+	void operator()(to_headset::video_stream_motion &&);
+	void operator()(to_headset::video_stream_depth &&);
+	void operator()(to_headset::link_probe &&) {}
+	void operator()(to_headset::quad_layers &&);
 	void operator()(audio_data &&);
 
+	// Called by the decoders, does not block
 	void push_blit_handle(shard_accumulator * decoder, std::shared_ptr<shard_accumulator::blit_handle> handle);
 
+	// Adds the feedback to the next batch, only sends it if the batch is full
 	void send_feedback(const xrt::drivers::wivrn::from_headset::feedback & feedback);
+	void send_nack(const xrt::drivers::wivrn::from_headset::video_stream_nack & nack);
 
 	state current_state() const
 	{
@@ -156,34 +259,124 @@ public:
 
 private:
 	void process_packets();
+	void receive_video();
+	// Reconnects to the same server after a network error, keeping the decoders.
+	// Returns false if the server could not be reached in time
+	bool resume();
+	void send_network_stats();
+	// Polls the Android thermal status, called by the network thread
+	void check_thermal_status();
+	// Sends the worst of the runtime and Android states if it changed, must hold performance_state_mutex
+	void send_performance_state();
+	// Sends the pending feedback batch if its oldest record is older than feedback_interval, or if force is set
+	void flush_feedback(bool force = false);
 	void tracking();
 	void read_actions();
+	// Applies the received quad layers and records the copy of the changed ones, called by the render thread
+	void update_quad_layers(vk::raii::CommandBuffer &);
+	// Once the copy commands are submitted
+	void release_quad_layers();
+	std::vector<XrCompositionLayerQuad> quad_layer_composition();
+	// Moves the decoded frames to latest_frames, called by the render thread with decoder_mutex locked
+	void collect_decoded_frames();
 
 	void setup(const to_headset::video_stream_description &);
 	void setup_reprojection_swapchain();
+	// Waits until the GPU is done with all the frames in flight
+	void wait_frames();
 	void exit();
-
+	// Remember decoding times so that the server can pick the fastest codec on next connection
+	void save_decode_times();
+
+	// Created by the render thread on its first frame
+	std::optional<utils::performance_hint> render_hint;
+	// Set if XR_EXT_performance_settings is supported, only used by the render thread
+	std::optional<performance_controller> perf_controller;
+
+	utils::thermal_monitor thermal;
+	std::chrono::steady_clock::time_point next_thermal_check{};
+	std::mutex performance_state_mutex;
+	from_headset::performance_state runtime_performance_state{};
+	from_headset::performance_state::level android_thermal_level = from_headset::performance_state::level::normal;
+	from_headset::performance_state reported_performance_state{};
+	// The performance plots are hidden to reduce the load when the headset heats up
+	std::atomic<bool> thermal_pressure = false;
+
+	// size_gpu_timestamps queries per frame in flight
 	vk::raii::QueryPool query_pool = nullptr;
-	bool query_pool_filled = false;
 
 	uint64_t bytes_sent = 0;
 	uint64_t bytes_received = 0;
 	float bandwidth_rx = 0;
 	float bandwidth_tx = 0;
+	UDP::statistics metrics_stream_stats{};
+	float packet_loss = 0;
+	float packet_reordering = 0;
+
+	// Last reported to the server, used by the network thread
+	UDP::statistics reported_stream_stats{};
+	UDP::statistics reported_low_latency_stats{};
+	std::vector<UDP::statistics> reported_video_stats;
+	uint32_t reported_audio_xruns = 0;
+	std::chrono::steady_clock::time_point next_network_stats{};
+
+	static constexpr XrDuration feedback_interval = 4'000'000;
+	// Keeps the batches within a single datagram
+	static constexpr size_t max_feedback_batch = 16;
+	std::mutex feedback_mutex;
+	from_headset::feedback_batch pending_feedback{};
+	XrTime pending_feedback_start = 0;
+	// Stages of the frames displayed since the last network_stats report, protected by feedback_mutex
+	struct stage_sketches
+	{
+		utils::quantile_sketch receive;
+		utils::quantile_sketch decode;
+		utils::quantile_sketch queue;
+		utils::quantile_sketch display;
+	};
+	stage_sketches stage_stats;
 
+	// GPU time of each pass of a frame, in seconds
 	struct gpu_timestamps
 	{
+		// Copy of the quad layers to their swapchains
+		float gpu_quad_layers = 0;
+		// Layout transitions of the decoded images
 		float gpu_barrier = 0;
+		float gpu_reproject_left = 0;
+		float gpu_reproject_right = 0;
+		// Whole command buffer of the frame
 		float gpu_time = 0;
+		// Performance metrics overlay, only in the frames where it was rendered again
+		float gpu_overlay = 0;
+	};
+
+	// Sum of the GPU times since the last network_stats report, written by the render thread
+	struct gpu_accumulator
+	{
+		gpu_timestamps sum;
+		float max_time = 0;
+		uint32_t frames = 0;
+		utils::quantile_sketch cpu_time;
+		utils::quantile_sketch gpu_time;
 	};
+	std::mutex gpu_stats_mutex;
+	gpu_accumulator gpu_stats;
 
 	struct global_metric //: gpu_timestamps
 	{
+		float gpu_quad_layers;
 		float gpu_barrier;
+		float gpu_reproject_left;
+		float gpu_reproject_right;
 		float gpu_time;
+		float gpu_overlay;
 		float cpu_time = 0;
 		float bandwidth_rx = 0;
 		float bandwidth_tx = 0;
+		float packet_loss = 0;
+		float packet_reordering = 0;
+		float jitter = 0;
 	};
 
 	struct plot
@@ -198,7 +391,8 @@ private:
 		const char * unit;
 	};
 
-	static const inline int size_gpu_timestamps = 1 + sizeof(gpu_timestamps) / sizeof(float);
+	// Begin of the frame, then after the quad layers, the layout transitions and the reprojection of each eye
+	static const inline int size_gpu_timestamps = 3 + view_count;
 
 	struct decoder_metric
 	{
@@ -211,6 +405,12 @@ private:
 		float received_from_decoder;
 		float blitted;
 		float displayed;
+		// Production of the tracking sample the frame was rendered from, NaN if unknown
+		float tracking;
+		// Encoded frame size in bytes
+		float bytes;
+		// Negative if the encoder does not report it
+		float average_qp;
 	};
 
 	std::vector<global_metric> global_metrics{300};
@@ -223,5 +423,6 @@ private:
 	XrCompositionLayerQuad plot_performance_metrics(XrTime predicted_display_time);
 	void update_local_floor(XrTime when);
 	void on_reference_space_changed(XrReferenceSpaceType space, XrTime) override;
+	void on_perf_settings(const XrEventDataPerfSettingsEXT &) override;
 };
 } // namespace scenes
@@ -19,12 +19,41 @@
 
 #include "application.h"
 #include "stream.h"
+#include "wivrn_quantization.h"
+#include <algorithm>
 #include <spdlog/spdlog.h>
 
+// All the values are sent again after this duration, in case a packet was lost
+static const XrDuration inputs_refresh_period = 500'000'000;
+// A changed value is sent in this many packets, so that a lost packet does not leave a button held
+static const int inputs_repeat_count = 3;
+
 void scenes::stream::read_actions()
 {
 	from_headset::inputs inputs;
 
+	XrTime now = instance.now();
+	const bool refresh = now - last_inputs_refresh >= inputs_refresh_period;
+	if (refresh)
+		last_inputs_refresh = now;
+
+	auto add = [&](device_id id, float value, XrTime last_change_time) {
+		from_headset::inputs::input_value input{id, xrt::drivers::wivrn::pack_input(value), last_change_time};
+		auto [it, inserted] = sent_inputs.try_emplace(id, sent_input{input, 0});
+		auto & sent = it->second;
+		if (inserted or sent.value.value != input.value or sent.value.last_change_time != input.last_change_time)
+		{
+			sent.value = input;
+			sent.repeats = inputs_repeat_count;
+		}
+		if (refresh or sent.repeats > 0)
+		{
+			if (sent.repeats > 0)
+				--sent.repeats;
+			inputs.values.push_back(input);
+		}
+	};
+
 	for (const auto & [id, action, action_type]: input_actions)
 	{
 		switch (action_type)
@@ -32,14 +61,14 @@ void scenes::stream::read_actions()
 			case XR_ACTION_TYPE_BOOLEAN_INPUT: {
 				auto value = application::read_action_bool(action);
 				if (value)
-					inputs.values.push_back({id, (float)value->second, value->first});
+					add(id, value->second, value->first);
 			}
 			break;
 
 			case XR_ACTION_TYPE_FLOAT_INPUT: {
 				auto value = application::read_action_float(action);
 				if (value)
-					inputs.values.push_back({id, value->second, value->first});
+					add(id, value->second, value->first);
 			}
 			break;
 
@@ -47,8 +76,8 @@ void scenes::stream::read_actions()
 				auto value = application::read_action_vec2(action);
 				if (value)
 				{
-					inputs.values.push_back({id, value->second.x, value->first});
-					inputs.values.push_back({(device_id)((int)id + 1), value->second.y, value->first});
+					add(id, value->second.x, value->first);
+					add((device_id)((int)id + 1), value->second.y, value->first);
 				}
 			}
 			break;
@@ -58,6 +87,10 @@ void scenes::stream::read_actions()
 				break;
 		}
 	}
+
+	if (inputs.values.empty())
+		return;
+
 	try
 	{
 		network_session->send_stream(inputs);
@@ -69,6 +102,57 @@ void scenes::stream::read_actions()
 }
 
 void scenes::stream::operator()(to_headset::haptics && haptics)
+{
+	{
+		std::lock_guard lock(haptics_mutex);
+		// A sequence far behind the last one is from a new server
+		int32_t diff = last_haptics_sequence ? int32_t(haptics.sequence - *last_haptics_sequence) : 1;
+		if (diff <= 0 and diff > -64)
+			return;
+		last_haptics_sequence = haptics.sequence;
+
+		// Keep the order of the haptics of each controller
+		for (const auto & pending: pending_haptics)
+		{
+			if (pending.id == haptics.id)
+				haptics.start = std::max(haptics.start, pending.start);
+		}
+
+		// Start times further away are from a wrong clock offset
+		XrTime now = instance.now();
+		if (haptics.start > now and haptics.start < now + 100'000'000)
+		{
+			pending_haptics.push_back(haptics);
+			return;
+		}
+	}
+	apply_haptics(haptics);
+}
+
+XrTime scenes::stream::apply_pending_haptics(XrTime now)
+{
+	std::vector<to_headset::haptics> due;
+	XrTime next = 0;
+	{
+		std::lock_guard lock(haptics_mutex);
+		std::erase_if(pending_haptics, [&](const to_headset::haptics & haptics) {
+			if (haptics.start <= now)
+			{
+				due.push_back(haptics);
+				return true;
+			}
+			next = next ? std::min(next, haptics.start) : haptics.start;
+			return false;
+		});
+	}
+
+	// Runtimes may be slow to process haptics, do not hold the lock
+	for (const auto & haptics: due)
+		apply_haptics(haptics);
+	return next;
+}
+
+void scenes::stream::apply_haptics(const to_headset::haptics & haptics)
 {
 	size_t i;
 	if (haptics.id == device_id::LEFT_CONTROLLER_HAPTIC)
@@ -21,27 +21,288 @@
 
 #include "application.h"
 #include "utils/named_thread.h"
+#include "wifi_lock.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <magic_enum.hpp>
 #include <spdlog/spdlog.h>
+#include <sys/resource.h>
+#include <thread>
+#include <unistd.h>
+
+// The headset is usually back on the network within a few seconds
+static const auto resume_timeout = std::chrono::seconds(10);
 
 void scenes::stream::process_packets()
 {
 #ifdef __ANDROID__
 	application::instance().setup_jni();
 #endif
+	std::vector<to_headset::packets> packets;
 	while (not exiting)
 	{
 		try
 		{
-			network_session->poll(*this, std::chrono::milliseconds(500));
+			network_session->poll(*this, std::chrono::milliseconds(500), wivrn_session::control_sockets, stream_packets_event);
+
+			uint64_t count;
+			if (read(stream_packets_event, &count, sizeof(count)) > 0)
+			{
+				{
+					std::lock_guard lock(stream_packets_mutex);
+					std::swap(packets, stream_packets);
+				}
+				for (auto & packet: packets)
+					std::visit(*this, std::move(packet));
+				packets.clear();
+			}
+
+			send_network_stats();
+			check_thermal_status();
 		}
 		catch (std::exception & e)
 		{
-			spdlog::info("Exception in network thread, exiting: {}", e.what());
-			exit();
+			if (exiting)
+				break;
+			spdlog::info("Exception in network thread: {}", e.what());
+			if (not resume())
+			{
+				spdlog::info("Connection lost, exiting");
+				exit();
+			}
 		}
 	}
 }
 
+void scenes::stream::receive_video()
+{
+#ifdef __ANDROID__
+	application::instance().setup_jni();
+#endif
+	// Shards are only moved to the decoders, other work must not delay them
+	if (setpriority(PRIO_PROCESS, gettid(), -10) < 0)
+		spdlog::debug("Cannot raise the priority of the video thread: {}", strerror(errno));
+
+	// The work of each decoder frame period is reported, against half the period
+	std::optional<utils::performance_hint> hint;
+	std::chrono::nanoseconds busy{};
+	auto next_report = std::chrono::steady_clock::now();
+
+	auto visitor = [&]<typename T>(T && packet) {
+		if constexpr (std::is_same_v<T, to_headset::video_stream_data_shard> or std::is_same_v<T, to_headset::video_stream_parity_shard>)
+		{
+			auto start = std::chrono::steady_clock::now();
+			(*this)(std::move(packet));
+			busy += std::chrono::steady_clock::now() - start;
+		}
+		else
+		{
+			{
+				std::lock_guard lock(stream_packets_mutex);
+				stream_packets.emplace_back(std::move(packet));
+			}
+			uint64_t one = 1;
+			write(stream_packets_event, &one, sizeof(one));
+		}
+	};
+
+	while (not exiting)
+	{
+		try
+		{
+			network_session->poll(visitor, std::chrono::milliseconds(100), wivrn_session::stream_socket);
+
+			std::chrono::nanoseconds period(decoder_frame_period.load());
+			if (auto now = std::chrono::steady_clock::now(); period.count() > 0 and now >= next_report)
+			{
+				if (not hint)
+					hint.emplace("video thread", period / 2);
+				hint->set_target(period / 2);
+				hint->report(busy);
+				busy = {};
+				next_report = now + period;
+			}
+		}
+		catch (std::exception & e)
+		{
+			// The network thread notices the lost connection on the control socket and resumes it
+			spdlog::debug("Exception in video thread: {}", e.what());
+			std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		}
+	}
+}
+
+bool scenes::stream::resume()
+{
+	resuming = true;
+	auto deadline = std::chrono::steady_clock::now() + resume_timeout;
+	while (not exiting and std::chrono::steady_clock::now() < deadline)
+	{
+		try
+		{
+			network_session->reconnect();
+			network_session->send_control(headset_info);
+			reported_stream_stats = {};
+			reported_low_latency_stats = {};
+			reported_video_stats.clear();
+			resuming = false;
+			spdlog::info("Connection resumed");
+			return true;
+		}
+		catch (std::exception & e)
+		{
+			spdlog::info("Failed to resume connection: {}", e.what());
+			std::this_thread::sleep_for(std::chrono::milliseconds(200));
+		}
+	}
+	resuming = false;
+	return false;
+}
+
+void scenes::stream::send_network_stats()
+{
+	auto now = std::chrono::steady_clock::now();
+	if (now < next_network_stats)
+		return;
+	next_network_stats = now + std::chrono::seconds(1);
+
+	auto delta = [](const UDP::statistics & stats, UDP::statistics & reported) {
+		from_headset::network_stats::flow flow{
+		        .received = uint32_t(stats.received - reported.received),
+		        .lost = uint32_t(std::max<int64_t>(0, stats.lost - reported.lost)),
+		        .reordered = uint32_t(stats.reordered - reported.reordered),
+		        .jitter = stats.jitter,
+		};
+		reported = stats;
+		return flow;
+	};
+
+	// The number of video sockets only changes on reconnection, which resets the reported statistics
+	std::vector<from_headset::network_stats::flow> video;
+	auto video_stats = network_session->video_statistics();
+	reported_video_stats.resize(video_stats.size());
+	for (size_t i = 0; i < video_stats.size(); ++i)
+		video.push_back(delta(video_stats[i], reported_video_stats[i]));
+
+	std::optional<from_headset::network_stats::audio_latency> audio;
+	if (audio_handle)
+	{
+		uint32_t xruns = audio_stats.xruns;
+		audio = from_headset::network_stats::audio_latency{
+		        .speaker = XrDuration(audio_stats.latency * 1'000'000),
+		        .speaker_output = XrDuration(audio_stats.output_latency * 1'000'000),
+		        .microphone = XrDuration(audio_stats.microphone_latency * 1'000'000),
+		        .xruns = xruns - reported_audio_xruns,
+		};
+		reported_audio_xruns = xruns;
+	}
+
+	auto summary = [](const utils::quantile_sketch & sketch) {
+		return from_headset::network_stats::percentiles{
+		        .count = sketch.count(),
+		        .mean = sketch.mean(),
+		        .p50 = sketch.quantile(0.5),
+		        .p95 = sketch.quantile(0.95),
+		        .p99 = sketch.quantile(0.99),
+		};
+	};
+
+	std::optional<from_headset::network_stats::frame_stages> stages;
+	{
+		std::lock_guard lock(feedback_mutex);
+		if (stage_stats.display.count())
+		{
+			stages = from_headset::network_stats::frame_stages{
+			        .receive = summary(stage_stats.receive),
+			        .decode = summary(stage_stats.decode),
+			        .queue = summary(stage_stats.queue),
+			        .display = summary(stage_stats.display),
+			};
+		}
+		stage_stats = {};
+	}
+
+	std::optional<from_headset::network_stats::gpu_passes> gpu;
+	{
+		std::lock_guard lock(gpu_stats_mutex);
+		if (gpu_stats.frames)
+		{
+			const auto & sum = gpu_stats.sum;
+			auto average = [&](float seconds) { return XrDuration(seconds * 1e9 / gpu_stats.frames); };
+			gpu = from_headset::network_stats::gpu_passes{
+			        .frames = gpu_stats.frames,
+			        .quad_layers = average(sum.gpu_quad_layers),
+			        .transition = average(sum.gpu_barrier),
+			        .reprojection = {average(sum.gpu_reproject_left), average(sum.gpu_reproject_right)},
+			        .overlay = average(sum.gpu_overlay),
+			        .total = average(sum.gpu_time),
+			        .max_total = XrDuration(gpu_stats.max_time * 1e9),
+			};
+			if (stages)
+			{
+				stages->cpu = summary(gpu_stats.cpu_time);
+				stages->gpu = summary(gpu_stats.gpu_time);
+			}
+		}
+		gpu_stats = {};
+	}
+
+	try
+	{
+		network_session->send_control(from_headset::network_stats{
+		        .timestamp = instance.now(),
+		        .stream = delta(network_session->stream_statistics(), reported_stream_stats),
+		        .low_latency = delta(network_session->low_latency_statistics(), reported_low_latency_stats),
+		        .video = std::move(video),
+		        .wifi = wifi_lock::link(),
+		        .audio = audio,
+		        .gpu = gpu,
+		        .stages = stages,
+		});
+	}
+	catch (std::exception & e)
+	{
+		spdlog::warn("Exception while sending network stats packet: {}", e.what());
+	}
+}
+
+void scenes::stream::check_thermal_status()
+{
+	auto now = std::chrono::steady_clock::now();
+	if (not thermal or now < next_thermal_check)
+		return;
+	next_thermal_check = now + std::chrono::seconds(5);
+
+	using level = from_headset::performance_state::level;
+	using status = utils::thermal_monitor::status;
+
+	// Act on the forecast at the next check, before the system throttles
+	auto current_status = thermal.get_status();
+	float headroom = thermal.get_headroom(std::chrono::seconds(10));
+
+	std::lock_guard lock(performance_state_mutex);
+	level new_level = android_thermal_level;
+	if (current_status >= status::severe or headroom >= 1)
+		new_level = level::impaired;
+	else if (current_status == status::moderate or headroom >= 0.85)
+		new_level = level::warning;
+	else if (std::isnan(headroom) or headroom < 0.75)
+		// Only go back once there is some margin, not to oscillate around the threshold
+		new_level = level::normal;
+
+	if (new_level == android_thermal_level)
+		return;
+
+	spdlog::info("Thermal level {} -> {}: status {}, headroom {}",
+	             magic_enum::enum_name(android_thermal_level),
+	             magic_enum::enum_name(new_level),
+	             magic_enum::enum_name(current_status),
+	             headroom);
+	android_thermal_level = new_level;
+	send_performance_state();
+}
+
 void scenes::stream::operator()(to_headset::video_stream_data_shard && shard)
 {
 	std::shared_lock lock(decoder_mutex);
@@ -54,13 +315,26 @@ void scenes::stream::operator()(to_headset::video_stream_data_shard && shard)
 	decoders[idx].decoder->push_shard(std::move(shard));
 }
 
+void scenes::stream::operator()(to_headset::video_stream_parity_shard && shard)
+{
+	std::shared_lock lock(decoder_mutex);
+	if (shard.stream_item_idx >= decoders.size())
+	{
+		// We don't know (yet?) about this stream, ignore packet
+		return;
+	}
+	auto idx = shard.stream_item_idx;
+	decoders[idx].decoder->push_shard(std::move(shard));
+}
+
 void scenes::stream::operator()(to_headset::audio_stream_description && desc)
 {
-	audio_handle.emplace(desc, *network_session, instance);
+	audio_handle.emplace(desc, *network_session, instance, audio_stats);
 }
 
 void scenes::stream::operator()(to_headset::video_stream_description && desc)
 {
+	server_idle = false;
 	setup(desc);
 
 	if (not tracking_thread)
@@ -69,6 +343,29 @@ void scenes::stream::operator()(to_headset::video_stream_description && desc)
 	}
 }
 
+void scenes::stream::operator()(to_headset::video_stream_idle && packet)
+{
+	spdlog::info("Video stream {}", packet.idle ? "idle" : "resumed");
+	server_idle = packet.idle;
+}
+
+void scenes::stream::operator()(to_headset::video_stream_motion && packet)
+{
+	std::lock_guard lock(motion_mutex);
+	motion_fields.push_back(std::move(packet));
+	// The displayed frame is one of the last received ones
+	while (motion_fields.size() > 4)
+		motion_fields.pop_front();
+}
+
+void scenes::stream::operator()(to_headset::video_stream_depth && packet)
+{
+	std::lock_guard lock(depth_mutex);
+	depth_maps.push_back(std::move(packet));
+	while (depth_maps.size() > 4 * view_count)
+		depth_maps.pop_front();
+}
+
 void scenes::stream::operator()(to_headset::timesync_query && query)
 {
 	from_headset::timesync_response response{};
@@ -85,12 +382,86 @@ void scenes::stream::operator()(audio_data && data)
 
 void scenes::stream::send_feedback(const xrt::drivers::wivrn::from_headset::feedback & feedback)
 {
+	{
+		std::lock_guard lock(feedback_mutex);
+		auto & batch = pending_feedback;
+
+		// Frames displayed again are reported each time, the server only uses the first display
+		if (feedback.times_displayed > 1 and std::ranges::any_of(batch.frames, [&](const auto & f) {
+			    return f.stream_index == feedback.stream_index and f.frame_index == feedback.frame_index;
+		    }))
+			return;
+
+		if (feedback.times_displayed == 1)
+		{
+			auto add = [](utils::quantile_sketch & sketch, XrTime begin, XrTime end) {
+				if (begin and end >= begin)
+					sketch.add(end - begin);
+			};
+			add(stage_stats.receive, feedback.received_first_packet, feedback.received_last_packet);
+			add(stage_stats.decode, feedback.sent_to_decoder, feedback.received_from_decoder);
+			add(stage_stats.queue, feedback.received_from_decoder, feedback.blitted);
+			add(stage_stats.display, feedback.blitted, feedback.displayed);
+		}
+
+		if (feedback.times_displayed <= 1)
+		{
+			if (batch.streams.size() <= feedback.stream_index)
+				batch.streams.resize(feedback.stream_index + 1);
+			auto & counters = batch.streams[feedback.stream_index];
+			++counters.frames;
+			if (not feedback.sent_to_decoder or feedback.lost_slices)
+			{
+				++counters.lost;
+				counters.last_lost = feedback.frame_index;
+			}
+			else if (feedback.times_displayed == 0)
+				++counters.skipped;
+		}
+
+		if (batch.frames.empty())
+			pending_feedback_start = application::now();
+		batch.frames.push_back(feedback);
+		if (batch.frames.size() < max_feedback_batch)
+			return;
+	}
+	flush_feedback(true);
+}
+
+void scenes::stream::flush_feedback(bool force)
+{
+	from_headset::feedback_batch batch;
+	{
+		std::lock_guard lock(feedback_mutex);
+		if (pending_feedback.frames.empty())
+			return;
+		if (not force and application::now() < pending_feedback_start + feedback_interval)
+			return;
+
+		batch.sequence = pending_feedback.sequence++;
+		batch.frames = std::move(pending_feedback.frames);
+		batch.streams = pending_feedback.streams;
+		pending_feedback.frames.clear();
+	}
+
 	try
 	{
-		network_session->send_control(feedback);
+		network_session->send_stream(batch);
 	}
 	catch (std::exception & e)
 	{
 		spdlog::warn("Exception while sending feedback packet: {}", e.what());
 	}
 }
+
+void scenes::stream::send_nack(const xrt::drivers::wivrn::from_headset::video_stream_nack & nack)
+{
+	try
+	{
+		network_session->send_stream(nack);
+	}
+	catch (std::exception & e)
+	{
+		spdlog::warn("Exception while sending nack packet: {}", e.what());
+	}
+}
@@ -0,0 +1,193 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "stream.h"
+
+#include "application.h"
+#include "wivrn_rle.h"
+#include <algorithm>
+#include <spdlog/spdlog.h>
+
+using namespace xrt::drivers::wivrn;
+
+void scenes::stream::operator()(to_headset::quad_layers && packet)
+{
+	std::lock_guard lock(quad_layers_mutex);
+	pending_quad_layers.push_back(std::move(packet));
+}
+
+static bool same_image(const to_headset::quad_layers::item & a, const to_headset::quad_layers::item & b)
+{
+	return a.width == b.width and a.height == b.height and a.srgb == b.srgb;
+}
+
+void scenes::stream::update_quad_layers(vk::raii::CommandBuffer & command_buffer)
+{
+	std::vector<to_headset::quad_layers> packets;
+	{
+		std::lock_guard lock(quad_layers_mutex);
+		std::swap(packets, pending_quad_layers);
+	}
+
+	// The other frames in flight may still copy from the pixel buffers
+	if (not packets.empty())
+		wait_frames();
+
+	for (auto & packet: packets)
+	{
+		std::vector<quad_layer> layers;
+		for (auto & item: packet.items)
+		{
+			auto it = std::ranges::find_if(quad_layers, [&](const quad_layer & l) { return l.item.id == item.id and same_image(l.item, item); });
+			auto & layer = layers.emplace_back();
+			if (it != quad_layers.end())
+				layer = std::move(*it);
+			else
+			{
+				auto format = item.srgb ? vk::Format::eR8G8B8A8Srgb : vk::Format::eR8G8B8A8Unorm;
+				layer.swapchain = xr::swapchain(session, device, format, item.width, item.height, 1, XR_SWAPCHAIN_USAGE_TRANSFER_DST_BIT | XR_SWAPCHAIN_USAGE_SAMPLED_BIT);
+				layer.pixels = buffer_allocation(
+				        device,
+				        vk::BufferCreateInfo{
+				                .size = size_t(item.width) * item.height * sizeof(uint32_t),
+				                .usage = vk::BufferUsageFlagBits::eTransferSrc,
+				        },
+				        VmaAllocationCreateInfo{
+				                .flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT,
+				                .usage = VMA_MEMORY_USAGE_AUTO,
+				        });
+				spdlog::info("Created quad layer {}: {}x{}", item.id, item.width, item.height);
+			}
+
+			if (not item.pixels.empty())
+			{
+				if (item.update_x + item.update_width > item.width or item.update_y + item.update_height > item.height)
+				{
+					spdlog::warn("Invalid update of quad layer {}", item.id);
+					layers.pop_back();
+					continue;
+				}
+				std::vector<uint32_t> rect(size_t(item.update_width) * item.update_height);
+				if (not rle_decode(item.pixels, rect))
+				{
+					spdlog::warn("Invalid pixels for quad layer {}", item.id);
+					layers.pop_back();
+					continue;
+				}
+				uint32_t * pixels = layer.pixels.data<uint32_t>();
+				for (uint16_t y = 0; y < item.update_height; ++y)
+					std::ranges::copy(std::span(rect).subspan(size_t(y) * item.update_width, item.update_width),
+					                  pixels + size_t(item.update_y + y) * item.width + item.update_x);
+				layer.changed = true;
+			}
+			item.pixels.clear();
+			layer.item = std::move(item);
+		}
+		// Layers that are not in the packet are destroyed
+		quad_layers = std::move(layers);
+	}
+
+	for (auto & layer: quad_layers)
+	{
+		if (not layer.changed)
+			continue;
+		vmaFlushAllocation(vk_allocator::instance(), layer.pixels, 0, VK_WHOLE_SIZE);
+
+		int index = layer.swapchain.acquire();
+		layer.swapchain.wait();
+		layer.acquired = true;
+		layer.changed = false;
+		layer.ready = true;
+		vk::Image image = layer.swapchain.images()[index].image;
+
+		vk::ImageMemoryBarrier barrier{
+		        .srcAccessMask = {},
+		        .dstAccessMask = vk::AccessFlagBits::eTransferWrite,
+		        .oldLayout = vk::ImageLayout::eUndefined,
+		        .newLayout = vk::ImageLayout::eTransferDstOptimal,
+		        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+		        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+		        .image = image,
+		        .subresourceRange = {
+		                .aspectMask = vk::ImageAspectFlagBits::eColor,
+		                .levelCount = 1,
+		                .layerCount = 1,
+		        },
+		};
+		command_buffer.pipelineBarrier(vk::PipelineStageFlagBits::eTopOfPipe, vk::PipelineStageFlagBits::eTransfer, {}, nullptr, nullptr, barrier);
+
+		command_buffer.copyBufferToImage(
+		        layer.pixels,
+		        image,
+		        vk::ImageLayout::eTransferDstOptimal,
+		        vk::BufferImageCopy{
+		                .imageSubresource = {
+		                        .aspectMask = vk::ImageAspectFlagBits::eColor,
+		                        .layerCount = 1,
+		                },
+		                .imageExtent = {layer.item.width, layer.item.height, 1},
+		        });
+
+		// Layout expected by the runtime when the image is released
+		barrier.srcAccessMask = vk::AccessFlagBits::eTransferWrite;
+		barrier.dstAccessMask = {};
+		barrier.oldLayout = vk::ImageLayout::eTransferDstOptimal;
+		barrier.newLayout = vk::ImageLayout::eColorAttachmentOptimal;
+		command_buffer.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eBottomOfPipe, {}, nullptr, nullptr, barrier);
+	}
+}
+
+void scenes::stream::release_quad_layers()
+{
+	for (auto & layer: quad_layers)
+	{
+		if (layer.acquired)
+			layer.swapchain.release();
+		layer.acquired = false;
+	}
+}
+
+std::vector<XrCompositionLayerQuad> scenes::stream::quad_layer_composition()
+{
+	std::vector<XrCompositionLayerQuad> res;
+	res.reserve(quad_layers.size());
+	for (const auto & layer: quad_layers)
+	{
+		if (not layer.ready)
+			continue;
+		res.push_back({
+		        .type = XR_TYPE_COMPOSITION_LAYER_QUAD,
+		        .layerFlags = XR_COMPOSITION_LAYER_BLEND_TEXTURE_SOURCE_ALPHA_BIT |
+		                      (layer.item.unpremultiplied_alpha ? XR_COMPOSITION_LAYER_UNPREMULTIPLIED_ALPHA_BIT : 0),
+		        .space = layer.item.head_locked ? application::view() : XrSpace(local_floor),
+		        .eyeVisibility = XR_EYE_VISIBILITY_BOTH,
+		        .subImage = {
+		                .swapchain = layer.swapchain,
+		                .imageRect = {
+		                        .offset = {0, 0},
+		                        .extent = layer.swapchain.extent(),
+		                },
+		        },
+		        .pose = layer.item.pose,
+		        .size = layer.item.size,
+		});
+	}
+	return res;
+}
@@ -18,11 +18,13 @@
  */
 
 #include "stream_reprojection.h"
-#include "application.h"
 #include "vk/allocation.h"
 #include "vk/pipeline.h"
 #include "vk/shader.h"
+#include <algorithm>
 #include <array>
+#include <cassert>
+#include <cstring>
 #include <glm/glm.hpp>
 #include <glm/gtx/quaternion.hpp>
 #include <spdlog/spdlog.h>
@@ -37,51 +39,55 @@ struct stream_reprojection::uniform
 	alignas(8) glm::vec2 b;
 	alignas(8) glm::vec2 lambda;
 	alignas(8) glm::vec2 xc;
+
+	// Motion extrapolation, from half pixels of the stream to the view
+	alignas(8) glm::vec2 motion_scale;
+	// From the view to the blocks of the motion field
+	alignas(8) glm::vec2 block_scale;
+	alignas(8) glm::vec2 block_offset;
+	alignas(8) glm::ivec2 blocks;
+
+	// Index of the first distance of the view
+	alignas(4) int32_t depth_offset;
 };
 
+using xrt::drivers::wivrn::to_headset::video_stream_depth;
+
 const int nb_reprojection_vertices = 64;
 
 stream_reprojection::stream_reprojection(
         vk::raii::Device & device,
         vk::raii::PhysicalDevice & physical_device,
-        std::vector<vk::Image> input_images_,
+        size_t view_count,
+        size_t frames_in_flight,
         std::vector<vk::Image> output_images_,
+        std::vector<vk::Image> depth_images_,
         vk::Extent2D extent,
         vk::Format format,
-        const xrt::drivers::wivrn::to_headset::video_stream_description & description) :
-        input_images(std::move(input_images_)),
+        vk::Format depth_format,
+        const xrt::drivers::wivrn::to_headset::video_stream_description & description,
+        vk::raii::PipelineCache & pipeline_cache,
+        bool fragment_density_map) :
+        device(device),
+        pipeline_cache(pipeline_cache),
+        view_count(view_count),
+        frames(frames_in_flight),
+        motion_width((description.width + xrt::drivers::wivrn::to_headset::video_stream_motion::block_size - 1) / xrt::drivers::wivrn::to_headset::video_stream_motion::block_size),
+        motion_height((description.height + xrt::drivers::wivrn::to_headset::video_stream_motion::block_size - 1) / xrt::drivers::wivrn::to_headset::video_stream_motion::block_size),
+        stream_size{description.width, description.height},
         output_images(std::move(output_images_)),
+        depth_images(std::move(depth_images_)),
         extent(extent)
 {
 	foveation_parameters = description.foveation;
 
 	vk::PhysicalDeviceProperties properties = physical_device.getProperties();
 
-	vk::SamplerCreateInfo sampler_info{
-	        .magFilter = vk::Filter::eLinear,
-	        .minFilter = vk::Filter::eLinear,
-	        .mipmapMode = vk::SamplerMipmapMode::eNearest,
-	        .addressModeU = vk::SamplerAddressMode::eClampToBorder,
-	        .addressModeV = vk::SamplerAddressMode::eClampToBorder,
-	        .addressModeW = vk::SamplerAddressMode::eClampToBorder,
-	        .mipLodBias = 0.0f,
-	        .anisotropyEnable = VK_FALSE,
-	        .maxAnisotropy = 1,
-	        .compareEnable = VK_FALSE,
-	        .compareOp = vk::CompareOp::eNever,
-	        .minLod = 0.0f,
-	        .maxLod = 0.0f,
-	        .borderColor = vk::BorderColor::eFloatOpaqueBlack,
-	        .unnormalizedCoordinates = VK_FALSE,
-	};
-
-	sampler = vk::raii::Sampler(device, sampler_info);
-
 	size_t uniform_size = sizeof(uniform) + properties.limits.minUniformBufferOffsetAlignment - 1;
 	uniform_size = uniform_size - uniform_size % properties.limits.minUniformBufferOffsetAlignment;
 
 	vk::BufferCreateInfo create_info{
-	        .size = uniform_size * input_images.size(),
+	        .size = uniform_size * view_count,
 	        .usage = vk::BufferUsageFlagBits::eUniformBuffer,
 	        .sharingMode = vk::SharingMode::eExclusive,
 	};
@@ -90,60 +96,342 @@ stream_reprojection::stream_reprojection(
 	        .requiredFlags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
 	};
 
-	buffer = buffer_allocation(device, create_info, alloc_info);
-	void * data = buffer.map();
-	for (size_t i = 0; i < input_images.size(); i++)
-		ubo.push_back(reinterpret_cast<uniform *>(reinterpret_cast<uintptr_t>(data) + i * uniform_size));
+	// The CPU writes the buffers of a frame while the GPU may still read the ones of the previous frames
+	for (auto & frame: frames)
+	{
+		frame.buffer = buffer_allocation(device, create_info, alloc_info);
+		void * data = frame.buffer.map();
+		for (size_t i = 0; i < view_count; i++)
+		{
+			frame.ubo.push_back(reinterpret_cast<uniform *>(reinterpret_cast<uintptr_t>(data) + i * uniform_size));
+			*frame.ubo.back() = {};
+		}
+
+		// Two bytes per block, read as 32 bit words
+		frame.motion_buffer = buffer_allocation(
+		        device,
+		        vk::BufferCreateInfo{
+		                .size = vk::DeviceSize(2 * motion_width * motion_height + 3) & ~3,
+		                .usage = vk::BufferUsageFlagBits::eStorageBuffer,
+		                .sharingMode = vk::SharingMode::eExclusive,
+		        },
+		        alloc_info);
+		frame.motion_vectors = reinterpret_cast<int8_t *>(frame.motion_buffer.map());
+
+		frame.depth_buffer = buffer_allocation(
+		        device,
+		        vk::BufferCreateInfo{
+		                .size = view_count * video_stream_depth::grid_size * video_stream_depth::grid_size,
+		                .usage = vk::BufferUsageFlagBits::eStorageBuffer,
+		                .sharingMode = vk::SharingMode::eExclusive,
+		        },
+		        alloc_info);
+		frame.depth_values = reinterpret_cast<uint8_t *>(frame.depth_buffer.map());
+		memset(frame.depth_values, 0, view_count * video_stream_depth::grid_size * video_stream_depth::grid_size);
+	}
+
+	// Each vertex of the grid is computed once, the vertex index is its position in the grid
+	std::vector<uint16_t> indices;
+	indices.reserve(6 * nb_reprojection_vertices * nb_reprojection_vertices);
+	for (uint16_t y = 0; y < nb_reprojection_vertices; y++)
+	{
+		for (uint16_t x = 0; x < nb_reprojection_vertices; x++)
+		{
+			uint16_t top_left = y * (nb_reprojection_vertices + 1) + x;
+			uint16_t bottom_left = top_left + nb_reprojection_vertices + 1;
+			indices.insert(indices.end(), {top_left, uint16_t(top_left + 1), bottom_left, uint16_t(top_left + 1), bottom_left, uint16_t(bottom_left + 1)});
+		}
+	}
+
+	index_buffer = buffer_allocation(
+	        device,
+	        vk::BufferCreateInfo{
+	                .size = indices.size() * sizeof(uint16_t),
+	                .usage = vk::BufferUsageFlagBits::eIndexBuffer,
+	                .sharingMode = vk::SharingMode::eExclusive,
+	        },
+	        alloc_info);
+	memcpy(index_buffer.map(), indices.data(), indices.size() * sizeof(uint16_t));
+
+	// The periphery of the foveated stream has fewer pixels than the view, shade it at a lower rate
+	if (fragment_density_map and
+	    (physical_device.getFormatProperties(vk::Format::eR8G8Unorm).optimalTilingFeatures & vk::FormatFeatureFlagBits::eFragmentDensityMapEXT))
+	{
+		density_texel_size = physical_device.getProperties2KHR<vk::PhysicalDeviceProperties2, vk::PhysicalDeviceFragmentDensityMapPropertiesEXT>()
+		                             .get<vk::PhysicalDeviceFragmentDensityMapPropertiesEXT>()
+		                             .minFragmentDensityTexelSize;
+		density_extent = vk::Extent2D{
+		        (extent.width + density_texel_size.width - 1) / density_texel_size.width,
+		        (extent.height + density_texel_size.height - 1) / density_texel_size.height,
+		};
+
+		density_maps.reserve(view_count);
+		density_map_views.reserve(view_count);
+		for (size_t i = 0; i < view_count; i++)
+		{
+			density_maps.emplace_back(
+			        device,
+			        vk::ImageCreateInfo{
+			                .imageType = vk::ImageType::e2D,
+			                .format = vk::Format::eR8G8Unorm,
+			                .extent = {density_extent.width, density_extent.height, 1},
+			                .mipLevels = 1,
+			                .arrayLayers = 1,
+			                .samples = vk::SampleCountFlagBits::e1,
+			                .tiling = vk::ImageTiling::eOptimal,
+			                .usage = vk::ImageUsageFlagBits::eFragmentDensityMapEXT | vk::ImageUsageFlagBits::eTransferDst,
+			                .initialLayout = vk::ImageLayout::eUndefined,
+			        },
+			        VmaAllocationCreateInfo{
+			                .usage = VMA_MEMORY_USAGE_AUTO,
+			        });
+
+			density_map_views.emplace_back(
+			        device,
+			        vk::ImageViewCreateInfo{
+			                .image = density_maps.back(),
+			                .viewType = vk::ImageViewType::e2D,
+			                .format = vk::Format::eR8G8Unorm,
+			                .subresourceRange = {
+			                        .aspectMask = vk::ImageAspectFlagBits::eColor,
+			                        .baseMipLevel = 0,
+			                        .levelCount = 1,
+			                        .baseArrayLayer = 0,
+			                        .layerCount = 1,
+			                },
+			        });
+		}
+
+		for (auto & frame: frames)
+		{
+			frame.density_buffer = buffer_allocation(
+			        device,
+			        vk::BufferCreateInfo{
+			                .size = view_count * density_extent.width * density_extent.height * 2,
+			                .usage = vk::BufferUsageFlagBits::eTransferSrc,
+			                .sharingMode = vk::SharingMode::eExclusive,
+			        },
+			        alloc_info);
+			frame.density_values = reinterpret_cast<uint8_t *>(frame.density_buffer.map());
+		}
+		density_foveation.resize(view_count);
+
+		spdlog::info("Using a {}x{} fragment density map", density_extent.width, density_extent.height);
+	}
 
-	// Create VkDescriptorSetLayout
-	std::array layout_binding{
+	// Create VkDescriptorSetLayout, the decoder images are in set 1
+	std::array layout_bindings{
 	        vk::DescriptorSetLayoutBinding{
 	                .binding = 0,
-	                .descriptorType = vk::DescriptorType::eCombinedImageSampler,
+	                .descriptorType = vk::DescriptorType::eUniformBuffer,
 	                .descriptorCount = 1,
-	                .stageFlags = vk::ShaderStageFlagBits::eFragment,
+	                .stageFlags = vk::ShaderStageFlagBits::eVertex,
 	        },
 	        vk::DescriptorSetLayoutBinding{
 	                .binding = 1,
-	                .descriptorType = vk::DescriptorType::eUniformBuffer,
+	                .descriptorType = vk::DescriptorType::eStorageBuffer,
 	                .descriptorCount = 1,
-	                .stageFlags = vk::ShaderStageFlagBits::eVertex | vk::ShaderStageFlagBits::eFragment,
+	                .stageFlags = vk::ShaderStageFlagBits::eVertex,
+	        },
+	        vk::DescriptorSetLayoutBinding{
+	                .binding = 2,
+	                .descriptorType = vk::DescriptorType::eStorageBuffer,
+	                .descriptorCount = 1,
+	                .stageFlags = vk::ShaderStageFlagBits::eVertex,
 	        },
 	};
 
 	vk::DescriptorSetLayoutCreateInfo layout_info;
-	layout_info.setBindings(layout_binding);
+	layout_info.setBindings(layout_bindings);
 
 	descriptor_set_layout = vk::raii::DescriptorSetLayout(device, layout_info);
 
 	std::array pool_size{
 	        vk::DescriptorPoolSize{
-	                .type = vk::DescriptorType::eCombinedImageSampler,
-	                .descriptorCount = (uint32_t)input_images.size(),
+	                .type = vk::DescriptorType::eUniformBuffer,
+	                .descriptorCount = uint32_t(view_count * frames.size()),
 	        },
 	        vk::DescriptorPoolSize{
-	                .type = vk::DescriptorType::eUniformBuffer,
-	                .descriptorCount = (uint32_t)input_images.size(),
+	                .type = vk::DescriptorType::eStorageBuffer,
+	                .descriptorCount = uint32_t(2 * view_count * frames.size()),
 	        },
 	};
 
 	vk::DescriptorPoolCreateInfo pool_info;
 	pool_info.flags = vk::DescriptorPoolCreateFlags{};
-	pool_info.maxSets = input_images.size();
+	pool_info.maxSets = view_count * frames.size();
 	pool_info.setPoolSizes(pool_size);
 
 	descriptor_pool = vk::raii::DescriptorPool(device, pool_info);
 
-	// Create image views and descriptor sets
-	input_image_views.reserve(input_images.size());
-	descriptor_sets.reserve(input_images.size());
-	VkDeviceSize offset = 0;
-	for (vk::Image image: input_images)
+	// Create descriptor sets
+	for (auto & frame: frames)
+	{
+		frame.descriptor_sets.reserve(view_count);
+		VkDeviceSize offset = 0;
+		for (size_t i = 0; i < view_count; i++)
+		{
+			vk::DescriptorSetAllocateInfo ds_info{
+			        .descriptorPool = *descriptor_pool,
+			        .descriptorSetCount = 1,
+			        .pSetLayouts = &*descriptor_set_layout,
+			};
+
+			frame.descriptor_sets.push_back(device.allocateDescriptorSets(ds_info)[0].release());
+
+			vk::DescriptorBufferInfo buffer_info{
+			        .buffer = frame.buffer,
+			        .offset = offset,
+			        .range = sizeof(uniform),
+			};
+			offset += uniform_size;
+
+			vk::DescriptorBufferInfo motion_info{
+			        .buffer = frame.motion_buffer,
+			        .range = vk::WholeSize,
+			};
+
+			vk::DescriptorBufferInfo depth_info{
+			        .buffer = frame.depth_buffer,
+			        .range = vk::WholeSize,
+			};
+
+			std::array writes{
+			        vk::WriteDescriptorSet{
+			                .dstSet = frame.descriptor_sets.back(),
+			                .dstBinding = 0,
+			                .dstArrayElement = 0,
+			                .descriptorCount = 1,
+			                .descriptorType = vk::DescriptorType::eUniformBuffer,
+			                .pBufferInfo = &buffer_info,
+			        },
+			        vk::WriteDescriptorSet{
+			                .dstSet = frame.descriptor_sets.back(),
+			                .dstBinding = 1,
+			                .dstArrayElement = 0,
+			                .descriptorCount = 1,
+			                .descriptorType = vk::DescriptorType::eStorageBuffer,
+			                .pBufferInfo = &motion_info,
+			        },
+			        vk::WriteDescriptorSet{
+			                .dstSet = frame.descriptor_sets.back(),
+			                .dstBinding = 2,
+			                .dstArrayElement = 0,
+			                .descriptorCount = 1,
+			                .descriptorType = vk::DescriptorType::eStorageBuffer,
+			                .pBufferInfo = &depth_info,
+			        },
+			};
+
+			device.updateDescriptorSets(writes, {});
+		}
+	}
+
+	// Create renderpass, parts of the view without a decoder are black and infinitely far
+	vk::AttachmentReference color_ref{
+	        .attachment = 0,
+	        .layout = vk::ImageLayout::eColorAttachmentOptimal,
+	};
+
+	vk::AttachmentReference depth_ref{
+	        .attachment = 1,
+	        .layout = vk::ImageLayout::eDepthStencilAttachmentOptimal,
+	};
+
+	std::vector<vk::AttachmentDescription> attachments{
+	        vk::AttachmentDescription{
+	                .format = format,
+	                .samples = vk::SampleCountFlagBits::e1,
+	                .loadOp = vk::AttachmentLoadOp::eClear,
+	                .storeOp = vk::AttachmentStoreOp::eStore,
+	                .initialLayout = vk::ImageLayout::eColorAttachmentOptimal,
+	                .finalLayout = vk::ImageLayout::eColorAttachmentOptimal,
+	        },
+	};
+
+	if (not depth_images.empty())
+	{
+		attachments.push_back(vk::AttachmentDescription{
+		        .format = depth_format,
+		        .samples = vk::SampleCountFlagBits::e1,
+		        .loadOp = vk::AttachmentLoadOp::eClear,
+		        .storeOp = vk::AttachmentStoreOp::eStore,
+		        .stencilLoadOp = vk::AttachmentLoadOp::eDontCare,
+		        .stencilStoreOp = vk::AttachmentStoreOp::eDontCare,
+		        .initialLayout = vk::ImageLayout::eDepthStencilAttachmentOptimal,
+		        .finalLayout = vk::ImageLayout::eDepthStencilAttachmentOptimal,
+		});
+	}
+
+	vk::RenderPassFragmentDensityMapCreateInfoEXT density_map_info{
+	        .fragmentDensityMapAttachment = {
+	                .attachment = (uint32_t)attachments.size(),
+	                .layout = vk::ImageLayout::eFragmentDensityMapOptimalEXT,
+	        },
+	};
+
+	if (not density_maps.empty())
+	{
+		attachments.push_back(vk::AttachmentDescription{
+		        .format = vk::Format::eR8G8Unorm,
+		        .samples = vk::SampleCountFlagBits::e1,
+		        .loadOp = vk::AttachmentLoadOp::eDontCare,
+		        .storeOp = vk::AttachmentStoreOp::eDontCare,
+		        .stencilLoadOp = vk::AttachmentLoadOp::eDontCare,
+		        .stencilStoreOp = vk::AttachmentStoreOp::eDontCare,
+		        .initialLayout = vk::ImageLayout::eFragmentDensityMapOptimalEXT,
+		        .finalLayout = vk::ImageLayout::eFragmentDensityMapOptimalEXT,
+		});
+	}
+
+	vk::SubpassDescription subpass{
+	        .pipelineBindPoint = vk::PipelineBindPoint::eGraphics,
+	};
+	subpass.setColorAttachments(color_ref);
+	if (not depth_images.empty())
+		subpass.setPDepthStencilAttachment(&depth_ref);
+
+	vk::RenderPassCreateInfo renderpass_info;
+	renderpass_info.setAttachments(attachments);
+	renderpass_info.setSubpasses(subpass);
+	if (not density_maps.empty())
+		renderpass_info.pNext = &density_map_info;
+
+	renderpass = vk::raii::RenderPass(device, renderpass_info);
+
+	// Pipelines are created for each decoder
+	vertex_shader = load_shader(device, "reprojection.vert");
+	fragment_shader = load_shader(device, "reprojection.frag");
+
+	for (vk::Image image: depth_images)
+	{
+		depth_image_views.emplace_back(
+		        device,
+		        vk::ImageViewCreateInfo{
+		                .image = image,
+		                .viewType = vk::ImageViewType::e2D,
+		                .format = depth_format,
+		                .subresourceRange = {
+		                        .aspectMask = vk::ImageAspectFlagBits::eDepth,
+		                        .baseMipLevel = 0,
+		                        .levelCount = 1,
+		                        .baseArrayLayer = 0,
+		                        .layerCount = 1,
+		                },
+		        });
+	}
+
+	// Create image views and framebuffers
+	const size_t images_per_view = output_images.size() / view_count;
+	const size_t depth_images_per_view = depth_images.size() / view_count;
+	output_image_views.reserve(output_images.size());
+	framebuffers.reserve(output_images.size() * std::max<size_t>(depth_images_per_view, 1));
+	for (vk::Image image: output_images)
 	{
 		vk::ImageViewCreateInfo iv_info{
 		        .image = image,
 		        .viewType = vk::ImageViewType::e2D,
-		        .format = vk::Format::eA8B8G8R8SrgbPack32,
+		        .format = format,
 		        .components = {
 		                .r = vk::ComponentSwizzle::eIdentity,
 		                .g = vk::ComponentSwizzle::eIdentity,
@@ -159,91 +447,54 @@ stream_reprojection::stream_reprojection(
 		        },
 		};
 
-		input_image_views.emplace_back(device, iv_info);
-
-		vk::DescriptorSetAllocateInfo ds_info{
-		        .descriptorPool = *descriptor_pool,
-		        .descriptorSetCount = 1,
-		        .pSetLayouts = &*descriptor_set_layout,
-		};
-
-		descriptor_sets.push_back(device.allocateDescriptorSets(ds_info)[0].release());
-
-		vk::DescriptorImageInfo image_info{
-		        .sampler = *sampler,
-		        .imageView = *input_image_views.back(),
-		        .imageLayout = vk::ImageLayout::eShaderReadOnlyOptimal,
-		};
+		output_image_views.emplace_back(device, iv_info);
 
-		vk::DescriptorBufferInfo buffer_info{
-		        .buffer = buffer,
-		        .offset = offset,
-		        .range = sizeof(uniform),
-		};
-		offset += uniform_size;
-
-		std::array write{
-		        vk::WriteDescriptorSet{
-		                .dstSet = descriptor_sets.back(),
-		                .dstBinding = 0,
-		                .dstArrayElement = 0,
-		                .descriptorCount = 1,
-		                .descriptorType = vk::DescriptorType::eCombinedImageSampler,
-		                .pImageInfo = &image_info,
-		        },
-		        vk::WriteDescriptorSet{
-		                .dstSet = descriptor_sets.back(),
-		                .dstBinding = 1,
-		                .dstArrayElement = 0,
-		                .descriptorCount = 1,
-		                .descriptorType = vk::DescriptorType::eUniformBuffer,
-		                .pBufferInfo = &buffer_info,
-		        },
+		vk::FramebufferCreateInfo fb_create_info{
+		        .renderPass = *renderpass,
+		        .width = extent.width,
+		        .height = extent.height,
+		        .layers = 1,
 		};
 
-		device.updateDescriptorSets(write, {});
+		size_t view = (output_image_views.size() - 1) / images_per_view;
+		for (size_t i = 0; i < std::max<size_t>(depth_images_per_view, 1); ++i)
+		{
+			std::vector<vk::ImageView> views{*output_image_views.back()};
+			if (not depth_images.empty())
+				views.push_back(*depth_image_views[view * depth_images_per_view + i]);
+			if (not density_map_views.empty())
+				views.push_back(*density_map_views[view]);
+			fb_create_info.setAttachments(views);
+			framebuffers.emplace_back(device, fb_create_info);
+		}
 	}
+}
 
-	// Create renderpass
-	vk::AttachmentReference color_ref{
-	        .attachment = 0,
-	        .layout = vk::ImageLayout::eColorAttachmentOptimal,
-	};
-
-	vk::AttachmentDescription attachment{
-	        .format = format,
-	        .samples = vk::SampleCountFlagBits::e1,
-	        .loadOp = vk::AttachmentLoadOp::eDontCare,
-	        .storeOp = vk::AttachmentStoreOp::eStore,
-	        .initialLayout = vk::ImageLayout::eColorAttachmentOptimal,
-	        .finalLayout = vk::ImageLayout::eColorAttachmentOptimal,
-	};
+vk::raii::PipelineLayout stream_reprojection::create_pipeline_layout(vk::DescriptorSetLayout image_layout)
+{
+	std::array set_layouts{*descriptor_set_layout, image_layout};
 
-	vk::SubpassDescription subpass{
-	        .pipelineBindPoint = vk::PipelineBindPoint::eGraphics,
+	vk::PushConstantRange push_constant{
+	        .stageFlags = vk::ShaderStageFlagBits::eVertex,
+	        .offset = 0,
+	        .size = sizeof(region),
 	};
-	subpass.setColorAttachments(color_ref);
-
-	vk::RenderPassCreateInfo renderpass_info;
-	renderpass_info.setAttachments(attachment);
-	renderpass_info.setSubpasses(subpass);
-
-	renderpass = vk::raii::RenderPass(device, renderpass_info);
-
-	// Create graphics pipeline
-	vk::raii::ShaderModule vertex_shader = load_shader(device, "reprojection.vert");
-	vk::raii::ShaderModule fragment_shader = load_shader(device, "reprojection.frag");
 
 	vk::PipelineLayoutCreateInfo pipeline_layout_info;
-	pipeline_layout_info.setSetLayouts(*descriptor_set_layout);
+	pipeline_layout_info.setSetLayouts(set_layouts);
+	pipeline_layout_info.setPushConstantRanges(push_constant);
 
-	layout = vk::raii::PipelineLayout(device, pipeline_layout_info);
+	return vk::raii::PipelineLayout(device, pipeline_layout_info);
+}
 
+vk::raii::Pipeline stream_reprojection::create_pipeline(const vk::raii::PipelineLayout & layout)
+{
 	int specialization_constants[] = {
 	        foveation_parameters[0].x.scale < 1,
 	        foveation_parameters[0].y.scale < 1,
 	        nb_reprojection_vertices,
 	        nb_reprojection_vertices,
+	        video_stream_depth::grid_size,
 	};
 
 	std::array specialization_constants_desc{
@@ -267,6 +518,11 @@ stream_reprojection::stream_reprojection(
 	                .offset = 3 * sizeof(int),
 	                .size = sizeof(int),
 	        },
+	        vk::SpecializationMapEntry{
+	                .constantID = 4,
+	                .offset = 4 * sizeof(int),
+	                .size = sizeof(int),
+	        },
 	};
 
 	vk::SpecializationInfo specialization_info;
@@ -320,6 +576,12 @@ stream_reprojection::stream_reprojection(
 	        .MultisampleState = {{
 	                .rasterizationSamples = vk::SampleCountFlagBits::e1,
 	        }},
+	        // Depth is written as computed by the vertex shader, the test is needed for writes
+	        .DepthStencilState = depth_images.empty() ? std::nullopt : std::optional(vk::PipelineDepthStencilStateCreateInfo{
+	                                                                           .depthTestEnable = true,
+	                                                                           .depthWriteEnable = true,
+	                                                                           .depthCompareOp = vk::CompareOp::eAlways,
+	                                                                   }),
 	        .ColorBlendState = {.flags = {}},
 	        .ColorBlendAttachments = {{
 	                .colorWriteMask = vk::ColorComponentFlagBits::eR | vk::ColorComponentFlagBits::eG | vk::ColorComponentFlagBits::eB | vk::ColorComponentFlagBits::eA,
@@ -329,79 +591,204 @@ stream_reprojection::stream_reprojection(
 	        .subpass = 0,
 	};
 
-	pipeline = vk::raii::Pipeline(device, application::get_pipeline_cache(), pipeline_info);
+	return vk::raii::Pipeline(device, pipeline_cache, pipeline_info);
+}
 
-	// Create image views and framebuffers
-	output_image_views.reserve(output_images.size());
-	framebuffers.reserve(output_images.size());
-	for (vk::Image image: output_images)
+void stream_reprojection::set_frame(size_t index)
+{
+	assert(index < frames.size());
+	current_frame = index;
+}
+
+void stream_reprojection::set_foveation(const std::array<xrt::drivers::wivrn::to_headset::video_stream_description::foveation_parameter, 2> & foveation)
+{
+	for (size_t i = 0; i < foveation_parameters.size(); ++i)
 	{
-		vk::ImageViewCreateInfo iv_info{
-		        .image = image,
-		        .viewType = vk::ImageViewType::e2D,
-		        .format = format,
-		        .components = {
-		                .r = vk::ComponentSwizzle::eIdentity,
-		                .g = vk::ComponentSwizzle::eIdentity,
-		                .b = vk::ComponentSwizzle::eIdentity,
-		                .a = vk::ComponentSwizzle::eIdentity,
-		        },
-		        .subresourceRange = {
-		                .aspectMask = vk::ImageAspectFlagBits::eColor,
-		                .baseMipLevel = 0,
-		                .levelCount = 1,
-		                .baseArrayLayer = 0,
-		                .layerCount = 1,
-		        },
-		};
+		// Pipeline and swapchain sizes depend on the scale
+		if (foveation_parameters[i].x.scale != foveation[i].x.scale or foveation_parameters[i].y.scale != foveation[i].y.scale)
+			continue;
+		foveation_parameters[i] = foveation[i];
+	}
+}
 
-		output_image_views.emplace_back(device, iv_info);
+void stream_reprojection::set_motion(const xrt::drivers::wivrn::to_headset::video_stream_motion * motion, float factor)
+{
+	if (not motion or motion->width != motion_width or motion->height != motion_height or motion->vectors.size() != 2u * motion_width * motion_height)
+	{
+		motion_factor = 0;
+		return;
+	}
 
-		vk::FramebufferCreateInfo fb_create_info{
-		        .renderPass = *renderpass,
-		        .width = extent.width,
-		        .height = extent.height,
-		        .layers = 1,
-		};
-		fb_create_info.setAttachments(*output_image_views.back());
+	// The last frame that used the buffer has completed
+	auto & frame = frames[current_frame];
+	if (frame.motion_frame != motion->frame_idx)
+	{
+		memcpy(frame.motion_vectors, motion->vectors.data(), motion->vectors.size());
+		frame.motion_frame = motion->frame_idx;
+	}
+	motion_factor = factor;
+}
 
-		framebuffers.emplace_back(device, fb_create_info);
+bool stream_reprojection::set_depth(int view, const video_stream_depth * depth)
+{
+	const size_t size = video_stream_depth::grid_size * video_stream_depth::grid_size;
+	// The last frame that used the buffer has completed
+	uint8_t * depth_values = frames[current_frame].depth_values;
+	if (not depth or depth->values.size() != size)
+	{
+		memset(depth_values + view * size, 0, size);
+		return false;
 	}
+	memcpy(depth_values + view * size, depth->values.data(), size);
+	return true;
+}
+
+void stream_reprojection::update_density_map(vk::raii::CommandBuffer & command_buffer, int view)
+{
+	auto & frame = frames[current_frame];
+	std::array foveation{frame.ubo[view]->lambda, frame.ubo[view]->xc};
+	if (density_foveation[view] == foveation)
+		return;
+	density_foveation[view] = foveation;
+
+	// Stream pixels per view pixel without foveation
+	const glm::vec2 ratio{
+	        float(stream_size.width) / view_count / extent.width,
+	        float(stream_size.height) / extent.height,
+	};
+	const glm::vec2 scale{foveation_parameters[view].x.scale, foveation_parameters[view].y.scale};
+
+	// Density of the stream in the range [u0, u1] of the view (from -1 to 1), the highest value is the
+	// closest to the centre: the derivative of the foveated position is ratio / (scale * (1 + ((u - xc) / lambda)²))
+	auto density = [&](int axis, float u0, float u1) -> uint8_t {
+		float d = ratio[axis];
+		if (scale[axis] < 1)
+		{
+			float t = (std::clamp(foveation[1][axis], u0, u1) - foveation[1][axis]) / foveation[0][axis];
+			d /= scale[axis] * (1 + t * t);
+		}
+		return std::clamp(d, 0.f, 1.f) * 255;
+	};
+
+	std::vector<uint8_t> columns(density_extent.width);
+	for (uint32_t x = 0; x < density_extent.width; ++x)
+		columns[x] = density(0, 2.f * x * density_texel_size.width / extent.width - 1, 2.f * (x + 1) * density_texel_size.width / extent.width - 1);
+
+	// The last frame that used the buffer has completed
+	const size_t offset = view * density_extent.width * density_extent.height * 2;
+	uint8_t * values = frame.density_values + offset;
+	for (uint32_t y = 0; y < density_extent.height; ++y)
+	{
+		uint8_t row = density(1, 2.f * y * density_texel_size.height / extent.height - 1, 2.f * (y + 1) * density_texel_size.height / extent.height - 1);
+		for (uint32_t x = 0; x < density_extent.width; ++x)
+		{
+			*values++ = columns[x];
+			*values++ = row;
+		}
+	}
+
+	vk::ImageSubresourceRange range{
+	        .aspectMask = vk::ImageAspectFlagBits::eColor,
+	        .levelCount = 1,
+	        .layerCount = 1,
+	};
+
+	command_buffer.pipelineBarrier(
+	        vk::PipelineStageFlagBits::eFragmentDensityProcessEXT,
+	        vk::PipelineStageFlagBits::eTransfer,
+	        {},
+	        {},
+	        {},
+	        vk::ImageMemoryBarrier{
+	                .srcAccessMask = {},
+	                .dstAccessMask = vk::AccessFlagBits::eTransferWrite,
+	                .oldLayout = vk::ImageLayout::eUndefined,
+	                .newLayout = vk::ImageLayout::eTransferDstOptimal,
+	                .image = density_maps[view],
+	                .subresourceRange = range,
+	        });
+
+	command_buffer.copyBufferToImage(
+	        frame.density_buffer,
+	        density_maps[view],
+	        vk::ImageLayout::eTransferDstOptimal,
+	        vk::BufferImageCopy{
+	                .bufferOffset = offset,
+	                .imageSubresource = {
+	                        .aspectMask = vk::ImageAspectFlagBits::eColor,
+	                        .layerCount = 1,
+	                },
+	                .imageExtent = {density_extent.width, density_extent.height, 1},
+	        });
+
+	command_buffer.pipelineBarrier(
+	        vk::PipelineStageFlagBits::eTransfer,
+	        vk::PipelineStageFlagBits::eFragmentDensityProcessEXT,
+	        {},
+	        {},
+	        {},
+	        vk::ImageMemoryBarrier{
+	                .srcAccessMask = vk::AccessFlagBits::eTransferWrite,
+	                .dstAccessMask = vk::AccessFlagBits::eFragmentDensityMapReadEXT,
+	                .oldLayout = vk::ImageLayout::eTransferDstOptimal,
+	                .newLayout = vk::ImageLayout::eFragmentDensityMapOptimalEXT,
+	                .image = density_maps[view],
+	                .subresourceRange = range,
+	        });
 }
 
-void stream_reprojection::reproject(vk::raii::CommandBuffer & command_buffer, int source, int destination)
+void stream_reprojection::reproject(vk::raii::CommandBuffer & command_buffer, std::span<const source> sources, int view, int destination, int depth_destination)
 {
-	if (source < 0 || source >= (int)input_images.size())
-		throw std::runtime_error("Invalid source image index");
+	if (view < 0 || view >= (int)view_count)
+		throw std::runtime_error("Invalid view index");
 	if (destination < 0 || destination >= (int)output_images.size())
 		throw std::runtime_error("Invalid destination image index");
 
-	if (foveation_parameters[source].x.scale < 1)
+	auto & ubo = frames[current_frame].ubo;
+
+	if (foveation_parameters[view].x.scale < 1)
 	{
-		ubo[source]->a.x = foveation_parameters[source].x.a;
-		ubo[source]->b.x = foveation_parameters[source].x.b;
-		ubo[source]->lambda.x = foveation_parameters[source].x.scale / foveation_parameters[source].x.a;
-		ubo[source]->xc.x = foveation_parameters[source].x.center;
+		ubo[view]->a.x = foveation_parameters[view].x.a;
+		ubo[view]->b.x = foveation_parameters[view].x.b;
+		ubo[view]->lambda.x = foveation_parameters[view].x.scale / foveation_parameters[view].x.a;
+		ubo[view]->xc.x = foveation_parameters[view].x.center;
 	}
 
-	if (foveation_parameters[source].y.scale < 1)
+	if (foveation_parameters[view].y.scale < 1)
 	{
-		ubo[source]->a.y = foveation_parameters[source].y.a;
-		ubo[source]->b.y = foveation_parameters[source].y.b;
-		ubo[source]->lambda.y = foveation_parameters[source].y.scale / foveation_parameters[source].y.a;
-		ubo[source]->xc.y = foveation_parameters[source].y.center;
+		ubo[view]->a.y = foveation_parameters[view].y.a;
+		ubo[view]->b.y = foveation_parameters[view].y.b;
+		ubo[view]->lambda.y = foveation_parameters[view].y.scale / foveation_parameters[view].y.a;
+		ubo[view]->xc.y = foveation_parameters[view].y.center;
 	}
 
-	vk::ClearValue clear(vk::ClearColorValue(0, 0, 0, 0));
+	const float view_width = float(stream_size.width) / view_count;
+	const float block_size = xrt::drivers::wivrn::to_headset::video_stream_motion::block_size;
+	ubo[view]->motion_scale = motion_factor * glm::vec2(0.5 / view_width, 0.5 / stream_size.height);
+	// Motion vectors are at the centre of the blocks
+	ubo[view]->block_scale = glm::vec2(view_width, stream_size.height) / block_size;
+	ubo[view]->block_offset = glm::vec2(view * view_width / block_size - 0.5, -0.5);
+	ubo[view]->blocks = {motion_width, motion_height};
+	ubo[view]->depth_offset = view * video_stream_depth::grid_size * video_stream_depth::grid_size;
+
+	if (not density_maps.empty())
+		update_density_map(command_buffer, view);
+
+	std::array clear{
+	        vk::ClearValue{vk::ClearColorValue(0, 0, 0, 0)},
+	        vk::ClearValue{vk::ClearDepthStencilValue{1, 0}},
+	};
+	size_t depth_images_per_view = depth_images.size() / view_count;
+	size_t framebuffer = depth_images.empty() ? destination : destination * depth_images_per_view + depth_destination;
 	vk::RenderPassBeginInfo begin_info{
 	        .renderPass = *renderpass,
-	        .framebuffer = *framebuffers[destination],
+	        .framebuffer = *framebuffers[framebuffer],
 	        .renderArea = {
 	                .offset = {0, 0},
 	                .extent = extent,
 	        },
-	        .clearValueCount = 1,
-	        .pClearValues = &clear,
+	        .clearValueCount = depth_images.empty() ? 1u : 2u,
+	        .pClearValues = clear.data(),
 	};
 
 	command_buffer.pipelineBarrier(
@@ -423,9 +810,36 @@ void stream_reprojection::reproject(vk::raii::CommandBuffer & command_buffer, in
 	                },
 	        });
 
+	if (not depth_images.empty())
+	{
+		command_buffer.pipelineBarrier(
+		        vk::PipelineStageFlagBits::eTopOfPipe,
+		        vk::PipelineStageFlagBits::eEarlyFragmentTests,
+		        {},
+		        {},
+		        {},
+		        vk::ImageMemoryBarrier{
+		                .srcAccessMask = {},
+		                .dstAccessMask = vk::AccessFlagBits::eDepthStencilAttachmentWrite,
+		                .oldLayout = vk::ImageLayout::eUndefined,
+		                .newLayout = vk::ImageLayout::eDepthStencilAttachmentOptimal,
+		                .image = depth_images[view * depth_images_per_view + depth_destination],
+		                .subresourceRange = {
+		                        .aspectMask = vk::ImageAspectFlagBits::eDepth,
+		                        .levelCount = 1,
+		                        .layerCount = 1,
+		                },
+		        });
+	}
+
 	command_buffer.beginRenderPass(begin_info, vk::SubpassContents::eInline);
-	command_buffer.bindPipeline(vk::PipelineBindPoint::eGraphics, *pipeline);
-	command_buffer.bindDescriptorSets(vk::PipelineBindPoint::eGraphics, *layout, 0, descriptor_sets[source], {});
-	command_buffer.draw(6 * nb_reprojection_vertices * nb_reprojection_vertices, 1, 0, 0);
+	command_buffer.bindIndexBuffer(index_buffer, 0, vk::IndexType::eUint16);
+	for (const source & i: sources)
+	{
+		command_buffer.bindPipeline(vk::PipelineBindPoint::eGraphics, i.pipeline);
+		command_buffer.bindDescriptorSets(vk::PipelineBindPoint::eGraphics, i.layout, 0, {frames[current_frame].descriptor_sets[view], i.descriptor_set}, {});
+		command_buffer.pushConstants<region>(i.layout, vk::ShaderStageFlagBits::eVertex, 0, i.area);
+		command_buffer.drawIndexed(6 * nb_reprojection_vertices * nb_reprojection_vertices, 1, 0, 0, 0);
+	}
 	command_buffer.endRenderPass();
 }
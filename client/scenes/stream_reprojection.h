@@ -21,6 +21,10 @@
 
 #include "vk/allocation.h"
 #include "wivrn_packets.h"
+#include <glm/glm.hpp>
+#include <optional>
+#include <span>
+#include <vector>
 #include <vulkan/vulkan_raii.hpp>
 #include <openxr/openxr.h>
 
@@ -28,46 +32,144 @@ class stream_reprojection
 {
 	struct uniform;
 
-	// Uniform buffer
-	buffer_allocation buffer;
-	std::vector<uniform *> ubo;
+	vk::raii::Device & device;
+	vk::raii::PipelineCache & pipeline_cache;
+	size_t view_count;
+
+	// Buffers written by the CPU, one set per frame in flight
+	struct frame_data
+	{
+		// Uniform buffer, one per view
+		buffer_allocation buffer;
+		std::vector<uniform *> ubo;
+
+		// Motion field of the displayed frame, shared by all views
+		buffer_allocation motion_buffer;
+		int8_t * motion_vectors;
+		std::optional<uint64_t> motion_frame;
+
+		// Distance grid of each view, see to_headset::video_stream_depth
+		buffer_allocation depth_buffer;
+		uint8_t * depth_values;
+
+		// Staging buffer of the density maps, 2 bytes per texel
+		buffer_allocation density_buffer;
+		uint8_t * density_values;
+
+		// One per view
+		std::vector<vk::DescriptorSet> descriptor_sets;
+	};
+	std::vector<frame_data> frames;
+	// Frame recorded by the next calls
+	size_t current_frame = 0;
+
+	// Triangles of the reprojection grid, each vertex is shared by the neighbouring cells
+	buffer_allocation index_buffer;
+
+	// Size in blocks of the motion field
+	uint16_t motion_width;
+	uint16_t motion_height;
+	// Fraction of the motion applied to the next frames
+	float motion_factor = 0;
+	// Size of the stream in pixels
+	vk::Extent2D stream_size;
+
+	// Fragment density of each view derived from the foveation, empty without VK_EXT_fragment_density_map
+	std::vector<image_allocation> density_maps;
+	std::vector<vk::raii::ImageView> density_map_views;
+	vk::Extent2D density_extent;
+	vk::Extent2D density_texel_size;
+	// Foveation used for the density map of each view (lambda and xc)
+	std::vector<std::optional<std::array<glm::vec2, 2>>> density_foveation;
 
-	// Graphic pipeline
 	vk::raii::DescriptorSetLayout descriptor_set_layout = nullptr;
 	vk::raii::DescriptorPool descriptor_pool = nullptr;
-	vk::raii::PipelineLayout layout = nullptr;
-	vk::raii::RenderPass renderpass = nullptr;
-	vk::raii::Pipeline pipeline = nullptr;
-
-	// Source images
-	vk::raii::Sampler sampler = nullptr;
-	std::vector<vk::Image> input_images;
-	std::vector<vk::raii::ImageView> input_image_views;
 	std::vector<vk::DescriptorSet> descriptor_sets;
+	vk::raii::RenderPass renderpass = nullptr;
+	vk::raii::ShaderModule vertex_shader = nullptr;
+	vk::raii::ShaderModule fragment_shader = nullptr;
 
 	// Destination images
 	std::vector<vk::Image> output_images;
 	std::vector<vk::raii::ImageView> output_image_views;
+	// Optional depth images, rendered with the color images of the same view
+	std::vector<vk::Image> depth_images;
+	std::vector<vk::raii::ImageView> depth_image_views;
+	// One per color image if there is no depth, one per pair of color and depth images of a view otherwise
 	std::vector<vk::raii::Framebuffer> framebuffers;
 	vk::Extent2D extent;
 
 	// Foveation
 	std::array<xrt::drivers::wivrn::to_headset::video_stream_description::foveation_parameter, 2> foveation_parameters;
 
+	void update_density_map(vk::raii::CommandBuffer & command_buffer, int view);
+
 public:
+	// Rectangle of a view covered by a decoder
+	struct region
+	{
+		// Corners in the foveated view, from 0 to 1
+		glm::vec2 min;
+		glm::vec2 max;
+		// Transformation from the foveated view coordinates to the decoder image coordinates
+		glm::vec2 uv_scale;
+		glm::vec2 uv_offset;
+		// Homography of the view coordinates from the pose of the decoder image to the pose of the layer,
+		// columns padded to vec4 like a GLSL mat3
+		glm::mat3x4 correction = glm::mat3x4(1);
+	};
+
+	// Decoder image sampled directly by the reprojection, with its own pipeline
+	// because of the immutable (YCbCr) sampler
+	struct source
+	{
+		vk::PipelineLayout layout;
+		vk::Pipeline pipeline;
+		// Set 1, with the decoder image in binding 0
+		vk::DescriptorSet descriptor_set;
+		region area;
+	};
+
 	stream_reprojection(
 	        vk::raii::Device & device,
 	        vk::raii::PhysicalDevice & physical_device,
-	        std::vector<vk::Image> input_images,
+	        size_t view_count,
+	        size_t frames_in_flight,
 	        std::vector<vk::Image> output_images,
+	        std::vector<vk::Image> depth_images,
 	        vk::Extent2D extent,
 	        vk::Format format,
-	        const xrt::drivers::wivrn::to_headset::video_stream_description & description);
+	        vk::Format depth_format,
+	        const xrt::drivers::wivrn::to_headset::video_stream_description & description,
+	        vk::raii::PipelineCache & pipeline_cache,
+	        // VK_EXT_fragment_density_map is enabled on the device
+	        bool fragment_density_map);
 
 	stream_reprojection(const stream_reprojection &) = delete;
 
+	// Pipelines for a decoder whose images are in binding 0 of image_layout
+	vk::raii::PipelineLayout create_pipeline_layout(vk::DescriptorSetLayout image_layout);
+	vk::raii::Pipeline create_pipeline(const vk::raii::PipelineLayout & layout);
+
+	// Selects the buffers of the next frame, the commands of the last frame that used them must have completed
+	void set_frame(size_t index);
+
+	// Updates the foveation centre for the next frames, the scale must match the stream description
+	void set_foveation(const std::array<xrt::drivers::wivrn::to_headset::video_stream_description::foveation_parameter, 2> &);
+
+	// Moves the content of the next frames by factor times the motion field, nullptr for no motion
+	void set_motion(const xrt::drivers::wivrn::to_headset::video_stream_motion * motion, float factor);
+
+	// Distance of the next frames for a view, the values are cleared if depth is nullptr.
+	// Returns false if there is no depth for the view
+	bool set_depth(int view, const xrt::drivers::wivrn::to_headset::video_stream_depth * depth);
+
+	// Samples the decoder images, undistorts the foveation and writes the destination image in a single pass.
+	// The depth image is the index in the images of the view, ignored without depth images
 	void reproject(
 	        vk::raii::CommandBuffer & command_buffer,
-	        int source,
-	        int destination);
+	        std::span<const source> sources,
+	        int view,
+	        int destination,
+	        int depth_destination = 0);
 };
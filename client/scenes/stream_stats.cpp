@@ -87,6 +87,11 @@ void scenes::stream::accumulate_metrics(XrTime predicted_display_time, const std
 	bandwidth_rx = 0.8 * bandwidth_rx + 0.2 * float(rx - bytes_received) / dt;
 	bandwidth_tx = 0.8 * bandwidth_tx + 0.2 * float(tx - bytes_sent) / dt;
 
+	auto stats = network_session->stream_statistics();
+	packet_loss = 0.8 * packet_loss + 0.2 * std::max<int64_t>(0, stats.lost - metrics_stream_stats.lost) / dt;
+	packet_reordering = 0.8 * packet_reordering + 0.2 * float(stats.reordered - metrics_stream_stats.reordered) / dt;
+	metrics_stream_stats = stats;
+
 	last_metric_time = predicted_display_time;
 	bytes_received = rx;
 	bytes_sent = tx;
@@ -95,6 +100,9 @@ void scenes::stream::accumulate_metrics(XrTime predicted_display_time, const std
 	global_metrics[metrics_offset].cpu_time = application::get_cpu_time().count() * 1e-9f;
 	global_metrics[metrics_offset].bandwidth_rx = bandwidth_rx * 8;
 	global_metrics[metrics_offset].bandwidth_tx = bandwidth_tx * 8;
+	global_metrics[metrics_offset].packet_loss = packet_loss;
+	global_metrics[metrics_offset].packet_reordering = packet_reordering;
+	global_metrics[metrics_offset].jitter = stats.jitter * 1e-6f;
 
 	if (decoder_metrics.size() != blit_handles.size())
 		decoder_metrics.resize(blit_handles.size());
@@ -108,6 +116,7 @@ void scenes::stream::accumulate_metrics(XrTime predicted_display_time, const std
 		if (metrics.size() != global_metrics.size())
 			metrics.resize(global_metrics.size());
 
+		const auto tracking_timestamp = bh->view_info.tracking_timestamp;
 		metrics[metrics_offset] = decoder_metric{
 		        // clang-format off
 			.send_begin            = (bh->timing_info.send_begin         - min_encode_begin) * 1e-9f,
@@ -118,6 +127,9 @@ void scenes::stream::accumulate_metrics(XrTime predicted_display_time, const std
 			.received_from_decoder = (bh->feedback.received_from_decoder - min_encode_begin) * 1e-9f,
 			.blitted               = (bh->feedback.blitted               - min_encode_begin) * 1e-9f,
 			.displayed             = (bh->feedback.displayed             - min_encode_begin) * 1e-9f,
+			.tracking              = tracking_timestamp ? (tracking_timestamp - min_encode_begin) * 1e-9f : std::numeric_limits<float>::quiet_NaN(),
+			.bytes                 = float(bh->timing_info.bytes),
+			.average_qp            = bh->timing_info.average_qp,
 		        // clang-format on
 		};
 	}
@@ -140,11 +152,20 @@ XrCompositionLayerQuad scenes::stream::plot_performance_metrics(XrTime predicted
 	        // clang-format off
 	        plot(_("CPU time"), {{"",          &global_metric::cpu_time}},     "s"),
 
-	        plot(_("GPU time"), {{_("Reproject"), &global_metric::gpu_time},
-		                     {_("Blit"),      &global_metric::gpu_barrier}},  "s"),
+	        plot(_("GPU time"), {{_("Total"),       &global_metric::gpu_time},
+	                             {_("Quad layers"), &global_metric::gpu_quad_layers},
+	                             {_("Blit"),        &global_metric::gpu_barrier},
+	                             {_("Left eye"),    &global_metric::gpu_reproject_left},
+	                             {_("Right eye"),   &global_metric::gpu_reproject_right},
+	                             {_("Overlay"),     &global_metric::gpu_overlay}}, "s"),
 
 	        plot(("Network"),  {{_("Download"),  &global_metric::bandwidth_rx},
 	                            {_("Upload"),    &global_metric::bandwidth_tx}}, "bit/s"),
+
+	        plot(_("Packet loss"), {{_("Lost"),      &global_metric::packet_loss},
+	                                {_("Reordered"), &global_metric::packet_reordering}}, "packet/s"),
+
+	        plot(_("Jitter"),   {{"",          &global_metric::jitter}},       "s"),
 	        // clang-format on
 	};
 
@@ -156,7 +177,7 @@ XrCompositionLayerQuad scenes::stream::plot_performance_metrics(XrTime predicted
 
 	ImVec2 plot_size = ImVec2(
 	        window_size.x / n_cols - style.ItemSpacing.x * (n_cols - 1) / n_cols,
-	        (window_size.y - ImGui::GetCurrentContext()->FontSize - style.ItemSpacing.y) / n_rows - style.ItemSpacing.y * (n_rows - 1) / n_rows);
+	        (window_size.y - 2 * (ImGui::GetCurrentContext()->FontSize + style.ItemSpacing.y)) / n_rows - style.ItemSpacing.y * (n_rows - 1) / n_rows);
 
 	ImPlot::PushStyleColor(ImPlotCol_PlotBg, IM_COL32(32, 32, 32, 64));
 	ImPlot::PushStyleColor(ImPlotCol_FrameBg, IM_COL32(0, 0, 0, 0));
@@ -225,7 +246,29 @@ XrCompositionLayerQuad scenes::stream::plot_performance_metrics(XrTime predicted
 			else
 				axis_scale[n] = 0.99 * axis_scale[n] + 0.01 * max_v;
 
+			// Average encoded size and QP over the plotted frames
+			float bytes = 0;
+			float qp = 0;
+			int count = 0;
+			int qp_count = 0;
+			for (const auto & metric: metrics)
+			{
+				if (metric.bytes == 0)
+					continue;
+				bytes += metric.bytes;
+				++count;
+				if (metric.average_qp >= 0)
+				{
+					qp += metric.average_qp;
+					++qp_count;
+				}
+			}
+
 			std::string title_with_units = _("Timings [ms]");
+			if (count)
+				title_with_units += fmt::format(", {:.0f} kB", bytes / count / 1000);
+			if (qp_count)
+				title_with_units += fmt::format(", QP {:.1f}", qp / qp_count);
 			ImPlot::SetupAxes(nullptr, title_with_units.c_str(), ImPlotAxisFlags_NoDecorations, 0);
 			ImPlot::SetupAxesLimits(0, metrics.size() - 1, min_v * 1e3f, axis_scale[n] * 1e3f, ImGuiCond_Always);
 
@@ -291,6 +334,43 @@ XrCompositionLayerQuad scenes::stream::plot_performance_metrics(XrTime predicted
 
 	ImPlot::PopStyleColor(5);
 	ImGui::Text("%s", fmt::format(_F("Estimated motion to photons latency: {}ms"), tracking_prediction_offset.load() / 1'000'000).c_str());
+	if (int periods = periods_per_frame; periods > 1)
+		ImGui::Text("%s", fmt::format(_F("Server renders one frame every {} display refreshes, the others are reprojected"), periods).c_str());
+
+	// Measured on the displayed frames, from the tracking sample used for rendering
+	for (auto && [index, metrics]: utils::enumerate(decoder_metrics))
+	{
+		float motion_to_photons = 0;
+		float tracking_to_encode = 0;
+		int count = 0;
+		for (const auto & metric: metrics)
+		{
+			if (metric.bytes == 0 or std::isnan(metric.tracking) or metric.displayed < metric.tracking)
+				continue;
+			motion_to_photons += metric.displayed - metric.tracking;
+			tracking_to_encode += -metric.tracking;
+			++count;
+		}
+		if (count)
+			ImGui::Text("%s", fmt::format(_F("Decoder {}: motion to photons {:.1f}ms, tracking to encode {:.1f}ms, encode to display {:.1f}ms"), index, motion_to_photons / count * 1e3f, tracking_to_encode / count * 1e3f, (motion_to_photons - tracking_to_encode) / count * 1e3f).c_str());
+	}
+	ImGui::Text("%s", fmt::format(_F("Audio latency: {:.0f}ms (target {:.0f}ms, buffer {:.0f}ms, jitter {:.1f}ms, drift {:.0f}ppm), {} underruns, {} overruns"), audio_stats.latency.load(), audio_stats.target.load(), audio_stats.buffer.load(), audio_stats.jitter.load(), audio_stats.drift.load(), audio_stats.underruns.load(), audio_stats.overruns.load()).c_str());
+	ImGui::Text("%s", fmt::format(_F("Audio output: {:.0f}ms ({:.0f}ms buffer, {} xruns), microphone: {:.0f}ms"), audio_stats.output_latency.load(), audio_stats.output_buffer.load(), audio_stats.xruns.load(), audio_stats.microphone_latency.load()).c_str());
+
+	{
+		auto memory = vk_allocator::instance().get_report();
+		VkDeviceSize usage = 0;
+		VkDeviceSize budget = 0;
+		VkDeviceSize pooled = 0;
+		for (const auto & heap: memory.heaps)
+		{
+			usage += heap.usage;
+			budget += heap.budget;
+		}
+		for (const auto & pool: memory.pools)
+			pooled += pool.block_bytes;
+		ImGui::Text("%s", fmt::format(_F("GPU memory: {}MB used out of {}MB, {}MB in pools, {} allocations over budget"), usage >> 20, budget >> 20, pooled >> 20, memory.over_budget_allocations).c_str());
+	}
 	ImGui::End();
 
 	return imgui_ctx->end_frame();
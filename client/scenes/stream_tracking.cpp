@@ -19,28 +19,24 @@
 
 #include "application.h"
 #include "stream.h"
+#include "utils/contains.h"
 #include "utils/ranges.h"
+#include "wivrn_quantization.h"
+#include <array>
+#include <span>
 #include <spdlog/spdlog.h>
 #include <thread>
 
-static from_headset::tracking::pose locate_space(device_id device, XrSpace space, XrSpace reference, XrTime time)
+// Positions are stored relative to origin, which is set when locating the head
+static from_headset::tracking::pose to_pose(device_id device, const XrSpaceLocation & location, const XrSpaceVelocity & velocity, XrVector3f & origin)
 {
-	XrSpaceVelocity velocity{
-	        .type = XR_TYPE_SPACE_VELOCITY,
-	};
-
-	XrSpaceLocation location{
-	        .type = XR_TYPE_SPACE_LOCATION,
-	        .next = &velocity,
-	};
-
-	xrLocateSpace(space, reference, time, &location);
+	if (device == device_id::HEAD)
+		origin = location.pose.position;
 
 	from_headset::tracking::pose res{
 	        .device = device,
-	        .pose = location.pose,
-	        .linear_velocity = velocity.linearVelocity,
-	        .angular_velocity = velocity.angularVelocity,
+	        .orientation = xrt::drivers::wivrn::pack(location.pose.orientation),
+	        .position = xrt::drivers::wivrn::pack(location.pose.position, origin),
 	        .flags = 0,
 	};
 
@@ -51,10 +47,16 @@ static from_headset::tracking::pose locate_space(device_id device, XrSpace space
 		res.flags |= from_headset::tracking::position_valid;
 
 	if (velocity.velocityFlags & XR_SPACE_VELOCITY_LINEAR_VALID_BIT)
+	{
 		res.flags |= from_headset::tracking::linear_velocity_valid;
+		res.linear_velocity = velocity.linearVelocity;
+	}
 
 	if (velocity.velocityFlags & XR_SPACE_VELOCITY_ANGULAR_VALID_BIT)
+	{
 		res.flags |= from_headset::tracking::angular_velocity_valid;
+		res.angular_velocity = velocity.angularVelocity;
+	}
 
 	if (location.locationFlags & XR_SPACE_LOCATION_ORIENTATION_TRACKED_BIT)
 		res.flags |= from_headset::tracking::orientation_tracked;
@@ -65,6 +67,22 @@ static from_headset::tracking::pose locate_space(device_id device, XrSpace space
 	return res;
 }
 
+static from_headset::tracking::pose locate_space(device_id device, XrSpace space, XrSpace reference, XrTime time, XrVector3f & origin)
+{
+	XrSpaceVelocity velocity{
+	        .type = XR_TYPE_SPACE_VELOCITY,
+	};
+
+	XrSpaceLocation location{
+	        .type = XR_TYPE_SPACE_LOCATION,
+	        .next = &velocity,
+	};
+
+	xrLocateSpace(space, reference, time, &location);
+
+	return to_pose(device, location, velocity, origin);
+}
+
 namespace
 {
 class timer
@@ -92,19 +110,21 @@ public:
 };
 } // namespace
 
-static std::optional<std::array<from_headset::hand_tracking::pose, XR_HAND_JOINT_COUNT_EXT>> locate_hands(xr::hand_tracker & hand, XrSpace space, XrTime time)
+// Joint positions are relative to the palm, which is stored in origin
+static std::optional<std::array<from_headset::hand_tracking::pose, XR_HAND_JOINT_COUNT_EXT>> locate_hands(xr::hand_tracker & hand, XrSpace space, XrTime time, XrVector3f & origin)
 {
 	auto joints = hand.locate(space, time);
 
 	if (joints)
 	{
+		origin = (*joints)[XR_HAND_JOINT_PALM_EXT].first.pose.position;
+
 		std::array<from_headset::hand_tracking::pose, XR_HAND_JOINT_COUNT_EXT> poses;
 		for (int i = 0; i < XR_HAND_JOINT_COUNT_EXT; i++)
 		{
 			poses[i] = {
-			        .pose = (*joints)[i].first.pose,
-			        .linear_velocity = (*joints)[i].second.linearVelocity,
-			        .angular_velocity = (*joints)[i].second.angularVelocity,
+			        .orientation = xrt::drivers::wivrn::pack((*joints)[i].first.pose.orientation),
+			        .position = xrt::drivers::wivrn::pack((*joints)[i].first.pose.position, origin),
 			        .radius = uint16_t((*joints)[i].first.radius * 10'000),
 			};
 
@@ -115,10 +135,16 @@ static std::optional<std::array<from_headset::hand_tracking::pose, XR_HAND_JOINT
 				poses[i].flags |= from_headset::hand_tracking::position_valid;
 
 			if ((*joints)[i].second.velocityFlags & XR_SPACE_VELOCITY_LINEAR_VALID_BIT)
+			{
 				poses[i].flags |= from_headset::hand_tracking::linear_velocity_valid;
+				poses[i].linear_velocity = (*joints)[i].second.linearVelocity;
+			}
 
 			if ((*joints)[i].second.velocityFlags & XR_SPACE_VELOCITY_ANGULAR_VALID_BIT)
+			{
 				poses[i].flags |= from_headset::hand_tracking::angular_velocity_valid;
+				poses[i].angular_velocity = (*joints)[i].second.angularVelocity;
+			}
 
 			if ((*joints)[i].first.locationFlags & XR_SPACE_LOCATION_ORIENTATION_TRACKED_BIT)
 				poses[i].flags |= from_headset::hand_tracking::orientation_tracked;
@@ -133,25 +159,84 @@ static std::optional<std::array<from_headset::hand_tracking::pose, XR_HAND_JOINT
 		return std::nullopt;
 }
 
+// Hands that moved less than this since the last sent sample are not sent again
+static const float hand_position_threshold = 0.001;      // m
+static const float hand_orientation_threshold = 0.99996; // cos(0.5°), a rotation of 1°
+// Unchanged hands are still sent at this period, the server drops samples older than 1s
+static const XrDuration hand_keep_alive = 100'000'000;
+
+static bool hand_moved(const from_headset::hand_tracking & before, const from_headset::hand_tracking & after)
+{
+	if (before.joints.has_value() != after.joints.has_value())
+		return true;
+	if (not after.joints)
+		return false;
+
+	for (auto [a, b]: utils::zip(*before.joints, *after.joints))
+	{
+		if (a.flags != b.flags)
+			return true;
+
+		XrVector3f pa = unpack(a.position, before.origin);
+		XrVector3f pb = unpack(b.position, after.origin);
+		float dx = pa.x - pb.x;
+		float dy = pa.y - pb.y;
+		float dz = pa.z - pb.z;
+		if (dx * dx + dy * dy + dz * dz > hand_position_threshold * hand_position_threshold)
+			return true;
+
+		XrQuaternionf qa = unpack(a.orientation);
+		XrQuaternionf qb = unpack(b.orientation);
+		if (std::abs(qa.x * qb.x + qa.y * qb.y + qa.z * qb.z + qa.w * qb.w) < hand_orientation_threshold)
+			return true;
+	}
+	return false;
+}
+
 void scenes::stream::tracking()
 {
 #ifdef __ANDROID__
 	// Runtime may use JNI and needs the thread to be attached
 	application::instance().setup_jni();
 #endif
+	// Head must be first, other positions are relative to it
 	std::vector<std::pair<device_id, XrSpace>> spaces = {
 	        {device_id::HEAD, application::view()},
 	        {device_id::LEFT_AIM, application::left_aim()},
 	        {device_id::LEFT_GRIP, application::left_grip()},
 	        {device_id::RIGHT_AIM, application::right_aim()},
 	        {device_id::RIGHT_GRIP, application::right_grip()}};
+	if (application::eye_gaze())
+		spaces.emplace_back(device_id::EYE_GAZE, application::eye_gaze());
+
+#ifdef XR_KHR_locate_spaces
+	// Locate all the spaces with a single call if possible
+	const bool locate_spaces = utils::contains(application::get_xr_extensions(), XR_KHR_LOCATE_SPACES_EXTENSION_NAME);
+	std::vector<XrSpace> space_handles;
+	for (auto [device, space]: spaces)
+		space_handles.push_back(space);
+#endif
 
 	XrSpace view_space = application::view();
 	XrDuration tracking_period = 1'000'000; // Send tracking data every 1ms
 	const XrDuration dt = 100'000;          // Wake up 0.1ms before measuring the position
+	// Period between the samples scheduled for the compositor wake ups
+	const XrDuration background_period = 4'000'000;
+	// Extrapolation target of a scheduled sample, 0 for the others
+	XrTime scheduled_display = 0;
+
+	// Hand tracking is sent at its own rate, and only if the hands moved
+	const float hand_tracking_rate = application::get_config().hand_tracking_rate;
+	const XrDuration hand_period = hand_tracking_rate > 0 ? XrDuration(1e9 / hand_tracking_rate) : 0;
+	XrTime next_hand_sample = 0;
+	// Last measured sample sent for each hand
+	std::array<std::optional<from_headset::hand_tracking>, 2> sent_hands;
+	// Hands sent in the current iteration, decided with the measured sample
+	std::array<bool, 2> send_hands{};
 
 	XrTime t0 = instance.now();
 	from_headset::tracking packet{};
+	utils::performance_hint hint("tracking thread", std::chrono::nanoseconds(tracking_period / 5));
 
 	while (not exiting)
 	{
@@ -166,60 +251,124 @@ void scenes::stream::tracking()
 
 			timer t(instance);
 
-			XrDuration prediction = std::min<XrDuration>(tracking_prediction_offset, 80'000'000);
-			// 1 or 2 samples
-			for (XrDuration Δt = 0; Δt <= prediction; Δt += std::max<XrDuration>(1, prediction))
+			XrDuration head_prediction = std::min<XrDuration>(scheduled_display ? std::max<XrDuration>(scheduled_display - t0, 0) : tracking_prediction_offset.load(), 80'000'000);
+			XrDuration hand_prediction = std::min<XrDuration>(scheduled_display ? head_prediction : hand_prediction_offset.load(), 80'000'000);
+
+			// The measured sample has all the devices, the predicted ones only those they are for:
+			// the server keeps a single predicted sample for each device
+			struct sample
+			{
+				XrDuration Δt;
+				bool head;
+				bool others;
+			};
+			std::array<sample, 3> samples{{{0, true, true}}};
+			size_t sample_count = 1;
+			if (head_prediction == hand_prediction)
+			{
+				if (head_prediction > 0)
+					samples[sample_count++] = {head_prediction, true, true};
+			}
+			else
 			{
-				from_headset::hand_tracking hands{};
+				if (head_prediction > 0)
+					samples[sample_count++] = {head_prediction, true, false};
+				if (hand_prediction > 0)
+					samples[sample_count++] = {hand_prediction, false, true};
+			}
 
-				packet.production_timestamp = t0;
-				hands.production_timestamp = t0;
+			const bool hands_due = application::get_hand_tracking_supported() and t0 >= next_hand_sample;
+			if (hands_due)
+				next_hand_sample = t0 + hand_period;
+			send_hands = {};
 
+			for (auto [Δt, head, others]: std::span(samples).first(sample_count))
+			{
+				packet.production_timestamp = t0;
 				packet.timestamp = t0 + Δt;
-				hands.timestamp = t0 + Δt;
 
 				try
 				{
-					auto [flags, views] = session.locate_views(XR_VIEW_CONFIGURATION_TYPE_PRIMARY_STEREO, t0 + Δt, view_space);
-					assert(views.size() == packet.views.size());
-
-					for (auto [i, j]: utils::zip(views, packet.views))
+					// The views are only used with the head pose
+					if (head)
 					{
-						j.pose = i.pose;
-						j.fov = i.fov;
-					}
+						auto [flags, views] = session.locate_views(XR_VIEW_CONFIGURATION_TYPE_PRIMARY_STEREO, t0 + Δt, view_space);
+						assert(views.size() == packet.views.size());
 
-					packet.flags = flags;
+						for (auto [i, j]: utils::zip(views, packet.views))
+						{
+							j.pose = i.pose;
+							j.fov = i.fov;
+						}
+
+						packet.flags = flags;
+					}
 
 					packet.device_poses.clear();
 					std::lock_guard lock(local_floor_mutex);
-					for (auto [device, space]: spaces)
+#ifdef XR_KHR_locate_spaces
+					if (locate_spaces)
 					{
-						packet.device_poses.push_back(locate_space(device, space, local_floor, t0 + Δt));
+						auto locations = session.locate_spaces(t0 + Δt, space_handles, local_floor);
+						for (size_t i = 0; i < spaces.size(); i++)
+						{
+							if (spaces[i].first == device_id::HEAD ? head : others)
+								packet.device_poses.push_back(to_pose(spaces[i].first, locations[i].first, locations[i].second, packet.origin));
+						}
+					}
+					else
+#endif
+					{
+						for (auto [device, space]: spaces)
+						{
+							if (device == device_id::HEAD ? head : others)
+								packet.device_poses.push_back(locate_space(device, space, local_floor, t0 + Δt, packet.origin));
+						}
 					}
 
-					t.pause();
-					network_session->send_stream(packet);
-					t.resume();
-
-					if (application::get_hand_tracking_supported())
+					std::array<from_headset::hand_tracking, 2> hands{};
+					if (others and hands_due)
 					{
-						hands.hand = xrt::drivers::wivrn::from_headset::hand_tracking::left;
-						hands.joints = locate_hands(application::get_left_hand(), local_floor, hands.timestamp);
-						t.pause();
-						network_session->send_stream(hands);
-						t.resume();
-
-						hands.hand = xrt::drivers::wivrn::from_headset::hand_tracking::right;
-						hands.joints = locate_hands(application::get_right_hand(), local_floor, hands.timestamp);
-						t.pause();
-						network_session->send_stream(hands);
-						t.resume();
+						for (auto [i, hand]: utils::enumerate(hands))
+						{
+							// The measured sample decides which hands are sent, predicted ones follow it
+							if (Δt != 0 and not send_hands[i])
+								continue;
+
+							hand.production_timestamp = t0;
+							hand.timestamp = t0 + Δt;
+							hand.hand = i == 0 ? from_headset::hand_tracking::left : from_headset::hand_tracking::right;
+							hand.joints = locate_hands(i == 0 ? application::get_left_hand() : application::get_right_hand(), local_floor, hand.timestamp, hand.origin);
+
+							if (Δt == 0)
+							{
+								auto & sent = sent_hands[i];
+								send_hands[i] = not sent or t0 - sent->production_timestamp >= hand_keep_alive or hand_moved(*sent, hand);
+								if (send_hands[i])
+									sent = hand;
+							}
+						}
 					}
+					const bool left = others and send_hands[0];
+					const bool right = others and send_hands[1];
+
+					// Each hand is in its own packet to avoid IP fragmentation, all are sent with a single system call
+					t.pause();
+					if (left and right)
+						network_session->send_stream_batch(packet, hands[0], hands[1]);
+					else if (left)
+						network_session->send_stream_batch(packet, hands[0]);
+					else if (right)
+						network_session->send_stream_batch(packet, hands[1]);
+					else
+						network_session->send_stream(packet);
+					t.resume();
 
 					XrDuration busy_time = t.count();
 					// Target: polling between 1 and 5ms, with 20% busy time
 					tracking_period = std::clamp<XrDuration>(std::lerp(tracking_period, busy_time * 5, 0.2), 1'000'000, 5'000'000);
+					hint.set_target(std::chrono::nanoseconds(tracking_period / 5));
+					hint.report(std::chrono::nanoseconds(busy_time));
 				}
 				catch (const std::system_error & e)
 				{
@@ -229,10 +378,50 @@ void scenes::stream::tracking()
 				}
 			}
 
-			t0 += tracking_period;
+			// The tracking thread is the timer of the feedback batches and of the haptics
+			flush_feedback();
+			XrTime next_haptics = apply_pending_haptics(instance.now());
+
+			XrTime next = t0 + tracking_period;
+			scheduled_display = 0;
+			{
+				std::lock_guard lock(tracking_schedule_mutex);
+				if (tracking_schedule and t0 - tracking_schedule->received < 3'000'000'000)
+				{
+					const auto & schedule = *tracking_schedule;
+					// Margin for the jitter of the network and of the wake up of this thread
+					XrDuration lead = schedule.uplink + 1'000'000;
+					// First wake up whose sample is after this one
+					XrTime wake_up = schedule.next_wake_up;
+					if (wake_up - lead <= t0)
+						wake_up += ((t0 - wake_up + lead) / schedule.wake_up_period + 1) * schedule.wake_up_period;
+
+					next = t0 + std::max(tracking_period, background_period);
+					if (wake_up - lead <= next)
+					{
+						next = wake_up - lead;
+						scheduled_display = wake_up + schedule.display_offset;
+					}
+				}
+			}
+			if (next_haptics and next_haptics < next)
+			{
+				next = next_haptics;
+				scheduled_display = 0;
+			}
+			t0 = next;
 		}
 		catch (std::exception & e)
 		{
+			// Network errors are handled by the network thread, which tries to resume the connection
+			auto system_error = dynamic_cast<const std::system_error *>(&e);
+			bool network_error = dynamic_cast<const socket_shutdown *>(&e) or
+			                     (system_error and system_error->code().category() == std::generic_category());
+			if (resuming or network_error)
+			{
+				t0 += tracking_period;
+				continue;
+			}
 			spdlog::info("Exception in tracking thread, exiting: {}", e.what());
 			exit();
 		}
@@ -241,6 +430,21 @@ void scenes::stream::tracking()
 
 void scenes::stream::operator()(to_headset::prediction_offset && packet)
 {
+	// The server already filters the offsets
 	if (packet.offset.count() >= 0)
-		tracking_prediction_offset = std::lerp(packet.offset.count(), tracking_prediction_offset.load(), 0.2);
+		tracking_prediction_offset = packet.offset.count();
+	if (packet.hand_offset.count() >= 0)
+		hand_prediction_offset = packet.hand_offset.count();
+
+	std::lock_guard lock(tracking_schedule_mutex);
+	if (packet.next_wake_up and packet.wake_up_period.count() > 0)
+		tracking_schedule = wake_up_schedule{
+		        .next_wake_up = packet.next_wake_up,
+		        .wake_up_period = packet.wake_up_period.count(),
+		        .display_offset = packet.display_offset.count(),
+		        .uplink = packet.uplink.count(),
+		        .received = instance.now(),
+		};
+	else
+		tracking_schedule.reset();
 }
@@ -19,6 +19,16 @@
 
 #version 450
 
+// The lit_multiview variant renders both views in a single pass
+#ifdef MULTIVIEW
+#extension GL_EXT_multiview : require
+#define VIEW_COUNT 2
+#define VIEW_INDEX gl_ViewIndex
+#else
+#define VIEW_COUNT 1
+#define VIEW_INDEX 0
+#endif
+
 layout (constant_id = 0) const int nb_texcoords = 2;
 layout (constant_id = 1) const int nb_clipping = 1;
 layout (constant_id = 2) const bool dithering = true;
@@ -29,7 +39,7 @@ const float fog_min_dist = 20.0;
 const float fog_max_dist = 35.0;
 const vec4 fog_color = vec4(0.0, 0.25, 0.5, 1.0);
 
-layout(set = 0, binding = 0) uniform scene_ssbo
+struct view_data
 {
 	mat4 view;
 	mat4 proj;
@@ -37,13 +47,23 @@ layout(set = 0, binding = 0) uniform scene_ssbo
 	vec4 ambient_color;
 	vec4 light_color;
 // 	vec4 clipping_plane[8];
-} scene;
+};
+
+layout(set = 0, binding = 0) uniform scene_ssbo
+{
+	view_data views[VIEW_COUNT];
+} scene_views;
+
+#define scene scene_views.views[VIEW_INDEX]
 
-layout(set = 0, binding = 1) uniform mesh_ssbo
+struct instance_data
 {
 	mat4 model;
-	mat4 modelview;
-	mat4 modelviewproj;
+};
+
+layout(set = 0, binding = 1) readonly buffer mesh_ssbo
+{
+	instance_data instances[];
 } mesh;
 
 layout(set = 0, binding = 2) uniform joints_ssbo
@@ -110,6 +130,8 @@ layout(location = 0) out vec4 out_color;
 
 void main()
 {
+	mat4 modelview = scene.view * mesh.instances[gl_InstanceIndex].model;
+	mat4 modelviewproj = scene.proj * modelview;
 
 	for(int i = 0; i < nb_texcoords; i++)
 		texcoord[i] = in_texcoord[i];
@@ -122,15 +144,15 @@ void main()
 			in_weights.z * joints.joint_matrices[int(in_joints.z)] +
 			in_weights.w * joints.joint_matrices[int(in_joints.w)];
 
-		normal = vec3(mesh.modelview * skinMatrix * vec4(in_normal, 0.0));
-		gl_Position = mesh.modelviewproj * skinMatrix * vec4(in_position, 1.0);
+		normal = vec3(modelview * skinMatrix * vec4(in_normal, 0.0));
+		gl_Position = modelviewproj * skinMatrix * vec4(in_position, 1.0);
 	}
 	else
 	{
-		normal = vec3(mesh.modelview * vec4(in_normal, 0.0));
-		gl_Position = mesh.modelviewproj * vec4(in_position, 1.0);
+		normal = vec3(modelview * vec4(in_normal, 0.0));
+		gl_Position = modelviewproj * vec4(in_position, 1.0);
 	}
-	frag_pos = mesh.modelview * vec4(in_position, 1.0);
+	frag_pos = modelview * vec4(in_position, 1.0);
 	light_pos = scene.view * scene.light_position;
 
 // 	for(int i = 0; i < nb_clipping; i++)
@@ -23,13 +23,23 @@ layout (constant_id = 0) const bool use_foveation_x = false;
 layout (constant_id = 1) const bool use_foveation_y = false;
 layout (constant_id = 2) const int nb_x = 64;
 layout (constant_id = 3) const int nb_y = 64;
+layout (constant_id = 4) const int depth_grid_size = 32;
 
-layout(set = 0, binding = 1) uniform UniformBufferObject
+layout(set = 0, binding = 0) uniform UniformBufferObject
 {
 	vec2 a;
 	vec2 b;
 	vec2 lambda;
 	vec2 xc;
+
+	// Motion extrapolation, zero if disabled
+	vec2 motion_scale;
+	vec2 block_scale;
+	vec2 block_offset;
+	ivec2 blocks;
+
+	// Index of the first distance of the view
+	int depth_offset;
 }
 ubo;
 
@@ -56,35 +66,113 @@ vec2 unfoveate(vec2 uv)
 
 #ifdef VERT_SHADER
 
-vec2 positions[6] = vec2[](
-	vec2(0, 0), vec2(1, 0), vec2(0, 1),
-	vec2(1, 0), vec2(0, 1), vec2(1, 1));
+// Part of the view covered by the decoder
+layout(push_constant) uniform PushConstants
+{
+	vec2 min;
+	vec2 max;
+	vec2 uv_scale;
+	vec2 uv_offset;
+	// Rotation from the pose of the decoder image to the pose of the layer
+	mat3 correction;
+}
+region;
+
+// Motion of each block, x and y as signed bytes, in half pixels of the stream
+layout(set = 0, binding = 1) readonly buffer Motion
+{
+	uint vectors[];
+}
+motion;
+
+vec2 block_motion(ivec2 block)
+{
+	block = clamp(block, ivec2(0), ubo.blocks - 1);
+	int i = block.y * ubo.blocks.x + block.x;
+	int word = int(motion.vectors[i / 2]);
+	int shift = (i % 2) * 16;
+	return vec2(bitfieldExtract(word, shift, 8), bitfieldExtract(word, shift + 8, 8));
+}
+
+// Motion at a position of the view, interpolated between the centres of the blocks
+vec2 motion_at(vec2 uv)
+{
+	vec2 pos = uv * ubo.block_scale + ubo.block_offset;
+	ivec2 i = ivec2(floor(pos));
+	vec2 f = fract(pos);
+	return mix(mix(block_motion(i), block_motion(i + ivec2(1, 0)), f.x),
+	           mix(block_motion(i + ivec2(0, 1)), block_motion(i + ivec2(1, 1)), f.x),
+	           f.y);
+}
+
+// Distance of each view on a grid of the foveated view, as bytes of 255 * min_distance / distance
+layout(set = 0, binding = 2) readonly buffer Depth
+{
+	uint values[];
+}
+depth;
+
+float depth_value(ivec2 cell)
+{
+	cell = clamp(cell, ivec2(0), ivec2(depth_grid_size - 1));
+	int i = ubo.depth_offset + cell.y * depth_grid_size + cell.x;
+	return float(bitfieldExtract(depth.values[i / 4], (i % 4) * 8, 8));
+}
+
+// Depth of the runtime depth layer, 1 - min_distance / distance, interpolated between the centres of the cells
+float depth_at(vec2 uv)
+{
+	vec2 pos = uv * depth_grid_size - 0.5;
+	ivec2 i = ivec2(floor(pos));
+	vec2 f = fract(pos);
+	float value = mix(mix(depth_value(i), depth_value(i + ivec2(1, 0)), f.x),
+	                  mix(depth_value(i + ivec2(0, 1)), depth_value(i + ivec2(1, 1)), f.x),
+	                  f.y);
+	return 1 - value / 255;
+}
 
 layout(location = 0) out vec2 outUV;
 
 void main()
 {
-	vec2 quad_size = 1 / vec2(nb_x, nb_y);
-	int cell_id = gl_VertexIndex / 6;
+	// Indexed draw, the vertices are shared by the neighbouring cells of the grid
+	vec2 t = vec2(gl_VertexIndex % (nb_x + 1), gl_VertexIndex / (nb_x + 1)) / vec2(nb_x, nb_y);
 
-	vec2 top_left = quad_size * vec2(cell_id % nb_x, cell_id / nb_x);
-	outUV = top_left + positions[gl_VertexIndex % 6] * quad_size;
+	// Exact edges so that there is no gap with the neighbouring decoders
+	vec2 uv = mix(mix(region.min, region.max, t), region.max, equal(t, vec2(1)));
+	outUV = uv * region.uv_scale + region.uv_offset;
 
-	gl_Position = vec4(unfoveate(outUV), 0.0, 1.0);
+	// Move the content along its motion, the borders of the view stay in place
+	vec2 pos = uv;
+	if (ubo.motion_scale != vec2(0))
+	{
+		bvec2 border = bvec2(uvec2(equal(uv, vec2(0))) | uvec2(equal(uv, vec2(1))));
+		pos = mix(uv + motion_at(uv) * ubo.motion_scale, uv, border);
+	}
+
+	// Homogeneous coordinates so that the image is interpolated along the rotated plane
+	vec3 p = region.correction * vec3(unfoveate(pos), 1);
+	gl_Position = vec4(p.xy, depth_at(uv) * p.z, p.z);
 }
 #endif
 
 #ifdef FRAG_SHADER
-layout(set = 0, binding = 0) uniform sampler2D texSampler;
+layout(set = 1, binding = 0) uniform sampler2D texSampler;
 
 layout(location = 0) in vec2 inUV;
 
 layout(location = 0) out vec4 outColor;
 
-void main()
+float sRGB_to_linear(float x)
 {
-	outColor = vec4(texture(texSampler, inUV).rgb, 1);
+	if (x <= 0.04045)
+		return x / 12.92;
+	return pow((x + 0.055) / 1.055, 2.4);
+}
 
+void main()
+{
+	vec3 rgb = texture(texSampler, inUV).rgb;
+	outColor = vec4(sRGB_to_linear(rgb.r), sRGB_to_linear(rgb.g), sRGB_to_linear(rgb.b), 1);
 }
 #endif
-
@@ -0,0 +1,125 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "performance_hint.h"
+
+#include <spdlog/spdlog.h>
+#include <utility>
+
+#ifdef __ANDROID__
+#include <dlfcn.h>
+#include <unistd.h>
+
+namespace
+{
+// The minimum API level is 29, the functions are only available from API 33
+struct adpf_functions
+{
+	void * (*get_manager)() = nullptr;
+	void * (*create_session)(void *, const int32_t *, size_t, int64_t) = nullptr;
+	int (*update_target)(void *, int64_t) = nullptr;
+	int (*report_actual)(void *, int64_t) = nullptr;
+	void (*close_session)(void *) = nullptr;
+	void * manager = nullptr;
+
+	adpf_functions()
+	{
+		void * lib = dlopen("libandroid.so", RTLD_NOW | RTLD_LOCAL);
+		if (not lib)
+			return;
+
+		get_manager = (decltype(get_manager))dlsym(lib, "APerformanceHint_getManager");
+		create_session = (decltype(create_session))dlsym(lib, "APerformanceHint_createSession");
+		update_target = (decltype(update_target))dlsym(lib, "APerformanceHint_updateTargetWorkDuration");
+		report_actual = (decltype(report_actual))dlsym(lib, "APerformanceHint_reportActualWorkDuration");
+		close_session = (decltype(close_session))dlsym(lib, "APerformanceHint_closeSession");
+
+		if (get_manager and create_session and update_target and report_actual and close_session)
+			manager = get_manager();
+		if (not manager)
+			spdlog::info("Performance hints are not supported");
+	}
+};
+
+const adpf_functions & adpf()
+{
+	static adpf_functions instance;
+	return instance;
+}
+} // namespace
+#endif
+
+utils::performance_hint::performance_hint(const char * name, std::chrono::nanoseconds target) :
+        target(target)
+{
+#ifdef __ANDROID__
+	const auto & f = adpf();
+	if (not f.manager or target.count() <= 0)
+		return;
+
+	int32_t tid = gettid();
+	session = f.create_session(f.manager, &tid, 1, target.count());
+	if (session)
+		spdlog::info("Created performance hint session for {}, target {}µs", name, target.count() / 1000);
+	else
+		spdlog::info("Cannot create performance hint session for {}", name);
+#endif
+}
+
+utils::performance_hint::performance_hint(performance_hint && other) noexcept :
+        session(std::exchange(other.session, nullptr)),
+        target(other.target)
+{
+}
+
+utils::performance_hint & utils::performance_hint::operator=(performance_hint && other) noexcept
+{
+	std::swap(session, other.session);
+	std::swap(target, other.target);
+	return *this;
+}
+
+utils::performance_hint::~performance_hint()
+{
+#ifdef __ANDROID__
+	if (session)
+		adpf().close_session(session);
+#endif
+}
+
+void utils::performance_hint::set_target(std::chrono::nanoseconds value)
+{
+	// Small changes are not worth a system call
+	if (not session or value.count() <= 0 or std::chrono::abs(value - target) * 20 < target)
+		return;
+	target = value;
+#ifdef __ANDROID__
+	adpf().update_target(session, target.count());
+#endif
+}
+
+void utils::performance_hint::report(std::chrono::nanoseconds actual)
+{
+	if (not session or actual.count() <= 0)
+		return;
+#ifdef __ANDROID__
+	adpf().report_actual(session, actual.count());
+#endif
+}
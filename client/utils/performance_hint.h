@@ -0,0 +1,80 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+
+#pragma once
+
+#include <chrono>
+
+namespace utils
+{
+
+// Performance hint session of the Android Dynamic Performance Framework for the
+// thread that creates it: the system sets the CPU frequency so that the reported
+// work durations stay below the target, instead of reacting late to the load.
+// Does nothing on other platforms and before Android 13.
+class performance_hint
+{
+	using clock = std::chrono::steady_clock;
+
+	void * session = nullptr;
+	std::chrono::nanoseconds target{};
+
+public:
+	class scope
+	{
+		performance_hint & hint;
+		clock::time_point start = clock::now();
+
+	public:
+		scope(performance_hint & hint) :
+		        hint(hint) {}
+		scope(const scope &) = delete;
+		~scope()
+		{
+			hint.report(clock::now() - start);
+		}
+	};
+
+	performance_hint() = default;
+	performance_hint(const char * name, std::chrono::nanoseconds target);
+	performance_hint(const performance_hint &) = delete;
+	performance_hint & operator=(const performance_hint &) = delete;
+	performance_hint(performance_hint &&) noexcept;
+	performance_hint & operator=(performance_hint &&) noexcept;
+	~performance_hint();
+
+	explicit operator bool() const
+	{
+		return session;
+	}
+
+	// Only calls the system when the target changes by more than 5%
+	void set_target(std::chrono::nanoseconds);
+	void report(std::chrono::nanoseconds actual);
+
+	// Reports the duration of the work done until the returned object is destroyed
+	scope measure()
+	{
+		return scope(*this);
+	}
+};
+
+} // namespace utils
@@ -0,0 +1,85 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+
+namespace utils
+{
+
+// Quantiles of durations in nanoseconds, in a fixed size histogram with logarithmic buckets.
+// Buckets grow by 10%, from 10µs to about 2s, so quantiles are within 5% of the exact value.
+class quantile_sketch
+{
+	static constexpr int bucket_count = 128;
+	static constexpr double min_value = 10'000;
+	static constexpr double growth = 1.1;
+
+	std::array<uint32_t, bucket_count> buckets{};
+	uint32_t count_ = 0;
+	double sum = 0;
+
+public:
+	void add(int64_t value)
+	{
+		int bucket = 0;
+		if (value > min_value)
+			bucket = std::min<int>(bucket_count - 1, std::log(value / min_value) / std::log(growth));
+		++buckets[bucket];
+		++count_;
+		sum += value;
+	}
+
+	uint32_t count() const
+	{
+		return count_;
+	}
+
+	int64_t mean() const
+	{
+		return count_ ? sum / count_ : 0;
+	}
+
+	// Middle of the bucket of the q quantile, 0 if empty
+	int64_t quantile(double q) const
+	{
+		if (count_ == 0)
+			return 0;
+		uint32_t rank = std::ceil(q * count_);
+		uint32_t seen = 0;
+		for (int i = 0; i < bucket_count; ++i)
+		{
+			seen += buckets[i];
+			if (seen >= std::max<uint32_t>(rank, 1))
+				return min_value * std::pow(growth, i + 0.5);
+		}
+		return min_value * std::pow(growth, bucket_count);
+	}
+
+	void clear()
+	{
+		*this = {};
+	}
+};
+
+} // namespace utils
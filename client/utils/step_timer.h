@@ -0,0 +1,64 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <chrono>
+#include <spdlog/spdlog.h>
+#include <string>
+#include <string_view>
+
+namespace utils
+{
+
+// Logs the duration of each step of a sequence, and the total when destroyed
+class step_timer
+{
+	using clock = std::chrono::steady_clock;
+
+	std::string name;
+	clock::time_point start = clock::now();
+	clock::time_point last = start;
+
+	static float ms(clock::duration d)
+	{
+		return std::chrono::duration<float, std::milli>(d).count();
+	}
+
+public:
+	step_timer(std::string name) :
+	        name(std::move(name)) {}
+
+	step_timer(const step_timer &) = delete;
+
+	~step_timer()
+	{
+		spdlog::info("{}: {:.1f}ms total", name, ms(clock::now() - start));
+	}
+
+	void step(std::string_view step_name)
+	{
+		auto now = clock::now();
+		spdlog::info("{}: {} in {:.1f}ms", name, step_name, ms(now - last));
+		last = now;
+	}
+};
+
+} // namespace utils
@@ -0,0 +1,98 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+
+#include "thermal_monitor.h"
+
+#include <cmath>
+#include <spdlog/spdlog.h>
+
+#ifdef __ANDROID__
+#include <dlfcn.h>
+
+namespace
+{
+// The minimum API level is 29, the thermal status is available from API 30 and the headroom from API 31
+struct thermal_functions
+{
+	void * (*acquire_manager)() = nullptr;
+	void (*release_manager)(void *) = nullptr;
+	int (*get_current_status)(void *) = nullptr;
+	float (*get_headroom)(void *, int) = nullptr;
+
+	thermal_functions()
+	{
+		void * lib = dlopen("libandroid.so", RTLD_NOW | RTLD_LOCAL);
+		if (not lib)
+			return;
+
+		acquire_manager = (decltype(acquire_manager))dlsym(lib, "AThermal_acquireManager");
+		release_manager = (decltype(release_manager))dlsym(lib, "AThermal_releaseManager");
+		get_current_status = (decltype(get_current_status))dlsym(lib, "AThermal_getCurrentThermalStatus");
+		get_headroom = (decltype(get_headroom))dlsym(lib, "AThermal_getThermalHeadroom");
+	}
+};
+
+const thermal_functions & thermal()
+{
+	static thermal_functions instance;
+	return instance;
+}
+} // namespace
+#endif
+
+utils::thermal_monitor::thermal_monitor()
+{
+#ifdef __ANDROID__
+	const auto & f = thermal();
+	if (f.acquire_manager and f.release_manager and f.get_current_status)
+		manager = f.acquire_manager();
+	if (not manager)
+		spdlog::info("Thermal status is not available");
+	else if (not f.get_headroom)
+		spdlog::info("Thermal headroom is not available");
+#endif
+}
+
+utils::thermal_monitor::~thermal_monitor()
+{
+#ifdef __ANDROID__
+	if (manager)
+		thermal().release_manager(manager);
+#endif
+}
+
+utils::thermal_monitor::status utils::thermal_monitor::get_status()
+{
+#ifdef __ANDROID__
+	if (manager)
+		return status(thermal().get_current_status(manager));
+#endif
+	return status::error;
+}
+
+float utils::thermal_monitor::get_headroom(std::chrono::seconds forecast)
+{
+#ifdef __ANDROID__
+	if (manager and thermal().get_headroom)
+		return thermal().get_headroom(manager, forecast.count());
+#endif
+	return NAN;
+}
@@ -0,0 +1,68 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+
+#pragma once
+
+#include <chrono>
+
+namespace utils
+{
+
+// Thermal state of the device from the Android thermal API, to reduce the load
+// before the system throttles the CPU and GPU.
+// Does nothing on other platforms and before Android 11.
+class thermal_monitor
+{
+	void * manager = nullptr;
+
+public:
+	// Values of AThermalStatus
+	enum class status
+	{
+		error = -1,
+		none = 0,
+		light,
+		moderate,
+		severe,
+		critical,
+		emergency,
+		shutdown,
+	};
+
+	thermal_monitor();
+	thermal_monitor(const thermal_monitor &) = delete;
+	thermal_monitor & operator=(const thermal_monitor &) = delete;
+	~thermal_monitor();
+
+	explicit operator bool() const
+	{
+		return manager;
+	}
+
+	status get_status();
+
+	// Forecast of the thermal headroom, 1 is the start of severe throttling.
+	// NaN if unknown, or if it was requested less than a second ago.
+	// This is a call to a system service, it must not be done by time critical threads.
+	float get_headroom(std::chrono::seconds forecast);
+};
+
+} // namespace utils
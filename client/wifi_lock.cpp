@@ -19,6 +19,7 @@
 
 #include "wifi_lock.h"
 #include "spdlog/spdlog.h"
+#include <algorithm>
 
 #ifdef __ANDROID__
 #include "application.h"
@@ -76,6 +77,51 @@ void wifi_lock::apply()
 #endif
 }
 
+std::optional<xrt::drivers::wivrn::from_headset::network_stats::wifi_link> wifi_lock::link()
+{
+#ifdef __ANDROID__
+	try
+	{
+		// Called periodically from the network thread: method IDs are only looked up on the first call
+		jni::object<""> act(application::native_app()->activity->clazz);
+
+		static int api_level = jni::klass::find<"android/os/Build$VERSION">().field<jni::Int, "SDK_INT">();
+
+		auto app = act.call<jni::object<"android/app/Application">, "getApplication">();
+		auto ctx = app.call<jni::object<"android/content/Context">, "getApplicationContext">();
+		auto wifi_service_id = jni::klass::find<"android/content/Context">().field<jni::string, "WIFI_SERVICE">();
+		auto system_service = ctx.call<jni::object<"java/lang/Object">, "getSystemService">(wifi_service_id);
+		auto info = system_service.call<jni::object<"android/net/wifi/WifiInfo">, "getConnectionInfo">();
+
+		int rssi = info.call<jni::Int, "getRssi">();
+		// WifiInfo.INVALID_RSSI
+		if (rssi <= -127)
+			return std::nullopt;
+
+		// Channel utilization and retry counts are only available to system applications
+		auto rate = [](int mbps) { return uint16_t(std::clamp(mbps, 0, 0xffff)); };
+		xrt::drivers::wivrn::from_headset::network_stats::wifi_link link{
+		        .rssi = int8_t(std::clamp(rssi, -128, 0)),
+		        .frequency = rate(info.call<jni::Int, "getFrequency">()),
+		};
+		if (api_level >= 29)
+		{
+			link.tx_rate = rate(info.call<jni::Int, "getTxLinkSpeedMbps">());
+			link.rx_rate = rate(info.call<jni::Int, "getRxLinkSpeedMbps">());
+		}
+		else
+			link.tx_rate = rate(info.call<jni::Int, "getLinkSpeed">());
+
+		return link;
+	}
+	catch (std::exception & e)
+	{
+		spdlog::debug("Cannot read the Wi-Fi link: {}", e.what());
+	}
+#endif
+	return std::nullopt;
+}
+
 void wifi_lock::set_enabled(bool enabled)
 {
 	std::lock_guard lock(instance.mutex);
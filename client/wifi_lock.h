@@ -18,7 +18,9 @@
  */
 
 #pragma once
+#include "wivrn_packets.h"
 #include <mutex>
+#include <optional>
 
 class wifi_lock
 {
@@ -33,4 +35,8 @@ public:
 
 	static void want_multicast(bool enabled);
 	static void want_low_latency(bool enabled);
+
+	// Current link of the Wi-Fi connection, nullopt if not connected or unsupported.
+	// The thread must be attached to the JVM
+	static std::optional<xrt::drivers::wivrn::from_headset::network_stats::wifi_link> link();
 };
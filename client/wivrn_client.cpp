@@ -53,6 +53,51 @@ void init_stream(T & stream)
 	{
 		spdlog::warn("Failed to set IP ToS to Expedited Forwarding: {}", e.what());
 	}
+	try
+	{
+		// Shards are timestamped before they wait in the socket and in the video thread
+		stream.enable_receive_timestamps();
+	}
+	catch (std::exception & e)
+	{
+		spdlog::warn("Failed to enable receive timestamps: {}", e.what());
+	}
+	try
+	{
+		// Congestion Experienced marks are reported in the feedback of the frames
+		stream.enable_receive_ecn();
+	}
+	catch (std::exception & e)
+	{
+		spdlog::warn("Failed to enable ECN reception: {}", e.what());
+	}
+}
+
+// Sends handshakes until the server confirms the socket
+template <typename T>
+bool confirm_socket(T & socket)
+{
+	pollfd fds{};
+	fds.events = POLLIN;
+	fds.fd = socket.get_fd();
+
+	auto timeout = std::chrono::steady_clock::now() + 1s;
+	while (std::chrono::steady_clock::now() < timeout)
+	{
+		socket.send(from_headset::handshake{});
+
+		int r = ::poll(&fds, 1, 100);
+		if (r < 0)
+			throw std::system_error(errno, std::system_category());
+
+		if (fds.revents & POLLIN)
+		{
+			auto packet = socket.receive();
+			if (packet and std::holds_alternative<to_headset::handshake>(*packet))
+				return true;
+		}
+	}
+	return false;
 }
 } // namespace
 
@@ -106,12 +151,26 @@ void wivrn_session::handshake(T address)
 	send_stream(from_headset::handshake{});
 
 	// Wait for second handshake
+	int low_latency_port = -1;
+	int video_port = -1;
+	int video_sockets = 0;
 	while (true)
 	{
-		if (poll(
-		            [](const auto && packet) { return std::is_same_v<std::remove_cvref_t<decltype(packet)>, to_headset::handshake>; },
-		            std::chrono::milliseconds(100)))
-			return;
+		bool received = false;
+		poll(
+		        [&](auto && packet) {
+			        if constexpr (std::is_same_v<std::remove_cvref_t<decltype(packet)>, to_headset::handshake>)
+			        {
+				        received = true;
+				        low_latency_port = packet.low_latency_port;
+				        video_port = packet.stream_port;
+				        video_sockets = std::min(packet.video_sockets, to_headset::handshake::max_video_sockets);
+				        server_capabilities = packet.capabilities;
+			        }
+		        },
+		        std::chrono::milliseconds(100));
+		if (received)
+			break;
 		if (std::chrono::steady_clock::now() >= timeout)
 			throw std::runtime_error("Failed to establish connection");
 
@@ -119,10 +178,121 @@ void wivrn_session::handshake(T address)
 		if (stream)
 			stream.send(from_headset::handshake{});
 	}
+
+	if (stream and low_latency_port > 0)
+		handshake_low_latency(address, low_latency_port);
+
+	if (stream and video_port > 0 and video_sockets > 0)
+		handshake_video(address, video_port, video_sockets);
+
+	if (stream)
+		probe_link();
+}
+
+// The server sends bursts of link_probe packets after the handshake, report how they arrived
+void wivrn_session::probe_link()
+{
+	struct burst_reception
+	{
+		uint16_t received = 0;
+		uint32_t bytes = 0;
+		XrTime first = 0;
+		XrTime last = 0;
+	};
+	std::vector<burst_reception> bursts;
+
+	auto now = []() {
+		return std::chrono::steady_clock::now().time_since_epoch().count();
+	};
+
+	auto timeout = std::chrono::steady_clock::now() + 1s;
+	bool done = false;
+	while (not done and std::chrono::steady_clock::now() < timeout)
+	{
+		int r = poll(
+		        [&](auto && packet) {
+			        if constexpr (std::is_same_v<std::remove_cvref_t<decltype(packet)>, to_headset::link_probe>)
+			        {
+				        XrTime t = now();
+				        if (bursts.size() < packet.burst_count)
+					        bursts.resize(packet.burst_count);
+				        if (packet.burst >= bursts.size())
+					        return;
+				        auto & burst = bursts[packet.burst];
+				        if (burst.received++ == 0)
+					        burst.first = t;
+				        else
+					        burst.bytes += packet.padding.size();
+				        burst.last = t;
+				        done = packet.burst + 1 == packet.burst_count and packet.index + 1 == packet.count;
+			        }
+		        },
+		        100ms,
+		        stream_socket);
+		// Packets may be lost, do not wait for the whole timeout once they started
+		if (r == 0 and not bursts.empty())
+			break;
+	}
+
+	from_headset::link_probe_result result{};
+	XrTime last = 0;
+	for (const auto & burst: bursts)
+	{
+		result.bursts.push_back({
+		        .received = burst.received,
+		        .bytes = burst.bytes,
+		        .dispersion = burst.last - burst.first,
+		});
+		last = std::max(last, burst.last);
+	}
+	result.reply_delay = last ? now() - last : 0;
+	send_control(std::move(result));
+
+	spdlog::info("Link probe: {} bursts received", bursts.size());
+}
+
+template <typename T>
+void wivrn_session::handshake_low_latency(T address, int port)
+{
+	low_latency = decltype(low_latency)();
+	low_latency.connect(address, port);
+	init_stream(low_latency);
+	// Keep the queue short, packets are small and outdated quickly
+	low_latency.set_send_buffer_size(64 * 1024);
+
+	if (confirm_socket(low_latency))
+	{
+		spdlog::info("Using low latency socket");
+		low_latency_confirmed = true;
+		return;
+	}
+
+	// The server may still send on it if only its confirmation was lost,
+	// keep receiving but send everything on the stream socket
+	spdlog::warn("Low latency socket not confirmed by server");
+}
+
+template <typename T>
+void wivrn_session::handshake_video(T address, int port, int count)
+{
+	// The server connects its video sockets one at a time, in the order of the handshakes
+	for (int i = 0; i < count; ++i)
+	{
+		auto & socket = video.emplace_back();
+		socket.connect(address, port);
+		init_stream(socket);
+		if (not confirm_socket(socket))
+		{
+			// Same as the low latency socket, keep receiving on it
+			spdlog::warn("Video socket {} not confirmed by server", i);
+			return;
+		}
+	}
+	spdlog::info("Using {} video sockets", count + 1);
 }
 
 wivrn_session::wivrn_session(in6_addr address, int port) :
-        control(address, port), stream(-1), address(address)
+        control(address, port), stream(-1), low_latency(-1), server_port(port), address(address)
 {
 	char buffer[100];
 	spdlog::info("Connection to {}:{}", inet_ntop(AF_INET6, &address, buffer, sizeof(buffer)), port);
@@ -130,9 +300,32 @@ wivrn_session::wivrn_session(in6_addr address, int port) :
 }
 
 wivrn_session::wivrn_session(in_addr address, int port) :
-        control(address, port), stream(-1), address(address)
+        control(address, port), stream(-1), low_latency(-1), server_port(port), address(address)
 {
 	char buffer[100];
 	spdlog::info("Connection to {}:{}", inet_ntop(AF_INET, &address, buffer, sizeof(buffer)), port);
 	handshake(address);
 }
+
+wivrn_session::wivrn_session(TCP && control, std::variant<in_addr, in6_addr> address, int port) :
+        control(std::move(control)), stream(-1), low_latency(-1), server_port(port), address(address)
+{
+	std::visit([this](auto address) {
+		char buffer[100];
+		spdlog::info("Connection to {}:{}", inet_ntop(std::is_same_v<decltype(address), in_addr> ? AF_INET : AF_INET6, &address, buffer, sizeof(buffer)), server_port);
+		handshake(address);
+	},
+	           this->address);
+}
+
+void wivrn_session::reconnect()
+{
+	auto fresh = std::visit([this](auto address) { return std::make_unique<wivrn_session>(address, server_port); }, address);
+
+	std::unique_lock lock(mutex);
+	control = std::move(fresh->control);
+	stream = std::move(fresh->stream);
+	low_latency = std::move(fresh->low_latency);
+	low_latency_confirmed = fresh->low_latency_confirmed;
+	video = std::move(fresh->video);
+}
@@ -21,7 +21,10 @@
 
 #include "wivrn_packets.h"
 #include "wivrn_sockets.h"
+#include <mutex>
 #include <poll.h>
+#include <shared_mutex>
+#include <vector>
 
 using namespace xrt::drivers::wivrn;
 
@@ -29,26 +32,111 @@ class wivrn_session
 {
 	typed_socket<TCP, to_headset::packets, from_headset::packets> control;
 	typed_socket<UDP, to_headset::packets, from_headset::packets> stream;
+	// For packets in low_latency_packet, only used for sending once confirmed by the server
+	typed_socket<UDP, to_headset::packets, from_headset::packets> low_latency;
+	bool low_latency_confirmed = false;
+	// Additional sockets the server sends video streams on, only used for receiving
+	std::vector<typed_socket<UDP, to_headset::packets, from_headset::packets>> video;
+	// capability_bit of the features implemented by the server, from its handshake
+	uint64_t server_capabilities = 0;
+
+	// Sockets are replaced by reconnect while other threads may be sending
+	mutable std::shared_mutex mutex;
+	int server_port;
 
 	template <typename T>
 	void handshake(T address);
+	template <typename T>
+	void handshake_low_latency(T address, int port);
+	template <typename T>
+	void handshake_video(T address, int port, int count);
+	void probe_link();
 
 public:
 	std::variant<in_addr, in6_addr> address;
 
 	wivrn_session(in6_addr address, int port);
 	wivrn_session(in_addr address, int port);
+	// Uses an already connected control socket
+	wivrn_session(TCP && control, std::variant<in_addr, in6_addr> address, int port);
 	wivrn_session(const wivrn_session &) = delete;
 	wivrn_session & operator=(const wivrn_session &) = delete;
 
+	bool has_capability(capability c) const
+	{
+		return server_capabilities & capability_bit(c);
+	}
+
+	// Connects again to the same server and replaces the sockets, other threads
+	// can keep using the session meanwhile. Byte counters are kept, UDP statistics are reset.
+	// Throws if the server cannot be reached, the previous sockets are then kept
+	void reconnect();
+
 	template <typename T>
 	void send_control(T && packet)
 	{
+		std::shared_lock lock(mutex);
 		control.send(std::forward<T>(packet));
 	}
 	template <typename T>
 	void send_stream(T && packet)
 	{
+		std::shared_lock lock(mutex);
+		send_stream_locked(std::forward<T>(packet));
+	}
+
+	// Sends several stream packets with a single system call, they must all use the same socket
+	template <typename... T>
+	void send_stream_batch(T &&... packets)
+	{
+		static_assert(sizeof...(T) > 0);
+		constexpr bool all_low_latency = (low_latency_packet<std::decay_t<T>> and ...);
+		static_assert(all_low_latency or not(low_latency_packet<std::decay_t<T>> or ...));
+
+		std::shared_lock lock(mutex);
+		if (all_low_latency and low_latency_confirmed)
+		{
+			(low_latency.queue(std::forward<T>(packets)), ...);
+			low_latency.flush();
+		}
+		else if (stream)
+		{
+			(stream.queue(std::forward<T>(packets)), ...);
+			stream.flush();
+		}
+		else
+			(control.send(std::forward<T>(packets)), ...);
+	}
+
+	enum socket_set
+	{
+		// UDP stream socket: video shards and audio
+		stream_socket = 1 << 0,
+		// TCP control socket and UDP low latency socket
+		control_sockets = 1 << 1,
+		all_sockets = stream_socket | control_sockets,
+	};
+
+	// Handles the packets received on a set of sockets. Also returns when wake_fd is readable, if not -1
+	template <typename T>
+	int poll(T && visitor, std::chrono::milliseconds timeout, socket_set sockets = all_sockets, int wake_fd = -1)
+	{
+		std::shared_lock lock(mutex);
+		return poll_locked(std::forward<T>(visitor), timeout, sockets, wake_fd);
+	}
+
+private:
+	template <typename T>
+	void send_stream_locked(T && packet)
+	{
+		if constexpr (low_latency_packet<std::decay_t<T>>)
+		{
+			if (low_latency_confirmed)
+			{
+				low_latency.send(std::forward<T>(packet));
+				return;
+			}
+		}
 		if (stream)
 			stream.send(std::forward<T>(packet));
 		else
@@ -56,15 +144,25 @@ public:
 	}
 
 	template <typename T>
-	int poll(T && visitor, std::chrono::milliseconds timeout)
+	int poll_locked(T && visitor, std::chrono::milliseconds timeout, socket_set sockets, int wake_fd)
 	{
-		pollfd fds[2] = {};
+		// Negative file descriptors are ignored by poll
+		pollfd fds[4 + to_headset::handshake::max_video_sockets] = {};
 		fds[0].events = POLLIN;
-		fds[0].fd = stream.get_fd();
+		fds[0].fd = (sockets & stream_socket) ? stream.get_fd() : -1;
 		fds[1].events = POLLIN;
-		fds[1].fd = control.get_fd();
+		fds[1].fd = (sockets & control_sockets) ? control.get_fd() : -1;
+		fds[2].events = POLLIN;
+		fds[2].fd = (sockets & control_sockets) ? low_latency.get_fd() : -1;
+		fds[3].events = POLLIN;
+		fds[3].fd = wake_fd;
+		for (size_t i = 0; i < video.size(); ++i)
+		{
+			fds[4 + i].events = POLLIN;
+			fds[4 + i].fd = (sockets & stream_socket) ? video[i].get_fd() : -1;
+		}
 
-		int r = ::poll(fds, std::size(fds), timeout.count());
+		int r = ::poll(fds, 4 + video.size(), timeout.count());
 		if (r < 0)
 			throw std::system_error(errno, std::system_category());
 
@@ -74,11 +172,41 @@ public:
 		if (fds[1].revents & (POLLHUP | POLLERR))
 			throw std::runtime_error("Error on control socket");
 
+		if (fds[2].revents & (POLLHUP | POLLERR))
+			throw std::runtime_error("Error on low latency socket");
+
+		for (size_t i = 0; i < video.size(); ++i)
+		{
+			if (fds[4 + i].revents & (POLLHUP | POLLERR))
+				throw std::runtime_error("Error on video socket");
+		}
+
+		thread_local std::vector<to_headset::packets> packets;
+		if (fds[2].revents & POLLIN)
+		{
+			packets.clear();
+			low_latency.receive_many(packets);
+			for (auto & packet: packets)
+				std::visit(std::forward<T>(visitor), std::move(packet));
+		}
+
 		if (fds[0].revents & POLLIN)
 		{
-			auto packet = stream.receive();
-			if (packet)
-				std::visit(std::forward<T>(visitor), std::move(*packet));
+			packets.clear();
+			stream.receive_many(packets);
+			for (auto & packet: packets)
+				std::visit(std::forward<T>(visitor), std::move(packet));
+		}
+
+		for (size_t i = 0; i < video.size(); ++i)
+		{
+			if (fds[4 + i].revents & POLLIN)
+			{
+				packets.clear();
+				video[i].receive_many(packets);
+				for (auto & packet: packets)
+					std::visit(std::forward<T>(visitor), std::move(packet));
+			}
 		}
 
 		if (fds[1].revents & POLLIN)
@@ -91,13 +219,42 @@ public:
 		return r;
 	}
 
+public:
+
+	UDP::statistics stream_statistics() const
+	{
+		std::shared_lock lock(mutex);
+		return stream.get_statistics();
+	}
+
+	UDP::statistics low_latency_statistics() const
+	{
+		std::shared_lock lock(mutex);
+		return low_latency.get_statistics();
+	}
+
+	// One for each additional video socket
+	std::vector<UDP::statistics> video_statistics() const
+	{
+		std::shared_lock lock(mutex);
+		std::vector<UDP::statistics> stats;
+		for (const auto & socket: video)
+			stats.push_back(socket.get_statistics());
+		return stats;
+	}
+
 	uint64_t bytes_received() const
 	{
-		return control.bytes_received() + stream.bytes_received();
+		std::shared_lock lock(mutex);
+		uint64_t bytes = control.bytes_received() + stream.bytes_received() + low_latency.bytes_received();
+		for (const auto & socket: video)
+			bytes += socket.bytes_received();
+		return bytes;
 	}
 
 	uint64_t bytes_sent() const
 	{
-		return control.bytes_sent() + stream.bytes_sent();
+		std::shared_lock lock(mutex);
+		return control.bytes_sent() + stream.bytes_sent() + low_latency.bytes_sent();
 	}
 };
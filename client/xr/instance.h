@@ -44,6 +44,7 @@ union event
 	XrEventDataSessionStateChanged state_changed;
 	XrEventDataDisplayRefreshRateChangedFB refresh_rate_changed;
 	XrEventDataPassthroughStateChangedFB passthrough_state_changed;
+	XrEventDataPerfSettingsEXT perf_settings;
 };
 class instance : public utils::handle<XrInstance, xrDestroyInstance>
 {
@@ -174,6 +174,61 @@ std::pair<XrViewStateFlags, std::vector<XrView>> xr::session::locate_views(XrVie
 	return {view_state.viewStateFlags, views};
 }
 
+#ifdef XR_KHR_locate_spaces
+std::vector<std::pair<XrSpaceLocation, XrSpaceVelocity>> xr::session::locate_spaces(XrTime time, std::span<const XrSpace> spaces, XrSpace reference)
+{
+	static auto xrLocateSpacesKHR = inst->get_proc<PFN_xrLocateSpacesKHR>("xrLocateSpacesKHR");
+
+	thread_local std::vector<XrSpaceLocationDataKHR> location_data;
+	thread_local std::vector<XrSpaceVelocityDataKHR> velocity_data;
+	location_data.resize(spaces.size());
+	velocity_data.resize(spaces.size());
+
+	XrSpacesLocateInfoKHR locate_info{
+	        .type = XR_TYPE_SPACES_LOCATE_INFO_KHR,
+	        .baseSpace = reference,
+	        .time = time,
+	        .spaceCount = (uint32_t)spaces.size(),
+	        .spaces = spaces.data(),
+	};
+
+	XrSpaceVelocitiesKHR velocities{
+	        .type = XR_TYPE_SPACE_VELOCITIES_KHR,
+	        .velocityCount = (uint32_t)velocity_data.size(),
+	        .velocities = velocity_data.data(),
+	};
+
+	XrSpaceLocationsKHR locations{
+	        .type = XR_TYPE_SPACE_LOCATIONS_KHR,
+	        .next = &velocities,
+	        .locationCount = (uint32_t)location_data.size(),
+	        .locations = location_data.data(),
+	};
+
+	CHECK_XR(xrLocateSpacesKHR(id, &locate_info, &locations));
+
+	std::vector<std::pair<XrSpaceLocation, XrSpaceVelocity>> res;
+	res.reserve(spaces.size());
+	for (size_t i = 0; i < spaces.size(); i++)
+	{
+		res.emplace_back(
+		        XrSpaceLocation{
+		                .type = XR_TYPE_SPACE_LOCATION,
+		                .locationFlags = location_data[i].locationFlags,
+		                .pose = location_data[i].pose,
+		        },
+		        XrSpaceVelocity{
+		                .type = XR_TYPE_SPACE_VELOCITY,
+		                .velocityFlags = velocity_data[i].velocityFlags,
+		                .linearVelocity = velocity_data[i].linearVelocity,
+		                .angularVelocity = velocity_data[i].angularVelocity,
+		        });
+	}
+
+	return res;
+}
+#endif
+
 std::string xr::session::get_current_interaction_profile(const std::string & path)
 {
 	XrInteractionProfileState state{
@@ -278,6 +333,36 @@ void xr::session::set_refresh_rate(float refresh_rate)
 		CHECK_XR(xrRequestDisplayRefreshRateFB(id, refresh_rate));
 }
 
+std::pair<std::vector<XrVector2f>, std::vector<uint32_t>> xr::session::get_visibility_mask(XrViewConfigurationType type, uint32_t view_index, XrVisibilityMaskTypeKHR mask_type)
+{
+	static auto xrGetVisibilityMaskKHR = inst->get_proc<PFN_xrGetVisibilityMaskKHR>("xrGetVisibilityMaskKHR");
+
+	XrVisibilityMaskKHR mask{
+	        .type = XR_TYPE_VISIBILITY_MASK_KHR,
+	};
+	CHECK_XR(xrGetVisibilityMaskKHR(id, type, view_index, mask_type, &mask));
+
+	std::vector<XrVector2f> vertices(mask.vertexCountOutput);
+	std::vector<uint32_t> indices(mask.indexCountOutput);
+	mask.vertexCapacityInput = vertices.size();
+	mask.vertices = vertices.data();
+	mask.indexCapacityInput = indices.size();
+	mask.indices = indices.data();
+	CHECK_XR(xrGetVisibilityMaskKHR(id, type, view_index, mask_type, &mask));
+
+	vertices.resize(mask.vertexCountOutput);
+	indices.resize(mask.indexCountOutput);
+	return {std::move(vertices), std::move(indices)};
+}
+
+void xr::session::set_performance_level(XrPerfSettingsDomainEXT domain, XrPerfSettingsLevelEXT level)
+{
+	static auto xrPerfSettingsSetPerformanceLevelEXT = inst->get_proc<PFN_xrPerfSettingsSetPerformanceLevelEXT>("xrPerfSettingsSetPerformanceLevelEXT");
+
+	if (xrPerfSettingsSetPerformanceLevelEXT)
+		CHECK_XR(xrPerfSettingsSetPerformanceLevelEXT(id, domain, level));
+}
+
 void xr::session::sync_actions(std::span<XrActionSet> action_sets)
 {
 	std::vector<XrActiveActionSet> active_action_sets(action_sets.size());
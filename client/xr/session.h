@@ -60,6 +60,11 @@ public:
 	                                                              XrTime display_time,
 	                                                              XrSpace space);
 
+#ifdef XR_KHR_locate_spaces
+	// Locates all the spaces with a single call, XR_KHR_locate_spaces must be enabled
+	std::vector<std::pair<XrSpaceLocation, XrSpaceVelocity>> locate_spaces(XrTime time, std::span<const XrSpace> spaces, XrSpace reference);
+#endif
+
 	std::string get_current_interaction_profile(const std::string & path);
 	void attach_actionsets(const std::vector<XrActionSet> & actionsets);
 	std::vector<std::string> sources_for_action(XrAction a);
@@ -71,6 +76,12 @@ public:
 	std::vector<float> get_refresh_rates();
 	void set_refresh_rate(float);
 
+	// Vertices and indices of the mask of a view, XR_KHR_visibility_mask must be enabled
+	std::pair<std::vector<XrVector2f>, std::vector<uint32_t>> get_visibility_mask(XrViewConfigurationType, uint32_t view_index, XrVisibilityMaskTypeKHR);
+
+	// Does nothing if XR_EXT_performance_settings is not enabled
+	void set_performance_level(XrPerfSettingsDomainEXT, XrPerfSettingsLevelEXT);
+
 	void sync_actions(XrActionSet action_set, XrPath subaction_path = XR_NULL_PATH);
 	void sync_actions(XrActionSet action_set, const std::string & subaction_path);
 
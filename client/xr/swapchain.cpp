@@ -21,26 +21,27 @@
 #include "details/enumerate.h"
 #include "session.h"
 
-xr::swapchain::swapchain(xr::session & s, vk::raii::Device & device, vk::Format format, int32_t width, int32_t height, int sample_count)
+xr::swapchain::swapchain(xr::session & s, vk::raii::Device & device, vk::Format format, int32_t width, int32_t height, int sample_count, XrSwapchainUsageFlags usage, uint32_t array_size)
 {
 	assert(sample_count == 1);
 
 	XrSwapchainCreateInfo create_info{
 	        .type = XR_TYPE_SWAPCHAIN_CREATE_INFO,
 	        .createFlags = 0,
-	        .usageFlags = XR_SWAPCHAIN_USAGE_SAMPLED_BIT | XR_SWAPCHAIN_USAGE_COLOR_ATTACHMENT_BIT,
+	        .usageFlags = usage,
 	        .format = static_cast<VkFormat>(format),
 	        .sampleCount = (uint32_t)sample_count,
 	        .width = (uint32_t)width,
 	        .height = (uint32_t)height,
 	        .faceCount = 1,
-	        .arraySize = 1,
+	        .arraySize = array_size,
 	        .mipCount = 1,
 	};
 
 	width_ = width;
 	height_ = height;
 	sample_count_ = sample_count;
+	array_size_ = array_size;
 	format_ = format;
 
 	CHECK_XR(xrCreateSwapchain(s, &create_info, &id));
@@ -55,15 +56,15 @@ xr::swapchain::swapchain(xr::session & s, vk::raii::Device & device, vk::Format
 
 		vk::ImageViewCreateInfo iv_create_info{
 		        .image = array[i].image,
-		        .viewType = vk::ImageViewType::e2D,
+		        .viewType = array_size > 1 ? vk::ImageViewType::e2DArray : vk::ImageViewType::e2D,
 		        .format = format,
 		        .components = {},
 		        .subresourceRange = {
-		                .aspectMask = vk::ImageAspectFlagBits::eColor,
+		                .aspectMask = (usage & XR_SWAPCHAIN_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT) ? vk::ImageAspectFlagBits::eDepth : vk::ImageAspectFlagBits::eColor,
 		                .baseMipLevel = 0,
 		                .levelCount = 1,
 		                .baseArrayLayer = 0,
-		                .layerCount = 1,
+		                .layerCount = array_size,
 		        }};
 
 		images_[i].view = vk::raii::ImageView(device, iv_create_info);
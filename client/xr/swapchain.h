@@ -46,13 +46,21 @@ private:
 	int32_t width_;
 	int32_t height_;
 	int sample_count_;
+	uint32_t array_size_;
 	vk::Format format_;
 
 	std::vector<image> images_;
 
 public:
 	swapchain() = default;
-	swapchain(session &, vk::raii::Device & device, vk::Format format, int32_t width, int32_t height, int sample_count = 1);
+	swapchain(session &,
+	          vk::raii::Device & device,
+	          vk::Format format,
+	          int32_t width,
+	          int32_t height,
+	          int sample_count = 1,
+	          XrSwapchainUsageFlags usage = XR_SWAPCHAIN_USAGE_SAMPLED_BIT | XR_SWAPCHAIN_USAGE_COLOR_ATTACHMENT_BIT,
+	          uint32_t array_size = 1);
 
 	int32_t width() const
 	{
@@ -70,6 +78,11 @@ public:
 	{
 		return sample_count_;
 	}
+	// Number of layers of each image, the image views cover all of them
+	uint32_t array_size() const
+	{
+		return array_size_;
+	}
 	const std::vector<image> & images() const
 	{
 		return images_;
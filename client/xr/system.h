@@ -61,6 +61,7 @@ public:
 
 	XrSystemProperties properties() const;
 	XrSystemHandTrackingPropertiesEXT hand_tracking_properties() const;
+	XrSystemEyeGazeInteractionPropertiesEXT eye_gaze_interaction_properties() const;
 	passthrough_type passthrough_supported() const;
 
 	XrGraphicsRequirementsVulkan2KHR graphics_requirements() const;
@@ -55,6 +55,10 @@ XR_ENUM_STR(XrEyeVisibility);
 XR_ENUM_STR(XrSessionState);
 XR_ENUM_STR(XrObjectType);
 XR_ENUM_STR(XrStructureType);
+XR_ENUM_STR(XrPerfSettingsDomainEXT);
+XR_ENUM_STR(XrPerfSettingsSubDomainEXT);
+XR_ENUM_STR(XrPerfSettingsNotificationLevelEXT);
+XR_ENUM_STR(XrPerfSettingsLevelEXT);
 
 std::string to_string(XrVersion version);
 
@@ -1,15 +1,16 @@
 
-function(compile_glsl_aux shader_stage shader_name glsl_filename output)
+# The SPIR-V files are prefixed with the target name, several targets may compile the same shaders
+function(compile_glsl_aux target_name shader_stage shader_name glsl_filename output)
 
     string(TOUPPER ${shader_stage} shader_stage_upper)
 
     add_custom_command(
             OUTPUT ${output}
             COMMAND echo "{ \"${shader_name}\", {"         >> ${output}
-            COMMAND echo "#include \"${shader_name}.spv\"" >> ${output}
+            COMMAND echo "#include \"${target_name}_${shader_name}.spv\"" >> ${output}
             COMMAND echo "}},"                             >> ${output}
 
-            COMMAND glslangValidator -V -S ${shader_stage} -D${shader_stage_upper}_SHADER ${in_file} -x -o ${shader_name}.spv
+            COMMAND glslangValidator -V -S ${shader_stage} -D${shader_stage_upper}_SHADER ${ARGN} ${in_file} -x -o ${target_name}_${shader_name}.spv
             DEPENDS ${glsl_filename}
             VERBATIM
             APPEND
@@ -34,11 +35,18 @@ function(wivrn_compile_glsl target_name)
         if (in_file MATCHES "\.\(vert|frag|tesc|tese|geom|comp\)\.glsl$")
             set(shader_stage ${CMAKE_MATCH_1})
             cmake_path(GET in_file STEM LAST_ONLY shader_name)
-            compile_glsl_aux(${shader_stage} ${shader_name} ${in_file} ${target_name}_shaders.cpp)
+            compile_glsl_aux(${target_name} ${shader_stage} ${shader_name} ${in_file} ${target_name}_shaders.cpp)
         else()
             cmake_path(GET in_file STEM LAST_ONLY shader_name)
-            compile_glsl_aux(vert ${shader_name}.vert ${in_file} ${target_name}_shaders.cpp)
-            compile_glsl_aux(frag ${shader_name}.frag ${in_file} ${target_name}_shaders.cpp)
+            compile_glsl_aux(${target_name} vert ${shader_name}.vert ${in_file} ${target_name}_shaders.cpp)
+            compile_glsl_aux(${target_name} frag ${shader_name}.frag ${in_file} ${target_name}_shaders.cpp)
+
+            # Shaders supporting multiview also get a <name>_multiview variant
+            file(STRINGS ${in_file} multiview_support REGEX "#ifdef MULTIVIEW" LIMIT_COUNT 1)
+            if (multiview_support)
+                compile_glsl_aux(${target_name} vert ${shader_name}_multiview.vert ${in_file} ${target_name}_shaders.cpp -DMULTIVIEW)
+                compile_glsl_aux(${target_name} frag ${shader_name}_multiview.frag ${in_file} ${target_name}_shaders.cpp -DMULTIVIEW)
+            endif()
         endif()
 
 
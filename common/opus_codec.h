@@ -0,0 +1,210 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "wivrn_packets.h"
+
+#include <algorithm>
+#include <array>
+#include <memory>
+#include <opus.h>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace xrt::drivers::wivrn
+{
+
+inline bool opus_supported(uint32_t sample_rate, uint8_t num_channels)
+{
+	if (num_channels < 1 or num_channels > 2)
+		return false;
+	for (uint32_t rate: {8000, 12000, 16000, 24000, 48000})
+	{
+		if (rate == sample_rate)
+			return true;
+	}
+	return false;
+}
+
+// Encodes interleaved S16 samples in packets of a fixed duration, with in-band FEC
+class opus_encoder
+{
+	struct deleter
+	{
+		void operator()(OpusEncoder * encoder)
+		{
+			opus_encoder_destroy(encoder);
+		}
+	};
+	std::unique_ptr<OpusEncoder, deleter> encoder;
+	int num_channels;
+	int frame_size;
+	uint32_t sample_rate;
+	std::vector<int16_t> pending;
+	// Largest possible packet for a single frame
+	std::array<uint8_t, 1275> packet;
+	uint32_t sequence = 0;
+
+	template <typename F>
+	void encode_frame(const int16_t * frame, XrTime begin, F && f)
+	{
+		int size = opus_encode(encoder.get(), frame, frame_size, packet.data(), packet.size());
+		if (size < 0)
+			throw std::runtime_error(std::string("Opus encoding failed: ") + opus_strerror(size));
+		f(audio_data{
+		        .timestamp = begin,
+		        .sequence = sequence++,
+		        .payload = std::span(packet.data(), size),
+		});
+	}
+
+public:
+	// application is OPUS_APPLICATION_AUDIO or OPUS_APPLICATION_VOIP
+	opus_encoder(const to_headset::audio_stream_description::device & desc, int application) :
+	        num_channels(desc.num_channels),
+	        frame_size(desc.frame_size),
+	        sample_rate(desc.sample_rate)
+	{
+		int err;
+		encoder.reset(opus_encoder_create(desc.sample_rate, desc.num_channels, application, &err));
+		if (err != OPUS_OK)
+			throw std::runtime_error(std::string("Cannot create opus encoder: ") + opus_strerror(err));
+		// FEC is only produced by the SILK layer, which needs frames of at least 10ms
+		opus_encoder_ctl(encoder.get(), OPUS_SET_INBAND_FEC(1));
+		opus_encoder_ctl(encoder.get(), OPUS_SET_PACKET_LOSS_PERC(10));
+		pending.reserve(frame_size * num_channels);
+	}
+
+	// f is called with a packet for each complete frame, incomplete frames are kept for the next call.
+	// timestamp is the time of the end of samples, each packet gets the time of its first sample.
+	// Complete frames are encoded directly from samples, which can be a mapped audio buffer.
+	template <typename F>
+	void encode(std::span<const int16_t> samples, XrTime timestamp, F && f)
+	{
+		const size_t frame_samples = frame_size * num_channels;
+		auto begin = [&](size_t remaining) { return timestamp - XrTime(remaining / num_channels) * 1'000'000'000 / sample_rate; };
+
+		// Complete the frame started by the previous call
+		if (not pending.empty())
+		{
+			size_t n = std::min(frame_samples - pending.size(), samples.size());
+			pending.insert(pending.end(), samples.begin(), samples.begin() + n);
+			samples = samples.subspan(n);
+			if (pending.size() < frame_samples)
+				return;
+			encode_frame(pending.data(), begin(frame_samples + samples.size()), f);
+			pending.clear();
+		}
+
+		for (; samples.size() >= frame_samples; samples = samples.subspan(frame_samples))
+			encode_frame(samples.data(), begin(samples.size()), f);
+
+		pending.assign(samples.begin(), samples.end());
+	}
+
+	// Stops the stream until the next call to encode: f is called with a silence marker,
+	// an empty packet with the sequence of the next one so that the gap is not seen as lost
+	template <typename F>
+	void pause(XrTime timestamp, F && f)
+	{
+		pending.clear();
+		f(audio_data{
+		        .timestamp = timestamp,
+		        .sequence = sequence,
+		});
+	}
+};
+
+// Decodes opus packets to interleaved S16 samples.
+// Lost packets are recovered from the FEC of the next one, or concealed if several are missing.
+class opus_decoder
+{
+	struct deleter
+	{
+		void operator()(OpusDecoder * decoder)
+		{
+			opus_decoder_destroy(decoder);
+		}
+	};
+	std::unique_ptr<OpusDecoder, deleter> decoder;
+	int num_channels;
+	int frame_size;
+	std::vector<int16_t> pcm;
+	std::optional<uint32_t> next_sequence;
+
+	std::span<const int16_t> decode(std::span<const uint8_t> data, bool fec)
+	{
+		int samples = opus_decode(decoder.get(), data.empty() ? nullptr : data.data(), data.size(), pcm.data(), frame_size, fec);
+		if (samples < 0)
+			return {};
+		return std::span(pcm.data(), samples * num_channels);
+	}
+
+public:
+	// Longer losses are not filled, so that latency does not build up
+	static constexpr int max_concealed_frames = 5;
+
+	opus_decoder(const to_headset::audio_stream_description::device & desc) :
+	        num_channels(desc.num_channels),
+	        frame_size(desc.frame_size),
+	        pcm(desc.frame_size * desc.num_channels)
+	{
+		int err;
+		decoder.reset(opus_decoder_create(desc.sample_rate, desc.num_channels, &err));
+		if (err != OPUS_OK)
+			throw std::runtime_error(std::string("Cannot create opus decoder: ") + opus_strerror(err));
+	}
+
+	// f is called with the samples of each decoded frame, returns the number of lost frames before this packet.
+	// Duplicated and late packets are dropped.
+	template <typename F>
+	int decode(const audio_data & packet, F && f)
+	{
+		// Silence marker, the next packet has the same sequence
+		if (packet.payload.empty())
+		{
+			if (not next_sequence or int32_t(packet.sequence - *next_sequence) >= 0)
+				next_sequence = packet.sequence;
+			return 0;
+		}
+
+		int lost = 0;
+		if (next_sequence)
+		{
+			int32_t gap = int32_t(packet.sequence - *next_sequence);
+			if (gap < 0)
+				return 0;
+			lost = gap;
+			for (int i = 1; i < std::min(gap, max_concealed_frames); ++i)
+				f(decode({}, false));
+			if (gap > 0)
+				f(decode(packet.payload, true));
+		}
+		next_sequence = packet.sequence + 1;
+		f(decode(packet.payload, false));
+		return lost;
+	}
+};
+
+} // namespace xrt::drivers::wivrn
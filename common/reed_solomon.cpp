@@ -0,0 +1,208 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "reed_solomon.h"
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <stdexcept>
+
+namespace xrt::drivers::wivrn::reed_solomon
+{
+
+namespace
+{
+struct gf256
+{
+	// x^8 + x^4 + x^3 + x^2 + 1
+	static constexpr uint16_t polynomial = 0x11d;
+
+	std::array<uint8_t, 512> exp{};
+	std::array<uint8_t, 256> log{};
+
+	constexpr gf256()
+	{
+		uint16_t x = 1;
+		for (int i = 0; i < 255; ++i)
+		{
+			exp[i] = x;
+			exp[i + 255] = x;
+			log[x] = i;
+			x <<= 1;
+			if (x & 0x100)
+				x ^= polynomial;
+		}
+	}
+
+	constexpr uint8_t mul(uint8_t a, uint8_t b) const
+	{
+		if (a == 0 or b == 0)
+			return 0;
+		return exp[log[a] + log[b]];
+	}
+
+	constexpr uint8_t inv(uint8_t a) const
+	{
+		assert(a != 0);
+		return exp[255 - log[a]];
+	}
+
+	// dst ^= c * src
+	void mul_add(std::span<uint8_t> dst, std::span<const uint8_t> src, uint8_t c) const
+	{
+		if (c == 0)
+			return;
+		const size_t size = std::min(dst.size(), src.size());
+		const uint8_t log_c = log[c];
+		for (size_t i = 0; i < size; ++i)
+		{
+			if (src[i])
+				dst[i] ^= exp[log_c + log[src[i]]];
+		}
+	}
+};
+
+constexpr gf256 gf;
+
+// Cauchy matrix coefficient for parity row and data column
+uint8_t coefficient(size_t data_count, size_t parity_row, size_t data_column)
+{
+	return gf.inv((data_count + parity_row) ^ data_column);
+}
+
+// Gauss-Jordan inversion of a square matrix, stored row-major
+void invert(std::vector<uint8_t> & matrix, size_t n)
+{
+	std::vector<uint8_t> inverse(n * n, 0);
+	for (size_t i = 0; i < n; ++i)
+		inverse[i * n + i] = 1;
+
+	for (size_t col = 0; col < n; ++col)
+	{
+		size_t pivot = col;
+		while (pivot < n and matrix[pivot * n + col] == 0)
+			++pivot;
+		// Cauchy submatrices are always invertible
+		if (pivot == n)
+			throw std::logic_error("singular matrix in reed solomon decoder");
+
+		if (pivot != col)
+		{
+			for (size_t k = 0; k < n; ++k)
+			{
+				std::swap(matrix[pivot * n + k], matrix[col * n + k]);
+				std::swap(inverse[pivot * n + k], inverse[col * n + k]);
+			}
+		}
+
+		uint8_t scale = gf.inv(matrix[col * n + col]);
+		for (size_t k = 0; k < n; ++k)
+		{
+			matrix[col * n + k] = gf.mul(matrix[col * n + k], scale);
+			inverse[col * n + k] = gf.mul(inverse[col * n + k], scale);
+		}
+
+		for (size_t row = 0; row < n; ++row)
+		{
+			uint8_t factor = matrix[row * n + col];
+			if (row == col or factor == 0)
+				continue;
+			for (size_t k = 0; k < n; ++k)
+			{
+				matrix[row * n + k] ^= gf.mul(factor, matrix[col * n + k]);
+				inverse[row * n + k] ^= gf.mul(factor, inverse[col * n + k]);
+			}
+		}
+	}
+	matrix = std::move(inverse);
+}
+} // namespace
+
+std::vector<std::vector<uint8_t>> encode(
+        std::span<const std::span<const uint8_t>> data,
+        size_t parity_count,
+        size_t symbol_size)
+{
+	if (data.size() + parity_count > max_symbols)
+		throw std::invalid_argument("too many symbols for reed solomon encoder");
+
+	std::vector<std::vector<uint8_t>> parity(parity_count);
+	for (size_t row = 0; row < parity_count; ++row)
+	{
+		parity[row].resize(symbol_size, 0);
+		for (size_t column = 0; column < data.size(); ++column)
+			gf.mul_add(parity[row], data[column], coefficient(data.size(), row, column));
+	}
+	return parity;
+}
+
+bool reconstruct(
+        std::vector<std::vector<uint8_t>> & data,
+        std::span<const std::pair<uint8_t, std::span<const uint8_t>>> parity,
+        size_t symbol_size)
+{
+	const size_t data_count = data.size();
+	std::vector<size_t> missing;
+	for (size_t i = 0; i < data_count; ++i)
+	{
+		if (data[i].empty())
+			missing.push_back(i);
+	}
+
+	if (missing.empty())
+		return true;
+
+	const size_t n = missing.size();
+	if (parity.size() < n or data_count + parity.size() > max_symbols)
+		return false;
+
+	// Remove the contribution of known data from the parity symbols
+	std::vector<std::vector<uint8_t>> syndromes(n);
+	std::vector<uint8_t> matrix(n * n);
+	for (size_t row = 0; row < n; ++row)
+	{
+		const auto & [parity_row, symbol] = parity[row];
+		auto & syndrome = syndromes[row];
+		syndrome.assign(symbol.begin(), symbol.begin() + std::min(symbol.size(), symbol_size));
+		syndrome.resize(symbol_size, 0);
+
+		for (size_t column = 0; column < data_count; ++column)
+		{
+			if (not data[column].empty())
+				gf.mul_add(syndrome, data[column], coefficient(data_count, parity_row, column));
+		}
+
+		for (size_t k = 0; k < n; ++k)
+			matrix[row * n + k] = coefficient(data_count, parity_row, missing[k]);
+	}
+
+	invert(matrix, n);
+
+	for (size_t k = 0; k < n; ++k)
+	{
+		auto & symbol = data[missing[k]];
+		symbol.assign(symbol_size, 0);
+		for (size_t row = 0; row < n; ++row)
+			gf.mul_add(symbol, syndromes[row], matrix[k * n + row]);
+	}
+	return true;
+}
+
+} // namespace xrt::drivers::wivrn::reed_solomon
@@ -0,0 +1,52 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <utility>
+#include <vector>
+
+namespace xrt::drivers::wivrn::reed_solomon
+{
+
+// Systematic Reed-Solomon erasure code over GF(2^8), built on a Cauchy matrix.
+// Any data_count symbols out of the data_count + parity_count symbols of a
+// block are enough to recover the data.
+// Symbols shorter than symbol_size are implicitly padded with zeros.
+inline constexpr size_t max_symbols = 255;
+
+// Computes parity_count parity symbols of symbol_size bytes each
+std::vector<std::vector<uint8_t>> encode(
+        std::span<const std::span<const uint8_t>> data,
+        size_t parity_count,
+        size_t symbol_size);
+
+// Recovers missing data symbols in place.
+// data contains data_count elements, missing ones are empty vectors.
+// parity is a list of (parity index, parity symbol) pairs.
+// Returns false if there are not enough symbols to recover the data.
+bool reconstruct(
+        std::vector<std::vector<uint8_t>> & data,
+        std::span<const std::pair<uint8_t, std::span<const uint8_t>>> parity,
+        size_t symbol_size);
+
+} // namespace xrt::drivers::wivrn::reed_solomon
@@ -0,0 +1,70 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace utils
+{
+// Recycles byte buffers between users, to avoid allocations on hot paths such
+// as packet reception
+class buffer_pool
+{
+	std::mutex mutex;
+	std::vector<std::vector<uint8_t>> buffers;
+
+	static const size_t max_buffers = 2048;
+
+public:
+	static buffer_pool & instance()
+	{
+		static buffer_pool pool;
+		return pool;
+	}
+
+	// Get a buffer with at least the requested capacity, its size is set to capacity
+	std::vector<uint8_t> get(size_t capacity)
+	{
+		std::vector<uint8_t> res;
+		{
+			std::lock_guard lock(mutex);
+			if (not buffers.empty())
+			{
+				res = std::move(buffers.back());
+				buffers.pop_back();
+			}
+		}
+		res.resize(capacity);
+		return res;
+	}
+
+	void release(std::vector<uint8_t> && buffer)
+	{
+		if (buffer.capacity() == 0)
+			return;
+
+		std::lock_guard lock(mutex);
+		if (buffers.size() < max_buffers)
+			buffers.push_back(std::move(buffer));
+	}
+};
+} // namespace utils
@@ -0,0 +1,193 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "resampler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+namespace
+{
+int32_t load_pair(const int16_t * p)
+{
+	int32_t res;
+	memcpy(&res, p, sizeof(res));
+	return res;
+}
+
+// Generic kernel, returns the number of frames written
+size_t read_scalar(const int16_t * in, int16_t * out, size_t frames, int num_channels, double & position, double step)
+{
+	for (size_t i = 0; i < frames; ++i)
+	{
+		size_t index = position;
+		float t = position - index;
+		const int16_t * a = in + index * num_channels;
+		const int16_t * b = a + num_channels;
+		for (int c = 0; c < num_channels; ++c)
+			out[i * num_channels + c] = std::lrint(a[c] + (b[c] - a[c]) * t);
+		position += step;
+	}
+	return frames;
+}
+
+#if defined(__SSE2__)
+// 4 frames per iteration, the two samples of each frame are loaded as one 32 bit value
+size_t read_mono(const int16_t * in, int16_t * out, size_t frames, double & position, double step)
+{
+	size_t i = 0;
+	for (; i + 4 <= frames; i += 4)
+	{
+		size_t index[4];
+		float t[4];
+		for (int j = 0; j < 4; ++j, position += step)
+		{
+			index[j] = position;
+			t[j] = position - index[j];
+		}
+		__m128i v = _mm_set_epi32(load_pair(in + index[3]), load_pair(in + index[2]), load_pair(in + index[1]), load_pair(in + index[0]));
+		__m128 a = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_slli_epi32(v, 16), 16));
+		__m128 b = _mm_cvtepi32_ps(_mm_srai_epi32(v, 16));
+		__m128 r = _mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(b, a), _mm_loadu_ps(t)));
+		__m128i r16 = _mm_cvtps_epi32(r);
+		_mm_storel_epi64((__m128i *)(out + i), _mm_packs_epi32(r16, r16));
+	}
+	return i + read_scalar(in, out + i, frames - i, 1, position, step);
+}
+
+// 2 frames per iteration, the two frames of each output are loaded as one 64 bit value
+size_t read_stereo(const int16_t * in, int16_t * out, size_t frames, double & position, double step)
+{
+	size_t i = 0;
+	for (; i + 2 <= frames; i += 2)
+	{
+		__m128 r[2];
+		for (int j = 0; j < 2; ++j, position += step)
+		{
+			size_t index = position;
+			__m128 t = _mm_set1_ps(position - index);
+			__m128i v = _mm_loadl_epi64((const __m128i *)(in + index * 2));
+			__m128 ab = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16));
+			__m128 b = _mm_movehl_ps(ab, ab);
+			r[j] = _mm_add_ps(ab, _mm_mul_ps(_mm_sub_ps(b, ab), t));
+		}
+		__m128i r32 = _mm_cvtps_epi32(_mm_movelh_ps(r[0], r[1]));
+		_mm_storel_epi64((__m128i *)(out + i * 2), _mm_packs_epi32(r32, r32));
+	}
+	return i + read_scalar(in, out + i * 2, frames - i, 2, position, step);
+}
+#elif defined(__aarch64__)
+size_t read_mono(const int16_t * in, int16_t * out, size_t frames, double & position, double step)
+{
+	size_t i = 0;
+	for (; i + 4 <= frames; i += 4)
+	{
+		int32_t pairs[4];
+		float t[4];
+		for (int j = 0; j < 4; ++j, position += step)
+		{
+			size_t index = position;
+			pairs[j] = load_pair(in + index);
+			t[j] = position - index;
+		}
+		int32x4_t v = vld1q_s32(pairs);
+		float32x4_t a = vcvtq_f32_s32(vshrq_n_s32(vshlq_n_s32(v, 16), 16));
+		float32x4_t b = vcvtq_f32_s32(vshrq_n_s32(v, 16));
+		float32x4_t r = vfmaq_f32(a, vsubq_f32(b, a), vld1q_f32(t));
+		vst1_s16(out + i, vqmovn_s32(vcvtnq_s32_f32(r)));
+	}
+	return i + read_scalar(in, out + i, frames - i, 1, position, step);
+}
+
+size_t read_stereo(const int16_t * in, int16_t * out, size_t frames, double & position, double step)
+{
+	size_t i = 0;
+	for (; i + 2 <= frames; i += 2)
+	{
+		float32x2_t r[2];
+		for (int j = 0; j < 2; ++j, position += step)
+		{
+			size_t index = position;
+			float32x4_t ab = vcvtq_f32_s32(vmovl_s16(vld1_s16(in + index * 2)));
+			float32x2_t a = vget_low_f32(ab);
+			float32x2_t b = vget_high_f32(ab);
+			r[j] = vfma_n_f32(a, vsub_f32(b, a), position - index);
+		}
+		vst1_s16(out + i * 2, vqmovn_s32(vcvtnq_s32_f32(vcombine_f32(r[0], r[1]))));
+	}
+	return i + read_scalar(in, out + i * 2, frames - i, 2, position, step);
+}
+#endif
+} // namespace
+
+namespace utils
+{
+
+resampler::resampler(int num_channels) :
+        num_channels(num_channels)
+{
+}
+
+void resampler::push(std::span<const int16_t> new_samples)
+{
+	samples.insert(samples.end(), new_samples.begin(), new_samples.end());
+}
+
+size_t resampler::read(std::span<int16_t> output, double step)
+{
+	size_t input_frames = samples.size() / num_channels;
+	if (input_frames < 2)
+		return 0;
+
+	// Each output frame reads the input frame at floor(position) and the next one
+	double last = input_frames - 2;
+	size_t frames = std::min<size_t>(output.size() / num_channels, last < position ? 0 : (last - position) / step + 1);
+
+	size_t written;
+#if defined(__SSE2__) || defined(__aarch64__)
+	if (num_channels == 1)
+		written = read_mono(samples.data(), output.data(), frames, position, step);
+	else if (num_channels == 2)
+		written = read_stereo(samples.data(), output.data(), frames, position, step);
+	else
+#endif
+		written = read_scalar(samples.data(), output.data(), frames, num_channels, position, step);
+
+	size_t consumed = std::min<size_t>(position, input_frames);
+	samples.erase(samples.begin(), samples.begin() + consumed * num_channels);
+	position -= consumed;
+	return written;
+}
+
+void resampler::drop(size_t frames)
+{
+	frames = std::min(frames, samples.size() / num_channels);
+	samples.erase(samples.begin(), samples.begin() + frames * num_channels);
+	position = std::max(0., position - frames);
+}
+
+} // namespace utils
@@ -0,0 +1,60 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+namespace utils
+{
+
+// Buffers interleaved S16 samples and reads them with a fractional step by linear interpolation,
+// to compensate clock drift or adjust buffering without audible jumps.
+// Mono and stereo use SSE2 or NEON kernels when available.
+class resampler
+{
+	int num_channels;
+	std::vector<int16_t> samples;
+	// Read position in samples, in frames
+	double position = 0;
+
+public:
+	resampler(int num_channels);
+
+	void push(std::span<const int16_t> samples);
+
+	// Frames not read yet
+	double available() const
+	{
+		return samples.size() / num_channels - position;
+	}
+
+	// Fills up to output.size() / num_channels frames, advancing by step input frames for each of them.
+	// Returns the number of frames written, less than requested if there is not enough input.
+	size_t read(std::span<int16_t> output, double step);
+
+	// Discards frames from the beginning
+	void drop(size_t frames);
+};
+
+} // namespace utils
@@ -18,50 +18,123 @@
 
 #pragma once
 
+#include <algorithm>
 #include <array>
 #include <atomic>
+#include <bit>
 #include <cstddef>
 #include <optional>
+#include <span>
 
 namespace utils
 {
 
-// single writer/single reader rung buffer
+// std::hardware_destructive_interference_size is not stable across compiler flags, don't use it in headers
+inline constexpr size_t cache_line_size = 64;
+
+// single writer/single reader ring buffer holding up to capacity elements
 template <typename T, size_t capacity>
 class ring_buffer
 {
-	std::array<T, capacity> container;
-	// last position read
-	std::atomic<size_t> read_index = 0;
-	// last position written
-	std::atomic<size_t> write_index = 0;
+	static_assert(capacity > 0);
+
+	// Storage is rounded up to a power of two so that indices are masked instead of divided
+	static constexpr size_t storage_size = std::bit_ceil(capacity);
+	static constexpr size_t mask = storage_size - 1;
+
+	std::array<T, storage_size> container;
+
+	// Indices are never wrapped, only masked when accessing the container.
+	// Each one is only written by one side, keep them on separate cache lines
+	// along with the copy of the other side's index.
+	struct alignas(cache_line_size) writer_state
+	{
+		// next position to write
+		std::atomic<size_t> index = 0;
+		// last read_index seen by the writer
+		size_t cached_read = 0;
+	} writer;
+
+	struct alignas(cache_line_size) reader_state
+	{
+		// next position to read
+		std::atomic<size_t> index = 0;
+		// last write_index seen by the reader
+		size_t cached_write = 0;
+	} reader;
+
+	// The other side's index is only reloaded when the cached one does not allow wanted elements
+	size_t free_space(size_t wanted = 1)
+	{
+		const size_t w = writer.index.load(std::memory_order_relaxed);
+		if (capacity - (w - writer.cached_read) < wanted)
+			writer.cached_read = reader.index.load(std::memory_order_acquire);
+		return capacity - (w - writer.cached_read);
+	}
+
+	size_t available(size_t wanted = 1)
+	{
+		const size_t r = reader.index.load(std::memory_order_relaxed);
+		if (reader.cached_write - r < wanted)
+			reader.cached_write = writer.index.load(std::memory_order_acquire);
+		return reader.cached_write - r;
+	}
 
 public:
 	bool write(T && t)
 	{
-		size_t next_write = (write_index + 1) % capacity;
-		if (next_write == read_index)
+		if (free_space() == 0)
 			return false;
-		container[next_write] = std::move(t);
-		write_index.store(next_write);
+		const size_t w = writer.index.load(std::memory_order_relaxed);
+		container[w & mask] = std::move(t);
+		writer.index.store(w + 1, std::memory_order_release);
 		return true;
 	}
 
+	// Copies as many elements as possible, returns the number of elements written
+	size_t write(std::span<const T> items)
+	{
+		const size_t n = std::min(items.size(), free_space(items.size()));
+		if (n == 0)
+			return 0;
+		const size_t w = writer.index.load(std::memory_order_relaxed);
+		const size_t first = std::min(n, storage_size - (w & mask));
+		std::copy_n(items.begin(), first, container.begin() + (w & mask));
+		std::copy_n(items.begin() + first, n - first, container.begin());
+		writer.index.store(w + n, std::memory_order_release);
+		return n;
+	}
+
 	std::optional<T> read()
 	{
-		if (read_index == write_index)
+		if (available() == 0)
 			return {};
-		size_t next_read = (read_index + 1) % capacity;
-		T res = std::move(container[next_read]);
-		read_index.store(next_read);
-		return std::move(res);
+		const size_t r = reader.index.load(std::memory_order_relaxed);
+		T res = std::move(container[r & mask]);
+		reader.index.store(r + 1, std::memory_order_release);
+		return res;
+	}
+
+	// Moves as many elements as possible to items, returns the number of elements read
+	size_t read(std::span<T> items)
+	{
+		const size_t n = std::min(items.size(), available(items.size()));
+		if (n == 0)
+			return 0;
+		const size_t r = reader.index.load(std::memory_order_relaxed);
+		const size_t first = std::min(n, storage_size - (r & mask));
+		std::move(container.begin() + (r & mask), container.begin() + (r & mask) + first, items.begin());
+		std::move(container.begin(), container.begin() + (n - first), items.begin() + first);
+		reader.index.store(r + n, std::memory_order_release);
+		return n;
 	}
 
 	size_t size() const
 	{
-		size_t w = write_index;
-		size_t r = read_index;
-		return std::min(w - r, capacity + w - r);
+		const size_t r = reader.index.load(std::memory_order_acquire);
+		const size_t w = writer.index.load(std::memory_order_acquire);
+		// Both indices may have moved between the loads
+		return std::min(w - r, capacity);
 	}
 };
 
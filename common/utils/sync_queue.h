@@ -19,12 +19,16 @@
 
 #pragma once
 
+#include <algorithm>
 #include <cassert>
+#include <chrono>
 #include <condition_variable>
+#include <cstdint>
 #include <deque>
 #include <exception>
 #include <mutex>
 #include <optional>
+#include <vector>
 
 namespace utils
 {
@@ -37,29 +41,121 @@ public:
 	}
 };
 
+// What push does when the queue is full
+enum class overflow_policy
+{
+	block,       // wait until an item is popped
+	drop_oldest, // remove the item at the front of the queue
+	reject,      // do not add the item, push returns false
+};
+
+struct sync_queue_stats
+{
+	size_t depth;
+	size_t max_depth;
+	uint64_t pushed;
+	uint64_t dropped;  // removed by drop_oldest or drop_until
+	uint64_t rejected; // not added by reject
+	// Time spent in the queue by the popped items
+	std::chrono::nanoseconds average_latency;
+	std::chrono::nanoseconds max_latency;
+};
+
+// Multiple producers/multiple consumers queue, unbounded if capacity is 0.
+// For the single producer/single consumer case without locks, see ring_buffer
 template <typename T>
 class sync_queue
 {
-	std::deque<T> queue;
+	using clock = std::chrono::steady_clock;
+
+	struct entry
+	{
+		T item;
+		clock::time_point pushed;
+	};
+
+	std::deque<entry> queue;
 	std::condition_variable cv;
+	std::condition_variable cv_not_full;
 	std::mutex mutex;
 	bool closed = false;
 
-public:
-	void push(T && item)
+	const size_t capacity;
+	const overflow_policy policy;
+
+	size_t max_depth = 0;
+	uint64_t pushed = 0;
+	uint64_t popped = 0;
+	uint64_t dropped = 0;
+	uint64_t rejected = 0;
+	clock::duration total_latency{};
+	clock::duration max_latency{};
+
+	bool full() const
 	{
-		std::lock_guard lock(mutex);
+		return capacity and queue.size() >= capacity;
+	}
 
-		queue.push_back(std::move(item));
+	template <typename U>
+	bool push_locked(std::unique_lock<std::mutex> & lock, U && item)
+	{
+		if (full())
+		{
+			switch (policy)
+			{
+				case overflow_policy::block:
+					cv_not_full.wait(lock, [&]() { return !full() || closed; });
+					if (closed)
+						throw sync_queue_closed{};
+					break;
+				case overflow_policy::drop_oldest:
+					queue.pop_front();
+					dropped++;
+					break;
+				case overflow_policy::reject:
+					rejected++;
+					return false;
+			}
+		}
+
+		queue.push_back({std::forward<U>(item), clock::now()});
+		pushed++;
+		max_depth = std::max(max_depth, queue.size());
 		cv.notify_one();
+		return true;
 	}
 
-	void push(const T & item)
+	// Must be called with the lock held and the queue not empty
+	T pop_locked()
 	{
-		std::lock_guard lock(mutex);
+		assert(!queue.empty());
+		auto latency = clock::now() - queue.front().pushed;
+		total_latency += latency;
+		max_latency = std::max(max_latency, latency);
+		popped++;
 
-		queue.push_back(item);
-		cv.notify_one();
+		T item = std::move(queue.front().item);
+		queue.pop_front();
+		cv_not_full.notify_one();
+
+		return item;
+	}
+
+public:
+	sync_queue(size_t capacity = 0, overflow_policy policy = overflow_policy::block) :
+	        capacity(capacity), policy(policy) {}
+
+	// Returns false if the item was rejected because the queue is full
+	bool push(T && item)
+	{
+		std::unique_lock lock(mutex);
+		return push_locked(lock, std::move(item));
+	}
+
+	bool push(const T & item)
+	{
+		std::unique_lock lock(mutex);
+		return push_locked(lock, item);
 	}
 
 	template <typename Pred>
@@ -74,13 +170,8 @@ public:
 
 		assert(!queue.empty());
 
-		if (pred(queue.front()))
-		{
-			T item = std::move(queue.front());
-			queue.pop_front();
-
-			return item;
-		}
+		if (pred(queue.front().item))
+			return pop_locked();
 
 		return {};
 	}
@@ -94,11 +185,51 @@ public:
 		if (closed)
 			throw sync_queue_closed{};
 
-		assert(!queue.empty());
-		T item = std::move(queue.front());
-		queue.pop_front();
+		return pop_locked();
+	}
 
-		return item;
+	// Returns an empty optional on timeout
+	template <typename Rep, typename Period>
+	std::optional<T> pop_for(std::chrono::duration<Rep, Period> timeout)
+	{
+		std::unique_lock lock(mutex);
+
+		if (!cv.wait_for(lock, timeout, [&]() { return !queue.empty() || closed; }))
+			return {};
+
+		if (closed)
+			throw sync_queue_closed{};
+
+		return pop_locked();
+	}
+
+	std::optional<T> try_pop()
+	{
+		std::unique_lock lock(mutex);
+
+		if (closed)
+			throw sync_queue_closed{};
+
+		if (queue.empty())
+			return {};
+
+		return pop_locked();
+	}
+
+	// Removes all the items without waiting, the result is empty if there are none
+	std::vector<T> pop_all()
+	{
+		std::unique_lock lock(mutex);
+
+		if (closed)
+			throw sync_queue_closed{};
+
+		std::vector<T> items;
+		items.reserve(queue.size());
+		while (!queue.empty())
+			items.push_back(pop_locked());
+
+		return items;
 	}
 
 	template <typename Pred>
@@ -106,8 +237,12 @@ public:
 	{
 		std::unique_lock lock(mutex);
 
-		while (!queue.empty() && !pred(queue.front()))
+		while (!queue.empty() && !pred(queue.front().item))
+		{
 			queue.pop_front();
+			dropped++;
+			cv_not_full.notify_one();
+		}
 	}
 
 	T & peek()
@@ -120,7 +255,7 @@ public:
 			throw sync_queue_closed{};
 
 		assert(!queue.empty());
-		return queue.front();
+		return queue.front().item;
 	}
 
 	void close()
@@ -128,6 +263,21 @@ public:
 		std::lock_guard lock(mutex);
 		closed = true;
 		cv.notify_all();
+		cv_not_full.notify_all();
+	}
+
+	sync_queue_stats stats()
+	{
+		std::lock_guard lock(mutex);
+		return {
+		        .depth = queue.size(),
+		        .max_depth = max_depth,
+		        .pushed = pushed,
+		        .dropped = dropped,
+		        .rejected = rejected,
+		        .average_latency = popped ? std::chrono::duration_cast<std::chrono::nanoseconds>(total_latency / popped) : std::chrono::nanoseconds{},
+		        .max_latency = std::chrono::duration_cast<std::chrono::nanoseconds>(max_latency),
+		};
 	}
 };
 } // namespace utils
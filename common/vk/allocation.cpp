@@ -28,14 +28,32 @@
 std::pair<vk::raii::Buffer, VmaAllocation> basic_allocation_traits<VkBuffer>::create(
         vk::raii::Device & device,
         const CreateInfo & buffer_info,
-        const VmaAllocationCreateInfo & alloc_info)
+        const VmaAllocationCreateInfo & alloc_info,
+        memory_pool pool)
 {
 	VmaAllocator allocator = vk_allocator::instance();
 
 	VmaAllocation allocation;
 	VkBuffer tmp;
 
-	CHECK_VK(vmaCreateBuffer(allocator, &(NativeCreateInfo &)buffer_info, &alloc_info, &tmp, &allocation, nullptr));
+	VmaAllocationCreateInfo info = alloc_info;
+	if (pool != memory_pool::none)
+	{
+		uint32_t memory_type;
+		CHECK_VK(vmaFindMemoryTypeIndexForBufferInfo(allocator, &(NativeCreateInfo &)buffer_info, &alloc_info, &memory_type));
+		info.pool = vk_allocator::instance().pool(pool, memory_type);
+		info.flags |= VMA_ALLOCATION_CREATE_WITHIN_BUDGET_BIT;
+	}
+
+	VkResult result = vmaCreateBuffer(allocator, &(NativeCreateInfo &)buffer_info, &info, &tmp, &allocation, nullptr);
+	if (result == VK_ERROR_OUT_OF_DEVICE_MEMORY and (info.flags & VMA_ALLOCATION_CREATE_WITHIN_BUDGET_BIT))
+	{
+		// The driver may still be able to make room, the report tells how often this happens
+		vk_allocator::instance().count_over_budget();
+		info.flags &= ~VMA_ALLOCATION_CREATE_WITHIN_BUDGET_BIT;
+		result = vmaCreateBuffer(allocator, &(NativeCreateInfo &)buffer_info, &info, &tmp, &allocation, nullptr);
+	}
+	CHECK_VK(result, "vmaCreateBuffer");
 
 	return std::pair<vk::raii::Buffer, VmaAllocation>{vk::raii::Buffer{device, tmp}, allocation};
 }
@@ -72,14 +90,32 @@ void basic_allocation_traits_base::unmap(VmaAllocation allocation)
 std::pair<vk::raii::Image, VmaAllocation> basic_allocation_traits<VkImage>::create(
         vk::raii::Device & device,
         const CreateInfo & image_info,
-        const VmaAllocationCreateInfo & alloc_info)
+        const VmaAllocationCreateInfo & alloc_info,
+        memory_pool pool)
 {
 	VmaAllocator allocator = vk_allocator::instance();
 
 	VmaAllocation allocation;
 	VkImage tmp;
 
-	CHECK_VK(vmaCreateImage(allocator, &(NativeCreateInfo &)image_info, &alloc_info, &tmp, &allocation, nullptr));
+	VmaAllocationCreateInfo info = alloc_info;
+	if (pool != memory_pool::none)
+	{
+		uint32_t memory_type;
+		CHECK_VK(vmaFindMemoryTypeIndexForImageInfo(allocator, &(NativeCreateInfo &)image_info, &alloc_info, &memory_type));
+		info.pool = vk_allocator::instance().pool(pool, memory_type);
+		info.flags |= VMA_ALLOCATION_CREATE_WITHIN_BUDGET_BIT;
+	}
+
+	VkResult result = vmaCreateImage(allocator, &(NativeCreateInfo &)image_info, &info, &tmp, &allocation, nullptr);
+	if (result == VK_ERROR_OUT_OF_DEVICE_MEMORY and (info.flags & VMA_ALLOCATION_CREATE_WITHIN_BUDGET_BIT))
+	{
+		// The driver may still be able to make room, the report tells how often this happens
+		vk_allocator::instance().count_over_budget();
+		info.flags &= ~VMA_ALLOCATION_CREATE_WITHIN_BUDGET_BIT;
+		result = vmaCreateImage(allocator, &(NativeCreateInfo &)image_info, &info, &tmp, &allocation, nullptr);
+	}
+	CHECK_VK(result, "vmaCreateImage");
 
 	return std::pair<vk::raii::Image, VmaAllocation>{vk::raii::Image{device, tmp}, allocation};
 }
@@ -45,7 +45,8 @@ struct basic_allocation_traits<VkBuffer> : basic_allocation_traits_base
 	static std::pair<RaiiType, VmaAllocation> create(
 	        vk::raii::Device & device,
 	        const CreateInfo & buffer_info,
-	        const VmaAllocationCreateInfo & alloc_info);
+	        const VmaAllocationCreateInfo & alloc_info,
+	        memory_pool pool = memory_pool::none);
 
 	static void destroy(
 	        RaiiType & buffer,
@@ -63,7 +64,8 @@ struct basic_allocation_traits<VkImage> : basic_allocation_traits_base
 	static std::pair<RaiiType, VmaAllocation> create(
 	        vk::raii::Device & device,
 	        const CreateInfo & image_info,
-	        const VmaAllocationCreateInfo & alloc_info);
+	        const VmaAllocationCreateInfo & alloc_info,
+	        memory_pool pool = memory_pool::none);
 
 	static void destroy(
 	        RaiiType & image,
@@ -133,6 +135,21 @@ public:
 		vmaSetAllocationName(vk_allocator::instance(), allocation, name.c_str());
 	}
 
+	// Pooled allocations are made within the memory budget when possible
+	basic_allocation(vk::raii::Device & device, const CreateInfo & create_info, const VmaAllocationCreateInfo & alloc_info, memory_pool pool) :
+	        create_info(create_info)
+	{
+		std::tie(resource, allocation) = traits::create(device, create_info, alloc_info, pool);
+	}
+
+	basic_allocation(vk::raii::Device & device, const CreateInfo & create_info, const VmaAllocationCreateInfo & alloc_info, memory_pool pool, const std::string & name) :
+	        create_info(create_info)
+	{
+		std::tie(resource, allocation) = traits::create(device, create_info, alloc_info, pool);
+
+		vmaSetAllocationName(vk_allocator::instance(), allocation, name.c_str());
+	}
+
 	basic_allocation(const basic_allocation &) = delete;
 	basic_allocation(basic_allocation && other) :
 	        allocation(other.allocation),
@@ -188,6 +205,16 @@ public:
 	{
 		return create_info;
 	}
+
+	// Bytes of device memory used by the allocation, 0 if empty
+	VkDeviceSize allocated_size() const
+	{
+		if (not allocation)
+			return 0;
+		VmaAllocationInfo info;
+		vmaGetAllocationInfo(vk_allocator::instance(), allocation, &info);
+		return info.size;
+	}
 };
 
 using buffer_allocation = basic_allocation<vk::Buffer>;
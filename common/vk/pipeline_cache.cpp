@@ -0,0 +1,119 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "pipeline_cache.h"
+
+#include <cstring>
+#include <fstream>
+#include <system_error>
+
+namespace
+{
+struct pipeline_cache_header
+{
+	static constexpr uint32_t current_magic = 0x43505657; // "WVPC"
+
+	uint32_t magic;
+	uint32_t data_size;
+	uint64_t data_hash;
+
+	uint32_t vendor_id;
+	uint32_t device_id;
+	uint32_t driver_version;
+	uint32_t driver_abi;
+
+	uint8_t uuid[VK_UUID_SIZE];
+};
+
+uint64_t fnv1a(std::span<const std::byte> data)
+{
+	uint64_t hash = 0xcbf29ce484222325;
+	for (std::byte b: data)
+	{
+		hash ^= uint64_t(b);
+		hash *= 0x100000001b3;
+	}
+	return hash;
+}
+
+pipeline_cache_header make_header(const vk::PhysicalDeviceProperties & properties, std::span<const std::byte> data)
+{
+	pipeline_cache_header header{
+	        .magic = pipeline_cache_header::current_magic,
+	        .data_size = uint32_t(data.size()),
+	        .data_hash = fnv1a(data),
+	        .vendor_id = properties.vendorID,
+	        .device_id = properties.deviceID,
+	        .driver_version = properties.driverVersion,
+	        .driver_abi = sizeof(void *),
+	};
+	memcpy(header.uuid, properties.pipelineCacheUUID.data(), VK_UUID_SIZE);
+	return header;
+}
+} // namespace
+
+std::vector<std::byte> read_pipeline_cache(const std::filesystem::path & path, const vk::PhysicalDeviceProperties & properties)
+{
+	std::ifstream file(path, std::ios::binary);
+
+	pipeline_cache_header header;
+	if (not file.read(reinterpret_cast<char *>(&header), sizeof(header)))
+		return {};
+
+	// Check the device before reading the data
+	pipeline_cache_header expected = make_header(properties, {});
+	if (header.magic != expected.magic or
+	    header.vendor_id != expected.vendor_id or
+	    header.device_id != expected.device_id or
+	    header.driver_version != expected.driver_version or
+	    header.driver_abi != expected.driver_abi or
+	    memcmp(header.uuid, expected.uuid, VK_UUID_SIZE))
+		return {};
+
+	std::vector<std::byte> data(header.data_size);
+	if (not file.read(reinterpret_cast<char *>(data.data()), data.size()))
+		return {};
+
+	std::byte trailing;
+	if (file.read(reinterpret_cast<char *>(&trailing), 1) or fnv1a(data) != header.data_hash)
+		return {};
+
+	return data;
+}
+
+void write_pipeline_cache(const std::filesystem::path & path, const vk::PhysicalDeviceProperties & properties, std::span<const uint8_t> data)
+{
+	std::span<const std::byte> bytes = std::as_bytes(data);
+	pipeline_cache_header header = make_header(properties, bytes);
+
+	// Write to a temporary file so that an interrupted write does not leave a truncated cache
+	auto tmp = path;
+	tmp += ".tmp";
+
+	{
+		std::ofstream file(tmp, std::ios::binary | std::ios::trunc);
+		file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+		file.write(reinterpret_cast<const char *>(bytes.data()), bytes.size());
+		if (not file.flush())
+			throw std::system_error(errno, std::generic_category(), "Cannot write " + tmp.native());
+	}
+
+	std::filesystem::rename(tmp, path);
+}
@@ -0,0 +1,38 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <span>
+#include <vector>
+#include <vulkan/vulkan.hpp>
+
+// The pipeline cache is saved with a header identifying the device and the driver: some drivers do not validate
+// the data they are given, so a cache written by another GPU or driver version is discarded before reaching them.
+// See https://zeux.io/2019/07/17/serializing-pipeline-cache/
+
+// Returns an empty vector if the file does not exist or does not match the device
+std::vector<std::byte> read_pipeline_cache(const std::filesystem::path & path, const vk::PhysicalDeviceProperties & properties);
+
+// Throws on error, the file is replaced atomically
+void write_pipeline_cache(const std::filesystem::path & path, const vk::PhysicalDeviceProperties & properties, std::span<const uint8_t> data);
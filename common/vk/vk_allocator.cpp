@@ -27,6 +27,67 @@ vk_allocator::vk_allocator(const VmaAllocatorCreateInfo & info)
 
 vk_allocator::~vk_allocator()
 {
+	for (auto & [key, pool]: pools)
+		vmaDestroyPool(handle, pool);
+
 	if (handle)
 		vmaDestroyAllocator(handle);
 }
+
+VmaPool vk_allocator::pool(memory_pool type, uint32_t memory_type_index)
+{
+	if (type == memory_pool::none)
+		return nullptr;
+
+	std::lock_guard lock(mutex);
+	auto & pool = pools[{type, memory_type_index}];
+	if (pool)
+		return pool;
+
+	VmaPoolCreateInfo info{
+	        .memoryTypeIndex = memory_type_index,
+	};
+
+	CHECK_VK(vmaCreatePool(handle, &info, &pool));
+	vmaSetPoolName(handle, pool, type == memory_pool::frame ? "frame" : "staging");
+	return pool;
+}
+
+vk_allocator::report vk_allocator::get_report()
+{
+	report res;
+
+	const VkPhysicalDeviceMemoryProperties * properties;
+	vmaGetMemoryProperties(handle, &properties);
+
+	std::vector<VmaBudget> budgets(properties->memoryHeapCount);
+	vmaGetHeapBudgets(handle, budgets.data());
+
+	for (const VmaBudget & budget: budgets)
+	{
+		res.heaps.push_back({
+		        .usage = budget.usage,
+		        .budget = budget.budget,
+		        .allocated = budget.statistics.allocationBytes,
+		        .allocations = budget.statistics.allocationCount,
+		});
+	}
+
+	std::lock_guard lock(mutex);
+	for (auto & [key, pool]: pools)
+	{
+		VmaStatistics stats;
+		vmaGetPoolStatistics(handle, pool, &stats);
+		res.pools.push_back({
+		        .pool = key.first,
+		        .memory_type = key.second,
+		        .block_bytes = stats.blockBytes,
+		        .allocation_bytes = stats.allocationBytes,
+		        .allocations = stats.allocationCount,
+		});
+	}
+
+	res.over_budget_allocations = over_budget_allocations;
+
+	return res;
+}
@@ -22,11 +22,59 @@
 #include "utils/singleton.h"
 #include "vk_mem_alloc.h"
 
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+// Allocations of the same class are sub-allocated from their own pools, so
+// that large per-frame resources do not fragment the default blocks
+enum class memory_pool
+{
+	none,    // default VMA blocks
+	frame,   // per-frame images and buffers: swapchain images, yuv planes, decoded frames
+	staging, // host visible buffers used for transfers
+};
+
 class vk_allocator : public singleton<vk_allocator>
 {
 	VmaAllocator handle = nullptr;
 
+	std::mutex mutex;
+	std::map<std::pair<memory_pool, uint32_t>, VmaPool> pools;
+
+	// Allocations that did not fit in the budget and were made anyway
+	std::atomic<uint64_t> over_budget_allocations = 0;
+
 public:
+	struct heap_report
+	{
+		VkDeviceSize usage;
+		VkDeviceSize budget;
+		VkDeviceSize allocated; // by this process, through VMA
+		uint32_t allocations;
+	};
+
+	struct pool_report
+	{
+		memory_pool pool;
+		uint32_t memory_type;
+		VkDeviceSize block_bytes;
+		VkDeviceSize allocation_bytes;
+		uint32_t allocations;
+	};
+
+	struct report
+	{
+		std::vector<heap_report> heaps;
+		std::vector<pool_report> pools;
+		uint64_t over_budget_allocations;
+	};
+
+	// VMA_ALLOCATOR_CREATE_EXT_MEMORY_BUDGET_BIT should be set if VK_EXT_memory_budget is enabled,
+	// otherwise the budget is estimated
 	vk_allocator(const VmaAllocatorCreateInfo &);
 	~vk_allocator();
 
@@ -34,4 +82,14 @@ public:
 	{
 		return handle;
 	}
+
+	// Returns nullptr for memory_pool::none
+	VmaPool pool(memory_pool, uint32_t memory_type_index);
+
+	void count_over_budget()
+	{
+		++over_budget_allocations;
+	}
+
+	report get_report();
 };
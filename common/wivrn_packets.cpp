@@ -0,0 +1,235 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "wivrn_packets.h"
+
+#include "wivrn_quantization.h"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace xrt::drivers::wivrn;
+using shard = to_headset::video_stream_data_shard;
+
+// Decoding and encoding again must give the same bytes: the headset serializes the
+// received shards again for Reed-Solomon reconstruction.
+
+namespace
+{
+// Flags of the shard only use the low bits
+const uint8_t has_view_info = 1 << 6;
+const uint8_t has_timing_info = 1 << 7;
+
+// Quaternion components
+const float orientation_scale = 0x7fff;
+// Field of view angles, in 10th of mrad
+const float fov_scale = 10'000;
+// Timings relative to encode_begin, in 100ns
+const int64_t timing_unit = 100;
+const float qp_scale = 256;
+
+struct vector_writer
+{
+	std::vector<uint8_t> & buffer;
+
+	void write(const void * data, size_t size)
+	{
+		auto bytes = reinterpret_cast<const uint8_t *>(data);
+		buffer.insert(buffer.end(), bytes, bytes + size);
+	}
+};
+
+template <typename Writer, typename T>
+void put(Writer & w, const T & value)
+{
+	static_assert(std::is_trivially_copyable_v<T>);
+	w.write(&value, sizeof(value));
+}
+
+// LEB128: 7 bits per byte, the high bit is set when more bytes follow
+template <typename Writer>
+void put_varint(Writer & w, uint64_t value)
+{
+	uint8_t bytes[10];
+	size_t size = 0;
+	do
+	{
+		bytes[size] = value & 0x7f;
+		value >>= 7;
+		if (value)
+			bytes[size] |= 0x80;
+		++size;
+	} while (value);
+	w.write(bytes, size);
+}
+
+uint64_t get_varint(deserialization_packet & packet)
+{
+	uint64_t value = 0;
+	for (int shift = 0; shift < 64; shift += 7)
+	{
+		uint8_t byte = packet.deserialize<uint8_t>();
+		value |= uint64_t(byte & 0x7f) << shift;
+		if (not(byte & 0x80))
+			return value;
+	}
+	throw deserialization_error();
+}
+
+int16_t quantize(float value, float scale)
+{
+	return std::clamp<long>(std::lround(value * scale), -0x7fff, 0x7fff);
+}
+
+template <typename Writer>
+void put(Writer & w, const shard::view_info_t & info)
+{
+	put(w, info.display_time);
+	// Views are a few cm apart
+	put(w, info.pose[0].position);
+	put(w, pack(info.pose[1].position, info.pose[0].position));
+	for (const auto & pose: info.pose)
+	{
+		for (float c: {pose.orientation.x, pose.orientation.y, pose.orientation.z, pose.orientation.w})
+			put(w, quantize(c, orientation_scale));
+	}
+	for (const auto & fov: info.fov)
+	{
+		for (float angle: {fov.angleLeft, fov.angleRight, fov.angleUp, fov.angleDown})
+			put(w, quantize(angle, fov_scale));
+	}
+	for (const auto & foveation: info.foveation)
+	{
+		for (const auto & axis: {foveation.x, foveation.y})
+		{
+			for (double value: {axis.center, axis.scale, axis.a, axis.b})
+				put(w, float(value));
+		}
+	}
+	// Age of the tracking sample at display time in µs, all ones if unknown
+	uint32_t tracking_age = -1;
+	if (info.tracking_timestamp)
+		tracking_age = std::clamp<int64_t>((info.display_time - info.tracking_timestamp) / 1000, 0, 0xfffffffe);
+	put(w, tracking_age);
+}
+
+shard::view_info_t get_view_info(deserialization_packet & packet)
+{
+	shard::view_info_t info;
+	info.display_time = packet.deserialize<XrTime>();
+	info.pose[0].position = packet.deserialize<XrVector3f>();
+	info.pose[1].position = unpack(packet.deserialize<packed_position>(), info.pose[0].position);
+	for (auto & pose: info.pose)
+	{
+		for (float * c: {&pose.orientation.x, &pose.orientation.y, &pose.orientation.z, &pose.orientation.w})
+			*c = packet.deserialize<int16_t>() / orientation_scale;
+	}
+	for (auto & fov: info.fov)
+	{
+		for (float * angle: {&fov.angleLeft, &fov.angleRight, &fov.angleUp, &fov.angleDown})
+			*angle = packet.deserialize<int16_t>() / fov_scale;
+	}
+	for (auto & foveation: info.foveation)
+	{
+		for (auto * axis: {&foveation.x, &foveation.y})
+		{
+			for (double * value: {&axis->center, &axis->scale, &axis->a, &axis->b})
+				*value = packet.deserialize<float>();
+		}
+	}
+	uint32_t tracking_age = packet.deserialize<uint32_t>();
+	info.tracking_timestamp = tracking_age == uint32_t(-1) ? 0 : info.display_time - int64_t(tracking_age) * 1000;
+	return info;
+}
+
+template <typename Writer>
+void put(Writer & w, const shard::timing_info_t & info)
+{
+	auto relative = [&](XrTime t) -> int32_t {
+		return std::clamp<int64_t>((t - info.encode_begin) / timing_unit, INT32_MIN, INT32_MAX);
+	};
+	put(w, info.encode_begin);
+	put(w, relative(info.send_begin));
+	put(w, relative(info.send_end));
+	put_varint(w, info.bytes);
+	put(w, quantize(info.average_qp, qp_scale));
+}
+
+shard::timing_info_t get_timing_info(deserialization_packet & packet)
+{
+	shard::timing_info_t info;
+	info.encode_begin = packet.deserialize<XrTime>();
+	info.send_begin = info.encode_begin + packet.deserialize<int32_t>() * timing_unit;
+	info.send_end = info.encode_begin + packet.deserialize<int32_t>() * timing_unit;
+	info.bytes = get_varint(packet);
+	info.average_qp = packet.deserialize<int16_t>() / qp_scale;
+	return info;
+}
+
+template <typename Writer>
+void put_header(Writer & w, const shard & value)
+{
+	put(w, value.stream_item_idx);
+	put_varint(w, value.shard_idx);
+	if (value.shard_idx == 0)
+		put_varint(w, value.frame_idx);
+	else
+		put(w, uint16_t(value.frame_idx));
+	put(w, uint8_t(value.flags | (value.view_info ? has_view_info : 0) | (value.timing_info ? has_timing_info : 0)));
+	put_varint(w, value.offset);
+	if (value.view_info)
+		put(w, *value.view_info);
+	if (value.timing_info)
+		put(w, *value.timing_info);
+	put(w, uint16_t(value.payload.size()));
+}
+} // namespace
+
+void serialization_traits<shard>::serialize(const shard & value, serialization_packet & packet)
+{
+	put_header(packet, value);
+	packet.write(value.payload);
+}
+
+void serialization_traits<shard>::serialize_header(const shard & value, std::vector<uint8_t> & buffer)
+{
+	vector_writer w{buffer};
+	put_header(w, value);
+}
+
+shard serialization_traits<shard>::deserialize(deserialization_packet & packet)
+{
+	shard value;
+	value.stream_item_idx = packet.deserialize<uint8_t>();
+	value.shard_idx = get_varint(packet);
+	value.frame_idx = value.shard_idx == 0 ? get_varint(packet) : packet.deserialize<uint16_t>();
+	uint8_t flags = packet.deserialize<uint8_t>();
+	value.flags = flags & ~(has_view_info | has_timing_info);
+	value.offset = get_varint(packet);
+	if (flags & has_view_info)
+		value.view_info = get_view_info(packet);
+	if (flags & has_timing_info)
+		value.timing_info = get_timing_info(packet);
+	value.receive_time = packet.receive_time();
+	value.ecn = packet.ecn();
+	value.payload = packet.deserialize<std::span<uint8_t>>();
+	value.data = packet.deserialize<data_holder>();
+	return value;
+}
@@ -30,7 +30,7 @@
 #include <vulkan/vulkan_core.h>
 #include <openxr/openxr.h>
 
-#include "wivrn_serialization_types.h"
+#include "wivrn_serialization.h"
 
 namespace xrt::drivers::wivrn
 {
@@ -73,17 +73,64 @@ enum class device_id : uint8_t
 	RIGHT_THUMBSTICK_CLICK,  // /user/hand/right/input/thumbstick/click
 	RIGHT_THUMBSTICK_TOUCH,  // /user/hand/right/input/thumbstick/touch
 	RIGHT_THUMBREST_TOUCH,   // /user/hand/right/input/thumbrest/touch
+	EYE_GAZE,                // /user/eyes_ext/input/gaze_ext/pose
 };
 
 enum video_codec
 {
 	h265,
 	hevc = h265,
+	av1,
+	h264,
+	avc = h264,
 };
 
+// Optional features, each side sends the bits of the ones it implements in the handshake and a
+// feature is only used if both sides have it. The packets are still part of the protocol hash,
+// a feature that needs new packets or fields changes it once, its bit allows an implementation
+// to leave it out, or to disable it, without breaking the other side.
+enum class capability : uint8_t
+{
+	parity_shards,  // to_headset::video_stream_parity_shard
+	motion_vectors, // to_headset::video_stream_motion
+	depth,          // to_headset::video_stream_depth
+	quad_layers,    // to_headset::quad_layers
+	microphone_dtx, // microphone audio_data silence markers
+};
+
+constexpr uint64_t capability_bit(capability c)
+{
+	return uint64_t(1) << uint8_t(c);
+}
+
+// Unit quaternion quantized with the smallest three method: the largest
+// component is dropped and recomputed from the other three.
+// Components use 15 bits each, the index of the dropped one is stored in the
+// high bit of the first two values.
+struct packed_quaternion
+{
+	std::array<uint16_t, 3> value;
+};
+
+// Position relative to a reference point, in 10th of mm
+struct packed_position
+{
+	std::array<int16_t, 3> value;
+};
+
+enum class audio_codec : uint8_t
+{
+	raw, // interleaved S16 samples
+	opus,
+};
+
+// With capability::microphone_dtx, an empty payload from the microphone marks the start of
+// silence: nothing is sent until voice resumes and the receiver fills the gap with silence.
 struct audio_data
 {
 	XrTime timestamp;
+	// Incremented for each opus packet, to detect lost packets
+	uint32_t sequence = 0;
 	std::span<uint8_t> payload;
 	data_holder data;
 };
@@ -101,11 +148,38 @@ struct headset_info_packet
 	{
 		uint8_t num_channels;
 		uint32_t sample_rate;
+		// Supported codecs in addition to raw
+		std::vector<audio_codec> codecs;
 	};
 	std::optional<audio_description> speaker;
 	std::optional<audio_description> microphone;
 	std::array<XrFovf, 2> fov;
+	// Area of each view hidden by the lenses, from XR_KHR_visibility_mask, so that the applications
+	// do not render it. Vertices are at z = -1 in the view space, indices are triangles.
+	struct visibility_mask
+	{
+		std::vector<XrVector2f> vertices;
+		std::vector<uint32_t> indices;
+	};
+	std::array<std::optional<visibility_mask>, 2> hidden_area;
 	bool hand_tracking;
+	struct decoder_info
+	{
+		video_codec codec;
+		// average decoding time measured in previous sessions, in µs per megapixel, 0 if unknown
+		float decode_time;
+		// limits reported by the decoder, 0 if unknown
+		uint16_t max_width = 0;
+		uint16_t max_height = 0;
+		uint16_t max_instances = 0;
+		// pixels per second decoded by one instance, for the recommended size of both eyes side by side
+		float max_pixel_rate = 0;
+		bool low_latency = false;
+	};
+	// hardware decoders available on the headset
+	std::vector<decoder_info> decoders;
+	// capability_bit of the features the headset implements
+	uint64_t capabilities;
 };
 
 struct handshake
@@ -128,9 +202,12 @@ struct tracking
 	struct pose
 	{
 		device_id device;
-		XrPosef pose;
-		XrVector3f linear_velocity;
-		XrVector3f angular_velocity;
+		packed_quaternion orientation;
+		// Relative to tracking::origin
+		packed_position position;
+		// Only set if the matching flag is valid
+		std::optional<XrVector3f> linear_velocity;
+		std::optional<XrVector3f> angular_velocity;
 		uint8_t flags;
 	};
 
@@ -144,6 +221,8 @@ struct tracking
 	XrTime production_timestamp;
 	XrTime timestamp;
 	XrViewStateFlags flags;
+	// Reference for the positions of device_poses, the head position
+	XrVector3f origin;
 
 	std::array<view, 2> views;
 	std::vector<pose> device_poses;
@@ -167,9 +246,12 @@ struct hand_tracking
 	};
 	struct pose
 	{
-		XrPosef pose;
-		XrVector3f linear_velocity;
-		XrVector3f angular_velocity;
+		packed_quaternion orientation;
+		// Relative to hand_tracking::origin
+		packed_position position;
+		// Only set if the matching flag is valid
+		std::optional<XrVector3f> linear_velocity;
+		std::optional<XrVector3f> angular_velocity;
 		// In order to avoid packet fragmentation
 		// use 2 less bytes for radius
 		uint16_t radius; // 10th of mm
@@ -179,15 +261,19 @@ struct hand_tracking
 	XrTime production_timestamp;
 	XrTime timestamp;
 	hand_id hand;
+	// Reference for the positions of joints, the palm position
+	XrVector3f origin;
 	std::optional<std::array<pose, XR_HAND_JOINT_COUNT_EXT>> joints;
 };
 
+// Only the values changed since the previous packet, all of them are sent periodically
 struct inputs
 {
 	struct input_value
 	{
 		device_id id;
-		float value;
+		// Fixed point from -1 to 1, see pack_input
+		int16_t value;
 		XrTime last_change_time;
 	};
 	std::vector<input_value> values;
@@ -213,9 +299,168 @@ struct feedback
 	XrTime displayed;
 
 	uint8_t times_displayed;
+	// Data shards received with the Congestion Experienced ECN mark
+	uint16_t congestion_marks;
+	// Slices that were missing when the frame was decoded with error concealment,
+	// the next frames must not depend on it
+	uint16_t lost_slices;
+};
+
+// Feedback of the frames handled since the previous batch, sent on the stream
+// socket every few ms instead of one packet per frame
+struct feedback_batch
+{
+	// Totals since the session started, for each stream: the server compares
+	// them with the records it received to account for the lost batches
+	struct stream_counters
+	{
+		// Frames reported for the first time
+		uint32_t frames;
+		// Frames that were not decoded, or decoded with lost slices
+		uint32_t lost;
+		// Most recent frame that was not decoded
+		uint64_t last_lost;
+		// Frames decoded but never displayed: a newer frame was ready or they were too late for their display time
+		uint32_t skipped;
+	};
+
+	uint32_t sequence;
+	std::vector<feedback> frames;
+	std::vector<stream_counters> streams;
 };
 
-using packets = std::variant<headset_info_packet, feedback, audio_data, handshake, tracking, hand_tracking, inputs, timesync_response>;
+// Request retransmission of missing video shards
+struct video_stream_nack
+{
+	uint64_t frame_index;
+	uint8_t stream_index;
+	uint16_t first_shard;
+	uint16_t shard_count;
+};
+
+// Reception statistics of the UDP sockets, since the previous report
+struct network_stats
+{
+	struct flow
+	{
+		uint32_t received;
+		uint32_t lost;
+		uint32_t reordered;
+		// Inter-arrival jitter, in µs
+		float jitter;
+	};
+
+	// State of the Wi-Fi connection of the headset, when sampling it is possible
+	struct wifi_link
+	{
+		// dBm
+		int8_t rssi;
+		// Negotiated PHY rates in Mbps, 0 if unknown
+		uint16_t tx_rate;
+		uint16_t rx_rate;
+		// MHz
+		uint16_t frequency;
+	};
+
+	// Measured by the audio callbacks of the headset, when audio is streamed
+	struct audio_latency
+	{
+		// From the server timestamp of the speaker samples to when they are played, including the jitter buffer
+		XrDuration speaker;
+		// Buffer and hardware latency of the output stream alone
+		XrDuration speaker_output;
+		// From the capture of the microphone samples to when the headset gets them
+		XrDuration microphone;
+		// Output underruns reported by the system, since the previous report
+		uint32_t xruns;
+	};
+
+	// GPU time of the headset render passes, averaged over the frames since the previous report
+	struct gpu_passes
+	{
+		uint32_t frames;
+		XrDuration quad_layers;
+		// Layout transitions of the decoded images
+		XrDuration transition;
+		std::array<XrDuration, 2> reprojection;
+		// Performance metrics overlay, 0 when hidden
+		XrDuration overlay;
+		XrDuration total;
+		// Longest total of a single frame
+		XrDuration max_total;
+	};
+
+	// Distribution of a duration over the frames since the previous report
+	struct percentiles
+	{
+		uint32_t count;
+		XrDuration mean;
+		XrDuration p50;
+		XrDuration p95;
+		XrDuration p99;
+	};
+
+	// Stages of the frames displayed since the previous report, measured by the headset
+	struct frame_stages
+	{
+		// From the first to the last received packet
+		percentiles receive;
+		// From the submission to the decoder to the decoded image
+		percentiles decode;
+		// From the decoded image to the first frame it is used in
+		percentiles queue;
+		// From the start of that frame to its predicted display time
+		percentiles display;
+		// Render thread, CPU and GPU time of each displayed frame
+		percentiles cpu;
+		percentiles gpu;
+	};
+
+	XrTime timestamp;
+	flow stream;
+	flow low_latency;
+	// One for each additional video socket
+	std::vector<flow> video;
+	std::optional<wifi_link> wifi;
+	std::optional<audio_latency> audio;
+	std::optional<gpu_passes> gpu;
+	std::optional<frame_stages> stages;
+};
+
+// Reception of the link probe packets, sent on the control socket once the last one
+// is received or they stopped arriving
+struct link_probe_result
+{
+	struct burst
+	{
+		uint16_t received;
+		// Payload bytes received after the first packet of the burst
+		uint32_t bytes;
+		// Time between the first and the last received packet of the burst
+		XrDuration dispersion;
+	};
+	std::vector<burst> bursts;
+	// Time between the last received packet and this result
+	XrDuration reply_delay;
+};
+
+// Notifications of the headset runtime about its CPU and GPU (XR_EXT_performance_settings)
+// and Android thermal status, sent when they change
+struct performance_state
+{
+	enum class level : uint8_t
+	{
+		normal,
+		warning,
+		impaired,
+	};
+	// Worst level of the thermal notifications and of the forecast Android thermal status
+	level thermal;
+	// Worst level of the compositing and rendering notifications
+	level load;
+};
+
+using packets = std::variant<headset_info_packet, feedback_batch, audio_data, handshake, tracking, hand_tracking, inputs, timesync_response, video_stream_nack, network_stats, link_probe_result, performance_state>;
 } // namespace from_headset
 
 namespace to_headset
@@ -225,6 +470,14 @@ struct handshake
 {
 	// -1 if stream socket should not be used
 	int stream_port;
+	// Port for the low latency socket, -1 if it should not be used
+	int low_latency_port;
+	// capability_bit of the features the server implements
+	uint64_t capabilities;
+	// Additional sockets the headset connects to stream_port for the video streams,
+	// set up one after the other like the low latency socket
+	static constexpr int max_video_sockets = 7;
+	int video_sockets = 0;
 };
 
 struct audio_stream_description
@@ -233,6 +486,11 @@ struct audio_stream_description
 	{
 		uint8_t num_channels;
 		uint32_t sample_rate;
+		audio_codec codec = audio_codec::raw;
+		// Samples per channel in each packet, only for opus
+		uint16_t frame_size = 0;
+		// Added to the playback latency, only for the speaker
+		XrDuration offset = 0;
 	};
 	std::optional<device> speaker;
 	std::optional<device> microphone;
@@ -253,6 +511,22 @@ struct video_stream_description
 		video_codec codec;
 		std::optional<VkSamplerYcbcrRange> range;
 		std::optional<VkSamplerYcbcrModelConversion> color_model;
+		// Part of the stream the item is a scaled copy of, when it is not the rectangle at its offset.
+		// Items are drawn in order, scaled ones are sent first so that the others are drawn over them.
+		struct source_rect
+		{
+			uint16_t offset_x;
+			uint16_t offset_y;
+			uint16_t width;
+			uint16_t height;
+
+			bool operator==(const source_rect &) const = default;
+		};
+		std::optional<source_rect> source;
+		// Frames with missing shards are decoded without their incomplete slices, the decoder conceals them
+		bool error_concealment = false;
+
+		bool operator==(const item &) const = default;
 	};
 	struct foveation_parameter_item
 	{
@@ -260,36 +534,55 @@ struct video_stream_description
 		double scale;
 		double a;
 		double b;
+
+		bool operator==(const foveation_parameter_item &) const = default;
 	};
 	struct foveation_parameter
 	{
 		foveation_parameter_item x;
 		foveation_parameter_item y;
+
+		bool operator==(const foveation_parameter &) const = default;
 	};
 	uint16_t width;
 	uint16_t height;
+	// Refresh rate of the headset
 	float fps;
+	// Each frame is displayed for this many refresh periods, the headset reprojects it to the latest pose in between
+	uint8_t periods_per_frame = 1;
 	std::array<foveation_parameter, 2> foveation;
 	std::vector<item> items;
+
+	bool operator==(const video_stream_description &) const = default;
 };
 
 class video_stream_data_shard
 {
 public:
 	inline static const size_t max_payload_size = 1400;
+	// When the stream goes through TCP, there is no MTU: shards are only limited
+	// by the 16 bit sizes of the framing and of the payload
+	inline static const size_t max_tcp_payload_size = 65000;
 	enum flags : uint8_t
 	{
 		start_of_slice = 1,
 		end_of_slice = 1 << 1,
 		end_of_frame = 1 << 2,
+		// No other frame depends on this one, it can be dropped without breaking the stream
+		non_reference = 1 << 3,
 	};
+	// Serialized size of view_info, it reduces the payload of the first shard
+	inline static const size_t view_info_size = 126;
 	// Identifier of stream in video_stream_description
 	uint8_t stream_item_idx;
-	// Counter increased for each frame
+	// Counter increased for each frame. Only the first shard of a frame has the
+	// full index, the others have the low 16 bits: see extend_frame_index
 	uint64_t frame_idx;
 	// Identifier of the shard within the frame
 	uint16_t shard_idx;
 	uint8_t flags;
+	// Position of the payload in the encoded frame
+	uint32_t offset;
 
 	// Position information, must be present on first video shard
 	struct view_info_t
@@ -299,6 +592,11 @@ public:
 
 		std::array<XrPosef, 2> pose;
 		std::array<XrFovf, 2> fov;
+		// Foveation used by the server for this frame, the scale does not change during a stream
+		std::array<video_stream_description::foveation_parameter, 2> foveation;
+		// production_timestamp of the newest tracking sample when the views were computed,
+		// 0 if unknown
+		XrTime tracking_timestamp;
 	};
 	std::optional<view_info_t> view_info;
 
@@ -308,8 +606,16 @@ public:
 		XrTime encode_begin;
 		XrTime send_begin;
 		XrTime send_end;
+		// Size of the encoded frame
+		uint32_t bytes;
+		// Negative if the encoder does not report it
+		float average_qp;
 	};
 	std::optional<timing_info_t> timing_info;
+	// Not serialized: CLOCK_MONOTONIC time the datagram was received by the kernel, 0 if unknown
+	int64_t receive_time = 0;
+	// Not serialized: ECN codepoint of the datagram, 0 if unknown
+	uint8_t ecn = 0;
 	// Actual video data, may contain multiple NAL units
 	std::span<uint8_t> payload;
 
@@ -317,12 +623,46 @@ public:
 	data_holder data;
 };
 
+// Full index of a frame from the low 16 bits received in a shard, returns the
+// closest one to reference
+inline uint64_t extend_frame_index(uint64_t truncated, uint64_t reference)
+{
+	int16_t diff = uint16_t(truncated) - uint16_t(reference);
+	if (diff < 0 and uint64_t(-diff) > reference)
+		return 0;
+	return reference + diff;
+}
+
+// Reed-Solomon parity for a block of consecutive video_stream_data_shard.
+// Data symbols are the serialized shards, padded with zeros to the size of the
+// parity payload.
+struct video_stream_parity_shard
+{
+	uint8_t stream_item_idx;
+	uint64_t frame_idx;
+	// Identifier of the first data shard of the block
+	uint16_t first_data_shard;
+	uint8_t data_shard_count;
+	// Identifier of this shard within the parity shards of the block
+	uint8_t parity_idx;
+	uint8_t parity_count;
+	std::span<uint8_t> payload;
+
+	// Container for the data, read payload instead
+	data_holder data;
+};
+
 struct haptics
 {
 	device_id id;
 	std::chrono::nanoseconds duration;
 	float frequency;
 	float amplitude;
+	// Headset time at which the vibration should start: the predicted display time
+	// of the frames being rendered, so that it matches the image. 0 to start it on arrival
+	XrTime start;
+	// Each packet is sent twice in case a datagram is lost, the headset ignores the copy
+	uint32_t sequence;
 };
 
 struct timesync_query
@@ -332,11 +672,133 @@ struct timesync_query
 
 struct prediction_offset
 {
+	// How far in the future the head and views should be sampled
 	std::chrono::nanoseconds offset;
+	// Same for the controllers and hands, which are requested at different times
+	std::chrono::nanoseconds hand_offset;
+	// Next expected wake up of the compositor in the headset clock, 0 if the
+	// compositor is idle. The following ones are every wake_up_period.
+	XrTime next_wake_up;
+	std::chrono::nanoseconds wake_up_period;
+	// From the wake up to the predicted display time of the frame
+	std::chrono::nanoseconds display_offset;
+	// Time for a tracking sample to reach the server
+	std::chrono::nanoseconds uplink;
+};
+
+// Sent when the server stops or resumes sending video, because no application
+// submits layers. While idle, the headset keeps displaying the last frame.
+struct video_stream_idle
+{
+	bool idle;
+};
+
+// Motion of the content of a frame since the previous one, sent after the frame when
+// motion extrapolation is enabled. The headset extrapolates the frame with it until the next one.
+struct video_stream_motion
+{
+	// Size in pixels of the stream of the blocks
+	inline static const int block_size = 64;
+	uint64_t frame_idx;
+	// Time between the display of the previous frame and this one
+	std::chrono::nanoseconds interval;
+	// Number of blocks
+	uint16_t width;
+	uint16_t height;
+	// Motion of each block in raster order, x then y, in half pixels of the stream
+	std::vector<int8_t> vectors;
 };
 
-using packets = std::variant<handshake, audio_stream_description, video_stream_description, audio_data, video_stream_data_shard, haptics, timesync_query, prediction_offset>;
+// Distance of the content of a view of a frame, from the depth layer of the application,
+// on a coarse grid of the foveated view. Sent before the frame when the depth stream is enabled.
+struct video_stream_depth
+{
+	inline static const int grid_size = 32;
+	// Values are 255 * min_distance / distance, 0 for infinity
+	inline static constexpr float min_distance = 0.1;
+	uint64_t frame_idx;
+	uint8_t view;
+	// grid_size * grid_size values in raster order
+	std::vector<uint8_t> values;
+};
+
+// Quad layers of the application, sent on the control socket when they are added,
+// removed, moved or their image changed. With quad_layers enabled they are not
+// composited in the video stream, the headset submits them as XrCompositionLayerQuad.
+struct quad_layers
+{
+	struct item
+	{
+		// Stays the same for a layer across packets
+		uint8_t id;
+		// The pose is relative to the head instead of the reference space of the views
+		bool head_locked;
+		bool unpremultiplied_alpha;
+		bool srgb;
+		XrPosef pose;
+		XrExtent2Df size;
+		// Size of the image, RGBA8
+		uint16_t width;
+		uint16_t height;
+		// Part of the image that changed, pixels are empty if there is none
+		uint16_t update_x;
+		uint16_t update_y;
+		uint16_t update_width;
+		uint16_t update_height;
+		// Rows of the updated part, compressed with rle_encode
+		std::vector<uint8_t> pixels;
+	};
+	// All the layers to display, from back to front
+	std::vector<item> items;
+};
+
+// Sent in back to back bursts on the stream socket after the handshake, the
+// dispersion of each burst at the headset gives the capacity of the link
+struct link_probe
+{
+	uint8_t burst;
+	uint8_t burst_count;
+	uint16_t index;
+	uint16_t count;
+	std::vector<uint8_t> padding;
+};
+
+using packets = std::variant<handshake, audio_stream_description, video_stream_description, audio_data, video_stream_data_shard, haptics, timesync_query, prediction_offset, video_stream_parity_shard, video_stream_idle, video_stream_motion, video_stream_depth, link_probe, quad_layers>;
 
 } // namespace to_headset
 
+// Video shards are most of the traffic, they have a compact encoding instead of
+// the generic one: variable length integers, truncated frame index, quantized view
+// information and timings relative to encode_begin
+template <>
+struct serialization_traits<to_headset::video_stream_data_shard>
+{
+	static constexpr void type_hash(details::hash_context & h)
+	{
+		h.feed("video_stream_data_shard{compact,1}");
+	}
+
+	static void serialize(const to_headset::video_stream_data_shard &, serialization_packet &);
+	static to_headset::video_stream_data_shard deserialize(deserialization_packet &);
+
+	// Appends everything but the payload bytes, the same as serialize
+	static void serialize_header(const to_headset::video_stream_data_shard &, std::vector<uint8_t> &);
+};
+
+// Small time-critical packets, sent on the low latency socket when it is available
+template <typename T>
+inline constexpr bool low_latency_packet = false;
+template <>
+inline constexpr bool low_latency_packet<from_headset::tracking> = true;
+template <>
+inline constexpr bool low_latency_packet<from_headset::hand_tracking> = true;
+template <>
+inline constexpr bool low_latency_packet<from_headset::inputs> = true;
+template <>
+inline constexpr bool low_latency_packet<from_headset::timesync_response> = true;
+template <>
+inline constexpr bool low_latency_packet<to_headset::haptics> = true;
+template <>
+inline constexpr bool low_latency_packet<to_headset::timesync_query> = true;
+
 } // namespace xrt::drivers::wivrn
@@ -0,0 +1,121 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "wivrn_packets.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <openxr/openxr.h>
+
+namespace xrt::drivers::wivrn
+{
+
+namespace details
+{
+// The 3 smallest components of a unit quaternion are in [-1/√2, 1/√2]
+inline constexpr float quaternion_component_max = 0.70710678f;
+inline constexpr float quaternion_scale = 0x7fff / 2.f;
+// 10th of mm
+inline constexpr float position_scale = 10'000;
+inline constexpr float input_scale = 0x7fff;
+} // namespace details
+
+inline packed_quaternion pack(const XrQuaternionf & q)
+{
+	const std::array<float, 4> c{q.x, q.y, q.z, q.w};
+
+	int largest = 0;
+	for (int i = 1; i < 4; ++i)
+	{
+		if (std::abs(c[i]) > std::abs(c[largest]))
+			largest = i;
+	}
+
+	// q and -q are the same rotation, make the dropped component positive
+	const float sign = c[largest] < 0 ? -1 : 1;
+
+	packed_quaternion res{};
+	for (int i = 0, j = 0; i < 4; ++i)
+	{
+		if (i == largest)
+			continue;
+		float v = std::clamp(sign * c[i] / details::quaternion_component_max, -1.f, 1.f);
+		res.value[j++] = std::lround((v + 1) * details::quaternion_scale);
+	}
+
+	res.value[0] |= (largest & 1) << 15;
+	res.value[1] |= (largest & 2) << 14;
+	return res;
+}
+
+inline XrQuaternionf unpack(const packed_quaternion & q)
+{
+	const int largest = (q.value[0] >> 15) | ((q.value[1] >> 15) << 1);
+
+	std::array<float, 4> c;
+	float sum = 0;
+	for (int i = 0, j = 0; i < 4; ++i)
+	{
+		if (i == largest)
+			continue;
+		c[i] = ((q.value[j++] & 0x7fff) / details::quaternion_scale - 1) * details::quaternion_component_max;
+		sum += c[i] * c[i];
+	}
+	c[largest] = std::sqrt(std::max(0.f, 1 - sum));
+
+	return {c[0], c[1], c[2], c[3]};
+}
+
+inline packed_position pack(const XrVector3f & position, const XrVector3f & origin)
+{
+	auto quantize = [](float v) -> int16_t {
+		return std::clamp<long>(std::lround(v * details::position_scale), -0x7fff, 0x7fff);
+	};
+	return {{
+	        quantize(position.x - origin.x),
+	        quantize(position.y - origin.y),
+	        quantize(position.z - origin.z),
+	}};
+}
+
+inline XrVector3f unpack(const packed_position & position, const XrVector3f & origin)
+{
+	return {
+	        origin.x + position.value[0] / details::position_scale,
+	        origin.y + position.value[1] / details::position_scale,
+	        origin.z + position.value[2] / details::position_scale,
+	};
+}
+
+// Booleans are 0 or 1, analog values are from -1 to 1
+inline int16_t pack_input(float value)
+{
+	return std::lround(std::clamp(value, -1.f, 1.f) * details::input_scale);
+}
+
+inline float unpack_input(int16_t value)
+{
+	return value / details::input_scale;
+}
+
+} // namespace xrt::drivers::wivrn
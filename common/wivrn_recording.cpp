@@ -0,0 +1,89 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "wivrn_recording.h"
+
+#include <cstring>
+#include <stdexcept>
+
+namespace xrt::drivers::wivrn
+{
+
+recording_writer::recording_writer(const std::filesystem::path & path) :
+        file(path, std::ios::binary | std::ios::trunc)
+{
+	if (not file)
+		throw std::runtime_error("Cannot create recording file " + path.string());
+
+	recording_header header;
+	file.write((const char *)&header, sizeof(header));
+}
+
+void recording_writer::write(int64_t timestamp, serialization_packet & packet)
+{
+	std::vector<uint8_t> data = packet.flatten();
+	uint32_t size = data.size();
+
+	std::lock_guard lock(mutex);
+	if (not start)
+		start = timestamp;
+	int64_t time = timestamp - *start;
+
+	file.write((const char *)&time, sizeof(time));
+	file.write((const char *)&size, sizeof(size));
+	file.write((const char *)data.data(), data.size());
+	// Keep the file usable if the server does not exit cleanly
+	file.flush();
+}
+
+recording_reader::recording_reader(const std::filesystem::path & path) :
+        file(path, std::ios::binary)
+{
+	if (not file)
+		throw std::runtime_error("Cannot open recording file " + path.string());
+
+	recording_header expected;
+	recording_header header;
+	if (not file.read((char *)&header, sizeof(header)) or memcmp(header.magic, expected.magic, sizeof(header.magic)))
+		throw std::runtime_error(path.string() + " is not a WiVRn recording");
+
+	if (header.protocol != expected.protocol)
+		throw std::runtime_error(path.string() + " was recorded with another protocol version");
+}
+
+std::optional<recording_reader::record> recording_reader::read()
+{
+	int64_t time;
+	uint32_t size;
+	if (not file.read((char *)&time, sizeof(time)) or not file.read((char *)&size, sizeof(size)))
+		return {};
+
+	std::vector<uint8_t> data(size);
+	if (not file.read((char *)data.data(), size))
+		return {};
+
+	deserialization_packet packet(std::move(data));
+	return record{
+	        .time = time,
+	        .packet = packet.deserialize<from_headset::packets>(),
+	};
+}
+
+} // namespace xrt::drivers::wivrn
@@ -0,0 +1,101 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "wivrn_packets.h"
+#include "wivrn_serialization.h"
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <optional>
+#include <type_traits>
+#include <variant>
+
+namespace xrt::drivers::wivrn
+{
+
+// File of packets received from the headset, with the time they were received.
+// Written by the server when WIVRN_RECORD is set, replayed by wivrn-headset-replay.
+//
+// Layout: header, then for each packet its time in ns relative to the first one,
+// its size and its serialization as a from_headset::packets.
+struct recording_header
+{
+	char magic[8] = {'W', 'i', 'V', 'R', 'n', 'R', 'e', 'c'};
+	// Recordings are only readable by the same protocol version
+	uint64_t protocol = serialization_type_hash<from_headset::packets>();
+};
+
+class recording_writer
+{
+	std::mutex mutex;
+	std::ofstream file;
+	std::optional<int64_t> start;
+
+	void write(int64_t timestamp, serialization_packet & packet);
+
+public:
+	explicit recording_writer(const std::filesystem::path & path);
+
+	// timestamp in ns, from any monotonic clock
+	template <typename T>
+	void write(int64_t timestamp, const T & packet)
+	{
+		thread_local serialization_packet p;
+		p.clear();
+		p.serialize(variant_index<T>((from_headset::packets *)nullptr));
+		p.serialize(packet);
+		write(timestamp, p);
+	}
+
+private:
+	template <typename T, typename... Ts>
+	static constexpr uint8_t variant_index(std::variant<Ts...> *)
+	{
+		uint8_t index = 0;
+		// Stops at the first matching type
+		((std::is_same_v<T, Ts> ? false : (++index, true)) and ...);
+		return index;
+	}
+};
+
+class recording_reader
+{
+	std::ifstream file;
+
+public:
+	struct record
+	{
+		// ns since the first packet
+		int64_t time;
+		from_headset::packets packet;
+	};
+
+	// Throws if the file is not a recording of this protocol version
+	explicit recording_reader(const std::filesystem::path & path);
+
+	// Empty at the end of the file
+	std::optional<record> read();
+};
+
+} // namespace xrt::drivers::wivrn
@@ -0,0 +1,112 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <vector>
+
+namespace xrt::drivers::wivrn
+{
+
+// Lossless run length encoding of 32 bit pixels, for images with large uniform areas
+// such as user interfaces. Each block starts with a byte n:
+//  - n < 128: n + 1 literal pixels follow
+//  - n >= 128: the following pixel is repeated n - 126 times
+inline std::vector<uint8_t> rle_encode(std::span<const uint32_t> pixels)
+{
+	std::vector<uint8_t> res;
+	res.reserve(pixels.size());
+
+	auto push_pixels = [&](const uint32_t * begin, size_t count) {
+		size_t size = res.size();
+		res.resize(size + 4 * count);
+		memcpy(res.data() + size, begin, 4 * count);
+	};
+
+	size_t i = 0;
+	size_t literal_begin = 0;
+	auto flush_literal = [&]() {
+		while (literal_begin < i)
+		{
+			size_t count = std::min<size_t>(i - literal_begin, 128);
+			res.push_back(count - 1);
+			push_pixels(pixels.data() + literal_begin, count);
+			literal_begin += count;
+		}
+	};
+
+	while (i < pixels.size())
+	{
+		size_t run = 1;
+		while (i + run < pixels.size() and run < 129 and pixels[i + run] == pixels[i])
+			++run;
+
+		// A run of 2 pixels is as long as a literal, only break literals for longer ones
+		if (run >= 3 or (run == 2 and literal_begin == i))
+		{
+			flush_literal();
+			res.push_back(run + 126);
+			push_pixels(pixels.data() + i, 1);
+			i += run;
+			literal_begin = i;
+		}
+		else
+			++i;
+	}
+	flush_literal();
+	return res;
+}
+
+// Returns false if the data does not decode to exactly pixels.size() pixels
+inline bool rle_decode(std::span<const uint8_t> data, std::span<uint32_t> pixels)
+{
+	size_t in = 0;
+	size_t out = 0;
+	while (in < data.size())
+	{
+		uint8_t n = data[in++];
+		if (n < 128)
+		{
+			size_t count = n + 1;
+			if (in + 4 * count > data.size() or out + count > pixels.size())
+				return false;
+			memcpy(pixels.data() + out, data.data() + in, 4 * count);
+			in += 4 * count;
+			out += count;
+		}
+		else
+		{
+			size_t count = n - 126;
+			if (in + 4 > data.size() or out + count > pixels.size())
+				return false;
+			uint32_t pixel;
+			memcpy(&pixel, data.data() + in, 4);
+			in += 4;
+			std::fill_n(pixels.data() + out, count, pixel);
+			out += count;
+		}
+	}
+	return out == pixels.size();
+}
+} // namespace xrt::drivers::wivrn
@@ -158,19 +158,52 @@ public:
 		}
 		return v.res;
 	}
+
+	// Copy the serialized data into a contiguous buffer
+	std::vector<uint8_t> flatten()
+	{
+		std::vector<uint8_t> res;
+		for (const auto & span: std::vector<std::span<uint8_t>>(*this))
+			res.insert(res.end(), span.begin(), span.end());
+		return res;
+	}
 };
 
 class deserialization_packet
 {
 	std::vector<uint8_t> buffer;
 	size_t read_index;
+	// buffer comes from utils::buffer_pool
+	bool pooled = false;
+	// CLOCK_MONOTONIC time the kernel received the datagram, 0 if unknown
+	int64_t receive_time_ = 0;
+	// ECN codepoint of the datagram, 0 (not ECN capable) if unknown
+	uint8_t ecn_ = 0;
 
 public:
 	deserialization_packet() :
 	        read_index(0) {}
-	explicit deserialization_packet(std::vector<uint8_t> buffer, size_t skip = 0) :
-	        buffer(std::move(buffer)), read_index(skip)
+	explicit deserialization_packet(std::vector<uint8_t> buffer, size_t skip = 0, bool pooled = false) :
+	        buffer(std::move(buffer)), read_index(skip), pooled(pooled)
 	{}
+	deserialization_packet(const deserialization_packet &) = delete;
+	deserialization_packet(deserialization_packet && other) :
+	        buffer(std::move(other.buffer)), read_index(other.read_index), pooled(std::exchange(other.pooled, false)), receive_time_(other.receive_time_), ecn_(other.ecn_) {}
+	deserialization_packet & operator=(const deserialization_packet &) = delete;
+	deserialization_packet & operator=(deserialization_packet && other)
+	{
+		std::swap(buffer, other.buffer);
+		std::swap(read_index, other.read_index);
+		std::swap(pooled, other.pooled);
+		std::swap(receive_time_, other.receive_time_);
+		std::swap(ecn_, other.ecn_);
+		return *this;
+	}
+	~deserialization_packet()
+	{
+		if (pooled)
+			utils::buffer_pool::instance().release(std::move(buffer));
+	}
 
 	void read(void * data, size_t size)
 	{
@@ -193,6 +226,13 @@ public:
 		return buffer.size() - read_index;
 	}
 
+	// Next byte, without reading it
+	uint8_t peek() const
+	{
+		check_remaining_size(1);
+		return buffer[read_index];
+	}
+
 	bool empty() const
 	{
 		return buffer.size() <= read_index;
@@ -220,6 +260,30 @@ public:
 	{
 		return {read_index, std::move(buffer)};
 	}
+
+	// Whether the buffer must be given back to utils::buffer_pool
+	bool is_pooled() const
+	{
+		return pooled;
+	}
+
+	int64_t receive_time() const
+	{
+		return receive_time_;
+	}
+	void set_receive_time(int64_t time)
+	{
+		receive_time_ = time;
+	}
+
+	uint8_t ecn() const
+	{
+		return ecn_;
+	}
+	void set_ecn(uint8_t ecn)
+	{
+		ecn_ = ecn;
+	}
 };
 
 template <typename T>
@@ -286,6 +350,46 @@ struct is_stdarray<std::array<T, N>> : public std::true_type
 template <typename T>
 inline constexpr bool is_stdarray_v = is_stdarray<T>::value;
 
+namespace details
+{
+template <typename T>
+constexpr size_t fixed_wire_size();
+
+template <typename T, size_t... I>
+constexpr size_t fields_wire_size(std::index_sequence<I...>)
+{
+	constexpr std::array<size_t, sizeof...(I)> sizes{fixed_wire_size<boost::pfr::tuple_element_t<I, T>>()...};
+	size_t size = 0;
+	for (size_t i: sizes)
+	{
+		if (i == 0)
+			return 0;
+		size += i;
+	}
+	return size;
+}
+
+// Serialized size of T if it only contains fixed size fields, 0 otherwise.
+// It follows the same recursion as type_hash, so it only depends on the schema.
+template <typename T>
+constexpr size_t fixed_wire_size()
+{
+	if constexpr (std::is_arithmetic_v<T> or std::is_enum_v<T>)
+		return sizeof(T);
+	else if constexpr (is_stdarray_v<T>)
+		return std::tuple_size_v<T> * fixed_wire_size<typename T::value_type>();
+	else if constexpr (std::is_aggregate_v<T> and std::is_trivially_copyable_v<T> and std::is_standard_layout_v<T>)
+		return fields_wire_size<T>(std::make_index_sequence<boost::pfr::tuple_size_v<T>>());
+	else
+		return 0;
+}
+
+// Types whose memory layout is identical to their serialized form: they can be
+// serialized with a single memcpy without changing the protocol
+template <typename T>
+inline constexpr bool memcpy_serializable = std::is_trivially_copyable_v<T> and fixed_wire_size<T>() == sizeof(T);
+} // namespace details
+
 template <typename T>
 struct serialization_traits<T, std::enable_if_t<std::is_aggregate_v<T> && !is_stdarray_v<T>>>
 {
@@ -312,15 +416,21 @@ struct serialization_traits<T, std::enable_if_t<std::is_aggregate_v<T> && !is_st
 
 	static void serialize(const T & value, serialization_packet & packet)
 	{
-		boost::pfr::for_each_field(value, [&](const auto & x) { packet.serialize(x); });
+		if constexpr (details::memcpy_serializable<T>)
+			packet.write(&value, sizeof(T));
+		else
+			boost::pfr::for_each_field(value, [&](const auto & x) { packet.serialize(x); });
 	}
 
 	static T deserialize(deserialization_packet & packet)
 	{
 		T value;
 
-		boost::pfr::for_each_field(
-		        value, [&](auto & x) { x = packet.deserialize<std::remove_reference_t<decltype(x)>>(); });
+		if constexpr (details::memcpy_serializable<T>)
+			packet.read(&value, sizeof(T));
+		else
+			boost::pfr::for_each_field(
+			        value, [&](auto & x) { x = packet.deserialize<std::remove_reference_t<decltype(x)>>(); });
 
 		return value;
 	}
@@ -367,7 +477,7 @@ struct serialization_traits<std::vector<T>>
 	{
 		packet.serialize<uint16_t>(value.size());
 
-		if constexpr (std::is_arithmetic_v<T>)
+		if constexpr (details::memcpy_serializable<T>)
 		{
 			packet.write(value.data(), value.size() * sizeof(T));
 		}
@@ -383,7 +493,7 @@ struct serialization_traits<std::vector<T>>
 		std::vector<T> value;
 		size_t size = packet.deserialize<uint16_t>();
 
-		if constexpr (std::is_arithmetic_v<T>)
+		if constexpr (details::memcpy_serializable<T>)
 		{
 			packet.check_remaining_size(size * sizeof(T));
 			value.resize(size);
@@ -448,17 +558,31 @@ struct serialization_traits<std::array<T, N>>
 
 	static void serialize(const std::array<T, N> & value, serialization_packet & packet)
 	{
-		for (const T & i: value)
-			packet.serialize<T>(i);
+		if constexpr (details::memcpy_serializable<std::array<T, N>>)
+		{
+			packet.write(value.data(), sizeof(value));
+		}
+		else
+		{
+			for (const T & i: value)
+				packet.serialize<T>(i);
+		}
 	}
 
 	static std::array<T, N> deserialize(deserialization_packet & packet)
 	{
 		std::array<T, N> value;
 
-		for (size_t i = 0; i < N; i++)
+		if constexpr (details::memcpy_serializable<std::array<T, N>>)
+		{
+			packet.read(value.data(), sizeof(value));
+		}
+		else
 		{
-			value[i] = packet.deserialize<T>();
+			for (size_t i = 0; i < N; i++)
+			{
+				value[i] = packet.deserialize<T>();
+			}
 		}
 
 		return value;
@@ -576,6 +700,7 @@ struct serialization_traits<data_holder>
 	{
 		data_holder value;
 		size_t size;
+		value.pooled = packet.is_pooled();
 		std::tie(size, value.c) = packet.steal_buffer();
 		return value;
 	}
@@ -18,7 +18,9 @@
  */
 #pragma once
 
+#include "utils/buffer_pool.h"
 #include <cstdint>
+#include <utility>
 #include <vector>
 
 namespace xrt::drivers::wivrn
@@ -30,11 +32,24 @@ struct data_holder
 {
 	data_holder() = default;
 	data_holder(const data_holder &) = delete;
-	data_holder(data_holder &&) = default;
+	data_holder(data_holder &&other) :
+	        c(std::move(other.c)), pooled(std::exchange(other.pooled, false)) {}
 	data_holder & operator=(const data_holder &) = delete;
-	data_holder & operator=(data_holder &&) = default;
+	data_holder & operator=(data_holder && other)
+	{
+		std::swap(c, other.c);
+		std::swap(pooled, other.pooled);
+		return *this;
+	}
+	~data_holder()
+	{
+		if (pooled)
+			utils::buffer_pool::instance().release(std::move(c));
+	}
 
 	std::vector<uint8_t> c;
+	// c comes from utils::buffer_pool and is given back on destruction
+	bool pooled = false;
 };
 
 } // namespace xrt::drivers::wivrn
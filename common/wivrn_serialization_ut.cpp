@@ -51,4 +51,16 @@ struct test
 	float y;
 };
 static_assert(serialization_type_hash<test>() == hash("structure{int32,float32}"));
+
+struct padded
+{
+	uint8_t x;
+	uint32_t y;
+};
+static_assert(details::fixed_wire_size<test>() == 8);
+static_assert(details::memcpy_serializable<test>);
+static_assert(details::memcpy_serializable<std::array<test, 3>>);
+static_assert(details::fixed_wire_size<padded>() == 5);
+static_assert(not details::memcpy_serializable<padded>);
+static_assert(not details::memcpy_serializable<std::optional<int>>);
 } // namespace
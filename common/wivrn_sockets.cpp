@@ -18,13 +18,21 @@
  */
 
 #include "wivrn_sockets.h"
+#include "utils/named_thread.h"
 
+#include <algorithm>
 #include <arpa/inet.h>
 #include <cassert>
+#include <chrono>
+#include <cmath>
+#include <ctime>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
 #include <memory>
 #include <netdb.h>
 #include <netinet/ip.h>
 #include <netinet/tcp.h>
+#include <poll.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -32,6 +40,10 @@
 #include <system_error>
 #include <unistd.h>
 
+#ifndef IPTOS_ECN_MASK
+#define IPTOS_ECN_MASK 0x03
+#endif
+
 const char * xrt::drivers::wivrn::invalid_packet::what() const noexcept
 {
 	return "Invalid packet";
@@ -73,6 +85,83 @@ xrt::drivers::wivrn::UDP::UDP(int fd)
 	this->fd = fd;
 }
 
+// Sequence number of the last datagram sent by the thread
+static thread_local uint32_t last_sequence = 0;
+
+static int64_t to_ns(const timespec & t)
+{
+	return int64_t(t.tv_sec) * 1'000'000'000 + t.tv_nsec;
+}
+
+// Kernel timestamps use CLOCK_REALTIME, returns what to subtract to get CLOCK_MONOTONIC
+static int64_t realtime_offset()
+{
+	timespec realtime, monotonic;
+	clock_gettime(CLOCK_REALTIME, &realtime);
+	clock_gettime(CLOCK_MONOTONIC, &monotonic);
+	return to_ns(realtime) - to_ns(monotonic);
+}
+
+static uint32_t timestamp_us()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+xrt::drivers::wivrn::UDP::datagram_header xrt::drivers::wivrn::UDP::next_header()
+{
+	return {
+	        .sequence = flow->send_sequence++,
+	        .timestamp = timestamp_us(),
+	};
+}
+
+bool xrt::drivers::wivrn::UDP::on_receive(std::span<const uint8_t> datagram)
+{
+	if (datagram.size() < sizeof(datagram_header))
+		return false;
+
+	datagram_header header;
+	memcpy(&header, datagram.data(), sizeof(header));
+
+	int32_t transit = timestamp_us() - header.timestamp;
+
+	std::lock_guard lock(flow->mutex);
+	auto & stats = flow->stats;
+	++stats.received;
+	if (not flow->started)
+	{
+		flow->started = true;
+		flow->expected_sequence = header.sequence + 1;
+		flow->last_transit = transit;
+		return true;
+	}
+
+	int32_t gap = header.sequence - flow->expected_sequence;
+	if (gap >= 0)
+	{
+		stats.lost += gap;
+		flow->expected_sequence = header.sequence + 1;
+	}
+	else
+	{
+		// Counted as lost when the gap was seen
+		++stats.reordered;
+		if (stats.lost > 0)
+			--stats.lost;
+	}
+
+	float d = std::abs(transit - flow->last_transit);
+	stats.jitter += (d - stats.jitter) / 16;
+	flow->last_transit = transit;
+	return true;
+}
+
+xrt::drivers::wivrn::UDP::statistics xrt::drivers::wivrn::UDP::get_statistics() const
+{
+	std::lock_guard lock(flow->mutex);
+	return flow->stats;
+}
+
 void xrt::drivers::wivrn::UDP::bind(int port)
 {
 	sockaddr_in6 bind_addr{};
@@ -144,15 +233,161 @@ void xrt::drivers::wivrn::UDP::set_send_buffer_size(int size)
 	setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
 }
 
+void xrt::drivers::wivrn::UDP::set_reuse_port()
+{
+	int reuse_port = 1;
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &reuse_port, sizeof(reuse_port)) < 0)
+		throw std::system_error{errno, std::generic_category()};
+}
+
 void xrt::drivers::wivrn::UDP::set_tos(int tos)
 {
-	int err = setsockopt(fd, IPPROTO_IP, IP_TOS, &tos, sizeof(tos));
-	if (err == -1)
+	// IPv4 datagrams sent from the IPv6 socket to mapped addresses use the IPv4 option
+	int err4 = setsockopt(fd, IPPROTO_IP, IP_TOS, &tos, sizeof(tos));
+	int err6 = setsockopt(fd, IPPROTO_IPV6, IPV6_TCLASS, &tos, sizeof(tos));
+	if (err4 == -1 and err6 == -1)
 	{
 		throw std::system_error{errno, std::generic_category()};
 	}
 }
 
+void xrt::drivers::wivrn::UDP::enable_receive_timestamps()
+{
+	int on = 1;
+	if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) < 0)
+		throw std::system_error{errno, std::generic_category()};
+	flow->receive_timestamps = true;
+}
+
+void xrt::drivers::wivrn::UDP::enable_receive_ecn()
+{
+	// IPv4 datagrams are received on the IPv6 socket as mapped addresses, they use the IPv4 option
+	int on = 1;
+	int err4 = setsockopt(fd, IPPROTO_IP, IP_RECVTOS, &on, sizeof(on));
+	int err6 = setsockopt(fd, IPPROTO_IPV6, IPV6_RECVTCLASS, &on, sizeof(on));
+	if (err4 < 0 and err6 < 0)
+		throw std::system_error{errno, std::generic_category()};
+	flow->receive_ecn = true;
+}
+
+void xrt::drivers::wivrn::UDP::enable_send_timestamps()
+{
+	std::lock_guard lock(flow->send_mutex);
+	flow->send_timestamps = true;
+	try
+	{
+		restart_send_timestamps();
+	}
+	catch (...)
+	{
+		flow->send_timestamps = false;
+		throw;
+	}
+}
+
+void xrt::drivers::wivrn::UDP::restart_send_timestamps()
+{
+	// Timestamps of the previous keys are still valid
+	read_error_queue();
+
+	// Keys start from 0 when SOF_TIMESTAMPING_OPT_ID is set again
+	int flags = 0;
+	setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags));
+	flags = SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+	if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0)
+		throw std::system_error{errno, std::generic_category()};
+
+	std::lock_guard lock(flow->send_times_mutex);
+	flow->timestamp_base = flow->send_sequence;
+}
+
+void xrt::drivers::wivrn::UDP::send_error()
+{
+	int error = errno;
+	if (flow->send_timestamps)
+	{
+		try
+		{
+			restart_send_timestamps();
+		}
+		catch (...)
+		{
+			flow->send_timestamps = false;
+		}
+	}
+	throw std::system_error{error, std::generic_category()};
+}
+
+uint32_t xrt::drivers::wivrn::UDP::last_sent_sequence()
+{
+	return last_sequence;
+}
+
+bool xrt::drivers::wivrn::UDP::read_error_queue()
+{
+	if (not flow->send_timestamps)
+		return false;
+
+	std::lock_guard lock(flow->send_times_mutex);
+	int64_t offset = realtime_offset();
+	while (true)
+	{
+		union
+		{
+			char buffer[CMSG_SPACE(sizeof(scm_timestamping)) + CMSG_SPACE(sizeof(sock_extended_err) + sizeof(sockaddr_in6))];
+			cmsghdr align;
+		} control;
+		msghdr msg{};
+		msg.msg_control = control.buffer;
+		msg.msg_controllen = sizeof(control.buffer);
+		if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+			break;
+
+		std::optional<int64_t> time;
+		std::optional<uint32_t> key;
+		for (cmsghdr * cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+		{
+			if (cmsg->cmsg_level == SOL_SOCKET and cmsg->cmsg_type == SCM_TIMESTAMPING)
+			{
+				scm_timestamping ts;
+				memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+				time = to_ns(ts.ts[0]) - offset;
+			}
+			else if ((cmsg->cmsg_level == SOL_IP and cmsg->cmsg_type == IP_RECVERR) or
+			         (cmsg->cmsg_level == SOL_IPV6 and cmsg->cmsg_type == IPV6_RECVERR))
+			{
+				sock_extended_err err;
+				memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+				if (err.ee_errno == ENOMSG and err.ee_origin == SO_EE_ORIGIN_TIMESTAMPING)
+					key = err.ee_data;
+			}
+		}
+		if (time and key)
+		{
+			uint32_t sequence = flow->timestamp_base + *key;
+			flow->send_times[sequence % flow->send_times.size()] = {sequence, *time};
+		}
+	}
+
+	int error = 0;
+	socklen_t size = sizeof(error);
+	getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &size);
+	return error == 0;
+}
+
+std::optional<int64_t> xrt::drivers::wivrn::UDP::send_time(uint32_t sequence)
+{
+	if (not flow->send_timestamps)
+		return std::nullopt;
+
+	read_error_queue();
+	std::lock_guard lock(flow->send_times_mutex);
+	auto [stored, time] = flow->send_times[sequence % flow->send_times.size()];
+	if (stored != sequence or time == 0)
+		return std::nullopt;
+	return time;
+}
+
 void xrt::drivers::wivrn::TCP::init()
 {
 	int nodelay = 1;
@@ -268,7 +503,10 @@ std::pair<xrt::drivers::wivrn::deserialization_packet, sockaddr_in6> xrt::driver
 	bytes_received_ += received;
 	buffer.resize(received);
 
-	return {deserialization_packet{std::move(buffer)}, addr};
+	if (not on_receive(buffer))
+		return {deserialization_packet{}, addr};
+
+	return {deserialization_packet{std::move(buffer), sizeof(datagram_header)}, addr};
 }
 
 xrt::drivers::wivrn::deserialization_packet xrt::drivers::wivrn::UDP::receive_raw()
@@ -283,15 +521,125 @@ xrt::drivers::wivrn::deserialization_packet xrt::drivers::wivrn::UDP::receive_ra
 	bytes_received_ += received;
 	buffer.resize(received);
 
-	return deserialization_packet{std::move(buffer)};
+	if (not on_receive(buffer))
+		return {};
+
+	return deserialization_packet{std::move(buffer), sizeof(datagram_header)};
+}
+
+void xrt::drivers::wivrn::UDP::receive_many_raw(std::vector<deserialization_packet> & packets, size_t max_count)
+{
+	// Larger than any datagram sent by the protocol
+	const size_t max_datagram_size = 2048;
+
+	thread_local std::vector<std::vector<uint8_t>> buffers;
+	thread_local std::vector<iovec> iovecs;
+	thread_local std::vector<mmsghdr> headers;
+	union control_buffer
+	{
+		char buffer[CMSG_SPACE(sizeof(timespec)) + CMSG_SPACE(sizeof(int))];
+		cmsghdr align;
+	};
+	thread_local std::vector<control_buffer> controls;
+
+	auto & pool = utils::buffer_pool::instance();
+	// Buffers that were not used in the previous call are kept
+	while (buffers.size() < max_count)
+		buffers.push_back(pool.get(max_datagram_size));
+
+	iovecs.resize(max_count);
+	headers.resize(max_count);
+	controls.resize(max_count);
+	for (size_t i = 0; i < max_count; ++i)
+	{
+		buffers[i].resize(max_datagram_size);
+		iovecs[i] = {buffers[i].data(), buffers[i].size()};
+		headers[i] = {};
+		headers[i].msg_hdr.msg_iov = &iovecs[i];
+		headers[i].msg_hdr.msg_iovlen = 1;
+		if (flow->receive_timestamps or flow->receive_ecn)
+		{
+			headers[i].msg_hdr.msg_control = controls[i].buffer;
+			headers[i].msg_hdr.msg_controllen = sizeof(controls[i].buffer);
+		}
+	}
+
+	int n = ::recvmmsg(fd, headers.data(), max_count, MSG_DONTWAIT, nullptr);
+	if (n < 0)
+	{
+		if (errno == EAGAIN or errno == EWOULDBLOCK)
+			return;
+		throw std::system_error{errno, std::generic_category()};
+	}
+
+	std::optional<int64_t> offset;
+	for (int i = 0; i < n; ++i)
+	{
+		bytes_received_ += headers[i].msg_len;
+		// Drop truncated datagrams, the buffer is reused next time
+		if (headers[i].msg_hdr.msg_flags & MSG_TRUNC)
+			continue;
+
+		buffers[i].resize(headers[i].msg_len);
+		if (not on_receive(buffers[i]))
+			continue;
+		auto & packet = packets.emplace_back(std::move(buffers[i]), sizeof(datagram_header), true);
+
+		msghdr & msg = headers[i].msg_hdr;
+		for (cmsghdr * cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+		{
+			if (cmsg->cmsg_level == SOL_SOCKET and cmsg->cmsg_type == SCM_TIMESTAMPNS)
+			{
+				timespec ts;
+				memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+				if (not offset)
+					offset = realtime_offset();
+				packet.set_receive_time(to_ns(ts) - *offset);
+			}
+			else if (cmsg->cmsg_level == SOL_IP and cmsg->cmsg_type == IP_TOS)
+			{
+				uint8_t tos;
+				memcpy(&tos, CMSG_DATA(cmsg), sizeof(tos));
+				packet.set_ecn(tos & IPTOS_ECN_MASK);
+			}
+			else if (cmsg->cmsg_level == SOL_IPV6 and cmsg->cmsg_type == IPV6_TCLASS)
+			{
+				int traffic_class;
+				memcpy(&traffic_class, CMSG_DATA(cmsg), sizeof(traffic_class));
+				packet.set_ecn(traffic_class & IPTOS_ECN_MASK);
+			}
+		}
+	}
+	std::erase_if(buffers, [](const auto & buffer) { return buffer.capacity() == 0; });
+}
+
+void xrt::drivers::wivrn::UDP::feed_raw(std::span<const uint8_t> data, std::vector<deserialization_packet> & packets)
+{
+	bytes_received_ += data.size();
+	if (not on_receive(data))
+		return;
+
+	std::vector<uint8_t> buffer = utils::buffer_pool::instance().get(data.size());
+	buffer.assign(data.begin(), data.end());
+	packets.emplace_back(std::move(buffer), sizeof(datagram_header), true);
 }
 
 void xrt::drivers::wivrn::UDP::send_raw(const std::vector<uint8_t> & data)
 {
-	ssize_t sent = ::send(fd, data.data(), data.size(), 0);
+	std::unique_lock lock(flow->send_mutex, std::defer_lock);
+	if (flow->send_timestamps)
+		lock.lock();
+	datagram_header header = next_header();
+	iovec iovecs[] = {
+	        {&header, sizeof(header)},
+	        {(void *)data.data(), data.size()},
+	};
+
+	ssize_t sent = ::writev(fd, iovecs, std::size(iovecs));
 	if (sent < 0)
-		throw std::system_error{errno, std::generic_category()};
+		send_error();
 
+	last_sequence = header.sequence;
 	bytes_sent_ += sent;
 }
 
@@ -299,11 +647,90 @@ void xrt::drivers::wivrn::UDP::send_raw(const std::vector<std::span<uint8_t>> &
 {
 	thread_local std::vector<iovec> spans;
 	spans.clear();
+	std::unique_lock lock(flow->send_mutex, std::defer_lock);
+	if (flow->send_timestamps)
+		lock.lock();
+	datagram_header header = next_header();
+	spans.emplace_back(&header, sizeof(header));
 	for (const auto & span: data)
 		spans.emplace_back((void *)span.data(), span.size());
 
 	if (::writev(fd, spans.data(), spans.size()) < 0)
-		throw std::system_error{errno, std::generic_category()};
+		send_error();
+	last_sequence = header.sequence;
+}
+
+void xrt::drivers::wivrn::UDP::send_many_raw(std::span<serialization_packet> packets)
+{
+	thread_local std::vector<iovec> iovecs;
+	thread_local std::vector<mmsghdr> headers;
+	thread_local std::vector<std::pair<size_t, size_t>> ranges;
+	thread_local std::vector<datagram_header> datagram_headers;
+	iovecs.clear();
+	headers.clear();
+	ranges.clear();
+	datagram_headers.clear();
+
+	std::unique_lock lock(flow->send_mutex, std::defer_lock);
+	if (flow->send_timestamps)
+		lock.lock();
+	for (size_t i = 0; i < packets.size(); ++i)
+		datagram_headers.push_back(next_header());
+	if (not datagram_headers.empty())
+		last_sequence = datagram_headers.back().sequence;
+
+	// Fill the iovec first, msg_iov pointers are set once it is no longer resized
+	for (size_t i = 0; i < packets.size(); ++i)
+	{
+		auto & packet = packets[i];
+		size_t begin = iovecs.size();
+		iovecs.emplace_back(&datagram_headers[i], sizeof(datagram_header));
+		for (const auto & span: std::vector<std::span<uint8_t>>(packet))
+			iovecs.emplace_back((void *)span.data(), span.size());
+		ranges.emplace_back(begin, iovecs.size() - begin);
+	}
+
+	for (const auto & [begin, count]: ranges)
+	{
+		headers.push_back(mmsghdr{
+		        .msg_hdr = {
+		                .msg_name = nullptr,
+		                .msg_namelen = 0,
+		                .msg_iov = iovecs.data() + begin,
+		                .msg_iovlen = count,
+		                .msg_control = nullptr,
+		                .msg_controllen = 0,
+		                .msg_flags = 0,
+		        },
+		        .msg_len = 0,
+		});
+	}
+
+	size_t sent = 0;
+	while (sent < headers.size())
+	{
+		int n = ::sendmmsg(fd, headers.data() + sent, headers.size() - sent, 0);
+		if (n < 0)
+		{
+			if (errno == ENOSYS)
+			{
+				// No sendmmsg support, send packets one by one
+				for (; sent < headers.size(); ++sent)
+				{
+					ssize_t size = ::writev(fd, headers[sent].msg_hdr.msg_iov, headers[sent].msg_hdr.msg_iovlen);
+					if (size < 0)
+						send_error();
+					bytes_sent_ += size;
+				}
+				return;
+			}
+			send_error();
+		}
+
+		for (int i = 0; i < n; ++i)
+			bytes_sent_ += headers[sent + i].msg_len;
+		sent += n;
+	}
 }
 
 xrt::drivers::wivrn::deserialization_packet xrt::drivers::wivrn::TCP::receive_raw()
@@ -348,8 +775,163 @@ xrt::drivers::wivrn::deserialization_packet xrt::drivers::wivrn::TCP::receive_ra
 	return deserialization_packet{std::move(new_buffer), sizeof(uint16_t)};
 }
 
+void xrt::drivers::wivrn::TCP::feed_raw(std::span<const uint8_t> data, std::vector<deserialization_packet> & packets)
+{
+	bytes_received_ += data.size();
+
+	while (not data.empty())
+	{
+		size_t expected_size;
+		if (buffer.size() < sizeof(uint16_t))
+			expected_size = sizeof(uint16_t) - buffer.size();
+		else
+			expected_size = *reinterpret_cast<uint16_t *>(buffer.data()) + sizeof(uint16_t) - buffer.size();
+
+		size_t size = std::min(expected_size, data.size());
+		buffer.insert(buffer.end(), data.begin(), data.begin() + size);
+		data = data.subspan(size);
+
+		if (buffer.size() < sizeof(uint16_t))
+			continue;
+
+		uint32_t payload_size = *reinterpret_cast<uint16_t *>(buffer.data());
+		if (buffer.size() == sizeof(uint16_t) + payload_size)
+		{
+			std::vector<uint8_t> new_buffer;
+			std::swap(buffer, new_buffer);
+			packets.emplace_back(std::move(new_buffer), sizeof(uint16_t));
+		}
+	}
+}
+
+xrt::drivers::wivrn::TCP::async_writer::async_writer(int fd, size_t max_queued_bytes) :
+        fd(fd), max_queued_bytes(max_queued_bytes)
+{
+	thread = utils::named_thread("tcp_writer", &async_writer::run, this);
+}
+
+xrt::drivers::wivrn::TCP::async_writer::~async_writer()
+{
+	{
+		std::lock_guard lock(mutex);
+		stop = true;
+	}
+	cv.notify_all();
+	thread.join();
+}
+
+size_t xrt::drivers::wivrn::TCP::async_writer::push(const std::vector<std::span<uint8_t>> & spans)
+{
+	uint16_t size = 0;
+	for (const auto & span: spans)
+		size += span.size_bytes();
+
+	std::unique_lock lock(mutex);
+	if (not pending.empty() and pending.size() + sizeof(size) + size > max_queued_bytes)
+	{
+		++stats.overflows;
+		cv.wait(lock, [&]() { return error or stop or pending.size() + sizeof(size) + size <= max_queued_bytes; });
+	}
+
+	if (error)
+		std::rethrow_exception(error);
+	if (stop)
+		throw socket_shutdown{};
+
+	const uint8_t * size_bytes = reinterpret_cast<const uint8_t *>(&size);
+	pending.insert(pending.end(), size_bytes, size_bytes + sizeof(size));
+	for (const auto & span: spans)
+		pending.insert(pending.end(), span.begin(), span.end());
+	++stats.packets;
+
+	lock.unlock();
+	cv.notify_all();
+	return sizeof(size) + size;
+}
+
+void xrt::drivers::wivrn::TCP::async_writer::run()
+{
+	std::vector<uint8_t> sending;
+	std::unique_lock lock(mutex);
+	while (true)
+	{
+		cv.wait(lock, [&]() { return stop or not pending.empty(); });
+		if (stop)
+			return;
+
+		std::swap(pending, sending);
+		lock.unlock();
+		// Senders waiting for space in the queue
+		cv.notify_all();
+
+		try
+		{
+			std::span<uint8_t> data = sending;
+			while (not data.empty())
+			{
+				ssize_t sent = ::send(fd, data.data(), data.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+
+				if (sent == 0)
+					throw socket_shutdown{};
+
+				if (sent < 0)
+				{
+					if (errno != EAGAIN and errno != EWOULDBLOCK)
+						throw std::system_error{errno, std::generic_category()};
+
+					// Wait with a timeout so that the writer can be stopped on a stalled connection
+					pollfd pfd{.fd = fd, .events = POLLOUT};
+					if (::poll(&pfd, 1, 100) < 0 and errno != EINTR)
+						throw std::system_error{errno, std::generic_category()};
+
+					std::lock_guard lock2(mutex);
+					if (stop)
+						return;
+					continue;
+				}
+
+				data = data.subspan(sent);
+
+				std::lock_guard lock2(mutex);
+				++stats.writes;
+			}
+		}
+		catch (...)
+		{
+			lock.lock();
+			error = std::current_exception();
+			lock.unlock();
+			cv.notify_all();
+			return;
+		}
+
+		sending.clear();
+		lock.lock();
+	}
+}
+
+void xrt::drivers::wivrn::TCP::start_writer(size_t max_queued_bytes)
+{
+	if (not writer)
+		writer = std::make_unique<async_writer>(fd, max_queued_bytes);
+}
+
+xrt::drivers::wivrn::TCP::writer_statistics xrt::drivers::wivrn::TCP::get_writer_statistics()
+{
+	if (not writer)
+		return {};
+	std::lock_guard lock(writer->mutex);
+	return writer->stats;
+}
+
 void xrt::drivers::wivrn::TCP::send_raw(const std::vector<std::span<uint8_t>> & spans)
 {
+	if (writer)
+	{
+		bytes_sent_ += writer->push(spans);
+		return;
+	}
+
 	thread_local std::vector<iovec> iovecs;
 	iovecs.clear();
 
@@ -398,3 +980,9 @@ void xrt::drivers::wivrn::TCP::send_raw(const std::vector<std::span<uint8_t>> &
 		hdr.msg_iov[0].iov_len -= sent;
 	}
 }
+
+void xrt::drivers::wivrn::TCP::send_many_raw(std::span<serialization_packet> packets)
+{
+	for (auto & packet: packets)
+		send_raw(packet);
+}
@@ -21,13 +21,17 @@
 
 #include "wivrn_serialization.h"
 
+#include <array>
 #include <atomic>
 #include <cassert>
+#include <condition_variable>
 #include <exception>
 #include <memory>
 #include <mutex>
 #include <netinet/ip.h>
+#include <optional>
 #include <span>
+#include <thread>
 #include <utility>
 #include <vector>
 
@@ -100,14 +104,75 @@ public:
 
 class UDP : public fd_base
 {
+public:
+	// Prepended to every datagram
+	struct datagram_header
+	{
+		uint32_t sequence;
+		// Sender clock, in µs
+		uint32_t timestamp;
+	};
+
+	struct statistics
+	{
+		uint64_t received;
+		// Gaps in the sequence numbers, minus late datagrams
+		uint64_t lost;
+		uint64_t reordered;
+		// Inter-arrival jitter as defined in RFC 3550, in µs
+		float jitter;
+	};
+
+private:
+	struct flow_state
+	{
+		std::atomic<uint32_t> send_sequence = 0;
+
+		std::mutex mutex;
+		statistics stats{};
+		bool started = false;
+		uint32_t expected_sequence;
+		int32_t last_transit;
+
+		bool receive_timestamps = false;
+		bool receive_ecn = false;
+
+		// With send timestamps, datagrams are sent one thread at a time so that the
+		// kernel timestamp keys follow the sequence numbers
+		bool send_timestamps = false;
+		std::mutex send_mutex;
+		std::mutex send_times_mutex;
+		// Sequence number of the datagram with timestamp key 0
+		uint32_t timestamp_base = 0;
+		// Sequence number and CLOCK_MONOTONIC send time, indexed by sequence number
+		std::array<std::pair<uint32_t, int64_t>, 4096> send_times{};
+	};
+	std::unique_ptr<flow_state> flow = std::make_unique<flow_state>();
+
+	datagram_header next_header();
+	// Returns false if the datagram is too short
+	bool on_receive(std::span<const uint8_t> datagram);
+	// Called with send_mutex locked when some datagrams may not have been sent,
+	// restarts the timestamp keys from the next sequence number
+	void restart_send_timestamps();
+	[[noreturn]] void send_error();
+
 public:
 	UDP();
 	explicit UDP(int fd);
 
+	statistics get_statistics() const;
+
 	deserialization_packet receive_raw();
+	// Receive up to max_count pending datagrams without blocking, in buffers from utils::buffer_pool
+	void receive_many_raw(std::vector<deserialization_packet> & packets, size_t max_count);
 	std::pair<xrt::drivers::wivrn::deserialization_packet, sockaddr_in6> receive_from_raw();
+	// Parse a datagram that was received without going through this socket (e.g. with io_uring)
+	void feed_raw(std::span<const uint8_t> data, std::vector<deserialization_packet> & packets);
 	void send_raw(const std::vector<uint8_t> & data);
 	void send_raw(const std::vector<std::span<uint8_t>> & data);
+	// Send multiple datagrams with as few system calls as possible
+	void send_many_raw(std::span<serialization_packet> packets);
 
 	void connect(in6_addr address, int port);
 	void connect(in_addr address, int port);
@@ -116,13 +181,71 @@ public:
 	void unsubscribe_multicast(in6_addr address);
 	void set_receive_buffer_size(int size);
 	void set_send_buffer_size(int size);
+	// Must be called before bind, on all the sockets sharing the port
+	void set_reuse_port();
 	void set_tos(int type_of_service);
+
+	// Datagrams from receive_many_raw get the time they were received by the kernel,
+	// see deserialization_packet::receive_time
+	void enable_receive_timestamps();
+	// Datagrams from receive_many_raw get the ECN bits of their traffic class, see deserialization_packet::ecn
+	void enable_receive_ecn();
+	// The kernel reports when datagrams are handed to the network interface, see send_time
+	void enable_send_timestamps();
+	bool has_send_timestamps() const
+	{
+		return flow->send_timestamps;
+	}
+	// Sequence number of the last datagram sent from the calling thread, on any socket
+	static uint32_t last_sent_sequence();
+	// CLOCK_MONOTONIC time the datagram was sent, if its timestamp was received
+	std::optional<int64_t> send_time(uint32_t sequence);
+	// Reads the pending send timestamps, they make poll report POLLERR.
+	// Returns false if the socket also has an actual error.
+	bool read_error_queue();
 };
 
 class TCP : public fd_base
 {
+public:
+	struct writer_statistics
+	{
+		uint64_t packets;
+		// Number of system calls used to send the packets
+		uint64_t writes;
+		// Number of times a sender had to wait for the queue to drain
+		uint64_t overflows;
+	};
+
+private:
+	// Sends packets from a dedicated thread, so that a stalled connection
+	// does not block the threads producing them
+	struct async_writer
+	{
+		int fd;
+		size_t max_queued_bytes;
+
+		std::mutex mutex;
+		std::condition_variable cv;
+		// Framed packets waiting for the writer thread
+		std::vector<uint8_t> pending;
+		bool stop = false;
+		std::exception_ptr error;
+		writer_statistics stats{};
+
+		std::thread thread;
+
+		async_writer(int fd, size_t max_queued_bytes);
+		~async_writer();
+
+		// Returns the number of bytes queued
+		size_t push(const std::vector<std::span<uint8_t>> & spans);
+		void run();
+	};
+
 	std::vector<uint8_t> buffer;
 	std::unique_ptr<std::mutex> mutex;
+	std::unique_ptr<async_writer> writer;
 
 	void init();
 
@@ -131,8 +254,18 @@ public:
 	TCP(in_addr address, int port);
 	explicit TCP(int fd);
 
+	// Do not send from the calling thread any more: packets are copied to a
+	// queue of at most max_queued_bytes, and small packets are coalesced into
+	// single writes. Senders wait when the queue is full.
+	// Errors are reported on the next send.
+	void start_writer(size_t max_queued_bytes = 256 * 1024);
+	writer_statistics get_writer_statistics();
+
 	deserialization_packet receive_raw();
+	// Parse bytes of the stream that were received without going through this socket (e.g. with io_uring)
+	void feed_raw(std::span<const uint8_t> data, std::vector<deserialization_packet> & packets);
 	void send_raw(const std::vector<std::span<uint8_t>> & data);
+	void send_many_raw(std::span<serialization_packet> packets);
 };
 
 class TCPListener : public fd_base
@@ -194,6 +327,27 @@ public:
 		return packet.deserialize<ReceivedType>();
 	}
 
+	// Receive all pending packets, up to max_count, with as few system calls as possible
+	void receive_many(std::vector<ReceivedType> & packets, size_t max_count = 64)
+		requires requires(Socket s, std::vector<deserialization_packet> & p, size_t n) { s.receive_many_raw(p, n); }
+	{
+		thread_local std::vector<deserialization_packet> raw;
+		raw.clear();
+		this->receive_many_raw(raw, max_count);
+		for (auto & packet: raw)
+			packets.push_back(packet.deserialize<ReceivedType>());
+	}
+
+	// Deserialize packets from data received by an external mechanism
+	void feed(std::span<const uint8_t> data, std::vector<ReceivedType> & packets)
+	{
+		thread_local std::vector<deserialization_packet> raw;
+		raw.clear();
+		this->feed_raw(data, raw);
+		for (auto & packet: raw)
+			packets.push_back(packet.deserialize<ReceivedType>());
+	}
+
 	template <typename T>
 	void send(T && data)
 	{
@@ -204,6 +358,64 @@ public:
 		p.serialize(std::forward<T>(data));
 		this->send_raw(p);
 	}
+
+	// Serialize a packet to be sent by the next call to flush, from the same thread.
+	// Spans in the packet must stay valid until then.
+	template <typename T>
+	void queue(T && data)
+	{
+		auto & q = send_queue();
+		if (q.size == max_queue_size)
+			flush();
+		if (q.size == q.packets.size())
+			q.packets.emplace_back();
+
+		auto & p = q.packets[q.size++];
+		p.clear();
+		uint8_t index = details::Index<std::decay_t<T>, std::tuple<VariantTypes...>>::value;
+		p.serialize(index);
+		p.serialize(std::forward<T>(data));
+	}
+
+	// Queue a packet of type T from bytes already serialized, without copying them.
+	// header and payload must stay valid until flush.
+	template <typename T>
+	void queue_raw(std::span<uint8_t> header, std::span<uint8_t> payload)
+	{
+		auto & q = send_queue();
+		if (q.size == max_queue_size)
+			flush();
+		if (q.size == q.packets.size())
+			q.packets.emplace_back();
+
+		auto & p = q.packets[q.size++];
+		p.clear();
+		uint8_t index = details::Index<T, std::tuple<VariantTypes...>>::value;
+		p.serialize(index);
+		p.write(header);
+		p.write(payload);
+	}
+
+	void flush()
+	{
+		auto & q = send_queue();
+		size_t size = std::exchange(q.size, 0);
+		if (size > 0)
+			this->send_many_raw(std::span(q.packets.data(), size));
+	}
+
+private:
+	static const size_t max_queue_size = 64;
+	struct queued_packets
+	{
+		std::vector<serialization_packet> packets;
+		size_t size = 0;
+	};
+	static queued_packets & send_queue()
+	{
+		thread_local queued_packets q;
+		return q;
+	}
 };
 
 } // namespace xrt::drivers::wivrn
@@ -46,9 +46,10 @@ std::unique_ptr<xrt::drivers::wivrn::TCP> accept_connection(int watch_fd, std::f
 	        {"cookie", server_cookie()},
 	};
 
-	avahi_publisher publisher(hostname().c_str(), "_wivrn._tcp", xrt::drivers::wivrn::default_port, TXT);
+	const int port = configuration::read_user_configuration().port.value_or(xrt::drivers::wivrn::default_port);
+	avahi_publisher publisher(hostname().c_str(), "_wivrn._tcp", port, TXT);
 
-	xrt::drivers::wivrn::TCPListener listener(xrt::drivers::wivrn::default_port);
+	xrt::drivers::wivrn::TCPListener listener(port);
 	bool client_connected = false;
 	bool fd_triggered = false;
 
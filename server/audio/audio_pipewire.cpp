@@ -21,13 +21,25 @@
 #include "driver/wivrn_session.h"
 #include "os/os_time.h"
 #include "util/u_logging.h"
+#include "utils/metrics.h"
+#include "utils/resampler.h"
 #include "utils/ring_buffer.h"
+#include "utils/thread_policy.h"
+#include <algorithm>
 #include <memory>
+#include <string>
 #include <pipewire/pipewire.h>
 #include <spa/param/audio/format-utils.h>
 
 using namespace xrt::drivers::wivrn;
 
+// Microphone buffering, in ms
+static const double mic_target_buffer = 30;
+static const double mic_max_buffer = 80;
+// Reading speed change per ms of buffering error, and its limit
+static const double mic_correction_rate = 0.0005;
+static const double mic_max_correction = 0.01;
+
 struct deleter
 {
 	void operator()(pw_main_loop * loop)
@@ -41,6 +53,24 @@ struct deleter
 	}
 };
 
+// Process the samples by network packet instead of the default quantum of the graph, often 1024 samples
+static std::string node_latency(const to_headset::audio_stream_description::device & desc)
+{
+	return std::to_string(audio_packet_frames(desc)) + "/" + std::to_string(desc.sample_rate);
+}
+
+// Samples in the buffer and graph delay, in s
+static void update_latency(pw_stream * stream, const spa_data & data, size_t frame_size, double sample_rate, metrics::gauge & gauge, double buffered = 0)
+{
+	double latency = data.chunk->size / frame_size / sample_rate + buffered;
+#if PW_CHECK_VERSION(0, 3, 50)
+	pw_time time;
+	if (pw_stream_get_time_n(stream, &time, sizeof(time)) == 0 and time.rate.denom)
+		latency += double(time.delay) * time.rate.num / time.rate.denom;
+#endif
+	gauge.set(latency);
+}
+
 struct pipewire_device : public audio_device
 {
 	to_headset::audio_stream_description desc;
@@ -52,9 +82,16 @@ struct pipewire_device : public audio_device
 	        .process = &pipewire_device::speaker_process,
 	};
 
+	std::optional<audio_sender> speaker_sender;
+
+	std::optional<audio_receiver> mic_receiver;
 	utils::ring_buffer<audio_data, 100> mic_samples;
-	std::atomic<size_t> mic_buffer_size_bytes;
-	audio_data mic_current;
+	// Only used by the pipewire thread
+	std::optional<utils::resampler> mic_resampler;
+	// Headset clock rate relative to the server clock, from the clock offset slope
+	std::atomic<double> mic_drift = 1;
+	// The headset stopped sending until voice resumes
+	std::atomic<bool> mic_silence = false;
 	std::unique_ptr<pw_stream, deleter> microphone;
 	pw_stream_events mic_events{
 	        .version = PW_VERSION_STREAM_EVENTS,
@@ -92,10 +129,9 @@ struct pipewire_device : public audio_device
 		pw_loop.reset(pw_main_loop_new(nullptr));
 		if (info.speaker)
 		{
-			desc.speaker = {
-			        .num_channels = info.speaker->num_channels,
-			        .sample_rate = info.speaker->sample_rate,
-			};
+			desc.speaker = audio_stream_parameters(*info.speaker);
+			speaker_sender.emplace(*desc.speaker, session);
+			std::string latency = node_latency(*desc.speaker);
 
 			speaker.reset(pw_stream_new_simple(
 			        pw_main_loop_get_loop(pw_loop.get()),
@@ -113,6 +149,8 @@ struct pipewire_device : public audio_device
 			                "Audio/Sink",
 			                PW_KEY_MEDIA_ROLE,
 			                "Game",
+			                PW_KEY_NODE_LATENCY,
+			                latency.c_str(),
 			                NULL),
 			        &speaker_events,
 			        this));
@@ -139,10 +177,10 @@ struct pipewire_device : public audio_device
 
 		if (info.microphone)
 		{
-			desc.microphone = {
-			        .num_channels = info.microphone->num_channels,
-			        .sample_rate = info.microphone->sample_rate,
-			};
+			desc.microphone = audio_stream_parameters(*info.microphone);
+			mic_receiver.emplace(*desc.microphone);
+			mic_resampler.emplace(desc.microphone->num_channels);
+			std::string latency = node_latency(*desc.microphone);
 
 			microphone.reset(pw_stream_new_simple(
 			        pw_main_loop_get_loop(pw_loop.get()),
@@ -160,6 +198,8 @@ struct pipewire_device : public audio_device
 			                "Audio/Source",
 			                PW_KEY_MEDIA_ROLE,
 			                "Game",
+			                PW_KEY_NODE_LATENCY,
+			                latency.c_str(),
 			                NULL),
 			        &mic_events,
 			        this));
@@ -185,8 +225,8 @@ struct pipewire_device : public audio_device
 		}
 
 		if (desc.speaker or desc.microphone)
-			thread = std::thread(
-			        [loop = pw_loop.get()]() { pw_main_loop_run(loop); });
+			thread = role_thread(
+			        thread_role::audio, "pipewire", [loop = pw_loop.get()]() { pw_main_loop_run(loop); });
 	}
 };
 
@@ -216,45 +256,40 @@ void pipewire_device::mic_process(void * self_v)
 	{
 		num_frames = data.maxsize / frame_size;
 	}
+	num_frames = std::min<size_t>(num_frames, data.maxsize / frame_size);
 	data.chunk->offset = 0;
-	data.chunk->size = 0;
 	data.chunk->stride = frame_size;
 
-	while (num_frames != 0)
+	auto & resampler = *self->mic_resampler;
+	while (auto packet = self->mic_samples.read())
+		resampler.push(std::span((const int16_t *)packet->payload.data(), packet->payload.size() / sizeof(int16_t)));
+
+	const double sample_rate = self->desc.microphone->sample_rate;
+	auto buffered = [&]() { return resampler.available() * 1000 / sample_rate; };
+
+	// discard excess data, so we don't accumulate latency
+	if (buffered() > mic_max_buffer)
 	{
-		// remaining bytes in existing buffer
-		auto & current = self->mic_current;
-		ptrdiff_t tmp_remain = current.payload.size_bytes();
-		// limit to requested frames
-		tmp_remain = std::min<ptrdiff_t>(tmp_remain, num_frames * frame_size);
-		if (tmp_remain)
-		{
-			memcpy(data_ptr, current.payload.data(), tmp_remain);
-			current.payload = current.payload.subspan(tmp_remain);
-			data_ptr += tmp_remain;
-			data.chunk->size += tmp_remain;
-			num_frames -= tmp_remain / frame_size;
-		}
-		else
-		{
-			auto tmp = self->mic_samples.read();
-			if (not tmp)
-				break;
-			self->mic_current = std::move(*tmp);
-		}
+		size_t drop = (buffered() - mic_target_buffer) * sample_rate / 1000;
+		resampler.drop(drop);
+		U_LOG_D("Audio sync: discard %zu frames", drop);
 	}
-	pw_stream_queue_buffer(self->microphone.get(), buffer);
 
-	// discard excess data, so we don't accumulate latency
-	size_t target_buffer_size = frame_size * self->desc.microphone->sample_rate * 0.08;
-	while (self->mic_buffer_size_bytes > target_buffer_size and self->mic_samples.size() > 1)
+	// Follow the headset clock, and read up to 1% faster or slower to keep the target latency
+	double step = self->mic_drift * (1 + std::clamp((buffered() - mic_target_buffer) * mic_correction_rate, -mic_max_correction, mic_max_correction));
+	size_t frames = resampler.read(std::span((int16_t *)data_ptr, num_frames * self->desc.microphone->num_channels), step);
+	if (frames < num_frames and self->mic_silence)
 	{
-		auto tmp = self->mic_samples.read();
-		if (not tmp)
-			break;
-		self->mic_buffer_size_bytes.fetch_sub(tmp->payload.size_bytes());
-		U_LOG_D("Audio sync: discard %ld bytes", tmp->payload.size_bytes());
+		// Fill the silence of the headset after the last samples
+		std::fill((int16_t *)data_ptr + frames * self->desc.microphone->num_channels, (int16_t *)data_ptr + num_frames * self->desc.microphone->num_channels, 0);
+		frames = num_frames;
 	}
+	else if (frames < num_frames)
+		xrt::drivers::wivrn::metrics::audio_underruns.add();
+	data.chunk->size = frames * frame_size;
+	update_latency(self->microphone.get(), data, frame_size, sample_rate, metrics::microphone_latency, buffered() / 1000);
+
+	pw_stream_queue_buffer(self->microphone.get(), buffer);
 }
 
 void pipewire_device::speaker_process(void * self_v)
@@ -271,26 +306,29 @@ void pipewire_device::speaker_process(void * self_v)
 	if (not data.data)
 		return;
 
-	audio_data packet{
-	        .timestamp = self->session.get_offset().to_headset(os_monotonic_get_ns()),
-	        .payload = std::span(
-	                (uint8_t *)data.data + data.chunk->offset,
-	                data.chunk->size),
-	};
+	// Encoded or sent from the mapped buffer, without an intermediate copy
 	try
 	{
-		self->session.send_control(packet);
+		self->speaker_sender->send(
+		        std::span((uint8_t *)data.data + data.chunk->offset, data.chunk->size),
+		        self->session.get_offset().to_headset(os_monotonic_get_ns()));
 	}
 	catch (std::exception & e)
 	{
 		U_LOG_D("Failed to send audio data: %s", e.what());
 	}
+	update_latency(self->speaker.get(), data, self->desc.speaker->num_channels * sizeof(int16_t), self->desc.speaker->sample_rate, metrics::speaker_latency);
 	pw_stream_queue_buffer(self->speaker.get(), buffer);
 }
 
 void pipewire_device::process_mic_data(xrt::drivers::wivrn::audio_data && sample)
 {
-	mic_samples.write(std::move(sample));
+	if (auto offset = session.get_offset())
+		mic_drift = offset.a;
+	mic_silence = sample.payload.empty();
+	mic_receiver->receive(std::move(sample), [this](audio_data && pcm) {
+		mic_samples.write(std::move(pcm));
+	});
 }
 
 std::shared_ptr<audio_device> create_pipewire_handle(
@@ -4,32 +4,31 @@
 #include "driver/wivrn_session.h"
 #include "os/os_time.h"
 #include "util/u_logging.h"
-#include "utils/sync_queue.h"
+#include "utils/metrics.h"
+#include "utils/thread_policy.h"
 #include "utils/wrap_lambda.h"
 
 #include <pulse/context.h>
 #include <pulse/ext-device-manager.h>
 #include <pulse/introspect.h>
 #include <pulse/proplist.h>
+#include <pulse/stream.h>
 #include <pulse/thread-mainloop.h>
 
 #include <atomic>
-#include <fcntl.h>
-#include <filesystem>
 #include <future>
 #include <iostream>
-#include <sys/poll.h>
+#include <mutex>
 
 static const char * source_name = "WiVRn-mic";
 static const char * sink_name = "WiVRn";
-static const char * source_pipe = "wivrn-source";
-static const char * sink_pipe = "wivrn-sink";
+// Null sink written by the microphone stream, its monitor is remapped to the source
+static const char * mic_sink_suffix = ".input";
 
 struct module_entry
 {
 	uint32_t module;
 	uint32_t device;
-	std::filesystem::path socket;
 };
 
 void wait_connected(std::atomic<pa_context_state> & state)
@@ -108,17 +107,6 @@ std::optional<module_entry> get_source(pa_context * ctx, const char * name)
 	return result;
 }
 
-std::filesystem::path get_socket_path()
-{
-	const char * path = std::getenv("XDG_RUNTIME_DIR");
-	if (path)
-		return path;
-	path = "/tmp/wivrn";
-	std::filesystem::create_directories(path);
-	U_LOG_W("XDG_RUNTIME_DIR is not set, using %s instead", path);
-	return path;
-}
-
 module_entry ensure_sink(pa_context * ctx, const char * name, const std::string & description, int channels, int sample_rate)
 {
 	auto sink = get_sink(ctx, name);
@@ -129,31 +117,28 @@ module_entry ensure_sink(pa_context * ctx, const char * name, const std::string
 	wrap_lambda cb = [&module_index](pa_context *, uint32_t index) {
 		module_index.set_value(index);
 	};
-	std::filesystem::path fifo = get_socket_path() / sink_pipe;
 	std::stringstream params;
 	params << "sink_name=" << std::quoted(name)
-	       << " file=" << std::quoted(fifo.string())
 	       << " channels=" << channels
 	       << " rate=" << sample_rate
-	       << " use_system_clock_for_timing=yes"
 	       << " sink_properties=" << PA_PROP_DEVICE_DESCRIPTION << "=" << std::quoted(description)
 	       << PA_PROP_DEVICE_ICON_NAME << "=network-wireless";
 	;
-	auto op = pa_context_load_module(ctx, "module-pipe-sink", params.str().c_str(), cb, cb);
+	auto op = pa_context_load_module(ctx, "module-null-sink", params.str().c_str(), cb, cb);
 	pa_operation_unref(op);
 	module_index.get_future().wait();
 
 	sink = get_sink(ctx, name);
 	if (not sink)
 		throw std::runtime_error("failed to create audio sink " + std::string(name));
-	sink->socket = fifo;
 
 	add_cleanup_function(unload_module, sink->module);
 
 	return *sink;
 }
 
-module_entry ensure_source(pa_context * ctx, const char * name, const std::string & description, int channels, int sample_rate)
+// Source fed by the monitor of master
+module_entry ensure_source(pa_context * ctx, const char * name, const std::string & description, const std::string & master)
 {
 	auto source = get_source(ctx, name);
 	if (source)
@@ -163,23 +148,19 @@ module_entry ensure_source(pa_context * ctx, const char * name, const std::strin
 	wrap_lambda cb = [&module_index](pa_context *, uint32_t index) {
 		module_index.set_value(index);
 	};
-	std::filesystem::path fifo = get_socket_path() / source_pipe;
 	std::stringstream params;
 	params << "source_name=" << std::quoted(name)
-	       << " file=" << std::quoted(fifo.string())
-	       << " channels=" << channels
-	       << " rate=" << sample_rate
+	       << " master=" << std::quoted(master + ".monitor")
 	       << " source_properties=" << PA_PROP_DEVICE_DESCRIPTION << "=" << std::quoted(description)
 	       << PA_PROP_DEVICE_ICON_NAME << "=network-wireless";
 	;
-	auto op = pa_context_load_module(ctx, "module-pipe-source", params.str().c_str(), cb, cb);
+	auto op = pa_context_load_module(ctx, "module-remap-source", params.str().c_str(), cb, cb);
 	pa_operation_unref(op);
 	module_index.get_future().wait();
 
 	source = get_source(ctx, name);
 	if (not source)
 		throw std::runtime_error("failed to create audio source " + std::string(name));
-	source->socket = fifo;
 
 	add_cleanup_function(unload_module, source->module);
 
@@ -236,160 +217,146 @@ public:
 	{
 		return ctx.get();
 	}
+
+	// Locks the main loop, required to use streams outside of their callbacks
+	void lock()
+	{
+		pa_threaded_mainloop_lock(main_loop.get());
+	}
+	void unlock()
+	{
+		pa_threaded_mainloop_unlock(main_loop.get());
+	}
 };
 
 struct pulse_device : public audio_device
 {
 	xrt::drivers::wivrn::to_headset::audio_stream_description desc;
 
-	std::thread mic_thread;
-	std::thread speaker_thread;
-	std::atomic<bool> quit;
+	// Callbacks are called from the main loop thread of the connection
+	pa_connection cnx{"WiVRn"};
+	std::once_flag thread_policy;
 
 	std::optional<module_entry> speaker;
 	std::optional<module_entry> microphone;
+	std::optional<module_entry> microphone_sink;
 
-	utils::sync_queue<audio_data> mic_buffer;
+	pa_stream * speaker_stream = nullptr;
+	pa_stream * mic_stream = nullptr;
 
-	xrt::drivers::wivrn::fd_base speaker_pipe;
-	xrt::drivers::wivrn::fd_base mic_pipe;
+	std::optional<audio_sender> speaker_sender;
+	std::optional<audio_receiver> mic_receiver;
 
 	xrt::drivers::wivrn::wivrn_session & session;
 
 	~pulse_device()
 	{
-		quit = true;
-		mic_buffer.close();
-		if (mic_thread.joinable())
-			mic_thread.join();
-		if (speaker_thread.joinable())
-			speaker_thread.join();
-		if (speaker or microphone)
-		{
-			try
-			{
-				pa_connection cnx("WiVRn");
-				if (speaker)
-					unload_module(cnx, speaker->module);
-				if (microphone)
-					unload_module(cnx, microphone->module);
-			}
-			catch (const std::exception & e)
-			{
-				std::cout << "failed to depublish pulseaudio modules: "
-				          << e.what() << std::endl;
-			}
-		}
+		cleanup();
 	}
 
-	xrt::drivers::wivrn::to_headset::audio_stream_description description() const override
-	{
-		return desc;
-	};
-
-	void run_speaker()
+	void cleanup()
 	{
-		assert(desc.speaker);
-		pthread_setname_np(pthread_self(), "speaker_thread");
-
-		U_LOG_I("started speaker thread, sample rate %dHz, %d channels", desc.speaker->sample_rate, desc.speaker->num_channels);
-
-		const size_t sample_size = desc.speaker->num_channels * sizeof(int16_t);
-		// use buffers of up to 2ms
-		// read buffers must be smaller than buffer size on client or we will discard chunks often
-		const size_t buffer_size = (desc.speaker->sample_rate * sample_size * 2) / 1000;
-		xrt::drivers::wivrn::audio_data packet;
-		std::vector<uint8_t> buffer(buffer_size, 0);
-		size_t remainder = 0;
-
-		// Flush existing data, but keep alignment
 		{
-			char sewer[1024];
-			while (true)
+			std::lock_guard lock(cnx);
+			for (auto stream: {speaker_stream, mic_stream})
 			{
-				int size = read(speaker_pipe.get_fd(), sewer, sizeof(sewer));
-				if (size <= 0)
-					break;
-				remainder = (remainder + size) % sample_size;
+				if (not stream)
+					continue;
+				pa_stream_disconnect(stream);
+				pa_stream_unref(stream);
 			}
 		}
-
 		try
 		{
-			while (not quit)
-			{
-				pollfd pfd{};
-				pfd.fd = speaker_pipe.get_fd();
-				pfd.events = POLL_IN;
-
-				int r = poll(&pfd, 1, 100);
-				if (r < 0)
-					throw std::system_error(errno, std::system_category());
-				if (pfd.revents & (POLLHUP | POLLERR))
-					throw std::runtime_error("Error on speaker pipe");
-				if (pfd.revents & POLLIN)
-				{
-					int size = read(pfd.fd, buffer.data() + remainder, buffer_size - remainder);
-					if (size < 0)
-						throw std::system_error(errno, std::system_category());
-					size += remainder;              // full size of available data
-					remainder = size % sample_size; // data to keep for next iteration
-					size -= remainder;              // size of data to send
-					packet.payload = std::span<uint8_t>(buffer.begin(), size);
-					packet.timestamp = session.get_offset().to_headset(os_monotonic_get_ns());
-					session.send_stream(packet);
-					// put the remaining data at the beginning of the buffer
-					memmove(buffer.data(), buffer.data() + size, remainder);
-				}
-			}
+			if (speaker)
+				unload_module(cnx, speaker->module);
+			if (microphone)
+				unload_module(cnx, microphone->module);
+			if (microphone_sink)
+				unload_module(cnx, microphone_sink->module);
 		}
 		catch (const std::exception & e)
 		{
-			U_LOG_D("Error in audio thread: %s", e.what());
+			std::cout << "failed to depublish pulseaudio modules: "
+			          << e.what() << std::endl;
 		}
 	}
 
-	void run_mic()
+	xrt::drivers::wivrn::to_headset::audio_stream_description description() const override
 	{
-		assert(desc.microphone);
-		pthread_setname_np(pthread_self(), "mic_thread");
+		return desc;
+	};
 
-		const size_t sample_size = desc.microphone->num_channels * sizeof(int16_t);
-		try
+	void apply_thread_policy()
+	{
+		std::call_once(thread_policy, []() {
+			pthread_setname_np(pthread_self(), "audio_thread");
+			xrt::drivers::wivrn::apply_thread_policy(xrt::drivers::wivrn::thread_role::audio);
+		});
+	}
+
+	static void update_latency(pa_stream * stream, xrt::drivers::wivrn::metrics::gauge & gauge)
+	{
+		pa_usec_t latency;
+		int negative;
+		if (pa_stream_get_latency(stream, &latency, &negative) == 0)
+			gauge.set(negative ? 0 : latency * 1e-6);
+	}
+
+	// Samples of the sink monitor, sent as they are read
+	static void speaker_read(pa_stream * stream, size_t, void * self_v)
+	{
+		auto self = (pulse_device *)self_v;
+		self->apply_thread_policy();
+
+		const void * data;
+		size_t size;
+		while (pa_stream_readable_size(stream) > 0)
 		{
-			while (not quit)
+			if (pa_stream_peek(stream, &data, &size) < 0 or size == 0)
+				return;
+			// data is null for holes in the stream
+			if (data)
 			{
-				pollfd pfd{};
-				pfd.fd = mic_pipe.get_fd();
-				pfd.events = POLLOUT;
-
-				int r = poll(&pfd, 1, 100);
-				if (r < 0)
-					throw std::system_error(errno, std::system_category());
-				if (pfd.revents & (POLLHUP | POLLERR))
-					throw std::runtime_error("Error on mic pipe");
-				if (pfd.revents & POLLOUT)
+				try
 				{
-					auto packet = mic_buffer.pop();
-					auto & buffer = packet.payload;
-
-					int written = write(mic_pipe.get_fd(), buffer.data(), buffer.size());
-					if (written < 0)
-						throw std::system_error(errno, std::system_category());
-
-					// Discard anything that didn't fit the buffer
+					self->speaker_sender->send(std::span((uint8_t *)data, size),
+					                           self->session.get_offset().to_headset(os_monotonic_get_ns()));
+				}
+				catch (const std::exception & e)
+				{
+					U_LOG_D("Error in audio thread: %s", e.what());
 				}
 			}
+			pa_stream_drop(stream);
 		}
-		catch (const std::exception & e)
-		{
-			U_LOG_E("Error in audio thread: %s", e.what());
-		}
+		update_latency(stream, xrt::drivers::wivrn::metrics::speaker_latency);
 	}
 
 	void process_mic_data(xrt::drivers::wivrn::audio_data && mic_data) override
 	{
-		mic_buffer.push(std::move(mic_data));
+		mic_receiver->receive(std::move(mic_data), [this](xrt::drivers::wivrn::audio_data && pcm) {
+			// Silence marker: the stream underruns and the sink plays silence until voice resumes
+			if (pcm.payload.empty())
+				return;
+			std::lock_guard lock(cnx);
+			if (pa_stream_get_state(mic_stream) != PA_STREAM_READY)
+				return;
+			// Discard anything that doesn't fit the buffer, so that latency does not accumulate
+			if (pa_stream_writable_size(mic_stream) < pcm.payload.size())
+				return;
+			pa_stream_write(mic_stream, pcm.payload.data(), pcm.payload.size(), nullptr, 0, PA_SEEK_RELATIVE);
+			update_latency(mic_stream, xrt::drivers::wivrn::metrics::microphone_latency);
+		});
+	}
+
+	static pa_sample_spec sample_spec(const xrt::drivers::wivrn::to_headset::audio_stream_description::device & desc)
+	{
+		return {
+		        .format = PA_SAMPLE_S16NE,
+		        .rate = desc.sample_rate,
+		        .channels = desc.num_channels,
+		};
 	}
 
 	pulse_device(
@@ -401,33 +368,65 @@ struct pulse_device : public audio_device
 	        xrt::drivers::wivrn::wivrn_session & session) :
 	        session(session)
 	{
-		pa_connection cnx("WiVRn");
-
-		if (info.microphone)
-		{
-			microphone = ensure_source(cnx, source_name.c_str(), source_description, info.microphone->num_channels, info.microphone->sample_rate);
-			desc.microphone = {
-			        .num_channels = info.microphone->num_channels,
-			        .sample_rate = info.microphone->sample_rate};
-
-			mic_pipe = open(microphone->socket.c_str(), O_WRONLY | O_NONBLOCK);
-			if (not mic_pipe)
-				throw std::system_error(errno, std::system_category(), "failed to open mic pipe " + microphone->socket.string());
-			mic_thread = std::thread([this]() { run_mic(); });
-		}
-
-		if (info.speaker)
+		try
 		{
-			speaker = ensure_sink(cnx, sink_name.c_str(), sink_description, info.speaker->num_channels, info.speaker->sample_rate);
-			desc.speaker = {
-			        .num_channels = info.speaker->num_channels,
-			        .sample_rate = info.speaker->sample_rate};
+			// Buffers are sized to the network packets instead of the server defaults,
+			// which are often tens of milliseconds
+			const pa_stream_flags_t flags = pa_stream_flags_t(PA_STREAM_ADJUST_LATENCY | PA_STREAM_AUTO_TIMING_UPDATE | PA_STREAM_INTERPOLATE_TIMING | PA_STREAM_DONT_MOVE);
 
-			speaker_pipe = open(speaker->socket.c_str(), O_RDONLY | O_NONBLOCK);
-			if (not speaker_pipe)
-				throw std::system_error(errno, std::system_category(), "failed to open speaker pipe " + speaker->socket.string());
+			if (info.microphone)
+			{
+				std::string mic_sink = source_name + mic_sink_suffix;
+				microphone_sink = ensure_sink(cnx, mic_sink.c_str(), source_description + " input", info.microphone->num_channels, info.microphone->sample_rate);
+				microphone = ensure_source(cnx, source_name.c_str(), source_description, mic_sink);
+				desc.microphone = audio_stream_parameters(*info.microphone);
+				mic_receiver.emplace(*desc.microphone);
+
+				auto spec = sample_spec(*desc.microphone);
+				uint32_t packet_size = audio_packet_frames(*desc.microphone) * pa_frame_size(&spec);
+				// Two packets to absorb the network jitter
+				pa_buffer_attr attr{
+				        .maxlength = uint32_t(-1),
+				        .tlength = 2 * packet_size,
+				        .prebuf = uint32_t(-1),
+				        .minreq = packet_size,
+				        .fragsize = uint32_t(-1),
+				};
+
+				std::lock_guard lock(cnx);
+				mic_stream = pa_stream_new(cnx, "WiVRn microphone", &spec, nullptr);
+				if (not mic_stream or pa_stream_connect_playback(mic_stream, mic_sink.c_str(), &attr, flags, nullptr, nullptr) < 0)
+					throw std::runtime_error("failed to connect microphone stream");
+			}
 
-			speaker_thread = std::thread([this]() { run_speaker(); });
+			if (info.speaker)
+			{
+				speaker = ensure_sink(cnx, sink_name.c_str(), sink_description, info.speaker->num_channels, info.speaker->sample_rate);
+				desc.speaker = audio_stream_parameters(*info.speaker);
+				speaker_sender.emplace(*desc.speaker, session);
+
+				auto spec = sample_spec(*desc.speaker);
+				pa_buffer_attr attr{
+				        .maxlength = uint32_t(-1),
+				        .tlength = uint32_t(-1),
+				        .prebuf = uint32_t(-1),
+				        .minreq = uint32_t(-1),
+				        .fragsize = uint32_t(audio_packet_frames(*desc.speaker) * pa_frame_size(&spec)),
+				};
+
+				std::lock_guard lock(cnx);
+				speaker_stream = pa_stream_new(cnx, "WiVRn speaker", &spec, nullptr);
+				if (not speaker_stream)
+					throw std::runtime_error("failed to create speaker stream");
+				pa_stream_set_read_callback(speaker_stream, &pulse_device::speaker_read, this);
+				if (pa_stream_connect_record(speaker_stream, (sink_name + ".monitor").c_str(), &attr, flags) < 0)
+					throw std::runtime_error("failed to connect speaker stream");
+			}
+		}
+		catch (...)
+		{
+			cleanup();
+			throw;
 		}
 	}
 };
@@ -19,9 +19,13 @@
 
 #include "audio_setup.h"
 
+#include "driver/configuration.h"
+#include "driver/wivrn_session.h"
 #include "util/u_logging.h"
 #include "wivrn_config.h"
 
+#include <algorithm>
+
 #ifdef WIVRN_USE_PULSEAUDIO
 #include "audio_pulse.h"
 #endif
@@ -50,3 +54,78 @@ std::shared_ptr<audio_device> audio_device::create(
 	U_LOG_W("No audio backend available");
 	return nullptr;
 }
+
+using namespace xrt::drivers::wivrn;
+
+to_headset::audio_stream_description::device audio_stream_parameters(const from_headset::headset_info_packet::audio_description & headset)
+{
+	auto config = configuration::read_user_configuration();
+	to_headset::audio_stream_description::device res{
+	        .num_channels = headset.num_channels,
+	        .sample_rate = headset.sample_rate,
+	        .offset = XrDuration(config.audio_offset * 1'000'000),
+	};
+#ifdef WIVRN_USE_OPUS
+	if (config.audio_codec == audio_codec::opus and
+	    std::ranges::find(headset.codecs, audio_codec::opus) != headset.codecs.end() and
+	    opus_supported(headset.sample_rate, headset.num_channels))
+	{
+		res.codec = audio_codec::opus;
+		res.frame_size = uint16_t(headset.sample_rate * config.audio_frame_duration / 1000);
+	}
+#endif
+	return res;
+}
+
+// Larger raw packets would be fragmented and often lost on the stream socket
+static const size_t max_raw_stream_payload = 1024;
+
+uint32_t audio_packet_frames(const to_headset::audio_stream_description::device & desc)
+{
+	if (desc.codec == audio_codec::opus)
+		return desc.frame_size;
+	return max_raw_stream_payload / (desc.num_channels * sizeof(int16_t));
+}
+
+audio_sender::audio_sender(const to_headset::audio_stream_description::device & desc, wivrn_session & session) :
+        session(session),
+        num_channels(desc.num_channels),
+        sample_rate(desc.sample_rate)
+{
+#ifdef WIVRN_USE_OPUS
+	if (desc.codec == audio_codec::opus)
+		encoder.emplace(desc, OPUS_APPLICATION_AUDIO);
+#endif
+}
+
+void audio_sender::send(std::span<uint8_t> samples, XrTime timestamp)
+{
+#ifdef WIVRN_USE_OPUS
+	if (encoder)
+	{
+		// Packets are small, a lost one is recovered by the headset from the next one
+		encoder->encode(
+		        std::span((const int16_t *)samples.data(), samples.size() / sizeof(int16_t)),
+		        timestamp,
+		        [&](audio_data && packet) { session.send_stream(packet); });
+		return;
+	}
+#endif
+	size_t frames = samples.size() / (num_channels * sizeof(int16_t));
+	audio_data packet{
+	        .timestamp = timestamp - XrTime(frames * 1'000'000'000 / sample_rate),
+	        .payload = samples,
+	};
+	if (samples.size() <= max_raw_stream_payload)
+		session.send_stream(packet);
+	else
+		session.send_control(packet);
+}
+
+audio_receiver::audio_receiver(const to_headset::audio_stream_description::device & desc)
+{
+#ifdef WIVRN_USE_OPUS
+	if (desc.codec == audio_codec::opus)
+		decoder.emplace(desc);
+#endif
+}
@@ -20,15 +20,79 @@
 #pragma once
 
 #include <memory>
+#include <optional>
+#include <span>
 #include <string>
 
+#include "wivrn_config.h"
 #include "wivrn_packets.h"
 
+#ifdef WIVRN_USE_OPUS
+#include "opus_codec.h"
+#endif
+
 namespace xrt::drivers::wivrn
 {
 class wivrn_session;
 }
 
+// Stream parameters for a device of the headset, the codec is chosen from the configuration and what the headset supports
+xrt::drivers::wivrn::to_headset::audio_stream_description::device audio_stream_parameters(
+        const xrt::drivers::wivrn::from_headset::headset_info_packet::audio_description & headset);
+
+// Samples per channel in each network packet, the audio graph should process samples by this amount
+uint32_t audio_packet_frames(const xrt::drivers::wivrn::to_headset::audio_stream_description::device &);
+
+// Sends interleaved S16 speaker samples to the headset with the negotiated codec
+class audio_sender
+{
+	xrt::drivers::wivrn::wivrn_session & session;
+	uint8_t num_channels;
+	uint32_t sample_rate;
+#ifdef WIVRN_USE_OPUS
+	std::optional<xrt::drivers::wivrn::opus_encoder> encoder;
+#endif
+
+public:
+	audio_sender(const xrt::drivers::wivrn::to_headset::audio_stream_description::device &, xrt::drivers::wivrn::wivrn_session &);
+
+	// timestamp is the time of the end of samples in the headset clock, the same timeline as the video frames.
+	// Each packet gets the time of its first sample.
+	// Throws if sending fails
+	void send(std::span<uint8_t> samples, XrTime timestamp);
+};
+
+// Decodes microphone packets to interleaved S16 samples
+class audio_receiver
+{
+#ifdef WIVRN_USE_OPUS
+	std::optional<xrt::drivers::wivrn::opus_decoder> decoder;
+#endif
+
+public:
+	audio_receiver(const xrt::drivers::wivrn::to_headset::audio_stream_description::device &);
+
+	// f is called with each decoded packet
+	template <typename F>
+	void receive(xrt::drivers::wivrn::audio_data && packet, F && f)
+	{
+#ifdef WIVRN_USE_OPUS
+		if (decoder)
+		{
+			decoder->decode(packet, [&](std::span<const int16_t> samples) {
+				xrt::drivers::wivrn::audio_data pcm{.timestamp = packet.timestamp};
+				auto bytes = std::as_bytes(samples);
+				pcm.data.c.assign((const uint8_t *)bytes.data(), (const uint8_t *)bytes.data() + bytes.size());
+				pcm.payload = pcm.data.c;
+				f(std::move(pcm));
+			});
+			return;
+		}
+#endif
+		f(std::move(packet));
+	}
+};
+
 struct audio_device
 {
 	// unpublishes the device
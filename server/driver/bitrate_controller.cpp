@@ -0,0 +1,141 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "bitrate_controller.h"
+
+#include "clock_offset.h"
+#include "encoder/encoder_settings.h"
+#include "os/os_time.h"
+#include "util/u_logging.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace xrt::drivers::wivrn
+{
+
+// Queueing delay above which the link is considered congested
+static const int64_t congested_delay = 15'000'000;
+// Queueing delay below which the bitrate can increase
+static const int64_t clear_delay = 5'000'000;
+// Minimum time between two bitrate decreases, to let the queues drain
+static const int64_t decrease_interval = 200'000'000;
+static const double decrease_factor = 0.85;
+// Relative increase per second of the bitrate
+static const double increase_rate = 0.05;
+// Bitrate changes smaller than this are not sent to encoders
+static const double min_change = 0.05;
+// Weight of each frame in the marked fraction, and minimum time between two decreases
+// caused by ECN marks: they come before the queues build up, so the response is smaller and faster
+static const double mark_gain = 1. / 16;
+static const int64_t mark_decrease_interval = 20'000'000;
+
+bitrate_controller::bitrate_controller(const std::vector<encoder_settings> & settings, std::optional<uint64_t> link_capacity) :
+        max_bitrate([&]() {
+	        uint64_t total = 0;
+	        for (const auto & encoder: settings)
+		        total += encoder.bitrate;
+	        return total;
+        }()),
+        min_bitrate(max_bitrate / 10),
+        bitrate(max_bitrate),
+        applied_bitrate(max_bitrate)
+{
+	for (const auto & encoder: settings)
+		weights.push_back(max_bitrate ? double(encoder.bitrate) / max_bitrate : 0);
+
+	// The encoders are set to the new bitrate on the first feedback
+	if (link_capacity)
+	{
+		bitrate = std::clamp<double>(link_bitrate(*link_capacity), min_bitrate, max_bitrate);
+		throughput = *link_capacity / 8e9;
+	}
+}
+
+void bitrate_controller::set_limit(double fraction)
+{
+	std::lock_guard lock(mutex);
+	limit = fraction;
+}
+
+std::optional<std::vector<uint64_t>> bitrate_controller::on_feedback(const from_headset::feedback & feedback, const frame_info & info, const clock_offset & offset)
+{
+	std::lock_guard lock(mutex);
+
+	int64_t now = os_monotonic_get_ns();
+	bool lost = feedback.received_first_packet and (not feedback.sent_to_decoder or feedback.lost_slices);
+	bool congested = lost;
+
+	// L4S style: decrease in proportion to the fraction of marked shards, as long as there are marks
+	bool marked = feedback.congestion_marks > 0;
+	if (info.shards > 0)
+		marked_fraction = std::lerp(marked_fraction, std::min(1., double(feedback.congestion_marks) / info.shards), mark_gain);
+	if (marked and now - last_mark_decrease > mark_decrease_interval)
+	{
+		bitrate *= 1 - std::max(marked_fraction, mark_gain) / 2;
+		last_mark_decrease = now;
+	}
+
+	if (feedback.received_last_packet and info.send_end)
+	{
+		int64_t received_begin = offset.from_headset(feedback.received_first_packet);
+		int64_t received_end = offset.from_headset(feedback.received_last_packet);
+		int64_t delay = received_end - info.send_end;
+
+		// Forget the minimum slowly to follow clock drift
+		if (min_delay == std::numeric_limits<int64_t>::max())
+			min_delay = delay;
+		else
+			min_delay = std::min(delay, min_delay + 10'000);
+		int64_t queueing_delay = delay - min_delay;
+
+		if (received_end > received_begin)
+			throughput = std::lerp(throughput, double(info.bytes) / (received_end - received_begin), 0.1);
+
+		// IDR frames are larger than the others and take longer to go through
+		if (queueing_delay > congested_delay and not info.idr)
+			congested = true;
+		else if (queueing_delay < clear_delay and last_update and not lost and not marked)
+			bitrate *= 1 + increase_rate * (now - last_update) * 1e-9;
+	}
+	last_update = now;
+
+	if (congested and now - last_decrease > decrease_interval)
+	{
+		bitrate *= decrease_factor;
+		// Do not go above what was recently received
+		if (throughput > 0)
+			bitrate = std::min(bitrate, throughput * 8e9);
+		last_decrease = now;
+	}
+
+	bitrate = std::clamp<double>(bitrate, min_bitrate, std::max<double>(min_bitrate, max_bitrate * limit));
+
+	if (std::abs(bitrate - applied_bitrate) < min_change * applied_bitrate)
+		return std::nullopt;
+
+	applied_bitrate = bitrate;
+	U_LOG_I("Setting bitrate to %ldMbit/s", applied_bitrate / 1'000'000);
+
+	std::vector<uint64_t> res;
+	for (double weight: weights)
+		res.push_back(weight * applied_bitrate);
+	return res;
+}
+} // namespace xrt::drivers::wivrn
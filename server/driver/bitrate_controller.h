@@ -0,0 +1,88 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "wivrn_packets.h"
+
+#include <cstdint>
+#include <limits>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+struct clock_offset;
+
+namespace xrt::drivers::wivrn
+{
+struct encoder_settings;
+
+// Congestion controller for the video streams, adjusts the total bitrate
+// based on queueing delay, ECN marks and loss reported in feedback packets
+class bitrate_controller
+{
+	std::mutex mutex;
+
+	const uint64_t max_bitrate;
+	const uint64_t min_bitrate;
+	double bitrate;
+	uint64_t applied_bitrate;
+	// Share of the total bitrate for each encoder
+	std::vector<double> weights;
+
+	// Smallest observed one way delay, includes clock offset error
+	int64_t min_delay = std::numeric_limits<int64_t>::max();
+	int64_t last_update = 0;
+	int64_t last_decrease = 0;
+	// Smoothed fraction of the shards with the Congestion Experienced mark
+	double marked_fraction = 0;
+	int64_t last_mark_decrease = 0;
+	// Bytes per ns, measured when receiving frames
+	double throughput = 0;
+	// Fraction of max_bitrate that can be used, requested by the headset when it is throttled
+	double limit = 1;
+
+public:
+	struct frame_info
+	{
+		size_t bytes;
+		// Server clock
+		int64_t send_begin;
+		int64_t send_end;
+		bool idr;
+		// Number of parts the encoder output the frame in
+		uint16_t slices;
+		// Negative if the encoder does not report it
+		float average_qp;
+		// ns from the start of encoding to the last encoded data
+		int64_t encode_time;
+		// Data shards sent over UDP
+		uint16_t shards;
+	};
+
+	// The measured link capacity in bit/s, if known, sets the starting bitrate and throughput
+	bitrate_controller(const std::vector<encoder_settings> & settings, std::optional<uint64_t> link_capacity = std::nullopt);
+
+	// Applied on the next feedback
+	void set_limit(double fraction);
+
+	// Returns the new bitrate of each encoder, if they must be changed
+	std::optional<std::vector<uint64_t>> on_feedback(const from_headset::feedback &, const frame_info &, const clock_offset &);
+};
+} // namespace xrt::drivers::wivrn
@@ -23,7 +23,18 @@
 #include "os/os_time.h"
 #include "util/u_logging.h"
 
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
 static const size_t num_samples = 100;
+// Minimum duration covered by the samples to estimate the clock drift
+static const XrTime min_drift_span = 5'000'000'000;
+// Relative drift above which the estimation is considered wrong
+static const double max_drift = 1e-3;
+// Consecutive rejected samples after which the network is assumed to have changed
+static const int max_rejected = 10;
+static const XrTime log_interval = 10'000'000'000;
 
 void clock_offset_estimator::reset()
 {
@@ -31,6 +42,9 @@ void clock_offset_estimator::reset()
 	sample_index = 0;
 	samples.clear();
 	offset = clock_offset();
+	min_rtt = 0;
+	median_rtt = 0;
+	rejected = 0;
 	next_sample = {};
 	sample_interval = std::chrono::milliseconds(10);
 }
@@ -52,83 +66,129 @@ void clock_offset_estimator::add_sample(const xrt::drivers::wivrn::from_headset:
 	XrTime now = os_monotonic_get_ns();
 	clock_offset_estimator::sample sample{base_sample, now};
 	std::lock_guard lock(mutex);
+	int64_t rtt = sample.received - sample.query;
+	// packets with too high latency are likely to be retransmitted
+	if (samples.size() >= num_samples / 2 and rtt > 3 * median_rtt and ++rejected < max_rejected)
+	{
+		U_LOG_D("drop packet for latency %ldµs > %ldµs", rtt / 1000, 3 * median_rtt / 1000);
+		return;
+	}
+	rejected = 0;
+
 	if (samples.size() < num_samples)
 	{
 		samples.push_back(sample);
 	}
 	else
 	{
-		sample_interval = std::chrono::seconds(1);
-		int64_t latency = 0;
-		for (const auto & s: samples)
-			latency += s.received - s.query;
-		latency /= samples.size();
-		// packets with too high latency are likely to be retransmitted
-		if (sample.received - sample.query > 3 * latency)
-		{
-			U_LOG_D("drop packet for latency %ldµs > %ldµs", (sample.received - sample.query) / 1000, latency / 1000);
-			return;
-		}
-
 		samples[sample_index] = sample;
 		sample_index = (sample_index + 1) % num_samples;
 	}
 
-	// Linear regression
+	update();
+}
+
+void clock_offset_estimator::update()
+{
+	const size_t n = samples.size();
+	std::vector<int64_t> rtt(n);
+	for (size_t i = 0; i < n; ++i)
+		rtt[i] = samples[i].received - samples[i].query;
+	auto median = rtt.begin() + n / 2;
+	std::nth_element(rtt.begin(), median, rtt.end());
+	median_rtt = *median;
+	min_rtt = *std::min_element(rtt.begin(), median + 1);
+
+	// Only use the samples with the lowest round trip times, the others
+	// were delayed by queueing, which is usually not symmetrical.
 	// X = time on server
 	// Y = time on headset
 	// in order to maintain accuracy, use x = X-x0, y = Y-y0
 	// where x0 and y0 are means of X an Y
-	size_t n = samples.size();
-	double inv_n = 1. / n;
+	auto selected = [this](const sample & s) { return s.received - s.query <= median_rtt; };
+	size_t count = 0;
 	double x0 = 0;
 	double y0 = 0;
+	XrTime first = std::numeric_limits<XrTime>::max();
+	XrTime last = 0;
 	for (const auto & s: samples)
 	{
-		x0 += (s.query + s.received) * 0.5;
+		if (not selected(s))
+			continue;
+		// assume symmetrical latency
+		XrTime x = (s.query + s.received) / 2;
+		x0 += x;
 		y0 += s.response;
+		first = std::min(first, x);
+		last = std::max(last, x);
+		++count;
 	}
-	x0 /= n;
-	y0 /= n;
-
-	if (samples.size() < num_samples)
-	{
-		offset.a = 1;
-		offset.b = y0 - x0;
-		return;
-	}
+	x0 /= count;
+	y0 /= count;
 
-	double sum_x = 0;
-	double sum_y = 0;
 	double sum_x2 = 0;
 	double sum_xy = 0;
 	for (const auto & s: samples)
 	{
-#if 1
-		// assume symmetrical latency
+		if (not selected(s))
+			continue;
 		double x = (s.query + s.received) * 0.5 - x0;
-#else
-		// assume latency is only on server -> headset link
-		double x = s.received - x0;
-#endif
 		double y = s.response - y0;
-		sum_x += x;
-		sum_y += y;
 		sum_x2 += x * x;
 		sum_xy += x * y;
 	}
 
-	double mean_x = sum_x * inv_n;
-	double mean_y = sum_y * inv_n;
-	// y = ax + b
-	double cov = inv_n * sum_xy - mean_x * mean_y;
-	double v = inv_n * sum_x2 - mean_x * mean_x;
-	double a = cov / v;
-	double b = mean_y - a * mean_x;
+	// The drift is only estimated when the samples cover enough time,
+	// otherwise keep the previous estimation
+	double a = offset.a;
+	if (n == num_samples and last - first >= min_drift_span and sum_x2 > 0)
+	{
+		double fit = sum_xy / sum_x2;
+		if (std::abs(fit - 1) < max_drift)
+			a = fit;
+	}
+
+	double sum_residual2 = 0;
+	for (const auto & s: samples)
+	{
+		if (not selected(s))
+			continue;
+		double residual = (s.response - y0) - a * ((s.query + s.received) * 0.5 - x0);
+		sum_residual2 += residual * residual;
+	}
+	double jitter = std::sqrt(sum_residual2 / count);
 
 	offset.a = a;
-	offset.b = y0 + b - int64_t(a * x0);
-	U_LOG_D("clock relations: headset = a*x+b where a=%f b=%ldµs", offset.a, offset.b / 1000);
+	offset.b = y0 - int64_t(a * x0);
+	// Asymmetry of the fastest round trip, and standard error of the mean
+	offset.uncertainty = min_rtt / 2 + jitter / std::sqrt(count);
+
+	// Sample quickly until the window is full and covers enough time for the drift,
+	// then according to the measurement noise
+	using namespace std::chrono_literals;
+	if (n < num_samples)
+		sample_interval = 10ms;
+	else if (last - first < min_drift_span)
+		sample_interval = std::chrono::duration_cast<std::chrono::milliseconds>(2 * std::chrono::nanoseconds(min_drift_span) / num_samples);
+	else if (jitter > 1'000'000)
+		sample_interval = 100ms;
+	else if (jitter > 250'000)
+		sample_interval = 250ms;
+	else
+		sample_interval = 1s;
+
+	XrTime now = os_monotonic_get_ns();
+	if (now - last_log < log_interval)
+		return;
+	last_log = now;
+	U_LOG_D("clock relations: headset = a*x+b where a=%f (drift %.1fppm) b=%ldµs ±%ldµs, round trip min %ldµs median %ldµs, sampling every %ldms",
+	        offset.a,
+	        (offset.a - 1) * 1e6,
+	        offset.b / 1000,
+	        offset.uncertainty / 1000,
+	        min_rtt / 1000,
+	        median_rtt / 1000,
+	        sample_interval.load().count());
 }
 
 clock_offset clock_offset_estimator::get_offset()
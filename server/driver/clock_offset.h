@@ -35,6 +35,8 @@ struct clock_offset
 	// y = ax+b
 	int64_t b = 0;
 	double a = 1;
+	// Estimated error of b in nanoseconds
+	int64_t uncertainty = 0;
 
 	operator bool() const
 	{
@@ -57,10 +59,18 @@ class clock_offset_estimator
 	std::vector<sample> samples;
 	size_t sample_index = 0;
 	clock_offset offset;
+	// Round trip times of the current samples
+	int64_t min_rtt = 0;
+	int64_t median_rtt = 0;
+	// Consecutive samples rejected for their latency
+	int rejected = 0;
+	XrTime last_log = 0;
 
 	std::chrono::steady_clock::time_point next_sample{};
 	std::atomic<std::chrono::milliseconds> sample_interval = std::chrono::milliseconds(10);
 
+	void update();
+
 public:
 	void reset();
 	void request_sample(wivrn_connection & connection);
@@ -17,8 +17,10 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
 #include <filesystem>
 #include <fstream>
+#include <mutex>
 #define JSON_DISABLE_ENUM_SERIALIZATION 1
 #ifdef JSON_DIAGNOSTICS
 #undef JSON_DIAGNOSTICS
@@ -35,6 +37,9 @@
 
 static std::filesystem::path config_file = xdg_config_home() / "wivrn" / "config.json";
 
+static std::mutex running_application_mutex;
+static std::vector<std::string> running_application;
+
 static std::filesystem::path get_cookie_file()
 {
 	return xdg_config_home() / "wivrn" / "cookie";
@@ -48,14 +53,82 @@ NLOHMANN_JSON_SERIALIZE_ENUM(
                 {video_codec(-1), ""},
                 {h265, "h265"},
                 {h265, "hevc"},
+                {av1, "av1"},
+                {h264, "h264"},
+                {h264, "avc"},
+        })
+
+NLOHMANN_JSON_SERIALIZE_ENUM(
+        audio_codec,
+        {
+                {audio_codec(-1), ""},
+                {audio_codec::raw, "raw"},
+                {audio_codec::opus, "opus"},
         })
 }
 
+NLOHMANN_JSON_SERIALIZE_ENUM(
+        pose_predictor,
+        {
+                {pose_predictor(-1), ""},
+                {pose_predictor::none, "none"},
+                {pose_predictor::linear, "linear"},
+                {pose_predictor::velocity, "velocity"},
+                {pose_predictor::acceleration, "acceleration"},
+                {pose_predictor::kalman, "kalman"},
+        })
+
+NLOHMANN_JSON_SERIALIZE_ENUM(
+        configuration::thread_policy::scheduler,
+        {
+                {configuration::thread_policy::scheduler(-1), ""},
+                {configuration::thread_policy::scheduler::other, "other"},
+                {configuration::thread_policy::scheduler::fifo, "fifo"},
+                {configuration::thread_policy::scheduler::rtkit, "rtkit"},
+        })
+
 void configuration::set_config_file(const std::filesystem::path & path)
 {
 	config_file = path;
 }
 
+const std::filesystem::path & configuration::get_config_file()
+{
+	return config_file;
+}
+
+void configuration::set_running_application(std::vector<std::string> names)
+{
+	std::lock_guard lock(running_application_mutex);
+	running_application = std::move(names);
+}
+
+static void apply_profile(configuration & config)
+{
+	std::lock_guard lock(running_application_mutex);
+	auto profile = std::ranges::find_if(config.profiles, [](const auto & p) {
+		return std::ranges::find(running_application, p.application) != running_application.end();
+	});
+	if (profile == config.profiles.end())
+		return;
+
+	config.active_profile = profile->application;
+	if (profile->bitrate)
+		config.bitrate = profile->bitrate;
+	if (profile->codec)
+		config.codec = profile->codec;
+	if (profile->scale)
+		config.scale = profile->scale;
+	if (profile->foveated_inset)
+		config.foveated_inset = profile->foveated_inset;
+	if (profile->refresh_rate)
+		config.refresh_rate = profile->refresh_rate;
+	if (profile->pacing)
+		config.pacing = profile->pacing;
+	if (profile->latency_percentile)
+		config.latency_percentile = profile->latency_percentile;
+}
+
 configuration configuration::read_user_configuration()
 {
 	configuration result;
@@ -79,6 +152,108 @@ configuration configuration::read_user_configuration()
 			result.bitrate = json["bitrate"];
 		}
 
+		if (json.contains("fec_ratio"))
+		{
+			result.fec_ratio = json["fec_ratio"];
+		}
+
+		if (json.contains("adaptive_bitrate"))
+		{
+			result.adaptive_bitrate = json["adaptive_bitrate"];
+		}
+
+		if (json.contains("dynamic_resolution"))
+		{
+			result.dynamic_resolution = json["dynamic_resolution"];
+		}
+
+		if (json.contains("automatic_refresh_rate"))
+		{
+			result.automatic_refresh_rate = json["automatic_refresh_rate"];
+		}
+
+		if (json.contains("pacing"))
+		{
+			result.pacing = json["pacing"];
+		}
+
+		if (json.contains("latency_percentile"))
+		{
+			result.latency_percentile = json["latency_percentile"];
+		}
+
+		if (json.contains("qp_emphasis"))
+		{
+			result.qp_emphasis = json["qp_emphasis"];
+		}
+
+		if (json.contains("foveated_inset"))
+		{
+			result.foveated_inset = json["foveated_inset"];
+		}
+
+		if (json.contains("skip_static_frames"))
+		{
+			result.skip_static_frames = json["skip_static_frames"];
+		}
+
+		if (json.contains("non_reference_frames"))
+		{
+			result.non_reference_frames = json["non_reference_frames"];
+		}
+
+		if (json.contains("error_concealment"))
+		{
+			result.error_concealment = json["error_concealment"];
+		}
+
+		if (json.contains("throttle_on_drop"))
+		{
+			result.throttle_on_drop = json["throttle_on_drop"];
+		}
+
+		if (json.contains("half_rate"))
+		{
+			result.half_rate = json["half_rate"];
+		}
+
+		if (json.contains("motion_extrapolation"))
+		{
+			result.motion_extrapolation = json["motion_extrapolation"];
+		}
+
+		if (json.contains("depth_stream"))
+		{
+			result.depth_stream = json["depth_stream"];
+		}
+
+		if (json.contains("quad_layers"))
+		{
+			result.quad_layers = json["quad_layers"];
+		}
+
+		if (json.contains("bypass_compositor"))
+		{
+			result.bypass_compositor = json["bypass_compositor"];
+		}
+
+		if (json.contains("prediction"))
+		{
+			const auto & prediction = json["prediction"];
+			for (auto [name, value]: {
+			             std::pair{"head", &result.prediction.head},
+			             std::pair{"controllers", &result.prediction.controllers},
+			             std::pair{"hands", &result.prediction.hands},
+			     })
+			{
+				if (not prediction.contains(name))
+					continue;
+				*value = prediction[name];
+				if (*value == pose_predictor(-1))
+					throw std::runtime_error("invalid prediction value " + prediction[name].get<std::string>());
+			}
+		}
+
 		if (json.contains("encoders"))
 		{
 			for (const auto & encoder: json["encoders"])
@@ -100,10 +275,17 @@ configuration configuration::read_user_configuration()
 					throw std::runtime_error("invalid codec value " + encoder["codec"].get<std::string>());
 				SET_IF(options);
 				SET_IF(device);
+				SET_IF(intra_refresh);
+				SET_IF(fec_ratio);
 				result.encoders.push_back(e);
 			}
 		}
 
+		if (json.contains("encoder_autotune"))
+		{
+			result.encoder_autotune = json["encoder_autotune"];
+		}
+
 		if (json.contains("application"))
 		{
 			if (json["application"].is_string())
@@ -117,10 +299,127 @@ configuration configuration::read_user_configuration()
 			}
 		}
 
+		if (json.contains("profiles"))
+		{
+			for (const auto & profile: json["profiles"])
+			{
+				configuration::profile p;
+				p.application = profile.at("application");
+				if (profile.contains("bitrate"))
+					p.bitrate = profile["bitrate"];
+				if (profile.contains("codec"))
+				{
+					p.codec = profile["codec"];
+					if (p.codec == xrt::drivers::wivrn::video_codec(-1))
+						throw std::runtime_error("invalid codec value " + profile["codec"].get<std::string>());
+				}
+				if (profile.contains("scale"))
+				{
+					if (profile["scale"].is_number())
+						p.scale = std::array<double, 2>{profile["scale"], profile["scale"]};
+					else
+						p.scale = profile["scale"];
+				}
+				if (profile.contains("foveated_inset"))
+					p.foveated_inset = profile["foveated_inset"];
+				if (profile.contains("refresh_rate"))
+					p.refresh_rate = profile["refresh_rate"];
+				if (profile.contains("pacing"))
+					p.pacing = profile["pacing"];
+				if (profile.contains("latency_percentile"))
+					p.latency_percentile = profile["latency_percentile"];
+				result.profiles.push_back(p);
+			}
+		}
+
 		if (json.contains("tcp_only"))
 		{
 			result.tcp_only = json["tcp_only"];
 		}
+
+		if (json.contains("low_latency_channel"))
+		{
+			result.low_latency_channel = json["low_latency_channel"];
+		}
+
+		if (json.contains("video_sockets"))
+		{
+			result.video_sockets = json["video_sockets"];
+		}
+
+		if (json.contains("ecn"))
+		{
+			result.ecn = json["ecn"];
+		}
+
+		if (json.contains("port"))
+		{
+			result.port = json["port"];
+		}
+
+		if (json.contains("metrics_port"))
+		{
+			result.metrics_port = json["metrics_port"];
+		}
+
+		if (json.contains("timings_port"))
+		{
+			result.timings_port = json["timings_port"];
+		}
+
+		if (json.contains("stats_shm"))
+		{
+			result.stats_shm = json["stats_shm"];
+		}
+
+		if (json.contains("spectator_socket"))
+		{
+			result.spectator_socket = json["spectator_socket"];
+		}
+
+		if (json.contains("audio_codec"))
+		{
+			result.audio_codec = json["audio_codec"];
+			if (result.audio_codec == xrt::drivers::wivrn::audio_codec(-1))
+				throw std::runtime_error("invalid audio_codec value " + json["audio_codec"].get<std::string>());
+		}
+
+		if (json.contains("audio_frame_duration"))
+		{
+			result.audio_frame_duration = json["audio_frame_duration"];
+			if (result.audio_frame_duration != 2.5 and result.audio_frame_duration != 5 and
+			    result.audio_frame_duration != 10 and result.audio_frame_duration != 20)
+				throw std::runtime_error("invalid audio_frame_duration value, must be 2.5, 5, 10 or 20");
+		}
+
+		if (json.contains("audio_offset"))
+			result.audio_offset = json["audio_offset"];
+
+		if (json.contains("scheduling"))
+		{
+			const auto & scheduling = json["scheduling"];
+			for (auto [name, value]: {
+			             std::pair{"compositor", &result.scheduling.compositor},
+			             std::pair{"encoder", &result.scheduling.encoder},
+			             std::pair{"session", &result.scheduling.session},
+			             std::pair{"audio", &result.scheduling.audio},
+			     })
+			{
+				if (not scheduling.contains(name))
+					continue;
+				const auto & policy = scheduling[name];
+				if (policy.contains("policy"))
+				{
+					value->policy = policy["policy"];
+					if (value->policy == configuration::thread_policy::scheduler(-1))
+						throw std::runtime_error("invalid scheduling policy " + policy["policy"].get<std::string>());
+				}
+				if (policy.contains("priority"))
+					value->priority = policy["priority"];
+				if (policy.contains("cpus"))
+					value->cpus = policy["cpus"].get<std::vector<int>>();
+			}
+		}
 	}
 	catch (const std::exception & e)
 	{
@@ -128,6 +427,7 @@ configuration configuration::read_user_configuration()
 		return {};
 	}
 
+	apply_profile(result);
 	return result;
 }
 
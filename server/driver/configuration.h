@@ -24,7 +24,9 @@
 #include <map>
 #include <optional>
 #include <string>
+#include <vector>
 
+#include "driver/pose_predictor.h"
 #include "wivrn_packets.h"
 
 struct configuration
@@ -40,16 +42,103 @@ struct configuration
 		std::optional<xrt::drivers::wivrn::video_codec> codec;
 		std::map<std::string, std::string> options;
 		std::optional<std::string> device;
+		std::optional<int> intra_refresh;
+		// Overrides the global fec_ratio for this encoder
+		std::optional<double> fec_ratio;
+	};
+
+	// Settings applied while an OpenXR application with this executable name is running
+	struct profile
+	{
+		std::string application;
+		std::optional<int> bitrate;
+		std::optional<xrt::drivers::wivrn::video_codec> codec;
+		std::optional<std::array<double, 2>> scale;
+		std::optional<double> foveated_inset;
+		std::optional<float> refresh_rate;
+		std::optional<double> pacing;
+		std::optional<double> latency_percentile;
 	};
 
 	std::vector<encoder> encoders;
+	bool encoder_autotune = true;
 	std::optional<int> bitrate;
+	std::optional<double> fec_ratio;
+	bool adaptive_bitrate = false;
+	bool dynamic_resolution = false;
+	bool automatic_refresh_rate = false;
+	std::optional<double> pacing;
+	std::optional<double> latency_percentile;
+	std::optional<double> qp_emphasis;
+	std::optional<double> foveated_inset;
+	bool skip_static_frames = false;
+	bool non_reference_frames = false;
+	bool error_concealment = false;
+	bool throttle_on_drop = false;
+	bool half_rate = false;
+	bool motion_extrapolation = false;
+	bool depth_stream = false;
+	bool quad_layers = false;
+	bool bypass_compositor = false;
+	struct
+	{
+		pose_predictor head = pose_predictor::velocity;
+		pose_predictor controllers = pose_predictor::none;
+		pose_predictor hands = pose_predictor::none;
+	} prediction;
 	std::optional<std::array<double, 2>> scale;
+	// Only set by a profile: refresh rate, instead of the one selected on the headset, and codec of all the encoders
+	std::optional<float> refresh_rate;
+	std::optional<xrt::drivers::wivrn::video_codec> codec;
 	std::vector<std::string> application;
+	std::vector<profile> profiles;
+	// Application of the profile merged in this configuration
+	std::optional<std::string> active_profile;
+	std::optional<int> port;
 	bool tcp_only = false;
+	bool low_latency_channel = true;
+	// UDP sockets for the video streams, including the stream socket
+	int video_sockets = 1;
+	// Mark the video datagrams ECN capable, ECT(1) as used by L4S
+	bool ecn = false;
+	std::optional<int> metrics_port;
+	std::optional<int> timings_port;
+	std::optional<std::string> stats_shm;
+	std::optional<std::string> spectator_socket;
+	xrt::drivers::wivrn::audio_codec audio_codec = xrt::drivers::wivrn::audio_codec::opus;
+	// Duration of opus packets, in ms
+	double audio_frame_duration = 10;
+	// Delay of the audio relative to the video, in ms
+	double audio_offset = 0;
+
+	struct thread_policy
+	{
+		enum class scheduler
+		{
+			other,
+			fifo,
+			rtkit,
+		};
+		scheduler policy = scheduler::other;
+		// Real-time priority, for fifo and rtkit
+		int priority = 10;
+		// CPUs the thread may run on, empty for all
+		std::vector<int> cpus;
+	};
+	struct
+	{
+		thread_policy compositor;
+		thread_policy encoder;
+		thread_policy session;
+		thread_policy audio;
+	} scheduling;
 
 	static void set_config_file(const std::filesystem::path &);
+	static const std::filesystem::path & get_config_file();
 	static configuration read_user_configuration();
+	// Names of the running OpenXR application, the first profile matching one of them is merged in
+	// the configuration returned by read_user_configuration
+	static void set_running_application(std::vector<std::string> names);
 };
 
 std::string server_cookie();
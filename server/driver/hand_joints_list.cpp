@@ -20,37 +20,324 @@
 #include "hand_joints_list.h"
 #include "math/m_space.h"
 #include "pose_list.h"
+#include "wivrn_quantization.h"
 #include "xrt_cast.h"
 
+#include <algorithm>
+#include <cmath>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
 using namespace xrt::drivers::wivrn;
 
 static_assert(XRT_HAND_JOINT_COUNT == XR_HAND_JOINT_COUNT_EXT);
 
 namespace
 {
-xrt_hand_joint_value interpolate(const xrt_hand_joint_value & a, const xrt_hand_joint_value & b, float t)
+// Quaternion dot product for a rotation of 2° between two samples: below it, the
+// normalized linear interpolation is within 2e-7 rad of the spherical one.
+// Joints move little between two samples, so slerp is rarely needed.
+constexpr float nlerp_threshold = 0.99985;
+
+#if defined(__SSE2__)
+using float4 = __m128;
+float4 load(const float * p)
 {
-	return {
-	        .relation = pose_list::interpolate(a.relation, b.relation, t),
-	        .radius = a.radius * (1 - t) + b.radius * t};
+	return _mm_load_ps(p);
+}
+void store(float * p, float4 v)
+{
+	_mm_store_ps(p, v);
+}
+float4 splat(float x)
+{
+	return _mm_set1_ps(x);
+}
+float4 add(float4 a, float4 b)
+{
+	return _mm_add_ps(a, b);
+}
+float4 mul(float4 a, float4 b)
+{
+	return _mm_mul_ps(a, b);
+}
+float4 sub(float4 a, float4 b)
+{
+	return _mm_sub_ps(a, b);
+}
+float4 div(float4 a, float4 b)
+{
+	return _mm_div_ps(a, b);
+}
+float4 sqrt(float4 x)
+{
+	return _mm_sqrt_ps(x);
+}
+float4 max(float4 a, float4 b)
+{
+	return _mm_max_ps(a, b);
+}
+// Sign bits of x
+float4 sign(float4 x)
+{
+	return _mm_and_ps(x, _mm_set1_ps(-0.f));
+}
+// Flips x where the sign bit of s is set
+float4 flip(float4 x, float4 s)
+{
+	return _mm_xor_ps(x, s);
+}
+#elif defined(__aarch64__)
+using float4 = float32x4_t;
+float4 load(const float * p)
+{
+	return vld1q_f32(p);
+}
+void store(float * p, float4 v)
+{
+	vst1q_f32(p, v);
+}
+float4 splat(float x)
+{
+	return vdupq_n_f32(x);
+}
+float4 add(float4 a, float4 b)
+{
+	return vaddq_f32(a, b);
+}
+float4 mul(float4 a, float4 b)
+{
+	return vmulq_f32(a, b);
+}
+float4 sub(float4 a, float4 b)
+{
+	return vsubq_f32(a, b);
+}
+float4 div(float4 a, float4 b)
+{
+	return vdivq_f32(a, b);
+}
+float4 sqrt(float4 x)
+{
+	return vsqrtq_f32(x);
+}
+float4 max(float4 a, float4 b)
+{
+	return vmaxq_f32(a, b);
+}
+float4 sign(float4 x)
+{
+	return vreinterpretq_f32_u32(vandq_u32(vreinterpretq_u32_f32(x), vdupq_n_u32(0x80000000)));
+}
+float4 flip(float4 x, float4 s)
+{
+	return vreinterpretq_f32_u32(veorq_u32(vreinterpretq_u32_f32(x), vreinterpretq_u32_f32(s)));
+}
+#else
+struct float4
+{
+	float v[4];
+};
+float4 load(const float * p)
+{
+	return {p[0], p[1], p[2], p[3]};
+}
+void store(float * p, float4 v)
+{
+	for (int i = 0; i < 4; ++i)
+		p[i] = v.v[i];
+}
+float4 splat(float x)
+{
+	return {x, x, x, x};
+}
+template <typename F>
+float4 apply(float4 a, float4 b, F && f)
+{
+	return {f(a.v[0], b.v[0]), f(a.v[1], b.v[1]), f(a.v[2], b.v[2]), f(a.v[3], b.v[3])};
+}
+float4 add(float4 a, float4 b)
+{
+	return apply(a, b, [](float x, float y) { return x + y; });
+}
+float4 mul(float4 a, float4 b)
+{
+	return apply(a, b, [](float x, float y) { return x * y; });
+}
+float4 sub(float4 a, float4 b)
+{
+	return apply(a, b, [](float x, float y) { return x - y; });
+}
+float4 div(float4 a, float4 b)
+{
+	return apply(a, b, [](float x, float y) { return x / y; });
+}
+float4 sqrt(float4 x)
+{
+	return apply(x, x, [](float x, float) { return std::sqrt(x); });
+}
+float4 max(float4 a, float4 b)
+{
+	return apply(a, b, [](float x, float y) { return std::max(x, y); });
+}
+float4 sign(float4 x)
+{
+	return apply(x, x, [](float x, float) { return std::signbit(x) ? -0.f : 0.f; });
+}
+float4 flip(float4 x, float4 s)
+{
+	return apply(x, s, [](float x, float s) { return std::signbit(s) ? -x : x; });
+}
+#endif
+
+float4 dot(const float4 (&a)[4], const float4 (&b)[4])
+{
+	return add(add(mul(a[0], b[0]), mul(a[1], b[1])), add(mul(a[2], b[2]), mul(a[3], b[3])));
+}
+
+void lerp(const float * a, const float * b, float t, float * out)
+{
+	float4 vt = splat(t);
+	for (size_t i = 0; i < hand_joints::padded_count; i += 4)
+	{
+		float4 va = load(a + i);
+		store(out + i, add(va, mul(sub(load(b + i), va), vt)));
+	}
+}
+
+// Shortest path rotations, 4 joints at a time
+void slerp(const hand_joints & a, const hand_joints & b, float t, hand_joints & out)
+{
+	for (size_t i = 0; i < hand_joints::padded_count; i += 4)
+	{
+		float4 qa[4];
+		float4 qb[4];
+		for (int c = 0; c < 4; ++c)
+		{
+			qa[c] = load(a.orientation[c] + i);
+			qb[c] = load(b.orientation[c] + i);
+		}
+
+		float4 d = dot(qa, qb);
+		float4 s = sign(d);
+		for (auto & c: qb)
+			c = flip(c, s);
+
+		alignas(16) float cosines[4];
+		alignas(16) float wa[4];
+		alignas(16) float wb[4];
+		store(cosines, flip(d, s));
+		for (int j = 0; j < 4; ++j)
+		{
+			if (cosines[j] > nlerp_threshold)
+			{
+				wa[j] = 1 - t;
+				wb[j] = t;
+			}
+			else
+			{
+				float angle = std::acos(std::min(cosines[j], 1.f));
+				float sine = std::sin(angle);
+				wa[j] = std::sin((1 - t) * angle) / sine;
+				wb[j] = std::sin(t * angle) / sine;
+			}
+		}
+
+		float4 q[4];
+		for (int c = 0; c < 4; ++c)
+			q[c] = add(mul(qa[c], load(wa)), mul(qb[c], load(wb)));
+
+		// Only needed for the linear interpolation, the padding joints stay zero
+		float4 norm = sqrt(max(dot(q, q), splat(1e-12)));
+		for (int c = 0; c < 4; ++c)
+			store(out.orientation[c] + i, div(q[c], norm));
+	}
 }
 } // namespace
 
-xrt_hand_joint_set hand_joints_list::interpolate(const xrt_hand_joint_set & a, const xrt_hand_joint_set & b, float t)
+hand_joints hand_joints::from_joint_set(const xrt_hand_joint_set & set)
 {
-	xrt_hand_joint_set j = a;
+	hand_joints res{};
+	res.hand_pose = set.hand_pose;
+	res.is_active = set.is_active;
 	for (int i = 0; i < XRT_HAND_JOINT_COUNT; i++)
 	{
-		j.values.hand_joint_set_default[i] = ::interpolate(a.values.hand_joint_set_default[i], b.values.hand_joint_set_default[i], t);
+		const auto & joint = set.values.hand_joint_set_default[i];
+		const auto & pose = joint.relation.pose;
+		res.orientation[0][i] = pose.orientation.x;
+		res.orientation[1][i] = pose.orientation.y;
+		res.orientation[2][i] = pose.orientation.z;
+		res.orientation[3][i] = pose.orientation.w;
+		res.position[0][i] = pose.position.x;
+		res.position[1][i] = pose.position.y;
+		res.position[2][i] = pose.position.z;
+		res.linear_velocity[0][i] = joint.relation.linear_velocity.x;
+		res.linear_velocity[1][i] = joint.relation.linear_velocity.y;
+		res.linear_velocity[2][i] = joint.relation.linear_velocity.z;
+		res.angular_velocity[0][i] = joint.relation.angular_velocity.x;
+		res.angular_velocity[1][i] = joint.relation.angular_velocity.y;
+		res.angular_velocity[2][i] = joint.relation.angular_velocity.z;
+		res.radius[i] = joint.radius;
+		res.flags[i] = joint.relation.relation_flags;
 	}
-	return j;
+	return res;
 }
 
-xrt_hand_joint_set hand_joints_list::extrapolate(const xrt_hand_joint_set & a, const xrt_hand_joint_set & b, uint64_t ta, uint64_t tb, uint64_t t)
+xrt_hand_joint_set hand_joints::joint_set() const
 {
-	xrt_hand_joint_set j = t <= ta ? a : b;
+	xrt_hand_joint_set res{};
+	res.hand_pose = hand_pose;
+	res.is_active = is_active;
+	for (int i = 0; i < XRT_HAND_JOINT_COUNT; i++)
+	{
+		res.values.hand_joint_set_default[i] = {
+		        .relation = {
+		                .relation_flags = flags[i],
+		                .pose = {
+		                        .orientation = {orientation[0][i], orientation[1][i], orientation[2][i], orientation[3][i]},
+		                        .position = {position[0][i], position[1][i], position[2][i]},
+		                },
+		                .linear_velocity = {linear_velocity[0][i], linear_velocity[1][i], linear_velocity[2][i]},
+		                .angular_velocity = {angular_velocity[0][i], angular_velocity[1][i], angular_velocity[2][i]},
+		        },
+		        .radius = radius[i],
+		};
+	}
+	return res;
+}
+
+hand_joints hand_joints_list::interpolate(const hand_joints & a, const hand_joints & b, float t)
+{
+	hand_joints res;
+	res.hand_pose = a.hand_pose;
+	res.is_active = a.is_active;
+
+	// Like m_space_relation_interpolate, all the components are interpolated and
+	// only those valid in both samples keep their flag
+	for (size_t i = 0; i < hand_joints::padded_count; i++)
+		res.flags[i] = xrt_space_relation_flags(a.flags[i] & b.flags[i]);
+
+	slerp(a, b, t, res);
+	for (int c = 0; c < 3; ++c)
+	{
+		lerp(a.position[c], b.position[c], t, res.position[c]);
+		lerp(a.linear_velocity[c], b.linear_velocity[c], t, res.linear_velocity[c]);
+		lerp(a.angular_velocity[c], b.angular_velocity[c], t, res.angular_velocity[c]);
+	}
+	lerp(a.radius, b.radius, t, res.radius);
+	return res;
+}
+
+hand_joints hand_joints_list::extrapolate(const hand_joints & a, const hand_joints & b, uint64_t ta, uint64_t tb, uint64_t t) const
+{
+	hand_joints j = t < ta ? a : b;
 	// Only extrapolate the hand pose, individual joints are too noisy
-	j.hand_pose = pose_list::extrapolate(a.hand_pose, b.hand_pose, ta, tb, t);
+	if (a.is_active and b.is_active)
+		j.hand_pose = pose_list::predict(a.hand_pose, b.hand_pose, ta, tb, t, prediction.predictor);
 	return j;
 }
 
@@ -77,24 +364,27 @@ static xrt_space_relation_flags cast_flags(uint8_t in_flags)
 	return xrt_space_relation_flags(flags);
 }
 
-static xrt_space_relation to_relation(const from_headset::hand_tracking::pose & pose)
+static xrt_space_relation to_relation(const from_headset::hand_tracking::pose & pose, const XrVector3f & origin)
 {
 	return {
 	        .relation_flags = cast_flags(pose.flags),
-	        .pose = xrt_cast(pose.pose),
-	        .linear_velocity = xrt_cast(pose.linear_velocity),
-	        .angular_velocity = xrt_cast(pose.angular_velocity),
+	        .pose = {
+	                .orientation = xrt_cast(unpack(pose.orientation)),
+	                .position = xrt_cast(unpack(pose.position, origin)),
+	        },
+	        .linear_velocity = xrt_cast(pose.linear_velocity.value_or(XrVector3f{})),
+	        .angular_velocity = xrt_cast(pose.angular_velocity.value_or(XrVector3f{})),
 	};
 }
 
-static xrt_hand_joint_set convert_joints(const std::optional<std::array<from_headset::hand_tracking::pose, XR_HAND_JOINT_COUNT_EXT>> & input_joints)
+static xrt_hand_joint_set convert_joints(const std::optional<std::array<from_headset::hand_tracking::pose, XR_HAND_JOINT_COUNT_EXT>> & input_joints, const XrVector3f & origin)
 {
 	xrt_hand_joint_set output_joints{};
 
 	if (input_joints)
 	{
 		output_joints.is_active = true;
-		output_joints.hand_pose = to_relation((*input_joints)[XRT_HAND_JOINT_WRIST]);
+		output_joints.hand_pose = to_relation((*input_joints)[XRT_HAND_JOINT_WRIST], origin);
 
 		xrt_relation_chain rel_chain{};
 		xrt_space_relation * joint_rel = m_relation_chain_reserve(&rel_chain);
@@ -105,7 +395,7 @@ static xrt_hand_joint_set convert_joints(const std::optional<std::array<from_hea
 			xrt_hand_joint_value & res = output_joints.values.hand_joint_set_default[i];
 
 			res.radius = (*input_joints)[i].radius / 10'000.;
-			*joint_rel = to_relation((*input_joints)[i]);
+			*joint_rel = to_relation((*input_joints)[i], origin);
 
 			m_relation_chain_resolve(&rel_chain, &res.relation);
 		}
@@ -120,10 +410,18 @@ static xrt_hand_joint_set convert_joints(const std::optional<std::array<from_hea
 
 void hand_joints_list::update_tracking(const from_headset::hand_tracking & tracking, const clock_offset & offset)
 {
-	if (tracking.hand == hand_id)
-		add_sample(
-		        tracking.production_timestamp,
-		        tracking.timestamp,
-		        convert_joints(tracking.joints),
-		        offset);
+	if (tracking.hand != hand_id)
+		return;
+
+	auto joints = convert_joints(tracking.joints, tracking.origin);
+	// Samples predicted by the headset are not compared
+	if (joints.is_active and tracking.production_timestamp == tracking.timestamp)
+	{
+		XrTime t = offset.from_headset(tracking.timestamp);
+		auto [horizon, predicted] = get_at(t);
+		if (predicted.is_active)
+			prediction.on_sample(joints.hand_pose, t, predicted.hand_pose, horizon);
+	}
+
+	add_sample(tracking.production_timestamp, tracking.timestamp, hand_joints::from_joint_set(joints), offset);
 }
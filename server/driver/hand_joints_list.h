@@ -20,18 +20,49 @@
 #pragma once
 
 #include "history.h"
+#include "pose_predictor.h"
 #include "xrt/xrt_defines.h"
 
-class hand_joints_list : public history<hand_joints_list, xrt_hand_joint_set>
+#include <cstddef>
+#include <cstdint>
+
+// Joints of a hand stored by component, so that they are interpolated 4 at a time
+struct hand_joints
+{
+	// Multiple of the vector width
+	static constexpr size_t padded_count = (XRT_HAND_JOINT_COUNT + 3) / 4 * 4;
+
+	xrt_space_relation hand_pose;
+	bool is_active;
+
+	// x, y, z, w; the padding joints are zero
+	alignas(16) float orientation[4][padded_count];
+	alignas(16) float position[3][padded_count];
+	alignas(16) float linear_velocity[3][padded_count];
+	alignas(16) float angular_velocity[3][padded_count];
+	alignas(16) float radius[padded_count];
+	xrt_space_relation_flags flags[padded_count];
+
+	static hand_joints from_joint_set(const xrt_hand_joint_set &);
+	xrt_hand_joint_set joint_set() const;
+};
+
+class hand_joints_list : public history<hand_joints_list, hand_joints, true>
 {
 	int hand_id;
+	prediction_state prediction{"Hand"};
 
 public:
-	static xrt_hand_joint_set interpolate(const xrt_hand_joint_set & a, const xrt_hand_joint_set & b, float t);
-	static xrt_hand_joint_set extrapolate(const xrt_hand_joint_set & a, const xrt_hand_joint_set & b, uint64_t ta, uint64_t tb, uint64_t t);
+	static hand_joints interpolate(const hand_joints & a, const hand_joints & b, float t);
+	hand_joints extrapolate(const hand_joints & a, const hand_joints & b, uint64_t ta, uint64_t tb, uint64_t t) const;
 
 	hand_joints_list(int hand_id) :
 	        hand_id(hand_id) {}
 
+	void set_predictor(pose_predictor value)
+	{
+		prediction.predictor = value;
+	}
+
 	void update_tracking(const xrt::drivers::wivrn::from_headset::hand_tracking & tracking, const clock_offset & offset);
 };
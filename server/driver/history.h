@@ -20,12 +20,21 @@
 #pragma once
 
 #include "clock_offset.h"
-#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
 #include <cstddef>
-#include <list>
 #include <mutex>
+#include <optional>
+#include <thread>
+#include <type_traits>
 
-template <typename Derived, typename Data, bool extrapolate = false, size_t MaxSamples = 10>
+// Sorted samples in a fixed size ring buffer.
+// Writers are serialized with a mutex, readers never block them: they use a
+// sequence lock and retry if a sample was added while they were reading.
+// The last results of get_at are kept until a sample is added, devices are
+// queried several times for the same display time in each frame.
+template <typename Derived, typename Data, bool extrapolate = false, size_t MaxSamples = 10, size_t CacheSize = 4>
 class history
 {
 	struct TimedData : public Data
@@ -33,9 +42,133 @@ class history
 		XrTime produced_timestamp;
 		XrTime at_timestamp_ns;
 	};
+	static_assert(std::is_trivially_copyable_v<TimedData>, "samples are copied while they may be written");
 
 	std::mutex mutex;
-	std::list<TimedData> data;
+	// Odd while a writer modifies the samples
+	std::atomic<uint32_t> sequence = 0;
+	std::array<TimedData, MaxSamples> samples;
+	size_t first = 0;
+	size_t count = 0;
+
+	// Result of get_at, computed from the samples at sequence
+	struct cached_result
+	{
+		// Odd while a reader stores a result
+		std::atomic<uint32_t> version = 0;
+		uint32_t sequence = 1;
+		XrTime at_timestamp_ns;
+		std::chrono::nanoseconds extrapolation;
+		Data data;
+	};
+	std::array<cached_result, CacheSize> cache;
+	std::atomic<uint32_t> next_cache_entry = 0;
+
+	std::optional<std::pair<std::chrono::nanoseconds, Data>> cached(XrTime at_timestamp_ns, uint32_t seq)
+	{
+		for (auto & entry: cache)
+		{
+			uint32_t version = entry.version.load(std::memory_order_acquire);
+			if (version & 1)
+				continue;
+			if (entry.sequence != seq or entry.at_timestamp_ns != at_timestamp_ns)
+				continue;
+			std::pair<std::chrono::nanoseconds, Data> res{entry.extrapolation, entry.data};
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (entry.version.load(std::memory_order_relaxed) == version)
+				return res;
+		}
+		return std::nullopt;
+	}
+
+	void store(XrTime at_timestamp_ns, uint32_t seq, const std::pair<std::chrono::nanoseconds, Data> & res)
+	{
+		auto & entry = cache[next_cache_entry.fetch_add(1, std::memory_order_relaxed) % CacheSize];
+		// Another reader is storing in this entry, skip caching
+		uint32_t version = entry.version.load(std::memory_order_relaxed);
+		if ((version & 1) or not entry.version.compare_exchange_strong(version, version + 1, std::memory_order_relaxed))
+			return;
+		std::atomic_thread_fence(std::memory_order_release);
+		entry.sequence = seq;
+		entry.at_timestamp_ns = at_timestamp_ns;
+		entry.extrapolation = res.first;
+		entry.data = res.second;
+		entry.version.store(version + 2, std::memory_order_release);
+	}
+
+	TimedData & at(size_t i)
+	{
+		return samples[(first + i) % MaxSamples];
+	}
+
+	// extrapolate may depend on the settings of the list
+	Derived & derived()
+	{
+		return static_cast<Derived &>(*this);
+	}
+
+	// Samples needed to compute the value at a given time
+	struct lookup
+	{
+		size_t count = 0;
+		TimedData before;
+		TimedData after;
+		// before and after surround the requested time
+		bool between = false;
+		// Sequence of the samples that were read
+		uint32_t sequence = 0;
+	};
+
+	lookup find(XrTime at_timestamp_ns)
+	{
+		lookup res;
+		while (true)
+		{
+			uint32_t seq = sequence.load(std::memory_order_acquire);
+			if (seq & 1)
+			{
+				std::this_thread::yield();
+				continue;
+			}
+
+			res.count = count;
+			res.between = false;
+			if (res.count == 1)
+				res.before = at(0);
+			else if (res.count > 1)
+			{
+				if (at(0).at_timestamp_ns > at_timestamp_ns)
+				{
+					res.before = at(0);
+					res.after = at(1);
+				}
+				else
+				{
+					size_t i = 1;
+					while (i < res.count and at(i).at_timestamp_ns <= at_timestamp_ns)
+						++i;
+					res.between = i < res.count;
+					if (res.between)
+					{
+						res.before = at(i - 1);
+						res.after = at(i);
+					}
+					else
+					{
+						res.before = at(res.count - 2);
+						res.after = at(res.count - 1);
+					}
+				}
+			}
+
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (sequence.load(std::memory_order_relaxed) == seq)
+			{
+				res.sequence = seq;
+				return res;
+			}
+		}
+	}
 
 protected:
 	void add_sample(XrTime produced_timestamp, XrTime timestamp, const Data & sample, const clock_offset & offset)
@@ -45,86 +178,113 @@ protected:
 		std::lock_guard lock(mutex);
 
 		// Discard outdated data, packets could be reordered
-		if (not data.empty())
-		{
-			if (data.back().produced_timestamp > produced)
-				return;
-		}
+		if (count and at(count - 1).produced_timestamp > produced)
+			return;
+
+		uint32_t seq = sequence.load(std::memory_order_relaxed);
+		sequence.store(seq + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+
+		// Samples older than 1s are stale, do not interpolate with them
+		if (count and t - at(count - 1).at_timestamp_ns > 1'000'000'000)
+			count = 0;
 
 		// Only keep one predicted value
 		// It should be the last one
-		if (not data.empty() and t != produced and data.back().at_timestamp_ns != data.back().produced_timestamp)
-			data.pop_back();
+		if (count and t != produced and at(count - 1).at_timestamp_ns != at(count - 1).produced_timestamp)
+			--count;
 
 		// Insert the new sample
-		auto it = std::lower_bound(data.begin(), data.end(), t, [](TimedData & sample, uint64_t t) { return sample.at_timestamp_ns < t; });
-		if (it == data.end())
-			data.emplace_back(sample, produced, t);
-		else if (it->at_timestamp_ns == t)
-			*it = TimedData(sample, produced, t);
+		size_t pos = count;
+		while (pos > 0 and at(pos - 1).at_timestamp_ns >= t)
+			--pos;
+		if (pos < count and at(pos).at_timestamp_ns == t)
+			at(pos) = TimedData(sample, produced, t);
 		else
-			data.emplace(it, sample, produced, t);
+		{
+			if (count == MaxSamples)
+			{
+				// Drop the oldest sample
+				if (pos == 0)
+				{
+					sequence.store(seq + 2, std::memory_order_release);
+					return;
+				}
+				first = (first + 1) % MaxSamples;
+				--count;
+				--pos;
+			}
+			for (size_t i = count; i > pos; --i)
+				at(i) = at(i - 1);
+			at(pos) = TimedData(sample, produced, t);
+			++count;
+		}
 
-		while (data.size() > MaxSamples)
-			data.pop_front();
+		sequence.store(seq + 2, std::memory_order_release);
 	}
 
-public:
-	std::pair<std::chrono::nanoseconds, Data> get_at(XrTime at_timestamp_ns)
+	std::pair<std::chrono::nanoseconds, Data> compute_at(XrTime at_timestamp_ns, const lookup & samples)
 	{
-		std::lock_guard lock(mutex);
 		std::chrono::nanoseconds ex(0);
+		[[maybe_unused]] const auto & [n, before, after, between, seq] = samples;
 
-		if (data.empty())
+		if (n == 0)
 		{
 			return {};
 		}
 
-		if (at_timestamp_ns - data.back().at_timestamp_ns > 1'000'000'000)
+		const auto & last = n == 1 ? before : after;
+		if (at_timestamp_ns - last.at_timestamp_ns > 1'000'000'000)
 		{
 			// stale data
-			data.clear();
 			return {};
 		}
 
-		if (data.size() == 1)
+		if (n == 1)
 		{
-			return {ex, data.front()};
+			return {ex, before};
 		}
 
-		if (data.front().at_timestamp_ns > at_timestamp_ns)
+		if (before.at_timestamp_ns > at_timestamp_ns)
 		{
 			if (extrapolate)
-			{
-				auto second = data.begin();
-				auto first = second++;
-				return {ex, Derived::extrapolate(*first, *second, first->at_timestamp_ns, second->at_timestamp_ns, at_timestamp_ns)};
-			}
+				return {ex, derived().extrapolate(before, after, before.at_timestamp_ns, after.at_timestamp_ns, at_timestamp_ns)};
 			else
-				return {ex, data.front()};
+				return {ex, before};
 		}
 
-		for (auto after = data.begin(), before = after++; after != data.end(); before = after++)
+		if (between)
 		{
-			if (after->at_timestamp_ns > at_timestamp_ns)
-			{
-				ex = std::chrono::nanoseconds(at_timestamp_ns - std::min(before->produced_timestamp, after->produced_timestamp));
-				float t = float(after->at_timestamp_ns - at_timestamp_ns) /
-				          (after->at_timestamp_ns - before->at_timestamp_ns);
-				return {ex, Derived::interpolate(*before, *after, t)};
-			}
+			ex = std::chrono::nanoseconds(at_timestamp_ns - std::min(before.produced_timestamp, after.produced_timestamp));
+			float t = float(after.at_timestamp_ns - at_timestamp_ns) /
+			          (after.at_timestamp_ns - before.at_timestamp_ns);
+			return {ex, Derived::interpolate(before, after, t)};
 		}
 
-		ex = std::chrono::nanoseconds(at_timestamp_ns - data.back().produced_timestamp);
+		ex = std::chrono::nanoseconds(at_timestamp_ns - after.produced_timestamp);
 		if (extrapolate)
 		{
-			auto prev = data.rbegin();
-			auto last = prev++;
-			return {ex, Derived::extrapolate(*prev, *last, prev->at_timestamp_ns, last->at_timestamp_ns, at_timestamp_ns)};
+			return {ex, derived().extrapolate(before, after, before.at_timestamp_ns, after.at_timestamp_ns, at_timestamp_ns)};
 		}
 		else
 		{
-			return {ex, data.back()};
+			return {ex, after};
+		}
+	}
+
+public:
+	std::pair<std::chrono::nanoseconds, Data> get_at(XrTime at_timestamp_ns)
+	{
+		// Sequences are even when no sample is being added, entries start odd so they never match
+		if (uint32_t seq = sequence.load(std::memory_order_acquire); not(seq & 1))
+		{
+			if (auto res = cached(at_timestamp_ns, seq))
+				return *res;
 		}
+
+		auto samples = find(at_timestamp_ns);
+		auto res = compute_at(at_timestamp_ns, samples);
+		store(at_timestamp_ns, samples.sequence, res);
+		return res;
 	}
 };
@@ -0,0 +1,128 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "pose_list.h"
+
+#include <CLI/CLI.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+// Measures the duration of history::get_at while samples are added at the tracking rate
+namespace
+{
+class benchmark_list : public history<benchmark_list, xrt_space_relation, true>
+{
+public:
+	static xrt_space_relation interpolate(const xrt_space_relation & a, const xrt_space_relation & b, float t)
+	{
+		return pose_list::interpolate(a, b, t);
+	}
+	static xrt_space_relation extrapolate(const xrt_space_relation & a, const xrt_space_relation & b, uint64_t ta, uint64_t tb, uint64_t t)
+	{
+		return pose_list::predict(a, b, ta, tb, t, pose_predictor::velocity);
+	}
+
+	using history::add_sample;
+};
+
+int64_t now()
+{
+	return std::chrono::steady_clock::now().time_since_epoch().count();
+}
+} // namespace
+
+int main(int argc, char ** argv)
+{
+	CLI::App app{"Pose history contention benchmark"};
+
+	int readers = 4;
+	double duration = 5;
+	double rate = 1000;
+	app.add_option("-t,--threads", readers, "number of reader threads (default: 4)");
+	app.add_option("-d,--duration", duration, "duration in seconds (default: 5)");
+	app.add_option("-r,--rate", rate, "samples added per second, 0 to add them as fast as possible (default: 1000)");
+
+	CLI11_PARSE(app, argc, argv);
+
+	benchmark_list list;
+	clock_offset offset;
+	std::atomic<bool> stop = false;
+	std::atomic<uint64_t> samples = 0;
+
+	std::thread writer([&]() {
+		xrt_space_relation relation = XRT_SPACE_RELATION_ZERO;
+		relation.relation_flags = xrt_space_relation_flags(XRT_SPACE_RELATION_POSITION_VALID_BIT | XRT_SPACE_RELATION_ORIENTATION_VALID_BIT);
+		auto interval = std::chrono::nanoseconds(rate > 0 ? int64_t(1e9 / rate) : 0);
+		while (not stop)
+		{
+			int64_t t = now();
+			relation.pose.position.x = t * 1e-9;
+			// A measured sample and a predicted one, as the headset sends them
+			list.add_sample(t, t, relation, offset);
+			list.add_sample(t, t + 20'000'000, relation, offset);
+			++samples;
+			if (interval.count())
+				std::this_thread::sleep_for(interval);
+		}
+	});
+
+	std::vector<uint64_t> calls(readers);
+	std::vector<int64_t> worst(readers);
+	std::vector<std::thread> threads;
+	for (int i = 0; i < readers; ++i)
+	{
+		threads.emplace_back([&, i]() {
+			while (not stop)
+			{
+				int64_t begin = now();
+				// Times between samples, and after the last one
+				auto res = list.get_at(begin + (calls[i] % 2 ? -2'000'000 : 30'000'000));
+				int64_t elapsed = now() - begin;
+				worst[i] = std::max(worst[i], elapsed);
+				++calls[i];
+				(void)res;
+			}
+		});
+	}
+
+	std::this_thread::sleep_for(std::chrono::duration<double>(duration));
+	stop = true;
+	writer.join();
+	for (auto & thread: threads)
+		thread.join();
+
+	uint64_t total = 0;
+	int64_t max_elapsed = 0;
+	for (int i = 0; i < readers; ++i)
+	{
+		total += calls[i];
+		max_elapsed = std::max(max_elapsed, worst[i]);
+	}
+
+	std::printf("%d readers, %lu samples added\n", readers, samples.load());
+	std::printf("get_at: %.0f calls/s per thread, %.1fns average, %.1fus worst\n",
+	            total / duration / readers,
+	            duration * 1e9 * readers / total,
+	            max_elapsed * 1e-3);
+	return 0;
+}
@@ -18,6 +18,7 @@
  */
 
 #include "pose_list.h"
+#include "wivrn_quantization.h"
 #include "math/m_eigen_interop.hpp"
 #include "math/m_space.h"
 #include "math/m_vec3.h"
@@ -35,22 +36,47 @@ xrt_space_relation pose_list::interpolate(const xrt_space_relation & a, const xr
 	return result;
 }
 
-xrt_space_relation pose_list::extrapolate(const xrt_space_relation & a, const xrt_space_relation & b, uint64_t ta, uint64_t tb, uint64_t t)
+xrt_space_relation pose_list::predict(const xrt_space_relation & a, const xrt_space_relation & b, uint64_t ta, uint64_t tb, uint64_t t, pose_predictor predictor)
 {
-	float h = (tb - ta) / 1.e9;
-
 	xrt_space_relation res = t < ta ? a : b;
+	if (predictor == pose_predictor::none or tb <= ta)
+		return res;
 
-	xrt_vec3 lin_vel = res.relation_flags & XRT_SPACE_RELATION_LINEAR_VELOCITY_VALID_BIT ? res.linear_velocity : (b.pose.position - a.pose.position) / h;
+	float h = (tb - ta) / 1.e9;
+	// Signed, t is before ta when extrapolating backwards
+	float dt = (int64_t(t) - int64_t(t < ta ? ta : tb)) / 1.e9;
 
-	float dt = (t - tb) / 1.e9;
+	const bool use_velocity = predictor != pose_predictor::linear;
+	const bool lin_vel_valid = use_velocity and (res.relation_flags & XRT_SPACE_RELATION_LINEAR_VELOCITY_VALID_BIT);
+	const bool ang_vel_valid = use_velocity and (res.relation_flags & XRT_SPACE_RELATION_ANGULAR_VELOCITY_VALID_BIT);
 
-	float dt2_over_2 = dt * dt / 2;
+	xrt_vec3 lin_vel = lin_vel_valid ? res.linear_velocity : (b.pose.position - a.pose.position) / h;
 	res.pose.position = res.pose.position + lin_vel * dt;
 
-	if (res.relation_flags & XRT_SPACE_RELATION_ANGULAR_VELOCITY_VALID_BIT)
+	xrt_vec3 dtheta{};
+	if (ang_vel_valid)
+	{
+		dtheta = res.angular_velocity * dt;
+	}
+	else if (predictor == pose_predictor::linear)
+	{
+		// Rotation from a to b, in the frame of b
+		Eigen::AngleAxisf delta(map_quat(a.pose.orientation).inverse() * map_quat(b.pose.orientation));
+		map_vec3(dtheta) = delta.axis() * (delta.angle() * dt / h);
+	}
+
+	if (predictor == pose_predictor::acceleration)
+	{
+		float dt2_over_2 = dt * dt / 2;
+		const auto flags = a.relation_flags & b.relation_flags;
+		if (flags & XRT_SPACE_RELATION_LINEAR_VELOCITY_VALID_BIT)
+			res.pose.position = res.pose.position + (b.linear_velocity - a.linear_velocity) * (dt2_over_2 / h);
+		if (flags & XRT_SPACE_RELATION_ANGULAR_VELOCITY_VALID_BIT)
+			dtheta = dtheta + (b.angular_velocity - a.angular_velocity) * (dt2_over_2 / h);
+	}
+
+	if (ang_vel_valid or predictor == pose_predictor::linear)
 	{
-		xrt_vec3 dtheta = res.angular_velocity * dt;
 		xrt_quat dq;
 		math_quat_exp(&dtheta, &dq);
 
@@ -60,25 +86,28 @@ xrt_space_relation pose_list::extrapolate(const xrt_space_relation & a, const xr
 	return res;
 }
 
-void pose_list::update_tracking(const from_headset::tracking & tracking, const clock_offset & offset)
+void pose_list::update_tracking(const from_headset::tracking & tracking, const from_headset::tracking::pose & pose, const clock_offset & offset)
 {
-	for (const auto & pose: tracking.device_poses)
+	auto relation = convert_pose(pose, tracking.origin);
+	// Samples predicted by the headset are not compared
+	if (tracking.production_timestamp == tracking.timestamp)
 	{
-		if (pose.device != device)
-			continue;
-
-		add_sample(tracking.production_timestamp, tracking.timestamp, convert_pose(pose), offset);
-		return;
+		XrTime t = offset.from_headset(tracking.timestamp);
+		auto [horizon, predicted] = get_at(t);
+		prediction.on_sample(relation, t, predicted, horizon);
 	}
+
+	add_sample(tracking.production_timestamp, tracking.timestamp, relation, offset);
 }
 
-xrt_space_relation pose_list::convert_pose(const from_headset::tracking::pose & pose)
+xrt_space_relation pose_list::convert_pose(const from_headset::tracking::pose & pose, const XrVector3f & origin)
 {
 	xrt_space_relation res{};
 
-	res.pose = xrt_cast(pose.pose);
-	res.angular_velocity = xrt_cast(pose.angular_velocity);
-	res.linear_velocity = xrt_cast(pose.linear_velocity);
+	res.pose.orientation = xrt_cast(unpack(pose.orientation));
+	res.pose.position = xrt_cast(unpack(pose.position, origin));
+	res.angular_velocity = xrt_cast(pose.angular_velocity.value_or(XrVector3f{}));
+	res.linear_velocity = xrt_cast(pose.linear_velocity.value_or(XrVector3f{}));
 
 	int flags = 0;
 	if (pose.flags & from_headset::tracking::position_valid)
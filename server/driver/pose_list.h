@@ -21,21 +21,39 @@
 
 #include "clock_offset.h"
 #include "history.h"
+#include "pose_predictor.h"
 #include "wivrn_packets.h"
 #include "xrt/xrt_defines.h"
 
-class pose_list : public history<pose_list, xrt_space_relation>
+class pose_list : public history<pose_list, xrt_space_relation, true>
 {
 	xrt::drivers::wivrn::device_id device;
+	prediction_state prediction{"Controller"};
 
 public:
 	static xrt_space_relation interpolate(const xrt_space_relation & a, const xrt_space_relation & b, float t);
-	static xrt_space_relation extrapolate(const xrt_space_relation & a, const xrt_space_relation & b, uint64_t ta, uint64_t tb, uint64_t t);
+	static xrt_space_relation predict(const xrt_space_relation & a, const xrt_space_relation & b, uint64_t ta, uint64_t tb, uint64_t t, pose_predictor);
+
+	xrt_space_relation extrapolate(const xrt_space_relation & a, const xrt_space_relation & b, uint64_t ta, uint64_t tb, uint64_t t) const
+	{
+		return predict(a, b, ta, tb, t, prediction.predictor);
+	}
 
 	pose_list(xrt::drivers::wivrn::device_id id) :
 	        device(id) {}
 
-	void update_tracking(const xrt::drivers::wivrn::from_headset::tracking &, const clock_offset & offset);
+	xrt::drivers::wivrn::device_id get_device() const
+	{
+		return device;
+	}
+
+	void set_predictor(pose_predictor value)
+	{
+		prediction.predictor = value;
+	}
+
+	// pose is the one of this device, the other fields of tracking are used but not its device_poses
+	void update_tracking(const xrt::drivers::wivrn::from_headset::tracking &, const xrt::drivers::wivrn::from_headset::tracking::pose & pose, const clock_offset & offset);
 
-	static xrt_space_relation convert_pose(const xrt::drivers::wivrn::from_headset::tracking::pose &);
+	static xrt_space_relation convert_pose(const xrt::drivers::wivrn::from_headset::tracking::pose &, const XrVector3f & origin);
 };
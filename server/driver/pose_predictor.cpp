@@ -0,0 +1,95 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "pose_predictor.h"
+
+#include "math/m_eigen_interop.hpp"
+#include "os/os_time.h"
+#include "util/u_logging.h"
+
+#include <cmath>
+
+using namespace xrt::auxiliary::math;
+
+// Variance growth of the velocities per second, (m/s)² or (rad/s)²
+static const float process_noise = 20;
+// Variance of the reported velocities
+static const float measurement_noise = 0.05;
+// Interval between two logs of the prediction error
+static const XrTime log_interval = 10'000'000'000;
+
+static void update(xrt_vec3 & value, float & variance, const xrt_vec3 & measurement, float dt)
+{
+	variance += process_noise * dt;
+	float gain = variance / (variance + measurement_noise);
+	map_vec3(value) += gain * (map_vec3(measurement) - map_vec3(value));
+	variance *= 1 - gain;
+}
+
+void velocity_filter::update(xrt_space_relation & relation, XrTime timestamp)
+{
+	// Restart after a gap in tracking
+	if (not last or timestamp <= last or timestamp - last > 100'000'000)
+	{
+		linear = {relation.linear_velocity, measurement_noise};
+		angular = {relation.angular_velocity, measurement_noise};
+		last = timestamp;
+		return;
+	}
+
+	float dt = (timestamp - last) * 1e-9;
+	last = timestamp;
+	if (relation.relation_flags & XRT_SPACE_RELATION_LINEAR_VELOCITY_VALID_BIT)
+	{
+		::update(linear.value, linear.variance, relation.linear_velocity, dt);
+		relation.linear_velocity = linear.value;
+	}
+	if (relation.relation_flags & XRT_SPACE_RELATION_ANGULAR_VELOCITY_VALID_BIT)
+	{
+		::update(angular.value, angular.variance, relation.angular_velocity, dt);
+		relation.angular_velocity = angular.value;
+	}
+}
+
+void prediction_error::add(const xrt_space_relation & predicted, const xrt_space_relation & real, std::chrono::nanoseconds horizon)
+{
+	const auto flags = XRT_SPACE_RELATION_POSITION_VALID_BIT | XRT_SPACE_RELATION_ORIENTATION_VALID_BIT;
+	if (horizon.count() <= 0 or (predicted.relation_flags & flags) != flags or (real.relation_flags & flags) != flags)
+		return;
+
+	position += (map_vec3(predicted.pose.position) - map_vec3(real.pose.position)).norm();
+	angle += map_quat(predicted.pose.orientation).angularDistance(map_quat(real.pose.orientation));
+	total_horizon += horizon.count();
+	++count;
+
+	XrTime now = os_monotonic_get_ns();
+	if (now - last_log < log_interval)
+		return;
+	last_log = now;
+	U_LOG_D("%s prediction error over %ld samples: %.1fmm, %.2f°, average horizon %.1fms",
+	        name,
+	        count,
+	        position / count * 1000,
+	        angle / count * 180 / M_PI,
+	        total_horizon / count * 1e-6);
+	position = 0;
+	angle = 0;
+	total_horizon = 0;
+	count = 0;
+}
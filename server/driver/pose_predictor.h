@@ -0,0 +1,102 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "xrt/xrt_defines.h"
+
+#include <chrono>
+#include <cstdint>
+#include <openxr/openxr.h>
+
+// How poses are extrapolated after the last sample or before the first one
+enum class pose_predictor
+{
+	// Use the nearest sample
+	none,
+	// Finite differences between the two nearest samples, ignoring reported velocities
+	linear,
+	// Velocities reported by the headset, finite differences if they are not valid
+	velocity,
+	// Reported velocities, and accelerations from the difference of the velocities of the two nearest samples
+	acceleration,
+	// Reported velocities smoothed by a Kalman filter when the samples are received
+	kalman,
+};
+
+// Smooths the reported velocities of measured samples, for pose_predictor::kalman
+class velocity_filter
+{
+	struct state
+	{
+		xrt_vec3 value;
+		// Estimated variance of the value
+		float variance;
+	};
+	state linear{};
+	state angular{};
+	XrTime last = 0;
+
+public:
+	void reset()
+	{
+		last = 0;
+	}
+
+	// Replaces the velocities of the relation with the filtered ones
+	void update(xrt_space_relation &, XrTime timestamp);
+};
+
+// Statistics of the difference between predicted poses and the samples received later for the same time
+class prediction_error
+{
+	const char * name;
+	double position = 0;
+	double angle = 0;
+	double total_horizon = 0;
+	size_t count = 0;
+	XrTime last_log = 0;
+
+public:
+	prediction_error(const char * name) :
+	        name(name) {}
+
+	// horizon is the time between the prediction and the newest sample it was based on
+	void add(const xrt_space_relation & predicted, const xrt_space_relation & real, std::chrono::nanoseconds horizon);
+};
+
+// Prediction settings and statistics of a list of poses
+struct prediction_state
+{
+	pose_predictor predictor = pose_predictor::none;
+	velocity_filter filter;
+	prediction_error error;
+
+	prediction_state(const char * name) :
+	        error(name) {}
+
+	// Called before adding a measured sample at time t (server clock), predicted is the
+	// pose the list gives for t. Velocities of relation are filtered for pose_predictor::kalman.
+	void on_sample(xrt_space_relation & relation, XrTime t, const xrt_space_relation & predicted, std::chrono::nanoseconds horizon)
+	{
+		error.add(predicted, relation, horizon);
+		if (predictor == pose_predictor::kalman)
+			filter.update(relation, t);
+	}
+};
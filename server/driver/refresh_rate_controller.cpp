@@ -0,0 +1,172 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "refresh_rate_controller.h"
+
+#include "os/os_time.h"
+#include "util/u_logging.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace xrt::drivers::wivrn
+{
+
+static const int64_t window_duration = 1'000'000'000;
+// A window is overloaded when more than this share of the frames are not displayed
+static const double max_missed_ratio = 0.05;
+// or when the 90th percentile of decoding times is above this share of the frame interval
+static const double overload_decode_ratio = 0.9;
+// A window has enough margin for the next rate when less frames are missed
+static const double clear_missed_ratio = 0.01;
+// and decoding takes less than this share of the frame interval at the next rate
+static const double clear_decode_ratio = 0.6;
+// Consecutive windows before changing the rate
+static const int overloaded_windows_for_decrease = 3;
+static const int clear_windows_for_increase = 20;
+// The headset recreates its swapchains and the server its encoders on each change
+static const int64_t change_interval = 10'000'000'000;
+// Do not go up again soon after going down, the load is likely to come back
+static const int64_t increase_after_decrease = 60'000'000'000;
+
+static int64_t percentile_90(std::vector<int64_t> & values)
+{
+	if (values.empty())
+		return 0;
+	auto it = values.begin() + values.size() * 9 / 10;
+	std::nth_element(values.begin(), it, values.end());
+	return *it;
+}
+
+refresh_rate_controller::refresh_rate_controller(const std::vector<float> & available_rates, float preferred_rate)
+{
+	for (float rate: available_rates)
+	{
+		if (rate <= preferred_rate)
+			rates.push_back(rate);
+	}
+	std::ranges::sort(rates);
+	if (rates.empty() or rates.back() != preferred_rate)
+		rates.push_back(preferred_rate);
+	current = rates.size() - 1;
+	max_index = current;
+}
+
+std::optional<float> refresh_rate_controller::set_max_rate(float rate)
+{
+	std::lock_guard lock(mutex);
+	max_index = 0;
+	while (max_index + 1 < rates.size() and rates[max_index + 1] <= rate)
+		++max_index;
+
+	if (current <= max_index)
+		return std::nullopt;
+
+	U_LOG_I("Refresh rate %.0f -> %.0fHz: limited by the headset", rates[current], rates[max_index]);
+	current = max_index;
+	overloaded_windows = 0;
+	clear_windows = 0;
+	last_change = os_monotonic_get_ns();
+	return rates[current];
+}
+
+float refresh_rate_controller::get_rate()
+{
+	std::lock_guard lock(mutex);
+	return rates[current];
+}
+
+void refresh_rate_controller::on_drop()
+{
+	std::lock_guard lock(mutex);
+	++dropped_frames;
+}
+
+void refresh_rate_controller::reset()
+{
+	std::lock_guard lock(mutex);
+	decode_times.clear();
+	frames = 0;
+	missed_frames = 0;
+	dropped_frames = 0;
+	window_start = 0;
+}
+
+std::optional<float> refresh_rate_controller::on_feedback(const from_headset::feedback & feedback)
+{
+	std::lock_guard lock(mutex);
+
+	int64_t now = os_monotonic_get_ns();
+	if (not window_start)
+		window_start = now;
+
+	++frames;
+	// Lost, or decoded after the headset had to display the previous frame again
+	if (feedback.received_first_packet and not feedback.blitted)
+		++missed_frames;
+	if (feedback.sent_to_decoder and feedback.received_from_decoder > feedback.sent_to_decoder)
+		decode_times.push_back(feedback.received_from_decoder - feedback.sent_to_decoder);
+
+	if (now - window_start < window_duration)
+		return std::nullopt;
+
+	int64_t decode = percentile_90(decode_times);
+	double missed = double(missed_frames + dropped_frames) / frames;
+	decode_times.clear();
+	frames = 0;
+	missed_frames = 0;
+	dropped_frames = 0;
+	window_start = now;
+
+	const double frame_interval = 1e9 / rates[current];
+	bool overloaded = missed > max_missed_ratio or decode > overload_decode_ratio * frame_interval;
+	bool clear = current < max_index and
+	             missed < clear_missed_ratio and
+	             decode < clear_decode_ratio * 1e9 / rates[current + 1];
+	overloaded_windows = overloaded ? overloaded_windows + 1 : 0;
+	clear_windows = clear ? clear_windows + 1 : 0;
+
+	if (now - last_change < change_interval)
+		return std::nullopt;
+
+	size_t next = current;
+	if (current > 0 and overloaded_windows >= overloaded_windows_for_decrease)
+	{
+		next = current - 1;
+		last_decrease = now;
+	}
+	else if (clear_windows >= clear_windows_for_increase and now - last_decrease >= increase_after_decrease)
+		next = current + 1;
+
+	if (next == current)
+		return std::nullopt;
+
+	U_LOG_I("Refresh rate %.0f -> %.0fHz: %.1f%% of frames missed, decode %.1fms",
+	        rates[current],
+	        rates[next],
+	        missed * 100,
+	        decode * 1e-6);
+	current = next;
+	overloaded_windows = 0;
+	clear_windows = 0;
+	last_change = now;
+	return rates[current];
+}
+} // namespace xrt::drivers::wivrn
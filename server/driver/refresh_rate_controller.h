@@ -0,0 +1,74 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "wivrn_packets.h"
+
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+namespace xrt::drivers::wivrn
+{
+
+// Lowers the headset refresh rate when the frames are not displayed on time
+// for several seconds, and raises it back when there is enough margin
+class refresh_rate_controller
+{
+	std::mutex mutex;
+
+	// Available refresh rates, up to the one requested by the headset, ascending
+	std::vector<float> rates;
+	size_t current;
+	// Highest index that can be used, lowered when the headset is throttled
+	size_t max_index;
+
+	// Statistics of the current window
+	std::vector<int64_t> decode_times;
+	int frames = 0;
+	int missed_frames = 0;
+	int dropped_frames = 0;
+	int64_t window_start = 0;
+
+	int overloaded_windows = 0;
+	int clear_windows = 0;
+	int64_t last_change = 0;
+	int64_t last_decrease = 0;
+
+public:
+	refresh_rate_controller(const std::vector<float> & available_rates, float preferred_rate);
+
+	float get_rate();
+
+	// An encoder did not take a frame before the next one
+	void on_drop();
+
+	// Returns the new refresh rate if it must be changed
+	std::optional<float> on_feedback(const from_headset::feedback &);
+
+	// Highest refresh rate that can be used, returns the new refresh rate if it must be changed
+	std::optional<float> set_max_rate(float);
+
+	// Forget the statistics of the previous encoders
+	void reset();
+};
+} // namespace xrt::drivers::wivrn
@@ -0,0 +1,151 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "resolution_controller.h"
+
+#include "os/os_time.h"
+#include "util/u_logging.h"
+
+#include <algorithm>
+
+namespace xrt::drivers::wivrn
+{
+
+static const int64_t window_duration = 1'000'000'000;
+// Minimum time between two changes, recreating the encoders costs an IDR frame
+static const int64_t change_interval = 5'000'000'000;
+// A window is overloaded when the 90th percentile of encoding or decoding times is above this share of the frame interval
+static const double overload_ratio = 0.85;
+// A window has enough margin when they are below this share
+static const double clear_ratio = 0.5;
+static const double max_lost_ratio = 0.05;
+// Number of windows with enough margin before increasing the resolution
+static const int clear_windows_for_increase = 5;
+static const double decrease_step = 0.85;
+static const double increase_step = 1 / 0.9;
+static const double min_factor = 0.5;
+
+static int64_t percentile_90(std::vector<int64_t> & values)
+{
+	if (values.empty())
+		return 0;
+	auto it = values.begin() + values.size() * 9 / 10;
+	std::nth_element(values.begin(), it, values.end());
+	return *it;
+}
+
+resolution_controller::resolution_controller(float fps) :
+        frame_interval(1'000'000'000 / fps)
+{
+}
+
+double resolution_controller::get_factor()
+{
+	std::lock_guard lock(mutex);
+	return factor;
+}
+
+void resolution_controller::reset()
+{
+	std::lock_guard lock(mutex);
+	encode_times.clear();
+	decode_times.clear();
+	frames = 0;
+	lost_frames = 0;
+	window_start = 0;
+}
+
+void resolution_controller::set_fps(float fps)
+{
+	std::lock_guard lock(mutex);
+	frame_interval = 1'000'000'000 / fps;
+}
+
+std::optional<double> resolution_controller::set_max_factor(double value)
+{
+	std::lock_guard lock(mutex);
+	max_factor = std::max(min_factor, value);
+	if (factor <= max_factor)
+		return std::nullopt;
+
+	U_LOG_I("Resolution factor %.2f -> %.2f: limited by the headset", factor, max_factor);
+	factor = max_factor;
+	clear_windows = 0;
+	last_change = os_monotonic_get_ns();
+	return factor;
+}
+
+std::optional<double> resolution_controller::on_feedback(const from_headset::feedback & feedback, const bitrate_controller::frame_info * info)
+{
+	std::lock_guard lock(mutex);
+
+	int64_t now = os_monotonic_get_ns();
+	if (not window_start)
+		window_start = now;
+
+	++frames;
+	if (feedback.received_first_packet and (not feedback.sent_to_decoder or feedback.lost_slices))
+		++lost_frames;
+	if (info and info->encode_time > 0)
+		encode_times.push_back(info->encode_time);
+	// Both times are in the headset clock
+	if (feedback.sent_to_decoder and feedback.received_from_decoder > feedback.sent_to_decoder)
+		decode_times.push_back(feedback.received_from_decoder - feedback.sent_to_decoder);
+
+	if (now - window_start < window_duration)
+		return std::nullopt;
+
+	int64_t encode = percentile_90(encode_times);
+	int64_t decode = percentile_90(decode_times);
+	bool lost = lost_frames > max_lost_ratio * frames;
+	encode_times.clear();
+	decode_times.clear();
+	frames = 0;
+	lost_frames = 0;
+	window_start = now;
+
+	bool overloaded = std::max(encode, decode) > overload_ratio * frame_interval;
+	bool clear = std::max(encode, decode) < clear_ratio * frame_interval and not lost;
+	clear_windows = clear ? clear_windows + 1 : 0;
+
+	if (now - last_change < change_interval)
+		return std::nullopt;
+
+	double new_factor = factor;
+	if (overloaded)
+		new_factor = std::max(min_factor, factor * decrease_step);
+	else if (clear_windows >= clear_windows_for_increase)
+		new_factor = std::min(max_factor, factor * increase_step);
+
+	if (new_factor == factor)
+		return std::nullopt;
+
+	U_LOG_I("Resolution factor %.2f -> %.2f: encode %.1fms, decode %.1fms for a %.1fms frame interval",
+	        factor,
+	        new_factor,
+	        encode * 1e-6,
+	        decode * 1e-6,
+	        frame_interval * 1e-6);
+	factor = new_factor;
+	clear_windows = 0;
+	last_change = now;
+	return factor;
+}
+} // namespace xrt::drivers::wivrn
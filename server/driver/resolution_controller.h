@@ -0,0 +1,73 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "bitrate_controller.h"
+#include "wivrn_packets.h"
+
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+namespace xrt::drivers::wivrn
+{
+
+// Scales the encoded resolution down when encoding or decoding does not fit in
+// the frame interval, and back up when there is enough margin
+class resolution_controller
+{
+	std::mutex mutex;
+
+	int64_t frame_interval;
+	double factor = 1;
+	// Lowered when the headset is throttled
+	double max_factor = 1;
+
+	// Statistics of the current window, in ns
+	std::vector<int64_t> encode_times;
+	std::vector<int64_t> decode_times;
+	int frames = 0;
+	int lost_frames = 0;
+	int64_t window_start = 0;
+
+	// Consecutive windows with enough margin
+	int clear_windows = 0;
+	int64_t last_change = 0;
+
+public:
+	resolution_controller(float fps);
+
+	// Factor applied to the configured resolution
+	double get_factor();
+
+	// Returns the new factor if the resolution must be changed
+	std::optional<double> on_feedback(const from_headset::feedback &, const bitrate_controller::frame_info *);
+
+	// Forget the timings of the previous encoders
+	void reset();
+
+	void set_fps(float fps);
+
+	// Returns the new factor if it must be changed
+	std::optional<double> set_max_factor(double);
+};
+} // namespace xrt::drivers::wivrn
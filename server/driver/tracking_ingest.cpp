@@ -0,0 +1,100 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "tracking_ingest.h"
+#include "pose_list.h"
+#include "utils/metrics.h"
+#include "view_list.h"
+#include "wivrn_sockets.h"
+
+#include "os/os_time.h"
+
+#include <cmath>
+
+using namespace xrt::drivers::wivrn;
+
+namespace
+{
+template <typename T, typename... Ts>
+constexpr size_t variant_index(const std::variant<Ts...> *)
+{
+	return index_of_type<T, Ts...>::value;
+}
+
+constexpr uint8_t tracking_index = variant_index<from_headset::tracking>((const from_headset::packets *)nullptr);
+
+// ingest reads the fields one by one, in the order of the generic deserialization
+static_assert(boost::pfr::tuple_size_v<from_headset::tracking> == 6, "update tracking_ingest::ingest");
+} // namespace
+
+void tracking_ingest::add(view_list & list)
+{
+	views = &list;
+}
+
+void tracking_ingest::add(pose_list & list)
+{
+	poses[size_t(list.get_device())] = &list;
+}
+
+bool tracking_ingest::is_tracking(const deserialization_packet & packet)
+{
+	return not packet.empty() and packet.peek() == tracking_index;
+}
+
+void tracking_ingest::ingest(deserialization_packet & packet, const clock_offset & offset)
+{
+	packet.deserialize<uint8_t>();
+	packet.deserialize(tracking.production_timestamp);
+	packet.deserialize(tracking.timestamp);
+	packet.deserialize(tracking.flags);
+	packet.deserialize(tracking.origin);
+	packet.deserialize(tracking.views);
+
+	size_t count = packet.deserialize<uint16_t>();
+	tracking.device_poses.clear();
+	for (size_t i = 0; i < count; ++i)
+		tracking.device_poses.push_back(packet.deserialize<from_headset::tracking::pose>());
+
+	process(tracking, offset, packet.receive_time());
+}
+
+void tracking_ingest::process(const from_headset::tracking & tracking, const clock_offset & offset, int64_t receive_time)
+{
+	auto start = os_monotonic_get_ns();
+	// Samples reach the server in a few ms, larger values are from a wrong clock offset
+	if (int64_t uplink = start - offset.from_headset(tracking.production_timestamp); uplink >= 0 and uplink < 50'000'000)
+		uplink_ns = uplink_ns ? int64_t(std::lerp(double(uplink_ns), double(uplink), 0.05)) : uplink;
+
+	for (const auto & pose: tracking.device_poses)
+	{
+		if (pose.device == device_id::HEAD)
+		{
+			if (views)
+				views->update_tracking(tracking, pose, offset);
+		}
+		else if (size_t(pose.device) < poses.size() and poses[size_t(pose.device)])
+			poses[size_t(pose.device)]->update_tracking(tracking, pose, offset);
+	}
+
+	auto end = os_monotonic_get_ns();
+	metrics::tracking_duration.observe((end - start) * 1e-9);
+	if (receive_time)
+		metrics::tracking_latency.observe((end - receive_time) * 1e-9);
+}
@@ -0,0 +1,63 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "clock_offset.h"
+#include "wivrn_packets.h"
+#include "wivrn_serialization.h"
+
+#include <array>
+#include <cstdint>
+
+class pose_list;
+class view_list;
+
+// Adds the poses of tracking packets to the histories of their devices.
+// Packets can be parsed straight from the received data, without building a from_headset::packets:
+// the tracking structure is reused so its pose vector does not allocate once it has grown,
+// and each pose goes to the history of its device instead of every list scanning all the poses.
+class tracking_ingest
+{
+	view_list * views = nullptr;
+	std::array<pose_list *, size_t(xrt::drivers::wivrn::device_id::EYE_GAZE) + 1> poses{};
+
+	xrt::drivers::wivrn::from_headset::tracking tracking;
+
+	// Smoothed time for the tracking samples to reach the server, in ns
+	int64_t uplink_ns = 0;
+
+public:
+	void add(view_list &);
+	void add(pose_list &);
+
+	// Whether the next packet to be deserialized is a tracking packet, the packet is not modified
+	static bool is_tracking(const xrt::drivers::wivrn::deserialization_packet &);
+
+	// Reads a packet for which is_tracking is true and adds its poses
+	void ingest(xrt::drivers::wivrn::deserialization_packet &, const clock_offset &);
+
+	// receive_time is the CLOCK_MONOTONIC time the packet was received, 0 if unknown
+	void process(const xrt::drivers::wivrn::from_headset::tracking &, const clock_offset &, int64_t receive_time = 0);
+
+	int64_t get_uplink() const
+	{
+		return uplink_ns;
+	}
+};
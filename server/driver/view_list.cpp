@@ -21,6 +21,8 @@
 #include "pose_list.h"
 #include "xrt_cast.h"
 
+#include "os/os_time.h"
+
 tracked_views view_list::interpolate(const tracked_views & a, const tracked_views & b, float t)
 {
 	tracked_views result = a;
@@ -28,32 +30,43 @@ tracked_views view_list::interpolate(const tracked_views & a, const tracked_view
 	return result;
 }
 
-tracked_views view_list::extrapolate(const tracked_views & a, const tracked_views & b, uint64_t ta, uint64_t tb, uint64_t t)
+tracked_views view_list::extrapolate(const tracked_views & a, const tracked_views & b, uint64_t ta, uint64_t tb, uint64_t t) const
 {
 	tracked_views result = t < ta ? a : b;
-	result.relation = pose_list::extrapolate(a.relation, b.relation, ta, tb, t);
+	result.relation = pose_list::predict(a.relation, b.relation, ta, tb, t, prediction.predictor);
 	return result;
 }
 
-void view_list::update_tracking(const from_headset::tracking & tracking, const clock_offset & offset)
+void view_list::update_tracking(const from_headset::tracking & tracking, const from_headset::tracking::pose & pose, const clock_offset & offset)
 {
-	for (const auto & pose: tracking.device_poses)
+	tracked_views view{};
+
+	view.relation = pose_list::convert_pose(pose, tracking.origin);
+	view.flags = tracking.flags;
+
+	for (size_t eye = 0; eye < 2; ++eye)
 	{
-		if (pose.device != device_id::HEAD)
-			continue;
+		view.poses[eye] = xrt_cast(tracking.views[eye].pose);
+		view.fovs[eye] = xrt_cast(tracking.views[eye].fov);
+	}
 
-		tracked_views view{};
+	// Samples predicted by the headset are not compared
+	if (tracking.production_timestamp == tracking.timestamp)
+	{
+		XrTime t = offset.from_headset(tracking.timestamp);
+		auto [horizon, predicted] = get_at(t);
+		prediction.on_sample(view.relation, t, predicted.relation, horizon);
+	}
 
-		view.relation = pose_list::convert_pose(pose);
-		view.flags = tracking.flags;
+	add_sample(tracking.production_timestamp, tracking.timestamp, view, offset);
 
-		for (size_t eye = 0; eye < 2; ++eye)
-		{
-			view.poses[eye] = xrt_cast(tracking.views[eye].pose);
-			view.fovs[eye] = xrt_cast(tracking.views[eye].fov);
-		}
+	std::lock_guard lock(sample_mutex);
+	if (tracking.production_timestamp > last_sample.produced)
+		last_sample = {tracking.production_timestamp, os_monotonic_get_ns()};
+}
 
-		add_sample(tracking.production_timestamp, tracking.timestamp, view, offset);
-		return;
-	}
+tracking_sample view_list::get_last_sample()
+{
+	std::lock_guard lock(sample_mutex);
+	return last_sample;
 }
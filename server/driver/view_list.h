@@ -22,6 +22,8 @@
 #include "pose_list.h"
 #include "wivrn_session.h"
 
+#include <mutex>
+
 struct tracked_views
 {
 	XrViewStateFlags flags;
@@ -32,9 +34,27 @@ struct tracked_views
 
 class view_list : public history<view_list, tracked_views, true>
 {
+	prediction_state prediction{"Head"};
+
+	std::mutex sample_mutex;
+	tracking_sample last_sample;
+
 public:
+	view_list()
+	{
+		prediction.predictor = pose_predictor::velocity;
+	}
+
 	static tracked_views interpolate(const tracked_views & a, const tracked_views & b, float t);
-	static tracked_views extrapolate(const tracked_views & a, const tracked_views & b, uint64_t ta, uint64_t tb, uint64_t t);
+	tracked_views extrapolate(const tracked_views & a, const tracked_views & b, uint64_t ta, uint64_t tb, uint64_t t) const;
+
+	void set_predictor(pose_predictor value)
+	{
+		prediction.predictor = value;
+	}
+
+	// pose is the one of the head, the other fields of tracking are used but not its device_poses
+	void update_tracking(const from_headset::tracking & tracking, const from_headset::tracking::pose & pose, const clock_offset & offset);
 
-	void update_tracking(const from_headset::tracking & tracking, const clock_offset & offset);
+	tracking_sample get_last_sample();
 };
@@ -18,11 +18,20 @@
  */
 
 #include "wivrn_comp_target.h"
+#include "driver/configuration.h"
+#include "encoder/encoder_autotune.h"
+#include "encoder/motion_estimator.h"
 #include "encoder/video_encoder.h"
 #include "main/comp_compositor.h"
 #include "math/m_space.h"
+#include "utils/metrics.h"
 #include "utils/scoped_lock.h"
 #include "xrt_cast.h"
+#include <algorithm>
+#include <cinttypes>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
 #include <vector>
 #include <vulkan/vulkan.hpp>
 #include <vulkan/vulkan_core.h>
@@ -32,6 +41,12 @@ using namespace xrt::drivers::wivrn;
 static const pseudo_swapchain::status_type::value_type image_free = 0;
 static const pseudo_swapchain::status_type::value_type image_acquired = 1;
 
+// Frames an encoder fails to encode in a row before its stream switches to another backend
+static const int max_consecutive_errors = 10;
+
+// Conversion resources of an image are released after it was not used for this duration
+static const int64_t idle_image_release = 10 * U_TIME_1S_IN_NS;
+
 std::vector<const char *> wivrn_comp_target::wanted_instance_extensions = {};
 std::vector<const char *> wivrn_comp_target::wanted_device_extensions = {
 // For FFMPEG
@@ -45,6 +60,16 @@ std::vector<const char *> wivrn_comp_target::wanted_device_extensions = {
         VK_EXT_IMAGE_DRM_FORMAT_MODIFIER_EXTENSION_NAME,
 #endif
 
+// For nvenc to wait for the present semaphore
+#ifdef VK_KHR_external_semaphore_fd
+        VK_KHR_EXTERNAL_SEMAPHORE_FD_EXTENSION_NAME,
+#endif
+
+// For the memory report and budget aware allocations
+#ifdef VK_EXT_memory_budget
+        VK_EXT_MEMORY_BUDGET_EXTENSION_NAME,
+#endif
+
 // For vulkan video encode
 #ifdef VK_KHR_video_queue
         VK_KHR_VIDEO_QUEUE_EXTENSION_NAME,
@@ -71,8 +96,16 @@ static void destroy_images(struct wivrn_comp_target * cn)
 	if (cn->images == nullptr)
 		return;
 
-	cn->encoder_threads.clear();
-	cn->encoders.clear();
+	{
+		std::lock_guard lock(cn->encoders_mutex);
+		cn->encoder_threads.clear();
+		cn->encoders.clear();
+		cn->bitrate_control.reset();
+		if (cn->resolution_control)
+			cn->resolution_control->reset();
+		if (cn->refresh_rate_control)
+			cn->refresh_rate_control->reset();
+	}
 
 	cn->psc.images.reset();
 
@@ -87,18 +120,25 @@ struct encoder_thread_param
 	wivrn_comp_target * cn;
 	wivrn_comp_target::encoder_thread * thread;
 	std::vector<std::shared_ptr<VideoEncoder>> encoders;
+	// Only for the first thread, when motion extrapolation is enabled
+	std::shared_ptr<motion_estimator> motion;
+	// All the encoders wait for the image on the GPU, the thread does not wait before encoding
+	bool gpu_wait = true;
 };
 
 static void * comp_wivrn_present_thread(void * void_param);
+static void apply_rate_control(wivrn_comp_target * cn);
 
 static void create_encoders(wivrn_comp_target * cn)
 {
 	auto vk = get_vk(cn);
+	std::lock_guard lock(cn->encoders_mutex);
 	assert(cn->encoders.empty());
 	assert(cn->encoder_threads.empty());
 	assert(cn->wivrn_bundle);
 
 	auto & desc = cn->desc;
+	desc.items.clear();
 	desc.width = cn->width;
 	desc.height = cn->height;
 	desc.foveation = cn->cnx->set_foveated_size(desc.width, desc.height);
@@ -107,19 +147,56 @@ static void create_encoders(wivrn_comp_target * cn)
 
 	for (auto & settings: cn->settings)
 	{
+		if (not cn->cnx->has_capability(capability::parity_shards))
+			settings.fec_ratio = 0;
+		settings.stream_width = desc.width;
+		settings.stream_height = desc.height;
+		settings.foveation = desc.foveation;
+		VideoEncoder::PlaceInset(settings);
 		uint8_t stream_index = cn->encoders.size();
-		auto & encoder = cn->encoders.emplace_back(
-		        VideoEncoder::Create(*cn->wivrn_bundle, settings, stream_index, desc.width, desc.height, desc.fps));
+		std::shared_ptr<VideoEncoder> encoder;
+		while (not encoder)
+		{
+			try
+			{
+				encoder = VideoEncoder::Create(*cn->wivrn_bundle, settings, stream_index, desc.width, desc.height, cn->fps);
+			}
+			catch (const std::exception & e)
+			{
+				// For instance when the GPU has no encoding session left
+				U_LOG_E("Failed to create %s encoder for stream %d: %s", settings.encoder_name.c_str(), stream_index, e.what());
+				auto & failed = cn->failed_encoders[stream_index];
+				failed.insert(settings.encoder_name);
+				if (not replace_failed_encoder(settings, failed))
+					throw;
+				settings.video_width = settings.width;
+				settings.video_height = settings.height;
+				U_LOG_W("Stream %d: falling back to %s", stream_index, settings.encoder_name.c_str());
+				metrics::encoder_failovers.add();
+			}
+		}
+		cn->encoders.push_back(encoder);
 		desc.items.push_back(settings);
 
-		thread_params[settings.group].encoders.emplace_back(encoder);
+		auto & params = thread_params[settings.group];
+		params.encoders.emplace_back(encoder);
+		// Static frames are detected from the checksums, which are read on the CPU
+		params.gpu_wait = params.gpu_wait and
+		                  cn->psc.present_semaphore_exportable and
+		                  not settings.skip_static_frames and
+		                  encoder->WaitOnGpu(*cn->psc.present_semaphore);
 	}
 
+	if (cn->motion_extrapolation and not thread_params.empty())
+		thread_params.begin()->second.motion = std::make_shared<motion_estimator>(desc.width, desc.height);
+
 	for (auto & [group, params]: thread_params)
 	{
 		auto params_ptr = new encoder_thread_param(params);
-		auto & thread = cn->encoder_threads.emplace_back(cn->psc.present_gen);
+		auto & thread = cn->encoder_threads.emplace_back();
 		thread.index = cn->encoder_threads.size() - 1;
+		for (auto & encoder: params.encoders)
+			thread.streams.push_back(encoder->stream_index());
 		params_ptr->thread = &thread;
 		params_ptr->cn = cn;
 		os_thread_helper_start(&thread.thread, comp_wivrn_present_thread, params_ptr);
@@ -127,9 +204,276 @@ static void create_encoders(wivrn_comp_target * cn)
 		os_thread_helper_name(&thread.thread, name.c_str());
 	}
 	cn->pacer.set_stream_count(cn->encoders.size());
+	apply_rate_control(cn);
 	cn->cnx->send_control(desc);
 }
 
+// Without adaptive bitrate, must hold encoders_mutex
+static void apply_fixed_bitrate_limit(wivrn_comp_target * cn)
+{
+	uint64_t total_bitrate = 0;
+	for (size_t i = 0; i < cn->encoders.size() and i < cn->settings.size(); ++i)
+	{
+		uint64_t bitrate = cn->settings[i].bitrate * cn->bitrate_limit;
+		cn->encoders[i]->SetBitrate(bitrate);
+		total_bitrate += bitrate;
+	}
+	metrics::bitrate.set(total_bitrate);
+}
+
+// Settings which do not need new encoders when they change, must hold encoders_mutex
+static void apply_rate_control(wivrn_comp_target * cn)
+{
+	auto config = configuration::read_user_configuration();
+	if (config.latency_percentile)
+		cn->pacer.set_target(*config.latency_percentile / 100);
+	cn->throttle_on_drop = config.throttle_on_drop;
+	bool bitrate_change = std::ranges::all_of(cn->encoders, [](const auto & encoder) { return encoder->SupportsBitrateChange(); });
+	if (config.adaptive_bitrate and not bitrate_change)
+		U_LOG_W("Adaptive bitrate disabled, the encoders cannot change their bitrate");
+	if (config.adaptive_bitrate and bitrate_change)
+	{
+		cn->bitrate_control = std::make_unique<bitrate_controller>(cn->settings, cn->cnx->get_link_capacity());
+		cn->bitrate_control->set_limit(cn->bitrate_limit);
+	}
+	else
+	{
+		cn->bitrate_control.reset();
+		if (cn->bitrate_limit < 1)
+			apply_fixed_bitrate_limit(cn);
+	}
+	if (not config.dynamic_resolution)
+		cn->resolution_control.reset();
+	else if (not cn->resolution_control)
+	{
+		cn->resolution_control = std::make_unique<resolution_controller>(cn->fps);
+		metrics::resolution_scale.set(1);
+		if (cn->resolution_limit < 1 and cn->resolution_control->set_max_factor(cn->resolution_limit))
+			cn->resolution_changed = true;
+	}
+	if (not config.automatic_refresh_rate)
+		cn->refresh_rate_control.reset();
+	else if (not cn->refresh_rate_control)
+	{
+		const auto & info = cn->cnx->get_headset_info();
+		cn->refresh_rate_control = std::make_unique<refresh_rate_controller>(info.available_refresh_rates, info.preferred_refresh_rate);
+		if (cn->refresh_rate_limit > 0)
+		{
+			if (auto rate = cn->refresh_rate_control->set_max_rate(cn->refresh_rate_limit))
+				cn->new_refresh_rate = *rate;
+		}
+	}
+	if (float rate = config.refresh_rate.value_or(0); rate != cn->profile_refresh_rate and not cn->refresh_rate_control)
+	{
+		// Back to the rate selected on the headset when the profile no longer applies
+		cn->profile_refresh_rate = rate;
+		const auto & info = cn->cnx->get_headset_info();
+		if (rate <= 0)
+			rate = info.preferred_refresh_rate;
+		if (cn->refresh_rate_limit > 0)
+			rate = std::min(rate, cn->refresh_rate_limit);
+		if (not info.available_refresh_rates.empty())
+			rate = *std::ranges::min_element(info.available_refresh_rates, {}, [rate](float r) { return std::abs(r - rate); });
+		if (rate != cn->desc.fps)
+			cn->new_refresh_rate = rate;
+	}
+	uint64_t total_bitrate = 0;
+	for (const auto & s: cn->settings)
+		total_bitrate += s.bitrate;
+	metrics::bitrate.set(total_bitrate);
+}
+
+// Whether an encoder created with a can be reused for b, once its bitrate is changed
+static bool same_encoder(const encoder_settings & a, const encoder_settings & b)
+{
+	return a.width == b.width and
+	       a.height == b.height and
+	       a.offset_x == b.offset_x and
+	       a.offset_y == b.offset_y and
+	       a.codec == b.codec and
+	       a.encoder_name == b.encoder_name and
+	       a.options == b.options and
+	       a.group == b.group and
+	       a.device == b.device and
+	       a.fec_ratio == b.fec_ratio and
+	       a.pacing == b.pacing and
+	       a.intra_refresh == b.intra_refresh and
+	       a.tcp_only == b.tcp_only and
+	       a.qp_emphasis == b.qp_emphasis and
+	       a.skip_static_frames == b.skip_static_frames and
+	       a.non_reference_frames == b.non_reference_frames and
+	       a.error_concealment == b.error_concealment and
+	       a.spectator_socket == b.spectator_socket and
+	       a.inset == b.inset and
+	       a.source == b.source;
+}
+
+// Settings computed from the configuration do not use the backends that failed on this connection
+static void replace_failed_encoders(wivrn_comp_target * cn, std::vector<encoder_settings> & settings)
+{
+	for (const auto & [stream, failed]: cn->failed_encoders)
+	{
+		if (stream < settings.size())
+			replace_failed_encoder(settings[stream], failed);
+	}
+}
+
+// Called on the compositor thread when an encoder thread reported that the encoder of a stream keeps failing.
+// The affected stream switches to another backend, the headset keeps the decoders of the other streams.
+static void fail_over(wivrn_comp_target * cn, size_t stream)
+{
+	if (stream >= cn->settings.size())
+		return;
+	auto & settings = cn->settings[stream];
+	std::string failed_name = settings.encoder_name;
+	auto & failed = cn->failed_encoders[stream];
+	failed.insert(failed_name);
+	if (not replace_failed_encoder(settings, failed))
+	{
+		U_LOG_E("Stream %zu: encoder %s is failing and no other encoder is available", stream, failed_name.c_str());
+		return;
+	}
+	settings.video_width = settings.width;
+	settings.video_height = settings.height;
+	U_LOG_W("Stream %zu: encoder %s is failing, switching to %s", stream, failed_name.c_str(), settings.encoder_name.c_str());
+	metrics::encoder_failovers.add();
+	cn->recreate_images = true;
+}
+
+// Called on the compositor thread when the configuration file or the resolution factor changed.
+// Bitrate and rate control are applied to the running encoders, other changes recreate
+// the images and encoders on the next acquire and send a new video_stream_description.
+static void reconfigure(wivrn_comp_target * cn)
+{
+	uint32_t width = cn->unscaled_width;
+	uint32_t height = cn->unscaled_height;
+	double factor = 1;
+	if (std::unique_lock lock(cn->encoders_mutex); cn->resolution_control or cn->resolution_limit < 1)
+	{
+		factor = cn->resolution_control ? cn->resolution_control->get_factor() : cn->resolution_limit;
+		width = std::round(width * factor / 2) * 2;
+		height = std::round(height * factor / 2) * 2;
+	}
+	// Applications do not need to render more than what the stream keeps
+	cn->cnx->set_recommended_scale(factor);
+	std::vector<encoder_settings> settings;
+	try
+	{
+		settings = get_encoder_settings(*cn->wivrn_bundle->physical_device,
+		                                width,
+		                                height,
+		                                cn->fps,
+		                                cn->cnx->get_headset_decoders(),
+		                                cn->cnx->get_link_capacity());
+	}
+	catch (const std::exception & e)
+	{
+		U_LOG_E("Configuration not applied: %s", e.what());
+		return;
+	}
+	replace_failed_encoders(cn, settings);
+
+	// The insets of the running encoders have been moved to the foveation centre
+	for (auto & item: settings)
+	{
+		if (not cn->cnx->has_capability(capability::parity_shards))
+			item.fec_ratio = 0;
+		item.stream_width = cn->desc.width;
+		item.stream_height = cn->desc.height;
+		item.foveation = cn->desc.foveation;
+		VideoEncoder::PlaceInset(item);
+	}
+	bool reuse = width == cn->width and height == cn->height and settings.size() == cn->settings.size();
+	for (size_t i = 0; reuse and i < settings.size(); ++i)
+		reuse = same_encoder(settings[i], cn->settings[i]);
+
+	if (not reuse)
+	{
+		U_LOG_I("Recreating encoders for a %dx%d stream", width, height);
+		print_encoders(settings);
+		cn->settings = std::move(settings);
+		// Used by the compositor when it recreates the images
+		cn->c->settings.preferred.width = width;
+		cn->c->settings.preferred.height = height;
+		cn->recreate_images = true;
+		return;
+	}
+
+	U_LOG_I("Configuration changed, updating bitrate");
+	std::lock_guard lock(cn->encoders_mutex);
+	for (size_t i = 0; i < settings.size(); ++i)
+	{
+		cn->settings[i].bitrate = settings[i].bitrate;
+		cn->encoders[i]->SetBitrate(settings[i].bitrate);
+	}
+	apply_rate_control(cn);
+}
+
+// Called on the compositor thread, the headset switches to the rate of the new video_stream_description
+static void set_refresh_rate(wivrn_comp_target * cn, float rate)
+{
+	cn->desc.fps = rate;
+	cn->fps = cn->half_rate ? rate / 2 : rate;
+	cn->pacer.set_frame_duration(U_TIME_1S_IN_NS / cn->fps);
+	if (std::lock_guard lock(cn->encoders_mutex); cn->resolution_control)
+		cn->resolution_control->set_fps(cn->fps);
+	// The encoders are configured for a frame rate
+	cn->recreate_images = true;
+}
+
+// Wait until the commands of the last frame submitted for the image are done
+static void wait_image(wivrn_comp_target * cn, const pseudo_swapchain::item & item)
+{
+	vk::Result res;
+	if (*cn->psc.present_semaphore)
+	{
+		uint64_t value = item.frame_index + 1;
+		res = cn->wivrn_bundle->device.waitSemaphores(
+		        vk::SemaphoreWaitInfo{
+		                .semaphoreCount = 1,
+		                .pSemaphores = &*cn->psc.present_semaphore,
+		                .pValues = &value,
+		        },
+		        UINT64_MAX);
+	}
+	else
+		res = cn->wivrn_bundle->device.waitForFences(*item.fence, VK_TRUE, UINT64_MAX);
+	if (res != vk::Result::eSuccess)
+		throw std::runtime_error("failed to wait for presented image: " + vk::to_string(res));
+}
+
+// Device memory of the images given to the compositor, and of their conversion resources
+static void update_memory_metrics(wivrn_comp_target * cn)
+{
+	vk::DeviceSize swapchain = 0;
+	vk::DeviceSize conversion = 0;
+	uint32_t prepared = 0;
+	for (uint32_t i = 0; cn->psc.images and i < cn->image_count; i++)
+	{
+		const auto & item = cn->psc.images[i];
+		swapchain += item.image.allocated_size();
+		conversion += item.yuv.memory_size();
+		prepared += item.prepared;
+	}
+	// Host visible buffers the encoders read the images back with
+	vk::DeviceSize staging = 0;
+	for (const auto & pool: vk_allocator::instance().get_report().pools)
+	{
+		if (pool.pool == memory_pool::staging)
+			staging += pool.allocation_bytes;
+	}
+	metrics::swapchain_memory.set(swapchain);
+	metrics::conversion_memory.set(conversion);
+	metrics::staging_memory.set(staging);
+	metrics::prepared_images.set(prepared);
+	U_LOG_D("Video memory: %" PRIu64 "MB for %u compositor images, %" PRIu64 "MB for the conversion of %u, %" PRIu64 "MB of staging buffers",
+	        uint64_t(swapchain >> 20),
+	        cn->image_count,
+	        uint64_t(conversion >> 20),
+	        prepared,
+	        uint64_t(staging >> 20));
+}
+
 static VkResult create_images(struct wivrn_comp_target * cn, vk::ImageUsageFlags flags)
 {
 	auto vk = get_vk(cn);
@@ -166,10 +510,27 @@ static VkResult create_images(struct wivrn_comp_target * cn, vk::ImageUsageFlags
 		                },
 		        {
 		                .usage = VMA_MEMORY_USAGE_AUTO,
-		        });
+		        },
+		        memory_pool::frame,
+		        "pseudo swapchain image");
 		cn->images[i].handle = image;
 	}
 
+	if (not cn->conversion_pipeline)
+		cn->conversion_pipeline = std::make_shared<yuv_pipeline>(device, cn->wivrn_bundle->pipeline_cache);
+
+	// Downscaled copy of the stream for the background of layered foveation
+	cn->psc.format = format;
+	cn->psc.background.reset();
+	for (const auto & settings: cn->settings)
+	{
+		if (settings.source)
+			cn->psc.background = vk::Rect2D{
+			        .offset = {settings.offset_x, settings.offset_y},
+			        .extent = {settings.width, settings.height},
+			};
+	}
+
 	for (uint32_t i = 0; i < cn->image_count; i++)
 	{
 		auto & item = cn->psc.images[i];
@@ -189,23 +550,90 @@ static VkResult create_images(struct wivrn_comp_target * cn, vk::ImageUsageFlags
 		                                              },
 		                                      });
 		cn->images[i].view = *item.image_view;
-		item.yuv = yuv_converter(vk->physical_device, device, item.image, format, vk::Extent2D{cn->width, cn->height});
 
 		item.fence = vk::raii::Fence(device, vk::FenceCreateInfo{.flags = vk::FenceCreateFlagBits::eSignaled});
 
+		if (cn->psc.timestamp_period > 0)
+			item.timestamps = vk::raii::QueryPool(device,
+			                                      vk::QueryPoolCreateInfo{
+			                                              .queryType = vk::QueryType::eTimestamp,
+			                                              .queryCount = 3 + pseudo_swapchain::max_timed_copies,
+			                                      });
+
 		item.command_buffer = std::move(device.allocateCommandBuffers(
 		        {.commandPool = *cn->command_pool,
 		         .commandBufferCount = 1})[0]);
 	}
+	update_memory_metrics(cn);
 
 	return VK_SUCCESS;
 }
 
+// Creates the resources an image needs to be converted and sent, on its first present
+static void prepare_image(wivrn_comp_target * cn, pseudo_swapchain::item & item)
+{
+	auto & device = cn->wivrn_bundle->device;
+	item.yuv = yuv_converter(get_vk(cn)->physical_device, device, cn->conversion_pipeline, item.image, cn->psc.format, vk::Extent2D{cn->width, cn->height}, cn->psc.background);
+	if (cn->depth_stream)
+		item.depth = depth_sampler(device, cn->wivrn_bundle->pipeline_cache);
+	if (cn->quad_layers)
+		item.quads = quad_layer_copier(device);
+	item.prepared = true;
+	update_memory_metrics(cn);
+}
+
+// Releases the conversion resources of the images the pipeline did not need for a while:
+// images are acquired in order, the last ones are only used when the encoders lag
+static void release_idle_images(wivrn_comp_target * cn, uint32_t acquired_index)
+{
+	int64_t now = os_monotonic_get_ns();
+	bool released = false;
+	for (uint32_t i = 0; i < cn->image_count; i++)
+	{
+		auto & item = cn->psc.images[i];
+		if (i == acquired_index or not item.prepared or now - item.last_used_ns < idle_image_release)
+			continue;
+		// Encoders never take a free image, owning it is enough to release its resources
+		auto expected = image_free;
+		if (not item.status.compare_exchange_strong(expected, image_acquired))
+			continue;
+		wait_image(cn, item);
+		item.yuv = yuv_converter();
+		item.depth = depth_sampler();
+		item.quads = quad_layer_copier();
+		item.has_depth = false;
+		item.prepared = false;
+		item.status = image_free;
+		released = true;
+		U_LOG_D("Released the conversion resources of unused image %u", i);
+	}
+	if (released)
+		update_memory_metrics(cn);
+}
+
 static bool comp_wivrn_init_pre_vulkan(struct comp_target * ct)
 {
 	return true;
 }
 
+// Whether the present semaphore can be shared with encoders that wait for it on the GPU
+static bool can_export_timeline_semaphore(wivrn_vk_bundle & bundle)
+{
+	if (not std::ranges::any_of(bundle.device_extensions, [](const char * ext) {
+		    return strcmp(ext, VK_KHR_EXTERNAL_SEMAPHORE_FD_EXTENSION_NAME) == 0;
+	    }))
+		return false;
+
+	vk::SemaphoreTypeCreateInfo timeline_info{
+	        .semaphoreType = vk::SemaphoreType::eTimeline,
+	};
+	auto properties = bundle.physical_device.getExternalSemaphoreProperties(vk::PhysicalDeviceExternalSemaphoreInfo{
+	        .pNext = &timeline_info,
+	        .handleType = vk::ExternalSemaphoreHandleTypeFlagBits::eOpaqueFd,
+	});
+	return bool(properties.externalSemaphoreFeatures & vk::ExternalSemaphoreFeatureFlagBits::eExportable);
+}
+
 static bool comp_wivrn_init_post_vulkan(struct comp_target * ct, uint32_t preferred_width, uint32_t preferred_height)
 {
 	struct wivrn_comp_target * cn = (struct wivrn_comp_target *)ct;
@@ -221,6 +649,26 @@ static bool comp_wivrn_init_post_vulkan(struct comp_target * ct, uint32_t prefer
 		                .flags = vk::CommandPoolCreateFlagBits::eResetCommandBuffer,
 		                .queueFamilyIndex = vk->queue_family_index,
 		        });
+		if (vk->features.timeline_semaphore)
+		{
+			vk::SemaphoreTypeCreateInfo timeline_info{
+			        .semaphoreType = vk::SemaphoreType::eTimeline,
+			};
+			vk::ExportSemaphoreCreateInfo export_info{
+			        .pNext = &timeline_info,
+			        .handleTypes = vk::ExternalSemaphoreHandleTypeFlagBits::eOpaqueFd,
+			};
+			cn->psc.present_semaphore_exportable = can_export_timeline_semaphore(*cn->wivrn_bundle);
+			cn->psc.present_semaphore = vk::raii::Semaphore(
+			        cn->wivrn_bundle->device,
+			        vk::SemaphoreCreateInfo{
+			                .pNext = cn->psc.present_semaphore_exportable ? (void *)&export_info : (void *)&timeline_info,
+			        });
+		}
+		// The conversion shares the only queue with the compositor, measure how long it occupies it
+		const auto & physical_device = cn->wivrn_bundle->physical_device;
+		if (physical_device.getQueueFamilyProperties()[vk->queue_family_index].timestampValidBits > 0)
+			cn->psc.timestamp_period = physical_device.getProperties().limits.timestampPeriod;
 	}
 	catch (std::exception & e)
 	{
@@ -230,8 +678,25 @@ static bool comp_wivrn_init_post_vulkan(struct comp_target * ct, uint32_t prefer
 
 	try
 	{
-		cn->settings = get_encoder_settings(*cn->wivrn_bundle->physical_device, cn->c->settings.preferred.width, cn->c->settings.preferred.height);
+		cn->app_watcher.emplace();
+		configuration::set_running_application(cn->app_watcher->get_names());
+		cn->unscaled_width = cn->c->settings.preferred.width;
+		cn->unscaled_height = cn->c->settings.preferred.height;
+		// Only benchmarks on the first connection for this GPU and headset
+		autotune_encoders(*cn->wivrn_bundle,
+		                  cn->unscaled_width,
+		                  cn->unscaled_height,
+		                  cn->fps,
+		                  cn->cnx->get_headset_decoders(),
+		                  cn->cnx->get_link_capacity());
+		cn->settings = get_encoder_settings(*cn->wivrn_bundle->physical_device,
+		                                    cn->c->settings.preferred.width,
+		                                    cn->c->settings.preferred.height,
+		                                    cn->fps,
+		                                    cn->cnx->get_headset_decoders(),
+		                                    cn->cnx->get_link_capacity());
 		print_encoders(cn->settings);
+		cn->config_watcher.emplace(configuration::get_config_file());
 	}
 	catch (const std::exception & e)
 	{
@@ -241,20 +706,104 @@ static bool comp_wivrn_init_post_vulkan(struct comp_target * ct, uint32_t prefer
 	return true;
 }
 
+// Remove the quad layers that can be sent separately from the layers the compositor renders,
+// at least one layer is kept in the video stream
+static void extract_quad_layers(wivrn_comp_target * cn)
+{
+	auto & slot = cn->c->base.slot;
+	auto is_quad = [](const auto & layer) { return layer.data.type == XRT_LAYER_QUAD; };
+	if (std::all_of(slot.layers, slot.layers + slot.layer_count, is_quad))
+		return;
+
+	uint32_t kept = 0;
+	for (uint32_t i = 0; i < slot.layer_count; ++i)
+	{
+		const auto & layer = slot.layers[i];
+		if (is_quad(layer) and cn->quads.size() < quad_layer_copier::max_layers)
+		{
+			const comp_swapchain * sc = layer.sc_array[0];
+			const auto & quad = layer.data.quad;
+			auto format = vk::Format(sc->vkic.info.format);
+			if (quad_layer_copier::supported(format) and
+			    uint32_t(quad.sub.rect.extent.w) <= quad_layer_copier::max_size and
+			    uint32_t(quad.sub.rect.extent.h) <= quad_layer_copier::max_size)
+			{
+				cn->quads.push_back({
+				        .swapchain = sc,
+				        .image = sc->vkic.images[quad.sub.image_index].handle,
+				        .array_index = quad.sub.array_index,
+				        .format = format,
+				        .rect = {
+				                .offset = {quad.sub.rect.offset.w, quad.sub.rect.offset.h},
+				                .extent = {uint32_t(quad.sub.rect.extent.w), uint32_t(quad.sub.rect.extent.h)},
+				        },
+				        .head_locked = bool(layer.data.flags & XRT_LAYER_COMPOSITION_VIEW_SPACE_BIT),
+				        .unpremultiplied_alpha = bool(layer.data.flags & XRT_LAYER_COMPOSITION_UNPREMULTIPLIED_ALPHA_BIT),
+				        .pose = xrt_cast(quad.pose),
+				        .size = {quad.size.x, quad.size.y},
+				});
+				continue;
+			}
+		}
+		if (kept != i)
+			slot.layers[kept] = slot.layers[i];
+		++kept;
+	}
+	slot.layer_count = kept;
+}
+
+// Take the layer out of the slot if it is a single opaque projection layer: the compositor then has
+// nothing to render, and the conversion samples the application images with the foveation
+static void extract_projection_layer(wivrn_comp_target * cn)
+{
+	cn->bypass_layer.reset();
+
+	auto & slot = cn->c->base.slot;
+	if (slot.layer_count != 1)
+		return;
+
+	const auto & layer = slot.layers[0];
+	if (layer.data.type != XRT_LAYER_PROJECTION and layer.data.type != XRT_LAYER_PROJECTION_DEPTH)
+		return;
+
+	// Blending with the background and flipped images are left to the compositor
+	if (layer.data.view_count != 2 or layer.data.flip_y or
+	    (layer.data.flags & (XRT_LAYER_COMPOSITION_BLEND_TEXTURE_SOURCE_ALPHA_BIT | XRT_LAYER_COMPOSITION_UNPREMULTIPLIED_ALPHA_BIT)))
+		return;
+
+	cn->bypass_layer = layer;
+	slot.layer_count = 0;
+}
+
 static bool comp_wivrn_check_ready(struct comp_target * ct)
 {
 	struct wivrn_comp_target * cn = (struct wivrn_comp_target *)ct;
 	if (not cn->cnx->connected())
 		return false;
 
+	// Once per frame, the layers are gone from the slot after the first call
+	if (cn->quad_layers and cn->quads_frame_id != cn->current_frame_id)
+	{
+		cn->quads.clear();
+		extract_quad_layers(cn);
+		cn->quads_frame_id = cn->current_frame_id;
+	}
+
+	if (cn->bypass_compositor and cn->bypass_frame_id != cn->current_frame_id)
+	{
+		extract_projection_layer(cn);
+		cn->bypass_frame_id = cn->current_frame_id;
+	}
+
 	// This function is called before on each frame before reprojection
 	// hijack it so that we can dynamically change ATW
 	cn->c->debug.atw_off = true;
-	for (int eye = 0; eye < 2; ++eye)
+	// The bypassed layer is a single projection layer
+	for (int eye = 0; eye < 2 and not cn->bypass_layer; ++eye)
 	{
 		const auto & slot = cn->c->base.slot;
 		if (slot.layer_count > 1 or
-		    slot.layers[0].data.type != XRT_LAYER_PROJECTION)
+		    (slot.layers[0].data.type != XRT_LAYER_PROJECTION and slot.layers[0].data.type != XRT_LAYER_PROJECTION_DEPTH))
 		{
 			// We are not in the trivial single stereo projection layer
 			// reprojection must be done
@@ -347,6 +896,27 @@ static VkResult comp_wivrn_acquire(struct comp_target * ct, uint32_t * out_index
 	struct wivrn_comp_target * cn = (struct wivrn_comp_target *)ct;
 	struct vk_bundle * vk = get_vk(cn);
 
+	bool config_changed = cn->config_watcher and cn->config_watcher->changed();
+	if (cn->app_watcher and cn->app_watcher->changed())
+	{
+		configuration::set_running_application(cn->app_watcher->get_names());
+		if (auto profile = configuration::read_user_configuration().active_profile)
+			U_LOG_I("Using configuration profile for %s", profile->c_str());
+		config_changed = true;
+	}
+	if (cn->resolution_changed.exchange(false) or config_changed)
+		reconfigure(cn);
+	if (float rate = cn->new_refresh_rate.exchange(0))
+		set_refresh_rate(cn, rate);
+	if (int stream = cn->failing_stream.exchange(-1); stream >= 0)
+		fail_over(cn, stream);
+	if (cn->recreate_images)
+	{
+		// The compositor calls create_images with the new preferred size
+		cn->recreate_images = false;
+		return VK_ERROR_OUT_OF_DATE_KHR;
+	}
+
 	vk::Semaphore sem(cn->semaphores.present_complete);
 
 	vk::SubmitInfo submit_info{
@@ -367,69 +937,233 @@ static VkResult comp_wivrn_acquire(struct comp_target * ct, uint32_t * out_index
 			if (cn->psc.images[i].status.compare_exchange_weak(expected, image_acquired))
 			{
 				*out_index = i;
+				release_idle_images(cn, i);
 				return VK_SUCCESS;
 			}
 		}
 	};
 }
 
+// Submit the commands of the image for the current frame
+static void submit_image(wivrn_comp_target * cn, pseudo_swapchain::item & item, vk::SubmitInfo & submit_info)
+{
+	struct vk_bundle * vk = get_vk(cn);
+	item.frame_index = cn->current_frame_id;
+	if (*cn->psc.present_semaphore)
+	{
+		uint64_t value = item.frame_index + 1;
+		vk::TimelineSemaphoreSubmitInfo timeline_info{
+		        .signalSemaphoreValueCount = 1,
+		        .pSignalSemaphoreValues = &value,
+		};
+		submit_info.pNext = &timeline_info;
+		submit_info.signalSemaphoreCount = 1;
+		submit_info.pSignalSemaphores = &*cn->psc.present_semaphore;
+		scoped_lock lock(vk->queue_mutex);
+		cn->wivrn_bundle->queue.submit(submit_info);
+	}
+	else
+	{
+		cn->wivrn_bundle->device.resetFences(*item.fence);
+		scoped_lock lock(vk->queue_mutex);
+		cn->wivrn_bundle->queue.submit(submit_info, *item.fence);
+	}
+}
+
+// Times per second the quad layers are copied to check whether they changed
+static const int quad_layer_copy_rate = 10;
+
+// GPU and CPU clocks are sampled again after this duration
+static const int64_t gpu_calibration_interval = U_TIME_1S_IN_NS;
+
+// Converts a GPU timestamp to CLOCK_MONOTONIC, 0 if the clocks cannot be correlated
+static int64_t gpu_to_monotonic(wivrn_comp_target * cn, uint64_t timestamp)
+{
+	auto & psc = cn->psc;
+	int64_t now = os_monotonic_get_ns();
+	if (get_vk(cn)->has_EXT_calibrated_timestamps and now - psc.last_calibration_ns > gpu_calibration_interval)
+	{
+		psc.last_calibration_ns = now;
+		try
+		{
+			std::array infos{
+			        vk::CalibratedTimestampInfoEXT{.timeDomain = vk::TimeDomainEXT::eDevice},
+			        vk::CalibratedTimestampInfoEXT{.timeDomain = vk::TimeDomainEXT::eClockMonotonic},
+			};
+			auto [timestamps, deviation] = cn->wivrn_bundle->device.getCalibratedTimestampsEXT(infos);
+			psc.calibration_gpu = timestamps[0];
+			psc.calibration_cpu_ns = timestamps[1];
+			psc.calibrated = true;
+		}
+		catch (std::exception & e)
+		{
+			U_LOG_D("Failed to calibrate GPU timestamps: %s", e.what());
+		}
+	}
+	if (not psc.calibrated)
+		return 0;
+	return psc.calibration_cpu_ns + int64_t(double(int64_t(timestamp - psc.calibration_gpu)) * psc.timestamp_period);
+}
+
+// Times of the conversion and copies on the GPU, the commands of the image must be done
+static void read_gpu_timestamps(wivrn_comp_target * cn, pseudo_swapchain::item & item)
+{
+	uint32_t count = std::exchange(item.timestamp_count, 0);
+	if (count == 0)
+		return;
+	auto [res, timestamps] = item.timestamps.getResults<uint64_t>(0, count, count * sizeof(uint64_t), sizeof(uint64_t), vk::QueryResultFlagBits::e64);
+	if (res != vk::Result::eSuccess or timestamps.back() <= timestamps.front())
+		return;
+	metrics::conversion_gpu_duration.observe((timestamps.back() - timestamps.front()) * cn->psc.timestamp_period * 1e-9);
+
+	if (not gpu_to_monotonic(cn, timestamps.front()))
+		return;
+	cn->cnx->dump_time("gpu_convert_begin", item.frame_index, gpu_to_monotonic(cn, timestamps[0]));
+	cn->cnx->dump_time("gpu_convert_end", item.frame_index, gpu_to_monotonic(cn, timestamps[1]));
+	// Encoders are in the order of their stream index
+	for (uint32_t i = 2; i + 1 < count; ++i)
+		cn->cnx->dump_time("gpu_copy_end", item.frame_index, gpu_to_monotonic(cn, timestamps[i]), i - 2);
+	cn->cnx->dump_time("gpu_present_end", item.frame_index, gpu_to_monotonic(cn, timestamps.back()));
+}
+
 static void * comp_wivrn_present_thread(void * void_param)
 {
 	std::unique_ptr<encoder_thread_param> param((encoder_thread_param *)void_param);
 	struct wivrn_comp_target * cn = param->cn;
-	struct vk_bundle * vk = get_vk(cn);
 	U_LOG_I("Starting encoder thread %d", param->thread->index);
+	apply_thread_policy(thread_role::encoder);
+	wakeup_latency wakeup("Encoder group " + std::to_string(param->thread->index), metrics::encoder_wakeup_latency);
 
 	uint8_t status_bit = 1 << (param->thread->index + 1);
 
-	std::vector<VkFence> fences(cn->image_count);
-	std::vector<int> indices(cn->image_count);
+	auto & ready = param->thread->ready;
+	// The thread was waiting for an image
+	bool woken = false;
+	std::vector<int> consecutive_errors(param->encoders.size());
 	while (os_thread_helper_is_running(&param->thread->thread))
 	{
-		int presenting_index = -1;
-		int nb_fences = 0;
+		int index = ready.exchange(wivrn_comp_target::encoder_thread::no_image);
+		if (index == wivrn_comp_target::encoder_thread::no_image)
+		{
+			ready.wait(wivrn_comp_target::encoder_thread::no_image);
+			woken = true;
+			continue;
+		}
+		if (index == wivrn_comp_target::encoder_thread::stop)
+			continue;
+		if (woken)
 		{
-			uint64_t timestamp = 0;
-			auto gen = cn->psc.present_gen.load();
+			wakeup.add(param->thread->ready_ns, os_monotonic_get_ns());
+			woken = false;
+		}
+
+		if (int dropped = param->thread->dropped.exchange(0))
+			U_LOG_I("Encoder group %d dropped %d frames", param->thread->index, dropped);
 
-			for (uint32_t i = 0; i < cn->image_count; i++)
+		auto & psc_image = cn->psc.images[index];
+		bool released = false;
+		try
+		{
+			// The image data needed on the CPU is only read by the first thread
+			bool gpu_wait = param->gpu_wait and not param->motion and
+			                not(param->thread->index == 0 and (psc_image.has_depth or cn->quad_layers));
+			if (not gpu_wait)
+				wait_image(cn, psc_image);
+
+			auto view_info = psc_image.view_info;
+			auto frame_index = psc_image.frame_index;
+			bool refresh = psc_image.refresh;
+			std::vector<uint32_t> image_checksums;
+			if (not gpu_wait)
 			{
-				if (cn->psc.images[i].status & status_bit)
+				auto checksums = psc_image.yuv.checksums();
+				image_checksums.assign(checksums.begin(), checksums.end());
+			}
+			std::vector<uint8_t> thumbnail;
+			if (param->motion)
+			{
+				auto image_thumbnail = psc_image.yuv.thumbnail();
+				thumbnail.assign(image_thumbnail.begin(), image_thumbnail.end());
+			}
+			auto thumbnail_size = psc_image.yuv.thumbnail_size();
+			if (param->thread->index == 0 and not gpu_wait)
+				read_gpu_timestamps(cn, psc_image);
+			std::vector<to_headset::video_stream_depth> depth;
+			if (param->thread->index == 0 and psc_image.has_depth)
+			{
+				for (uint8_t view = 0; view < 2; ++view)
 				{
-					if (timestamp < cn->psc.images[i].view_info.display_time)
+					auto values = psc_image.depth.values(view);
+					depth.push_back({
+					        .frame_idx = uint64_t(frame_index),
+					        .view = view,
+					        .values = {values.begin(), values.end()},
+					});
+				}
+			}
+			std::vector<to_headset::quad_layers> quads;
+			if (param->thread->index == 0 and cn->quad_layers)
+			{
+				if (cn->reset_quads.exchange(false))
+					cn->quad_sender.reset();
+				quads = cn->quad_sender.update(psc_image.quads);
+			}
+			// Encoders copied the image when it was presented, it can be reused
+			if (not gpu_wait)
+			{
+				psc_image.status &= ~status_bit;
+				released = true;
+			}
+
+			// Encoders of the group wait from here until the previous ones are done
+			int64_t now = os_monotonic_get_ns();
+			for (auto & encoder: param->encoders)
+				cn->cnx->dump_time("encode_ready", frame_index, now, encoder->stream_index());
+
+			// Depth is needed as soon as the frame is displayed
+			for (auto & packet: depth)
+				cn->cnx->send_stream(std::move(packet));
+
+			for (size_t i = 0; i < param->encoders.size(); ++i)
+			{
+				auto & encoder = param->encoders[i];
+				int & errors = consecutive_errors[i];
+				try
+				{
+					encoder->Encode(*cn->cnx, view_info, frame_index, image_checksums, refresh);
+					errors = 0;
+				}
+				catch (std::exception & e)
+				{
+					U_LOG_W("Stream %d: encode error: %s", encoder->stream_index(), e.what());
+					// A broken encoder is replaced instead of failing for the rest of the session
+					if (++errors == max_consecutive_errors)
 					{
-						presenting_index = i;
+						int expected = -1;
+						cn->failing_stream.compare_exchange_strong(expected, encoder->stream_index());
 					}
-					indices[nb_fences] = i;
-					fences[nb_fences++] = *cn->psc.images[i].fence;
 				}
 			}
 
-			if (presenting_index < 0)
+			if (gpu_wait)
 			{
-				cn->psc.present_gen.wait(gen);
-				continue;
+				// The encoders only queued their wait, the commands of the image
+				// must be done before it is given back to the compositor
+				wait_image(cn, psc_image);
+				if (param->thread->index == 0)
+					read_gpu_timestamps(cn, psc_image);
+				psc_image.status &= ~status_bit;
+				released = true;
 			}
-		}
 
-		VkResult res = vk->vkWaitForFences(vk->device, nb_fences, fences.data(), VK_TRUE, UINT64_MAX);
-		if (nb_fences > 1)
-		{
-			U_LOG_I("Encoder group %d dropped %d frames", param->thread->index, nb_fences - 1);
-		}
-		VK_CHK_WITH_RET(res, "vkWaitForFences", NULL);
+			for (auto & packet: quads)
+				cn->cnx->send_control(std::move(packet));
 
-		for (int i = 0; i < nb_fences; i++)
-		{
-			cn->psc.images[indices[i]].status &= ~status_bit;
-		}
-
-		const auto & psc_image = cn->psc.images[presenting_index];
-		try
-		{
-			for (auto & encoder: param->encoders)
+			// The motion is only needed when the frame is displayed again, after the encoded frame
+			if (param->motion)
 			{
-				encoder->Encode(*cn->cnx, psc_image.view_info, psc_image.frame_index);
+				if (auto motion = param->motion->estimate(thumbnail, thumbnail_size, frame_index, view_info.display_time))
+					cn->cnx->send_control(std::move(*motion));
 			}
 		}
 		catch (std::exception & e)
@@ -440,6 +1174,8 @@ static void * comp_wivrn_present_thread(void * void_param)
 		{
 			// Ignore errors
 		}
+		if (not released)
+			psc_image.status &= ~status_bit;
 	}
 
 	return NULL;
@@ -456,11 +1192,17 @@ static VkResult comp_wivrn_present(struct comp_target * ct,
 
 	assert(index < cn->image_count);
 
-	struct vk_bundle * vk = get_vk(cn);
+	auto & item = cn->psc.images[index];
+	// Encoders are done with the image, but the commands of its last frame may still be running
+	wait_image(cn, item);
+	if (not item.prepared)
+		prepare_image(cn, item);
+	item.last_used_ns = os_monotonic_get_ns();
 
-	auto & command_buffer = cn->psc.images[index].command_buffer;
+	auto & command_buffer = item.command_buffer;
 	command_buffer.reset();
 	command_buffer.begin(vk::CommandBufferBeginInfo{});
+	item.timestamp_count = 0;
 
 	vk::Semaphore wait_semaphore = cn->semaphores.render_complete;
 	vk::PipelineStageFlags wait_stage = vk::PipelineStageFlagBits::eComputeShader;
@@ -472,51 +1214,157 @@ static VkResult comp_wivrn_present(struct comp_target * ct,
 	        .pCommandBuffers = &*command_buffer,
 	};
 
-	if (cn->c->base.slot.layer_count == 0 or not cn->cnx->get_offset())
+	if ((cn->c->base.slot.layer_count == 0 and not cn->bypass_layer) or not cn->cnx->get_offset())
 	{
-		// TODO: Tell the headset that there is no image to display
-		assert(cn->psc.images[index].status == image_acquired);
+		// Nothing to display: skip conversion and encoding, the headset keeps the last frame
+		cn->set_idle(true);
+		assert(item.status == image_acquired);
 		command_buffer.end();
-		scoped_lock lock(vk->queue_mutex);
-		cn->wivrn_bundle->queue.submit(submit_info);
-		cn->psc.images[index].status = image_free;
+		submit_image(cn, item, submit_info);
+		item.status = image_free;
 		return VK_SUCCESS;
 	}
 
 	assert(index < ct->image_count);
 	assert(ct->images != NULL);
 
-	auto & yuv = cn->psc.images[index].yuv;
-	yuv.record_draw_commands(command_buffer);
-	for (auto & encoder: cn->encoders)
+	cn->set_idle(false);
+
+	// The swapchain images of the layer are kept by the compositor until the next frame
+	const auto & first_layer = cn->bypass_layer ? *cn->bypass_layer : cn->c->base.slot.layers[0];
+
+	auto & yuv = item.yuv;
+	// A single encoder may take the output of the conversion directly
+	std::optional<yuv_converter::direct_output> direct;
+	if (cn->encoders.size() == 1)
+		direct = cn->encoders[0]->DirectInput(yuv, cn->current_frame_id);
+	uint32_t timestamp_count = 0;
+	if (*item.timestamps)
 	{
-		encoder->PresentImage(yuv, command_buffer);
+		command_buffer.resetQueryPool(*item.timestamps, 0, 3 + pseudo_swapchain::max_timed_copies);
+		// Written once rendering is complete, the wait stage of the semaphore
+		command_buffer.writeTimestamp(vk::PipelineStageFlagBits::eComputeShader, *item.timestamps, timestamp_count++);
+	}
+	// The compositor renders with the distortion monado computed once from the fixed parameters,
+	// only the conversion of a bypassed layer can move the foveation with the gaze
+	auto foveation = cn->desc.foveation;
+	std::optional<std::array<yuv_converter::source_view, 2>> source;
+	if (cn->bypass_layer)
+	{
+		const auto & slot = cn->c->base.slot;
+		foveation = cn->cnx->get_foveation(desired_present_time_ns, {slot.poses[0], slot.poses[1]}, {slot.fovs[0], slot.fovs[1]});
+		source.emplace();
+		for (int eye = 0; eye < 2; ++eye)
+		{
+			const auto & v = first_layer.data.proj.v[eye];
+			const comp_swapchain * sc = first_layer.sc_array[eye];
+			(*source)[eye] = {
+			        .image = sc->images[v.sub.image_index].views.no_alpha[v.sub.array_index],
+			        .x = v.sub.norm_rect.x,
+			        .y = v.sub.norm_rect.y,
+			        .width = v.sub.norm_rect.w,
+			        .height = v.sub.norm_rect.h,
+			        .stream_fov = xrt_cast(cn->c->base.slot.fovs[eye]),
+			        .image_fov = xrt_cast(v.fov),
+			        .foveation = foveation[eye],
+			};
+		}
+		metrics::frames_bypassed.add();
+	}
+	yuv.record_draw_commands(command_buffer, direct, source);
+	if (*item.timestamps)
+		command_buffer.writeTimestamp(vk::PipelineStageFlagBits::eBottomOfPipe, *item.timestamps, timestamp_count++);
+	// The encoders get their input before the depth and quad layers are processed
+	if (not direct)
+	{
+		for (size_t i = 0; i < cn->encoders.size(); ++i)
+		{
+			cn->encoders[i]->PresentImage(yuv, command_buffer, cn->current_frame_id);
+			if (*item.timestamps and i < pseudo_swapchain::max_timed_copies)
+				command_buffer.writeTimestamp(vk::PipelineStageFlagBits::eBottomOfPipe, *item.timestamps, timestamp_count++);
+		}
 	}
-	command_buffer.end();
 
+	item.has_depth = false;
+	if (cn->depth_stream and cn->c->debug.atw_off and first_layer.data.type == XRT_LAYER_PROJECTION_DEPTH)
 	{
-		std::vector<vk::Fence> fences;
-		fences.reserve(ct->image_count);
-		for (size_t i = 0; i < ct->image_count; ++i)
+		const auto & slot = cn->c->base.slot;
+		const auto & layer = first_layer;
+		std::array<depth_sampler::view, 2> views;
+		for (int eye = 0; eye < 2; ++eye)
 		{
-			fences.push_back(*cn->psc.images[i].fence);
+			const auto & d = layer.data.depth.d[eye];
+			const comp_swapchain * sc = layer.sc_array[layer.data.view_count + eye];
+			views[eye] = {
+			        .depth = sc->images[d.sub.image_index].views.no_alpha[d.sub.array_index],
+			        .x = d.sub.norm_rect.x,
+			        .y = d.sub.norm_rect.y,
+			        .width = d.sub.norm_rect.w,
+			        .height = d.sub.norm_rect.h,
+			        .stream_fov = xrt_cast(slot.fovs[eye]),
+			        .depth_fov = xrt_cast(layer.data.depth.v[eye].fov),
+			        .near_z = d.near_z,
+			        .far_z = d.far_z,
+			        .min_depth = d.min_depth,
+			        .max_depth = d.max_depth,
+			        .foveation = foveation[eye],
+			};
 		}
-		auto res = cn->wivrn_bundle->device.waitForFences(fences, VK_TRUE, UINT64_MAX);
+		item.depth.record_draw_commands(command_buffer, views);
+		item.has_depth = true;
+	}
+	if (cn->quad_layers)
+	{
+		// Static layers are compared on the encoder thread, only copy them a few times per second
+		int64_t now = os_monotonic_get_ns();
+		bool copy = not cn->quads.empty() and now - cn->last_quad_copy_ns >= U_TIME_1S_IN_NS / quad_layer_copy_rate;
+		if (copy)
+			cn->last_quad_copy_ns = now;
+		item.quads.record_copy_commands(command_buffer, cn->quads, copy);
+	}
+	if (*item.timestamps)
+	{
+		command_buffer.writeTimestamp(vk::PipelineStageFlagBits::eBottomOfPipe, *item.timestamps, timestamp_count++);
+		item.timestamp_count = timestamp_count;
 	}
+	command_buffer.end();
 
-	cn->wivrn_bundle->device.resetFences(*cn->psc.images[index].fence);
 	{
-		scoped_lock lock(vk->queue_mutex);
-		cn->wivrn_bundle->queue.submit(submit_info, *cn->psc.images[index].fence);
+		// Decided here and not by each encoder, so that all the streams skip the same static frames
+		int64_t now = os_monotonic_get_ns();
+		item.refresh = now >= cn->last_refresh_ns + VideoEncoder::static_frame_refresh;
+		if (not item.refresh)
+		{
+			std::lock_guard lock(cn->encoders_mutex);
+			item.refresh = std::ranges::any_of(cn->encoders, [](const auto & encoder) { return encoder->RecoveryPending(); });
+		}
+		if (item.refresh)
+			cn->last_refresh_ns = now;
 	}
 
-	assert(cn->psc.images[index].status == image_acquired);
-	// set bits to 1 for index 1..num encoder threads + 1
-	cn->psc.images[index].status = (1 << (cn->encoder_threads.size() + 1)) - 2;
-	cn->psc.images[index].frame_index = cn->current_frame_id;
+	submit_image(cn, item, submit_info);
 
-	auto & view_info = cn->psc.images[index].view_info;
-	view_info.display_time = cn->cnx->get_offset().to_headset(desired_present_time_ns);
+	assert(item.status == image_acquired);
+	// set bits to 1 for index 1..num encoder threads + 1
+	item.status = (1 << (cn->encoder_threads.size() + 1)) - 2;
+	cn->cnx->dump_time("present", cn->current_frame_id, os_monotonic_get_ns());
+	metrics::frames_presented.add();
+
+	// The poses are the ones the image was rendered with, the headset reprojects from them
+	// to its own latest pose. Replacing them with fresher poses when encoding would shift the image.
+	auto & view_info = item.view_info;
+	auto offset = cn->cnx->get_offset();
+	view_info.display_time = offset.to_headset(desired_present_time_ns);
+	view_info.foveation = foveation;
+
+	// Motion to photons: the sample the views come from, the rest of the path is in the stream events
+	auto sample = cn->cnx->get_view_sample();
+	view_info.tracking_timestamp = sample.produced;
+	if (sample.produced)
+	{
+		cn->cnx->dump_time("tracking_produced", cn->current_frame_id, offset.from_headset(sample.produced));
+		cn->cnx->dump_time("tracking_received", cn->current_frame_id, sample.received);
+	}
 	for (int eye = 0; eye < 2; ++eye)
 	{
 		const auto & slot = cn->c->base.slot;
@@ -524,7 +1372,7 @@ static VkResult comp_wivrn_present(struct comp_target * ct,
 		view_info.pose[eye] = xrt_cast(slot.poses[eye]);
 		if (cn->c->debug.atw_off)
 		{
-			const auto & proj = slot.layers[0].data.proj;
+			const auto & proj = first_layer.data.proj;
 			view_info.pose[eye] = xrt_cast(proj.v[eye].pose);
 		}
 		else
@@ -536,8 +1384,31 @@ static VkResult comp_wivrn_present(struct comp_target * ct,
 			view_info.pose[eye] = xrt_cast(result.pose);
 		}
 	}
-	cn->psc.present_gen += 1;
-	cn->psc.present_gen.notify_all();
+
+	// Hand the image to the encoder threads, an image they did not take yet is dropped
+	bool dropped = false;
+	int64_t ready_ns = os_monotonic_get_ns();
+	for (auto & thread: cn->encoder_threads)
+	{
+		thread.ready_ns = ready_ns;
+		int previous = thread.ready.exchange(index);
+		if (previous >= 0)
+		{
+			auto & dropped_image = cn->psc.images[previous];
+			int64_t now = os_monotonic_get_ns();
+			for (uint8_t stream: thread.streams)
+				cn->cnx->dump_time("encode_drop", dropped_image.frame_index, now, stream);
+			dropped_image.status &= ~(1 << (thread.index + 1));
+			++thread.dropped;
+			metrics::frames_dropped.add();
+			dropped = true;
+		}
+		thread.ready.notify_all();
+	}
+	if (dropped and cn->refresh_rate_control)
+		cn->refresh_rate_control->on_drop();
+	if (dropped and cn->throttle_on_drop)
+		cn->pacer.delay_next_frame();
 
 	return VK_SUCCESS;
 }
@@ -556,11 +1427,21 @@ static void comp_wivrn_calc_frame_pacing(struct comp_target * ct,
 {
 	struct wivrn_comp_target * cn = (struct wivrn_comp_target *)ct;
 
+	// The compositor thread is created by monado
+	if (not cn->thread_policy_applied)
+	{
+		apply_thread_policy(thread_role::compositor);
+		cn->thread_policy_applied = true;
+	}
+
 	cn->pacer.predict(
 	        *out_wake_up_time_ns,
 	        *out_desired_present_time_ns,
 	        *out_present_slop_ns,
 	        *out_predicted_display_time_ns);
+	cn->predicted_wake_up_ns = *out_wake_up_time_ns;
+	cn->predicted_display_time_ns = *out_predicted_display_time_ns;
+	cn->cnx->set_wake_up_schedule(*out_wake_up_time_ns, cn->pacer.wake_up_interval(), *out_predicted_display_time_ns);
 	*out_frame_id = cn->current_frame_id++;
 }
 
@@ -577,7 +1458,10 @@ static void comp_wivrn_mark_timing_point(struct comp_target * ct,
 	switch (point)
 	{
 		case COMP_TARGET_TIMING_POINT_WAKE_UP:
+			cn->compositor_wakeup.add(cn->predicted_wake_up_ns, when_ns);
 			cn->cnx->dump_time("wake_up", frame_id, when_ns);
+			// The newest tracking samples arrived while the compositor was sleeping
+			cn->cnx->prefetch_poses(cn->predicted_display_time_ns);
 			break;
 		case COMP_TARGET_TIMING_POINT_BEGIN:
 			cn->cnx->dump_time("begin", frame_id, when_ns);
@@ -616,24 +1500,165 @@ static void comp_wivrn_destroy(struct comp_target * ct)
 static void comp_wivrn_info_gpu(struct comp_target * ct, int64_t frame_id, uint64_t gpu_start_ns, uint64_t gpu_end_ns, uint64_t when_ns)
 {
 	COMP_TRACE_MARKER();
+	struct wivrn_comp_target * cn = (struct wivrn_comp_target *)ct;
+
+	// Rendering of the compositor, the conversion follows on the same queue
+	cn->cnx->dump_time("gpu_render_begin", frame_id, gpu_start_ns);
+	cn->cnx->dump_time("gpu_render_end", frame_id, gpu_end_ns);
 }
 
-void wivrn_comp_target::on_feedback(const from_headset::feedback & feedback, const clock_offset & o)
+void wivrn_comp_target::on_feedback(const std::vector<from_headset::feedback> & batch, const clock_offset & o)
 {
 	if (not o)
 		return;
-	pacer.on_feedback(feedback, o);
-	if (not feedback.sent_to_decoder)
+	std::lock_guard lock(encoders_mutex);
+
+	std::vector<std::optional<bitrate_controller::frame_info>> infos;
+	std::vector<wivrn_pacer::feedback_sample> samples;
+	infos.reserve(batch.size());
+	samples.reserve(batch.size());
+	for (const auto & feedback: batch)
+	{
+		// The headset sends the feedback again each time it displays a frame again, which
+		// happens for every frame with half_rate: the timings are those of the first display
+		if (feedback.times_displayed > 1)
+			continue;
+		if (feedback.stream_index < encoders.size())
+			infos.push_back(encoders[feedback.stream_index]->GetFrameInfo(feedback.frame_index));
+		else
+			infos.emplace_back();
+		samples.push_back({&feedback, infos.back() ? &*infos.back() : nullptr});
+	}
+	pacer.on_feedback(samples, o);
+
+	for (const auto & [feedback_ptr, info]: samples)
+	{
+		const auto & feedback = *feedback_ptr;
+		if (feedback.stream_index >= encoders.size())
+			continue;
+		if (not feedback.sent_to_decoder or feedback.lost_slices)
+			encoders[feedback.stream_index]->FrameLost(feedback.frame_index);
+		if (feedback.lost_slices)
+			metrics::concealed_frames.add();
+		metrics::ecn_marked_shards.add(feedback.congestion_marks);
+
+		if (bitrate_control and info)
+		{
+			if (auto bitrates = bitrate_control->on_feedback(feedback, *info, o))
+			{
+				uint64_t total_bitrate = 0;
+				for (size_t i = 0; i < encoders.size(); ++i)
+				{
+					encoders[i]->SetBitrate((*bitrates)[i]);
+					total_bitrate += (*bitrates)[i];
+				}
+				metrics::bitrate.set(total_bitrate);
+			}
+		}
+
+		if (resolution_control)
+		{
+			if (auto factor = resolution_control->on_feedback(feedback, info))
+			{
+				metrics::resolution_scale.set(*factor);
+				resolution_changed = true;
+			}
+		}
+
+		if (refresh_rate_control)
+		{
+			if (auto rate = refresh_rate_control->on_feedback(feedback))
+				new_refresh_rate = *rate;
+		}
+	}
+}
+
+void wivrn_comp_target::on_frame_lost(uint8_t stream_index, uint64_t frame_index)
+{
+	std::lock_guard lock(encoders_mutex);
+	if (stream_index < encoders.size())
+		encoders[stream_index]->FrameLost(frame_index);
+}
+
+void wivrn_comp_target::set_limits(double bitrate, double resolution, float refresh_rate)
+{
+	std::lock_guard lock(encoders_mutex);
+	if (bitrate != bitrate_limit)
+	{
+		bitrate_limit = bitrate;
+		U_LOG_I("Bitrate limited to %d%% of the configured bitrate", int(bitrate * 100));
+		if (bitrate_control)
+			bitrate_control->set_limit(bitrate);
+		else
+			apply_fixed_bitrate_limit(this);
+	}
+
+	// Applied by the compositor thread, like the changes of the controllers
+	if (resolution != resolution_limit)
+	{
+		resolution_limit = resolution;
+		U_LOG_I("Resolution limited to %d%% of the configured resolution", int(resolution * 100));
+		if (resolution_control)
+		{
+			if (auto factor = resolution_control->set_max_factor(resolution))
+			{
+				metrics::resolution_scale.set(*factor);
+				resolution_changed = true;
+			}
+		}
+		else
+		{
+			metrics::resolution_scale.set(resolution);
+			resolution_changed = true;
+		}
+	}
+
+	if (refresh_rate != refresh_rate_limit)
+	{
+		refresh_rate_limit = refresh_rate;
+		float preferred = cnx->get_headset_info().preferred_refresh_rate;
+		if (refresh_rate_control)
+		{
+			if (auto rate = refresh_rate_control->set_max_rate(refresh_rate > 0 ? refresh_rate : preferred))
+				new_refresh_rate = *rate;
+		}
+		else
+			new_refresh_rate = refresh_rate > 0 ? std::min(refresh_rate, preferred) : preferred;
+	}
+}
+
+void wivrn_comp_target::on_nack(const from_headset::video_stream_nack & nack)
+{
+	std::lock_guard lock(encoders_mutex);
+	if (nack.stream_index >= encoders.size())
+		return;
+	encoders[nack.stream_index]->Retransmit(nack);
+}
+
+void wivrn_comp_target::set_idle(bool value)
+{
+	if (idle.exchange(value) == value)
+		return;
+	pacer.set_idle(value);
+	U_LOG_I("Video stream %s", value ? "idle" : "resumed");
+	try
+	{
+		cnx->send_control(to_headset::video_stream_idle{.idle = value});
+	}
+	catch (std::exception & e)
 	{
-		if (encoders.size() < feedback.stream_index)
-			return;
-		encoders[feedback.stream_index]->SyncNeeded();
+		U_LOG_W("Failed to send idle state: %s", e.what());
 	}
 }
 
 void wivrn_comp_target::reset_encoders()
 {
+	// The headset is told again if the stream is idle on the next frame
+	idle = false;
+	pacer.set_idle(false);
 	pacer.reset();
+	reset_quads = true;
+	std::lock_guard lock(encoders_mutex);
 	for (auto & encoder: encoders)
 	{
 		encoder->SyncNeeded();
@@ -643,7 +1668,12 @@ void wivrn_comp_target::reset_encoders()
 
 wivrn_comp_target::wivrn_comp_target(std::shared_ptr<xrt::drivers::wivrn::wivrn_session> cnx, struct comp_compositor * c, float fps) :
         comp_target{},
-        pacer(U_TIME_1S_IN_NS / fps),
+        half_rate(configuration::read_user_configuration().half_rate or configuration::read_user_configuration().motion_extrapolation),
+        motion_extrapolation(configuration::read_user_configuration().motion_extrapolation and cnx->has_capability(capability::motion_vectors)),
+        depth_stream(configuration::read_user_configuration().depth_stream and cnx->has_capability(capability::depth)),
+        quad_layers(configuration::read_user_configuration().quad_layers and cnx->has_capability(capability::quad_layers)),
+        bypass_compositor(configuration::read_user_configuration().bypass_compositor),
+        pacer(U_TIME_1S_IN_NS / (half_rate ? fps / 2 : fps)),
         cnx(cnx)
 {
 	check_ready = comp_wivrn_check_ready;
@@ -660,7 +1690,13 @@ wivrn_comp_target::wivrn_comp_target(std::shared_ptr<xrt::drivers::wivrn::wivrn_
 	init_post_vulkan = comp_wivrn_init_post_vulkan;
 	set_title = comp_wivrn_set_title;
 	flush = comp_wivrn_flush;
-	this->fps = fps;
+	// The headset keeps its refresh rate
+	this->fps = half_rate ? fps / 2 : fps;
 	desc.fps = fps;
+	desc.periods_per_frame = half_rate ? 2 : 1;
+	if (motion_extrapolation)
+		U_LOG_I("Motion extrapolation enabled, rendering at %.1f fps", this->fps);
+	else if (half_rate)
+		U_LOG_I("Half rate enabled, rendering at %.1f fps", this->fps);
 	this->c = c;
 }
@@ -23,16 +23,30 @@
 #include "wivrn_session.h"
 
 #include "main/comp_target.h"
+#include "util/comp_base.h"
 
+#include "encoder/depth_sampler.h"
+#include "encoder/quad_layers.h"
 #include "encoder/yuv_converter.h"
 #include "utils/wivrn_vk_bundle.h"
 #include "vk/allocation.h"
 
+#include "driver/bitrate_controller.h"
+#include "driver/refresh_rate_controller.h"
+#include "driver/resolution_controller.h"
 #include "driver/wivrn_pacer.h"
 #include "encoder/encoder_settings.h"
+#include "utils/application_watcher.h"
+#include "utils/file_watcher.h"
+#include "utils/thread_policy.h"
+#include <atomic>
 #include <list>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <optional>
+#include <set>
+#include <string>
 #include <vector>
 #include <vulkan/vulkan_raii.hpp>
 
@@ -52,28 +66,96 @@ struct pseudo_swapchain
 	{
 		image_allocation image;
 		vk::raii::ImageView image_view = nullptr;
+		// Only used without timeline semaphores
 		vk::raii::Fence fence = nullptr;
 		vk::raii::CommandBuffer command_buffer = nullptr;
 		yuv_converter yuv;
+		// Only used with the depth stream
+		depth_sampler depth;
+		bool has_depth = false;
+		// Only used with quad_layers
+		quad_layer_copier quads;
+		// Timestamps around the conversion and copies, null if the queue has no timestamps:
+		// begin, end of the conversion, end of the copy of each encoder, end
+		vk::raii::QueryPool timestamps = nullptr;
+		// Queries written for the last frame, 0 if none
+		uint32_t timestamp_count = 0;
+		// The conversion resources (yuv, depth, quads) are created on the first present of the
+		// image, and released once it was not used for idle_image_release
+		bool prepared = false;
+		int64_t last_used_ns = 0;
 		status_type status; // bitmask of consumer status, index 0 for acquired, the rest for each encoder
-		int64_t frame_index;
+		// Frame of the last submitted commands for this image
+		int64_t frame_index = -1;
 		to_headset::video_stream_data_shard::view_info_t view_info{};
+		// Encoded even if it is static, decided when the frame is presented for all the encoders
+		bool refresh = true;
 	};
 	std::unique_ptr<item[]> images;
-	// Incremented and notified when a new image is available for encoders
-	status_type present_gen;
+	// Parameters of the conversion resources of the images
+	vk::Format format;
+	std::optional<vk::Rect2D> background;
+	// Timeline semaphore, signaled with frame_index + 1 when the image of a frame is ready.
+	// Null if timeline semaphores are not supported, the fence of each image is used instead.
+	vk::raii::Semaphore present_semaphore = nullptr;
+	// present_semaphore can be exported to the encoders
+	bool present_semaphore_exportable = false;
+	// Nanoseconds per timestamp tick
+	float timestamp_period = 0;
+	// Encoders whose copy is timed, the others are included in the last timestamp
+	static constexpr uint32_t max_timed_copies = 8;
+
+	// GPU timestamp and CLOCK_MONOTONIC at the same time, to place the GPU events in the timing dump.
+	// Only used by the first encoder thread, calibrated is false without VK_EXT_calibrated_timestamps
+	bool calibrated = false;
+	uint64_t calibration_gpu = 0;
+	int64_t calibration_cpu_ns = 0;
+	int64_t last_calibration_ns = 0;
 };
 
 struct wivrn_comp_target : public comp_target
 {
+	// Frames are rendered at half the refresh rate, the headset reprojects them for the other periods
+	bool half_rate;
+	// With half_rate, the headset also moves the frames along their motion
+	bool motion_extrapolation;
+	// Send the depth layer of the application, read when the headset connects
+	bool depth_stream;
+	// Send the quad layers separately instead of compositing them, read when the headset connects
+	bool quad_layers;
+	// Convert a single opaque projection layer without compositing it
+	bool bypass_compositor;
 	wivrn_pacer pacer;
 
 	std::optional<wivrn_vk_bundle> wivrn_bundle;
 	vk::raii::CommandPool command_pool = nullptr;
+	// Shared by the yuv converters of all the images, kept when they are recreated
+	std::shared_ptr<yuv_pipeline> conversion_pipeline;
 
+	// Rate of the rendered frames
 	float fps;
 
 	int64_t current_frame_id = 0;
+	// Last frame encoded even if static, only accessed from the compositor thread
+	int64_t last_refresh_ns = 0;
+
+	// Only accessed from the compositor thread
+	bool thread_policy_applied = false;
+	uint64_t predicted_wake_up_ns = 0;
+	uint64_t predicted_display_time_ns = 0;
+	// Quad layers removed from the composited layers for the current frame
+	std::vector<quad_layer_copier::layer> quads;
+	int64_t quads_frame_id = -1;
+	int64_t last_quad_copy_ns = 0;
+	// Projection layer converted directly for the current frame, removed from the composited layers
+	std::optional<comp_layer> bypass_layer;
+	int64_t bypass_frame_id = -1;
+
+	// Only accessed from the first encoder thread
+	quad_layer_sender quad_sender;
+	// Set when the headset reconnects, it lost its layers
+	std::atomic<bool> reset_quads = false;
+	wakeup_latency compositor_wakeup{"Compositor", metrics::compositor_wakeup_latency};
 
 	pseudo_swapchain psc;
 
@@ -84,20 +166,29 @@ struct wivrn_comp_target : public comp_target
 
 	struct encoder_thread
 	{
+		static constexpr int no_image = -1;
+		static constexpr int stop = -2;
+
 		int index;
 		os_thread_helper thread;
-		pseudo_swapchain::status_type & gen;
-
-		encoder_thread(pseudo_swapchain::status_type & gen) :
-		        gen(gen)
+		// Last presented image not yet taken by the thread, older ones are dropped
+		std::atomic<int> ready = no_image;
+		// When ready was last set
+		std::atomic<int64_t> ready_ns = 0;
+		// Frames dropped since the last log
+		std::atomic<int> dropped = 0;
+		// Streams encoded by the thread
+		std::vector<uint8_t> streams;
+
+		encoder_thread()
 		{
 			os_thread_helper_init(&thread);
 		}
 		~encoder_thread()
 		{
 			os_thread_helper_signal_stop(&thread);
-			gen += 1;
-			gen.notify_all();
+			ready = stop;
+			ready.notify_all();
 			os_thread_helper_wait_locked(&thread);
 			os_thread_helper_destroy(&thread);
 		}
@@ -105,15 +196,56 @@ struct wivrn_comp_target : public comp_target
 	std::vector<encoder_settings> settings;
 	to_headset::video_stream_description desc{};
 	std::list<encoder_thread> encoder_threads;
+	// Protects encoders and the controllers, used by the network thread while the compositor may recreate them
+	std::mutex encoders_mutex;
 	std::vector<std::shared_ptr<VideoEncoder>> encoders;
+	std::unique_ptr<bitrate_controller> bitrate_control;
+	// Kept when the encoders are recreated, so that the factor survives resolution changes
+	std::unique_ptr<resolution_controller> resolution_control;
+	// Set by the network thread when the resolution factor changed, applied on the next acquire
+	std::atomic<bool> resolution_changed = false;
+	// Created when the encoders are first created, kept afterwards
+	std::unique_ptr<refresh_rate_controller> refresh_rate_control;
+	// Set by the network thread to the refresh rate to switch to, 0 if there is none
+	std::atomic<float> new_refresh_rate = 0;
+	// Size requested by the compositor before scaling, to compute the settings again when the configuration changes
+	uint32_t unscaled_width = 0;
+	uint32_t unscaled_height = 0;
+	std::optional<file_watcher> config_watcher;
+	// Selects the configuration profile of the running application
+	std::optional<application_watcher> app_watcher;
+	// Refresh rate of the active profile applied to the headset, 0 if there is none
+	float profile_refresh_rate = 0;
+	// The images and encoders are recreated on the next acquire, only accessed from the compositor thread
+	bool recreate_images = false;
+	// Backends that failed for each stream index, replaced when the settings are computed, only accessed from the compositor thread
+	std::map<size_t, std::set<std::string>> failed_encoders;
+	// Set by an encoder thread to the index of a stream whose encoder keeps failing, -1 if there is none
+	std::atomic<int> failing_stream = -1;
+	// Slow down the compositor when a frame is dropped instead of only encoding the newest one
+	bool throttle_on_drop = false;
+	// No image is being sent to the headset, see to_headset::video_stream_idle
+	std::atomic<bool> idle = false;
+
+	// See set_limits, protected by encoders_mutex
+	double bitrate_limit = 1;
+	double resolution_limit = 1;
+	float refresh_rate_limit = 0;
 
 	std::shared_ptr<xrt::drivers::wivrn::wivrn_session> cnx;
 
 	wivrn_comp_target(std::shared_ptr<xrt::drivers::wivrn::wivrn_session> cnx, struct comp_compositor * c, float fps);
 	~wivrn_comp_target();
 
-	void on_feedback(const from_headset::feedback &, const clock_offset &);
+	void on_feedback(const std::vector<from_headset::feedback> &, const clock_offset &);
+	// The feedback of a lost frame was not received
+	void on_frame_lost(uint8_t stream_index, uint64_t frame_index);
+	void on_nack(const from_headset::video_stream_nack &);
+	// Fractions of the configured bitrate and resolution, and highest refresh rate (0 for no limit),
+	// lowered when the headset is throttled
+	void set_limits(double bitrate, double resolution, float refresh_rate);
 	void reset_encoders();
+	void set_idle(bool idle);
 };
 
 } // namespace xrt::drivers::wivrn
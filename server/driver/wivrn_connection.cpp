@@ -20,13 +20,39 @@
 #include "wivrn_connection.h"
 #include "configuration.h"
 #include "util/u_logging.h"
+#include <algorithm>
 #include <arpa/inet.h>
+#include <cinttypes>
 #include <poll.h>
+#include <thread>
 
 using namespace std::chrono_literals;
 
+// Link probe: bursts of packets sent as fast as possible, spaced so that the
+// queues drain between them. About 270 kB in total.
+static const int probe_bursts = 4;
+static const int probe_burst_packets = 48;
+static const auto probe_burst_interval = 10ms;
+static const auto probe_timeout = 1s;
+
+// Bounds the time shards wait in the kernel when the link slows down: senders block once it
+// is full, and the encoders drop the shards of the frames that are past their display time.
+// About 80ms at 100Mbit/s.
+static const int stream_send_buffer_size = 1024 * 1024;
+
+// ECN capable transport codepoint of L4S, in the low bits of the type of service
+static const int ect_1 = 0x01;
+
+// Optional features implemented by the server, see capability
+static const uint64_t server_capabilities =
+        capability_bit(capability::parity_shards) |
+        capability_bit(capability::motion_vectors) |
+        capability_bit(capability::depth) |
+        capability_bit(capability::quad_layers) |
+        capability_bit(capability::microphone_dtx);
+
 wivrn_connection::wivrn_connection(TCP && tcp) :
-        control(std::move(tcp)), stream(-1)
+        control(std::move(tcp)), stream(-1), low_latency(-1)
 {
 	init();
 }
@@ -34,7 +60,17 @@ wivrn_connection::wivrn_connection(TCP && tcp) :
 void wivrn_connection::init()
 {
 	active = false;
+	link.reset();
+#ifdef WIVRN_USE_LIBURING
+	uring.reset();
+	uring_failed = false;
+#endif
 	stream = -1;
+	low_latency = -1;
+	video.clear();
+
+	// Control packets are sent from the session and encoder threads, which must not block on the socket
+	control.start_writer();
 
 	sockaddr_in6 server_address;
 	socklen_t len = sizeof(server_address);
@@ -54,17 +90,35 @@ void wivrn_connection::init()
 	// Wait for client to send handshake
 	auto timeout = std::chrono::steady_clock::now() + std::chrono::seconds(10);
 
-	if (configuration::read_user_configuration().tcp_only)
+	auto config = configuration::read_user_configuration();
+	bool use_low_latency = config.low_latency_channel;
+	stream_tos = IPTOS_DSCP_EF | (config.ecn ? ect_1 : 0);
+	int video_sockets = std::clamp(config.video_sockets, 1, to_headset::handshake::max_video_sockets + 1) - 1;
+	if (config.tcp_only)
 	{
 		port = -1;
+		video_sockets = 0;
 	}
 	else
 	{
 		stream = decltype(stream)();
+		if (use_low_latency or video_sockets > 0)
+		{
+			try
+			{
+				stream.set_reuse_port();
+			}
+			catch (std::exception & e)
+			{
+				U_LOG_I("Cannot share stream port, disabling low latency and video sockets: %s", e.what());
+				use_low_latency = false;
+				video_sockets = 0;
+			}
+		}
 		stream.bind(port);
 	}
 
-	control.send(to_headset::handshake{.stream_port = port});
+	control.send(to_headset::handshake{.stream_port = port, .low_latency_port = -1, .capabilities = server_capabilities});
 
 	while (true)
 	{
@@ -92,7 +146,7 @@ void wivrn_connection::init()
 				int client_port = htons(peer_addr.sin6_port);
 				stream.connect(peer_addr.sin6_addr, client_port);
 				U_LOG_D("Stream socket connected, client port %d", client_port);
-				stream.set_send_buffer_size(1024 * 1024 * 5);
+				stream.set_send_buffer_size(stream_send_buffer_size);
 				break;
 			}
 		}
@@ -106,6 +160,8 @@ void wivrn_connection::init()
 				{
 					stream = decltype(stream)(-1);
 					port = -1;
+					use_low_latency = false;
+					video_sockets = 0;
 					U_LOG_I("Using TCP only");
 					break;
 				}
@@ -121,23 +177,308 @@ void wivrn_connection::init()
 			throw std::runtime_error("No handshake received from client");
 		}
 	}
-	control.send(to_headset::handshake{.stream_port = port});
+	if (use_low_latency)
+	{
+		// The stream socket is connected at this point, datagrams from other
+		// client ports are delivered to this one
+		low_latency = decltype(low_latency)();
+		low_latency.set_reuse_port();
+		low_latency.bind(port);
+	}
+	else if (video_sockets > 0)
+		bind_video_socket(port);
+
+	control.send(to_headset::handshake{
+	        .stream_port = port,
+	        .low_latency_port = use_low_latency ? port : -1,
+	        .capabilities = server_capabilities,
+	        .video_sockets = video_sockets,
+	});
 
 	try
 	{
-		// Set Expedited forwarding https://datatracker.ietf.org/doc/html/rfc3246
+		// Set Expedited forwarding https://datatracker.ietf.org/doc/html/rfc3246, and ECT(1) with ecn
 		if (stream)
-			stream.set_tos(IPTOS_DSCP_EF);
+			stream.set_tos(stream_tos);
 	}
 	catch (std::exception & e)
 	{
 		U_LOG_I("Failed to set IP ToS to Expedited Forwarding: %s", e.what());
 	}
+
+	try
+	{
+		// Separates the time shards wait in the network stack from the network latency
+		if (stream)
+			stream.enable_send_timestamps();
+	}
+	catch (std::exception & e)
+	{
+		U_LOG_I("Failed to enable send timestamps: %s", e.what());
+	}
+
+	if (low_latency)
+		init_low_latency(client_address, video_sockets > 0 ? port : -1);
+	if (video_sockets > 0)
+		init_video_sockets(client_address, port, video_sockets);
+	if (stream)
+		probe_link();
 	active = true;
 }
 
+void wivrn_connection::probe_link()
+{
+	to_headset::link_probe probe{
+	        .burst_count = probe_bursts,
+	        .count = probe_burst_packets,
+	        .padding = std::vector<uint8_t>(to_headset::video_stream_data_shard::max_payload_size),
+	};
+
+	auto last_sent = std::chrono::steady_clock::now();
+	for (int burst = 0; burst < probe_bursts; ++burst)
+	{
+		if (burst)
+			std::this_thread::sleep_for(probe_burst_interval);
+		probe.burst = burst;
+		for (int i = 0; i < probe_burst_packets; ++i)
+		{
+			probe.index = i;
+			stream.send(probe);
+		}
+		last_sent = std::chrono::steady_clock::now();
+	}
+
+	std::optional<from_headset::link_probe_result> result;
+	auto timeout = last_sent + probe_timeout;
+	while (not result and std::chrono::steady_clock::now() < timeout)
+	{
+		pollfd fds{};
+		fds.events = POLLIN;
+		fds.fd = control.get_fd();
+
+		int r = ::poll(&fds, 1, 100);
+		if (r < 0)
+			throw std::system_error(errno, std::system_category());
+		if (fds.revents & (POLLHUP | POLLERR))
+			throw std::runtime_error("Error on control socket");
+		if (not(fds.revents & POLLIN))
+			continue;
+
+		auto packet = control.receive();
+		if (not packet)
+			continue;
+		if (auto p = std::get_if<from_headset::link_probe_result>(&*packet))
+			result = std::move(*p);
+		else
+			throw std::runtime_error("Unexpected packet during link probe");
+	}
+	auto received = std::chrono::steady_clock::now();
+
+	if (not result)
+	{
+		U_LOG_W("No link probe result from the headset");
+		return;
+	}
+
+	// Bursts smaller than half of the packets were too disturbed to be used
+	std::vector<double> capacities;
+	size_t received_packets = 0;
+	for (const auto & burst: result->bursts)
+	{
+		received_packets += burst.received;
+		if (burst.received >= probe_burst_packets / 2 and burst.dispersion > 0)
+			capacities.push_back(burst.bytes * 8 / (burst.dispersion * 1e-9));
+	}
+	if (capacities.empty())
+	{
+		U_LOG_W("Link probe failed, %zu packets received", received_packets);
+		return;
+	}
+
+	std::ranges::sort(capacities);
+	link = link_estimate{
+	        .capacity = uint64_t(capacities[capacities.size() / 2]),
+	        .rtt = std::max(std::chrono::nanoseconds(0), received - last_sent - std::chrono::nanoseconds(result->reply_delay)),
+	        .loss = 1 - float(received_packets) / (probe_bursts * probe_burst_packets),
+	};
+	U_LOG_I("Link probe: %.1f Mbit/s, round trip time %.1fms, %.1f%% loss",
+	        link->capacity * 1e-6,
+	        link->rtt.count() * 1e-6,
+	        link->loss * 100);
+}
+
+void wivrn_connection::init_low_latency(const sockaddr_in6 & client_address, int video_port)
+{
+	// Wait for the client to send a handshake on its low latency socket
+	auto timeout = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+	while (std::chrono::steady_clock::now() < timeout)
+	{
+		pollfd fds{};
+		fds.events = POLLIN;
+		fds.fd = low_latency.get_fd();
+
+		int r = ::poll(&fds, 1, 100);
+		if (r < 0)
+			throw std::system_error(errno, std::system_category());
+
+		if (fds.revents & POLLIN)
+		{
+			auto [packet, peer_addr] = low_latency.receive_from_raw();
+			if (memcmp(&peer_addr.sin6_addr, &client_address.sin6_addr, sizeof(peer_addr.sin6_addr)) == 0)
+			{
+				int client_port = htons(peer_addr.sin6_port);
+				low_latency.connect(peer_addr.sin6_addr, client_port);
+				// Keep the queue short, packets are small and outdated quickly
+				low_latency.set_send_buffer_size(64 * 1024);
+				try
+				{
+					low_latency.set_tos(IPTOS_DSCP_EF);
+				}
+				catch (std::exception & e)
+				{
+					U_LOG_I("Failed to set IP ToS to Expedited Forwarding: %s", e.what());
+				}
+				// The headset starts with its video sockets once this is confirmed
+				if (video_port > 0)
+					bind_video_socket(video_port);
+				low_latency.send(to_headset::handshake{.stream_port = -1, .low_latency_port = -1, .capabilities = server_capabilities});
+				U_LOG_D("Low latency socket connected, client port %d", client_port);
+				return;
+			}
+		}
+	}
+
+	U_LOG_I("No handshake received on low latency socket, disabling it");
+	low_latency = decltype(low_latency)(-1);
+}
+
+void wivrn_connection::bind_video_socket(int port)
+{
+	auto & socket = video.emplace_back();
+	socket.set_reuse_port();
+	socket.bind(port);
+}
+
+void wivrn_connection::init_video_sockets(const sockaddr_in6 & client_address, int port, int count)
+{
+	// Sockets are connected one at a time, so that the headset handshake on a new port
+	// is received by the only unconnected socket
+	for (int i = 0; i < count; ++i)
+	{
+		if (video.size() == size_t(i))
+			bind_video_socket(port);
+
+		bool connected = false;
+		auto timeout = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+		while (not connected and std::chrono::steady_clock::now() < timeout)
+		{
+			pollfd fds{};
+			fds.events = POLLIN;
+			fds.fd = video[i].get_fd();
+
+			int r = ::poll(&fds, 1, 100);
+			if (r < 0)
+				throw std::system_error(errno, std::system_category());
+
+			if (not(fds.revents & POLLIN))
+				continue;
+
+			auto [packet, peer_addr] = video[i].receive_from_raw();
+			if (memcmp(&peer_addr.sin6_addr, &client_address.sin6_addr, sizeof(peer_addr.sin6_addr)) != 0)
+				continue;
+
+			int client_port = htons(peer_addr.sin6_port);
+			video[i].connect(peer_addr.sin6_addr, client_port);
+			video[i].set_send_buffer_size(stream_send_buffer_size);
+			try
+			{
+				video[i].set_tos(stream_tos);
+			}
+			catch (std::exception & e)
+			{
+				U_LOG_I("Failed to set IP ToS to Expedited Forwarding: %s", e.what());
+			}
+			try
+			{
+				video[i].enable_send_timestamps();
+			}
+			catch (std::exception & e)
+			{
+				U_LOG_I("Failed to enable send timestamps: %s", e.what());
+			}
+			U_LOG_D("Video socket %d connected, client port %d", i, client_port);
+			connected = true;
+		}
+
+		if (not connected)
+		{
+			U_LOG_I("No handshake received on video socket %d, using %d video sockets", i, i + 1);
+			video.erase(video.begin() + i, video.end());
+			return;
+		}
+
+		if (i + 1 < count)
+			bind_video_socket(port);
+		video[i].send(to_headset::handshake{.stream_port = -1, .low_latency_port = -1, .capabilities = server_capabilities});
+	}
+	U_LOG_I("Using %d video sockets", count + 1);
+}
+
+#ifdef WIVRN_USE_LIBURING
+int wivrn_connection::poll_uring(std::vector<deserialization_packet> & packets, int timeout)
+{
+	if (not uring)
+	{
+		try
+		{
+			std::vector<int> fds{control.get_fd()};
+			if (stream)
+				fds.push_back(stream.get_fd());
+			if (low_latency)
+				fds.push_back(low_latency.get_fd());
+			uring = std::make_unique<wivrn_uring>(std::move(fds));
+		}
+		catch (std::exception & e)
+		{
+			U_LOG_I("io_uring not available, using poll: %s", e.what());
+			uring_failed = true;
+			return -1;
+		}
+	}
+
+	try
+	{
+		return uring->receive(timeout, [&](size_t index, std::span<const uint8_t> data) {
+			if (index == 0)
+				control.feed_raw(data, packets);
+			else if (index == 1)
+				stream.feed_raw(data, packets);
+			else
+				low_latency.feed_raw(data, packets);
+		});
+	}
+	catch (std::system_error & e)
+	{
+		// Multishot recv requires Linux 6.0
+		if (e.code().value() != EINVAL)
+			throw;
+		U_LOG_I("io_uring multishot receive not supported, using poll");
+		uring.reset();
+		uring_failed = true;
+		return -1;
+	}
+}
+#endif
+
 void wivrn_connection::reset(TCP && tcp)
 {
+#ifdef WIVRN_USE_LIBURING
+	// Must not outlive the sockets it receives from
+	uring.reset();
+#endif
+	auto stats = control.get_writer_statistics();
+	if (stats.overflows)
+		U_LOG_W("Control socket queue was full %" PRIu64 " times for %" PRIu64 " packets", stats.overflows, stats.packets);
 	control = std::move(tcp);
 	init();
 }
@@ -19,20 +19,69 @@
 
 #pragma once
 
+#include "wivrn_config.h"
 #include "wivrn_packets.h"
 #include "wivrn_sockets.h"
+
+#include "os/os_time.h"
+
+#include <chrono>
+#include <memory>
 #include <optional>
 #include <poll.h>
 
+#ifdef WIVRN_USE_LIBURING
+#include "wivrn_uring.h"
+#endif
+
 using namespace xrt::drivers::wivrn;
 
+// Measured by the link probe when the connection is established
+struct link_estimate
+{
+	// bit/s
+	uint64_t capacity;
+	std::chrono::nanoseconds rtt;
+	// Fraction of the probe packets lost
+	float loss;
+};
+
 class wivrn_connection
 {
 	typed_socket<TCP, from_headset::packets, to_headset::packets> control;
 	typed_socket<UDP, from_headset::packets, to_headset::packets> stream;
+	// Shares the port of the stream socket, for packets in low_latency_packet
+	typed_socket<UDP, from_headset::packets, to_headset::packets> low_latency;
+	// Share the port of the stream socket, connected to other ports of the headset.
+	// Only used for sending, the headset does not send on them after the handshake.
+	std::vector<typed_socket<UDP, from_headset::packets, to_headset::packets>> video;
 	std::atomic<bool> active = false;
+	std::optional<link_estimate> link;
+	// Type of service of the stream and video sockets, with the ECN bits
+	int stream_tos = 0;
+
+#ifdef WIVRN_USE_LIBURING
+	// Created on the first call to poll, so that poll_control does not compete with it
+	std::unique_ptr<wivrn_uring> uring;
+	bool uring_failed = false;
+	// Returns -1 if io_uring cannot be used
+	int poll_uring(std::vector<deserialization_packet> & packets, int timeout);
+#endif
 
 	void init();
+	// Binds the first video socket before confirming the low latency one if video_port > 0
+	void init_low_latency(const sockaddr_in6 & client_address, int video_port);
+	// Unconnected, the headset handshake on its next video socket is received by this one
+	void bind_video_socket(int port);
+	void init_video_sockets(const sockaddr_in6 & client_address, int port, int count);
+	void probe_link();
+
+	// Video stream items are spread over the stream socket and the video sockets
+	typed_socket<UDP, from_headset::packets, to_headset::packets> & video_socket(uint8_t stream_item)
+	{
+		size_t index = stream_item % (video.size() + 1);
+		return index == 0 ? stream : video[index - 1];
+	}
 
 public:
 	wivrn_connection(TCP && tcp);
@@ -45,6 +94,12 @@ public:
 	}
 	void reset(TCP && tcp);
 
+	// Unset if the probe failed or the connection is TCP only
+	const std::optional<link_estimate> & get_link_estimate() const
+	{
+		return link;
+	}
+
 	template <typename T>
 	void send_control(T && packet)
 	{
@@ -64,6 +119,14 @@ public:
 	{
 		try
 		{
+			if constexpr (low_latency_packet<std::decay_t<T>>)
+			{
+				if (active and low_latency)
+				{
+					low_latency.send(std::forward<T>(packet));
+					return;
+				}
+			}
 			if (active and stream)
 				stream.send(std::forward<T>(packet));
 			else
@@ -76,39 +139,201 @@ public:
 		}
 	}
 
+	// Queue a packet on the stream socket, it is sent on the next call to flush_stream
+	template <typename T>
+	void queue_stream(T && packet)
+	{
+		try
+		{
+			if (active and stream)
+				stream.queue(std::forward<T>(packet));
+			else
+				control.send(std::forward<T>(packet));
+		}
+		catch (...)
+		{
+			active = false;
+			throw;
+		}
+	}
+
+	template <typename T>
+	void queue_stream_raw(std::span<uint8_t> header, std::span<uint8_t> payload)
+	{
+		try
+		{
+			if (active and stream)
+				stream.queue_raw<T>(header, payload);
+			else
+			{
+				control.queue_raw<T>(header, payload);
+				control.flush();
+			}
+		}
+		catch (...)
+		{
+			active = false;
+			throw;
+		}
+	}
+
+	void flush_stream()
+	{
+		try
+		{
+			if (active and stream)
+				stream.flush();
+		}
+		catch (...)
+		{
+			active = false;
+			throw;
+		}
+	}
+
+	// Serialized video_stream_data_shard, sent on the socket of the stream item on the next call to flush_video
+	void queue_video_shard(uint8_t stream_item, std::span<uint8_t> header, std::span<uint8_t> payload)
+	{
+		try
+		{
+			if (active and stream)
+				video_socket(stream_item).queue_raw<to_headset::video_stream_data_shard>(header, payload);
+			else
+			{
+				control.queue_raw<to_headset::video_stream_data_shard>(header, payload);
+				control.flush();
+			}
+		}
+		catch (...)
+		{
+			active = false;
+			throw;
+		}
+	}
+
+	void queue_parity_shard(const to_headset::video_stream_parity_shard & shard)
+	{
+		try
+		{
+			if (active and stream)
+				video_socket(shard.stream_item_idx).queue(shard);
+			else
+				control.send(shard);
+		}
+		catch (...)
+		{
+			active = false;
+			throw;
+		}
+	}
+
+	// Packets are queued per thread: the ones of a stream item must be flushed
+	// before the calling thread queues packets for another one
+	void flush_video(uint8_t stream_item)
+	{
+		try
+		{
+			if (active and stream)
+				video_socket(stream_item).flush();
+		}
+		catch (...)
+		{
+			active = false;
+			throw;
+		}
+	}
+
+	// Sequence number of the last datagram sent by flush_video from the calling thread,
+	// if send timestamps are available
+	std::optional<uint32_t> last_video_datagram(uint8_t stream_item)
+	{
+		if (active and stream and video_socket(stream_item).has_send_timestamps())
+			return UDP::last_sent_sequence();
+		return std::nullopt;
+	}
+
+	std::optional<int64_t> video_send_time(uint8_t stream_item, uint32_t datagram)
+	{
+		if (active and stream)
+			return video_socket(stream_item).send_time(datagram);
+		return std::nullopt;
+	}
+
 	std::optional<from_headset::packets> poll_control(int timeout);
 
+	// Packets are given to visitor.ingest if it exists, before being deserialized:
+	// it returns true if it read the packet, which is then not visited.
+	// Packets without a kernel receive time get the time they were polled.
 	template <typename T>
 	int poll(T && visitor, int timeout)
 	{
-		pollfd fds[2] = {};
+		auto dispatch = [&](deserialization_packet & packet, int64_t now) {
+			if constexpr (requires { visitor.ingest(packet); })
+			{
+				if (not packet.receive_time())
+					packet.set_receive_time(now);
+				if (visitor.ingest(packet))
+					return;
+			}
+			std::visit(std::forward<T>(visitor), packet.deserialize<from_headset::packets>());
+		};
+
+#ifdef WIVRN_USE_LIBURING
+		if (not uring_failed)
+		{
+			thread_local std::vector<deserialization_packet> packets;
+			packets.clear();
+			int r = poll_uring(packets, timeout);
+			int64_t now = os_monotonic_get_ns();
+			for (auto & packet: packets)
+				dispatch(packet, now);
+			if (r >= 0)
+				return r;
+		}
+#endif
+		pollfd fds[3] = {};
 		fds[0].events = POLLIN;
 		fds[0].fd = stream.get_fd();
 		fds[1].events = POLLIN;
 		fds[1].fd = control.get_fd();
+		fds[2].events = POLLIN;
+		fds[2].fd = low_latency.get_fd();
 
 		int r = ::poll(fds, std::size(fds), timeout);
 		if (r < 0)
 			throw std::system_error(errno, std::system_category());
 
-		if (fds[0].revents & (POLLHUP | POLLERR))
+		// Pending send timestamps are also reported as errors
+		if (fds[0].revents & POLLHUP or (fds[0].revents & POLLERR and not stream.read_error_queue()))
 			throw std::runtime_error("Error on stream socket");
 
 		if (fds[1].revents & (POLLHUP | POLLERR))
 			throw std::runtime_error("Error on control socket");
 
+		if (fds[2].revents & (POLLHUP | POLLERR))
+			throw std::runtime_error("Error on low latency socket");
+
+		int64_t now = os_monotonic_get_ns();
+
+		if (fds[2].revents & POLLIN)
+		{
+			auto packet = low_latency.receive_raw();
+			if (not packet.empty())
+				dispatch(packet, now);
+		}
+
 		if (fds[0].revents & POLLIN)
 		{
-			auto packet = stream.receive();
-			if (packet)
-				std::visit(std::forward<T>(visitor), std::move(*packet));
+			auto packet = stream.receive_raw();
+			if (not packet.empty())
+				dispatch(packet, now);
 		}
 
 		if (fds[1].revents & POLLIN)
 		{
-			auto packet = control.receive();
-			if (packet)
-				std::visit(std::forward<T>(visitor), std::move(*packet));
+			auto packet = control.receive_raw();
+			if (not packet.empty())
+				dispatch(packet, now);
 		}
 		return r;
 	}
@@ -18,6 +18,8 @@
  */
 
 #include "wivrn_controller.h"
+#include "configuration.h"
+#include "wivrn_quantization.h"
 
 #include "util/u_logging.h"
 #include <stdio.h>
@@ -159,6 +161,11 @@ wivrn_controller::wivrn_controller(int hand_id,
 {
 	xrt_device * base = this;
 
+	const auto config = configuration::read_user_configuration();
+	grip.set_predictor(config.prediction.controllers);
+	aim.set_predictor(config.prediction.controllers);
+	joints.set_predictor(config.prediction.hands);
+
 	base->destroy = wivrn_controller_destroy;
 	base->get_tracked_pose = wivrn_controller_get_tracked_pose;
 	base->get_hand_tracking = wivrn_controller_get_hand_tracking;
@@ -258,7 +265,7 @@ void wivrn_controller::set_inputs(const from_headset::inputs & inputs, const clo
 	std::lock_guard lock{mutex};
 	for (const auto & input: inputs.values)
 	{
-		set_inputs(input.id, input.value, input.last_change_time ? clock_offset.from_headset(input.last_change_time) : 0);
+		set_inputs(input.id, xrt::drivers::wivrn::unpack_input(input.value), input.last_change_time ? clock_offset.from_headset(input.last_change_time) : 0);
 	}
 }
 
@@ -329,7 +336,7 @@ xrt_space_relation wivrn_controller::get_tracked_pose(xrt_input_name name, uint6
 			U_LOG_W("Unknown input name requested");
 			return {};
 	}
-	cnx->add_predict_offset(extrapolation_time);
+	cnx->add_hand_predict_offset(extrapolation_time);
 	return res;
 }
 
@@ -340,8 +347,8 @@ std::pair<xrt_hand_joint_set, uint64_t> wivrn_controller::get_hand_tracking(xrt_
 		case XRT_INPUT_GENERIC_HAND_TRACKING_LEFT:
 		case XRT_INPUT_GENERIC_HAND_TRACKING_RIGHT: {
 			auto [extrapolation_time, data] = joints.get_at(desired_timestamp_ns);
-			cnx->add_predict_offset(extrapolation_time);
-			return {data, desired_timestamp_ns};
+			cnx->add_hand_predict_offset(extrapolation_time);
+			return {data.joint_set(), desired_timestamp_ns};
 		}
 
 		default:
@@ -350,10 +357,17 @@ std::pair<xrt_hand_joint_set, uint64_t> wivrn_controller::get_hand_tracking(xrt_
 	}
 }
 
-void wivrn_controller::update_tracking(const from_headset::tracking & tracking, const clock_offset & offset)
+void wivrn_controller::prefetch(uint64_t at_timestamp_ns)
+{
+	grip.get_at(at_timestamp_ns);
+	aim.get_at(at_timestamp_ns);
+	joints.get_at(at_timestamp_ns);
+}
+
+void wivrn_controller::register_tracking(tracking_ingest & ingest)
 {
-	aim.update_tracking(tracking, offset);
-	grip.update_tracking(tracking, offset);
+	ingest.add(aim);
+	ingest.add(grip);
 }
 
 void wivrn_controller::update_hand_tracking(const from_headset::hand_tracking & tracking, const clock_offset & offset)
@@ -368,11 +382,17 @@ void wivrn_controller::set_output(xrt_output_name name, const xrt_output_value *
 
 	try
 	{
-		cnx->send_stream(to_headset::haptics{
+		// The application applies haptics while it renders the frame that shows their cause
+		to_headset::haptics packet{
 		        .id = id,
 		        .duration = std::chrono::nanoseconds(value->vibration.duration_ns),
 		        .frequency = value->vibration.frequency,
-		        .amplitude = value->vibration.amplitude});
+		        .amplitude = value->vibration.amplitude,
+		        .start = cnx->headset_display_time(),
+		        .sequence = cnx->next_haptics_sequence(),
+		};
+		cnx->send_stream(packet);
+		cnx->send_stream(packet);
 	}
 	catch (...)
 	{
@@ -54,12 +54,15 @@ public:
 
 	xrt_space_relation get_tracked_pose(xrt_input_name name, uint64_t at_timestamp_ns);
 	std::pair<xrt_hand_joint_set, uint64_t> get_hand_tracking(xrt_input_name name, uint64_t desired_timestamp_ns);
+	// Computes the poses and joints at the given time, so that the next queries for it are served from the history cache
+	void prefetch(uint64_t at_timestamp_ns);
 
 	void set_output(xrt_output_name name, const xrt_output_value * value);
 
 	void set_inputs(const from_headset::inputs &, const clock_offset &);
 
-	void update_tracking(const from_headset::tracking &, const clock_offset &);
+	// Tracking packets are added to the grip and aim poses by the session
+	void register_tracking(tracking_ingest &);
 	void update_hand_tracking(const from_headset::hand_tracking &, const clock_offset &);
 
 private:
@@ -25,11 +25,15 @@
 #include "util/u_device.h"
 #include "util/u_distortion_mesh.h"
 #include "util/u_logging.h"
+#include "util/u_visibility_mask.h"
 
+#include "math/m_eigen_interop.hpp"
 #include "xrt_cast.h"
 #include <algorithm>
 #include <cmath>
 #include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <stdio.h>
 #include <openxr/openxr.h>
 
@@ -70,6 +74,11 @@ static void wivrn_hmd_get_view_poses(xrt_device * xdev,
                                      xrt_fov * out_fovs,
                                      xrt_pose * out_poses);
 
+static void wivrn_hmd_get_visibility_mask(xrt_device * xdev,
+                                          xrt_visibility_mask_type type,
+                                          uint32_t view_index,
+                                          xrt_visibility_mask ** out_mask);
+
 static double foveate(double a, double b, double λ, double c, double x)
 {
 	// In order to save encoding, transmit and decoding time, only a portion of the image is encoded in full resolution.
@@ -194,6 +203,7 @@ wivrn_hmd::wivrn_hmd(std::shared_ptr<xrt::drivers::wivrn::wivrn_session> cnx,
 	base->update_inputs = wivrn_hmd_update_inputs;
 	base->get_tracked_pose = wivrn_hmd_get_tracked_pose;
 	base->get_view_poses = wivrn_hmd_get_view_poses;
+	base->get_visibility_mask = wivrn_hmd_get_visibility_mask;
 	base->destroy = wivrn_hmd_destroy;
 	name = XRT_DEVICE_GENERIC_HMD;
 	device_type = XRT_DEVICE_TYPE_HMD;
@@ -212,6 +222,7 @@ wivrn_hmd::wivrn_hmd(std::shared_ptr<xrt::drivers::wivrn::wivrn_session> cnx,
 	input_count = 1;
 
 	const auto config = configuration::read_user_configuration();
+	views.set_predictor(config.prediction.head);
 
 	auto eye_width = info.recommended_eye_width;
 	auto eye_height = info.recommended_eye_height;
@@ -239,6 +250,31 @@ wivrn_hmd::wivrn_hmd(std::shared_ptr<xrt::drivers::wivrn::wivrn_session> cnx,
 	// FOV from headset info packet
 	hmd->distortion.fov[0] = xrt_cast(info.fov[0]);
 	hmd->distortion.fov[1] = xrt_cast(info.fov[1]);
+
+	hidden_area = info.hidden_area;
+}
+
+void wivrn_hmd::get_visibility_mask(xrt_visibility_mask_type type, uint32_t view_index, xrt_visibility_mask ** out_mask)
+{
+	// The views of the stream have the field of view of the headset, its mask is used as is
+	view_index = std::min<uint32_t>(view_index, hidden_area.size() - 1);
+	if (type != XRT_VISIBILITY_MASK_TYPE_HIDDEN_TRIANGLE_MESH or not hidden_area[view_index])
+	{
+		u_visibility_mask_get_default(type, &hmd->distortion.fov[view_index], out_mask);
+		return;
+	}
+
+	const auto & mask = *hidden_area[view_index];
+	size_t size = sizeof(xrt_visibility_mask) + mask.indices.size() * sizeof(uint32_t) + mask.vertices.size() * sizeof(xrt_vec2);
+	auto result = static_cast<xrt_visibility_mask *>(calloc(1, size));
+	result->type = type;
+	result->index_count = mask.indices.size();
+	result->vertex_count = mask.vertices.size();
+	memcpy(xrt_visibility_mask_get_indices(result), mask.indices.data(), mask.indices.size() * sizeof(uint32_t));
+	xrt_vec2 * vertices = xrt_visibility_mask_get_vertices(result);
+	for (size_t i = 0; i < mask.vertices.size(); ++i)
+		vertices[i] = {mask.vertices[i].x, mask.vertices[i].y};
+	*out_mask = result;
 }
 
 void wivrn_hmd::update_inputs()
@@ -262,13 +298,25 @@ xrt_space_relation wivrn_hmd::get_tracked_pose(xrt_input_name name, uint64_t at_
 	}
 
 	auto [extrapolation_time, res] = views.get_at(at_timestamp_ns);
-	cnx->add_predict_offset(extrapolation_time);
+	cnx->add_head_predict_offset(extrapolation_time);
 	return res.relation;
 }
 
-void wivrn_hmd::update_tracking(const from_headset::tracking & tracking, const clock_offset & offset)
+void wivrn_hmd::register_tracking(tracking_ingest & ingest)
 {
-	views.update_tracking(tracking, offset);
+	ingest.add(views);
+	ingest.add(gaze);
+}
+
+void wivrn_hmd::prefetch(uint64_t at_timestamp_ns)
+{
+	views.get_at(at_timestamp_ns);
+}
+
+tracking_sample wivrn_hmd::get_view_sample()
+{
+	std::lock_guard lock(mutex);
+	return view_sample;
 }
 
 void wivrn_hmd::get_view_poses(const xrt_vec3 * default_eye_relation,
@@ -279,7 +327,11 @@ void wivrn_hmd::get_view_poses(const xrt_vec3 * default_eye_relation,
                                xrt_pose * out_poses)
 {
 	auto [extrapolation_time, view] = views.get_at(at_timestamp_ns);
-	cnx->add_predict_offset(extrapolation_time);
+	cnx->add_head_predict_offset(extrapolation_time);
+	{
+		std::lock_guard lock(mutex);
+		view_sample = views.get_last_sample();
+	}
 
 	int flags = view.relation.relation_flags;
 
@@ -358,6 +410,49 @@ decltype(wivrn_hmd::foveation_parameters) wivrn_hmd::set_foveated_size(uint32_t
 	return foveation_parameters;
 }
 
+decltype(wivrn_hmd::foveation_parameters) wivrn_hmd::get_foveation(uint64_t at_timestamp_ns, const std::array<xrt_pose, 2> & poses, const std::array<xrt_fov, 2> & fovs)
+{
+	// The foveation function is steep when the centre gets close to the edges
+	const float max_center = 0.8;
+
+	auto result = foveation_parameters;
+	auto [extrapolation_time, relation] = gaze.get_at(at_timestamp_ns);
+	if (not(relation.relation_flags & XRT_SPACE_RELATION_ORIENTATION_TRACKED_BIT))
+		return result;
+
+	using xrt::auxiliary::math::map_quat;
+	for (int i = 0; i < 2; ++i)
+	{
+		// Gaze direction in the view, the gaze pose looks towards -Z
+		Eigen::Vector3f dir = map_quat(poses[i].orientation).inverse() * map_quat(relation.pose.orientation) * Eigen::Vector3f(0, 0, -1);
+		if (dir.z() > -0.1)
+			continue;
+
+		const auto & fov = fovs[i];
+		float l = tan(fov.angle_left);
+		float r = tan(fov.angle_right);
+		float t = tan(fov.angle_up);
+		float b = tan(fov.angle_down);
+		auto & param = result[i];
+		if (param.x.scale < 1)
+		{
+			// Same coordinates as in set_foveated_size, -1 on the left edge and 1 on the right edge
+			float cu = 2 * (-dir.x() / dir.z() - l) / (r - l) - 1;
+			param.x.center = std::clamp(cu, -max_center, max_center);
+			std::tie(param.x.a, param.x.b) = solve_foveation(param.x.scale, param.x.center);
+		}
+
+		if (param.y.scale < 1)
+		{
+			// Rows go down, from the up angle
+			float cv = 2 * (-dir.y() / dir.z() - t) / (b - t) - 1;
+			param.y.center = std::clamp(cv, -max_center, max_center);
+			std::tie(param.y.a, param.y.b) = solve_foveation(param.y.scale, param.y.center);
+		}
+	}
+	return result;
+}
+
 /*
  *
  * Functions
@@ -392,3 +487,11 @@ static void wivrn_hmd_get_view_poses(xrt_device * xdev,
 {
 	static_cast<wivrn_hmd *>(xdev)->get_view_poses(default_eye_relation, at_timestamp_ns, view_count, out_head_relation, out_fovs, out_poses);
 }
+
+static void wivrn_hmd_get_visibility_mask(xrt_device * xdev,
+                                          xrt_visibility_mask_type type,
+                                          uint32_t view_index,
+                                          xrt_visibility_mask ** out_mask)
+{
+	static_cast<wivrn_hmd *>(xdev)->get_visibility_mask(type, view_index, out_mask);
+}
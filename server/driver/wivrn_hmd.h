@@ -29,6 +29,7 @@
 #include <cstdint>
 #include <memory>
 #include <mutex>
+#include <optional>
 
 struct comp_target;
 
@@ -41,7 +42,13 @@ class wivrn_hmd : public xrt_device
 	xrt_tracking_origin tracking_origin;
 
 	view_list views;
+	// From XR_EXT_eye_gaze_interaction, empty when the headset has no eye tracking
+	pose_list gaze{xrt::drivers::wivrn::device_id::EYE_GAZE};
+	// Newest tracking sample when the views were last requested, protected by mutex
+	tracking_sample view_sample;
 	std::array<to_headset::video_stream_description::foveation_parameter, 2> foveation_parameters{};
+	// From the headset, for XR_KHR_visibility_mask
+	std::array<std::optional<from_headset::headset_info_packet::visibility_mask>, 2> hidden_area;
 
 	std::shared_ptr<xrt::drivers::wivrn::wivrn_session> cnx;
 
@@ -65,7 +72,18 @@ public:
 	                    xrt_fov * out_fovs,
 	                    xrt_pose * out_poses);
 
-	void update_tracking(const from_headset::tracking &, const clock_offset &);
+	// Tracking packets are added to the views by the session
+	void register_tracking(tracking_ingest &);
+	// Computes the views at the given time, so that the next queries for it are served from the history cache
+	void prefetch(uint64_t at_timestamp_ns);
+
+	tracking_sample get_view_sample();
+
+	// The mask is allocated with calloc, the caller frees it
+	void get_visibility_mask(xrt_visibility_mask_type type, uint32_t view_index, xrt_visibility_mask ** out_mask);
 
 	decltype(foveation_parameters) set_foveated_size(uint32_t width, uint32_t height);
+	// Foveation centred on the gaze at the given time, for views with these poses and fields of view.
+	// The scale is the one of set_foveated_size, the fixed parameters are used without a tracked gaze.
+	decltype(foveation_parameters) get_foveation(uint64_t at_timestamp_ns, const std::array<xrt_pose, 2> & poses, const std::array<xrt_fov, 2> & fovs);
 };
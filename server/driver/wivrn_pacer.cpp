@@ -20,19 +20,73 @@
 #include "wivrn_pacer.h"
 #include "driver/clock_offset.h"
 #include "os/os_time.h"
+#include "util/u_logging.h"
+#include "utils/metrics.h"
+#include <algorithm>
 #include <cmath>
 
-// How many samples of wait time to store per decoder
-const size_t num_wait_times = 100;
-// How many samples of wait time are required to use them
-const size_t min_wait_times = 50;
+// How many samples of each duration to store per decoder
+const size_t num_samples = 100;
+// How many samples are required to use them
+const size_t min_samples = 50;
+// Interval between two logs of the model
+const uint64_t log_interval_ns = 10'000'000'000;
+// Gains of the vsync phase locked loop, on the phase and on the frame duration
+const double phase_gain = 0.1;
+const double frequency_gain = 0.01;
+// Consecutive displayed frames far from the vsync grid before it is estimated again
+const int max_phase_outliers = 10;
+
+void wivrn_pacer::rolling_samples::push(int64_t value)
+{
+	if (samples.size() < num_samples)
+		samples.push_back(value);
+	else
+	{
+		samples[next] = value;
+		next = (next + 1) % num_samples;
+	}
+}
+
+int64_t wivrn_pacer::rolling_samples::percentile(double p) const
+{
+	if (samples.empty())
+		return 0;
+	std::vector<int64_t> sorted = samples;
+	auto nth = sorted.begin() + std::clamp<size_t>(std::lround(p * (sorted.size() - 1)), 0, sorted.size() - 1);
+	std::nth_element(sorted.begin(), nth, sorted.end());
+	return *nth;
+}
+
+void wivrn_pacer::rolling_samples::clear()
+{
+	samples.clear();
+	next = 0;
+}
 
 void wivrn_pacer::set_stream_count(size_t count)
 {
 	std::lock_guard lock(mutex);
 	streams.resize(count);
+}
+
+void wivrn_pacer::set_target(double value)
+{
+	std::lock_guard lock(mutex);
+	target = std::clamp(value, 0.5, 0.999);
+}
+
+void wivrn_pacer::set_frame_duration(uint64_t value)
+{
+	std::lock_guard lock(mutex);
+	frame_duration_ns = value;
 	for (auto & stream: streams)
-		stream.times.reserve(num_wait_times);
+		stream.model = {};
+	present_to_display.clear();
+	vsync_ns = 0;
+	wake_up_phase_ns = -1;
+	phase_error_ns = 0;
+	phase_outliers = 0;
 }
 
 void wivrn_pacer::predict(
@@ -44,23 +98,126 @@ void wivrn_pacer::predict(
 	std::lock_guard lock(mutex);
 	auto now = os_monotonic_get_ns();
 
-	next_frame_ns += frame_duration_ns;
+	next_frame_ns += idle ? frame_duration_ns * idle_frame_interval : frame_duration_ns;
 
 	if (next_frame_ns < now)
 		next_frame_ns = now;
 
+	if (vsync_ns)
+	{
+		// Keep the wake up at the same phase of the headset vsync, so that frames do not slide
+		// across vsync boundaries when the clocks drift
+		int64_t period = frame_duration_ns;
+		int64_t phase = ((int64_t(next_frame_ns) - vsync_ns) % period + period) % period;
+		if (wake_up_phase_ns < 0)
+			wake_up_phase_ns = phase;
+		int64_t correction = wake_up_phase_ns - phase;
+		if (correction > period / 2)
+			correction -= period;
+		else if (correction < -period / 2)
+			correction += period;
+		if (int64_t(next_frame_ns) + correction < int64_t(now))
+			correction += period;
+		next_frame_ns += correction;
+	}
+
 	out_wake_up_time_ns = next_frame_ns;
 	out_desired_present_time_ns = out_wake_up_time_ns + mean_wake_up_to_present_ns;
 	out_present_slop_ns = 0;
-	out_predicted_display_time_ns = out_desired_present_time_ns + mean_present_to_display_ns;
+	auto present_to_display = predicted_present_to_display_ns();
+	out_predicted_display_time_ns = out_desired_present_time_ns + present_to_display;
+	if (vsync_ns)
+		out_predicted_display_time_ns -= vsync_distance(out_predicted_display_time_ns);
+	xrt::drivers::wivrn::metrics::predicted_present_to_display.set(present_to_display * 1e-9);
+}
+
+int64_t wivrn_pacer::vsync_distance(int64_t t) const
+{
+	int64_t period = frame_duration_ns;
+	int64_t distance = ((t - vsync_ns) % period + period) % period;
+	return distance >= period / 2 ? distance - period : distance;
+}
+
+void wivrn_pacer::shift_wake_up(int64_t delta)
+{
+	if (wake_up_phase_ns < 0)
+	{
+		next_frame_ns += delta;
+		return;
+	}
+	int64_t period = frame_duration_ns;
+	wake_up_phase_ns = ((wake_up_phase_ns + delta) % period + period) % period;
+}
+
+uint64_t wivrn_pacer::wake_up_interval()
+{
+	std::lock_guard lock(mutex);
+	return idle ? 0 : frame_duration_ns;
 }
 
-void wivrn_pacer::on_feedback(const xrt::drivers::wivrn::from_headset::feedback & feedback, const clock_offset & offset)
+void wivrn_pacer::on_feedback(std::span<const feedback_sample> samples, const clock_offset & offset)
 {
 	std::lock_guard lock(mutex);
+	int adjustments = 0;
+	for (const auto & sample: samples)
+		adjustments += on_feedback_locked(*sample.feedback, sample.info, offset);
+
+	if (adjustments)
+	{
+		// Frames are late when they are decoded after the moment they should be blitted,
+		// keep this below the target fraction with a margin
+		bool wait_more = false;
+		bool wait_less = true;
+		for (const auto & stream: streams)
+		{
+			const auto & wait = stream.model.wait;
+			if (wait.size() >= min_samples)
+			{
+				int64_t margin = wait.percentile(1 - target);
+				if (margin < int64_t(frame_duration_ns / 10))
+					wait_less = false;
+				if (margin < 0)
+					wait_more = true;
+			}
+		}
+		// One step for each frame of the main stream
+		if (wait_more)
+			shift_wake_up(-adjustments * int64_t(frame_duration_ns / 1000));
+		else if (wait_less)
+			shift_wake_up(adjustments * int64_t(frame_duration_ns / 1000));
+	}
+
+	if (auto now = os_monotonic_get_ns(); now > last_log_ns + log_interval_ns)
+	{
+		last_log_ns = now;
+		auto state = get_model_locked();
+		U_LOG_D("Pacer model for p%.1f: frame %.2fms, wake up to present %.2fms, present to display %.2fms, vsync phase error %.3fms",
+		        state.target * 100,
+		        state.frame_duration_ns * 1e-6,
+		        state.wake_up_to_present_ns * 1e-6,
+		        state.present_to_display_ns * 1e-6,
+		        state.phase_error_ns * 1e-6);
+		for (size_t i = 0; i < state.streams.size(); ++i)
+		{
+			const auto & s = state.streams[i];
+			U_LOG_D("Pacer model stream %ld: encode %.2fms, send %.2fms, network %.2fms, decode %.2fms, wait %.2fms, blit %.2fms",
+			        i,
+			        s.encode * 1e-6,
+			        s.send * 1e-6,
+			        s.network * 1e-6,
+			        s.decode * 1e-6,
+			        s.wait * 1e-6,
+			        s.blit * 1e-6);
+		}
+	}
+}
+
+bool wivrn_pacer::on_feedback_locked(const xrt::drivers::wivrn::from_headset::feedback & feedback, const xrt::drivers::wivrn::bitrate_controller::frame_info * info, const clock_offset & offset)
+{
 	if (feedback.stream_index >= streams.size())
-		return;
+		return false;
 
+	bool adjust = false;
 	auto & last = streams[feedback.stream_index].last_feedback;
 
 	if (feedback.stream_index == 0 and
@@ -81,50 +238,50 @@ void wivrn_pacer::on_feedback(const xrt::drivers::wivrn::from_headset::feedback
 
 	last = feedback;
 
-	if (blitted and feedback.times_displayed <= 1)
+	auto & model = streams[feedback.stream_index].model;
+	if (info and info->send_end)
+	{
+		model.encode.push(info->encode_time);
+		model.send.push(info->send_end - info->send_begin);
+		if (feedback.received_last_packet)
+			model.network.push(offset.from_headset(feedback.received_last_packet) - info->send_end);
+	}
+	if (feedback.sent_to_decoder and feedback.received_from_decoder)
+		model.decode.push(feedback.received_from_decoder - feedback.sent_to_decoder);
+
+	if (blitted)
 	{
-		auto & stream = streams[feedback.stream_index];
-		if (stream.times.size() < num_wait_times)
-			stream.times.push_back(blitted - feedback.received_from_decoder);
-		else
+		model.wait.push(blitted - feedback.received_from_decoder);
+		if (feedback.blitted and feedback.displayed)
+			model.blit.push(feedback.displayed - feedback.blitted);
+
+		adjust = feedback.stream_index == 0;
+	}
+	if (feedback.stream_index == 0 and feedback.displayed)
+	{
+		// Displayed times are headset vsyncs: move the grid towards them,
+		// and correct the frame duration with the drift over the frames since the last one
+		int64_t displayed = offset.from_headset(feedback.displayed);
+		int64_t error = vsync_ns ? vsync_distance(displayed) : 0;
+		// With half_rate, a late frame is displayed half a frame off the grid: ignore it,
+		// unless the grid was lost
+		bool outlier = std::abs(error) > int64_t(frame_duration_ns / 4);
+		if (outlier)
+			++phase_outliers;
+		if (vsync_ns == 0 or phase_outliers >= max_phase_outliers)
 		{
-			stream.times[stream.next_times_index] = blitted - feedback.received_from_decoder;
-			stream.next_times_index = (stream.next_times_index + 1) % num_wait_times;
+			vsync_ns = displayed;
+			wake_up_phase_ns = -1;
+			phase_outliers = 0;
 		}
-
-		if (feedback.stream_index == 0)
+		else if (not outlier)
 		{
-			bool wait_more = false;
-			bool wait_less = true;
-			for (const auto & stream: streams)
-			{
-				if (stream.times.size() >= min_wait_times)
-				{
-					double mean_wait_time = 0;
-					double wait_time_variance = 0;
-
-					// https://en.wikipedia.org/wiki/Standard_deviation#Rapid_calculation_methods
-					for (size_t i = 0; i < stream.times.size(); ++i)
-					{
-						int64_t t = stream.times[i];
-						double prev_mean = mean_wait_time;
-						mean_wait_time += (t - mean_wait_time) / (i + 1);
-						wait_time_variance += (t - prev_mean) * (t - mean_wait_time);
-					}
-
-					wait_time_variance /= (stream.times.size() - 1);
-					double wait_time_std_dev = std::sqrt(wait_time_variance);
-
-					if (mean_wait_time < 4 * wait_time_std_dev)
-						wait_less = false;
-					if (mean_wait_time < 3 * wait_time_std_dev)
-						wait_more = true;
-				}
-			}
-			if (wait_more)
-				next_frame_ns -= frame_duration_ns / 1000;
-			else if (wait_less)
-				next_frame_ns += frame_duration_ns / 1000;
+			phase_outliers = 0;
+			int64_t periods = std::max<int64_t>(1, std::llround(double(displayed - vsync_ns) / frame_duration_ns));
+			vsync_ns = displayed - error + int64_t(error * phase_gain);
+			frame_duration_ns = int64_t(frame_duration_ns) + int64_t(error * frequency_gain / periods);
+			phase_error_ns = std::lerp(phase_error_ns, double(error), 0.1);
+			xrt::drivers::wivrn::metrics::vsync_phase_error.set(phase_error_ns * 1e-9);
 		}
 	}
 	if (feedback.displayed)
@@ -134,11 +291,29 @@ void wivrn_pacer::on_feedback(const xrt::drivers::wivrn::from_headset::feedback
 		{
 			auto displayed = offset.from_headset(feedback.displayed);
 			if (displayed > when.present_ns)
+			{
 				mean_present_to_display_ns = std::lerp(mean_present_to_display_ns, displayed - when.present_ns, 0.1);
+				present_to_display.push(displayed - when.present_ns);
+				xrt::drivers::wivrn::metrics::present_to_display.observe((displayed - when.present_ns) * 1e-9);
+			}
 			when.frame_id = 0;
 		}
 	}
+	return adjust;
 }
+
+void wivrn_pacer::delay_next_frame()
+{
+	std::lock_guard lock(mutex);
+	next_frame_ns += frame_duration_ns;
+}
+
+void wivrn_pacer::set_idle(bool value)
+{
+	std::lock_guard lock(mutex);
+	idle = value;
+}
+
 void wivrn_pacer::mark_timing_point(
         comp_target_timing_point point,
         int64_t frame_id,
@@ -167,13 +342,53 @@ void wivrn_pacer::mark_timing_point(
 	}
 }
 
+uint64_t wivrn_pacer::predicted_present_to_display_ns() const
+{
+	// The median follows sudden changes faster than the mean, and ignores outliers
+	if (present_to_display.size() >= min_samples)
+		return present_to_display.percentile(0.5);
+	return mean_present_to_display_ns;
+}
+
+wivrn_pacer::model_state wivrn_pacer::get_model_locked() const
+{
+	model_state state{
+	        .target = target,
+	        .frame_duration_ns = frame_duration_ns,
+	        .wake_up_to_present_ns = mean_wake_up_to_present_ns,
+	        .present_to_display_ns = predicted_present_to_display_ns(),
+	        .phase_error_ns = int64_t(phase_error_ns),
+	};
+	for (const auto & stream: streams)
+	{
+		const auto & model = stream.model;
+		state.streams.push_back({
+		        .encode = model.encode.percentile(target),
+		        .send = model.send.percentile(target),
+		        .network = model.network.percentile(target),
+		        .decode = model.decode.percentile(target),
+		        .wait = model.wait.percentile(1 - target),
+		        .blit = model.blit.percentile(target),
+		});
+	}
+	return state;
+}
+
+wivrn_pacer::model_state wivrn_pacer::get_model()
+{
+	std::lock_guard lock(mutex);
+	return get_model_locked();
+}
+
 void wivrn_pacer::reset()
 {
 	std::lock_guard lock(mutex);
 	for (auto & stream: streams)
-	{
-		stream.times.clear();
-		stream.next_times_index = 0;
-	}
+		stream.model = {};
+	present_to_display.clear();
 	in_flight_frames = {};
+	vsync_ns = 0;
+	wake_up_phase_ns = -1;
+	phase_error_ns = 0;
+	phase_outliers = 0;
 }
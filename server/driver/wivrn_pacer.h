@@ -19,34 +19,109 @@
 
 #pragma once
 
+#include "driver/bitrate_controller.h"
 #include "wivrn_packets.h"
 
+#include <array>
 #include <cstdint>
 #include <main/comp_target.h>
 #include <mutex>
+#include <span>
 #include <vector>
 
 struct clock_offset;
 
 class wivrn_pacer
 {
+public:
+	// Last samples of a duration, for percentile estimates
+	class rolling_samples
+	{
+		std::vector<int64_t> samples;
+		size_t next = 0;
+
+	public:
+		void push(int64_t value);
+		size_t size() const
+		{
+			return samples.size();
+		}
+		// Value below which a fraction p of the samples are, 0 if there are none
+		int64_t percentile(double p) const;
+		void clear();
+	};
+
+	// Duration of each step of the frames of an encoder, in ns
+	struct stream_model
+	{
+		rolling_samples encode;
+		// From the first to the last encoded data sent
+		rolling_samples send;
+		// From the last data sent to the last data received
+		rolling_samples network;
+		rolling_samples decode;
+		// From the end of decoding to the blit, negative when the frame was late
+		rolling_samples wait;
+		// From the blit to the display
+		rolling_samples blit;
+	};
+
+	// Percentiles of the model, for debugging
+	struct model_state
+	{
+		struct stream
+		{
+			int64_t encode;
+			int64_t send;
+			int64_t network;
+			int64_t decode;
+			int64_t wait;
+			int64_t blit;
+		};
+		// Fraction of frames that should be displayed on time
+		double target;
+		uint64_t frame_duration_ns;
+		uint64_t wake_up_to_present_ns;
+		uint64_t present_to_display_ns;
+		// Smoothed distance of the displayed frames to the locked vsync, 0 until locked
+		int64_t phase_error_ns;
+		// Lower percentiles of the wait time, higher ones for the other steps
+		std::vector<stream> streams;
+	};
+
+private:
 	std::mutex mutex;
 
 	uint64_t next_frame_ns;
 	uint64_t frame_duration_ns;
 
+	// Fraction of frames that should be displayed on time
+	double target = 0.99;
+
 	uint64_t mean_wake_up_to_present_ns;
 	uint64_t mean_present_to_display_ns;
+	rolling_samples present_to_display;
 
 	uint64_t last_wake_up_ns = 0;
+	uint64_t last_log_ns = 0;
+
+	// Nothing is displayed, wake up less often
+	bool idle = false;
+
+	// Phase locked loop on the headset display: estimated time of a vsync on the server
+	// clock, 0 until a frame is displayed. Predicted display times are on this grid
+	// and the wake ups keep a constant phase relative to it.
+	int64_t vsync_ns = 0;
+	// Phase of the wake ups after a vsync, negative until the loop is locked
+	int64_t wake_up_phase_ns = -1;
+	double phase_error_ns = 0;
+	int phase_outliers = 0;
 
-	// Client wait time for each decoder
 	struct stream_data
 	{
 		// Last feedback for each encoder
 		xrt::drivers::wivrn::from_headset::feedback last_feedback;
-		std::vector<int64_t> times;
-		size_t next_times_index = 0;
+		stream_model model;
 	};
 	std::vector<stream_data> streams;
 
@@ -57,6 +132,15 @@ class wivrn_pacer
 	};
 	std::array<frame_history, 4> in_flight_frames;
 
+	uint64_t predicted_present_to_display_ns() const;
+	// Distance from t to the closest vsync, between -frame_duration_ns/2 and frame_duration_ns/2
+	int64_t vsync_distance(int64_t t) const;
+	// Moves the wake ups, keeping the loop locked
+	void shift_wake_up(int64_t delta);
+	model_state get_model_locked() const;
+	// Returns true if the wake up time should be adjusted
+	bool on_feedback_locked(const xrt::drivers::wivrn::from_headset::feedback &, const xrt::drivers::wivrn::bitrate_controller::frame_info * info, const clock_offset &);
+
 public:
 	wivrn_pacer(uint64_t frame_duration) :
 	        next_frame_ns(0),
@@ -67,18 +151,43 @@ public:
 
 	void set_stream_count(size_t count);
 
+	// Fraction of frames that must be ready before they are displayed, between 0.5 and 1
+	void set_target(double target);
+
+	// The headset changed its refresh rate, the duration is then refined from the feedback
+	void set_frame_duration(uint64_t frame_duration);
+
 	void predict(
 	        uint64_t & out_wake_up_time_ns,
 	        uint64_t & out_desired_present_time_ns,
 	        uint64_t & out_present_slop_ns,
 	        uint64_t & out_predicted_display_time_ns);
 
-	void on_feedback(const xrt::drivers::wivrn::from_headset::feedback &, const clock_offset &);
+	struct feedback_sample
+	{
+		const xrt::drivers::wivrn::from_headset::feedback * feedback;
+		// Server side information on the frame, if it is still known
+		const xrt::drivers::wivrn::bitrate_controller::frame_info * info;
+	};
+	// Feedback of a batch, in the order the headset sent it
+	void on_feedback(std::span<const feedback_sample>, const clock_offset &);
+
+	// An encoder could not keep up and a frame was dropped, render the next one a frame later
+	void delay_next_frame();
+
+	// No image is sent to the headset, only wake up every idle_frame_interval frames
+	static constexpr int idle_frame_interval = 4;
+	void set_idle(bool idle);
+
+	// Expected time between two wake ups, 0 when idle
+	uint64_t wake_up_interval();
 
 	void mark_timing_point(
 	        comp_target_timing_point point,
 	        int64_t frame_id,
 	        uint64_t when_ns);
 
+	model_state get_model();
+
 	void reset();
 };
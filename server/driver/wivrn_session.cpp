@@ -26,15 +26,21 @@
 #include "util/u_logging.h"
 #include "util/u_system.h"
 #include "util/u_system_helpers.h"
+#include "utils/metrics.h"
 #include "utils/scoped_lock.h"
+#include "utils/thread_policy.h"
 
 #include "audio/audio_setup.h"
+#include "configuration.h"
 #include "wivrn_comp_target.h"
 #include "wivrn_controller.h"
 #include "wivrn_hmd.h"
 
+#include "xrt/xrt_compositor.h"
 #include "xrt/xrt_session.h"
+#include <algorithm>
 #include <cmath>
+#include <magic_enum.hpp>
 #include <vulkan/vulkan.h>
 
 struct wivrn_comp_target_factory : public comp_target_factory
@@ -74,20 +80,52 @@ struct wivrn_comp_target_factory : public comp_target_factory
 	}
 };
 
-void xrt::drivers::wivrn::max_accumulator::send(wivrn_connection & connection)
+// Fraction of the requested poses the headset prediction should cover
+static const double prediction_percentile = 0.95;
+// Fraction of the distance to the percentile by which the offset decreases in each interval
+static const double prediction_decay = 0.2;
+// Trim change for a fraction of uncovered requests 100% above the target
+static const double prediction_trim_gain = 5'000'000;
+static const double prediction_max_trim = 5'000'000;
+static const auto prediction_interval = std::chrono::milliseconds(250);
+
+void xrt::drivers::wivrn::prediction_offset_estimator::add(std::chrono::nanoseconds offset)
 {
-	if (std::chrono::steady_clock::now() < next_sample)
-		return;
+	std::lock_guard lock(mutex);
+	// Enough for the requests of an interval, later ones are not needed for the estimate
+	if (samples.size() < 1024)
+		samples.push_back(std::max<int64_t>(0, offset.count()));
+}
+
+std::optional<std::chrono::nanoseconds> xrt::drivers::wivrn::prediction_offset_estimator::update()
+{
+	std::vector<int64_t> window;
+	{
+		std::lock_guard lock(mutex);
+		std::swap(window, samples);
+	}
+	if (window.empty())
+		return std::nullopt;
+
+	// Error of the offset the headset used during the interval
+	double missed = double(std::ranges::count_if(window, [&](int64_t x) { return x > offset; })) / window.size();
 
-	if (auto offset = max.exchange(0))
-		connection.send_stream(to_headset::prediction_offset{
-		        .offset = std::chrono::nanoseconds(offset),
-		});
-	next_sample += std::chrono::seconds(1);
+	auto nth = window.begin() + size_t(prediction_percentile * (window.size() - 1));
+	std::ranges::nth_element(window, nth);
+	double percentile = *nth;
+
+	estimate = percentile > estimate ? percentile : std::lerp(estimate, percentile, prediction_decay);
+	trim = std::clamp(trim + (missed - (1 - prediction_percentile)) * prediction_trim_gain, -prediction_max_trim, prediction_max_trim);
+	offset = std::max<int64_t>(0, estimate + trim);
+	return std::chrono::nanoseconds(offset);
 }
 
 xrt::drivers::wivrn::wivrn_session::wivrn_session(xrt::drivers::wivrn::TCP && tcp, u_system & system) :
-        connection(std::move(tcp)), xrt_system(system)
+        connection(std::move(tcp)),
+        xrt_system(system),
+        worker("session worker", 64, metrics::worker_queue_delay, metrics::worker_queue_dropped, [this](deferred_packet && packet) {
+	        std::visit([this](auto && p) { handle(std::move(p)); }, std::move(packet));
+        })
 {
 }
 
@@ -114,6 +152,7 @@ xrt_result_t xrt::drivers::wivrn::wivrn_session::create_session(xrt::drivers::wi
 	}
 
 	const auto & info = std::get<from_headset::headset_info_packet>(*control);
+	self->headset_info = info;
 
 	try
 	{
@@ -135,6 +174,9 @@ xrt_result_t xrt::drivers::wivrn::wivrn_session::create_session(xrt::drivers::wi
 	self->hmd = std::make_unique<wivrn_hmd>(self, info);
 	self->left_hand = std::make_unique<wivrn_controller>(0, self->hmd.get(), self);
 	self->right_hand = std::make_unique<wivrn_controller>(1, self->hmd.get(), self);
+	self->hmd->register_tracking(self->tracking_input);
+	self->left_hand->register_tracking(self->tracking_input);
+	self->right_hand->register_tracking(self->tracking_input);
 
 	auto * usysds = u_system_devices_static_allocate();
 	*out_xsysd = &usysds->base.base;
@@ -163,6 +205,12 @@ xrt_result_t xrt::drivers::wivrn::wivrn_session::create_session(xrt::drivers::wi
 		U_LOG_E("Failed to create system compositor");
 		return xret;
 	}
+	self->system_compositor = *out_xsysc;
+	for (size_t i = 0; i < self->base_recommended_size.size(); ++i)
+	{
+		const auto & recommended = (*out_xsysc)->info.views[i].recommended;
+		self->base_recommended_size[i] = {recommended.width_pixels, recommended.height_pixels};
+	}
 
 	u_builder_create_space_overseer_legacy(
 	        &self->xrt_system.broadcast,
@@ -179,9 +227,51 @@ xrt_result_t xrt::drivers::wivrn::wivrn_session::create_session(xrt::drivers::wi
 	};
 
 	auto dump_file = std::getenv("WIVRN_DUMP_TIMINGS");
-	if (dump_file)
+	auto timings_port = configuration::read_user_configuration().timings_port;
+	if (dump_file or timings_port)
 	{
-		self->feedback_csv.open(dump_file);
+		self->tracer = std::make_unique<timing_tracer>(
+		        dump_file ? std::optional<std::filesystem::path>(dump_file) : std::nullopt,
+		        timings_port);
+	}
+
+	if (auto record_file = std::getenv("WIVRN_RECORD"))
+	{
+		try
+		{
+			self->recorder = std::make_unique<recording_writer>(record_file);
+			self->recorder->write(os_monotonic_get_ns(), self->headset_info);
+			U_LOG_I("Recording headset packets to %s", record_file);
+		}
+		catch (const std::exception & e)
+		{
+			U_LOG_E("Failed to start recording: %s", e.what());
+		}
+	}
+
+	if (auto port = configuration::read_user_configuration().metrics_port)
+	{
+		try
+		{
+			self->metrics_exporter = std::make_unique<metrics::exporter>(*port);
+		}
+		catch (const std::exception & e)
+		{
+			U_LOG_E("Failed to start metrics endpoint on port %d: %s", *port, e.what());
+		}
+	}
+
+	if (auto name = configuration::read_user_configuration().stats_shm)
+	{
+		try
+		{
+			self->stats = std::make_unique<stats_shm>(*name);
+			self->stats->set_connected(true);
+		}
+		catch (const std::exception & e)
+		{
+			U_LOG_E("Failed to create statistics shared memory %s: %s", name->c_str(), e.what());
+		}
 	}
 
 	self->thread = std::thread(&wivrn_session::run, self);
@@ -202,19 +292,31 @@ void wivrn_session::operator()(from_headset::headset_info_packet &&)
 {
 	U_LOG_W("unexpected headset info packet, ignoring");
 }
+
+bool wivrn_session::ingest(deserialization_packet & packet)
+{
+	if (not tracking_ingest::is_tracking(packet))
+		return false;
+
+	metrics::tracking_packets.add();
+	if (auto offset = offset_est.get_offset())
+		tracking_input.ingest(packet, offset);
+	return true;
+}
+
 void wivrn_session::operator()(from_headset::tracking && tracking)
 {
+	metrics::tracking_packets.add();
 	auto offset = offset_est.get_offset();
 	if (not offset)
 		return;
 
-	hmd->update_tracking(tracking, offset);
-	left_hand->update_tracking(tracking, offset);
-	right_hand->update_tracking(tracking, offset);
+	tracking_input.process(tracking, offset);
 }
 
 void wivrn_session::operator()(from_headset::hand_tracking && hand_tracking)
 {
+	metrics::hand_tracking_packets.add();
 	auto offset = offset_est.get_offset();
 	if (not offset)
 		return;
@@ -235,28 +337,230 @@ void wivrn_session::operator()(from_headset::inputs && inputs)
 void wivrn_session::operator()(from_headset::timesync_response && timesync)
 {
 	offset_est.add_sample(timesync);
+	auto offset = offset_est.get_offset();
+	metrics::clock_drift.set((offset.a - 1) * 1e6);
+	metrics::clock_uncertainty.set(offset.uncertainty * 1e-9);
+}
+
+void wivrn_session::operator()(from_headset::feedback_batch && batch)
+{
+	worker.push(std::move(batch));
 }
 
-void wivrn_session::operator()(from_headset::feedback && feedback)
+void wivrn_session::check_feedback_counters(const from_headset::feedback_batch & batch)
+{
+	// Batches are sent on the stream socket, they may be lost or reordered.
+	// A sequence far behind the last one is a new stream on the headset.
+	int32_t diff = feedback_sequence ? int32_t(batch.sequence - *feedback_sequence) : 0;
+	if (diff <= 0 and diff > -64 and feedback_sequence)
+		return;
+
+	if (diff > 1)
+	{
+		U_LOG_D("Lost %d feedback batches", diff - 1);
+		for (size_t i = 0; i < batch.streams.size() and i < feedback_counters.size(); ++i)
+		{
+			const auto & before = feedback_counters[i];
+			const auto & after = batch.streams[i];
+			uint32_t frames = 0;
+			uint32_t lost = 0;
+			for (const auto & feedback: batch.frames)
+			{
+				if (feedback.stream_index != i or feedback.times_displayed > 1)
+					continue;
+				++frames;
+				if (not feedback.sent_to_decoder or feedback.lost_slices)
+					++lost;
+			}
+
+			if (uint32_t(after.frames - before.frames) > frames)
+				metrics::feedback_frames_missed.add(after.frames - before.frames - frames);
+			// The encoder must not reference a lost frame, even if its feedback was not received
+			if (uint32_t(after.lost - before.lost) > lost)
+				comp_target->on_frame_lost(i, after.last_lost);
+		}
+	}
+
+	if (diff > 0)
+	{
+		for (size_t i = 0; i < batch.streams.size() and i < feedback_counters.size(); ++i)
+			metrics::headset_frames_skipped.add(batch.streams[i].skipped - feedback_counters[i].skipped);
+	}
+
+	feedback_sequence = batch.sequence;
+	feedback_counters = batch.streams;
+}
+
+void wivrn_session::handle(from_headset::feedback_batch && batch)
 {
 	assert(comp_target);
+	check_feedback_counters(batch);
+
 	clock_offset o = offset_est.get_offset();
 	if (not o)
 		return;
-	comp_target->on_feedback(feedback, o);
-
-	if (feedback.received_first_packet)
-		dump_time("receive_begin", feedback.frame_index, o.from_headset(feedback.received_first_packet), feedback.stream_index);
-	if (feedback.received_last_packet)
-		dump_time("receive_end", feedback.frame_index, o.from_headset(feedback.received_last_packet), feedback.stream_index);
-	if (feedback.sent_to_decoder)
-		dump_time("decode_begin", feedback.frame_index, o.from_headset(feedback.sent_to_decoder), feedback.stream_index);
-	if (feedback.received_from_decoder)
-		dump_time("decode_end", feedback.frame_index, o.from_headset(feedback.received_from_decoder), feedback.stream_index);
-	if (feedback.blitted)
-		dump_time("blit", feedback.frame_index, o.from_headset(feedback.blitted), feedback.stream_index);
-	if (feedback.displayed)
-		dump_time("display", feedback.frame_index, o.from_headset(feedback.displayed), feedback.stream_index);
+	comp_target->on_feedback(batch.frames, o);
+
+	for (const auto & feedback: batch.frames)
+	{
+		if (feedback.received_first_packet)
+			dump_time("receive_begin", feedback.frame_index, o.from_headset(feedback.received_first_packet), feedback.stream_index);
+		if (feedback.received_last_packet)
+			dump_time("receive_end", feedback.frame_index, o.from_headset(feedback.received_last_packet), feedback.stream_index);
+		if (feedback.sent_to_decoder)
+			dump_time("decode_begin", feedback.frame_index, o.from_headset(feedback.sent_to_decoder), feedback.stream_index);
+		if (feedback.received_from_decoder)
+			dump_time("decode_end", feedback.frame_index, o.from_headset(feedback.received_from_decoder), feedback.stream_index);
+		if (feedback.blitted)
+			dump_time("blit", feedback.frame_index, o.from_headset(feedback.blitted), feedback.stream_index);
+		if (feedback.displayed)
+			dump_time("display", feedback.frame_index, o.from_headset(feedback.displayed), feedback.stream_index);
+	}
+}
+
+void wivrn_session::operator()(from_headset::performance_state && state)
+{
+	assert(comp_target);
+	auto level = std::max(state.thermal, state.load);
+	U_LOG_I("Headset performance: thermal %s, load %s",
+	        magic_enum::enum_name(state.thermal).data(),
+	        magic_enum::enum_name(state.load).data());
+
+	// Degrade gradually: decoding a lower bitrate and resolution takes less power on the
+	// headset, a lower refresh rate also reduces the load of the compositor
+	switch (level)
+	{
+		case from_headset::performance_state::level::normal:
+			comp_target->set_limits(1, 1, 0);
+			break;
+		case from_headset::performance_state::level::warning:
+			comp_target->set_limits(0.75, 0.75, 0);
+			break;
+		case from_headset::performance_state::level::impaired: {
+			// Highest refresh rate at least 20% lower than the preferred one, or the lowest one
+			const auto & rates = headset_info.available_refresh_rates;
+			float preferred = headset_info.preferred_refresh_rate;
+			float rate = rates.empty() ? preferred : *std::ranges::min_element(rates);
+			for (float r: rates)
+			{
+				if (r <= 0.8 * preferred)
+					rate = std::max(rate, r);
+			}
+			comp_target->set_limits(0.5, 0.5, std::min(rate, preferred));
+			break;
+		}
+	}
+}
+
+// Retransmissions are time critical, they are not deferred
+void wivrn_session::operator()(from_headset::video_stream_nack && nack)
+{
+	assert(comp_target);
+	comp_target->on_nack(nack);
+}
+
+void wivrn_session::operator()(from_headset::network_stats && stats)
+{
+	worker.push(std::move(stats));
+}
+
+void wivrn_session::handle(from_headset::network_stats && stats)
+{
+	clock_offset o = offset_est.get_offset();
+	if (not o)
+		return;
+
+	// extra columns: received, lost, reordered, jitter (µs)
+	auto dump = [&](const from_headset::network_stats::flow & flow, uint8_t index) {
+		if (flow.received == 0 and flow.lost == 0)
+			return;
+		std::string extra = "," + std::to_string(flow.received) +
+		                    "," + std::to_string(flow.lost) +
+		                    "," + std::to_string(flow.reordered) +
+		                    "," + std::to_string(flow.jitter);
+		dump_time("network_stats", 0, o.from_headset(stats.timestamp), index, extra.c_str());
+	};
+	dump(stats.stream, 0);
+	dump(stats.low_latency, 1);
+	for (size_t i = 0; i < stats.video.size(); ++i)
+		dump(stats.video[i], i + 2);
+
+	if (stats.stream.lost > 0)
+		U_LOG_D("Stream packets: %u received, %u lost, %u reordered, jitter %.0fµs", stats.stream.received, stats.stream.lost, stats.stream.reordered, stats.stream.jitter);
+
+	if (stats.wifi)
+	{
+		metrics::wifi_rssi.set(stats.wifi->rssi);
+		metrics::wifi_tx_rate.set(stats.wifi->tx_rate);
+		metrics::wifi_rx_rate.set(stats.wifi->rx_rate);
+		metrics::wifi_frequency.set(stats.wifi->frequency);
+
+		// extra columns: rssi (dBm), tx rate, rx rate (Mbps), frequency (MHz)
+		std::string extra = "," + std::to_string(stats.wifi->rssi) +
+		                    "," + std::to_string(stats.wifi->tx_rate) +
+		                    "," + std::to_string(stats.wifi->rx_rate) +
+		                    "," + std::to_string(stats.wifi->frequency);
+		dump_time("wifi_link", 0, o.from_headset(stats.timestamp), 0, extra.c_str());
+	}
+
+	if (stats.audio)
+	{
+		metrics::headset_speaker_latency.set(stats.audio->speaker * 1e-9);
+		metrics::headset_output_latency.set(stats.audio->speaker_output * 1e-9);
+		metrics::headset_microphone_latency.set(stats.audio->microphone * 1e-9);
+		metrics::headset_audio_xruns.add(stats.audio->xruns);
+		if (stats.audio->xruns)
+			U_LOG_D("Headset audio: %u underruns, output latency %.1fms", stats.audio->xruns, stats.audio->speaker_output * 1e-6);
+	}
+
+	if (stats.gpu)
+	{
+		const auto & gpu = *stats.gpu;
+		metrics::headset_gpu_duration.set(gpu.total * 1e-9);
+		metrics::headset_gpu_max_duration.set(gpu.max_total * 1e-9);
+
+		// extra columns: frames, then average duration (ns) of quad layers, transitions, left and right reprojection, overlay, total, and the longest total
+		std::string extra = "," + std::to_string(gpu.frames) +
+		                    "," + std::to_string(gpu.quad_layers) +
+		                    "," + std::to_string(gpu.transition) +
+		                    "," + std::to_string(gpu.reprojection[0]) +
+		                    "," + std::to_string(gpu.reprojection[1]) +
+		                    "," + std::to_string(gpu.overlay) +
+		                    "," + std::to_string(gpu.total) +
+		                    "," + std::to_string(gpu.max_total);
+		dump_time("headset_gpu", 0, o.from_headset(stats.timestamp), 0, extra.c_str());
+	}
+
+	if (stats.stages)
+	{
+		auto set = [](metrics::summary & summary, const from_headset::network_stats::percentiles & p) {
+			summary.set(p.p50 * 1e-9, p.p95 * 1e-9, p.p99 * 1e-9, p.mean * p.count * 1e-9, p.count);
+		};
+		const auto & stages = *stats.stages;
+		set(metrics::headset_receive_duration, stages.receive);
+		set(metrics::headset_decode_duration, stages.decode);
+		set(metrics::headset_queue_duration, stages.queue);
+		set(metrics::headset_display_duration, stages.display);
+		set(metrics::headset_render_cpu_duration, stages.cpu);
+		set(metrics::headset_render_gpu_duration, stages.gpu);
+
+		// Reports are sent every second, log one per minute
+		if (stage_reports++ % 60 == 0)
+		{
+			auto ms = [](const from_headset::network_stats::percentiles & p) {
+				char buffer[48];
+				snprintf(buffer, sizeof(buffer), "%.1f/%.1f/%.1fms", p.p50 * 1e-6, p.p95 * 1e-6, p.p99 * 1e-6);
+				return std::string(buffer);
+			};
+			U_LOG_I("Headset frame stages p50/p95/p99: receive %s, decode %s, queue %s, display %s, render CPU %s, GPU %s",
+			        ms(stages.receive).c_str(),
+			        ms(stages.decode).c_str(),
+			        ms(stages.queue).c_str(),
+			        ms(stages.display).c_str(),
+			        ms(stages.cpu).c_str(),
+			        ms(stages.gpu).c_str());
+		}
+	}
 }
 
 void wivrn_session::operator()(audio_data && data)
@@ -267,6 +571,7 @@ void wivrn_session::operator()(audio_data && data)
 
 void wivrn_session::run(std::weak_ptr<wivrn_session> weak_self)
 {
+	apply_thread_policy(thread_role::session);
 	while (true)
 	{
 		try
@@ -275,8 +580,17 @@ void wivrn_session::run(std::weak_ptr<wivrn_session> weak_self)
 			if (self and not self->quit)
 			{
 				self->offset_est.request_sample(self->connection);
-				self->predict_offset.send(self->connection);
-				self->connection.poll(*self, 20);
+				self->send_prediction_offset();
+				if (self->recorder)
+				{
+					self->connection.poll([&](auto && packet) {
+						self->recorder->write(os_monotonic_get_ns(), packet);
+						(*self)(std::move(packet));
+					},
+					                      20);
+				}
+				else
+					self->connection.poll(*self, 20);
 			}
 			else
 				return;
@@ -296,13 +610,118 @@ std::array<to_headset::video_stream_description::foveation_parameter, 2> wivrn_s
 	return hmd->set_foveated_size(width, height);
 }
 
-void wivrn_session::dump_time(const std::string & event, uint64_t frame, uint64_t time, uint8_t stream, const char * extra)
+std::array<to_headset::video_stream_description::foveation_parameter, 2> wivrn_session::get_foveation(uint64_t at_timestamp_ns, const std::array<xrt_pose, 2> & poses, const std::array<xrt_fov, 2> & fovs)
 {
-	if (feedback_csv)
+	return hmd->get_foveation(at_timestamp_ns, poses, fovs);
+}
+
+void wivrn_session::set_recommended_scale(double factor)
+{
+	// Steps of 10%, changed only when 2 steps away or back to full size,
+	// so that each dynamic resolution change does not resize the swapchains of new applications
+	factor = std::clamp(std::round(factor * 10) / 10, 0.1, 1.);
+	if (not system_compositor or factor == recommended_scale or (factor < 1 and std::abs(factor - recommended_scale) < 0.2))
+		return;
+	recommended_scale = factor;
+
+	// Read by the IPC server when an application gets the view configuration
+	for (size_t i = 0; i < base_recommended_size.size(); ++i)
 	{
-		std::lock_guard lock(csv_mutex);
-		feedback_csv << std::quoted(event) << "," << frame << "," << time << "," << (int)stream << extra << std::endl;
+		auto & view = system_compositor->info.views[i];
+		view.recommended.width_pixels = std::min<uint32_t>(view.max.width_pixels, std::round(base_recommended_size[i][0] * factor / 8) * 8);
+		view.recommended.height_pixels = std::min<uint32_t>(view.max.height_pixels, std::round(base_recommended_size[i][1] * factor / 8) * 8);
 	}
+	U_LOG_I("Recommended view size for new applications: %dx%d (%d%%)",
+	        system_compositor->info.views[0].recommended.width_pixels,
+	        system_compositor->info.views[0].recommended.height_pixels,
+	        int(std::round(factor * 100)));
+}
+
+void wivrn_session::set_wake_up_schedule(uint64_t wake_up_ns, uint64_t period_ns, uint64_t predicted_display_ns)
+{
+	std::lock_guard lock(wake_up_mutex);
+	wake_up = {
+	        .next_wake_up_ns = wake_up_ns,
+	        .period_ns = period_ns,
+	        .display_offset_ns = predicted_display_ns - wake_up_ns,
+	};
+}
+
+void wivrn_session::prefetch_poses(uint64_t predicted_display_ns)
+{
+	if (hmd)
+		hmd->prefetch(predicted_display_ns);
+	for (auto & controller: {left_hand.get(), right_hand.get()})
+	{
+		if (controller)
+			controller->prefetch(predicted_display_ns);
+	}
+}
+
+XrTime wivrn_session::headset_display_time()
+{
+	wake_up_schedule schedule;
+	{
+		std::lock_guard lock(wake_up_mutex);
+		schedule = wake_up;
+	}
+	auto offset = offset_est.get_offset();
+	if (not offset or not schedule.period_ns)
+		return 0;
+	return offset.to_headset(schedule.next_wake_up_ns + schedule.display_offset_ns);
+}
+
+to_headset::prediction_offset wivrn_session::prediction_schedule()
+{
+	wake_up_schedule schedule;
+	{
+		std::lock_guard lock(wake_up_mutex);
+		schedule = wake_up;
+	}
+	auto offset = offset_est.get_offset();
+	if (not offset or not schedule.period_ns)
+		return {};
+
+	return {
+	        .next_wake_up = offset.to_headset(schedule.next_wake_up_ns),
+	        .wake_up_period = std::chrono::nanoseconds(schedule.period_ns),
+	        .display_offset = std::chrono::nanoseconds(schedule.display_offset_ns),
+	        .uplink = std::chrono::nanoseconds(tracking_input.get_uplink()),
+	};
+}
+
+void wivrn_session::send_prediction_offset()
+{
+	auto now = std::chrono::steady_clock::now();
+	if (now < next_prediction_offset)
+		return;
+	next_prediction_offset = now + prediction_interval;
+
+	auto head = head_predict_offset.update();
+	auto hands = hand_predict_offset.update();
+	// Nothing is rendered
+	if (not head and not hands)
+		return;
+
+	auto packet = prediction_schedule();
+	packet.offset = head.value_or(hands.value_or(std::chrono::nanoseconds(0)));
+	packet.hand_offset = hands.value_or(packet.offset);
+	metrics::head_prediction_offset.set(packet.offset.count() * 1e-9);
+	metrics::hand_prediction_offset.set(packet.hand_offset.count() * 1e-9);
+	connection.send_stream(packet);
+}
+
+tracking_sample wivrn_session::get_view_sample()
+{
+	return hmd->get_view_sample();
+}
+
+void wivrn_session::dump_time(const char * event, uint64_t frame, uint64_t time, uint8_t stream, const char * extra)
+{
+	if (tracer)
+		tracer->record(event, frame, time, stream, extra);
+	if (stats)
+		stats->record(event, frame, time, stream, extra);
 }
 
 static bool quit_if_no_client(u_system & xrt_system)
@@ -332,6 +751,9 @@ void wivrn_session::reconnect()
 		U_LOG_W("Failed to notify session state change");
 	}
 
+	if (stats)
+		stats->set_connected(false);
+
 	U_LOG_I("Waiting for new connection");
 	auto tcp = accept_connection(0 /*stdin*/, [this]() { return quit_if_no_client(xrt_system); });
 	if (not tcp)
@@ -347,11 +769,21 @@ void wivrn_session::reconnect()
 			// FIXME: timeout
 		}
 		const auto & info = std::get<from_headset::headset_info_packet>(*control);
-		// FIXME: ensure new client is compatible
+		if (recorder)
+			recorder->write(os_monotonic_get_ns(), info);
+		// Encoders and the video stream description are kept, so that the headset
+		// can keep its decoders and resume with the next IDR frame
+		if (info.recommended_eye_width != headset_info.recommended_eye_width or
+		    info.recommended_eye_height != headset_info.recommended_eye_height or
+		    info.preferred_refresh_rate != headset_info.preferred_refresh_rate or
+		    not std::ranges::equal(info.decoders, headset_info.decoders, {}, &from_headset::headset_info_packet::decoder_info::codec, &from_headset::headset_info_packet::decoder_info::codec))
+			U_LOG_W("Headset configuration changed, it is only applied on a new session");
 
 		comp_target->reset_encoders();
 		if (audio_handle)
 			send_control(audio_handle->description());
+		if (stats)
+			stats->set_connected(true);
 
 		event.state.visible = true;
 		event.state.focused = true;
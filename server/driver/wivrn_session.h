@@ -20,14 +20,24 @@
 #pragma once
 
 #include "clock_offset.h"
+#include "encoder/encoder_output.h"
+#include "tracking_ingest.h"
 #include "wivrn_connection.h"
+#include "utils/dispatch_queue.h"
+#include "utils/metrics.h"
+#include "utils/stats_shm.h"
+#include "utils/timing_tracer.h"
 #include "wivrn_packets.h"
+#include "wivrn_recording.h"
 #include "xrt/xrt_results.h"
+#include <array>
 #include <atomic>
 #include <fstream>
 #include <memory>
 #include <mutex>
+#include <optional>
 #include <thread>
+#include <vector>
 
 class wivrn_hmd;
 class wivrn_controller;
@@ -39,31 +49,42 @@ struct xrt_space_overseer;
 struct xrt_system_compositor;
 struct wivrn_comp_target_factory;
 
+// Most recent tracking sample, to follow it from the headset to the rendered frame
+struct tracking_sample
+{
+	// Headset clock
+	XrTime produced = 0;
+	// Server clock
+	XrTime received = 0;
+};
+
 namespace xrt::drivers::wivrn
 {
 struct wivrn_comp_target;
 
-class max_accumulator
+// Time in the future at which the headset should sample the poses, so that the
+// poses requested by the applications are interpolated instead of extrapolated.
+// It follows a percentile of the offsets of the requested poses from the newest
+// sample: it increases at once and decays over a few intervals, a single late
+// request does not keep it high. A trim, from the fraction of the requests that
+// were further than the offset last sent, makes that fraction converge to the target.
+class prediction_offset_estimator
 {
-	using T = std::chrono::nanoseconds::rep;
-	std::atomic<T> max;
-	std::chrono::steady_clock::time_point next_sample;
+	std::mutex mutex;
+	std::vector<int64_t> samples; // Locked by mutex
+
+	double estimate = 0;
+	double trim = 0;
+	int64_t offset = 0;
 
 public:
-	max_accumulator() :
-	        next_sample(std::chrono::steady_clock::now()) {}
-	void add(std::chrono::nanoseconds s)
-	{
-		auto sample = s.count();
-		T prev = max;
-		while (prev < sample and max.compare_exchange_weak(prev, sample))
-		{
-		}
-	}
-	void send(wivrn_connection & connection);
+	void add(std::chrono::nanoseconds);
+
+	// Once per interval, nullopt if no pose was requested
+	std::optional<std::chrono::nanoseconds> update();
 };
 
-class wivrn_session : public std::enable_shared_from_this<wivrn_session>
+class wivrn_session : public std::enable_shared_from_this<wivrn_session>, public encoder_output
 {
 	friend wivrn_comp_target_factory;
 	wivrn_connection connection;
@@ -78,16 +99,57 @@ class wivrn_session : public std::enable_shared_from_this<wivrn_session>
 	std::unique_ptr<wivrn_controller> right_hand;
 	wivrn_comp_target * comp_target;
 
+	// View sizes recommended to the applications before scaling, width and height of each eye
+	xrt_system_compositor * system_compositor = nullptr;
+	std::array<std::array<uint32_t, 2>, 2> base_recommended_size{};
+	double recommended_scale = 1; // Only used by the compositor thread
+
 	clock_offset_estimator offset_est;
 
-	// offsets in ns of each requested frame from its generation time
-	max_accumulator predict_offset;
+	// Offsets of the requested poses from the newest sample, the head ones are used for rendering
+	prediction_offset_estimator head_predict_offset;
+	prediction_offset_estimator hand_predict_offset;
+	std::chrono::steady_clock::time_point next_prediction_offset;
+	void send_prediction_offset();
 
-	std::mutex csv_mutex;
-	std::ofstream feedback_csv;
+	// Compositor wake up schedule in the server clock, sent with the prediction offset
+	// so that the headset samples the tracking just before the compositor needs it
+	struct wake_up_schedule
+	{
+		uint64_t next_wake_up_ns = 0;
+		uint64_t period_ns = 0;
+		uint64_t display_offset_ns = 0;
+	};
+	std::mutex wake_up_mutex;
+	wake_up_schedule wake_up; // Locked by wake_up_mutex
+	std::atomic<uint32_t> haptics_sequence = 0;
+	// Poses of the tracking packets, only used by the session thread
+	tracking_ingest tracking_input;
+	to_headset::prediction_offset prediction_schedule();
+
+	std::unique_ptr<stats_shm> stats;
+	std::unique_ptr<timing_tracer> tracer;
+	// Packets received from the headset, when WIVRN_RECORD is set
+	std::unique_ptr<recording_writer> recorder;
+	std::unique_ptr<metrics::exporter> metrics_exporter;
 
 	std::shared_ptr<audio_device> audio_handle;
 
+	// Sent by the headset on the first connection, the stream is kept on reconnection
+	from_headset::headset_info_packet headset_info;
+
+	// Last feedback counters received, only used by the worker thread
+	std::optional<uint32_t> feedback_sequence;
+	std::vector<from_headset::feedback_batch::stream_counters> feedback_counters;
+	// Frame stage reports received, only used by the worker thread
+	uint32_t stage_reports = 0;
+
+	// Packets that are not time critical are handled on a worker thread,
+	// so that they do not delay the tracking packets on the network thread.
+	// Declared last so that the thread is stopped first.
+	using deferred_packet = std::variant<from_headset::feedback_batch, from_headset::network_stats>;
+	dispatch_queue<deferred_packet> worker;
+
 	wivrn_session(TCP && tcp, u_system &);
 
 public:
@@ -97,21 +159,67 @@ public:
 	                                   xrt_space_overseer ** out_xspovrs,
 	                                   xrt_system_compositor ** out_xsysc);
 
-	clock_offset get_offset();
+	clock_offset get_offset() override;
 	bool connected();
 
-	void add_predict_offset(std::chrono::nanoseconds off)
+	const std::vector<from_headset::headset_info_packet::decoder_info> & get_headset_decoders() const
+	{
+		return headset_info.decoders;
+	}
+
+	const from_headset::headset_info_packet & get_headset_info() const
+	{
+		return headset_info;
+	}
+
+	bool has_capability(capability c) const
+	{
+		return headset_info.capabilities & capability_bit(c);
+	}
+
+	void add_head_predict_offset(std::chrono::nanoseconds off)
+	{
+		head_predict_offset.add(off);
+	}
+
+	// Controllers and hand joints
+	void add_hand_predict_offset(std::chrono::nanoseconds off)
+	{
+		hand_predict_offset.add(off);
+	}
+
+	// Period 0 when the compositor is idle
+	void set_wake_up_schedule(uint64_t wake_up_ns, uint64_t period_ns, uint64_t predicted_display_ns);
+	// Predicted display time of the next compositor frame in the headset clock, 0 if unknown
+	XrTime headset_display_time();
+	// Computes the poses of all devices for a frame when the compositor wakes up,
+	// the compositor, the space overseer and the application then read the same results
+	void prefetch_poses(uint64_t predicted_display_ns);
+
+	// Scales the view size recommended to the applications with the resolution of the stream,
+	// only the applications that start afterwards use it
+	void set_recommended_scale(double factor);
+
+	uint32_t next_haptics_sequence()
 	{
-		predict_offset.add(off);
+		return haptics_sequence++;
 	}
 
 	void operator()(from_headset::handshake &&) {}
 	void operator()(from_headset::headset_info_packet &&);
+	// Handles tracking packets without deserializing them as from_headset::packets,
+	// returns false for other packets, see wivrn_connection::poll
+	bool ingest(deserialization_packet &);
+
 	void operator()(from_headset::tracking &&);
 	void operator()(from_headset::hand_tracking &&);
 	void operator()(from_headset::inputs &&);
 	void operator()(from_headset::timesync_response &&);
-	void operator()(from_headset::feedback &&);
+	void operator()(from_headset::feedback_batch &&);
+	void operator()(from_headset::video_stream_nack &&);
+	void operator()(from_headset::network_stats &&);
+	void operator()(from_headset::link_probe_result &&) {}
+	void operator()(from_headset::performance_state &&);
 	void operator()(audio_data &&);
 
 	template <typename T>
@@ -120,6 +228,43 @@ public:
 		connection.send_stream(std::forward<T>(packet));
 	}
 
+	template <typename T>
+	void queue_stream(T && packet)
+	{
+		connection.queue_stream(std::forward<T>(packet));
+	}
+
+	template <typename T>
+	void queue_stream_raw(std::span<uint8_t> header, std::span<uint8_t> payload)
+	{
+		connection.queue_stream_raw<T>(header, payload);
+	}
+
+	void queue_video_shard(uint8_t stream, std::span<uint8_t> header, std::span<uint8_t> payload) override
+	{
+		connection.queue_video_shard(stream, header, payload);
+	}
+
+	void queue_parity_shard(const to_headset::video_stream_parity_shard & shard) override
+	{
+		connection.queue_parity_shard(shard);
+	}
+
+	void flush_stream(uint8_t stream) override
+	{
+		connection.flush_video(stream);
+	}
+
+	std::optional<uint32_t> last_stream_datagram(uint8_t stream) override
+	{
+		return connection.last_video_datagram(stream);
+	}
+
+	std::optional<int64_t> stream_send_time(uint8_t stream, uint32_t datagram) override
+	{
+		return connection.video_send_time(stream, datagram);
+	}
+
 	template <typename T>
 	void send_control(T && packet)
 	{
@@ -127,10 +272,27 @@ public:
 	}
 
 	std::array<to_headset::video_stream_description::foveation_parameter, 2> set_foveated_size(uint32_t width, uint32_t height);
+	std::array<to_headset::video_stream_description::foveation_parameter, 2> get_foveation(uint64_t at_timestamp_ns, const std::array<xrt_pose, 2> & poses, const std::array<xrt_fov, 2> & fovs);
 
-	void dump_time(const std::string & event, uint64_t frame, uint64_t time, uint8_t stream = -1, const char * extra = "");
+	// Tracking sample the last requested views were computed from
+	tracking_sample get_view_sample();
+
+	// Capacity of the link in bit/s measured on connection, if known
+	std::optional<uint64_t> get_link_capacity() const
+	{
+		if (const auto & link = connection.get_link_estimate())
+			return link->capacity;
+		return std::nullopt;
+	}
+
+	void dump_time(const char * event, uint64_t frame, uint64_t time, uint8_t stream = -1, const char * extra = "") override;
 
 private:
+	void handle(from_headset::feedback_batch &&);
+	// Accounts for the frames whose feedback was in a lost batch
+	void check_feedback_counters(const from_headset::feedback_batch &);
+	void handle(from_headset::network_stats &&);
+
 	static void run(std::weak_ptr<wivrn_session>);
 	void reconnect();
 };
@@ -0,0 +1,179 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "wivrn_uring.h"
+#include "wivrn_sockets.h"
+
+#include <cerrno>
+#include <liburing.h>
+#include <sys/socket.h>
+#include <system_error>
+
+namespace
+{
+// Must be a power of 2
+const unsigned buffer_count = 256;
+// Larger than any datagram sent by the protocol
+const size_t buffer_size = 2048;
+const int buffer_group = 0;
+} // namespace
+
+wivrn_uring::wivrn_uring(std::vector<int> fds_) :
+        ring(std::make_unique<io_uring>()),
+        buffers(buffer_count * buffer_size),
+        fds(std::move(fds_))
+{
+	int err = io_uring_queue_init(2 * buffer_count, ring.get(), 0);
+	if (err < 0)
+	{
+		ring.reset();
+		throw std::system_error(-err, std::system_category(), "io_uring_queue_init");
+	}
+
+	buffer_ring = io_uring_setup_buf_ring(ring.get(), buffer_count, buffer_group, 0, &err);
+	if (not buffer_ring)
+	{
+		io_uring_queue_exit(ring.get());
+		ring.reset();
+		throw std::system_error(-err, std::system_category(), "io_uring_setup_buf_ring");
+	}
+
+	for (uint16_t i = 0; i < buffer_count; ++i)
+		io_uring_buf_ring_add(buffer_ring, buffers.data() + i * buffer_size, buffer_size, i, io_uring_buf_ring_mask(buffer_count), i);
+	io_uring_buf_ring_advance(buffer_ring, buffer_count);
+
+	for (int fd: fds)
+	{
+		int type = 0;
+		socklen_t length = sizeof(type);
+		if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &length) < 0)
+			type = SOCK_STREAM;
+		datagram.push_back(type == SOCK_DGRAM);
+	}
+
+	for (size_t i = 0; i < fds.size(); ++i)
+		arm(i);
+	io_uring_submit(ring.get());
+}
+
+wivrn_uring::~wivrn_uring()
+{
+	if (ring)
+	{
+		io_uring_free_buf_ring(ring.get(), buffer_ring, buffer_count, buffer_group);
+		io_uring_queue_exit(ring.get());
+	}
+}
+
+void wivrn_uring::arm(size_t index)
+{
+	io_uring_sqe * sqe = io_uring_get_sqe(ring.get());
+	if (not sqe)
+	{
+		io_uring_submit(ring.get());
+		sqe = io_uring_get_sqe(ring.get());
+	}
+	io_uring_prep_recv_multishot(sqe, fds[index], nullptr, 0, 0);
+	sqe->flags |= IOSQE_BUFFER_SELECT;
+	sqe->buf_group = buffer_group;
+	io_uring_sqe_set_data64(sqe, index);
+}
+
+void wivrn_uring::recycle(uint16_t buffer_id)
+{
+	io_uring_buf_ring_add(buffer_ring, buffers.data() + buffer_id * buffer_size, buffer_size, buffer_id, io_uring_buf_ring_mask(buffer_count), 0);
+	io_uring_buf_ring_advance(buffer_ring, 1);
+}
+
+int wivrn_uring::receive(int timeout, const std::function<void(size_t, std::span<const uint8_t>)> & callback)
+{
+	io_uring_cqe * cqe;
+	__kernel_timespec ts{
+	        .tv_sec = timeout / 1000,
+	        .tv_nsec = (timeout % 1000) * 1'000'000,
+	};
+
+	int err = io_uring_wait_cqe_timeout(ring.get(), &cqe, timeout < 0 ? nullptr : &ts);
+	if (err == -ETIME or err == -EINTR)
+		return 0;
+	if (err < 0)
+		throw std::system_error(-err, std::system_category(), "io_uring_wait_cqe_timeout");
+
+	int count = 0;
+	bool rearm = false;
+	unsigned head;
+	unsigned seen = 0;
+	io_uring_for_each_cqe(ring.get(), head, cqe)
+	{
+		++seen;
+		size_t index = io_uring_cqe_get_data64(cqe);
+
+		if (cqe->res < 0 and cqe->res != -ENOBUFS)
+		{
+			io_uring_cq_advance(ring.get(), seen);
+			throw std::system_error(-cqe->res, std::system_category(), "io_uring recv");
+		}
+
+		if (cqe->res == 0 and not datagram[index])
+		{
+			if (cqe->flags & IORING_CQE_F_BUFFER)
+				recycle(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+			io_uring_cq_advance(ring.get(), seen);
+			throw xrt::drivers::wivrn::socket_shutdown{};
+		}
+
+		if (not(cqe->flags & IORING_CQE_F_MORE))
+		{
+			// Multishot request terminated, the kernel does it when running out of buffers
+			arm(index);
+			rearm = true;
+		}
+
+		if (not(cqe->flags & IORING_CQE_F_BUFFER))
+			continue;
+
+		uint16_t buffer_id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+		// Empty datagrams are valid, there is nothing to give to the callback
+		if (cqe->res == 0)
+		{
+			recycle(buffer_id);
+			continue;
+		}
+
+		try
+		{
+			callback(index, std::span(buffers.data() + buffer_id * buffer_size, cqe->res));
+		}
+		catch (...)
+		{
+			recycle(buffer_id);
+			io_uring_cq_advance(ring.get(), seen);
+			throw;
+		}
+		recycle(buffer_id);
+		++count;
+	}
+	io_uring_cq_advance(ring.get(), seen);
+
+	if (rearm)
+		io_uring_submit(ring.get());
+
+	return count;
+}
@@ -0,0 +1,58 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <span>
+#include <vector>
+
+struct io_uring;
+struct io_uring_buf_ring;
+
+// Receives from a set of sockets with io_uring, using multishot recv and a
+// ring of provided buffers so that a single system call can return many
+// packets.
+class wivrn_uring
+{
+	std::unique_ptr<io_uring> ring;
+	io_uring_buf_ring * buffer_ring = nullptr;
+	std::vector<uint8_t> buffers;
+	std::vector<int> fds;
+	// A zero length receive is a shutdown for stream sockets, an empty datagram otherwise
+	std::vector<bool> datagram;
+
+	void arm(size_t index);
+	void recycle(uint16_t buffer_id);
+
+public:
+	// Throws if io_uring or provided buffer rings are not available
+	wivrn_uring(std::vector<int> fds);
+	wivrn_uring(const wivrn_uring &) = delete;
+	wivrn_uring & operator=(const wivrn_uring &) = delete;
+	~wivrn_uring();
+
+	// Wait up to timeout milliseconds (forever if negative) for data on any of the sockets.
+	// callback is called with the index of the socket and the received data,
+	// which is only valid during the call.
+	// Returns the number of times callback was called.
+	int receive(int timeout, const std::function<void(size_t, std::span<const uint8_t>)> & callback);
+};
@@ -0,0 +1,299 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "bitstream_sink.h"
+
+#include "util/u_logging.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <iomanip>
+#include <optional>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <vector>
+
+namespace xrt::drivers::wivrn
+{
+
+bitstream_sink::bitstream_sink(std::filesystem::path path, mode output) :
+        buffer(std::make_unique<uint8_t[]>(capacity)),
+        path(std::move(path))
+{
+	writer = std::thread(output == mode::socket ? &bitstream_sink::run_socket : &bitstream_sink::run, this);
+}
+
+bitstream_sink::~bitstream_sink()
+{
+	quit = true;
+	writer.join();
+}
+
+void bitstream_sink::copy_in(size_t position, const void * data, size_t size)
+{
+	size_t offset = position % capacity;
+	size_t first = std::min(size, capacity - offset);
+	memcpy(buffer.get() + offset, data, first);
+	memcpy(buffer.get(), (const uint8_t *)data + first, size - first);
+}
+
+void bitstream_sink::copy_out(size_t position, void * data, size_t size) const
+{
+	size_t offset = position % capacity;
+	size_t first = std::min(size, capacity - offset);
+	memcpy(data, buffer.get() + offset, first);
+	memcpy((uint8_t *)data + first, buffer.get(), size - first);
+}
+
+void bitstream_sink::push(std::span<const uint8_t> data, bool end_of_frame, uint64_t frame_index, int64_t display_time)
+{
+	size_t h = head.load(std::memory_order_relaxed);
+	if (dropping or h + sizeof(record) + data.size() - tail.load(std::memory_order_acquire) > capacity)
+	{
+		if (not dropping)
+			dropped.fetch_add(1, std::memory_order_relaxed);
+		dropping = not end_of_frame;
+		return;
+	}
+
+	record r{
+	        .frame_index = frame_index,
+	        .display_time = display_time,
+	        .size = uint32_t(data.size()),
+	        .end_of_frame = end_of_frame,
+	};
+	copy_in(h, &r, sizeof(r));
+	copy_in(h + sizeof(r), data.data(), data.size());
+	head.store(h + sizeof(r) + data.size(), std::memory_order_release);
+}
+
+bool bitstream_sink::sync_requested()
+{
+	return sync_request.exchange(false, std::memory_order_relaxed);
+}
+
+static bool write_all(int fd, std::span<const uint8_t> data)
+{
+	while (not data.empty())
+	{
+		ssize_t n = ::write(fd, data.data(), data.size());
+		if (n < 0 and errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		data = data.subspan(n);
+	}
+	return true;
+}
+
+void bitstream_sink::run()
+{
+	pthread_setname_np(pthread_self(), "bitstream sink");
+
+	// A reader closing the pipe must not kill the server, write then fails with EPIPE
+	sigset_t pipe_signal;
+	sigemptyset(&pipe_signal);
+	sigaddset(&pipe_signal, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &pipe_signal, nullptr);
+
+	std::ofstream timestamps(path.string() + ".timestamps.txt");
+	timestamps << "# timestamp format v2\n" << std::fixed << std::setprecision(3);
+	std::optional<int64_t> origin;
+
+	int fd = -1;
+	std::vector<uint8_t> data;
+	while (true)
+	{
+		bool last = quit;
+		if (fd < 0)
+		{
+			// Opening a named pipe without a reader fails with ENXIO instead of blocking
+			fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_NONBLOCK | O_CLOEXEC, 0644);
+			if (fd >= 0)
+			{
+				fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+				// Players need the parameter sets of an IDR frame to start decoding
+				sync_request = true;
+			}
+			else if (errno != ENXIO)
+			{
+				U_LOG_E("Failed to open %s: %s", path.c_str(), strerror(errno));
+				return;
+			}
+		}
+
+		size_t t = tail.load(std::memory_order_relaxed);
+		size_t h = head.load(std::memory_order_acquire);
+		while (t != h)
+		{
+			record r;
+			copy_out(t, &r, sizeof(r));
+			data.resize(r.size);
+			copy_out(t + sizeof(r), data.data(), r.size);
+			t += sizeof(r) + r.size;
+			tail.store(t, std::memory_order_release);
+
+			// Without a reader, the data is discarded until one opens the pipe
+			if (fd < 0)
+				continue;
+			if (not write_all(fd, data))
+			{
+				if (errno == EPIPE)
+				{
+					timespec zero{};
+					sigtimedwait(&pipe_signal, nullptr, &zero);
+					U_LOG_I("%s closed by its reader", path.c_str());
+				}
+				else
+					U_LOG_E("Failed to write %s: %s", path.c_str(), strerror(errno));
+				::close(fd);
+				fd = -1;
+				continue;
+			}
+			if (r.end_of_frame)
+			{
+				if (not origin)
+					origin = r.display_time;
+				timestamps << (r.display_time - *origin) * 1e-6 << "\n";
+			}
+		}
+		timestamps.flush();
+
+		if (auto n = dropped.exchange(0, std::memory_order_relaxed))
+			U_LOG_W("Video dump: %zu frames incomplete, the writer did not keep up", n);
+
+		if (last)
+			break;
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	if (fd >= 0)
+		::close(fd);
+}
+
+// Clients are local players, a client that does not read for this long is disconnected
+// so that it does not hold back the others
+static const timeval client_send_timeout{.tv_sec = 0, .tv_usec = 200'000};
+
+void bitstream_sink::run_socket()
+{
+	pthread_setname_np(pthread_self(), "spectator sink");
+
+	int listen_fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	sockaddr_un addr{.sun_family = AF_UNIX};
+	if (path.native().size() >= sizeof(addr.sun_path))
+	{
+		U_LOG_E("Spectator socket path %s is too long", path.c_str());
+		::close(listen_fd);
+		return;
+	}
+	strcpy(addr.sun_path, path.c_str());
+	// Remove the socket of a previous encoder or server
+	::unlink(path.c_str());
+	if (listen_fd < 0 or ::bind(listen_fd, (sockaddr *)&addr, sizeof(addr)) < 0 or ::listen(listen_fd, 4) < 0)
+	{
+		U_LOG_E("Failed to create spectator socket %s: %s", path.c_str(), strerror(errno));
+		if (listen_fd >= 0)
+			::close(listen_fd);
+		return;
+	}
+	U_LOG_I("Spectator stream available on %s", path.c_str());
+
+	struct client
+	{
+		int fd;
+		// Data is sent from the first frame that begins after the connection
+		bool started = false;
+	};
+	std::vector<client> clients;
+	// The next record begins a frame
+	bool frame_start = true;
+	std::vector<uint8_t> data;
+	while (true)
+	{
+		bool last = quit;
+		while (true)
+		{
+			int fd = ::accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+			if (fd < 0)
+				break;
+			setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &client_send_timeout, sizeof(client_send_timeout));
+			clients.push_back({.fd = fd});
+			// Players need the parameter sets of an IDR frame to start decoding
+			sync_request = true;
+			U_LOG_I("Spectator connected to %s", path.c_str());
+		}
+
+		size_t t = tail.load(std::memory_order_relaxed);
+		size_t h = head.load(std::memory_order_acquire);
+		while (t != h)
+		{
+			record r;
+			copy_out(t, &r, sizeof(r));
+			data.resize(r.size);
+			copy_out(t + sizeof(r), data.data(), r.size);
+			t += sizeof(r) + r.size;
+			tail.store(t, std::memory_order_release);
+
+			for (auto & c: clients)
+			{
+				c.started = c.started or frame_start;
+				if (not c.started)
+					continue;
+				std::span<const uint8_t> remaining = data;
+				while (not remaining.empty())
+				{
+					ssize_t n = ::send(c.fd, remaining.data(), remaining.size(), MSG_NOSIGNAL);
+					if (n < 0 and errno == EINTR)
+						continue;
+					if (n <= 0)
+						break;
+					remaining = remaining.subspan(n);
+				}
+				if (not remaining.empty())
+				{
+					U_LOG_I("Spectator disconnected from %s", path.c_str());
+					::close(c.fd);
+					c.fd = -1;
+				}
+			}
+			std::erase_if(clients, [](const client & c) { return c.fd < 0; });
+			frame_start = r.end_of_frame;
+		}
+
+		if (auto n = dropped.exchange(0, std::memory_order_relaxed); n and not clients.empty())
+			U_LOG_W("Spectator stream: %zu frames incomplete, the writer did not keep up", n);
+
+		if (last)
+			break;
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	for (auto & c: clients)
+		::close(c.fd);
+	::close(listen_fd);
+	::unlink(path.c_str());
+}
+
+} // namespace xrt::drivers::wivrn
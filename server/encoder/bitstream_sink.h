@@ -0,0 +1,88 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <span>
+#include <thread>
+
+namespace xrt::drivers::wivrn
+{
+
+// Writes the bitstream of an encoder for WIVRN_DUMP_VIDEO without delaying it: the slices are
+// copied in a ring buffer, which a background thread drains to the file. The display time of
+// each frame is written next to it, in the mkvmerge timestamp format.
+// The file may be a named pipe, read by a player for a live preview.
+// As a spectator output, the path is a Unix socket instead: each local client that connects
+// receives the bitstream from the next frame, and no timestamps are written.
+class bitstream_sink
+{
+public:
+	enum class mode
+	{
+		file,
+		socket,
+	};
+
+private:
+	// Single producer, the calls to push are serialized by the encoder, single consumer
+	static constexpr size_t capacity = 16 * 1024 * 1024;
+	std::unique_ptr<uint8_t[]> buffer;
+	std::atomic<size_t> head = 0;
+	std::atomic<size_t> tail = 0;
+	// Frames partly dropped because the buffer was full
+	std::atomic<size_t> dropped = 0;
+	// The current frame is dropped until its end
+	bool dropping = false;
+	// Set when the file is opened, a player reading the pipe starts at an IDR frame
+	std::atomic<bool> sync_request = false;
+
+	struct record
+	{
+		uint64_t frame_index;
+		// ns in the headset clock, only set with end_of_frame
+		int64_t display_time;
+		uint32_t size;
+		bool end_of_frame;
+	};
+
+	std::filesystem::path path;
+	std::atomic<bool> quit = false;
+	std::thread writer;
+
+	void copy_in(size_t position, const void * data, size_t size);
+	void copy_out(size_t position, void * data, size_t size) const;
+	void run();
+	void run_socket();
+
+public:
+	explicit bitstream_sink(std::filesystem::path path, mode output = mode::file);
+	~bitstream_sink();
+
+	void push(std::span<const uint8_t> data, bool end_of_frame, uint64_t frame_index, int64_t display_time);
+	// True once after the file has been opened or a client connected, the encoder should then send an IDR frame
+	bool sync_requested();
+};
+
+} // namespace xrt::drivers::wivrn
@@ -0,0 +1,242 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "depth_sampler.h"
+#include "foveated_mapping.h"
+
+#include <cmath>
+#include <cstddef>
+#include <map>
+#include <string>
+#include <vector>
+
+extern const std::map<std::string, std::vector<uint32_t>> shaders;
+
+namespace
+{
+struct eye_parameters
+{
+	foveated_mapping mapping;
+	float near_z;
+	float far_z;
+	float min_depth;
+	float max_depth;
+};
+
+struct push_constants
+{
+	eye_parameters eyes[2];
+};
+
+struct specialization_constants
+{
+	int32_t grid_size;
+	float min_distance;
+};
+} // namespace
+
+depth_sampler::depth_sampler(vk::raii::Device & device, vk::raii::PipelineCache & pipeline_cache) :
+        device(*device)
+{
+	output = buffer_allocation(
+	        device,
+	        {
+	                .size = 2 * grid_size * grid_size,
+	                .usage = vk::BufferUsageFlagBits::eStorageBuffer,
+	        },
+	        {
+	                .flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT,
+	                .usage = VMA_MEMORY_USAGE_AUTO,
+	        });
+
+	sampler = device.createSampler({
+	        .magFilter = vk::Filter::eNearest,
+	        .minFilter = vk::Filter::eNearest,
+	        .mipmapMode = vk::SamplerMipmapMode::eNearest,
+	        .addressModeU = vk::SamplerAddressMode::eClampToEdge,
+	        .addressModeV = vk::SamplerAddressMode::eClampToEdge,
+	        .addressModeW = vk::SamplerAddressMode::eClampToEdge,
+	        .maxLod = VK_LOD_CLAMP_NONE,
+	});
+
+	std::array samplers{*sampler, *sampler};
+	std::array ds_layout_binding{
+	        vk::DescriptorSetLayoutBinding{
+	                .binding = 0,
+	                .descriptorType = vk::DescriptorType::eCombinedImageSampler,
+	                .descriptorCount = samplers.size(),
+	                .stageFlags = vk::ShaderStageFlagBits::eCompute,
+	                .pImmutableSamplers = samplers.data(),
+	        },
+	        vk::DescriptorSetLayoutBinding{
+	                .binding = 1,
+	                .descriptorType = vk::DescriptorType::eStorageBuffer,
+	                .descriptorCount = 1,
+	                .stageFlags = vk::ShaderStageFlagBits::eCompute,
+	        },
+	};
+	ds_layout = device.createDescriptorSetLayout({
+	        .bindingCount = ds_layout_binding.size(),
+	        .pBindings = ds_layout_binding.data(),
+	});
+
+	vk::PushConstantRange push_constant_range{
+	        .stageFlags = vk::ShaderStageFlagBits::eCompute,
+	        .offset = 0,
+	        .size = sizeof(push_constants),
+	};
+	layout = device.createPipelineLayout({
+	        .setLayoutCount = 1,
+	        .pSetLayouts = &*ds_layout,
+	        .pushConstantRangeCount = 1,
+	        .pPushConstantRanges = &push_constant_range,
+	});
+
+	auto & spirv = shaders.at("depth.comp");
+	vk::raii::ShaderModule shader(device, {
+	                                              .codeSize = spirv.size() * sizeof(uint32_t),
+	                                              .pCode = spirv.data(),
+	                                      });
+
+	specialization_constants constants{
+	        .grid_size = grid_size,
+	        .min_distance = xrt::drivers::wivrn::to_headset::video_stream_depth::min_distance,
+	};
+	std::array constants_desc{
+	        vk::SpecializationMapEntry{
+	                .constantID = 0,
+	                .offset = offsetof(specialization_constants, grid_size),
+	                .size = sizeof(constants.grid_size),
+	        },
+	        vk::SpecializationMapEntry{
+	                .constantID = 1,
+	                .offset = offsetof(specialization_constants, min_distance),
+	                .size = sizeof(constants.min_distance),
+	        },
+	};
+	vk::SpecializationInfo specialization_info{
+	        .mapEntryCount = constants_desc.size(),
+	        .pMapEntries = constants_desc.data(),
+	        .dataSize = sizeof(constants),
+	        .pData = &constants,
+	};
+
+	pipeline = vk::raii::Pipeline(device, pipeline_cache, vk::ComputePipelineCreateInfo{
+	                                                              .stage = {
+	                                                                      .stage = vk::ShaderStageFlagBits::eCompute,
+	                                                                      .module = *shader,
+	                                                                      .pName = "main",
+	                                                                      .pSpecializationInfo = &specialization_info,
+	                                                              },
+	                                                              .layout = *layout,
+	                                                      });
+
+	std::array pool_size{
+	        vk::DescriptorPoolSize{
+	                .type = vk::DescriptorType::eCombinedImageSampler,
+	                .descriptorCount = 2,
+	        },
+	        vk::DescriptorPoolSize{
+	                .type = vk::DescriptorType::eStorageBuffer,
+	                .descriptorCount = 1,
+	        }};
+	dp = device.createDescriptorPool({
+	        .maxSets = 1,
+	        .poolSizeCount = pool_size.size(),
+	        .pPoolSizes = pool_size.data(),
+	});
+
+	ds = device.allocateDescriptorSets({
+	        .descriptorPool = *dp,
+	        .descriptorSetCount = 1,
+	        .pSetLayouts = &*ds_layout,
+	})[0].release();
+
+	vk::DescriptorBufferInfo output_info{
+	        .buffer = output,
+	        .range = vk::WholeSize,
+	};
+	device.updateDescriptorSets(
+	        vk::WriteDescriptorSet{
+	                .dstSet = ds,
+	                .dstBinding = 1,
+	                .descriptorCount = 1,
+	                .descriptorType = vk::DescriptorType::eStorageBuffer,
+	                .pBufferInfo = &output_info,
+	        },
+	        nullptr);
+}
+
+void depth_sampler::record_draw_commands(vk::raii::CommandBuffer & cmd_buf, const std::array<view, 2> & views)
+{
+	// The descriptor set is not in use, the previous commands have completed
+	std::array<vk::DescriptorImageInfo, 2> image_info;
+	push_constants pc{};
+	for (size_t i = 0; i < views.size(); ++i)
+	{
+		const auto & v = views[i];
+		image_info[i] = {
+		        .imageView = v.depth,
+		        .imageLayout = vk::ImageLayout::eShaderReadOnlyOptimal,
+		};
+
+		auto & eye = pc.eyes[i];
+		eye.mapping.set_foveation(v.foveation);
+		eye.mapping.set_mapping(v.stream_fov, v.depth_fov, v.x, v.y, v.width, v.height);
+		eye.near_z = v.near_z;
+		eye.far_z = v.far_z;
+		eye.min_depth = v.min_depth;
+		eye.max_depth = v.max_depth;
+	}
+	device.updateDescriptorSets(
+	        vk::WriteDescriptorSet{
+	                .dstSet = ds,
+	                .dstBinding = 0,
+	                .descriptorCount = image_info.size(),
+	                .descriptorType = vk::DescriptorType::eCombinedImageSampler,
+	                .pImageInfo = image_info.data(),
+	        },
+	        nullptr);
+
+	cmd_buf.bindPipeline(vk::PipelineBindPoint::eCompute, *pipeline);
+	cmd_buf.bindDescriptorSets(vk::PipelineBindPoint::eCompute, *layout, 0, ds, {});
+	cmd_buf.pushConstants<push_constants>(*layout, vk::ShaderStageFlagBits::eCompute, 0, pc);
+	// Each invocation computes 4 cells, workgroups are 8x8 invocations
+	static_assert(grid_size % 32 == 0);
+	cmd_buf.dispatch(grid_size / 32, grid_size / 8, views.size());
+
+	vk::MemoryBarrier barrier{
+	        .srcAccessMask = vk::AccessFlagBits::eShaderWrite,
+	        .dstAccessMask = vk::AccessFlagBits::eHostRead,
+	};
+	cmd_buf.pipelineBarrier(
+	        vk::PipelineStageFlagBits::eComputeShader,
+	        vk::PipelineStageFlagBits::eHost,
+	        {},
+	        barrier,
+	        nullptr,
+	        nullptr);
+}
+
+std::span<const uint8_t> depth_sampler::values(int view)
+{
+	vmaInvalidateAllocation(vk_allocator::instance(), output, 0, VK_WHOLE_SIZE);
+	return {output.data<uint8_t>() + view * grid_size * grid_size, grid_size * grid_size};
+}
@@ -0,0 +1,72 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "vk/allocation.h"
+#include "wivrn_packets.h"
+#include <array>
+#include <span>
+#include <vulkan/vulkan_raii.hpp>
+
+// Samples the depth layer of the application on a coarse grid of each view of the stream image,
+// for the depth based reprojection of the headset runtime
+class depth_sampler
+{
+	vk::Device device;
+
+	buffer_allocation output;
+
+	vk::raii::Sampler sampler = nullptr;
+	vk::raii::DescriptorSetLayout ds_layout = nullptr;
+	vk::raii::PipelineLayout layout = nullptr;
+	vk::raii::Pipeline pipeline = nullptr;
+	vk::raii::DescriptorPool dp = nullptr;
+	vk::DescriptorSet ds = nullptr;
+
+public:
+	static constexpr uint32_t grid_size = xrt::drivers::wivrn::to_headset::video_stream_depth::grid_size;
+
+	struct view
+	{
+		// In shader read only optimal layout
+		vk::ImageView depth;
+		// Normalized rectangle of the depth image with the view
+		float x, y, width, height;
+		// Field of view of the stream and of the depth image, with the same pose
+		XrFovf stream_fov;
+		XrFovf depth_fov;
+		float near_z;
+		float far_z;
+		float min_depth;
+		float max_depth;
+		xrt::drivers::wivrn::to_headset::video_stream_description::foveation_parameter foveation;
+	};
+
+	depth_sampler() = default;
+	depth_sampler(vk::raii::Device & device, vk::raii::PipelineCache & pipeline_cache);
+
+	// The previous commands recorded for this sampler must have completed
+	void record_draw_commands(vk::raii::CommandBuffer & cmd_buf, const std::array<view, 2> & views);
+
+	// Distances of a view, see to_headset::video_stream_depth.
+	// Only valid once the command buffer recorded by record_draw_commands has completed
+	std::span<const uint8_t> values(int view);
+};
@@ -0,0 +1,574 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "encoder_autotune.h"
+#include "encoder_output.h"
+#include "encoder_settings.h"
+#include "video_encoder.h"
+#include "yuv_converter.h"
+
+#include "os/os_time.h"
+#include "util/u_logging.h"
+#include "utils/scoped_lock.h"
+#include "utils/wivrn_vk_bundle.h"
+#include "utils/xdg_base_directory.h"
+#include "vk/allocation.h"
+#include "vk/vk_allocator.h"
+#include "wivrn_config.h"
+
+#include <magic_enum.hpp>
+#include <nlohmann/json.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <exception>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <thread>
+
+using namespace xrt::drivers::wivrn;
+
+namespace
+{
+using decoder_info = from_headset::headset_info_packet::decoder_info;
+
+// Frames encoded with each candidate, the first ones are not measured
+const int benchmark_frames = 60;
+const int warmup_frames = 10;
+// Distinct images of the test pattern, uploaded once for all candidates
+const int pattern_count = 4;
+
+std::filesystem::path profile_file()
+{
+	return xdg_cache_home() / "wivrn" / "encoder_profiles.json";
+}
+
+nlohmann::json read_profiles()
+{
+	std::ifstream file(profile_file());
+	if (not file)
+		return nlohmann::json::array();
+	try
+	{
+		auto json = nlohmann::json::parse(file);
+		if (json.is_array())
+			return json;
+	}
+	catch (const std::exception & e)
+	{
+		U_LOG_W("Ignoring invalid encoder profiles %s: %s", profile_file().c_str(), e.what());
+	}
+	return nlohmann::json::array();
+}
+
+std::vector<std::string> codec_names(const std::vector<decoder_info> & headset_decoders)
+{
+	std::vector<std::string> res;
+	for (const auto & decoder: headset_decoders)
+		res.emplace_back(magic_enum::enum_name(decoder.codec));
+	std::ranges::sort(res);
+	return res;
+}
+
+// Profiles are only valid for the same GPU, driver and headset decoders
+bool same_device(const nlohmann::json & profile, const vk::PhysicalDeviceProperties & props, const std::vector<std::string> & codecs)
+{
+	return profile.value("vendor_id", 0u) == props.vendorID and
+	       profile.value("device_id", 0u) == props.deviceID and
+	       profile.value("driver_version", 0u) == props.driverVersion and
+	       profile.value("codecs", std::vector<std::string>{}) == codecs;
+}
+
+nlohmann::json encoder_to_json(const configuration::encoder & encoder)
+{
+	nlohmann::json res{
+	        {"encoder", encoder.name},
+	        {"options", encoder.options},
+	};
+	for (auto [name, value]: {
+	             std::pair{"width", encoder.width},
+	             std::pair{"height", encoder.height},
+	             std::pair{"offset_x", encoder.offset_x},
+	             std::pair{"offset_y", encoder.offset_y},
+	     })
+	{
+		if (value)
+			res[name] = *value;
+	}
+	if (encoder.group)
+		res["group"] = *encoder.group;
+	return res;
+}
+
+configuration::encoder encoder_from_json(const nlohmann::json & json)
+{
+	configuration::encoder res{
+	        .name = json.at("encoder").get<std::string>(),
+	};
+	for (auto [name, value]: {
+	             std::pair{"width", &res.width},
+	             std::pair{"height", &res.height},
+	             std::pair{"offset_x", &res.offset_x},
+	             std::pair{"offset_y", &res.offset_y},
+	     })
+	{
+		if (json.contains(name))
+			*value = json[name].get<double>();
+	}
+	if (json.contains("group"))
+		res.group = json["group"].get<int>();
+	if (json.contains("options"))
+		res.options = json["options"].get<std::map<std::string, std::string>>();
+	return res;
+}
+
+struct candidate
+{
+	std::string description;
+	std::vector<configuration::encoder> encoders;
+};
+
+// Encoders usable on this GPU, each with its option variants, in a single encoder
+// and in one encoder per eye running concurrently
+std::vector<candidate> get_candidates(vk::PhysicalDevice physical_device)
+{
+	using options = std::map<std::string, std::string>;
+	std::string name;
+	std::vector<options> variants;
+	[[maybe_unused]] bool nvidia = physical_device.getProperties().vendorID == 0x10DE;
+#ifdef WIVRN_USE_NVENC
+	if (nvidia)
+	{
+		name = encoder_nvenc;
+		variants = {{}, {{"async", "true"}}};
+	}
+#endif
+#ifdef WIVRN_USE_VAAPI
+	if (not nvidia)
+	{
+		name = encoder_vaapi;
+		for (const char * low_power: {"true", "false"})
+		{
+			for (const char * slices: {"1", "4"})
+				variants.push_back({{"low_power", low_power}, {"slices", slices}});
+		}
+	}
+#endif
+#ifdef WIVRN_USE_X265
+	if (name.empty())
+	{
+		name = encoder_x265;
+		variants = {{}, {{"slices", "4"}}};
+	}
+#endif
+
+	std::vector<candidate> res;
+	for (const auto & variant: variants)
+	{
+		std::string description = name;
+		for (const auto & [key, value]: variant)
+			description += " " + key + "=" + value;
+
+		res.push_back({
+		        .description = description,
+		        .encoders = {{.name = name, .options = variant}},
+		});
+		res.push_back({
+		        .description = description + ", one encoder per eye",
+		        .encoders = {
+		                {.name = name, .width = 0.5, .offset_x = 0, .options = variant},
+		                {.name = name, .width = 0.5, .offset_x = 0.5, .options = variant},
+		        },
+		});
+	}
+	return res;
+}
+
+// Records when the last stream of each frame was sent
+class autotune_output : public encoder_output
+{
+	std::mutex mutex;
+	std::vector<int64_t> & send_end;
+	std::vector<int> & streams_sent;
+
+public:
+	autotune_output(std::vector<int64_t> & send_end, std::vector<int> & streams_sent) :
+	        send_end(send_end), streams_sent(streams_sent) {}
+
+	void queue_video_shard(uint8_t stream, std::span<uint8_t> header, std::span<uint8_t> payload) override {}
+	void queue_parity_shard(const to_headset::video_stream_parity_shard &) override {}
+	void flush_stream(uint8_t stream) override {}
+
+	clock_offset get_offset() override
+	{
+		return {};
+	}
+
+	void dump_time(const char * event, uint64_t frame, uint64_t time, uint8_t stream, const char * extra) override
+	{
+		if (std::string_view(event) != "send_end" or frame >= send_end.size())
+			return;
+		std::lock_guard lock(mutex);
+		send_end[frame] = std::max<int64_t>(send_end[frame], time);
+		++streams_sent[frame];
+	}
+};
+
+// Moving gradient with a square crossing the image, as in the encoder benchmark
+class test_pattern
+{
+	wivrn_vk_bundle & bundle;
+	uint32_t width = 0;
+	uint32_t height = 0;
+	std::vector<buffer_allocation> frames;
+
+public:
+	test_pattern(wivrn_vk_bundle & bundle) :
+	        bundle(bundle) {}
+
+	vk::Buffer get(uint32_t w, uint32_t h, uint64_t index)
+	{
+		if (w != width or h != height)
+		{
+			width = w;
+			height = h;
+			frames.clear();
+			for (int i = 0; i < pattern_count; ++i)
+				frames.push_back(generate(i * 16));
+		}
+		return frames[index % frames.size()];
+	}
+
+private:
+	buffer_allocation generate(uint32_t shift)
+	{
+		buffer_allocation res(
+		        bundle.device,
+		        {
+		                .size = size_t(width) * height * 4,
+		                .usage = vk::BufferUsageFlagBits::eTransferSrc,
+		        },
+		        {
+		                .flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT,
+		                .usage = VMA_MEMORY_USAGE_AUTO,
+		        });
+		uint8_t * bgra = res.data();
+		uint32_t square = height / 4;
+		uint32_t square_x = (shift * 8) % width;
+		for (uint32_t y = 0; y < height; ++y)
+		{
+			for (uint32_t x = 0; x < width; ++x)
+			{
+				uint8_t * pixel = bgra + (size_t(y) * width + x) * 4;
+				bool in_square = x >= square_x and x < square_x + square and y >= square and y < 2 * square;
+				pixel[0] = in_square ? 255 : (x + shift * 2) & 0xff;
+				pixel[1] = in_square ? 255 : (y + shift) & 0xff;
+				pixel[2] = in_square ? 255 : ((x + y) / 4) & 0xff;
+				pixel[3] = 255;
+			}
+		}
+		vmaFlushAllocation(vk_allocator::instance(), res, 0, VK_WHOLE_SIZE);
+		return res;
+	}
+};
+
+// Submits frames at the frame rate and returns the 90th percentile, in ms, of the time
+// from the converted image to the end of the last stream, nullopt if a frame was not sent
+std::optional<double> run_candidate(wivrn_vk_bundle & bundle, test_pattern & pattern, std::vector<encoder_settings> & settings, uint32_t width, uint32_t height, float fps)
+{
+	vk::raii::CommandPool command_pool(bundle.device,
+	                                   {
+	                                           .flags = vk::CommandPoolCreateFlagBits::eResetCommandBuffer,
+	                                           .queueFamilyIndex = bundle.queue_family_index,
+	                                   });
+	vk::raii::CommandBuffer cmd = std::move(bundle.device.allocateCommandBuffers(
+	        {.commandPool = *command_pool,
+	         .commandBufferCount = 1})[0]);
+	vk::raii::Fence fence(bundle.device, vk::FenceCreateInfo{});
+
+	const vk::Format format = vk::Format::eB8G8R8A8Unorm;
+	image_allocation rgb(
+	        bundle.device, {
+	                               .flags = vk::ImageCreateFlagBits::eExtendedUsage | vk::ImageCreateFlagBits::eMutableFormat,
+	                               .imageType = vk::ImageType::e2D,
+	                               .format = format,
+	                               .extent = {width, height, 1},
+	                               .mipLevels = 1,
+	                               .arrayLayers = 1,
+	                               .samples = vk::SampleCountFlagBits::e1,
+	                               .tiling = vk::ImageTiling::eOptimal,
+	                               .usage = vk::ImageUsageFlagBits::eStorage | vk::ImageUsageFlagBits::eTransferDst,
+	                               .sharingMode = vk::SharingMode::eExclusive,
+	                       },
+	        {
+	                .usage = VMA_MEMORY_USAGE_AUTO,
+	        });
+	yuv_converter yuv(*bundle.physical_device, bundle.device, bundle.pipeline_cache, rgb, format, vk::Extent2D{width, height});
+
+	std::vector<int64_t> ready(benchmark_frames);
+	std::vector<int64_t> send_end(benchmark_frames);
+	std::vector<int> streams_sent(benchmark_frames);
+	autotune_output out(send_end, streams_sent);
+
+	std::vector<std::unique_ptr<VideoEncoder>> encoders;
+	std::map<int, std::vector<VideoEncoder *>> groups;
+	for (auto & item: settings)
+	{
+		item.stream_width = width;
+		item.stream_height = height;
+		item.skip_static_frames = false;
+		item.spectator_socket.clear();
+		encoders.push_back(VideoEncoder::Create(bundle, item, encoders.size(), width, height, fps));
+		groups[item.group].push_back(encoders.back().get());
+	}
+
+	const auto frame_interval = std::chrono::nanoseconds(int64_t(1e9 / fps));
+	auto next_frame = std::chrono::steady_clock::now();
+	for (uint64_t frame_index = 0; frame_index < benchmark_frames; ++frame_index)
+	{
+		std::this_thread::sleep_until(next_frame);
+		next_frame += frame_interval;
+
+		cmd.reset();
+		cmd.begin(vk::CommandBufferBeginInfo{.flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
+		vk::ImageMemoryBarrier barrier{
+		        .srcAccessMask = vk::AccessFlagBits::eNone,
+		        .dstAccessMask = vk::AccessFlagBits::eTransferWrite,
+		        .oldLayout = vk::ImageLayout::eUndefined,
+		        .newLayout = vk::ImageLayout::eTransferDstOptimal,
+		        .image = rgb,
+		        .subresourceRange = {.aspectMask = vk::ImageAspectFlagBits::eColor,
+		                             .baseMipLevel = 0,
+		                             .levelCount = 1,
+		                             .baseArrayLayer = 0,
+		                             .layerCount = 1},
+		};
+		cmd.pipelineBarrier(vk::PipelineStageFlagBits::eTopOfPipe, vk::PipelineStageFlagBits::eTransfer, {}, nullptr, nullptr, barrier);
+		cmd.copyBufferToImage(
+		        pattern.get(width, height, frame_index),
+		        rgb,
+		        vk::ImageLayout::eTransferDstOptimal,
+		        vk::BufferImageCopy{
+		                .imageSubresource = {
+		                        .aspectMask = vk::ImageAspectFlagBits::eColor,
+		                        .layerCount = 1,
+		                },
+		                .imageExtent = {width, height, 1},
+		        });
+		// yuv_converter expects the layout of a compositor image
+		barrier.srcAccessMask = vk::AccessFlagBits::eTransferWrite;
+		barrier.dstAccessMask = vk::AccessFlagBits::eMemoryRead;
+		barrier.oldLayout = vk::ImageLayout::eTransferDstOptimal;
+		barrier.newLayout = vk::ImageLayout::ePresentSrcKHR;
+		cmd.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eComputeShader, {}, nullptr, nullptr, barrier);
+
+		yuv.record_draw_commands(cmd);
+		for (auto & encoder: encoders)
+			encoder->PresentImage(yuv, cmd, frame_index);
+		cmd.end();
+		{
+			scoped_lock lock(bundle.queue_mutex);
+			bundle.queue.submit(vk::SubmitInfo{.commandBufferCount = 1, .pCommandBuffers = &*cmd}, *fence);
+		}
+		if (auto res = bundle.device.waitForFences(*fence, VK_TRUE, UINT64_MAX); res != vk::Result::eSuccess)
+			throw std::runtime_error("waitForFences: " + vk::to_string(res));
+		bundle.device.resetFences(*fence);
+		ready[frame_index] = os_monotonic_get_ns();
+
+		// Groups run concurrently, as in the compositor encoding threads
+		to_headset::video_stream_data_shard::view_info_t view_info{};
+		view_info.display_time = ready[frame_index] + frame_interval.count();
+		std::vector<std::exception_ptr> errors(groups.size());
+		std::vector<std::thread> threads;
+		for (auto & [group, items]: groups)
+		{
+			threads.emplace_back([&, &items = items, &error = errors[threads.size()]]() {
+				try
+				{
+					for (auto encoder: items)
+						encoder->Encode(out, view_info, frame_index, {}, true);
+				}
+				catch (...)
+				{
+					error = std::current_exception();
+				}
+			});
+		}
+		for (auto & thread: threads)
+			thread.join();
+		for (auto & error: errors)
+		{
+			if (error)
+				std::rethrow_exception(error);
+		}
+	}
+	// Waits for the frames still being encoded
+	encoders.clear();
+
+	std::vector<double> latency;
+	for (int i = warmup_frames; i < benchmark_frames; ++i)
+	{
+		if (streams_sent[i] < int(settings.size()))
+			return std::nullopt;
+		latency.push_back((send_end[i] - ready[i]) / 1e6);
+	}
+	std::ranges::sort(latency);
+	return latency[latency.size() * 9 / 10];
+}
+
+} // namespace
+
+std::optional<std::vector<configuration::encoder>> xrt::drivers::wivrn::load_encoder_profile(vk::PhysicalDevice physical_device, uint32_t width, uint32_t height, const std::vector<decoder_info> & headset_decoders)
+{
+	auto props = physical_device.getProperties();
+	auto codecs = codec_names(headset_decoders);
+	// A configuration fast enough for a larger image is also fast enough for a smaller one
+	const nlohmann::json * best = nullptr;
+	uint64_t best_pixels = std::numeric_limits<uint64_t>::max();
+	auto profiles = read_profiles();
+	for (const auto & profile: profiles)
+	{
+		if (not same_device(profile, props, codecs))
+			continue;
+		uint64_t w = profile.value("width", 0u);
+		uint64_t h = profile.value("height", 0u);
+		if (w < width or h < height or w * h >= best_pixels)
+			continue;
+		best = &profile;
+		best_pixels = w * h;
+	}
+	if (not best)
+		return std::nullopt;
+
+	try
+	{
+		std::vector<configuration::encoder> res;
+		for (const auto & encoder: best->value("encoders", nlohmann::json::array()))
+			res.push_back(encoder_from_json(encoder));
+		return res;
+	}
+	catch (const std::exception & e)
+	{
+		U_LOG_W("Ignoring invalid encoder profile: %s", e.what());
+		return std::nullopt;
+	}
+}
+
+void xrt::drivers::wivrn::autotune_encoders(wivrn_vk_bundle & bundle, uint32_t width, uint32_t height, float fps, const std::vector<decoder_info> & headset_decoders, std::optional<uint64_t> link_capacity)
+{
+	configuration config;
+	try
+	{
+		config = configuration::read_user_configuration();
+	}
+	catch (const std::exception &)
+	{
+		return;
+	}
+	if (not config.encoder_autotune or not config.encoders.empty())
+		return;
+
+	auto props = bundle.physical_device.getProperties();
+	auto codecs = codec_names(headset_decoders);
+	auto profiles = read_profiles();
+	for (const auto & profile: profiles)
+	{
+		if (same_device(profile, props, codecs) and profile.value("width", 0u) == width and profile.value("height", 0u) == height)
+			return;
+	}
+
+	auto candidates = get_candidates(*bundle.physical_device);
+	if (candidates.empty())
+		return;
+
+	// Encoding and sending must keep up with the frame rate
+	const double budget = 1000 / fps;
+	U_LOG_I("Benchmarking %zu encoder configurations for %s at %dx%d, latency budget %.2fms",
+	        candidates.size(),
+	        props.deviceName.data(),
+	        width,
+	        height,
+	        budget);
+
+	test_pattern pattern(bundle);
+	const candidate * best = nullptr;
+	double best_latency = std::numeric_limits<double>::infinity();
+	for (const auto & item: candidates)
+	{
+		try
+		{
+			uint32_t stream_width = width;
+			uint32_t stream_height = height;
+			auto settings = get_encoder_settings(*bundle.physical_device, stream_width, stream_height, item.encoders, headset_decoders, link_capacity);
+			auto latency = run_candidate(bundle, pattern, settings, stream_width, stream_height, fps);
+			if (not latency)
+			{
+				U_LOG_I("\t%s: frames were not sent", item.description.c_str());
+				continue;
+			}
+			U_LOG_I("\t%s: %.2fms", item.description.c_str(), *latency);
+			if (*latency <= budget and *latency < best_latency)
+			{
+				best = &item;
+				best_latency = *latency;
+			}
+		}
+		catch (const std::exception & e)
+		{
+			U_LOG_I("\t%s: %s", item.description.c_str(), e.what());
+		}
+	}
+
+	// Also stored when no candidate is fast enough, so that the benchmark does not run on each connection
+	nlohmann::json profile{
+	        {"device_name", props.deviceName.data()},
+	        {"vendor_id", props.vendorID},
+	        {"device_id", props.deviceID},
+	        {"driver_version", props.driverVersion},
+	        {"codecs", codecs},
+	        {"width", width},
+	        {"height", height},
+	        {"fps", fps},
+	        {"encoders", nlohmann::json::array()},
+	};
+	if (best)
+	{
+		U_LOG_I("Using %s by default, %.2fms", best->description.c_str(), best_latency);
+		for (const auto & encoder: best->encoders)
+			profile["encoders"].push_back(encoder_to_json(encoder));
+		profile["latency"] = best_latency;
+	}
+	else
+		U_LOG_W("No encoder configuration met the latency budget, using the default one");
+	profiles.push_back(profile);
+
+	try
+	{
+		std::filesystem::create_directories(profile_file().parent_path());
+		std::ofstream(profile_file()) << profiles.dump(1, '\t') << std::endl;
+	}
+	catch (const std::exception & e)
+	{
+		U_LOG_W("Failed to save encoder profile %s: %s", profile_file().c_str(), e.what());
+	}
+}
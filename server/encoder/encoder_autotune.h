@@ -0,0 +1,54 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "driver/configuration.h"
+#include "wivrn_packets.h"
+
+#include <cstdint>
+#include <optional>
+#include <vector>
+#include <vulkan/vulkan.hpp>
+
+struct wivrn_vk_bundle;
+
+namespace xrt::drivers::wivrn
+{
+
+// Encoders chosen by the autotuner for this GPU and headset decoders, from the profile of the
+// smallest resolution at least as large as width x height, nullopt if there is none.
+// An empty list means that no candidate met the latency budget.
+std::optional<std::vector<configuration::encoder>> load_encoder_profile(vk::PhysicalDevice physical_device,
+                                                                        uint32_t width,
+                                                                        uint32_t height,
+                                                                        const std::vector<from_headset::headset_info_packet::decoder_info> & headset_decoders);
+
+// Encodes a test pattern for a few seconds with each candidate encoder, option and layout, and
+// stores the fastest one that meets the latency budget in the profile cache.
+// Does nothing if encoders are configured, the autotuner is disabled or a profile already exists.
+void autotune_encoders(wivrn_vk_bundle & bundle,
+                       uint32_t width,
+                       uint32_t height,
+                       float fps,
+                       const std::vector<from_headset::headset_info_packet::decoder_info> & headset_decoders,
+                       std::optional<uint64_t> link_capacity);
+
+} // namespace xrt::drivers::wivrn
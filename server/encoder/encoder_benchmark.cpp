@@ -0,0 +1,584 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Encodes a sequence of raw frames with a single encoder, without a headset,
+// and reports encoding latency, frame sizes and throughput as json.
+
+#include "encoder_output.h"
+#include "video_encoder.h"
+#include "yuv_converter.h"
+
+#include "os/os_threading.h"
+#include "os/os_time.h"
+#include "util/u_logging.h"
+#include "utils/scoped_lock.h"
+#include "utils/wivrn_vk_bundle.h"
+#include "vk/allocation.h"
+#include "vk/vk_allocator.h"
+#include "vk/vk_helpers.h"
+#include "wivrn_config.h"
+
+#include <CLI/CLI.hpp>
+#include <nlohmann/json.hpp>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <numeric>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace xrt::drivers::wivrn;
+
+namespace
+{
+
+// Same as wivrn_comp_target::wanted_device_extensions, plus swapchain for the present src layout
+std::vector<const char *> wanted_device_extensions = {
+#ifdef VK_KHR_swapchain
+        VK_KHR_SWAPCHAIN_EXTENSION_NAME,
+#endif
+#ifdef VK_KHR_external_memory_fd
+        VK_KHR_EXTERNAL_MEMORY_FD_EXTENSION_NAME,
+#endif
+#ifdef VK_EXT_external_memory_dma_buf
+        VK_EXT_EXTERNAL_MEMORY_DMA_BUF_EXTENSION_NAME,
+#endif
+#ifdef VK_EXT_image_drm_format_modifier
+        VK_EXT_IMAGE_DRM_FORMAT_MODIFIER_EXTENSION_NAME,
+#endif
+#ifdef VK_KHR_video_queue
+        VK_KHR_VIDEO_QUEUE_EXTENSION_NAME,
+#endif
+#ifdef VK_KHR_video_encode_queue
+        VK_KHR_VIDEO_ENCODE_QUEUE_EXTENSION_NAME,
+#endif
+#ifdef VK_KHR_video_encode_h265
+        VK_KHR_VIDEO_ENCODE_H265_EXTENSION_NAME,
+#endif
+};
+
+struct frame_stats
+{
+	bool idr = false;
+	// Server clock, 0 if the event did not happen
+	int64_t encode_begin = 0;
+	int64_t encode_end = 0;
+	int64_t send_end = 0;
+	size_t bytes = 0;
+	int slices = 0;
+	// Negative if the encoder does not report it
+	float average_qp = -1;
+};
+
+// Records the timing events and sizes of encoded frames instead of sending them
+class benchmark_output : public encoder_output
+{
+	std::mutex mutex;
+	std::vector<frame_stats> & frames;
+	// frame of the shards being received
+	uint64_t current = -1;
+
+	frame_stats * get(uint64_t frame)
+	{
+		if (frame >= frames.size())
+			return nullptr;
+		return &frames[frame];
+	}
+
+public:
+	benchmark_output(std::vector<frame_stats> & frames) :
+	        frames(frames) {}
+
+	void queue_video_shard(uint8_t stream, std::span<uint8_t> header, std::span<uint8_t> payload) override
+	{
+		std::lock_guard lock(mutex);
+		if (auto stats = get(current))
+			stats->bytes += payload.size();
+	}
+
+	void queue_parity_shard(const to_headset::video_stream_parity_shard &) override {}
+
+	void flush_stream(uint8_t stream) override {}
+
+	clock_offset get_offset() override
+	{
+		// Headset and server clocks are the same
+		return {};
+	}
+
+	void dump_time(const char * event_name, uint64_t frame, uint64_t time, uint8_t stream, const char * extra) override
+	{
+		std::string_view event = event_name;
+		std::lock_guard lock(mutex);
+		auto stats = get(frame);
+		if (not stats)
+			return;
+		if (event == "encode_begin")
+		{
+			stats->encode_begin = time;
+			stats->idr = std::string(extra) == ",idr";
+		}
+		else if (event == "encode_end")
+			stats->encode_end = time;
+		else if (event == "send_begin")
+			current = frame;
+		else if (event == "send_end")
+			stats->send_end = time;
+		else if (event == "frame_stats")
+			// ,type,bytes,slices,qp,encode_time
+			std::sscanf(extra, ",%*[^,],%*u,%d,%f", &stats->slices, &stats->average_qp);
+	}
+};
+
+class frame_source
+{
+	uint32_t width;
+	uint32_t height;
+	std::ifstream file;
+	size_t file_frames = 0;
+
+public:
+	frame_source(const std::string & filename, uint32_t width, uint32_t height) :
+	        width(width), height(height)
+	{
+		if (filename.empty())
+			return;
+		file.open(filename, std::ios::binary | std::ios::ate);
+		if (not file)
+			throw std::runtime_error("Failed to open " + filename);
+		file_frames = size_t(file.tellg()) / frame_size();
+		if (file_frames == 0)
+			throw std::runtime_error(filename + " does not contain a " + std::to_string(width) + "x" + std::to_string(height) + " frame");
+	}
+
+	size_t frame_size() const
+	{
+		return size_t(width) * height * 4;
+	}
+
+	// Number of frames in the file, 0 for generated frames
+	size_t size() const
+	{
+		return file_frames;
+	}
+
+	// Frames of the file are repeated if more are requested
+	void read(uint64_t index, uint8_t * bgra)
+	{
+		if (file_frames)
+		{
+			file.seekg((index % file_frames) * frame_size());
+			file.read((char *)bgra, frame_size());
+			if (not file)
+				throw std::runtime_error("Failed to read frame " + std::to_string(index));
+			return;
+		}
+
+		// Moving gradient, with a square crossing the image
+		uint32_t square = height / 4;
+		uint32_t square_x = (index * 8) % width;
+		for (uint32_t y = 0; y < height; ++y)
+		{
+			for (uint32_t x = 0; x < width; ++x)
+			{
+				uint8_t * pixel = bgra + (size_t(y) * width + x) * 4;
+				bool in_square = x >= square_x and x < square_x + square and y >= square and y < 2 * square;
+				pixel[0] = in_square ? 255 : (x + index * 2) & 0xff;
+				pixel[1] = in_square ? 255 : (y + index) & 0xff;
+				pixel[2] = in_square ? 255 : ((x + y) / 4) & 0xff;
+				pixel[3] = 255;
+			}
+		}
+	}
+};
+
+nlohmann::json distribution(std::vector<double> values)
+{
+	if (values.empty())
+		return {};
+	std::ranges::sort(values);
+	auto percentile = [&](double p) {
+		return values[std::min<size_t>(values.size() * p, values.size() - 1)];
+	};
+	return {
+	        {"mean", std::accumulate(values.begin(), values.end(), 0.) / values.size()},
+	        {"min", values.front()},
+	        {"p50", percentile(0.5)},
+	        {"p90", percentile(0.9)},
+	        {"p99", percentile(0.99)},
+	        {"max", values.back()},
+	};
+}
+
+nlohmann::json histogram(const std::vector<double> & values, double bucket)
+{
+	std::vector<size_t> counts;
+	for (double value: values)
+	{
+		size_t i = value / bucket;
+		if (i >= counts.size())
+			counts.resize(i + 1);
+		++counts[i];
+	}
+	nlohmann::json res = nlohmann::json::array();
+	for (size_t i = 0; i < counts.size(); ++i)
+		res.push_back({{"upper", (i + 1) * bucket}, {"count", counts[i]}});
+	return res;
+}
+
+double to_ms(int64_t ns)
+{
+	return ns / 1e6;
+}
+
+} // namespace
+
+int main(int argc, char * argv[])
+{
+	CLI::App app{"Encode raw frames without a headset and report encoder performance"};
+
+	std::string input;
+	std::string output;
+	uint32_t width = 1920;
+	uint32_t height = 1080;
+	uint64_t frame_count = 0;
+	float fps = 90;
+	bool realtime = false;
+	uint64_t idr_interval = 0;
+	double bucket = 0.5;
+	size_t gpu = 0;
+	std::string codec = "h265";
+	std::string device_path;
+	std::vector<std::string> options;
+
+	encoder_settings settings{};
+	settings.bitrate = 50'000'000;
+#if defined(WIVRN_USE_NVENC)
+	settings.encoder_name = encoder_nvenc;
+#elif defined(WIVRN_USE_VAAPI)
+	settings.encoder_name = encoder_vaapi;
+#else
+	settings.encoder_name = encoder_x265;
+#endif
+
+	app.add_option("input", input, "raw bgra frames, as written by ffmpeg -pix_fmt bgra -f rawvideo; a test pattern is generated if omitted")->check(CLI::ExistingFile);
+	app.add_option("-o,--output", output, "write the json report to this file instead of the standard output");
+	app.add_option("-W,--width", width, "width of the frames")->capture_default_str();
+	app.add_option("-H,--height", height, "height of the frames")->capture_default_str();
+	app.add_option("-n,--frames", frame_count, "number of frames to encode, the input is repeated if needed (default: all the input, or 300 frames)");
+	app.add_option("-e,--encoder", settings.encoder_name, "encoder: nvenc, vaapi, x265 or vulkan")->capture_default_str();
+	app.add_option("-c,--codec", codec, "codec: h264, h265 or av1")->check(CLI::IsMember({"h264", "h265", "av1"}))->capture_default_str();
+	app.add_option("-b,--bitrate", settings.bitrate, "bitrate in bit/s")->capture_default_str();
+	app.add_option("--fps", fps, "frame rate given to the encoder")->capture_default_str();
+	app.add_option("--option", options, "encoder option, as key=value, see the options in configuration.md");
+	app.add_option("--device", device_path, "device for vaapi, such as /dev/dri/renderD128");
+	app.add_option("--intra-refresh", settings.intra_refresh, "intra refresh period in frames, for nvenc and x265");
+	app.add_option("--idr-interval", idr_interval, "request an IDR frame every n frames, as when the headset loses frames (default: only the first frame)");
+	app.add_flag("--realtime", realtime, "submit frames at the frame rate instead of as fast as possible");
+	app.add_option("--histogram-bucket", bucket, "width of the latency histogram buckets in ms")->capture_default_str();
+	app.add_option("--gpu", gpu, "index of the Vulkan physical device")->capture_default_str();
+
+	CLI11_PARSE(app, argc, argv);
+
+	for (const auto & option: options)
+	{
+		auto sep = option.find('=');
+		if (sep == std::string::npos)
+		{
+			std::cerr << "Invalid option " << option << ", expected key=value" << std::endl;
+			return EXIT_FAILURE;
+		}
+		settings.options[option.substr(0, sep)] = option.substr(sep + 1);
+	}
+
+	if (codec == "h264")
+		settings.codec = h264;
+	else if (codec == "av1")
+		settings.codec = av1;
+	else
+		settings.codec = h265;
+
+	if (not device_path.empty())
+		settings.device = device_path;
+
+	settings.width = width;
+	settings.height = height;
+	settings.video_width = width;
+	settings.video_height = height;
+	settings.stream_width = width;
+	settings.stream_height = height;
+
+	try
+	{
+		frame_source source(input, width, height);
+		if (frame_count == 0)
+			frame_count = source.size() ? source.size() : 300;
+
+		vk::raii::Context vk_ctx;
+		vk::ApplicationInfo app_info{
+		        .pApplicationName = "wivrn-encoder-benchmark",
+		        .apiVersion = VK_API_VERSION_1_3,
+		};
+		vk::raii::Instance instance(vk_ctx, vk::InstanceCreateInfo{.pApplicationInfo = &app_info});
+
+		auto physical_devices = instance.enumeratePhysicalDevices();
+		if (gpu >= physical_devices.size())
+			throw std::runtime_error("No Vulkan device " + std::to_string(gpu));
+		vk::raii::PhysicalDevice physical_device = std::move(physical_devices[gpu]);
+
+		// Same kind of queue as the one used by monado
+		auto queue_families = physical_device.getQueueFamilyProperties();
+		auto queue_family = std::ranges::find_if(queue_families, [](const vk::QueueFamilyProperties & props) {
+			return (props.queueFlags & vk::QueueFlagBits::eGraphics) and (props.queueFlags & vk::QueueFlagBits::eCompute);
+		});
+		if (queue_family == queue_families.end())
+			throw std::runtime_error("No graphics and compute queue");
+		uint32_t queue_family_index = queue_family - queue_families.begin();
+
+		std::vector<const char *> device_extensions;
+		for (auto & ext: physical_device.enumerateDeviceExtensionProperties())
+		{
+			for (const char * wanted: wanted_device_extensions)
+			{
+				if (std::string(wanted) == ext.extensionName)
+					device_extensions.push_back(wanted);
+			}
+		}
+
+		float queue_priority = 1;
+		vk::DeviceQueueCreateInfo queue_info{
+		        .queueFamilyIndex = queue_family_index,
+		        .queueCount = 1,
+		        .pQueuePriorities = &queue_priority,
+		};
+		vk::PhysicalDeviceVulkan12Features features12{
+		        .timelineSemaphore = true,
+		};
+		vk::raii::Device device(physical_device,
+		                        vk::DeviceCreateInfo{
+		                                .pNext = &features12,
+		                                .queueCreateInfoCount = 1,
+		                                .pQueueCreateInfos = &queue_info,
+		                                .enabledExtensionCount = uint32_t(device_extensions.size()),
+		                                .ppEnabledExtensionNames = device_extensions.data(),
+		                        });
+
+		// Only the members read by wivrn_vk_bundle
+		vk_bundle vk{};
+		vk.instance = *instance;
+		vk.physical_device = *physical_device;
+		vk.device = *device;
+		vk.queue_family_index = queue_family_index;
+		vk.queue_index = 0;
+		os_mutex_init(&vk.queue_mutex);
+
+		std::vector<frame_stats> frames(frame_count);
+		benchmark_output out(frames);
+		int64_t wall_begin;
+		int64_t wall_end;
+		{
+			std::vector<const char *> instance_extensions;
+			wivrn_vk_bundle bundle(vk, instance_extensions, device_extensions);
+
+			vk::raii::CommandPool command_pool(bundle.device,
+			                                   {
+			                                           .flags = vk::CommandPoolCreateFlagBits::eResetCommandBuffer,
+			                                           .queueFamilyIndex = bundle.queue_family_index,
+			                                   });
+			vk::raii::CommandBuffer cmd = std::move(bundle.device.allocateCommandBuffers(
+			        {.commandPool = *command_pool,
+			         .commandBufferCount = 1})[0]);
+			vk::raii::Fence fence(bundle.device, vk::FenceCreateInfo{});
+
+			const vk::Format format = vk::Format::eB8G8R8A8Unorm;
+			const vk::Extent2D extent{width, height};
+			image_allocation rgb(
+			        bundle.device, {
+			                               .flags = vk::ImageCreateFlagBits::eExtendedUsage | vk::ImageCreateFlagBits::eMutableFormat,
+			                               .imageType = vk::ImageType::e2D,
+			                               .format = format,
+			                               .extent = {width, height, 1},
+			                               .mipLevels = 1,
+			                               .arrayLayers = 1,
+			                               .samples = vk::SampleCountFlagBits::e1,
+			                               .tiling = vk::ImageTiling::eOptimal,
+			                               .usage = vk::ImageUsageFlagBits::eStorage | vk::ImageUsageFlagBits::eTransferDst,
+			                               .sharingMode = vk::SharingMode::eExclusive,
+			                       },
+			        {
+			                .usage = VMA_MEMORY_USAGE_AUTO,
+			        });
+			yuv_converter yuv(*bundle.physical_device, bundle.device, bundle.pipeline_cache, rgb, format, extent);
+
+			buffer_allocation staging(
+			        bundle.device,
+			        {
+			                .size = source.frame_size(),
+			                .usage = vk::BufferUsageFlagBits::eTransferSrc,
+			        },
+			        {
+			                .flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT,
+			                .usage = VMA_MEMORY_USAGE_AUTO,
+			        });
+
+			auto encoder = VideoEncoder::Create(bundle, settings, 0, width, height, fps);
+			std::cerr << "Encoding " << frame_count << " frames with " << settings.encoder_name << std::endl;
+
+			const auto frame_interval = std::chrono::nanoseconds(int64_t(1e9 / fps));
+			auto next_frame = std::chrono::steady_clock::now();
+			wall_begin = os_monotonic_get_ns();
+			for (uint64_t frame_index = 0; frame_index < frame_count; ++frame_index)
+			{
+				if (realtime)
+				{
+					std::this_thread::sleep_until(next_frame);
+					next_frame += frame_interval;
+				}
+				if (idr_interval > 0 and frame_index > 0 and frame_index % idr_interval == 0)
+					encoder->SyncNeeded();
+
+				source.read(frame_index, staging.data());
+				vmaFlushAllocation(vk_allocator::instance(), staging, 0, VK_WHOLE_SIZE);
+
+				cmd.reset();
+				cmd.begin(vk::CommandBufferBeginInfo{.flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
+				vk::ImageMemoryBarrier barrier{
+				        .srcAccessMask = vk::AccessFlagBits::eNone,
+				        .dstAccessMask = vk::AccessFlagBits::eTransferWrite,
+				        .oldLayout = vk::ImageLayout::eUndefined,
+				        .newLayout = vk::ImageLayout::eTransferDstOptimal,
+				        .image = rgb,
+				        .subresourceRange = {.aspectMask = vk::ImageAspectFlagBits::eColor,
+				                             .baseMipLevel = 0,
+				                             .levelCount = 1,
+				                             .baseArrayLayer = 0,
+				                             .layerCount = 1},
+				};
+				cmd.pipelineBarrier(vk::PipelineStageFlagBits::eTopOfPipe, vk::PipelineStageFlagBits::eTransfer, {}, nullptr, nullptr, barrier);
+				cmd.copyBufferToImage(
+				        staging,
+				        rgb,
+				        vk::ImageLayout::eTransferDstOptimal,
+				        vk::BufferImageCopy{
+				                .imageSubresource = {
+				                        .aspectMask = vk::ImageAspectFlagBits::eColor,
+				                        .layerCount = 1,
+				                },
+				                .imageExtent = {width, height, 1},
+				        });
+				// yuv_converter expects the layout of a compositor image
+				barrier.srcAccessMask = vk::AccessFlagBits::eTransferWrite;
+				barrier.dstAccessMask = vk::AccessFlagBits::eMemoryRead;
+				barrier.oldLayout = vk::ImageLayout::eTransferDstOptimal;
+				barrier.newLayout = vk::ImageLayout::ePresentSrcKHR;
+				cmd.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eComputeShader, {}, nullptr, nullptr, barrier);
+
+				yuv.record_draw_commands(cmd);
+				encoder->PresentImage(yuv, cmd, frame_index);
+				cmd.end();
+				{
+					scoped_lock lock(bundle.queue_mutex);
+					bundle.queue.submit(vk::SubmitInfo{.commandBufferCount = 1, .pCommandBuffers = &*cmd}, *fence);
+				}
+				if (auto res = bundle.device.waitForFences(*fence, VK_TRUE, UINT64_MAX); res != vk::Result::eSuccess)
+					throw std::runtime_error("waitForFences: " + vk::to_string(res));
+				bundle.device.resetFences(*fence);
+
+				to_headset::video_stream_data_shard::view_info_t view_info{};
+				view_info.display_time = os_monotonic_get_ns() + frame_interval.count();
+				encoder->Encode(out, view_info, frame_index, {}, true);
+			}
+			// Waits for the frames still being encoded
+			encoder.reset();
+			wall_end = os_monotonic_get_ns();
+		}
+		os_mutex_destroy(&vk.queue_mutex);
+
+		std::vector<double> latency;
+		std::vector<double> blocking;
+		std::vector<double> sizes;
+		std::vector<double> idr_sizes;
+		nlohmann::json per_frame = nlohmann::json::array();
+		size_t dropped = 0;
+		for (size_t i = 0; i < frames.size(); ++i)
+		{
+			const auto & f = frames[i];
+			if (not f.send_end)
+			{
+				++dropped;
+				continue;
+			}
+			latency.push_back(to_ms(f.send_end - f.encode_begin));
+			blocking.push_back(to_ms(f.encode_end - f.encode_begin));
+			(f.idr ? idr_sizes : sizes).push_back(f.bytes);
+			per_frame.push_back({
+			        {"frame", i},
+			        {"idr", f.idr},
+			        {"latency", latency.back()},
+			        {"blocking", blocking.back()},
+			        {"bytes", f.bytes},
+			        {"slices", f.slices},
+			        {"average_qp", f.average_qp},
+			});
+		}
+
+		double duration = (wall_end - wall_begin) / 1e9;
+		double total_bytes = std::accumulate(sizes.begin(), sizes.end(), 0.) + std::accumulate(idr_sizes.begin(), idr_sizes.end(), 0.);
+		nlohmann::json report{
+		        {"encoder", settings.encoder_name},
+		        {"codec", codec},
+		        {"width", settings.video_width},
+		        {"height", settings.video_height},
+		        {"fps", fps},
+		        {"bitrate", settings.bitrate},
+		        {"options", settings.options},
+		        {"realtime", realtime},
+		        {"frames", frame_count},
+		        {"dropped", dropped},
+		        {"duration", duration},
+		        {"throughput", (frame_count - dropped) / duration},
+		        {"output_bitrate", total_bytes * 8 / duration},
+		        // ms, from the start of encoding to the end of the frame data
+		        {"latency", distribution(latency)},
+		        {"latency_histogram", histogram(latency, bucket)},
+		        // ms, time the encoding thread is busy with each frame
+		        {"blocking", distribution(blocking)},
+		        // bytes
+		        {"size", distribution(sizes)},
+		        {"idr_size", distribution(idr_sizes)},
+		        {"per_frame", per_frame},
+		};
+
+		if (output.empty())
+			std::cout << report.dump(1, '\t') << std::endl;
+		else
+			std::ofstream(output) << report.dump(1, '\t') << std::endl;
+	}
+	catch (std::exception & e)
+	{
+		std::cerr << e.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
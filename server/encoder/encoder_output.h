@@ -0,0 +1,63 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "driver/clock_offset.h"
+#include "wivrn_packets.h"
+
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string>
+
+namespace xrt::drivers::wivrn
+{
+
+// Destination of the encoded video: the session, or a benchmark without any headset
+class encoder_output
+{
+public:
+	virtual ~encoder_output() = default;
+
+	// Serialized video_stream_data_shard header and its payload, sent on the next flush_stream.
+	// Each stream item may have its own socket, its packets are flushed before queuing others.
+	virtual void queue_video_shard(uint8_t stream, std::span<uint8_t> header, std::span<uint8_t> payload) = 0;
+	virtual void queue_parity_shard(const to_headset::video_stream_parity_shard &) = 0;
+	virtual void flush_stream(uint8_t stream) = 0;
+
+	// Identifies the last datagram sent by flush_stream from the calling thread,
+	// unset if the send time cannot be known
+	virtual std::optional<uint32_t> last_stream_datagram(uint8_t stream)
+	{
+		return std::nullopt;
+	}
+	// Time the datagram was handed to the network interface, on the server clock
+	virtual std::optional<int64_t> stream_send_time(uint8_t stream, uint32_t datagram)
+	{
+		return std::nullopt;
+	}
+
+	virtual clock_offset get_offset() = 0;
+
+	// event must have static storage duration
+	virtual void dump_time(const char * event, uint64_t frame, uint64_t time, uint8_t stream = -1, const char * extra = "") = 0;
+};
+
+} // namespace xrt::drivers::wivrn
@@ -19,11 +19,15 @@
 
 #include "encoder_settings.h"
 #include "driver/configuration.h"
+#include "encoder_autotune.h"
 #include "util/u_logging.h"
 #include "video_encoder.h"
 
+#include <algorithm>
 #include <cmath>
+#include <limits>
 #include <magic_enum.hpp>
+#include <map>
 #include <string>
 #include <vulkan/vulkan.h>
 
@@ -40,6 +44,18 @@ using namespace xrt::drivers::wivrn;
 
 // TODO: size independent bitrate
 static const uint64_t default_bitrate = 50'000'000;
+static const double default_scale = 0.8;
+// Share of the measured link capacity used for video
+static const double link_usage = 0.5;
+static const uint64_t min_link_bitrate = 10'000'000;
+static const uint64_t max_link_bitrate = 100'000'000;
+// Scale is not reduced below this for slow links
+static const double min_link_scale = 0.5;
+
+uint64_t xrt::drivers::wivrn::link_bitrate(uint64_t link_capacity)
+{
+	return std::clamp<uint64_t>(link_capacity * link_usage, min_link_bitrate, max_link_bitrate);
+}
 
 static bool is_nvidia(vk::PhysicalDevice physical_device)
 {
@@ -47,6 +63,53 @@ static bool is_nvidia(vk::PhysicalDevice physical_device)
 	return props.vendorID == 0x10DE;
 }
 
+// Number of queues able to encode video, drivers expose one per hardware encoding engine
+static uint32_t encode_engine_count(vk::PhysicalDevice physical_device)
+{
+	uint32_t count = 0;
+#ifdef VK_KHR_video_encode_queue
+	for (const auto & family: physical_device.getQueueFamilyProperties())
+	{
+		if (family.queueFlags & vk::QueueFlagBits::eVideoEncodeKHR)
+			count += family.queueCount;
+	}
+#endif
+	return count;
+}
+
+// One encoder per eye in separate groups, so that they run concurrently on different engines
+static std::vector<configuration::encoder> split_per_eye(const std::string & name)
+{
+	return {
+	        {
+	                .name = name,
+	                .width = 0.5,
+	                .offset_x = 0,
+	        },
+	        {
+	                .name = name,
+	                .width = 0.5,
+	                .offset_x = 0.5,
+	        },
+	};
+}
+
+// Layered foveation: one encoder per eye for the high resolution insets, in separate groups.
+// The background is added once the size of the stream is known.
+static std::vector<configuration::encoder> split_inset(const configuration::encoder & base, double inset)
+{
+	std::vector<configuration::encoder> res(2, base);
+	for (int eye = 0; eye < 2; ++eye)
+	{
+		res[eye].width = inset / 2;
+		res[eye].height = inset;
+		res[eye].offset_x = (eye + 0.5 - inset / 2) / 2;
+		res[eye].offset_y = (1 - inset) / 2;
+		res[eye].group = eye;
+	}
+	return res;
+}
+
 static void split_bitrate(std::vector<xrt::drivers::wivrn::encoder_settings> & encoders, uint64_t bitrate)
 {
 	double total_weight = 0;
@@ -80,7 +143,15 @@ void print_encoders(const std::vector<xrt::drivers::wivrn::encoder_settings> & e
 		        encoder.height,
 		        encoder.offset_x,
 		        encoder.offset_y);
+		if (encoder.source)
+			U_LOG_I("\tscaled from %dx%d", encoder.source->width, encoder.source->height);
 		U_LOG_I("\tbitrate: %ldMbit/s", encoder.bitrate / 1'000'000);
+		if (encoder.fec_ratio > 0)
+			U_LOG_I("\tFEC ratio: %.2f", encoder.fec_ratio);
+		if (encoder.intra_refresh > 0)
+			U_LOG_I("\tintra refresh: %d frames", encoder.intra_refresh);
+		if (encoder.non_reference_frames)
+			U_LOG_I("\tnon-reference frames");
 	}
 }
 
@@ -104,11 +175,117 @@ static void check_scale(std::string_view encoder_name, video_codec codec, uint16
 #endif
 }
 
+using decoder_info = from_headset::headset_info_packet::decoder_info;
+
+// Codecs by order of preference, most efficient first
+static const std::array codec_preference = {av1, h265, h264};
+
+// A less efficient codec is only used if it decodes this much faster
+static const float decode_time_margin = 1.2;
+
+static std::vector<video_codec> get_encoder_codecs(const std::string & encoder_name)
+{
+#ifdef WIVRN_USE_NVENC
+	if (encoder_name == encoder_nvenc)
+	{
+		try
+		{
+			return VideoEncoderNvenc::supported_codecs();
+		}
+		catch (const std::exception & e)
+		{
+			U_LOG_W("Failed to query nvenc codecs: %s", e.what());
+		}
+	}
+#endif
+	// vaapi cannot be probed, AV1 must be requested in the configuration
+	if (encoder_name == encoder_vaapi)
+		return {h265, h264};
+	return {h265};
+}
+
+static std::vector<std::string> compiled_encoders()
+{
+	std::vector<std::string> res;
+#ifdef WIVRN_USE_X265
+	res.push_back(encoder_x265);
+#endif
+#ifdef WIVRN_USE_NVENC
+	res.push_back(encoder_nvenc);
+#endif
+#ifdef WIVRN_USE_VAAPI
+	res.push_back(encoder_vaapi);
+#endif
+#ifdef WIVRN_USE_VULKAN_ENCODE
+	res.push_back(encoder_vulkan);
+#endif
+	return res;
+}
+
+bool xrt::drivers::wivrn::replace_failed_encoder(encoder_settings & settings, const std::set<std::string> & failed)
+{
+	if (not failed.contains(settings.encoder_name))
+		return true;
+
+	for (const auto & name: compiled_encoders())
+	{
+		if (failed.contains(name))
+			continue;
+		// Keep the codec the headset already decodes if possible
+		auto codecs = get_encoder_codecs(name);
+		if (std::ranges::find(codecs, settings.codec) == codecs.end())
+			settings.codec = codecs.front();
+		settings.encoder_name = name;
+		settings.options.clear();
+		settings.device.reset();
+		return true;
+	}
+	return false;
+}
+
+static video_codec choose_codec(const std::vector<video_codec> & encoder_codecs, const std::vector<decoder_info> & headset_decoders)
+{
+	// Headsets that do not report their decoders only support h265
+	if (headset_decoders.empty())
+		return h265;
+
+	std::vector<decoder_info> candidates;
+	for (auto codec: codec_preference)
+	{
+		auto decoder = std::ranges::find(headset_decoders, codec, &decoder_info::codec);
+		if (decoder != headset_decoders.end() and std::ranges::find(encoder_codecs, codec) != encoder_codecs.end())
+			candidates.push_back(*decoder);
+	}
+	if (candidates.empty())
+		return h265;
+
+	// Use the most efficient codec, unless the headset measured that another one decodes noticeably faster.
+	// Codecs that have not been measured yet are assumed to be fast enough.
+	float fastest = std::numeric_limits<float>::infinity();
+	for (const auto & decoder: candidates)
+	{
+		if (decoder.decode_time > 0)
+			fastest = std::min(fastest, decoder.decode_time);
+	}
+	for (const auto & decoder: candidates)
+	{
+		if (decoder.decode_time == 0 or decoder.decode_time <= fastest * decode_time_margin)
+			return decoder.codec;
+	}
+	return candidates.front().codec;
+}
+
 static std::vector<configuration::encoder> get_encoder_default_settings(vk::PhysicalDevice physical_device)
 {
+	uint32_t engines = encode_engine_count(physical_device);
 	if (is_nvidia(physical_device))
 	{
 #ifdef WIVRN_USE_NVENC
+		if (engines > 1)
+		{
+			U_LOG_I("%d encoding engines detected, using one encoder per eye", engines);
+			return split_per_eye(encoder_nvenc);
+		}
 		return {{.name = encoder_nvenc}};
 #elif defined(WIVRN_USE_X265)
 		U_LOG_W("nvidia GPU detected, but x265 support not compiled");
@@ -121,6 +298,11 @@ static std::vector<configuration::encoder> get_encoder_default_settings(vk::Phys
 	else
 	{
 #ifdef WIVRN_USE_VAAPI
+		if (engines > 1)
+		{
+			U_LOG_I("%d encoding engines detected, using one encoder per eye", engines);
+			return split_per_eye(encoder_vaapi);
+		}
 		return {{.name = encoder_vaapi}};
 // Split encoders have been reported to cause issues, don't use them in default configuration
 #ifdef WIVRN_SPLIT_ENCODERS
@@ -177,21 +359,60 @@ static void make_even(uint16_t & value, uint16_t max)
 	value = std::min(value, max);
 }
 
-std::vector<encoder_settings> xrt::drivers::wivrn::get_encoder_settings(vk::PhysicalDevice physical_device, uint32_t & width, uint32_t & height)
+static configuration read_configuration()
 {
-	configuration config;
 	try
 	{
-		config = configuration::read_user_configuration();
+		return configuration::read_user_configuration();
 	}
 	catch (const std::exception & e)
 	{
 		U_LOG_E("Failed to read encoder configuration: %s", e.what());
 	}
-	if (config.encoders.empty())
-		config.encoders = get_encoder_default_settings(physical_device);
+	return {};
+}
+
+static std::vector<encoder_settings> make_encoder_settings(configuration & config, uint32_t & width, uint32_t & height, const std::vector<from_headset::headset_info_packet::decoder_info> & headset_decoders, std::optional<uint64_t> link_capacity)
+{
 	uint64_t bitrate = config.bitrate.value_or(default_bitrate);
-	auto scale = config.scale.value_or(std::array<double, 2>{0.8, 0.8});
+	std::optional<uint64_t> measured_bitrate;
+	if (link_capacity and not config.bitrate)
+	{
+		measured_bitrate = link_bitrate(*link_capacity);
+		// The adaptive controller starts from the measured bitrate and may go up to the default one
+		bitrate = config.adaptive_bitrate ? std::max(*measured_bitrate, default_bitrate) : *measured_bitrate;
+	}
+	double pacing = config.tcp_only ? 0 : std::max(config.pacing.value_or(0), 0.);
+	auto scale = config.scale.value_or(std::array<double, 2>{default_scale, default_scale});
+	if (not config.scale and measured_bitrate and *measured_bitrate < default_bitrate)
+	{
+		// Keep the same bits per pixel as the default bitrate and scale
+		double s = std::max(default_scale * std::sqrt(double(*measured_bitrate) / default_bitrate), min_link_scale);
+		scale = {s, s};
+		U_LOG_I("Scale reduced to %.2f for a %.1f Mbit/s link", s, *link_capacity * 1e-6);
+	}
+	double inset = config.foveated_inset.value_or(0);
+	bool layered = inset > 0 and inset < 1 and not config.encoders.empty();
+	if (layered)
+		config.encoders = split_inset(config.encoders.front(), inset);
+	std::map<std::string, std::vector<video_codec>> encoder_codecs;
+	for (auto & encoder: config.encoders)
+	{
+		if (config.codec)
+			encoder.codec = config.codec;
+		if (not encoder.codec)
+		{
+			auto it = encoder_codecs.find(encoder.name);
+			if (it == encoder_codecs.end())
+				it = encoder_codecs.emplace(encoder.name, get_encoder_codecs(encoder.name)).first;
+			encoder.codec = choose_codec(it->second, headset_decoders);
+		}
+		else if (not headset_decoders.empty() and std::ranges::find(headset_decoders, *encoder.codec, &decoder_info::codec) == headset_decoders.end())
+		{
+			std::string codec(magic_enum::enum_name(*encoder.codec));
+			U_LOG_W("Codec %s is not supported by the headset decoder", codec.c_str());
+		}
+	}
 	for (const auto & encoder: config.encoders)
 	{
 		check_scale(encoder.name,
@@ -224,10 +445,105 @@ std::vector<encoder_settings> xrt::drivers::wivrn::get_encoder_settings(vk::Phys
 		settings.group = encoder.group.value_or(next_group);
 		settings.options = encoder.options;
 		settings.device = encoder.device;
+		settings.intra_refresh = std::max(encoder.intra_refresh.value_or(0), 0);
+		// Parity shards are useless when the stream goes through TCP
+		settings.fec_ratio = config.tcp_only ? 0 : std::clamp(encoder.fec_ratio.value_or(config.fec_ratio.value_or(0)), 0., 1.);
+		settings.pacing = pacing;
+		settings.tcp_only = config.tcp_only;
+		settings.qp_emphasis = std::max(config.qp_emphasis.value_or(0), 0.);
+		settings.skip_static_frames = config.skip_static_frames;
+		settings.non_reference_frames = config.non_reference_frames;
+		settings.error_concealment = config.error_concealment and not config.tcp_only;
+		settings.inset = layered;
 
 		next_group = std::max(next_group, settings.group + 1);
 		res.push_back(settings);
 	}
+	if (layered)
+	{
+		// Whole stream at half the resolution, below it in the planes of the conversion
+		auto background = res.front();
+		background.width = width / 4 * 2;
+		background.height = height / 4 * 2;
+		background.video_width = background.width;
+		background.video_height = background.height;
+		background.offset_x = 0;
+		background.offset_y = height;
+		background.source = to_headset::video_stream_description::item::source_rect{
+		        .offset_x = 0,
+		        .offset_y = 0,
+		        .width = uint16_t(width),
+		        .height = uint16_t(height),
+		};
+		background.group = next_group;
+		background.qp_emphasis = 0;
+		background.inset = false;
+		res.insert(res.begin(), background);
+	}
+	// The first stream is the whole image at a lower resolution when layered
+	if (config.spectator_socket and not res.empty())
+		res.front().spectator_socket = *config.spectator_socket;
 	split_bitrate(res, bitrate);
 	return res;
 }
+
+// Whether a single decoder instance can decode a w×h stream at fps
+static bool fits_decoder(const decoder_info & decoder, double w, double h, float fps)
+{
+	if (decoder.max_width and w > decoder.max_width)
+		return false;
+	if (decoder.max_height and h > decoder.max_height)
+		return false;
+	return decoder.max_pixel_rate == 0 or w * h * fps <= decoder.max_pixel_rate;
+}
+
+// Decodes in parallel on the headset when a single decoder is too slow or the stream is too large for it,
+// and uses a single encoder when the headset cannot run one decoder per encoder.
+static void fit_decoder(configuration & config, uint32_t width, uint32_t height, float fps, const std::vector<decoder_info> & headset_decoders)
+{
+	if (config.encoders.empty() or config.foveated_inset)
+		return;
+	const auto & name = config.encoders.front().name;
+	auto codec = config.codec.value_or(config.encoders.front().codec.value_or(choose_codec(get_encoder_codecs(name), headset_decoders)));
+	auto decoder = std::ranges::find(headset_decoders, codec, &decoder_info::codec);
+	if (decoder == headset_decoders.end())
+		return;
+
+	auto scale = config.scale.value_or(std::array<double, 2>{default_scale, default_scale});
+	double w = width * scale[0];
+	double h = height * scale[1];
+	if (config.encoders.size() == 1 and decoder->max_instances != 1 and not fits_decoder(*decoder, w, h, fps) and fits_decoder(*decoder, w / 2, h, fps))
+	{
+		U_LOG_I("Headset decoder cannot decode the stream at %.0fHz, using one encoder per eye", fps);
+		config.encoders = split_per_eye(name);
+		config.encoders[0].codec = config.encoders[1].codec = codec;
+	}
+	else if (decoder->max_instances and config.encoders.size() > decoder->max_instances and fits_decoder(*decoder, w, h, fps))
+	{
+		U_LOG_I("Headset supports %d decoders, using a single encoder", decoder->max_instances);
+		config.encoders = {{.name = name, .codec = codec}};
+	}
+}
+
+std::vector<encoder_settings> xrt::drivers::wivrn::get_encoder_settings(vk::PhysicalDevice physical_device, uint32_t & width, uint32_t & height, float fps, const std::vector<from_headset::headset_info_packet::decoder_info> & headset_decoders, std::optional<uint64_t> link_capacity)
+{
+	configuration config = read_configuration();
+	if (config.encoders.empty() and config.encoder_autotune)
+	{
+		if (auto profile = load_encoder_profile(physical_device, width, height, headset_decoders))
+			config.encoders = std::move(*profile);
+	}
+	if (config.encoders.empty())
+	{
+		config.encoders = get_encoder_default_settings(physical_device);
+		fit_decoder(config, width, height, fps, headset_decoders);
+	}
+	return make_encoder_settings(config, width, height, headset_decoders, link_capacity);
+}
+
+std::vector<encoder_settings> xrt::drivers::wivrn::get_encoder_settings(vk::PhysicalDevice physical_device, uint32_t & width, uint32_t & height, const std::vector<configuration::encoder> & encoders, const std::vector<from_headset::headset_info_packet::decoder_info> & headset_decoders, std::optional<uint64_t> link_capacity)
+{
+	configuration config = read_configuration();
+	config.encoders = encoders;
+	return make_encoder_settings(config, width, height, headset_decoders, link_capacity);
+}
@@ -19,9 +19,12 @@
 
 #pragma once
 
+#include "driver/configuration.h"
 #include "wivrn_packets.h"
 
 #include <map>
+#include <optional>
+#include <set>
 #include <string>
 #include <vulkan/vulkan.hpp>
 
@@ -30,16 +33,64 @@ namespace xrt::drivers::wivrn
 
 struct encoder_settings : public to_headset::video_stream_description::item
 {
-	// encoder identifier, such as nvenc, vaapi or x265
+	// encoder identifier, such as nvenc, vaapi, x265 or vulkan
 	std::string encoder_name;
 	uint64_t bitrate;                           // bit/s
 	std::map<std::string, std::string> options; // additional encoder-specific configuration
 	// encoders in the same group are executed in sequence
 	int group = 0;
 	std::optional<std::string> device;
+	// ratio of parity shards to data shards, 0 to disable forward error correction
+	double fec_ratio = 0;
+	// fraction of the frame interval over which an average frame is sent, 0 to disable pacing
+	double pacing = 0;
+	// number of frames over which the image is refreshed with intra blocks, 0 to rely on IDR frames
+	int intra_refresh = 0;
+	// video is sent on the TCP socket, shards are not limited by the MTU and are never lost
+	bool tcp_only = false;
+	// QP difference between the foveation centre and the edges of each eye, 0 to spend bits uniformly
+	double qp_emphasis = 0;
+	// frames identical to the previous one are not encoded
+	bool skip_static_frames = false;
+	// every other frame is encoded as a non-reference frame, that can be dropped without repairing the stream
+	bool non_reference_frames = false;
+	// Unix socket on which the bitstream is also published for local spectators, empty if none
+	std::string spectator_socket;
+	// high resolution part of a layered stream, centred on the foveation centre of its eye by PlaceInset
+	bool inset = false;
+	// size and foveation of the full stream, set before the encoder is created
+	uint16_t stream_width = 0;
+	uint16_t stream_height = 0;
+	std::array<to_headset::video_stream_description::foveation_parameter, 2> foveation{};
 };
 
-std::vector<encoder_settings> get_encoder_settings(vk::PhysicalDevice physical_device, uint32_t & width, uint32_t & height);
+// Without configured encoders, the ones found by the autotuner for this GPU are used, or defaults for its vendor.
+// Encoders without a configured codec use the most efficient one supported by both the encoder and the headset,
+// or a faster one if the headset reports slow decoding.
+// The default encoders are split per eye, or merged, to fit the limits reported by the headset decoder at fps.
+// The capacity of the link in bit/s, if it was measured, sets the bitrate and scale that are not configured.
+std::vector<encoder_settings> get_encoder_settings(vk::PhysicalDevice physical_device,
+                                                   uint32_t & width,
+                                                   uint32_t & height,
+                                                   float fps,
+                                                   const std::vector<from_headset::headset_info_packet::decoder_info> & headset_decoders,
+                                                   std::optional<uint64_t> link_capacity = std::nullopt);
+
+// Same, with these encoders instead of the configured or default ones
+std::vector<encoder_settings> get_encoder_settings(vk::PhysicalDevice physical_device,
+                                                   uint32_t & width,
+                                                   uint32_t & height,
+                                                   const std::vector<configuration::encoder> & encoders,
+                                                   const std::vector<from_headset::headset_info_packet::decoder_info> & headset_decoders,
+                                                   std::optional<uint64_t> link_capacity = std::nullopt);
+
+// Bitrate the link can sustain with room for other traffic and bursts
+uint64_t link_bitrate(uint64_t link_capacity);
+
+// Switches an encoder whose backend is in failed to another one compiled in: x265 first, as it does not
+// depend on the GPU driver, then the other hardware encoders. Backend specific options are dropped.
+// Returns false if every backend failed.
+bool replace_failed_encoder(encoder_settings & settings, const std::set<std::string> & failed);
 
 } // namespace xrt::drivers::wivrn
 
@@ -19,11 +19,13 @@
 
 #include "video_encoder_ffmpeg.h"
 #include "util/u_logging.h"
+#include "utils/named_thread.h"
 #include <stdexcept>
 
 extern "C"
 {
 #include <libavcodec/avcodec.h>
+#include <libavutil/intreadwrite.h>
 #include <libavutil/log.h>
 }
 
@@ -63,14 +65,44 @@ bool set_log_level()
 
 bool VideoEncoderFFMPEG::once = set_log_level();
 
-void VideoEncoderFFMPEG::Encode(bool idr, std::chrono::steady_clock::time_point target_timestamp)
+void VideoEncoderFFMPEG::Encode(bool idr, std::chrono::steady_clock::time_point target_timestamp, uint64_t frame_index)
+{
+	{
+		std::lock_guard lock(ctx_mutex);
+		PushFrame(idr, target_timestamp, frame_index);
+	}
+
+	if (not drain_thread.joinable())
+	{
+		ReceivePacket(frame_index);
+		return;
+	}
+
+	{
+		std::lock_guard lock(queue_mutex);
+		drain_queue.push_back(frame_index);
+	}
+	queue_cv.notify_all();
+}
+
+void VideoEncoderFFMPEG::ReceivePacket(uint64_t frame_index)
 {
-	PushFrame(idr, target_timestamp);
 	av_packet_ptr enc_pkt(av_packet_alloc());
-	int err = avcodec_receive_packet(encoder_ctx.get(), enc_pkt.get());
+	int err;
+	{
+		std::lock_guard lock(ctx_mutex);
+		err = avcodec_receive_packet(encoder_ctx.get(), enc_pkt.get());
+	}
+	FrameDone(frame_index);
 	if (err == 0)
 	{
-		SendData(std::span<uint8_t>(enc_pkt->data, enc_pkt->size), true);
+		// Quality stats start with the frame quality as a lambda, in little endian
+		float average_qp = -1;
+		size_t stats_size;
+		if (auto stats = av_packet_get_side_data(enc_pkt.get(), AV_PKT_DATA_QUALITY_STATS, &stats_size); stats and stats_size >= 4)
+			average_qp = float(AV_RL32(stats)) / FF_QP2LAMBDA;
+		// Sending may wait for the pacer, the next frame can be encoded meanwhile
+		SendData(std::span<uint8_t>(enc_pkt->data, enc_pkt->size), true, frame_index, average_qp);
 	}
 	if (err == AVERROR(EAGAIN))
 	{
@@ -82,3 +114,51 @@ void VideoEncoderFFMPEG::Encode(bool idr, std::chrono::steady_clock::time_point
 		throw std::runtime_error("frame encoding failed, code " + std::to_string(err));
 	}
 }
+
+void VideoEncoderFFMPEG::StartDrainThread(const std::string & name)
+{
+	drain_thread = utils::named_thread(name, &VideoEncoderFFMPEG::DrainLoop, this);
+}
+
+void VideoEncoderFFMPEG::StopDrainThread()
+{
+	if (not drain_thread.joinable())
+		return;
+	{
+		std::lock_guard lock(queue_mutex);
+		stop = true;
+	}
+	queue_cv.notify_all();
+	drain_thread.join();
+}
+
+void VideoEncoderFFMPEG::DrainLoop()
+{
+	while (true)
+	{
+		uint64_t frame_index;
+		{
+			std::unique_lock lock(queue_mutex);
+			queue_cv.wait(lock, [&]() { return stop or not drain_queue.empty(); });
+			if (stop)
+				break;
+			frame_index = drain_queue.front();
+			drain_queue.pop_front();
+		}
+
+		try
+		{
+			ReceivePacket(frame_index);
+		}
+		catch (std::exception & e)
+		{
+			U_LOG_W("Stream %d: failed to read frame %ld: %s", stream_idx, frame_index, e.what());
+		}
+	}
+}
+
+void VideoEncoderFFMPEG::ApplyBitrate(uint64_t)
+{
+	// Setting bit_rate after avcodec_open2 is ignored, the pacer keeps the rate of the encoder
+	throw std::runtime_error("the bitrate of a running ffmpeg encoder cannot be changed");
+}
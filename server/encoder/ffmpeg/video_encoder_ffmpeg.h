@@ -22,6 +22,10 @@
 #include "encoder/video_encoder.h"
 #include "ffmpeg_helper.h"
 #include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
 
 class VideoEncoderFFMPEG : public xrt::drivers::wivrn::VideoEncoder
 {
@@ -29,14 +33,50 @@ public:
 	using Codec = xrt::drivers::wivrn::video_codec;
 
 	void
-	Encode(bool idr, std::chrono::steady_clock::time_point target_timestamp) override;
+	Encode(bool idr, std::chrono::steady_clock::time_point target_timestamp, uint64_t frame_index) override;
+
+	void
+	ApplyBitrate(uint64_t bitrate) override;
+
+	// The vaapi encoders only read the rate control parameters when the codec is opened
+	bool
+	SupportsBitrateChange() const override
+	{
+		return false;
+	}
 
 protected:
 	virtual void
-	PushFrame(bool idr, std::chrono::steady_clock::time_point pts) = 0;
+	PushFrame(bool idr, std::chrono::steady_clock::time_point pts, uint64_t frame_index) = 0;
+
+	// Called once the packet of the frame has been received, its input may be overwritten
+	virtual void
+	FrameDone(uint64_t frame_index) {}
+
+	// Async mode: Encode only sends the frame, packets are received and sent by a separate thread.
+	// Must be stopped by the destructor of the derived class, before its resources are released.
+	void
+	StartDrainThread(const std::string & name);
+	void
+	StopDrainThread();
 
 	av_codec_context_ptr encoder_ctx;
 
 private:
+	void
+	ReceivePacket(uint64_t frame_index);
+	void
+	DrainLoop();
+
+	// Protects encoder_ctx
+	std::mutex ctx_mutex;
+
+	std::mutex queue_mutex;
+	std::condition_variable queue_cv;
+	// Frames sent to the encoder, waiting for their packet
+	std::deque<uint64_t> drain_queue;
+	bool stop = false;
+	std::thread drain_thread;
+
 	static bool once;
 };
@@ -25,8 +25,12 @@
 #include "util/u_logging.h"
 #include "utils/wivrn_vk_bundle.h"
 
+#include <algorithm>
+#include <cmath>
 #include <drm_fourcc.h>
 #include <filesystem>
+#include <map>
+#include <mutex>
 #include <optional>
 #include <unordered_map>
 #include <vulkan/vulkan_raii.hpp>
@@ -34,21 +38,54 @@
 extern "C"
 {
 #include <libavcodec/avcodec.h>
+#include <libavutil/frame.h>
 #include <libavutil/hwcontext.h>
 #include <libavutil/hwcontext_drm.h>
+#include <libavutil/hwcontext_vaapi.h>
 #include <libavutil/opt.h>
 #include <libavutil/pixdesc.h>
 }
 
 namespace
 {
+// Number of frames that can be encoded or sent at the same time in async mode
+const size_t async_slot_count = 3;
+
+// Alignment of the rows and planes of linear surfaces shared with another device
+const uint32_t linear_pitch_alignment = 256;
+const uint32_t linear_height_alignment = 16;
+
+uint32_t align(uint32_t value, uint32_t alignment)
+{
+	return (value + alignment - 1) / alignment * alignment;
+}
+
+// Linear surfaces are read through the host by the encoding device: device local host visible memory
+// is slow to read, and uncached host memory too
+uint32_t linear_memory_type(wivrn_vk_bundle & vk, uint32_t type_bits)
+{
+	const auto wanted = vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCached;
+	auto properties = vk.physical_device.getMemoryProperties();
+	for (uint32_t i = 0; i < properties.memoryTypeCount; ++i)
+	{
+		auto flags = properties.memoryTypes[i].propertyFlags;
+		if ((type_bits >> i) & 1 and (flags & wanted) == wanted and not(flags & vk::MemoryPropertyFlagBits::eDeviceLocal))
+			return i;
+	}
+	throw std::runtime_error("No host cached memory for the linear surfaces");
+}
+
 const char *
 encoder(VideoEncoderFFMPEG::Codec codec)
 {
 	switch (codec)
 	{
+		case VideoEncoderFFMPEG::Codec::h264:
+			return "h264_vaapi";
 		case VideoEncoderFFMPEG::Codec::h265:
 			return "hevc_vaapi";
+		case VideoEncoderFFMPEG::Codec::av1:
+			return "av1_vaapi";
 	}
 	throw std::runtime_error("invalid codec " + std::to_string(int(codec)));
 }
@@ -93,14 +130,54 @@ get_render_device(vk::raii::PhysicalDevice & physical_device)
 	return path;
 }
 
-av_buffer_ptr make_drm_hw_ctx(vk::raii::PhysicalDevice & physical_device, const std::optional<std::string> & device)
+// Whether the encoding device is another GPU than the one used by the compositor
+bool is_cross_device(vk::raii::PhysicalDevice & physical_device, const std::optional<std::string> & device)
+{
+	if (not device)
+		return false;
+	auto render_device = get_render_device(physical_device);
+	if (not render_device)
+		return false;
+	std::error_code ec;
+	bool same = std::filesystem::equivalent(*device, *render_device, ec);
+	return not ec and not same;
+}
+
+// DRM and VAAPI device contexts by render node, an empty key for the default one.
+// They are shared by the encoders, so that recreating encoders does not reopen the device.
+struct device_contexts
+{
+	av_buffer_ptr drm;
+	av_buffer_ptr vaapi;
+};
+std::mutex device_mutex;
+std::map<std::string, device_contexts> shared_devices;
+
+device_contexts make_device_contexts(const std::optional<std::filesystem::path> & render_device)
 {
-	const auto render_device = device ? *device : get_render_device(physical_device);
 	AVBufferRef * hw_ctx;
 	int err = av_hwdevice_ctx_create(&hw_ctx, AV_HWDEVICE_TYPE_DRM, render_device ? render_device->c_str() : NULL, NULL, 0);
 	if (err)
 		throw std::system_error(err, av_error_category(), "FFMPEG drm hardware context creation failed");
-	return av_buffer_ptr(hw_ctx);
+	av_buffer_ptr drm_hw_ctx(hw_ctx);
+
+	err = av_hwdevice_ctx_create_derived(&hw_ctx, AV_HWDEVICE_TYPE_VAAPI, drm_hw_ctx.get(), 0);
+	if (err)
+		throw std::system_error(err, av_error_category(), "FFMPEG vaapi hardware context creation failed");
+	return {std::move(drm_hw_ctx), av_buffer_ptr(hw_ctx)};
+}
+
+device_contexts get_device_contexts(const std::optional<std::filesystem::path> & render_device)
+{
+	std::string key = render_device ? render_device->string() : "";
+	std::lock_guard lock(device_mutex);
+	auto it = shared_devices.find(key);
+	if (it == shared_devices.end())
+		it = shared_devices.emplace(key, make_device_contexts(render_device)).first;
+	return {
+	        av_buffer_ptr(av_buffer_ref(it->second.drm.get())),
+	        av_buffer_ptr(av_buffer_ref(it->second.vaapi.get())),
+	};
 }
 
 std::unordered_map<uint32_t, vk::Format> vulkan_drm_format_map = {
@@ -121,20 +198,89 @@ vk::Format drm_to_vulkan_fmt(uint32_t drm_fourcc)
 	return vulkan_drm_format_map.at(drm_fourcc);
 }
 
+VAProfile va_profile(VideoEncoderFFMPEG::Codec codec)
+{
+	switch (codec)
+	{
+		case VideoEncoderFFMPEG::Codec::h264:
+			return VAProfileH264High;
+		case VideoEncoderFFMPEG::Codec::h265:
+			return VAProfileHEVCMain;
+		case VideoEncoderFFMPEG::Codec::av1:
+			return VAProfileAV1Profile0;
+	}
+	throw std::runtime_error("invalid codec " + std::to_string(int(codec)));
+}
+
+bool has_entrypoint(AVBufferRef * vaapi_hw_ctx, VideoEncoderFFMPEG::Codec codec, VAEntrypoint entrypoint)
+{
+	auto device_ctx = (AVHWDeviceContext *)vaapi_hw_ctx->data;
+	VADisplay display = ((AVVAAPIDeviceContext *)device_ctx->hwctx)->display;
+
+	std::vector<VAEntrypoint> entrypoints(vaMaxNumEntrypoints(display));
+	int count = 0;
+	if (vaQueryConfigEntrypoints(display, va_profile(codec), entrypoints.data(), &count) != VA_STATUS_SUCCESS)
+		return false;
+	entrypoints.resize(count);
+	return std::ranges::find(entrypoints, entrypoint) != entrypoints.end();
+}
+
+// The low power entrypoint (VDEnc on Intel) uses a fixed function encoder with lower latency.
+// The low_power option may be "auto" (default: used when available), "true" or "false".
+bool use_low_power(AVBufferRef * vaapi_hw_ctx, const xrt::drivers::wivrn::encoder_settings & settings)
+{
+	std::string option = "auto";
+	if (auto it = settings.options.find("low_power"); it != settings.options.end())
+		option = it->second;
+
+	if (option == "0" or option == "false")
+		return false;
+
+	bool supported = has_entrypoint(vaapi_hw_ctx, settings.codec, VAEntrypointEncSliceLP);
+	if (option == "1" or option == "true")
+	{
+		if (not supported)
+			U_LOG_W("vaapi: low power encoding is not supported by the driver");
+		return supported;
+	}
+
+	if (option != "auto")
+		U_LOG_W("vaapi: invalid low_power value %s, using auto", option.c_str());
+
+	if (supported)
+		U_LOG_I("vaapi: using low power encoding");
+	return supported;
+}
+
 } // namespace
 
+// Without a configured device, the compositor usually renders on the first render node
+static std::optional<std::filesystem::path> default_render_device()
+{
+	std::filesystem::path path = "/dev/dri/renderD128";
+	if (std::filesystem::exists(path))
+		return path;
+	return std::nullopt;
+}
+
+void video_encoder_va::Preload()
+{
+	// The driver is loaded and read from disk once, the contexts are not kept so that the process can fork
+	make_device_contexts(default_render_device());
+}
+
+void video_encoder_va::Prewarm(const std::optional<std::string> & device)
+{
+	get_device_contexts(device ? std::optional<std::filesystem::path>(*device) : default_render_device());
+}
+
 video_encoder_va::video_encoder_va(wivrn_vk_bundle & vk, xrt::drivers::wivrn::encoder_settings & settings, float fps) :
-        luma(nullptr), chroma(nullptr)
+        cross_device(is_cross_device(vk.physical_device, settings.device)),
+        queue_family_index(vk.queue_family_index)
 {
-	auto drm_hw_ctx = make_drm_hw_ctx(vk.physical_device, settings.device);
+	auto [drm_hw_ctx, vaapi_hw_ctx] = get_device_contexts(settings.device ? *settings.device : get_render_device(vk.physical_device));
 	AVBufferRef * tmp;
-	int err = av_hwdevice_ctx_create_derived(&tmp,
-	                                         AV_HWDEVICE_TYPE_VAAPI,
-	                                         drm_hw_ctx.get(),
-	                                         0);
-	if (err)
-		throw std::system_error(err, av_error_category(), "FFMPEG vaapi hardware context creation failed");
-	av_buffer_ptr vaapi_hw_ctx(tmp);
+	int err;
 
 	settings.video_width += settings.video_width % 2;
 	settings.video_height += settings.video_height % 2;
@@ -164,6 +310,9 @@ video_encoder_va::video_encoder_va(wivrn_vk_bundle & vk, xrt::drivers::wivrn::en
 	}
 	drm_frame_ctx = av_buffer_ptr(tmp);
 
+	if (cross_device)
+		U_LOG_I("vaapi: encoding on %s, frames are copied through linear host memory", settings.device->c_str());
+
 	const char * encoder_name = encoder(settings.codec);
 	const AVCodec * codec = avcodec_find_encoder_by_name(encoder_name);
 	if (codec == nullptr)
@@ -177,11 +326,37 @@ video_encoder_va::video_encoder_va(wivrn_vk_bundle & vk, xrt::drivers::wivrn::en
 		throw std::runtime_error("failed to allocate VAAPI encoder");
 	}
 
+	if (settings.intra_refresh > 0)
+	{
+		// ffmpeg VAAPI encoders have no intra refresh option
+		U_LOG_W("vaapi: intra refresh is not supported, using IDR frames");
+		settings.intra_refresh = 0;
+	}
+
+	// ffmpeg only outputs packets once async_depth frames are queued, which adds latency.
+	// The async option instead keeps async_depth at 1 and receives packets from another thread.
+	if (auto it = settings.options.find("async"); it != settings.options.end())
+		async = it->second == "1" or it->second == "true";
+
 	AVDictionary * opts = nullptr;
 	av_dict_set(&opts, "async_depth", "1", 0);
-	encoder_ctx->profile = FF_PROFILE_HEVC_MAIN;
+	av_dict_set(&opts, "low_power", use_low_power(vaapi_hw_ctx.get(), settings) ? "1" : "0", 0);
+	switch (settings.codec)
+	{
+		case Codec::h264:
+			encoder_ctx->profile = FF_PROFILE_H264_HIGH;
+			break;
+		case Codec::h265:
+			encoder_ctx->profile = FF_PROFILE_HEVC_MAIN;
+			break;
+		case Codec::av1:
+			encoder_ctx->profile = FF_PROFILE_AV1_MAIN;
+			break;
+	}
 	for (auto option: settings.options)
 	{
+		if (option.first == "async" or option.first == "low_power")
+			continue;
 		av_dict_set(&opts, option.first.c_str(), option.second.c_str(), 0);
 	}
 
@@ -215,24 +390,49 @@ video_encoder_va::video_encoder_va(wivrn_vk_bundle & vk, xrt::drivers::wivrn::en
 		U_LOG_W("Encoder %d reports a %d frame delay, reprojection will fail", stream_idx, encoder_ctx->delay);
 	}
 
-	va_frame = make_av_frame();
-	err = av_hwframe_get_buffer(vaapi_frame_ctx.get(), va_frame.get(), 0);
+	slots.resize(async ? async_slot_count : 1);
+	for (auto & slot: slots)
+	{
+		if (cross_device)
+			CreateLinearSlot(slot, vk, vaapi_frame_ctx.get());
+		else
+			CreateSlot(slot, vk, vaapi_frame_ctx.get());
+		if (settings.qp_emphasis > 0)
+			SetRegionsOfInterest(slot.va_frame.get(), settings);
+	}
+
+	if (async)
+	{
+		U_LOG_I("vaapi: asynchronous mode, %zu frames in flight", slots.size());
+		StartDrainThread("vaapi_drain");
+	}
+}
+
+video_encoder_va::~video_encoder_va()
+{
+	StopDrainThread();
+}
+
+void video_encoder_va::CreateSlot(slot & slot, wivrn_vk_bundle & vk, AVBufferRef * vaapi_frame_ctx)
+{
+	slot.va_frame = make_av_frame();
+	int err = av_hwframe_get_buffer(vaapi_frame_ctx, slot.va_frame.get(), 0);
 	if (err < 0)
 	{
 		throw std::system_error(err, av_error_category(), "Cannot create vaapi frame");
 	}
-	drm_frame = make_av_frame();
-	err = av_hwframe_get_buffer(drm_frame_ctx.get(), drm_frame.get(), 0);
+	slot.drm_frame = make_av_frame();
+	err = av_hwframe_get_buffer(drm_frame_ctx.get(), slot.drm_frame.get(), 0);
 	if (err < 0)
 	{
 		throw std::system_error(err, av_error_category(), "Cannot create vulkan frame");
 	}
-	av_hwframe_map(va_frame.get(), drm_frame.get(), AV_HWFRAME_MAP_DIRECT);
-	va_frame->color_range = AVCOL_RANGE_JPEG;
-	va_frame->colorspace = AVCOL_SPC_BT709;
-	va_frame->color_primaries = AVCOL_PRI_BT709;
-	va_frame->color_trc = AVCOL_TRC_BT709;
-	auto desc = (AVDRMFrameDescriptor *)drm_frame->data[0];
+	av_hwframe_map(slot.va_frame.get(), slot.drm_frame.get(), AV_HWFRAME_MAP_DIRECT);
+	slot.va_frame->color_range = AVCOL_RANGE_JPEG;
+	slot.va_frame->colorspace = AVCOL_SPC_BT709;
+	slot.va_frame->color_primaries = AVCOL_PRI_BT709;
+	slot.va_frame->color_trc = AVCOL_TRC_BT709;
+	auto desc = (AVDRMFrameDescriptor *)slot.drm_frame->data[0];
 
 	const bool has_modifiers =
 	        std::ranges::any_of(vk.device_extensions, [](const char * ext) {
@@ -260,8 +460,8 @@ video_encoder_va::video_encoder_va(wivrn_vk_bundle & vk, xrt::drivers::wivrn::en
 		                .imageType = vk::ImageType::e2D,
 		                .format = drm_to_vulkan_fmt(desc->layers[i].format),
 		                .extent = {
-		                        .width = uint32_t(drm_frame->width / (i == 0 ? 1 : 2)),
-		                        .height = uint32_t(drm_frame->height / (i == 0 ? 1 : 2)),
+		                        .width = uint32_t(slot.drm_frame->width / (i == 0 ? 1 : 2)),
+		                        .height = uint32_t(slot.drm_frame->height / (i == 0 ? 1 : 2)),
 		                        .depth = 1,
 		                },
 		                .mipLevels = 1,
@@ -278,7 +478,7 @@ video_encoder_va::video_encoder_va(wivrn_vk_bundle & vk, xrt::drivers::wivrn::en
 		        },
 
 		};
-		auto & image = (i == 0 ? luma : chroma);
+		auto & image = (i == 0 ? slot.luma : slot.chroma);
 		image = vk.device.createImage(image_create_info.get());
 	}
 	// objects == memory
@@ -298,7 +498,7 @@ video_encoder_va::video_encoder_va(wivrn_vk_bundle & vk, xrt::drivers::wivrn::en
 		};
 		try
 		{
-			mem.emplace_back(vk.device, alloc_info.get());
+			slot.mem.emplace_back(vk.device, alloc_info.get());
 		}
 		catch (...)
 		{
@@ -327,8 +527,8 @@ video_encoder_va::video_encoder_va(wivrn_vk_bundle & vk, xrt::drivers::wivrn::en
 				bind_info.push_back(
 				        {
 				                .pNext = signal_p ? &plane_info.back() : nullptr,
-				                .image = *((i == 0) ? luma : chroma),
-				                .memory = *mem[desc->layers[i].planes[j].object_index],
+				                .image = *((i == 0) ? slot.luma : slot.chroma),
+				                .memory = *slot.mem[desc->layers[i].planes[j].object_index],
 				                .memoryOffset = has_modifiers ? 0 : (vk::DeviceSize)desc->layers[i].planes[j].offset,
 				        });
 			}
@@ -337,15 +537,194 @@ video_encoder_va::video_encoder_va(wivrn_vk_bundle & vk, xrt::drivers::wivrn::en
 	}
 }
 
-void video_encoder_va::PresentImage(yuv_converter & src_yuv, vk::raii::CommandBuffer & cmd_buf)
+// Images of the encoding device usually cannot be imported by the rendering device.
+// Instead, the compositor exports a linear buffer in host memory, which is imported
+// as a VAAPI surface. The surface is only encoded after the encoder thread waited for
+// the semaphore of the frame, so the copy is complete.
+void video_encoder_va::CreateLinearSlot(slot & slot, wivrn_vk_bundle & vk, AVBufferRef * vaapi_frame_ctx)
 {
+	auto frames_ctx = (AVHWFramesContext *)vaapi_frame_ctx->data;
+	slot.pitch = align(frames_ctx->width, linear_pitch_alignment);
+	slot.chroma_offset = vk::DeviceSize(slot.pitch) * align(frames_ctx->height, linear_height_alignment);
+	vk::DeviceSize size = slot.chroma_offset + vk::DeviceSize(slot.pitch) * frames_ctx->height / 2;
+
+	vk::StructureChain buffer_info{
+	        vk::BufferCreateInfo{
+	                .size = size,
+	                .usage = vk::BufferUsageFlagBits::eTransferDst,
+	                .sharingMode = vk::SharingMode::eExclusive,
+	        },
+	        vk::ExternalMemoryBufferCreateInfo{
+	                .handleTypes = vk::ExternalMemoryHandleTypeFlagBits::eDmaBufEXT,
+	        },
+	};
+	slot.buffer = vk::raii::Buffer(vk.device, buffer_info.get());
+
+	auto requirements = slot.buffer.getMemoryRequirements();
+	vk::StructureChain alloc_info{
+	        vk::MemoryAllocateInfo{
+	                .allocationSize = requirements.size,
+	                .memoryTypeIndex = linear_memory_type(vk, requirements.memoryTypeBits),
+	        },
+	        vk::ExportMemoryAllocateInfo{
+	                .handleTypes = vk::ExternalMemoryHandleTypeFlagBits::eDmaBufEXT,
+	        },
+	};
+	slot.buffer_memory = vk::raii::DeviceMemory(vk.device, alloc_info.get());
+	slot.buffer.bindMemory(*slot.buffer_memory, 0);
+
+	int fd = vk.device.getMemoryFdKHR({
+	        .memory = *slot.buffer_memory,
+	        .handleType = vk::ExternalMemoryHandleTypeFlagBits::eDmaBufEXT,
+	});
+
+	// Owned by the drm frame, the fd is closed when it is freed
+	auto desc = (AVDRMFrameDescriptor *)av_mallocz(sizeof(AVDRMFrameDescriptor));
+	if (not desc)
+	{
+		close(fd);
+		throw std::bad_alloc();
+	}
+	desc->nb_objects = 1;
+	desc->objects[0] = {
+	        .fd = fd,
+	        .size = size_t(requirements.size),
+	        .format_modifier = DRM_FORMAT_MOD_LINEAR,
+	};
+	desc->nb_layers = 1;
+	desc->layers[0].format = DRM_FORMAT_NV12;
+	desc->layers[0].nb_planes = 2;
+	desc->layers[0].planes[0] = {.object_index = 0, .offset = 0, .pitch = slot.pitch};
+	desc->layers[0].planes[1] = {.object_index = 0, .offset = ptrdiff_t(slot.chroma_offset), .pitch = slot.pitch};
+
+	slot.drm_frame = make_av_frame();
+	slot.drm_frame->format = AV_PIX_FMT_DRM_PRIME;
+	slot.drm_frame->width = frames_ctx->width;
+	slot.drm_frame->height = frames_ctx->height;
+	slot.drm_frame->data[0] = (uint8_t *)desc;
+	slot.drm_frame->buf[0] = av_buffer_create(
+	        (uint8_t *)desc, sizeof(*desc), [](void *, uint8_t * data) {
+		        auto desc = (AVDRMFrameDescriptor *)data;
+		        close(desc->objects[0].fd);
+		        av_free(desc);
+	        },
+	        nullptr,
+	        0);
+	if (not slot.drm_frame->buf[0])
+	{
+		close(fd);
+		av_free(desc);
+		throw std::bad_alloc();
+	}
+
+	slot.va_frame = make_av_frame();
+	slot.va_frame->format = AV_PIX_FMT_VAAPI;
+	slot.va_frame->width = frames_ctx->width;
+	slot.va_frame->height = frames_ctx->height;
+	slot.va_frame->hw_frames_ctx = av_buffer_ref(vaapi_frame_ctx);
+	int err = av_hwframe_map(slot.va_frame.get(), slot.drm_frame.get(), AV_HWFRAME_MAP_READ);
+	if (err < 0)
+		throw std::system_error(err, av_error_category(), "Cannot import linear surface on the encoding device");
+	slot.va_frame->color_range = AVCOL_RANGE_JPEG;
+	slot.va_frame->colorspace = AVCOL_SPC_BT709;
+	slot.va_frame->color_primaries = AVCOL_PRI_BT709;
+	slot.va_frame->color_trc = AVCOL_TRC_BT709;
+}
+
+video_encoder_va::slot & video_encoder_va::GetSlot(uint64_t frame_index)
+{
+	return slots[frame_index % slots.size()];
+}
+
+void video_encoder_va::PresentImage(yuv_converter & src_yuv, vk::raii::CommandBuffer & cmd_buf, uint64_t frame_index)
+{
+	auto & slot = GetSlot(frame_index);
+	{
+		// Only waits in async mode, if the encoder is late by the whole ring
+		std::unique_lock lock(slot_mutex);
+		slot_cv.wait(lock, [&]() { return not slot.busy; });
+		slot.frame_index = frame_index;
+	}
+
+	if (cross_device)
+	{
+		// Get the buffer back from the encoding device, its content is overwritten
+		if (slot.released)
+		{
+			vk::BufferMemoryBarrier acquire{
+			        .srcAccessMask = vk::AccessFlagBits::eNone,
+			        .dstAccessMask = vk::AccessFlagBits::eTransferWrite,
+			        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_EXTERNAL,
+			        .dstQueueFamilyIndex = queue_family_index,
+			        .buffer = *slot.buffer,
+			        .offset = 0,
+			        .size = VK_WHOLE_SIZE,
+			};
+			cmd_buf.pipelineBarrier(
+			        vk::PipelineStageFlagBits::eTopOfPipe,
+			        vk::PipelineStageFlagBits::eTransfer,
+			        {},
+			        nullptr,
+			        acquire,
+			        nullptr);
+		}
+
+		std::array regions{
+		        vk::BufferImageCopy{
+		                .bufferOffset = 0,
+		                .bufferRowLength = slot.pitch,
+		                .imageSubresource = {
+		                        .aspectMask = vk::ImageAspectFlagBits::eColor,
+		                        .layerCount = 1,
+		                },
+		                .imageOffset = {
+		                        .x = rect.offset.x,
+		                        .y = rect.offset.y,
+		                },
+		                .imageExtent = {
+		                        .width = rect.extent.width,
+		                        .height = rect.extent.height,
+		                        .depth = 1,
+		                },
+		        },
+		};
+		cmd_buf.copyImageToBuffer(src_yuv.luma, vk::ImageLayout::eTransferSrcOptimal, *slot.buffer, regions);
+
+		// Row length is in texels, chroma texels are 2 bytes
+		regions[0].bufferOffset = slot.chroma_offset;
+		regions[0].bufferRowLength = slot.pitch / 2;
+		regions[0].imageOffset = vk::Offset3D{.x = rect.offset.x / 2, .y = rect.offset.y / 2};
+		regions[0].imageExtent = vk::Extent3D{.width = rect.extent.width / 2, .height = rect.extent.height / 2, .depth = 1};
+		cmd_buf.copyImageToBuffer(src_yuv.chroma, vk::ImageLayout::eTransferSrcOptimal, *slot.buffer, regions);
+
+		// Release the buffer to the encoding device
+		vk::BufferMemoryBarrier release{
+		        .srcAccessMask = vk::AccessFlagBits::eTransferWrite,
+		        .dstAccessMask = vk::AccessFlagBits::eNone,
+		        .srcQueueFamilyIndex = queue_family_index,
+		        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_EXTERNAL,
+		        .buffer = *slot.buffer,
+		        .offset = 0,
+		        .size = VK_WHOLE_SIZE,
+		};
+		cmd_buf.pipelineBarrier(
+		        vk::PipelineStageFlagBits::eTransfer,
+		        vk::PipelineStageFlagBits::eBottomOfPipe,
+		        {},
+		        nullptr,
+		        release,
+		        nullptr);
+		slot.released = true;
+		return;
+	}
+
 	std::array im_barriers = {
 	        vk::ImageMemoryBarrier{
 	                .srcAccessMask = vk::AccessFlagBits::eNone,
 	                .dstAccessMask = vk::AccessFlagBits::eMemoryWrite,
 	                .oldLayout = vk::ImageLayout::eUndefined,
 	                .newLayout = vk::ImageLayout::eTransferDstOptimal,
-	                .image = *luma,
+	                .image = *slot.luma,
 	                .subresourceRange = {.aspectMask = vk::ImageAspectFlagBits::eColor,
 	                                     .baseMipLevel = 0,
 	                                     .levelCount = 1,
@@ -357,7 +736,7 @@ void video_encoder_va::PresentImage(yuv_converter & src_yuv, vk::raii::CommandBu
 	                .dstAccessMask = vk::AccessFlagBits::eMemoryWrite,
 	                .oldLayout = vk::ImageLayout::eUndefined,
 	                .newLayout = vk::ImageLayout::eTransferDstOptimal,
-	                .image = *chroma,
+	                .image = *slot.chroma,
 	                .subresourceRange = {.aspectMask = vk::ImageAspectFlagBits::eColor,
 	                                     .baseMipLevel = 0,
 	                                     .levelCount = 1,
@@ -376,7 +755,7 @@ void video_encoder_va::PresentImage(yuv_converter & src_yuv, vk::raii::CommandBu
 	cmd_buf.copyImage(
 	        src_yuv.luma,
 	        vk::ImageLayout::eTransferSrcOptimal,
-	        *luma,
+	        *slot.luma,
 	        vk::ImageLayout::eTransferDstOptimal,
 	        vk::ImageCopy{
 	                .srcSubresource = {
@@ -400,7 +779,7 @@ void video_encoder_va::PresentImage(yuv_converter & src_yuv, vk::raii::CommandBu
 	cmd_buf.copyImage(
 	        src_yuv.chroma,
 	        vk::ImageLayout::eTransferSrcOptimal,
-	        *chroma,
+	        *slot.chroma,
 	        vk::ImageLayout::eTransferDstOptimal,
 	        vk::ImageCopy{
 	                .srcSubresource = {
@@ -422,13 +801,71 @@ void video_encoder_va::PresentImage(yuv_converter & src_yuv, vk::raii::CommandBu
 	                }});
 }
 
-void video_encoder_va::PushFrame(bool idr, std::chrono::steady_clock::time_point pts)
+void video_encoder_va::SetRegionsOfInterest(AVFrame * frame, const xrt::drivers::wivrn::encoder_settings & settings)
+{
+	// Concentric rings around the foveation centre of each eye. When regions overlap the first one
+	// is used, so the innermost ring comes first. The last ring covers the whole eye.
+	const int rings = 4;
+	// Offsets are a fraction of the QP range of the codec
+	const int qp_range = settings.codec == xrt::drivers::wivrn::av1 ? 255 : 51;
+
+	std::vector<AVRegionOfInterest> regions;
+	for (int ring = 1; ring <= rings; ++ring)
+	{
+		double offset = settings.qp_emphasis * ((ring - 0.5) / rings - qp_mean_distance);
+		for (int eye = 0; eye < 2; ++eye)
+		{
+			auto rect = QpEmphasisRegion(settings, eye, double(ring) / rings);
+			if (rect.extent.width == 0 or rect.extent.height == 0)
+				continue;
+			regions.push_back(AVRegionOfInterest{
+			        .self_size = sizeof(AVRegionOfInterest),
+			        .top = rect.offset.y,
+			        .bottom = int(rect.offset.y + rect.extent.height),
+			        .left = rect.offset.x,
+			        .right = int(rect.offset.x + rect.extent.width),
+			        .qoffset = av_make_q(std::clamp<int>(std::lround(offset), -qp_range, qp_range), qp_range),
+			});
+		}
+	}
+
+	if (regions.empty())
+		return;
+
+	AVFrameSideData * side_data = av_frame_new_side_data(frame, AV_FRAME_DATA_REGIONS_OF_INTEREST, regions.size() * sizeof(AVRegionOfInterest));
+	if (not side_data)
+		throw std::runtime_error("Cannot allocate regions of interest");
+	memcpy(side_data->data, regions.data(), regions.size() * sizeof(AVRegionOfInterest));
+}
+
+void video_encoder_va::PushFrame(bool idr, std::chrono::steady_clock::time_point pts, uint64_t frame_index)
 {
-	va_frame->pict_type = idr ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_P;
-	va_frame->pts = pts.time_since_epoch().count();
-	int err = avcodec_send_frame(encoder_ctx.get(), va_frame.get());
+	auto & slot = GetSlot(frame_index);
+	if (async)
+	{
+		std::lock_guard lock(slot_mutex);
+		if (slot.frame_index != frame_index)
+			throw std::runtime_error("input of frame " + std::to_string(frame_index) + " was overwritten");
+		slot.busy = true;
+	}
+
+	slot.va_frame->pict_type = idr ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_P;
+	slot.va_frame->pts = pts.time_since_epoch().count();
+	int err = avcodec_send_frame(encoder_ctx.get(), slot.va_frame.get());
 	if (err)
 	{
+		FrameDone(frame_index);
 		throw std::system_error(err, av_error_category(), "avcodec_send_frame failed");
 	}
 }
+
+void video_encoder_va::FrameDone(uint64_t frame_index)
+{
+	if (not async)
+		return;
+	{
+		std::lock_guard lock(slot_mutex);
+		GetSlot(frame_index).busy = false;
+	}
+	slot_cv.notify_all();
+}
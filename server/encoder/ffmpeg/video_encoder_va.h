@@ -22,6 +22,11 @@
 #include "ffmpeg_helper.h"
 #include "utils/wivrn_vk_bundle.h"
 #include "video_encoder_ffmpeg.h"
+#include <condition_variable>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
 #include <vulkan/vulkan_raii.hpp>
 
 namespace xrt::drivers::wivrn
@@ -32,18 +37,58 @@ struct encoder_settings;
 class video_encoder_va : public VideoEncoderFFMPEG
 {
 	av_buffer_ptr drm_frame_ctx;
-	av_frame_ptr va_frame;
-	av_frame_ptr drm_frame;
 	vk::Rect2D rect;
-	vk::raii::Image luma;
-	vk::raii::Image chroma;
-	std::vector<vk::raii::DeviceMemory> mem;
+	// The encoding device is not the one the compositor renders on
+	bool cross_device = false;
+	uint32_t queue_family_index;
+
+	// VAAPI surface and the vulkan images imported from it, mapped once
+	struct slot
+	{
+		av_frame_ptr va_frame;
+		av_frame_ptr drm_frame;
+		vk::raii::Image luma = nullptr;
+		vk::raii::Image chroma = nullptr;
+		std::vector<vk::raii::DeviceMemory> mem;
+
+		// Cross device: linear NV12 buffer in host memory, exported to the encoding device
+		vk::raii::Buffer buffer = nullptr;
+		vk::raii::DeviceMemory buffer_memory = nullptr;
+		uint32_t pitch = 0;
+		vk::DeviceSize chroma_offset = 0;
+		// Ownership was given to the encoding device, it is acquired back before the next copy
+		bool released = false;
+
+		// Frame copied in the surface
+		uint64_t frame_index = -1;
+		// Being encoded, the surface must not be written
+		bool busy = false;
+	};
+	// One slot in synchronous mode, a ring indexed by frame index in async mode
+	std::vector<slot> slots;
+	bool async = false;
+	std::mutex slot_mutex;
+	std::condition_variable slot_cv;
+
+	void CreateSlot(slot &, wivrn_vk_bundle &, AVBufferRef * vaapi_frame_ctx);
+	void CreateLinearSlot(slot &, wivrn_vk_bundle &, AVBufferRef * vaapi_frame_ctx);
+	slot & GetSlot(uint64_t frame_index);
+
+	// Attach regions of interest following the foveation to the frame
+	void SetRegionsOfInterest(AVFrame *, const xrt::drivers::wivrn::encoder_settings & settings);
 
 public:
 	video_encoder_va(wivrn_vk_bundle &, xrt::drivers::wivrn::encoder_settings & settings, float fps);
+	~video_encoder_va();
+
+	// Loads the VAAPI driver without keeping any context, so that the process can fork
+	static void Preload();
+	// Creates the device contexts shared by the encoders on this device, the first render node if unset
+	static void Prewarm(const std::optional<std::string> & device);
 
-	void PresentImage(yuv_converter & src_yuv, vk::raii::CommandBuffer & cmd_buf) override;
+	void PresentImage(yuv_converter & src_yuv, vk::raii::CommandBuffer & cmd_buf, uint64_t frame_index) override;
 
 protected:
-	void PushFrame(bool idr, std::chrono::steady_clock::time_point pts) override;
+	void PushFrame(bool idr, std::chrono::steady_clock::time_point pts, uint64_t frame_index) override;
+	void FrameDone(uint64_t frame_index) override;
 };
@@ -0,0 +1,79 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "wivrn_packets.h"
+#include <cmath>
+
+// From the coordinates of a view of the foveated stream image to an application image, for the shaders
+// that sample the application layers directly. Same layout as the eye parameters of these shaders:
+// the unfoveated coordinates, from -1 to 1, are lambda * tan(a * uv + b) + xc, see wivrn_hmd.cpp,
+// then they are scaled by uv_scale and moved by uv_offset.
+struct foveated_mapping
+{
+	// a is 0 on axes without foveation
+	float a[2];
+	float b[2];
+	float lambda[2];
+	float xc[2];
+	float uv_scale[2];
+	float uv_offset[2];
+
+	void set_foveation(const xrt::drivers::wivrn::to_headset::video_stream_description::foveation_parameter & param)
+	{
+		set_foveation(param.x, 0);
+		set_foveation(param.y, 1);
+	}
+
+	// x, y, width and height are the normalized rectangle of the image with the view,
+	// the fields of view are the ones of the stream and of the image, with the same pose
+	void set_mapping(const XrFovf & stream_fov, const XrFovf & image_fov, float x, float y, float width, float height)
+	{
+		set_mapping(std::tan(stream_fov.angleLeft), std::tan(stream_fov.angleRight), std::tan(image_fov.angleLeft), std::tan(image_fov.angleRight), x, width, 0);
+		// Rows go down, from the up angle
+		set_mapping(std::tan(stream_fov.angleUp), std::tan(stream_fov.angleDown), std::tan(image_fov.angleUp), std::tan(image_fov.angleDown), y, height, 1);
+	}
+
+private:
+	void set_foveation(const xrt::drivers::wivrn::to_headset::video_stream_description::foveation_parameter_item & param, int axis)
+	{
+		if (param.scale < 1)
+		{
+			a[axis] = param.a;
+			b[axis] = param.b;
+			lambda[axis] = param.scale / param.a;
+			xc[axis] = param.center;
+		}
+		else
+		{
+			a[axis] = 0;
+			b[axis] = 0;
+			lambda[axis] = 0;
+			xc[axis] = 0;
+		}
+	}
+
+	// Linear mapping from the stream view, from -1 to 1, to the image, with tangents of the angles
+	void set_mapping(float stream_min, float stream_max, float image_min, float image_max, float offset, float size, int axis)
+	{
+		uv_scale[axis] = size * (stream_max - stream_min) / (2 * (image_max - image_min));
+		uv_offset[axis] = offset + size * ((stream_min + stream_max) / 2 - image_min) / (image_max - image_min);
+	}
+};
@@ -0,0 +1,172 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "motion_estimator.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdlib>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace xrt::drivers::wivrn
+{
+
+namespace
+{
+// Minimum improvement of the sum of absolute differences over no motion, so that
+// flat or noisy blocks are not given a random motion
+constexpr int min_gain = motion_estimator::block_size * motion_estimator::block_size * 2;
+
+// Subpixel position of the minimum of the parabola through 3 points, from -0.5 to 0.5
+float refine(int before, int at, int after)
+{
+	int denominator = before - 2 * at + after;
+	if (denominator <= 0)
+		return 0;
+	return std::clamp(float(before - after) / (2 * denominator), -0.5f, 0.5f);
+}
+} // namespace
+
+motion_estimator::motion_estimator(uint16_t stream_width, uint16_t stream_height) :
+        width((stream_width + to_headset::video_stream_motion::block_size - 1) / to_headset::video_stream_motion::block_size),
+        height((stream_height + to_headset::video_stream_motion::block_size - 1) / to_headset::video_stream_motion::block_size),
+        valid_width((stream_width + yuv_converter::thumbnail_scale - 1) / yuv_converter::thumbnail_scale),
+        valid_height((stream_height + yuv_converter::thumbnail_scale - 1) / yuv_converter::thumbnail_scale),
+        stride(width * block_size + 2 * search_range),
+        current(stride * (height * block_size + 2 * search_range)),
+        previous(current.size())
+{
+}
+
+void motion_estimator::copy_padded(std::span<const uint8_t> thumbnail, vk::Extent2D thumbnail_size)
+{
+	uint32_t w = std::min(valid_width, thumbnail_size.width);
+	uint32_t h = std::min(valid_height, thumbnail_size.height);
+	size_t rows = current.size() / stride;
+	for (size_t y = 0; y < rows; ++y)
+	{
+		uint32_t src_y = std::clamp<int>(int(y) - search_range, 0, h - 1);
+		const uint8_t * src = thumbnail.data() + src_y * thumbnail_size.width;
+		uint8_t * dst = current.data() + y * stride;
+		for (size_t x = 0; x < stride; ++x)
+			dst[x] = src[std::clamp<int>(int(x) - search_range, 0, w - 1)];
+	}
+}
+
+int motion_estimator::sad(int x, int y, int dx, int dy) const
+{
+	static_assert(block_size == 8);
+	const uint8_t * a = current.data() + (search_range + y * block_size) * stride + search_range + x * block_size;
+	const uint8_t * b = previous.data() + (search_range + y * block_size - dy) * stride + search_range + x * block_size - dx;
+#ifdef __SSE2__
+	__m128i sum = _mm_setzero_si128();
+	for (int row = 0; row < block_size; row += 2)
+	{
+		__m128i va = _mm_unpacklo_epi64(
+		        _mm_loadl_epi64((const __m128i *)(a + row * stride)),
+		        _mm_loadl_epi64((const __m128i *)(a + (row + 1) * stride)));
+		__m128i vb = _mm_unpacklo_epi64(
+		        _mm_loadl_epi64((const __m128i *)(b + row * stride)),
+		        _mm_loadl_epi64((const __m128i *)(b + (row + 1) * stride)));
+		sum = _mm_add_epi64(sum, _mm_sad_epu8(va, vb));
+	}
+	return _mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_srli_si128(sum, 8));
+#else
+	int sum = 0;
+	for (int row = 0; row < block_size; ++row)
+		for (int col = 0; col < block_size; ++col)
+			sum += std::abs(int(a[row * stride + col]) - int(b[row * stride + col]));
+	return sum;
+#endif
+}
+
+std::optional<to_headset::video_stream_motion> motion_estimator::estimate(
+        std::span<const uint8_t> thumbnail,
+        vk::Extent2D thumbnail_size,
+        uint64_t frame_index,
+        XrTime display_time)
+{
+	copy_padded(thumbnail, thumbnail_size);
+
+	std::optional<to_headset::video_stream_motion> result;
+	if (has_previous and display_time > previous_display_time)
+	{
+		result.emplace(to_headset::video_stream_motion{
+		        .frame_idx = frame_index,
+		        .interval = std::chrono::nanoseconds(display_time - previous_display_time),
+		        .width = width,
+		        .height = height,
+		});
+		result->vectors.resize(2 * width * height);
+
+		constexpr int side = 2 * search_range + 1;
+		std::array<int, side * side> costs;
+		for (int y = 0; y < height; ++y)
+		{
+			for (int x = 0; x < width; ++x)
+			{
+				int best = search_range * side + search_range;
+				for (int dy = -search_range; dy <= search_range; ++dy)
+				{
+					for (int dx = -search_range; dx <= search_range; ++dx)
+					{
+						int i = (dy + search_range) * side + dx + search_range;
+						costs[i] = sad(x, y, dx, dy);
+						// Ties are resolved towards the smallest motion
+						if (costs[i] < costs[best] or (costs[i] == costs[best] and std::abs(dx) + std::abs(dy) < std::abs(best % side - search_range) + std::abs(best / side - search_range)))
+							best = i;
+					}
+				}
+
+				float mx = 0;
+				float my = 0;
+				int zero = search_range * side + search_range;
+				if (costs[zero] - costs[best] >= min_gain)
+				{
+					int bx = best % side;
+					int by = best / side;
+					mx = bx - search_range;
+					my = by - search_range;
+					if (bx > 0 and bx < side - 1)
+						mx += refine(costs[best - 1], costs[best], costs[best + 1]);
+					if (by > 0 and by < side - 1)
+						my += refine(costs[best - side], costs[best], costs[best + side]);
+				}
+
+				// Texels of the thumbnail to half pixels of the stream
+				constexpr float scale = 2 * yuv_converter::thumbnail_scale;
+				int8_t * v = &result->vectors[2 * (y * width + x)];
+				v[0] = std::lround(std::clamp(mx * scale, -127.f, 127.f));
+				v[1] = std::lround(std::clamp(my * scale, -127.f, 127.f));
+			}
+		}
+	}
+
+	std::swap(current, previous);
+	has_previous = true;
+	previous_display_time = display_time;
+	return result;
+}
+
+} // namespace xrt::drivers::wivrn
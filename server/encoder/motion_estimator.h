@@ -0,0 +1,74 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "wivrn_packets.h"
+#include "yuv_converter.h"
+
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <vector>
+
+namespace xrt::drivers::wivrn
+{
+
+// Motion of the content between successive frames, by block matching on the
+// thumbnails of yuv_converter. Only small displacements are searched, which is
+// enough to extrapolate a frame for one display interval on the headset.
+class motion_estimator
+{
+public:
+	// Size of the blocks, in texels of the thumbnail
+	static constexpr int block_size = to_headset::video_stream_motion::block_size / yuv_converter::thumbnail_scale;
+	// Maximum displacement, in texels of the thumbnail
+	static constexpr int search_range = 4;
+
+private:
+	// Number of blocks
+	uint16_t width;
+	uint16_t height;
+	// Texels of the thumbnail inside the stream
+	uint32_t valid_width;
+	uint32_t valid_height;
+
+	// Thumbnails with a border of search_range texels, edges are repeated
+	size_t stride;
+	std::vector<uint8_t> current;
+	std::vector<uint8_t> previous;
+	bool has_previous = false;
+	XrTime previous_display_time = 0;
+
+	void copy_padded(std::span<const uint8_t> thumbnail, vk::Extent2D thumbnail_size);
+	int sad(int x, int y, int dx, int dy) const;
+
+public:
+	motion_estimator(uint16_t stream_width, uint16_t stream_height);
+
+	// Motion from the previous frame to this one, nothing for the first frame
+	std::optional<to_headset::video_stream_motion> estimate(
+	        std::span<const uint8_t> thumbnail,
+	        vk::Extent2D thumbnail_size,
+	        uint64_t frame_index,
+	        XrTime display_time);
+};
+
+} // namespace xrt::drivers::wivrn
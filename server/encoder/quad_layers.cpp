@@ -0,0 +1,290 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "quad_layers.h"
+
+#include "vk/vk_allocator.h"
+#include "wivrn_rle.h"
+
+#include <algorithm>
+#include <cstring>
+
+using namespace xrt::drivers::wivrn;
+
+bool quad_layer_copier::supported(vk::Format format)
+{
+	switch (format)
+	{
+		case vk::Format::eR8G8B8A8Unorm:
+		case vk::Format::eR8G8B8A8Srgb:
+		case vk::Format::eB8G8R8A8Unorm:
+		case vk::Format::eB8G8R8A8Srgb:
+			return true;
+		default:
+			return false;
+	}
+}
+
+quad_layer_copier::quad_layer_copier(vk::raii::Device & device) :
+        device(&device)
+{
+}
+
+void quad_layer_copier::record_copy_commands(vk::raii::CommandBuffer & cmd_buf, std::vector<layer> layers, bool copy)
+{
+	layers_ = std::move(layers);
+	if (layers_.size() > max_layers)
+		layers_.resize(max_layers);
+	copied_ = copy and not layers_.empty();
+	if (not copied_)
+		return;
+
+	for (size_t i = 0; i < layers_.size(); ++i)
+	{
+		const auto & l = layers_[i];
+		vk::DeviceSize size = l.rect.extent.width * l.rect.extent.height * sizeof(uint32_t);
+		if (not buffers[i] or buffers[i].info().size < size)
+		{
+			buffers[i] = buffer_allocation(
+			        *device,
+			        {
+			                .size = size,
+			                .usage = vk::BufferUsageFlagBits::eTransferDst,
+			        },
+			        {
+			                .flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT,
+			                .usage = VMA_MEMORY_USAGE_AUTO,
+			        });
+		}
+
+		vk::ImageSubresourceRange range{
+		        .aspectMask = vk::ImageAspectFlagBits::eColor,
+		        .baseMipLevel = 0,
+		        .levelCount = 1,
+		        .baseArrayLayer = l.array_index,
+		        .layerCount = 1,
+		};
+		vk::ImageMemoryBarrier barrier{
+		        .srcAccessMask = vk::AccessFlagBits::eShaderRead,
+		        .dstAccessMask = vk::AccessFlagBits::eTransferRead,
+		        .oldLayout = vk::ImageLayout::eShaderReadOnlyOptimal,
+		        .newLayout = vk::ImageLayout::eTransferSrcOptimal,
+		        .image = l.image,
+		        .subresourceRange = range,
+		};
+		cmd_buf.pipelineBarrier(vk::PipelineStageFlagBits::eAllCommands, vk::PipelineStageFlagBits::eTransfer, {}, nullptr, nullptr, barrier);
+
+		cmd_buf.copyImageToBuffer(
+		        l.image,
+		        vk::ImageLayout::eTransferSrcOptimal,
+		        buffers[i],
+		        vk::BufferImageCopy{
+		                .imageSubresource = {
+		                        .aspectMask = vk::ImageAspectFlagBits::eColor,
+		                        .mipLevel = 0,
+		                        .baseArrayLayer = l.array_index,
+		                        .layerCount = 1,
+		                },
+		                .imageOffset = {l.rect.offset.x, l.rect.offset.y, 0},
+		                .imageExtent = {l.rect.extent.width, l.rect.extent.height, 1},
+		        });
+
+		std::swap(barrier.oldLayout, barrier.newLayout);
+		barrier.srcAccessMask = vk::AccessFlagBits::eTransferRead;
+		barrier.dstAccessMask = vk::AccessFlagBits::eShaderRead;
+		cmd_buf.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eAllCommands, {}, nullptr, nullptr, barrier);
+	}
+
+	vk::MemoryBarrier barrier{
+	        .srcAccessMask = vk::AccessFlagBits::eTransferWrite,
+	        .dstAccessMask = vk::AccessFlagBits::eHostRead,
+	};
+	cmd_buf.pipelineBarrier(
+	        vk::PipelineStageFlagBits::eTransfer,
+	        vk::PipelineStageFlagBits::eHost,
+	        {},
+	        barrier,
+	        nullptr,
+	        nullptr);
+}
+
+std::span<const uint32_t> quad_layer_copier::pixels(size_t layer)
+{
+	const auto & l = layers_[layer];
+	vmaInvalidateAllocation(vk_allocator::instance(), buffers[layer], 0, VK_WHOLE_SIZE);
+	return {buffers[layer].data<uint32_t>(), l.rect.extent.width * l.rect.extent.height};
+}
+
+static bool same_layer(const to_headset::quad_layers::item & a, const to_headset::quad_layers::item & b)
+{
+	return a.id == b.id and
+	       a.head_locked == b.head_locked and
+	       a.unpremultiplied_alpha == b.unpremultiplied_alpha and
+	       a.srgb == b.srgb and
+	       memcmp(&a.pose, &b.pose, sizeof(a.pose)) == 0 and
+	       memcmp(&a.size, &b.size, sizeof(a.size)) == 0 and
+	       a.width == b.width and
+	       a.height == b.height;
+}
+
+// Control packets and vectors have 16 bits sizes: the worst case of rle_encode
+// is one control byte for 128 pixels, keep some room for the layer descriptions
+static constexpr size_t max_band_pixels = 15000;
+
+std::vector<to_headset::quad_layers> quad_layer_sender::update(quad_layer_copier & copier)
+{
+	to_headset::quad_layers packet;
+	bool changed = false;
+
+	struct update_rect
+	{
+		size_t item;
+		const std::vector<uint32_t> * pixels;
+		uint16_t x0, y0, x1, y1;
+	};
+	std::vector<update_rect> updates;
+
+	std::map<const void *, state> current;
+	for (size_t index = 0; index < copier.layers().size(); ++index)
+	{
+		const auto & l = copier.layers()[index];
+		auto node = layers.extract(l.swapchain);
+		auto & s = current[l.swapchain];
+		if (node)
+			s = std::move(node.mapped());
+		else
+			s.id = next_id++;
+
+		bool srgb = l.format == vk::Format::eR8G8B8A8Srgb or l.format == vk::Format::eB8G8R8A8Srgb;
+		to_headset::quad_layers::item item{
+		        .id = s.id,
+		        .head_locked = l.head_locked,
+		        .unpremultiplied_alpha = l.unpremultiplied_alpha,
+		        .srgb = srgb,
+		        .pose = l.pose,
+		        .size = l.size,
+		};
+
+		if (copier.copied())
+		{
+			uint16_t width = l.rect.extent.width;
+			uint16_t height = l.rect.extent.height;
+			auto pixels = copier.pixels(index);
+			std::vector<uint32_t> rgba(pixels.begin(), pixels.end());
+			if (l.format == vk::Format::eB8G8R8A8Unorm or l.format == vk::Format::eB8G8R8A8Srgb)
+			{
+				for (auto & p: rgba)
+					p = (p & 0xff00ff00) | ((p & 0xff) << 16) | ((p >> 16) & 0xff);
+			}
+
+			// Bounding rectangle of the changed pixels
+			uint16_t x0 = 0, y0 = 0, x1 = width, y1 = height;
+			if (s.item.width == width and s.item.height == height and s.item.srgb == srgb and s.pixels.size() == rgba.size())
+			{
+				x0 = width;
+				y0 = height;
+				x1 = 0;
+				y1 = 0;
+				for (uint16_t y = 0; y < height; ++y)
+				{
+					const uint32_t * a = rgba.data() + y * width;
+					const uint32_t * b = s.pixels.data() + y * width;
+					if (memcmp(a, b, width * sizeof(uint32_t)) == 0)
+						continue;
+					uint16_t first = std::mismatch(a, a + width, b).first - a;
+					uint16_t last = width;
+					while (a[last - 1] == b[last - 1])
+						--last;
+					x0 = std::min(x0, first);
+					x1 = std::max(x1, last);
+					y0 = std::min(y0, y);
+					y1 = y + 1;
+				}
+			}
+
+			s.pixels = std::move(rgba);
+			if (x0 < x1 and y0 < y1)
+			{
+				updates.push_back({packet.items.size(), &s.pixels, x0, y0, x1, y1});
+				changed = true;
+			}
+			item.width = width;
+			item.height = height;
+		}
+		else
+		{
+			// The size is the one of the last copy
+			item.width = s.item.width;
+			item.height = s.item.height;
+		}
+
+		// Nothing to display until the first copy
+		if (s.pixels.empty())
+			continue;
+
+		s.item = item;
+		packet.items.push_back(std::move(item));
+	}
+
+	changed = changed or packet.items.size() != sent.size() or
+	          not std::ranges::equal(packet.items, sent, same_layer);
+	if (not changed)
+	{
+		layers = std::move(current);
+		return {};
+	}
+
+	// Each packet has the full list of layers and one band of one of the updates,
+	// the headset applies them in order
+	std::vector<to_headset::quad_layers> packets;
+	for (const auto & u: updates)
+	{
+		uint16_t width = packet.items[u.item].width;
+		uint16_t rows = std::max<size_t>(1, max_band_pixels / (u.x1 - u.x0));
+		for (uint16_t y0 = u.y0; y0 < u.y1; y0 += rows)
+		{
+			uint16_t y1 = std::min<uint16_t>(u.y1, y0 + rows);
+			std::vector<uint32_t> rect;
+			rect.reserve((u.x1 - u.x0) * (y1 - y0));
+			for (uint16_t y = y0; y < y1; ++y)
+				rect.insert(rect.end(), u.pixels->begin() + y * width + u.x0, u.pixels->begin() + y * width + u.x1);
+
+			auto & band = packets.emplace_back(packet);
+			auto & item = band.items[u.item];
+			item.update_x = u.x0;
+			item.update_y = y0;
+			item.update_width = u.x1 - u.x0;
+			item.update_height = y1 - y0;
+			item.pixels = rle_encode(rect);
+		}
+	}
+	if (packets.empty())
+		packets.push_back(packet);
+
+	layers = std::move(current);
+	sent = std::move(packet.items);
+	return packets;
+}
+
+void quad_layer_sender::reset()
+{
+	layers.clear();
+	sent.clear();
+}
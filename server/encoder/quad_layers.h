@@ -0,0 +1,107 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "vk/allocation.h"
+#include "wivrn_packets.h"
+#include <array>
+#include <map>
+#include <span>
+#include <vector>
+#include <vulkan/vulkan_raii.hpp>
+
+// Copies the quad layers of the application to host memory, so that they can be
+// sent to the headset on their own instead of being composited in the video stream
+class quad_layer_copier
+{
+public:
+	static constexpr size_t max_layers = 4;
+	static constexpr uint32_t max_size = 2048;
+
+	struct layer
+	{
+		// Identifies the layer across frames
+		const void * swapchain;
+		// In shader read only optimal layout
+		vk::Image image;
+		uint32_t array_index;
+		vk::Format format;
+		vk::Rect2D rect;
+		bool head_locked;
+		bool unpremultiplied_alpha;
+		XrPosef pose;
+		XrExtent2Df size;
+	};
+
+	// Whether a swapchain format can be sent, others are composited in the video stream
+	static bool supported(vk::Format);
+
+	quad_layer_copier() = default;
+	quad_layer_copier(vk::raii::Device & device);
+
+	// The previous commands recorded for this copier must have completed.
+	// If copy is false, only the layer descriptions are kept.
+	void record_copy_commands(vk::raii::CommandBuffer & cmd_buf, std::vector<layer> layers, bool copy);
+
+	const std::vector<layer> & layers() const
+	{
+		return layers_;
+	}
+	bool copied() const
+	{
+		return copied_;
+	}
+
+	// Pixels of a layer, rows of rect.extent.width pixels in the swapchain format.
+	// Only valid once the command buffer recorded by record_copy_commands has completed
+	std::span<const uint32_t> pixels(size_t layer);
+
+private:
+	vk::raii::Device * device = nullptr;
+	std::array<buffer_allocation, max_layers> buffers;
+	std::vector<layer> layers_;
+	bool copied_ = false;
+};
+
+// Keeps what the headset already has, to only send the changes
+class quad_layer_sender
+{
+	struct state
+	{
+		uint8_t id;
+		xrt::drivers::wivrn::to_headset::quad_layers::item item;
+		// RGBA8
+		std::vector<uint32_t> pixels;
+	};
+	std::map<const void *, state> layers;
+	uint8_t next_id = 0;
+	// Last sent list of layers
+	std::vector<xrt::drivers::wivrn::to_headset::quad_layers::item> sent;
+
+public:
+	// Only valid once the command buffer of the copier has completed,
+	// returns the packets to send, in order, if anything changed.
+	// Large updates are split in bands of rows to fit in control packets.
+	std::vector<xrt::drivers::wivrn::to_headset::quad_layers> update(quad_layer_copier & copier);
+
+	// The headset lost its layers
+	void reset();
+};
@@ -0,0 +1,84 @@
+#version 450
+
+// Distance of the application depth layer on a coarse grid of each view of the foveated stream image
+
+layout(binding = 0) uniform sampler2D depth[2];
+
+// 4 values per word, see to_headset::video_stream_depth
+layout(binding = 1) writeonly buffer Output
+{
+	uint values[];
+};
+
+struct eye_parameters
+{
+	// Foveation, a is 0 on axes without foveation
+	vec2 a;
+	vec2 b;
+	vec2 lambda;
+	vec2 xc;
+	// From the unfoveated view, from -1 to 1, to the coordinates of the depth image
+	vec2 uv_scale;
+	vec2 uv_offset;
+	float near_z;
+	float far_z;
+	float min_depth;
+	float max_depth;
+};
+
+layout(push_constant) uniform PushConstants
+{
+	eye_parameters eyes[2];
+}
+pcs;
+
+layout(constant_id = 0) const int grid_size = 32;
+layout(constant_id = 1) const float min_distance = 0.1;
+
+layout(local_size_x = 8, local_size_y = 8) in;
+
+vec2 unfoveate(eye_parameters eye, vec2 uv)
+{
+	uv = 2 * uv - 1;
+	return mix(uv, eye.lambda * tan(eye.a * uv + eye.b) + eye.xc, notEqual(eye.a, vec2(0)));
+}
+
+float distance_at(int view, vec2 uv)
+{
+	eye_parameters eye = pcs.eyes[view];
+	float d = texture(depth[view], unfoveate(eye, uv) * eye.uv_scale + eye.uv_offset).r;
+	d = (d - eye.min_depth) / (eye.max_depth - eye.min_depth);
+
+	if (isinf(eye.far_z))
+		return eye.near_z / (1 - d);
+	if (isinf(eye.near_z))
+		return eye.far_z / d;
+	return eye.near_z * eye.far_z / (eye.far_z - d * (eye.far_z - eye.near_z));
+}
+
+void main()
+{
+	int view = int(gl_WorkGroupID.z);
+	// Each invocation computes 4 consecutive cells of a row
+	uvec2 cell = uvec2(gl_GlobalInvocationID.x * 4, gl_GlobalInvocationID.y);
+	if (cell.x >= grid_size || cell.y >= grid_size)
+		return;
+
+	uint packed = 0;
+	for (uint i = 0; i < 4; ++i)
+	{
+		// Nearest of 4 samples of the cell, so that edges of near objects are kept
+		float dist = 1e30;
+		for (int j = 0; j < 4; ++j)
+		{
+			vec2 uv = (vec2(cell.x + i, cell.y) + (vec2(j % 2, j / 2) + 0.5) / 2) / grid_size;
+			float d = distance_at(view, uv);
+			if (d > 0)
+				dist = min(dist, d);
+		}
+		uint value = uint(clamp(round(255 * min_distance / dist), 0, 255));
+		packed |= value << (i * 8);
+	}
+
+	values[(view * grid_size + cell.y) * (grid_size / 4) + cell.x / 4] = packed;
+}
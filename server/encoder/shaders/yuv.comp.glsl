@@ -12,9 +12,54 @@ layout(binding = 2, r8) uniform writeonly image2D chroma_u;
 layout(binding = 3, r8) uniform writeonly image2D chroma_v;
 #endif
 
+// One checksum per workgroup, for static frame detection
+layout(binding = 4) writeonly buffer Checksums
+{
+	uint checksums[];
+};
+
+// Linear NV12 input of the encoder, written instead of the planes when direct_output is set
+layout(binding = 5) writeonly buffer Output
+{
+	uint nv12[];
+};
+
+// Mean luma of 8x8 pixel blocks, for motion estimation, 4 texels per word
+// Rows of the 4x4 texels of each tile are consecutive in memory, see yuv_converter::thumbnail
+layout(binding = 6) writeonly buffer Thumbnail
+{
+	uint thumbnail[];
+};
+
+// Views of the projection layer of the application, read instead of rgb when sampled_input is set
+layout(binding = 7) uniform sampler2D source[2];
+
+struct eye_parameters
+{
+	// Foveation, a is 0 on axes without foveation
+	vec2 a;
+	vec2 b;
+	vec2 lambda;
+	vec2 xc;
+	// From the unfoveated view, from -1 to 1, to the coordinates of the source view
+	vec2 uv_scale;
+	vec2 uv_offset;
+};
+
+layout(binding = 8) uniform Source
+{
+	eye_parameters eyes[2];
+}
+source_params;
+
 layout(push_constant) uniform PushConstants
 {
 	mat3 color_space;
+	uint direct_output;
+	// In bytes, multiples of 4
+	uint pitch;
+	uint chroma_offset;
+	uint sampled_input;
 }
 pcs;
 
@@ -22,6 +67,56 @@ layout(constant_id = 0) const bool full_range = true;
 
 layout(local_size_x = 16, local_size_y = 16) in;
 
+shared uint tile_checksum;
+
+// Planes of the 32x32 tile of the workgroup, 4 bytes per word
+shared uint tile_luma[32 * 8];
+shared uint tile_chroma[16 * 8];
+
+// Sum of the luma of each 8x8 block of the tile, from 0 to 255
+shared uint tile_thumbnail[16];
+
+uint hash(uint x)
+{
+	x ^= x >> 16;
+	x *= 0x7feb352du;
+	x ^= x >> 15;
+	x *= 0x846ca68bu;
+	x ^= x >> 16;
+	return x;
+}
+
+vec2 unfoveate(eye_parameters eye, vec2 uv)
+{
+	uv = 2 * uv - 1;
+	return mix(uv, eye.lambda * tan(eye.a * uv + eye.b) + eye.xc, notEqual(eye.a, vec2(0)));
+}
+
+vec3 linear_to_srgb(vec3 color)
+{
+	color = clamp(color, 0.0, 1.0);
+	return mix(12.92 * color, 1.055 * pow(color, vec3(1.0 / 2.4)) - 0.055, greaterThan(color, vec3(0.0031308)));
+}
+
+// Texel of the compositor output, in BGRA order with the sRGB transfer function
+vec4 load_texel(ivec2 texel_coords)
+{
+	if (pcs.sampled_input == 0)
+		return imageLoad(rgb, texel_coords);
+
+	// The views are side by side, as in the compositor output
+	ivec2 size = imageSize(rgb);
+	int eye_width = size.x / 2;
+	int view = texel_coords.x >= eye_width ? 1 : 0;
+	vec2 uv = (vec2(texel_coords.x - view * eye_width, texel_coords.y) + 0.5) / vec2(eye_width, size.y);
+
+	eye_parameters eye = source_params.eyes[view];
+	vec2 coords = clamp(unfoveate(eye, uv), -1, 1) * eye.uv_scale + eye.uv_offset;
+	// Constant indices, the view may not be uniform in the workgroup
+	vec4 color = view == 0 ? texture(source[0], coords) : texture(source[1], coords);
+	return vec4(linear_to_srgb(color.bgr), 1);
+}
+
 vec3 rgb_to_ycbcr(vec3 color)
 {
 	vec3 yuv = transpose(pcs.color_space) * color;
@@ -47,6 +142,25 @@ void main()
 	ivec2 coords = ivec2(self_id.x * 2, self_id.y * 2);
 	ivec2 chroma_coords = coords / 2;
 
+	if (gl_LocalInvocationIndex == 0)
+		tile_checksum = 0;
+	if (gl_LocalInvocationIndex < tile_thumbnail.length())
+		tile_thumbnail[gl_LocalInvocationIndex] = 0;
+	if (pcs.direct_output != 0)
+	{
+		tile_luma[gl_LocalInvocationIndex] = 0;
+		if (gl_LocalInvocationIndex < tile_chroma.length())
+			tile_chroma[gl_LocalInvocationIndex] = 0;
+	}
+	barrier();
+
+	// Each invocation writes 2 bytes of each row, in the low or high half of a word
+	uvec2 local_id = gl_LocalInvocationID.xy;
+	uint word = local_id.x / 2;
+	uint shift = (local_id.x % 2) * 16;
+
+	uint checksum = 0;
+	uint luma_sum = 0;
 	int j, k;
 	vec2 uvs[4];
 	for (k = 0; k < 2; k += 1)
@@ -54,10 +168,15 @@ void main()
 		for (j = 0; j < 2; j += 1)
 		{
 			ivec2 texel_coords = coords + ivec2(j, k);
-			vec4 texel = imageLoad(rgb, texel_coords);
+			vec4 texel = load_texel(texel_coords);
+			checksum ^= hash(packUnorm4x8(texel) ^ hash(uint(texel_coords.x) | uint(texel_coords.y) << 16));
 			vec3 yuv = rgb_to_ycbcr(texel.rgb);
+			luma_sum += uint(round(clamp(yuv.x, 0.0, 1.0) * 255.0));
 
-			imageStore(luminance, texel_coords, vec4(yuv.x));
+			if (pcs.direct_output != 0)
+				atomicOr(tile_luma[(local_id.y * 2 + uint(k)) * 8 + word], uint(round(clamp(yuv.x, 0.0, 1.0) * 255.0)) << (shift + uint(j) * 8));
+			else
+				imageStore(luminance, texel_coords, vec4(yuv.x));
 
 			int i = k * 2 + j;
 			uvs[i] = yuv.yz;
@@ -67,9 +186,44 @@ void main()
 	vec2 uv = mix(mix(uvs[0], uvs[1], 0.5), mix(uvs[2], uvs[3], 0.5), 0.5);
 
 #ifdef SEMIPLANAR
-	imageStore(chroma_uv, chroma_coords, vec4(uv.x, uv.y, 0, 0));
+	if (pcs.direct_output != 0)
+		atomicOr(tile_chroma[local_id.y * 8 + word], (packUnorm4x8(vec4(uv, 0, 0)) & 0xffffu) << shift);
+	else
+		imageStore(chroma_uv, chroma_coords, vec4(uv.x, uv.y, 0, 0));
 #else
 	imageStore(chroma_u, chroma_coords, vec4(u.x));
 	imageStore(chroma_v, chroma_coords, vec4(v.y));
 #endif
+
+	// xor is order independent, the position is part of the hash so that moved pixels are detected
+	atomicXor(tile_checksum, checksum);
+	// Each 8x8 block is converted by 4x4 invocations
+	atomicAdd(tile_thumbnail[(local_id.y / 4) * 4 + local_id.x / 4], luma_sum);
+	barrier();
+	if (gl_LocalInvocationIndex == 0)
+		checksums[gl_WorkGroupID.y * gl_NumWorkGroups.x + gl_WorkGroupID.x] = tile_checksum;
+	if (gl_LocalInvocationIndex < 4)
+	{
+		uint row = gl_LocalInvocationIndex;
+		uint packed = 0;
+		for (uint i = 0; i < 4; ++i)
+			packed |= ((tile_thumbnail[row * 4 + i] + 32) / 64) << (i * 8);
+		thumbnail[(gl_WorkGroupID.y * 4 + row) * gl_NumWorkGroups.x + gl_WorkGroupID.x] = packed;
+	}
+
+	if (pcs.direct_output != 0)
+	{
+		// Rows are padded to the pitch, words past the image width are in the padding
+		uvec2 size = uvec2(imageSize(rgb));
+		uvec2 tile = gl_WorkGroupID.xy * 32;
+		uint row = gl_LocalInvocationIndex / 8;
+		uint x = tile.x + (gl_LocalInvocationIndex % 8) * 4;
+		if (x < pcs.pitch)
+		{
+			if (tile.y + row < size.y)
+				nv12[((tile.y + row) * pcs.pitch + x) / 4] = tile_luma[gl_LocalInvocationIndex];
+			if (row < 16 && tile.y / 2 + row < size.y / 2)
+				nv12[(pcs.chroma_offset + (tile.y / 2 + row) * pcs.pitch + x) / 4] = tile_chroma[gl_LocalInvocationIndex];
+		}
+	}
 }
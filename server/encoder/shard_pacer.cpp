@@ -0,0 +1,60 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "shard_pacer.h"
+#include "wivrn_packets.h"
+
+#include <algorithm>
+
+namespace xrt::drivers::wivrn
+{
+
+// Number of shards that can be sent without waiting
+static const size_t burst_shards = 16;
+
+void shard_pacer::set_rate(uint64_t bitrate, double fraction)
+{
+	if (fraction <= 0 or bitrate == 0)
+	{
+		rate = 0;
+		return;
+	}
+	rate = bitrate / (8e9 * fraction);
+	burst = burst_shards * to_headset::video_stream_data_shard::max_payload_size;
+	tokens = std::min(tokens, burst);
+}
+
+int64_t shard_pacer::consume(size_t bytes, int64_t now)
+{
+	if (rate == 0)
+		return 0;
+
+	if (last_update)
+		tokens = std::min(burst, tokens + (now - last_update) * rate);
+	else
+		tokens = burst;
+	last_update = now;
+
+	tokens -= bytes;
+	if (tokens >= 0)
+		return 0;
+	return -tokens / rate;
+}
+
+} // namespace xrt::drivers::wivrn
@@ -0,0 +1,48 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace xrt::drivers::wivrn
+{
+
+// Token bucket used to spread the shards of a frame over time,
+// large bursts overflow Wi-Fi access points queues
+class shard_pacer
+{
+	// bytes per ns, 0 if pacing is disabled
+	double rate = 0;
+	// maximum number of bytes sent in a burst
+	double burst = 0;
+	double tokens = 0;
+	int64_t last_update = 0;
+
+public:
+	// Send data at a rate such that a frame of average size is sent
+	// in the given fraction of the frame interval
+	void set_rate(uint64_t bitrate, double fraction);
+
+	// Account for bytes about to be sent, returns the time in ns to wait before sending them
+	int64_t consume(size_t bytes, int64_t now);
+};
+
+} // namespace xrt::drivers::wivrn
@@ -17,15 +17,21 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
-// Include first because of incompatibility between Eigen and X includes
-#include "driver/wivrn_session.h"
-
 #include "video_encoder.h"
 
 #include "os/os_time.h"
+#include "reed_solomon.h"
 #include "util/u_logging.h"
+#include "utils/metrics.h"
+#include "utils/named_thread.h"
 
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <optional>
 #include <string>
+#include <thread>
+#include <type_traits>
 
 #include "wivrn_config.h"
 
@@ -38,10 +44,84 @@
 #ifdef WIVRN_USE_X265
 #include "video_encoder_x265.h"
 #endif
+#ifdef WIVRN_USE_VULKAN_ENCODE
+#include "video_encoder_vulkan.h"
+#endif
 
 namespace xrt::drivers::wivrn
 {
 
+void VideoEncoder::Preload()
+{
+#ifdef WIVRN_USE_NVENC
+	try
+	{
+		VideoEncoderNvenc::Preload();
+		return;
+	}
+	catch (const std::exception & e)
+	{
+		U_LOG_D("nvenc not preloaded: %s", e.what());
+	}
+#endif
+#ifdef WIVRN_USE_VAAPI
+	try
+	{
+		video_encoder_va::Preload();
+	}
+	catch (const std::exception & e)
+	{
+		U_LOG_D("vaapi not preloaded: %s", e.what());
+	}
+#endif
+}
+
+void VideoEncoder::Prewarm(std::vector<configuration::encoder> encoders)
+{
+	utils::named_thread("encoder_prewarm", [encoders]() {
+		auto start = os_monotonic_get_ns();
+#ifdef WIVRN_USE_NVENC
+		if (encoders.empty() or std::ranges::any_of(encoders, [](const auto & e) { return e.name == encoder_nvenc; }))
+		{
+			try
+			{
+				VideoEncoderNvenc::Prewarm();
+				U_LOG_I("nvenc context created in %.1fms", (os_monotonic_get_ns() - start) / 1e6);
+				// The default encoder is nvenc if it works
+				if (encoders.empty())
+					return;
+			}
+			catch (const std::exception & e)
+			{
+				U_LOG_D("nvenc not prewarmed: %s", e.what());
+			}
+		}
+#endif
+#ifdef WIVRN_USE_VAAPI
+		std::vector<std::optional<std::string>> devices;
+		if (encoders.empty())
+			devices.push_back(std::nullopt);
+		for (const auto & encoder: encoders)
+		{
+			if (encoder.name == encoder_vaapi and std::ranges::find(devices, encoder.device) == devices.end())
+				devices.push_back(encoder.device);
+		}
+		for (const auto & device: devices)
+		{
+			try
+			{
+				video_encoder_va::Prewarm(device);
+				U_LOG_I("vaapi context created in %.1fms", (os_monotonic_get_ns() - start) / 1e6);
+			}
+			catch (const std::exception & e)
+			{
+				U_LOG_D("vaapi not prewarmed: %s", e.what());
+			}
+		}
+#endif
+	}).detach();
+}
+
 std::unique_ptr<VideoEncoder> VideoEncoder::Create(
         wivrn_vk_bundle & wivrn_vk,
         encoder_settings & settings,
@@ -69,10 +149,29 @@ std::unique_ptr<VideoEncoder> VideoEncoder::Create(
 	{
 		res = std::make_unique<video_encoder_va>(wivrn_vk, settings, fps);
 	}
+#endif
+#ifdef WIVRN_USE_VULKAN_ENCODE
+	if (settings.encoder_name == encoder_vulkan)
+	{
+		res = std::make_unique<VideoEncoderVulkan>(wivrn_vk, settings, fps);
+	}
 #endif
 	if (not res)
 		throw std::runtime_error("Failed to create encoder " + settings.encoder_name);
 	res->stream_idx = stream_idx;
+	res->fec_ratio = settings.fec_ratio;
+	res->pacing = settings.pacing;
+	res->tcp_only = settings.tcp_only;
+	res->skip_static_frames = settings.skip_static_frames;
+	// Cleared by the backend if not supported
+	res->intra_refresh = settings.intra_refresh > 0;
+	if (settings.non_reference_frames and not res->SupportsNonReferenceFrames())
+	{
+		U_LOG_W("Stream %d: %s encoder does not support non-reference frames", stream_idx, settings.encoder_name.c_str());
+		settings.non_reference_frames = false;
+	}
+	res->non_reference_frames = settings.non_reference_frames;
+	res->pacer.set_rate(settings.bitrate, settings.pacing);
 
 	auto wivrn_dump_video = std::getenv("WIVRN_DUMP_VIDEO");
 	if (wivrn_dump_video)
@@ -81,32 +180,260 @@ std::unique_ptr<VideoEncoder> VideoEncoder::Create(
 		file += "-" + std::to_string(stream_idx);
 		switch (settings.codec)
 		{
+			case h264:
+				file += ".h264";
+				break;
 			case h265:
 				file += ".h265";
 				break;
+			case av1:
+				file += ".obu";
+				break;
 		}
-		res->video_dump.open(file);
+		res->video_dump = std::make_unique<bitstream_sink>(file);
 	}
+	if (not settings.spectator_socket.empty())
+		res->spectator = std::make_unique<bitstream_sink>(settings.spectator_socket, bitstream_sink::mode::socket);
 	return res;
 }
 
 static const uint64_t idr_throttle = 100;
+// Do not retransmit shards that would arrive later than this before display
+static const XrDuration retransmit_margin = 5'000'000;
+// Maximum number of data shards protected by one set of parity shards
+static const size_t fec_block_size = 32;
 
 VideoEncoder::VideoEncoder() :
-        last_idr_frame(-idr_throttle) {}
+        last_idr_frame(-idr_throttle)
+{
+	for (auto & i: non_reference_history)
+		i = -1;
+}
+
+namespace
+{
+// Foveated coordinate, in [-1, 1], of the foveation centre on one axis
+double foveation_center(const to_headset::video_stream_description::foveation_parameter_item & p)
+{
+	if (p.scale >= 1)
+		return 0;
+	// foveate(x) = λ / a * tan(a * x + b) + c is c for a * x + b = 0
+	return -p.b / p.a;
+}
+
+// Distance to the foveation centre on one axis, 0 at the centre and 1 at the edges
+double axis_distance(double x, double center)
+{
+	if (x > center)
+		return (x - center) / (1 - center);
+	return (center - x) / (1 + center);
+}
+
+// Inverse of axis_distance, on the given side of the centre
+double axis_position(double distance, double center, int side)
+{
+	if (side > 0)
+		return center + distance * (1 - center);
+	return center - distance * (1 + center);
+}
+} // namespace
+
+double VideoEncoder::QpOffset(const encoder_settings & settings, double x, double y)
+{
+	if (settings.qp_emphasis <= 0 or settings.stream_width == 0 or settings.stream_height == 0)
+		return 0;
+
+	double eye_width = settings.stream_width / 2.;
+	double stream_x = settings.offset_x + x;
+	int eye = std::clamp(int(stream_x / eye_width), 0, 1);
+	double u = 2 * (stream_x - eye * eye_width) / eye_width - 1;
+	double v = 2 * (settings.offset_y + y) / settings.stream_height - 1;
+
+	// Rings of equal distance are rectangles, so they can also be given as regions of interest
+	const auto & foveation = settings.foveation[eye];
+	double distance = std::max(
+	        axis_distance(u, foveation_center(foveation.x)),
+	        axis_distance(v, foveation_center(foveation.y)));
+
+	return settings.qp_emphasis * (std::clamp(distance, 0., 1.) - qp_mean_distance);
+}
+
+std::vector<float> VideoEncoder::QpOffsetMap(const encoder_settings & settings, int block_size)
+{
+	if (settings.qp_emphasis <= 0)
+		return {};
+
+	int width = (settings.video_width + block_size - 1) / block_size;
+	int height = (settings.video_height + block_size - 1) / block_size;
+	std::vector<float> map;
+	map.reserve(width * height);
+	for (int y = 0; y < height; ++y)
+	{
+		for (int x = 0; x < width; ++x)
+			map.push_back(QpOffset(settings, (x + 0.5) * block_size, (y + 0.5) * block_size));
+	}
+	return map;
+}
+
+vk::Rect2D VideoEncoder::QpEmphasisRegion(const encoder_settings & settings, int eye, double distance)
+{
+	double eye_width = settings.stream_width / 2.;
+	const auto & foveation = settings.foveation[eye];
+	double cu = foveation_center(foveation.x);
+	double cv = foveation_center(foveation.y);
+
+	// Stream coordinates of the region
+	double x0 = eye * eye_width + (axis_position(distance, cu, -1) + 1) / 2 * eye_width;
+	double x1 = eye * eye_width + (axis_position(distance, cu, 1) + 1) / 2 * eye_width;
+	double y0 = (axis_position(distance, cv, -1) + 1) / 2 * settings.stream_height;
+	double y1 = (axis_position(distance, cv, 1) + 1) / 2 * settings.stream_height;
+
+	// Clip to the encoded image
+	int left = std::clamp<int>(std::floor(x0) - settings.offset_x, 0, settings.width);
+	int right = std::clamp<int>(std::ceil(x1) - settings.offset_x, 0, settings.width);
+	int top = std::clamp<int>(std::floor(y0) - settings.offset_y, 0, settings.height);
+	int bottom = std::clamp<int>(std::ceil(y1) - settings.offset_y, 0, settings.height);
+
+	return vk::Rect2D{
+	        .offset = {left, top},
+	        .extent = {uint32_t(right - left), uint32_t(bottom - top)},
+	};
+}
+
+void VideoEncoder::PlaceInset(encoder_settings & settings)
+{
+	if (not settings.inset or settings.stream_width == 0 or settings.stream_height == 0)
+		return;
+
+	int eye_width = settings.stream_width / 2;
+	int eye = std::clamp((settings.offset_x + settings.width / 2) / eye_width, 0, 1);
+	const auto & foveation = settings.foveation[eye];
+
+	// Stream coordinates of the centre, the offsets stay even for the chroma plane
+	double cx = eye * eye_width + (foveation_center(foveation.x) + 1) / 2 * eye_width;
+	double cy = (foveation_center(foveation.y) + 1) / 2 * settings.stream_height;
+	int min_x = eye * eye_width + eye * eye_width % 2;
+	int max_x = std::max(min_x, eye * eye_width + eye_width - settings.width);
+	int max_y = std::max(0, settings.stream_height - settings.height);
+	settings.offset_x = std::clamp<int>(std::round((cx - settings.width / 2.) / 2) * 2, min_x, max_x & ~1);
+	settings.offset_y = std::clamp<int>(std::round((cy - settings.height / 2.) / 2) * 2, 0, max_y & ~1);
+}
 
 void VideoEncoder::SyncNeeded()
 {
 	sync_needed = true;
 }
 
-void VideoEncoder::Encode(wivrn_session & cnx,
+void VideoEncoder::FrameLost(uint64_t frame_index)
+{
+	if (non_reference_history[frame_index % non_reference_history.size()] == frame_index)
+		return;
+	uint64_t expected = lost_frame;
+	while (frame_index < expected and not lost_frame.compare_exchange_weak(expected, frame_index))
+	{
+	}
+}
+
+void VideoEncoder::SetBitrate(uint64_t bitrate)
+{
+	pending_bitrate = bitrate;
+}
+
+bool VideoEncoder::IsNonReference(uint64_t frame_index)
+{
+	std::lock_guard lock(mutex);
+	const auto & params = frames[frame_index % frames.size()];
+	return params.frame_index == frame_index and params.non_reference;
+}
+
+std::optional<bitrate_controller::frame_info> VideoEncoder::GetFrameInfo(uint64_t frame_index)
+{
+	std::lock_guard lock(mutex);
+	auto & sent = history[frame_index % history.size()];
+	if (sent.frame_idx != frame_index)
+		return std::nullopt;
+	ResolveSendEnd(sent);
+	return bitrate_controller::frame_info{
+	        .bytes = sent.bytes,
+	        .send_begin = sent.send_begin,
+	        .send_end = sent.send_end,
+	        .idr = sent.idr,
+	        .slices = sent.slices,
+	        .average_qp = sent.average_qp,
+	        .encode_time = sent.encode_time,
+	        .shards = uint16_t(sent.shard_count),
+	};
+}
+
+void VideoEncoder::Retransmit(const from_headset::video_stream_nack & nack)
+{
+	std::lock_guard lock(mutex);
+	auto & sent = history[nack.frame_index % history.size()];
+	if (sent.frame_idx != nack.frame_index or not cnx)
+		return;
+
+	if (clock.to_headset(os_monotonic_get_ns()) + retransmit_margin > sent.display_time)
+	{
+		U_LOG_D("Too late to retransmit shards of stream %d frame %ld", stream_idx, nack.frame_index);
+		return;
+	}
+
+	size_t end = std::min<size_t>(nack.first_shard + nack.shard_count, sent.shard_count);
+	try
+	{
+		for (size_t i = nack.first_shard; i < end; ++i)
+			// Shards in history already contain the payload
+			cnx->queue_video_shard(stream_idx, sent.shards[i], {});
+		cnx->flush_stream(stream_idx);
+	}
+	catch (...)
+	{
+		// Ignore network errors
+	}
+}
+
+void VideoEncoder::Encode(encoder_output & cnx,
                           const to_headset::video_stream_data_shard::view_info_t & view_info,
-                          uint64_t frame_index)
+                          uint64_t frame_index,
+                          std::span<const uint32_t> checksums,
+                          bool refresh)
 {
 	this->cnx = &cnx;
+	if (skip_static_frames)
+	{
+		// The whole image is compared and not only the encoded part, and refresh is
+		// decided once per frame, so that all streams skip the same frames and the
+		// headset can still match them. A pending recovery waits for the next refresh
+		if (not refresh and std::ranges::equal(checksums, last_checksums))
+		{
+			cnx.dump_time("encode_skip", frame_index, os_monotonic_get_ns(), stream_idx);
+			metrics::frames_skipped.add();
+			return;
+		}
+		last_checksums.assign(checksums.begin(), checksums.end());
+	}
 	auto target_timestamp = std::chrono::steady_clock::time_point(std::chrono::nanoseconds(view_info.display_time));
 	bool idr = sync_needed.exchange(false);
+	if (uint64_t lost = lost_frame.exchange(-1); lost != uint64_t(-1) and not idr)
+	{
+		try
+		{
+			idr = not InvalidateReferences(lost, frame_index);
+		}
+		catch (std::exception & e)
+		{
+			U_LOG_W("Stream %d: failed to invalidate reference frames: %s", stream_idx, e.what());
+			idr = true;
+		}
+		if (not idr)
+			U_LOG_D("Stream %d: invalidated references from frame %ld", stream_idx, lost);
+		else if (intra_refresh)
+		{
+			// The next refresh cycle repairs the image
+			U_LOG_D("Stream %d: frame %ld lost, waiting for intra refresh", stream_idx, lost);
+			idr = false;
+		}
+	}
 	// Throttle idr to prevent overloading the decoder
 	if (idr and frame_index < last_idr_frame + idr_throttle)
 	{
@@ -116,43 +443,104 @@ void VideoEncoder::Encode(wivrn_session & cnx,
 	}
 	if (idr)
 		last_idr_frame = frame_index;
-	const char * extra = idr ? ",idr" : ",p";
-	clock = cnx.get_offset();
-	timing_info.encode_begin = clock.to_headset(os_monotonic_get_ns());
+	// Reference and non-reference frames alternate, starting with a reference after an IDR frame
+	bool non_reference = non_reference_frames and not idr and not last_non_reference;
+	last_non_reference = non_reference;
+	if (non_reference)
+		non_reference_history[frame_index % non_reference_history.size()] = frame_index;
+	if (uint64_t bitrate = pending_bitrate.exchange(0))
+	{
+		try
+		{
+			ApplyBitrate(bitrate);
+			std::lock_guard lock(mutex);
+			pacer.set_rate(bitrate, pacing);
+		}
+		catch (std::exception & e)
+		{
+			U_LOG_W("Failed to change bitrate of stream %d: %s", stream_idx, e.what());
+		}
+	}
+	const char * extra = idr ? ",idr" : non_reference ? ",n" : ",p";
+	{
+		std::lock_guard lock(mutex);
+		clock = cnx.get_offset();
+		frames[frame_index % frames.size()] = {
+		        .frame_index = frame_index,
+		        .view_info = view_info,
+		        .encode_begin = clock.to_headset(os_monotonic_get_ns()),
+		        .idr = idr,
+		        .non_reference = non_reference,
+		};
+	}
 	cnx.dump_time("encode_begin", frame_index, os_monotonic_get_ns(), stream_idx, extra);
 
-	// Prepare the video shard template
-	shard.stream_item_idx = stream_idx;
-	shard.frame_idx = frame_index;
-	shard.shard_idx = 0;
-	shard.view_info = view_info;
-	shard.timing_info.reset();
-
-	Encode(idr, target_timestamp);
+	Encode(idr, target_timestamp, frame_index);
 	cnx.dump_time("encode_end", frame_index, os_monotonic_get_ns(), stream_idx, extra);
 }
 
-void VideoEncoder::SendData(std::span<uint8_t> data, bool end_of_frame)
+void VideoEncoder::SendData(std::span<uint8_t> data, bool end_of_frame, uint64_t frame_index, float average_qp)
 {
-	std::lock_guard lock(mutex);
+	std::unique_lock lock(mutex);
+	if (frame_done or shard.frame_idx != frame_index)
+	{
+		const auto & params = frames[frame_index % frames.size()];
+		if (params.frame_index != frame_index)
+		{
+			U_LOG_W("Stream %d: dropping data of frame %ld, encoded too late", stream_idx, frame_index);
+			return;
+		}
+		// Prepare the video shard template
+		shard.stream_item_idx = stream_idx;
+		shard.frame_idx = frame_index;
+		shard.shard_idx = 0;
+		shard.view_info = params.view_info;
+		shard.timing_info.reset();
+		timing_info.encode_begin = params.encode_begin;
+		timing_info.bytes = 0;
+		frame_slices = 0;
+		fec_symbols.clear();
+		frame_done = false;
+		frame_stale = false;
+		frame_flags = params.non_reference ? to_headset::video_stream_data_shard::non_reference : 0;
+	}
+	++frame_slices;
+	timing_info.bytes += data.size();
 	if (end_of_frame)
+	{
 		timing_info.send_end = clock.to_headset(os_monotonic_get_ns());
-	if (video_dump)
-		video_dump.write((char *)data.data(), data.size());
+		timing_info.average_qp = average_qp;
+	}
+	for (auto sink: {video_dump.get(), spectator.get()})
+	{
+		if (not sink)
+			continue;
+		// view_info of the shard is only set for the first shard of the frame
+		sink->push(data, end_of_frame, frame_index, frames[frame_index % frames.size()].view_info.display_time);
+		if (sink->sync_requested())
+			sync_needed = true;
+	}
 	if (shard.shard_idx == 0)
 	{
 		cnx->dump_time("send_begin", shard.frame_idx, os_monotonic_get_ns(), stream_idx);
 		timing_info.send_begin = clock.to_headset(os_monotonic_get_ns());
+		pacing_delay = 0;
 	}
 
-	shard.flags = to_headset::video_stream_data_shard::start_of_slice;
+	shard.flags = to_headset::video_stream_data_shard::start_of_slice | frame_flags;
 	auto begin = data.begin();
 	auto end = data.end();
 	while (begin != end)
 	{
-		const size_t view_info_size = sizeof(to_headset::video_stream_data_shard::view_info_t);
-		const size_t max_payload_size = to_headset::video_stream_data_shard::max_payload_size - (shard.view_info ? view_info_size : 0);
+		if (PastDisplayTime())
+		{
+			metrics::stale_video_bytes.add(end - begin);
+			break;
+		}
+		const size_t view_info_size = to_headset::video_stream_data_shard::view_info_size;
+		const size_t max_payload_size = (tcp_only ? to_headset::video_stream_data_shard::max_tcp_payload_size : to_headset::video_stream_data_shard::max_payload_size) - (shard.view_info ? view_info_size : 0);
 		auto next = std::min(end, begin + max_payload_size);
+		shard.offset = timing_info.bytes - (end - begin);
 		if (next == end)
 		{
 			shard.flags |= to_headset::video_stream_data_shard::end_of_slice;
@@ -163,21 +551,204 @@ void VideoEncoder::SendData(std::span<uint8_t> data, bool end_of_frame)
 			}
 		}
 		shard.payload = {begin, next};
+		auto header = SerializeShardHeader();
 		try
 		{
-			cnx->send_stream(shard);
+			// Shards are sent in a batch at the end of the slice
+			cnx->queue_video_shard(stream_idx, header, shard.payload);
 		}
 		catch (...)
 		{
 			// Ignore network errors
 		}
+
+		// Keep the serialized shard for retransmission and FEC
+		auto & sent = history[shard.frame_idx % history.size()];
+		if (sent.frame_idx != shard.frame_idx)
+		{
+			sent.frame_idx = shard.frame_idx;
+			sent.shard_count = 0;
+			sent.bytes = 0;
+			sent.send_begin = os_monotonic_get_ns();
+			sent.send_end = 0;
+			sent.last_datagram.reset();
+		}
+		if (shard.view_info)
+			sent.display_time = shard.view_info->display_time;
+		const size_t shard_size = header.size() + shard.payload.size();
+		sent.bytes += shard_size;
+		metrics::video_bytes.add(shard_size);
+		if (not tcp_only)
+		{
+			if (sent.shard_count == sent.shards.size())
+				sent.shards.emplace_back();
+			auto & symbol = sent.shards[sent.shard_count++];
+			symbol.assign(header.begin(), header.end());
+			symbol.insert(symbol.end(), shard.payload.begin(), shard.payload.end());
+
+			if (fec_ratio > 0)
+			{
+				if (fec_symbols.empty())
+					fec_first_shard = shard.shard_idx;
+				fec_symbols.emplace_back(symbol);
+				if (fec_symbols.size() == fec_block_size)
+					SendParity();
+			}
+		}
+
+		if (int64_t wait = pacer.consume(shard_size, os_monotonic_get_ns()); wait > 0)
+		{
+			FlushShards();
+			// The remaining shards of a non-reference frame are dropped now if they cannot arrive in time
+			if (not PastDisplayTime(wait))
+			{
+				// Retransmissions and the encode thread do not wait for the pacing,
+				// SendData is only called by the thread of this encoder
+				lock.unlock();
+				std::this_thread::sleep_for(std::chrono::nanoseconds(wait));
+				lock.lock();
+				pacing_delay += wait;
+			}
+		}
 		++shard.shard_idx;
-		shard.flags = 0;
+		shard.flags = frame_flags;
 		shard.view_info.reset();
 		begin = next;
 	}
+	FlushShards();
 	if (end_of_frame)
-		cnx->dump_time("send_end", shard.frame_idx, os_monotonic_get_ns(), stream_idx);
+	{
+		frame_done = true;
+		// Parity of an incomplete frame does not help the headset
+		if (frame_stale)
+			fec_symbols.clear();
+		SendParity();
+		const auto & params = frames[shard.frame_idx % frames.size()];
+		bool idr = params.frame_index == shard.frame_idx and params.idr;
+		// send_end was set when the last data was received from the encoder
+		int64_t encode_time = timing_info.send_end - timing_info.encode_begin;
+		metrics::encode_duration.observe(encode_time * 1e-9);
+		auto & sent = history[shard.frame_idx % history.size()];
+		if (sent.frame_idx == shard.frame_idx)
+		{
+			sent.send_end = os_monotonic_get_ns();
+			sent.idr = idr;
+			sent.slices = frame_slices;
+			sent.average_qp = average_qp;
+			sent.encode_time = encode_time;
+		}
+		// Also reads the pending kernel timestamps
+		for (auto & previous: history)
+		{
+			if (&previous != &sent)
+				ResolveSendEnd(previous);
+		}
+		std::string extra = "," + std::to_string(pacing_delay);
+		cnx->dump_time("send_end", shard.frame_idx, os_monotonic_get_ns(), stream_idx, extra.c_str());
+		extra = std::string(idr ? ",idr," : ",p,") + std::to_string(timing_info.bytes) + "," + std::to_string(frame_slices) + "," + std::to_string(average_qp) + "," + std::to_string(encode_time);
+		cnx->dump_time("frame_stats", shard.frame_idx, os_monotonic_get_ns(), stream_idx, extra.c_str());
+	}
+}
+
+// Shards that arrive after the display time are useless and delay the next frames:
+// the rest of the frame is not sent and the next one repairs the references.
+// Non-reference frames are also dropped when the pacer would send them delay ns too late.
+bool VideoEncoder::PastDisplayTime(int64_t delay)
+{
+	if (frame_stale)
+		return true;
+	const auto & params = frames[shard.frame_idx % frames.size()];
+	if (not params.non_reference)
+		delay = 0;
+	if (tcp_only or params.frame_index != shard.frame_idx or clock.to_headset(os_monotonic_get_ns()) + delay < params.view_info.display_time)
+		return false;
+
+	U_LOG_D("Stream %d: frame %ld cannot be displayed in time, dropping its remaining shards", stream_idx, shard.frame_idx);
+	frame_stale = true;
+	FrameLost(shard.frame_idx);
+	return true;
+}
+
+// Serialize everything but the payload bytes
+std::span<uint8_t> VideoEncoder::SerializeShardHeader()
+{
+	if (shard_headers_used == shard_headers.size())
+		shard_headers.emplace_back();
+	auto & header = shard_headers[shard_headers_used++];
+	header.clear();
+	serialization_traits<to_headset::video_stream_data_shard>::serialize_header(shard, header);
+	return header;
+}
+
+void VideoEncoder::FlushShards()
+{
+	try
+	{
+		cnx->flush_stream(stream_idx);
+		auto & sent = history[shard.frame_idx % history.size()];
+		if (sent.frame_idx == shard.frame_idx)
+		{
+			if (auto datagram = cnx->last_stream_datagram(stream_idx))
+				sent.last_datagram = datagram;
+		}
+	}
+	catch (...)
+	{
+		// Ignore network errors
+	}
+	shard_headers_used = 0;
+}
+
+// Replaces send_end by the time the last datagram left the network stack of the
+// server, so that the network latency does not include the time spent in the kernel queues
+void VideoEncoder::ResolveSendEnd(sent_frame & sent)
+{
+	if (not sent.send_end or not sent.last_datagram or not cnx)
+		return;
+	if (auto time = cnx->stream_send_time(stream_idx, *sent.last_datagram))
+	{
+		sent.send_end = *time;
+		sent.last_datagram.reset();
+	}
+}
+
+void VideoEncoder::SendParity()
+{
+	if (fec_symbols.empty())
+		return;
+
+	size_t symbol_size = 0;
+	for (const auto & symbol: fec_symbols)
+		symbol_size = std::max(symbol_size, symbol.size());
+
+	size_t parity_count = std::min<size_t>(
+	        std::ceil(fec_symbols.size() * fec_ratio),
+	        reed_solomon::max_symbols - fec_symbols.size());
+
+	to_headset::video_stream_parity_shard parity_shard{
+	        .stream_item_idx = stream_idx,
+	        .frame_idx = shard.frame_idx,
+	        .first_data_shard = fec_first_shard,
+	        .data_shard_count = uint8_t(fec_symbols.size()),
+	        .parity_count = uint8_t(parity_count),
+	};
+	auto parity = reed_solomon::encode(fec_symbols, parity_count, symbol_size);
+	for (size_t i = 0; i < parity.size(); ++i)
+	{
+		parity_shard.parity_idx = i;
+		parity_shard.payload = parity[i];
+		try
+		{
+			cnx->queue_parity_shard(parity_shard);
+		}
+		catch (...)
+		{
+			// Ignore network errors
+		}
+	}
+	// Also sends pending data shards of the block
+	FlushShards();
+	fec_symbols.clear();
 }
 
 } // namespace xrt::drivers::wivrn
@@ -19,28 +19,33 @@
 
 #pragma once
 
+#include "driver/bitrate_controller.h"
 #include "driver/clock_offset.h"
+#include <array>
 #include <atomic>
 #include <chrono>
-#include <fstream>
 #include <memory>
 #include <mutex>
+#include <span>
+#include <vector>
 #include <vulkan/vulkan_raii.hpp>
 
+#include "bitstream_sink.h"
+#include "encoder_output.h"
 #include "encoder_settings.h"
+#include "shard_pacer.h"
 #include "wivrn_packets.h"
+#include "yuv_converter.h"
 
-class yuv_converter;
 struct wivrn_vk_bundle;
 
 namespace xrt::drivers::wivrn
 {
 
-class wivrn_session;
-
 inline const char * encoder_nvenc = "nvenc";
 inline const char * encoder_vaapi = "vaapi";
 inline const char * encoder_x265 = "x265";
+inline const char * encoder_vulkan = "vulkan";
 
 class VideoEncoder
 {
@@ -51,18 +56,94 @@ protected:
 
 private:
 	// temporary data
-	wivrn_session * cnx;
+	encoder_output * cnx = nullptr;
+
+	// Parameters of the frames being encoded, indexed by frame index
+	struct frame_params
+	{
+		uint64_t frame_index = -1;
+		to_headset::video_stream_data_shard::view_info_t view_info;
+		XrTime encode_begin;
+		bool idr;
+		bool non_reference;
+	};
+	std::array<frame_params, 4> frames;
+	// The end of the frame of the current shard has been sent
+	bool frame_done = true;
+	// The current frame was past its display time, its remaining shards are not sent
+	bool frame_stale = false;
+	// Flags set on all the shards of the current frame
+	uint8_t frame_flags = 0;
+	// Number of SendData calls for the current frame
+	uint16_t frame_slices = 0;
 
 	// shard to send
 	to_headset::video_stream_data_shard shard;
+	// the stream goes through TCP: each slice is sent in as few shards as possible
+	// and they are not kept for retransmission
+	bool tcp_only = false;
+	// serialized shard headers, kept until the batch is sent
+	std::vector<std::vector<uint8_t>> shard_headers;
+	size_t shard_headers_used = 0;
 
 	to_headset::video_stream_data_shard::timing_info_t timing_info;
 	clock_offset clock;
 
 	std::atomic_bool sync_needed = true;
+	// Oldest frame reported lost since the last encoded frame, -1 if none
+	std::atomic<uint64_t> lost_frame = -1;
+	// Periodic intra refresh is enabled, lost frames are repaired without IDR frames
+	bool intra_refresh = false;
 	uint64_t last_idr_frame;
 
-	std::ofstream video_dump;
+	// Every other frame is not a reference, their loss does not need to be repaired
+	bool non_reference_frames = false;
+	bool last_non_reference = false;
+	// Index of the last non-reference frames, read by FrameLost without locking
+	std::array<std::atomic<uint64_t>, 8> non_reference_history;
+
+	// bitrate requested by SetBitrate, 0 if unchanged
+	std::atomic<uint64_t> pending_bitrate = 0;
+
+	// fraction of the frame interval used to send an average frame, 0 to disable pacing
+	double pacing = 0;
+	shard_pacer pacer;
+	// total time spent waiting for the pacer in the current frame
+	int64_t pacing_delay = 0;
+
+	// Forward error correction, ratio of parity shards to data shards
+	double fec_ratio = 0;
+	uint16_t fec_first_shard;
+	std::vector<std::span<const uint8_t>> fec_symbols;
+
+	// Serialized shards of the last frames, for retransmission
+	struct sent_frame
+	{
+		uint64_t frame_idx = -1;
+		// ns in headset time referential
+		XrTime display_time = 0;
+		std::vector<std::vector<uint8_t>> shards;
+		size_t shard_count = 0;
+		size_t bytes = 0;
+		// Server clock
+		int64_t send_begin = 0;
+		int64_t send_end = 0;
+		// Last datagram of the frame, until send_end is replaced by its kernel send time
+		std::optional<uint32_t> last_datagram;
+		bool idr = false;
+		uint16_t slices = 0;
+		float average_qp = -1;
+		int64_t encode_time = 0;
+	};
+	std::array<sent_frame, 3> history;
+
+	// Frames identical to the last encoded one are skipped, the headset keeps reprojecting it
+	bool skip_static_frames = false;
+	std::vector<uint32_t> last_checksums;
+
+	std::unique_ptr<bitstream_sink> video_dump;
+	// Local spectator output of the bitstream, on a Unix socket
+	std::unique_ptr<bitstream_sink> spectator;
 
 public:
 	static std::unique_ptr<VideoEncoder> Create(
@@ -73,24 +154,129 @@ public:
 	        int input_height,
 	        float fps);
 
+	// Loads the libraries of the hardware encoders when the server starts, without creating
+	// any device context so that the process can still fork for each connection.
+	static void Preload();
+	// Creates the device contexts of these encoders, or of the default ones if empty, in the
+	// background before the headset handshake. They are shared by the encoders created afterwards.
+	static void Prewarm(std::vector<configuration::encoder> encoders);
+
 	VideoEncoder();
 	virtual ~VideoEncoder() = default;
 
 	// called on present to submit command buffers for the image.
-	virtual void PresentImage(yuv_converter & src_yuv, vk::raii::CommandBuffer & cmd_buf) = 0;
+	virtual void PresentImage(yuv_converter & src_yuv, vk::raii::CommandBuffer & cmd_buf, uint64_t frame_index) = 0;
+
+	// Called on present before the conversion when the encoder is the only one. If it returns
+	// a linear input, the conversion writes to it and PresentImage is not called for the frame.
+	virtual std::optional<yuv_converter::direct_output> DirectInput(yuv_converter & src_yuv, uint64_t frame_index)
+	{
+		return std::nullopt;
+	}
+
+	// Called once after creation with the timeline semaphore signaled with frame_index + 1
+	// when the image of a frame is ready. If it returns true, Encode may be called before
+	// the image is ready and the encoder waits for the semaphore on the GPU.
+	virtual bool WaitOnGpu(vk::Semaphore present_semaphore)
+	{
+		return false;
+	}
+
+	uint8_t stream_index() const
+	{
+		return stream_idx;
+	}
 
 	// The other end lost a frame and needs to resynchronize
 	void SyncNeeded();
 
-	void Encode(wivrn_session & cnx,
+	// The other end could not decode a frame: stop using it as a reference,
+	// or send an IDR frame if the encoder does not support it.
+	// Non-reference frames are ignored, the next frames do not depend on them.
+	void FrameLost(uint64_t frame_index);
+
+	// The other end lost some shards, send them again if they can still be used
+	void Retransmit(const from_headset::video_stream_nack &);
+
+	// Change the target bitrate in bit/s, it is applied before encoding the next frame
+	void SetBitrate(uint64_t bitrate);
+
+	// Whether the running encoder can change its bitrate, the adaptive bitrate requires it
+	virtual bool SupportsBitrateChange() const
+	{
+		return true;
+	}
+
+	std::optional<bitrate_controller::frame_info> GetFrameInfo(uint64_t frame_index);
+
+	// Static images are encoded at this interval anyway, the headset considers the stream stalled after 1s
+	static constexpr int64_t static_frame_refresh = 250'000'000;
+
+	// An IDR frame was requested or a frame was lost, the next frame must be encoded
+	bool RecoveryPending() const
+	{
+		return sync_needed or lost_frame != uint64_t(-1);
+	}
+
+	// checksums are the tile checksums of the whole image, from yuv_converter.
+	// Static frames are skipped unless refresh is set, it must be the same for all the streams of a frame
+	void Encode(encoder_output & cnx,
 	            const to_headset::video_stream_data_shard::view_info_t & view_info,
-	            uint64_t frame_index);
+	            uint64_t frame_index,
+	            std::span<const uint32_t> checksums,
+	            bool refresh);
 
 protected:
 	// called when command buffer finished executing
-	virtual void Encode(bool idr, std::chrono::steady_clock::time_point target_timestamp) = 0;
+	virtual void Encode(bool idr, std::chrono::steady_clock::time_point target_timestamp, uint64_t frame_index) = 0;
+
+	// called from the encoding thread when the bitrate was changed
+	virtual void ApplyBitrate(uint64_t bitrate) = 0;
 
-	void SendData(std::span<uint8_t> data, bool end_of_frame);
+	// called from the encoding thread before encoding frame_index, so that
+	// lost_frame and the frames predicted from it are not used as references.
+	// Returns false if the encoder cannot do it, an IDR frame is then sent.
+	virtual bool InvalidateReferences(uint64_t lost_frame, uint64_t frame_index)
+	{
+		return false;
+	}
+
+	// Returns true if the backend can encode frames that are not used as references,
+	// non_reference_frames is then honoured, checked once after creation
+	virtual bool SupportsNonReferenceFrames()
+	{
+		return false;
+	}
+
+	// Called from Encode: frame_index must be encoded without being used as a reference by the next frames,
+	// which are predicted from the last reference frame
+	bool IsNonReference(uint64_t frame_index);
+
+	// May be called after Encode returned, from another thread,
+	// for the last frames given to Encode.
+	// average_qp is only used with end_of_frame, negative if the encoder does not report it
+	void SendData(std::span<uint8_t> data, bool end_of_frame, uint64_t frame_index, float average_qp = -1);
+
+	// QP offset for the pixel at (x, y) of the encoded image, derived from the foveation:
+	// negative near the foveation centre, positive at the edges and 0 on average
+	static double QpOffset(const encoder_settings &, double x, double y);
+	// QP offsets for each block of the encoded image in raster order, empty if qp_emphasis is disabled
+	static std::vector<float> QpOffsetMap(const encoder_settings &, int block_size);
+	// Part of the encoded image in the given eye where the distance to the foveation centre
+	// is below distance (0 at the centre, 1 at the edges), empty if it is outside of the image
+	static vk::Rect2D QpEmphasisRegion(const encoder_settings &, int eye, double distance);
+	// Average distance to the foveation centre over an eye
+	static constexpr double qp_mean_distance = 2. / 3;
+	// Moves an inset of a layered stream to the foveation centre of its eye, where the foveated image
+	// is at the full resolution, once the size and foveation of the stream are set
+	static void PlaceInset(encoder_settings &);
+
+private:
+	std::span<uint8_t> SerializeShardHeader();
+	void ResolveSendEnd(sent_frame &);
+	bool PastDisplayTime(int64_t delay = 0);
+	void FlushShards();
+	void SendParity();
 };
 
 } // namespace xrt::drivers::wivrn
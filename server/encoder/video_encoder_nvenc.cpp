@@ -20,9 +20,15 @@
 #include "video_encoder_nvenc.h"
 #include "encoder/yuv_converter.h"
 #include "util/u_logging.h"
+#include "utils/named_thread.h"
 #include "utils/wivrn_vk_bundle.h"
 
+#include <algorithm>
+#include <cmath>
+#include <cstring>
 #include <stdexcept>
+#include <thread>
+#include <unistd.h>
 #include <vulkan/vulkan_enums.hpp>
 #include <vulkan/vulkan_structs.hpp>
 
@@ -64,6 +70,19 @@
 namespace xrt::drivers::wivrn
 {
 
+// Number of slices in a frame when the encoder supports sub-frame readback
+static const uint32_t subframe_slice_count = 4;
+// Value of NV_ENC_LOCK_BITSTREAM::hwEncodeStatus once the whole picture is encoded
+static const uint32_t hw_encode_complete = 2;
+// Number of reference frames when reference invalidation is supported,
+// frames lost earlier than that require an IDR frame
+static const uint32_t reference_frame_count = 8;
+// Number of frames that can be encoded or sent at the same time in async mode
+static const size_t async_slot_count = 3;
+// Row alignment of the input buffers, in bytes: a multiple of 4 for the conversion shader
+// and of the pitch NVENC prefers for device memory
+static const uint32_t pitch_alignment = 256;
+
 void VideoEncoderNvenc::deleter::operator()(CudaFunctions * fn)
 {
 	cuda_free_functions(&fn);
@@ -73,30 +92,58 @@ void VideoEncoderNvenc::deleter::operator()(NvencFunctions * fn)
 	nvenc_free_functions(&fn);
 }
 
-static auto init()
-{
-	std::unique_ptr<CudaFunctions, VideoEncoderNvenc::deleter> cuda_fn;
-	std::unique_ptr<NvencFunctions, VideoEncoderNvenc::deleter> nvenc_fn;
-	void * session_handle;
+// Libraries and CUDA context are shared by all the encoders of the process
+static std::mutex context_mutex;
+static std::unique_ptr<CudaFunctions, VideoEncoderNvenc::deleter> shared_cuda_fn;
+static std::unique_ptr<NvencFunctions, VideoEncoderNvenc::deleter> shared_nvenc_fn;
+static CUcontext shared_cuda = nullptr;
 
+// Called with context_mutex held
+static void load_libraries()
+{
+	if (not shared_cuda_fn)
 	{
 		CudaFunctions * tmp = nullptr;
 		if (cuda_load_functions(&tmp, nullptr))
 			throw std::runtime_error("Failed to load CUDA");
-		cuda_fn.reset(tmp);
+		shared_cuda_fn.reset(tmp);
 	}
 
+	if (not shared_nvenc_fn)
 	{
 		NvencFunctions * tmp = nullptr;
 		if (nvenc_load_functions(&tmp, nullptr))
 			throw std::runtime_error("Failed to load nvenc");
-		nvenc_fn.reset(tmp);
+		shared_nvenc_fn.reset(tmp);
 	}
+}
 
-	CU_CHECK(cuda_fn->cuInit(0));
+// The context is not current on any thread when this returns
+static CUcontext get_cuda_context()
+{
+	std::lock_guard lock(context_mutex);
+	load_libraries();
+	if (shared_cuda)
+		return shared_cuda;
 
+	auto cuda_fn = shared_cuda_fn.get();
+	CU_CHECK(cuda_fn->cuInit(0));
 	CUcontext cuda;
 	CU_CHECK(cuda_fn->cuCtxCreate(&cuda, 0, 0));
+	CU_CHECK(cuda_fn->cuCtxPopCurrent(NULL));
+	shared_cuda = cuda;
+	return shared_cuda;
+}
+
+// Opens an encoding session, the CUDA context is left current on the calling thread
+static auto init()
+{
+	CUcontext cuda = get_cuda_context();
+	auto cuda_fn = shared_cuda_fn.get();
+	auto nvenc_fn = shared_nvenc_fn.get();
+	void * session_handle;
+
+	CU_CHECK(cuda_fn->cuCtxPushCurrent(cuda));
 
 	NV_ENCODE_API_FUNCTION_LIST fn{
 	        .version = NV_ENCODE_API_FUNCTION_LIST_VER,
@@ -117,15 +164,34 @@ static auto init()
 		NVENC_CHECK_NOENCODER(fn.nvEncOpenEncodeSessionEx(&params, &session_handle));
 	}
 
-	return std::make_tuple(std::move(cuda_fn), std::move(nvenc_fn), fn, cuda, session_handle);
+	return std::make_tuple(cuda_fn, nvenc_fn, fn, cuda, session_handle);
+}
+
+void VideoEncoderNvenc::Preload()
+{
+	std::lock_guard lock(context_mutex);
+	load_libraries();
+}
+
+void VideoEncoderNvenc::Prewarm()
+{
+	get_cuda_context();
 }
 
 static auto encode_guid(video_codec codec)
 {
 	switch (codec)
 	{
+		case h264:
+			return NV_ENC_CODEC_H264_GUID;
 		case h265:
 			return NV_ENC_CODEC_HEVC_GUID;
+		case av1:
+#if NVENCAPI_MAJOR_VERSION >= 12
+			return NV_ENC_CODEC_AV1_GUID;
+#else
+			throw std::runtime_error("nvenc: AV1 requires Video Codec SDK 12 headers");
+#endif
 	}
 	throw std::out_of_range("Invalid codec " + std::to_string(codec));
 }
@@ -148,6 +214,7 @@ VideoEncoderNvenc::VideoEncoderNvenc(wivrn_vk_bundle & vk, encoder_settings & se
 	};
 	height = settings.video_height;
 	width = settings.video_width;
+	pitch = (width + pitch_alignment - 1) / pitch_alignment * pitch_alignment;
 
 	uint32_t count;
 	std::vector<GUID> presets;
@@ -184,10 +251,95 @@ VideoEncoderNvenc::VideoEncoderNvenc(wivrn_vk_bundle & vk, encoder_settings & se
 	params.gopLength = NVENC_INFINITE_GOPLENGTH;
 	params.frameIntervalP = 1;
 
-	params.encodeCodecConfig.hevcConfig.repeatSPSPPS = 1;
-	params.encodeCodecConfig.hevcConfig.maxNumRefFramesInDPB = 0;
-	params.encodeCodecConfig.hevcConfig.idrPeriod = NVENC_INFINITE_GOPLENGTH;
-	params.encodeCodecConfig.hevcConfig.hevcVUIParameters.videoFullRangeFlag = 1;
+	bool intra_refresh = false;
+	for (auto [cap, res]: {
+	             std::pair{NV_ENC_CAPS_SUPPORT_SUBFRAME_READBACK, &subframe},
+	             {NV_ENC_CAPS_SUPPORT_REF_PIC_INVALIDATION, &ref_invalidation},
+	             {NV_ENC_CAPS_SUPPORT_INTRA_REFRESH, &intra_refresh},
+	     })
+	{
+		NV_ENC_CAPS_PARAM cap_param{
+		        .version = NV_ENC_CAPS_PARAM_VER,
+		        .capsToQuery = cap,
+		};
+		int value = 0;
+		NVENC_CHECK(fn.nvEncGetEncodeCaps(session_handle, encodeGUID, &cap_param, &value));
+		*res = value;
+	}
+	if (settings.intra_refresh > 0 and not intra_refresh)
+	{
+		U_LOG_W("nvenc: intra refresh is not supported");
+		settings.intra_refresh = 0;
+	}
+	// Refresh waves follow each other without interruption
+	uint32_t intra_refresh_period = std::max(settings.intra_refresh, 2);
+
+	for (float offset: QpOffsetMap(settings, settings.codec == h264 ? 16 : settings.codec == h265 ? 32 : 64))
+		qp_delta_map.push_back(std::lround(offset));
+	if (not qp_delta_map.empty())
+		params.rcParams.qpMapMode = NV_ENC_QP_MAP_DELTA;
+
+	switch (settings.codec)
+	{
+		case h264: {
+			auto & config = params.encodeCodecConfig.h264Config;
+			config.repeatSPSPPS = 1;
+			config.maxNumRefFrames = ref_invalidation ? reference_frame_count : 0;
+			config.idrPeriod = NVENC_INFINITE_GOPLENGTH;
+			config.h264VUIParameters.videoFullRangeFlag = 1;
+			if (settings.intra_refresh > 0)
+			{
+				config.enableIntraRefresh = 1;
+				config.intraRefreshPeriod = intra_refresh_period;
+				config.intraRefreshCnt = intra_refresh_period - 1;
+			}
+			if (subframe)
+			{
+				config.sliceMode = 3;
+				config.sliceModeData = subframe_slice_count;
+			}
+			break;
+		}
+		case h265: {
+			auto & config = params.encodeCodecConfig.hevcConfig;
+			config.repeatSPSPPS = 1;
+			config.maxNumRefFramesInDPB = ref_invalidation ? reference_frame_count : 0;
+			config.idrPeriod = NVENC_INFINITE_GOPLENGTH;
+			config.hevcVUIParameters.videoFullRangeFlag = 1;
+			if (settings.intra_refresh > 0)
+			{
+				config.enableIntraRefresh = 1;
+				config.intraRefreshPeriod = intra_refresh_period;
+				config.intraRefreshCnt = intra_refresh_period - 1;
+			}
+			if (subframe)
+			{
+				config.sliceMode = 3;
+				config.sliceModeData = subframe_slice_count;
+			}
+			break;
+		}
+		case av1: {
+#if NVENCAPI_MAJOR_VERSION >= 12
+			auto & config = params.encodeCodecConfig.av1Config;
+			config.repeatSeqHdr = 1;
+			config.maxNumRefFramesInDPB = ref_invalidation ? reference_frame_count : 0;
+			config.idrPeriod = NVENC_INFINITE_GOPLENGTH;
+			config.colorRange = 1;
+			if (settings.intra_refresh > 0)
+			{
+				config.enableIntraRefresh = 1;
+				config.intraRefreshPeriod = intra_refresh_period;
+				config.intraRefreshCnt = intra_refresh_period - 1;
+			}
+#endif
+			// AV1 frames are split in tiles, not slices
+			subframe = false;
+			break;
+		}
+	}
+	if (subframe)
+		U_LOG_I("nvenc: sub-frame readback enabled, %d slices", subframe_slice_count);
 
 	settings.range = VK_SAMPLER_YCBCR_RANGE_ITU_FULL;
 	settings.color_model = VK_SAMPLER_YCBCR_MODEL_CONVERSION_YCBCR_709;
@@ -204,30 +356,53 @@ VideoEncoderNvenc::VideoEncoderNvenc(wivrn_vk_bundle & vk, encoder_settings & se
 	        .frameRateDen = 1,
 	        .enableEncodeAsync = 0,
 	        .enablePTD = 1,
+	        .reportSliceOffsets = subframe,
+	        .enableSubFrameWrite = subframe,
 	        .encodeConfig = &params,
 	};
 	NVENC_CHECK(fn.nvEncInitializeEncoder(session_handle, &params2));
+	config = params;
+	init_params = params2;
+	init_params.encodeConfig = &config;
+
+	if (auto it = settings.options.find("async"); it != settings.options.end())
+		async = it->second == "1" or it->second == "true";
+
+	slots.resize(async ? async_slot_count : 1);
+	CU_CHECK(cuda_fn->cuCtxPushCurrent(cuda));
+	for (auto & slot: slots)
+		CreateSlot(slot, settings);
+	CU_CHECK(cuda_fn->cuCtxPopCurrent(NULL));
+
+	if (async)
+	{
+		U_LOG_I("nvenc: asynchronous mode, %zu frames in flight", slots.size());
+		drain_thread = utils::named_thread("nvenc_drain", &VideoEncoderNvenc::DrainLoop, this);
+	}
+}
 
+void VideoEncoderNvenc::CreateSlot(slot & slot, encoder_settings & settings)
+{
 	NV_ENC_CREATE_BITSTREAM_BUFFER params3{
 	        .version = NV_ENC_CREATE_BITSTREAM_BUFFER_VER,
 	};
 	NVENC_CHECK(fn.nvEncCreateBitstreamBuffer(session_handle, &params3));
-	bitstreamBuffer = params3.bitstreamBuffer;
+	slot.bitstream = params3.bitstreamBuffer;
 
-	vk::DeviceSize buffer_size = width * settings.video_height * 3 / 2;
+	vk::DeviceSize buffer_size = vk::DeviceSize(pitch) * settings.video_height * 3 / 2;
 
 	vk::StructureChain buffer_create_info{
 	        vk::BufferCreateInfo{
 	                .size = buffer_size,
-	                .usage = vk::BufferUsageFlagBits::eTransferDst,
+	                .usage = vk::BufferUsageFlagBits::eTransferDst | vk::BufferUsageFlagBits::eStorageBuffer,
 	        },
 	        vk::ExternalMemoryBufferCreateInfo{
 	                .handleTypes = vk::ExternalMemoryHandleTypeFlagBitsKHR::eOpaqueFd,
 	        },
 	};
 
-	yuv_buffer = vk::raii::Buffer(vk.device, buffer_create_info.get());
-	auto memory_req = yuv_buffer.getMemoryRequirements();
+	slot.yuv_buffer = vk::raii::Buffer(vk.device, buffer_create_info.get());
+	auto memory_req = slot.yuv_buffer.getMemoryRequirements();
 
 	vk::StructureChain mem_info{
 	        vk::MemoryAllocateInfo{
@@ -235,21 +410,20 @@ VideoEncoderNvenc::VideoEncoderNvenc(wivrn_vk_bundle & vk, encoder_settings & se
 	                .memoryTypeIndex = vk.get_memory_type(memory_req.memoryTypeBits, vk::MemoryPropertyFlagBits::eDeviceLocal),
 	        },
 	        vk::MemoryDedicatedAllocateInfo{
-	                .buffer = *yuv_buffer,
+	                .buffer = *slot.yuv_buffer,
 	        },
 	        vk::ExportMemoryAllocateInfo{
 	                .handleTypes = vk::ExternalMemoryHandleTypeFlagBitsKHR::eOpaqueFd,
 	        },
 	};
-	mem = vk.device.allocateMemory(mem_info.get());
-	yuv_buffer.bindMemory(*mem, 0);
+	slot.mem = vk.device.allocateMemory(mem_info.get());
+	slot.yuv_buffer.bindMemory(*slot.mem, 0);
 
 	int fd = vk.device.getMemoryFdKHR({
-	        .memory = *mem,
+	        .memory = *slot.mem,
 	        .handleType = vk::ExternalMemoryHandleTypeFlagBitsKHR::eOpaqueFd,
 	});
 
-	CU_CHECK(cuda_fn->cuCtxPushCurrent(cuda));
 	{
 		CUDA_EXTERNAL_MEMORY_HANDLE_DESC param{
 		        .type = CU_EXTERNAL_MEMORY_HANDLE_TYPE_OPAQUE_FD,
@@ -257,14 +431,14 @@ VideoEncoderNvenc::VideoEncoderNvenc(wivrn_vk_bundle & vk, encoder_settings & se
 		        .size = memory_req.size,
 		        .flags = 0,
 		};
-		CU_CHECK(cuda_fn->cuImportExternalMemory(&extmem, &param));
+		CU_CHECK(cuda_fn->cuImportExternalMemory(&slot.extmem, &param));
 
 		CUDA_EXTERNAL_MEMORY_BUFFER_DESC map_param{
 		        .offset = 0,
 		        .size = buffer_size,
 		        .flags = 0,
 		};
-		CU_CHECK(cuda_fn->cuExternalMemoryGetMappedBuffer(&frame, extmem, &map_param));
+		CU_CHECK(cuda_fn->cuExternalMemoryGetMappedBuffer(&slot.frame, slot.extmem, &map_param));
 	}
 
 	NV_ENC_REGISTER_RESOURCE param3{
@@ -272,30 +446,131 @@ VideoEncoderNvenc::VideoEncoderNvenc(wivrn_vk_bundle & vk, encoder_settings & se
 	        .resourceType = NV_ENC_INPUT_RESOURCE_TYPE_CUDADEVICEPTR,
 	        .width = settings.video_width,
 	        .height = settings.video_height,
-	        .pitch = width,
-	        .resourceToRegister = (void *)frame,
+	        .pitch = pitch,
+	        .resourceToRegister = (void *)slot.frame,
 	        .bufferFormat = NV_ENC_BUFFER_FORMAT_NV12,
 	        .bufferUsage = NV_ENC_INPUT_IMAGE,
 	};
 	NVENC_CHECK(fn.nvEncRegisterResource(session_handle, &param3));
-	nvenc_resource = param3.registeredResource;
-	CU_CHECK(cuda_fn->cuCtxPopCurrent(NULL));
+	slot.nvenc_resource = param3.registeredResource;
 }
 
 VideoEncoderNvenc::~VideoEncoderNvenc()
 {
+	if (drain_thread.joinable())
+	{
+		{
+			std::lock_guard lock(slot_mutex);
+			stop = true;
+		}
+		slot_cv.notify_all();
+		drain_thread.join();
+	}
 	if (session_handle)
 		fn.nvEncDestroyEncoder(session_handle);
+	if (present_semaphore or stream)
+	{
+		cuda_fn->cuCtxPushCurrent(cuda);
+		if (present_semaphore)
+			cuda_fn->cuDestroyExternalSemaphore(present_semaphore);
+		if (stream)
+			cuda_fn->cuStreamDestroy(stream);
+		cuda_fn->cuCtxPopCurrent(NULL);
+	}
+}
+
+VideoEncoderNvenc::slot & VideoEncoderNvenc::GetSlot(uint64_t frame_index)
+{
+	return slots[frame_index % slots.size()];
+}
+
+VideoEncoderNvenc::slot & VideoEncoderNvenc::AcquireSlot(uint64_t frame_index)
+{
+	auto & slot = GetSlot(frame_index);
+	// Only waits in async mode, if the encoder is late by the whole ring
+	std::unique_lock lock(slot_mutex);
+	slot_cv.wait(lock, [&]() { return not slot.busy; });
+	slot.frame_index = frame_index;
+	return slot;
+}
+
+std::optional<yuv_converter::direct_output> VideoEncoderNvenc::DirectInput(yuv_converter & src_yuv, uint64_t frame_index)
+{
+	auto size = src_yuv.size();
+	if (rect.offset.x != 0 or rect.offset.y != 0 or rect.extent.width != size.width or rect.extent.height != size.height)
+		return std::nullopt;
+
+	auto & slot = AcquireSlot(frame_index);
+	return yuv_converter::direct_output{
+	        .buffer = *slot.yuv_buffer,
+	        .pitch = pitch,
+	        .chroma_offset = vk::DeviceSize(pitch) * height,
+	};
 }
 
-void VideoEncoderNvenc::PresentImage(yuv_converter & src_yuv, vk::raii::CommandBuffer & cmd_buf)
+bool VideoEncoderNvenc::WaitOnGpu(vk::Semaphore semaphore)
 {
+	if (not cuda_fn->cuImportExternalSemaphore or
+	    not cuda_fn->cuDestroyExternalSemaphore or
+	    not cuda_fn->cuWaitExternalSemaphoresAsync or
+	    not fn.nvEncSetIOCudaStreams)
+		return false;
+
+	int fd = -1;
+	try
+	{
+		fd = vk.device.getSemaphoreFdKHR(vk::SemaphoreGetFdInfoKHR{
+		        .semaphore = semaphore,
+		        .handleType = vk::ExternalSemaphoreHandleTypeFlagBits::eOpaqueFd,
+		});
+	}
+	catch (std::exception & e)
+	{
+		U_LOG_W("nvenc: failed to export present semaphore: %s", e.what());
+		return false;
+	}
+
+	CU_CHECK(cuda_fn->cuCtxPushCurrent(cuda));
+	try
+	{
+		CUDA_EXTERNAL_SEMAPHORE_HANDLE_DESC desc{
+		        .type = CU_EXTERNAL_SEMAPHORE_HANDLE_TYPE_TIMELINE_SEMAPHORE_FD,
+		};
+		desc.handle.fd = fd;
+		CU_CHECK(cuda_fn->cuImportExternalSemaphore(&present_semaphore, &desc));
+		// CUDA owns the file descriptor once imported
+		fd = -1;
+
+		CU_CHECK(cuda_fn->cuStreamCreate(&stream, CU_STREAM_NON_BLOCKING));
+		// The input is read and the bitstream written after the wait on the stream
+		NVENC_CHECK(fn.nvEncSetIOCudaStreams(session_handle, (NV_ENC_CUSTREAM_PTR)&stream, (NV_ENC_CUSTREAM_PTR)&stream));
+	}
+	catch (std::exception & e)
+	{
+		U_LOG_W("nvenc: cannot wait for the present semaphore on the GPU: %s", e.what());
+		if (fd >= 0)
+			close(fd);
+		if (present_semaphore)
+			cuda_fn->cuDestroyExternalSemaphore(std::exchange(present_semaphore, nullptr));
+		if (stream)
+			cuda_fn->cuStreamDestroy(std::exchange(stream, nullptr));
+		cuda_fn->cuCtxPopCurrent(NULL);
+		return false;
+	}
+	CU_CHECK(cuda_fn->cuCtxPopCurrent(NULL));
+	return true;
+}
+
+void VideoEncoderNvenc::PresentImage(yuv_converter & src_yuv, vk::raii::CommandBuffer & cmd_buf, uint64_t frame_index)
+{
+	auto & slot = AcquireSlot(frame_index);
+
 	cmd_buf.copyImageToBuffer(
 	        src_yuv.luma,
 	        vk::ImageLayout::eTransferSrcOptimal,
-	        *yuv_buffer,
+	        *slot.yuv_buffer,
 	        vk::BufferImageCopy{
-	                .bufferRowLength = width,
+	                .bufferRowLength = pitch,
 	                .imageSubresource = {
 	                        .aspectMask = vk::ImageAspectFlagBits::eColor,
 	                        .layerCount = 1,
@@ -312,10 +587,11 @@ void VideoEncoderNvenc::PresentImage(yuv_converter & src_yuv, vk::raii::CommandB
 	cmd_buf.copyImageToBuffer(
 	        src_yuv.chroma,
 	        vk::ImageLayout::eTransferSrcOptimal,
-	        *yuv_buffer,
+	        *slot.yuv_buffer,
 	        vk::BufferImageCopy{
-	                .bufferOffset = width * height,
-	                .bufferRowLength = uint32_t(width / 2),
+	                .bufferOffset = vk::DeviceSize(pitch) * height,
+	                // In texels of 2 bytes
+	                .bufferRowLength = pitch / 2,
 	                .imageSubresource = {
 	                        .aspectMask = vk::ImageAspectFlagBits::eColor,
 	                        .layerCount = 1,
@@ -332,48 +608,206 @@ void VideoEncoderNvenc::PresentImage(yuv_converter & src_yuv, vk::raii::CommandB
 	return;
 }
 
-void VideoEncoderNvenc::Encode(bool idr, std::chrono::steady_clock::time_point pts)
+void VideoEncoderNvenc::ApplyBitrate(uint64_t new_bitrate)
 {
-	CU_CHECK(cuda_fn->cuCtxPushCurrent(cuda));
-
-	NV_ENC_MAP_INPUT_RESOURCE param4{};
-	param4.version = NV_ENC_MAP_INPUT_RESOURCE_VER;
-	param4.registeredResource = nvenc_resource;
-	NVENC_CHECK(fn.nvEncMapInputResource(session_handle, &param4));
-
-	NV_ENC_PIC_PARAMS param{
-	        .version = NV_ENC_PIC_PARAMS_VER,
-	        .inputWidth = rect.extent.width,
-	        .inputHeight = rect.extent.height,
-	        .inputPitch = width,
-	        .encodePicFlags = uint32_t(idr ? NV_ENC_PIC_FLAG_FORCEIDR | NV_ENC_PIC_FLAG_OUTPUT_SPSPPS : 0),
-	        .frameIdx = 0,
-	        .inputTimeStamp = 0,
-	        .inputBuffer = param4.mappedResource,
-	        .outputBitstream = bitstreamBuffer,
-	        .bufferFmt = param4.mappedBufferFmt,
-	        .pictureStruct = NV_ENC_PIC_STRUCT_FRAME,
+	bitrate = new_bitrate;
+	config.rcParams.averageBitRate = bitrate;
+	config.rcParams.maxBitRate = bitrate;
+	config.rcParams.vbvBufferSize = bitrate / fps;
+	config.rcParams.vbvInitialDelay = bitrate / fps;
+
+	NV_ENC_RECONFIGURE_PARAMS params{
+	        .version = NV_ENC_RECONFIGURE_PARAMS_VER,
+	        .reInitEncodeParams = init_params,
+	        .resetEncoder = 0,
+	        .forceIDR = 0,
 	};
-	NVENC_CHECK(fn.nvEncEncodePicture(session_handle, &param));
+	NVENC_CHECK(fn.nvEncReconfigureEncoder(session_handle, &params));
+}
 
-	NV_ENC_LOCK_BITSTREAM param2{
-	        .version = NV_ENC_LOCK_BITSTREAM_VER,
-	        .doNotWait = 0,
-	        .outputBitstream = bitstreamBuffer,
-	};
-	NVENC_CHECK(fn.nvEncLockBitstream(session_handle, &param2));
+void VideoEncoderNvenc::Encode(bool idr, std::chrono::steady_clock::time_point pts, uint64_t frame_index)
+{
+	auto & slot = GetSlot(frame_index);
+	if (async)
+	{
+		std::lock_guard lock(slot_mutex);
+		if (slot.frame_index != frame_index)
+		{
+			U_LOG_W("nvenc: input of frame %ld was overwritten, skipping", frame_index);
+			return;
+		}
+		slot.busy = true;
+	}
 
-	SendData({
-	                 (uint8_t *)param2.bitstreamBufferPtr,
-	                 (uint8_t *)param2.bitstreamBufferPtr + param2.bitstreamSizeInBytes,
-	         },
-	         true);
+	CU_CHECK(cuda_fn->cuCtxPushCurrent(cuda));
 
-	NVENC_CHECK(fn.nvEncUnlockBitstream(session_handle, bitstreamBuffer));
+	try
+	{
+		if (present_semaphore)
+		{
+			CUDA_EXTERNAL_SEMAPHORE_WAIT_PARAMS wait{};
+			wait.params.fence.value = frame_index + 1;
+			CU_CHECK(cuda_fn->cuWaitExternalSemaphoresAsync(&present_semaphore, &wait, 1, stream));
+		}
+
+		NV_ENC_MAP_INPUT_RESOURCE param4{};
+		param4.version = NV_ENC_MAP_INPUT_RESOURCE_VER;
+		param4.registeredResource = slot.nvenc_resource;
+		NVENC_CHECK(fn.nvEncMapInputResource(session_handle, &param4));
+		slot.mapped_resource = param4.mappedResource;
+
+		NV_ENC_PIC_PARAMS param{
+		        .version = NV_ENC_PIC_PARAMS_VER,
+		        .inputWidth = rect.extent.width,
+		        .inputHeight = rect.extent.height,
+		        .inputPitch = pitch,
+		        .encodePicFlags = uint32_t(idr ? NV_ENC_PIC_FLAG_FORCEIDR | NV_ENC_PIC_FLAG_OUTPUT_SPSPPS : 0),
+		        .frameIdx = 0,
+		        // Used to identify the frame in nvEncInvalidateRefFrames
+		        .inputTimeStamp = frame_index,
+		        .inputBuffer = param4.mappedResource,
+		        .outputBitstream = slot.bitstream,
+		        .bufferFmt = param4.mappedBufferFmt,
+		        .pictureStruct = NV_ENC_PIC_STRUCT_FRAME,
+		        .qpDeltaMap = qp_delta_map.empty() ? nullptr : qp_delta_map.data(),
+		        .qpDeltaMapSize = uint32_t(qp_delta_map.size()),
+		};
+		NVENC_CHECK(fn.nvEncEncodePicture(session_handle, &param));
+	}
+	catch (...)
+	{
+		if (slot.mapped_resource)
+			fn.nvEncUnmapInputResource(session_handle, std::exchange(slot.mapped_resource, nullptr));
+		std::lock_guard lock(slot_mutex);
+		slot.busy = false;
+		slot_cv.notify_all();
+		cuda_fn->cuCtxPopCurrent(NULL);
+		throw;
+	}
+
+	if (async)
+	{
+		{
+			std::lock_guard lock(slot_mutex);
+			drain_queue.emplace_back(&slot - slots.data(), frame_index);
+		}
+		slot_cv.notify_all();
+	}
+	else
+		Drain(slot, frame_index);
 
 	CU_CHECK(cuda_fn->cuCtxPopCurrent(NULL));
 }
 
+bool VideoEncoderNvenc::InvalidateReferences(uint64_t lost_frame, uint64_t frame_index)
+{
+	if (not ref_invalidation or frame_index > lost_frame + reference_frame_count)
+		return false;
+
+	// The frames encoded after the lost one were predicted from it, they are as corrupted on the headset
+	for (uint64_t i = lost_frame; i < frame_index; ++i)
+		NVENC_CHECK(fn.nvEncInvalidateRefFrames(session_handle, i));
+	return true;
+}
+
+void VideoEncoderNvenc::Drain(slot & slot, uint64_t frame_index)
+{
+	if (subframe)
+		SendSlices(slot, frame_index);
+	else
+	{
+		NV_ENC_LOCK_BITSTREAM param{
+		        .version = NV_ENC_LOCK_BITSTREAM_VER,
+		        .doNotWait = 0,
+		        .outputBitstream = slot.bitstream,
+		};
+		NVENC_CHECK(fn.nvEncLockBitstream(session_handle, &param));
+
+		SendData({
+		                 (uint8_t *)param.bitstreamBufferPtr,
+		                 (uint8_t *)param.bitstreamBufferPtr + param.bitstreamSizeInBytes,
+		         },
+		         true,
+		         frame_index,
+		         param.frameAvgQP);
+
+		NVENC_CHECK(fn.nvEncUnlockBitstream(session_handle, slot.bitstream));
+	}
+	NVENC_CHECK(fn.nvEncUnmapInputResource(session_handle, std::exchange(slot.mapped_resource, nullptr)));
+}
+
+void VideoEncoderNvenc::SendSlices(slot & slot, uint64_t frame_index)
+{
+	// The encoder writes slices as they are completed, poll the bitstream
+	// and send each new part without waiting for the end of the frame
+	uint32_t sent = 0;
+	while (true)
+	{
+		slice_offsets.assign(subframe_slice_count, 0);
+		NV_ENC_LOCK_BITSTREAM param{
+		        .version = NV_ENC_LOCK_BITSTREAM_VER,
+		        .doNotWait = 1,
+		        .outputBitstream = slot.bitstream,
+		        .sliceOffsets = slice_offsets.data(),
+		};
+		NVENC_CHECK(fn.nvEncLockBitstream(session_handle, &param));
+
+		bool complete = param.hwEncodeStatus == hw_encode_complete;
+		uint32_t available = param.bitstreamSizeInBytes;
+		if (available > sent or complete)
+		{
+			SendData({
+			                 (uint8_t *)param.bitstreamBufferPtr + sent,
+			                 (uint8_t *)param.bitstreamBufferPtr + available,
+			         },
+			         complete,
+			         frame_index,
+			         param.frameAvgQP);
+			sent = available;
+		}
+
+		NVENC_CHECK(fn.nvEncUnlockBitstream(session_handle, slot.bitstream));
+
+		if (complete)
+			return;
+		std::this_thread::sleep_for(std::chrono::microseconds(100));
+	}
+}
+
+void VideoEncoderNvenc::DrainLoop()
+{
+	cuda_fn->cuCtxPushCurrent(cuda);
+	while (true)
+	{
+		std::pair<size_t, uint64_t> item;
+		{
+			std::unique_lock lock(slot_mutex);
+			slot_cv.wait(lock, [&]() { return stop or not drain_queue.empty(); });
+			if (stop)
+				break;
+			item = drain_queue.front();
+			drain_queue.pop_front();
+		}
+
+		auto & slot = slots[item.first];
+		try
+		{
+			Drain(slot, item.second);
+		}
+		catch (std::exception & e)
+		{
+			U_LOG_W("nvenc: failed to read frame %ld: %s", item.second, e.what());
+		}
+
+		{
+			std::lock_guard lock(slot_mutex);
+			slot.busy = false;
+		}
+		slot_cv.notify_all();
+	}
+	cuda_fn->cuCtxPopCurrent(NULL);
+}
+
 std::array<int, 2> VideoEncoderNvenc::get_max_size(video_codec codec)
 {
 	auto [cuda_fn, nvenc_fn, fn, cuda, session_handle] = init();
@@ -406,4 +840,43 @@ std::array<int, 2> VideoEncoderNvenc::get_max_size(video_codec codec)
 	return result;
 }
 
+std::vector<video_codec> VideoEncoderNvenc::supported_codecs()
+{
+	auto [cuda_fn, nvenc_fn, fn, cuda, session_handle] = init();
+	std::vector<video_codec> result;
+	std::exception_ptr ex;
+	try
+	{
+		uint32_t count;
+		std::vector<GUID> guids;
+		NVENC_CHECK(fn.nvEncGetEncodeGUIDCount(session_handle, &count));
+		guids.resize(count);
+		NVENC_CHECK(fn.nvEncGetEncodeGUIDs(session_handle, guids.data(), count, &count));
+		guids.resize(count);
+
+		for (auto codec: {h264, h265, av1})
+		{
+			try
+			{
+				auto guid = encode_guid(codec);
+				if (std::ranges::any_of(guids, [&](const GUID & i) { return memcmp(&i, &guid, sizeof(GUID)) == 0; }))
+					result.push_back(codec);
+			}
+			catch (std::exception &)
+			{
+				// codec not available in the SDK headers
+			}
+		}
+	}
+	catch (...)
+	{
+		ex = std::current_exception();
+	}
+	cuda_fn->cuCtxPopCurrent(NULL);
+	fn.nvEncDestroyEncoder(session_handle);
+	if (ex)
+		std::rethrow_exception(ex);
+	return result;
+}
+
 } // namespace xrt::drivers::wivrn
@@ -21,6 +21,11 @@
 
 #include "video_encoder.h"
 #include <array>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
 #include <ffnvcodec/dynlink_cuda.h>
 #include <ffnvcodec/dynlink_loader.h>
 #include <ffnvcodec/nvEncodeAPI.h>
@@ -43,34 +48,92 @@ private:
 	// relevant part of the input image to encode
 	vk::Rect2D rect;
 
-	std::unique_ptr<CudaFunctions, deleter> cuda_fn;
-	std::unique_ptr<NvencFunctions, deleter> nvenc_fn;
+	// shared by all the encoders
+	CudaFunctions * cuda_fn;
+	NvencFunctions * nvenc_fn;
 	NV_ENCODE_API_FUNCTION_LIST fn;
 	CUcontext cuda;
 	void * session_handle = nullptr;
-	NV_ENC_OUTPUT_PTR bitstreamBuffer;
 
-	vk::raii::Buffer yuv_buffer = nullptr;
-	vk::raii::DeviceMemory mem = nullptr;
-	CUexternalMemory extmem;
+	// Imported present semaphore, the encoder waits for it on the GPU
+	CUexternalSemaphore present_semaphore = nullptr;
+	CUstream stream = nullptr;
+
+	// Input image and output bitstream for one frame
+	struct slot
+	{
+		vk::raii::Buffer yuv_buffer = nullptr;
+		vk::raii::DeviceMemory mem = nullptr;
+		CUexternalMemory extmem;
+		CUdeviceptr frame;
+		NV_ENC_REGISTERED_PTR nvenc_resource;
+		NV_ENC_INPUT_PTR mapped_resource = nullptr;
+		NV_ENC_OUTPUT_PTR bitstream;
+
+		// Frame copied in yuv_buffer
+		uint64_t frame_index = -1;
+		// Being encoded or drained, yuv_buffer must not be written
+		bool busy = false;
+	};
+	// One slot in synchronous mode, a ring indexed by frame index in async mode
+	std::vector<slot> slots;
+	slot & AcquireSlot(uint64_t frame_index);
+
+	// Async mode: Encode only submits the frame, the bitstream is read and
+	// sent by drain_thread, so the next frame can be prepared meanwhile
+	bool async = false;
+	std::mutex slot_mutex;
+	std::condition_variable slot_cv;
+	// Frames submitted to the encoder, in order: slot index and frame index
+	std::deque<std::pair<size_t, uint64_t>> drain_queue;
+	bool stop = false;
+	std::thread drain_thread;
 
 	vk::Image luma;
 	vk::Image chroma;
-	CUdeviceptr frame;
 	uint32_t width;
 	uint32_t height;
-	NV_ENC_REGISTERED_PTR nvenc_resource;
+	// Bytes per row of both planes in the input buffers, the conversion shader writes whole words
+	uint32_t pitch;
+	// Slices are read and sent while the rest of the frame is being encoded
+	bool subframe = false;
+	// Lost frames can be removed from the references, instead of sending an IDR frame
+	bool ref_invalidation = false;
+	std::vector<uint32_t> slice_offsets;
+	// QP delta for each macroblock, CTB or superblock, empty if disabled
+	std::vector<int8_t> qp_delta_map;
 	float fps;
 	int bitrate;
+	// kept for reconfiguration
+	NV_ENC_CONFIG config;
+	NV_ENC_INITIALIZE_PARAMS init_params;
 
 public:
 	VideoEncoderNvenc(wivrn_vk_bundle & vk, encoder_settings & settings, float fps);
 	~VideoEncoderNvenc();
 
-	void PresentImage(yuv_converter & src_yuv, vk::raii::CommandBuffer & cmd_buf) override;
-	void Encode(bool idr, std::chrono::steady_clock::time_point pts) override;
+	void PresentImage(yuv_converter & src_yuv, vk::raii::CommandBuffer & cmd_buf, uint64_t frame_index) override;
+	std::optional<yuv_converter::direct_output> DirectInput(yuv_converter & src_yuv, uint64_t frame_index) override;
+	bool WaitOnGpu(vk::Semaphore present_semaphore) override;
+	void Encode(bool idr, std::chrono::steady_clock::time_point pts, uint64_t frame_index) override;
+	void ApplyBitrate(uint64_t bitrate) override;
+	bool InvalidateReferences(uint64_t lost_frame, uint64_t frame_index) override;
 
 	static std::array<int, 2> get_max_size(video_codec);
+	static std::vector<video_codec> supported_codecs();
+
+	// Loads the CUDA and nvenc libraries, without initializing CUDA so that the process can fork
+	static void Preload();
+	// Creates the CUDA context shared by the encoders
+	static void Prewarm();
+
+private:
+	void CreateSlot(slot &, encoder_settings & settings);
+	slot & GetSlot(uint64_t frame_index);
+	// Wait for the frame in the slot to be encoded, send it and release the input
+	void Drain(slot &, uint64_t frame_index);
+	void SendSlices(slot &, uint64_t frame_index);
+	void DrainLoop();
 };
 
 } // namespace xrt::drivers::wivrn
@@ -0,0 +1,688 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "video_encoder_vulkan.h"
+
+#include "encoder/yuv_converter.h"
+#include "util/u_logging.h"
+#include "utils/scoped_lock.h"
+#include "utils/wivrn_vk_bundle.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <string>
+
+namespace xrt::drivers::wivrn
+{
+
+namespace
+{
+// Bitstream buffer size, large enough for an IDR frame at high bitrate
+const uint32_t bitstream_size = 16 * 1024 * 1024;
+
+uint32_t align(uint32_t value, uint32_t alignment)
+{
+	return (value + alignment - 1) / alignment * alignment;
+}
+
+vk::VideoEncodeRateControlModeFlagBitsKHR choose_rate_control(vk::VideoEncodeRateControlModeFlagsKHR modes)
+{
+	for (auto mode: {
+	             vk::VideoEncodeRateControlModeFlagBitsKHR::eCbr,
+	             vk::VideoEncodeRateControlModeFlagBitsKHR::eVbr,
+	     })
+	{
+		if (modes & mode)
+			return mode;
+	}
+	return vk::VideoEncodeRateControlModeFlagBitsKHR::eDefault;
+}
+} // namespace
+
+VideoEncoderVulkan::VideoEncoderVulkan(wivrn_vk_bundle & vk, encoder_settings & settings, float fps) :
+        vk(vk), fps(fps), bitrate(settings.bitrate)
+{
+	if (not *vk.encode_queue)
+		throw std::runtime_error("Vulkan video encode is not available on the compositor queue");
+
+	if (settings.codec != h265)
+	{
+		U_LOG_W("requested vulkan encoder with codec != h265");
+		settings.codec = h265;
+	}
+
+	if (settings.intra_refresh > 0)
+	{
+		U_LOG_W("vulkan: intra refresh is not supported, using IDR frames");
+		settings.intra_refresh = 0;
+	}
+
+	if (settings.qp_emphasis > 0)
+		U_LOG_W("vulkan: qp_emphasis is not supported");
+
+	rect = vk::Rect2D{
+	        .offset = {
+	                .x = settings.offset_x,
+	                .y = settings.offset_y,
+	        },
+	        .extent = {
+	                .width = settings.width,
+	                .height = settings.height,
+	        },
+	};
+
+	h265_profile = vk::VideoEncodeH265ProfileInfoKHR{
+	        .stdProfileIdc = STD_VIDEO_H265_PROFILE_IDC_MAIN,
+	};
+	usage_info = vk::VideoEncodeUsageInfoKHR{
+	        .pNext = &h265_profile,
+	        .videoUsageHints = vk::VideoEncodeUsageFlagBitsKHR::eStreaming,
+	        .videoContentHints = vk::VideoEncodeContentFlagBitsKHR::eRendered,
+	        .tuningMode = vk::VideoEncodeTuningModeKHR::eUltraLowLatency,
+	};
+	profile = vk::VideoProfileInfoKHR{
+	        .pNext = &usage_info,
+	        .videoCodecOperation = vk::VideoCodecOperationFlagBitsKHR::eEncodeH265,
+	        .chromaSubsampling = vk::VideoChromaSubsamplingFlagBitsKHR::e420,
+	        .lumaBitDepth = vk::VideoComponentBitDepthFlagBitsKHR::e8,
+	        .chromaBitDepth = vk::VideoComponentBitDepthFlagBitsKHR::e8,
+	};
+	profile_list = vk::VideoProfileListInfoKHR{
+	        .profileCount = 1,
+	        .pProfiles = &profile,
+	};
+
+	auto capabilities = vk.physical_device.getVideoCapabilitiesKHR<
+	        vk::VideoCapabilitiesKHR,
+	        vk::VideoEncodeCapabilitiesKHR,
+	        vk::VideoEncodeH265CapabilitiesKHR>(profile);
+	const auto & [caps, encode_caps, h265_caps] = capabilities.get<
+	        vk::VideoCapabilitiesKHR,
+	        vk::VideoEncodeCapabilitiesKHR,
+	        vk::VideoEncodeH265CapabilitiesKHR>();
+
+	if (caps.maxDpbSlots < dpb_images.size() or caps.maxActiveReferencePictures < 1)
+		throw std::runtime_error("Vulkan video encoder does not support reference pictures");
+
+	// Coding tree blocks and the implementation granularity must cover the whole picture
+	uint32_t ctb_size = 16;
+	if (h265_caps.ctbSizes & vk::VideoEncodeH265CtbSizeFlagBitsKHR::e32)
+		ctb_size = 32;
+	if (h265_caps.ctbSizes & vk::VideoEncodeH265CtbSizeFlagBitsKHR::e64)
+		ctb_size = 64;
+	settings.video_width = align(align(settings.video_width, ctb_size), caps.pictureAccessGranularity.width);
+	settings.video_height = align(align(settings.video_height, ctb_size), caps.pictureAccessGranularity.height);
+	coded_extent = vk::Extent2D{settings.video_width, settings.video_height};
+	if (coded_extent.width > caps.maxCodedExtent.width or coded_extent.height > caps.maxCodedExtent.height)
+		throw std::runtime_error("Image is too large for the Vulkan video encoder");
+
+	vk::PhysicalDeviceVideoFormatInfoKHR format_info{
+	        .pNext = &profile_list,
+	        .imageUsage = vk::ImageUsageFlagBits::eVideoEncodeSrcKHR,
+	};
+	const auto picture_format = vk::Format::eG8B8R82Plane420Unorm;
+	auto formats = vk.physical_device.getVideoFormatPropertiesKHR(format_info);
+	if (std::ranges::find(formats, picture_format, &vk::VideoFormatPropertiesKHR::format) == formats.end())
+		throw std::runtime_error("Vulkan video encoder does not support NV12 input");
+
+	video_session = vk::raii::VideoSessionKHR(
+	        vk.device,
+	        vk::VideoSessionCreateInfoKHR{
+	                .queueFamilyIndex = vk.encode_queue_family_index,
+	                .pVideoProfile = &profile,
+	                .pictureFormat = picture_format,
+	                .maxCodedExtent = coded_extent,
+	                .referencePictureFormat = picture_format,
+	                .maxDpbSlots = uint32_t(dpb_images.size()),
+	                .maxActiveReferencePictures = 1,
+	                .pStdHeaderVersion = &caps.stdHeaderVersion,
+	        });
+
+	{
+		std::vector<vk::BindVideoSessionMemoryInfoKHR> bind_infos;
+		for (const auto & requirements: video_session.getMemoryRequirements())
+		{
+			auto & memory = session_memory.emplace_back(
+			        vk.device,
+			        vk::MemoryAllocateInfo{
+			                .allocationSize = requirements.memoryRequirements.size,
+			                .memoryTypeIndex = vk.get_memory_type(requirements.memoryRequirements.memoryTypeBits, {}),
+			        });
+			bind_infos.push_back({
+			        .memoryBindIndex = requirements.memoryBindIndex,
+			        .memory = *memory,
+			        .memoryOffset = 0,
+			        .memorySize = requirements.memoryRequirements.size,
+			});
+		}
+		video_session.bindMemory(bind_infos);
+	}
+
+	CreateSessionParameters(h265_caps);
+
+	std::array<uint32_t, 2> queue_families{vk.queue_family_index, vk.encode_queue_family_index};
+	bool shared = vk.queue_family_index != vk.encode_queue_family_index;
+	vk::ImageCreateInfo image_info{
+	        .pNext = &profile_list,
+	        .imageType = vk::ImageType::e2D,
+	        .format = picture_format,
+	        .extent = {coded_extent.width, coded_extent.height, 1},
+	        .mipLevels = 1,
+	        .arrayLayers = 1,
+	        .samples = vk::SampleCountFlagBits::e1,
+	        .tiling = vk::ImageTiling::eOptimal,
+	        .usage = vk::ImageUsageFlagBits::eVideoEncodeSrcKHR | vk::ImageUsageFlagBits::eTransferDst,
+	        .sharingMode = shared ? vk::SharingMode::eConcurrent : vk::SharingMode::eExclusive,
+	        .queueFamilyIndexCount = shared ? uint32_t(queue_families.size()) : 0,
+	        .pQueueFamilyIndices = queue_families.data(),
+	        .initialLayout = vk::ImageLayout::eUndefined,
+	};
+	VmaAllocationCreateInfo alloc_info{
+	        .usage = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE,
+	};
+	vk::ImageViewCreateInfo view_info{
+	        .viewType = vk::ImageViewType::e2D,
+	        .format = picture_format,
+	        .subresourceRange = {
+	                .aspectMask = vk::ImageAspectFlagBits::eColor,
+	                .levelCount = 1,
+	                .layerCount = 1,
+	        },
+	};
+
+	src_image = image_allocation(vk.device, image_info, alloc_info, "vulkan encoder input");
+	view_info.image = src_image;
+	src_view = vk::raii::ImageView(vk.device, view_info);
+
+	image_info.usage = vk::ImageUsageFlagBits::eVideoEncodeDpbKHR;
+	image_info.sharingMode = vk::SharingMode::eExclusive;
+	image_info.queueFamilyIndexCount = 0;
+	for (size_t i = 0; i < dpb_images.size(); ++i)
+	{
+		dpb_images[i] = image_allocation(vk.device, image_info, alloc_info, "vulkan encoder DPB");
+		view_info.image = dpb_images[i];
+		dpb_views[i] = vk::raii::ImageView(vk.device, view_info);
+	}
+
+	bitstream = buffer_allocation(
+	        vk.device,
+	        {
+	                .pNext = &profile_list,
+	                .size = align(bitstream_size, caps.minBitstreamBufferSizeAlignment),
+	                .usage = vk::BufferUsageFlagBits::eVideoEncodeDstKHR,
+	        },
+	        {
+	                .flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT,
+	                .usage = VMA_MEMORY_USAGE_AUTO,
+	        },
+	        "vulkan encoder bitstream");
+
+	vk::QueryPoolVideoEncodeFeedbackCreateInfoKHR feedback_info{
+	        .pNext = &profile,
+	        .encodeFeedbackFlags = vk::VideoEncodeFeedbackFlagBitsKHR::eBitstreamBufferOffset |
+	                               vk::VideoEncodeFeedbackFlagBitsKHR::eBitstreamBytesWritten,
+	};
+	query_pool = vk::raii::QueryPool(
+	        vk.device,
+	        vk::QueryPoolCreateInfo{
+	                .pNext = &feedback_info,
+	                .queryType = vk::QueryType::eVideoEncodeFeedbackKHR,
+	                .queryCount = 1,
+	        });
+
+	command_pool = vk::raii::CommandPool(
+	        vk.device,
+	        {
+	                .flags = vk::CommandPoolCreateFlagBits::eResetCommandBuffer,
+	                .queueFamilyIndex = vk.encode_queue_family_index,
+	        });
+	command_buffer = std::move(vk.device.allocateCommandBuffers({
+	        .commandPool = *command_pool,
+	        .commandBufferCount = 1,
+	})[0]);
+
+	vk::SemaphoreTypeCreateInfo timeline_info{
+	        .semaphoreType = vk::SemaphoreType::eTimeline,
+	        .initialValue = 0,
+	};
+	encode_done = vk::raii::Semaphore(vk.device, vk::SemaphoreCreateInfo{.pNext = &timeline_info});
+
+	rate_control_mode = choose_rate_control(encode_caps.rateControlModes);
+	rate_control_layer = vk::VideoEncodeRateControlLayerInfoKHR{
+	        .averageBitrate = bitrate,
+	        .maxBitrate = bitrate,
+	        .frameRateNumerator = uint32_t(fps * 1'000),
+	        .frameRateDenominator = 1'000,
+	};
+	ApplyBitrate(bitrate);
+
+	settings.range = VK_SAMPLER_YCBCR_RANGE_ITU_FULL;
+	settings.color_model = VK_SAMPLER_YCBCR_MODEL_CONVERSION_YCBCR_709;
+}
+
+VideoEncoderVulkan::~VideoEncoderVulkan()
+{
+	if (*encode_done and encoded_frames)
+	{
+		uint64_t value = encoded_frames;
+		(void)vk.device.waitSemaphores(
+		        vk::SemaphoreWaitInfo{
+		                .semaphoreCount = 1,
+		                .pSemaphores = &*encode_done,
+		                .pValues = &value,
+		        },
+		        UINT64_MAX);
+	}
+}
+
+void VideoEncoderVulkan::CreateSessionParameters(const vk::VideoEncodeH265CapabilitiesKHR & h265_caps)
+{
+	StdVideoH265ProfileTierLevel profile_tier_level{};
+	profile_tier_level.flags.general_progressive_source_flag = 1;
+	profile_tier_level.flags.general_frame_only_constraint_flag = 1;
+	profile_tier_level.general_profile_idc = STD_VIDEO_H265_PROFILE_IDC_MAIN;
+	profile_tier_level.general_level_idc = h265_caps.maxLevelIdc;
+
+	StdVideoH265DecPicBufMgr dec_pic_buf_mgr{};
+	dec_pic_buf_mgr.max_dec_pic_buffering_minus1[0] = dpb_images.size() - 1;
+	dec_pic_buf_mgr.max_num_reorder_pics[0] = 0;
+	dec_pic_buf_mgr.max_latency_increase_plus1[0] = 0;
+
+	StdVideoH265VideoParameterSet vps{};
+	vps.flags.vps_temporal_id_nesting_flag = 1;
+	vps.flags.vps_sub_layer_ordering_info_present_flag = 1;
+	vps.vps_video_parameter_set_id = 0;
+	vps.vps_max_sub_layers_minus1 = 0;
+	vps.pDecPicBufMgr = &dec_pic_buf_mgr;
+	vps.pProfileTierLevel = &profile_tier_level;
+
+	// colour definitions, actually ignored by decoder
+	StdVideoH265SequenceParameterSetVui vui{};
+	vui.flags.video_signal_type_present_flag = 1;
+	vui.flags.video_full_range_flag = 1;
+	vui.flags.colour_description_present_flag = 1;
+	vui.video_format = 5;              // unspecified
+	vui.colour_primaries = 1;          // BT.709
+	vui.transfer_characteristics = 13; // sRGB
+	vui.matrix_coeffs = 1;             // BT.709
+
+	uint32_t log2_ctb_size = 4;
+	if (h265_caps.ctbSizes & vk::VideoEncodeH265CtbSizeFlagBitsKHR::e32)
+		log2_ctb_size = 5;
+	if (h265_caps.ctbSizes & vk::VideoEncodeH265CtbSizeFlagBitsKHR::e64)
+		log2_ctb_size = 6;
+	// Smallest and largest supported transform block sizes
+	const std::array<std::pair<vk::VideoEncodeH265TransformBlockSizeFlagBitsKHR, uint32_t>, 4> transform_sizes{{
+	        {vk::VideoEncodeH265TransformBlockSizeFlagBitsKHR::e4, 2},
+	        {vk::VideoEncodeH265TransformBlockSizeFlagBitsKHR::e8, 3},
+	        {vk::VideoEncodeH265TransformBlockSizeFlagBitsKHR::e16, 4},
+	        {vk::VideoEncodeH265TransformBlockSizeFlagBitsKHR::e32, 5},
+	}};
+	uint32_t log2_min_transform = 0;
+	uint32_t log2_max_transform = 2;
+	for (auto [size, log2]: transform_sizes)
+	{
+		if (not(h265_caps.transformBlockSizes & size))
+			continue;
+		if (log2_min_transform == 0)
+			log2_min_transform = log2;
+		log2_max_transform = log2;
+	}
+	if (log2_min_transform == 0)
+		log2_min_transform = 2;
+
+	StdVideoH265SequenceParameterSet sps{};
+	sps.flags.sps_temporal_id_nesting_flag = 1;
+	sps.flags.sps_sub_layer_ordering_info_present_flag = 1;
+	sps.flags.sample_adaptive_offset_enabled_flag = 1;
+	sps.flags.sps_temporal_mvp_enabled_flag = 1;
+	sps.flags.strong_intra_smoothing_enabled_flag = 1;
+	sps.flags.vui_parameters_present_flag = 1;
+	sps.chroma_format_idc = STD_VIDEO_H265_CHROMA_FORMAT_IDC_420;
+	sps.pic_width_in_luma_samples = coded_extent.width;
+	sps.pic_height_in_luma_samples = coded_extent.height;
+	sps.sps_video_parameter_set_id = 0;
+	sps.sps_max_sub_layers_minus1 = 0;
+	sps.sps_seq_parameter_set_id = 0;
+	sps.bit_depth_luma_minus8 = 0;
+	sps.bit_depth_chroma_minus8 = 0;
+	sps.log2_max_pic_order_cnt_lsb_minus4 = 12;
+	sps.log2_min_luma_coding_block_size_minus3 = 0;
+	sps.log2_diff_max_min_luma_coding_block_size = log2_ctb_size - 3;
+	sps.log2_min_luma_transform_block_size_minus2 = log2_min_transform - 2;
+	sps.log2_diff_max_min_luma_transform_block_size = log2_max_transform - log2_min_transform;
+	sps.max_transform_hierarchy_depth_inter = 3;
+	sps.max_transform_hierarchy_depth_intra = 3;
+	sps.num_short_term_ref_pic_sets = 0;
+	sps.num_long_term_ref_pics_sps = 0;
+	sps.pProfileTierLevel = &profile_tier_level;
+	sps.pDecPicBufMgr = &dec_pic_buf_mgr;
+	sps.pSequenceParameterSetVui = &vui;
+
+	StdVideoH265PictureParameterSet pps{};
+	pps.flags.cu_qp_delta_enabled_flag = 1;
+	pps.flags.pps_loop_filter_across_slices_enabled_flag = 1;
+	pps.pps_pic_parameter_set_id = 0;
+	pps.pps_seq_parameter_set_id = 0;
+	pps.sps_video_parameter_set_id = 0;
+	pps.num_ref_idx_l0_default_active_minus1 = 0;
+	pps.num_ref_idx_l1_default_active_minus1 = 0;
+
+	vk::VideoEncodeH265SessionParametersAddInfoKHR add_info{
+	        .stdVPSCount = 1,
+	        .pStdVPSs = &vps,
+	        .stdSPSCount = 1,
+	        .pStdSPSs = &sps,
+	        .stdPPSCount = 1,
+	        .pStdPPSs = &pps,
+	};
+	vk::VideoEncodeH265SessionParametersCreateInfoKHR h265_info{
+	        .maxStdVPSCount = 1,
+	        .maxStdSPSCount = 1,
+	        .maxStdPPSCount = 1,
+	        .pParametersAddInfo = &add_info,
+	};
+	session_parameters = vk::raii::VideoSessionParametersKHR(
+	        vk.device,
+	        vk::VideoSessionParametersCreateInfoKHR{
+	                .pNext = &h265_info,
+	                .videoSession = *video_session,
+	        });
+
+	vk::VideoEncodeH265SessionParametersGetInfoKHR h265_get_info{
+	        .writeStdVPS = true,
+	        .writeStdSPS = true,
+	        .writeStdPPS = true,
+	        .stdVPSId = 0,
+	        .stdSPSId = 0,
+	        .stdPPSId = 0,
+	};
+	std::tie(std::ignore, parameter_sets) = vk.device.getEncodedVideoSessionParametersKHR(
+	        vk::VideoEncodeSessionParametersGetInfoKHR{
+	                .pNext = &h265_get_info,
+	                .videoSessionParameters = *session_parameters,
+	        });
+}
+
+void VideoEncoderVulkan::PresentImage(yuv_converter & src_yuv, vk::raii::CommandBuffer & cmd_buf, uint64_t frame_index)
+{
+	src_yuv.assemble_planes(rect, cmd_buf, src_image);
+}
+
+void VideoEncoderVulkan::RecordEncode(bool idr, bool non_reference)
+{
+	if (idr)
+		poc = 0;
+	// Non-reference frames are not reconstructed, the DPB keeps the last reference frame
+	int32_t setup_slot = non_reference ? -1 : (last_slot + 1) % dpb_images.size();
+	int32_t reference_slot = idr ? -1 : last_slot;
+
+	command_buffer.reset();
+	command_buffer.begin(vk::CommandBufferBeginInfo{
+	        .flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit,
+	});
+
+	std::vector<vk::ImageMemoryBarrier> barriers;
+	barriers.push_back({
+	        .srcAccessMask = vk::AccessFlagBits::eTransferWrite,
+	        .dstAccessMask = vk::AccessFlagBits::eMemoryRead,
+	        .oldLayout = vk::ImageLayout::eTransferDstOptimal,
+	        .newLayout = vk::ImageLayout::eVideoEncodeSrcKHR,
+	        .srcQueueFamilyIndex = vk::QueueFamilyIgnored,
+	        .dstQueueFamilyIndex = vk::QueueFamilyIgnored,
+	        .image = src_image,
+	        .subresourceRange = {
+	                .aspectMask = vk::ImageAspectFlagBits::eColor,
+	                .levelCount = 1,
+	                .layerCount = 1,
+	        },
+	});
+	if (not dpb_initialized)
+	{
+		for (auto & image: dpb_images)
+		{
+			barriers.push_back({
+			        .srcAccessMask = vk::AccessFlagBits::eNone,
+			        .dstAccessMask = vk::AccessFlagBits::eMemoryRead | vk::AccessFlagBits::eMemoryWrite,
+			        .oldLayout = vk::ImageLayout::eUndefined,
+			        .newLayout = vk::ImageLayout::eVideoEncodeDpbKHR,
+			        .srcQueueFamilyIndex = vk::QueueFamilyIgnored,
+			        .dstQueueFamilyIndex = vk::QueueFamilyIgnored,
+			        .image = image,
+			        .subresourceRange = {
+			                .aspectMask = vk::ImageAspectFlagBits::eColor,
+			                .levelCount = 1,
+			                .layerCount = 1,
+			        },
+			});
+		}
+		dpb_initialized = true;
+	}
+	// The planes were copied by a previous submission on the same queue
+	command_buffer.pipelineBarrier(
+	        vk::PipelineStageFlagBits::eTransfer,
+	        vk::PipelineStageFlagBits::eAllCommands,
+	        {},
+	        nullptr,
+	        nullptr,
+	        barriers);
+
+	command_buffer.resetQueryPool(*query_pool, 0, 1);
+
+	std::array<vk::VideoPictureResourceInfoKHR, 2> dpb_resources;
+	std::array<StdVideoEncodeH265ReferenceInfo, 2> std_reference_infos{};
+	std::array<vk::VideoEncodeH265DpbSlotInfoKHR, 2> dpb_slot_infos;
+	std::array<vk::VideoReferenceSlotInfoKHR, 2> reference_slots;
+	for (size_t i = 0; i < dpb_images.size(); ++i)
+	{
+		dpb_resources[i] = vk::VideoPictureResourceInfoKHR{
+		        .codedExtent = coded_extent,
+		        .imageViewBinding = *dpb_views[i],
+		};
+		dpb_slot_infos[i] = vk::VideoEncodeH265DpbSlotInfoKHR{
+		        .pStdReferenceInfo = &std_reference_infos[i],
+		};
+		reference_slots[i] = vk::VideoReferenceSlotInfoKHR{
+		        .pNext = &dpb_slot_infos[i],
+		        .slotIndex = int32_t(i),
+		        .pPictureResource = &dpb_resources[i],
+		};
+	}
+	if (setup_slot >= 0)
+	{
+		std_reference_infos[setup_slot].pic_type = idr ? STD_VIDEO_H265_PICTURE_TYPE_IDR : STD_VIDEO_H265_PICTURE_TYPE_P;
+		std_reference_infos[setup_slot].PicOrderCntVal = poc;
+	}
+	if (reference_slot >= 0)
+	{
+		std_reference_infos[reference_slot].pic_type = last_idr ? STD_VIDEO_H265_PICTURE_TYPE_IDR : STD_VIDEO_H265_PICTURE_TYPE_P;
+		std_reference_infos[reference_slot].PicOrderCntVal = last_poc;
+	}
+
+	// The setup slot is not active yet when the coding scope begins
+	std::vector<vk::VideoReferenceSlotInfoKHR> begin_slots;
+	if (setup_slot >= 0)
+	{
+		begin_slots.push_back(reference_slots[setup_slot]);
+		begin_slots.back().slotIndex = -1;
+	}
+	if (reference_slot >= 0)
+		begin_slots.push_back(reference_slots[reference_slot]);
+
+	command_buffer.beginVideoCodingKHR(vk::VideoBeginCodingInfoKHR{
+	        .pNext = session_initialized ? &active_rate_control : nullptr,
+	        .videoSession = *video_session,
+	        .videoSessionParameters = *session_parameters,
+	        .referenceSlotCount = uint32_t(begin_slots.size()),
+	        .pReferenceSlots = begin_slots.data(),
+	});
+
+	if (not session_initialized or rate_control_dirty)
+	{
+		command_buffer.controlVideoCodingKHR(vk::VideoCodingControlInfoKHR{
+		        .pNext = &rate_control,
+		        .flags = (session_initialized ? vk::VideoCodingControlFlagsKHR{} : vk::VideoCodingControlFlagBitsKHR::eReset) |
+		                 vk::VideoCodingControlFlagBitsKHR::eEncodeRateControl,
+		});
+		session_initialized = true;
+		rate_control_dirty = false;
+		active_rate_control_layer = rate_control_layer;
+		active_rate_control = rate_control;
+		if (active_rate_control.layerCount)
+			active_rate_control.pLayers = &active_rate_control_layer;
+	}
+
+	StdVideoH265ShortTermRefPicSet short_term_ref_pic_set{};
+	short_term_ref_pic_set.num_negative_pics = 1;
+	// After a non-reference frame, the reference is two frames earlier
+	short_term_ref_pic_set.delta_poc_s0_minus1[0] = reference_slot >= 0 ? poc - last_poc - 1 : 0;
+	short_term_ref_pic_set.used_by_curr_pic_s0_flag = 1;
+
+	StdVideoEncodeH265ReferenceListsInfo reference_lists{};
+	std::ranges::fill(reference_lists.RefPicList0, STD_VIDEO_H265_NO_REFERENCE_PICTURE);
+	std::ranges::fill(reference_lists.RefPicList1, STD_VIDEO_H265_NO_REFERENCE_PICTURE);
+	if (reference_slot >= 0)
+		reference_lists.RefPicList0[0] = reference_slot;
+
+	StdVideoEncodeH265PictureInfo picture_info{};
+	picture_info.flags.is_reference = not non_reference;
+	picture_info.flags.IrapPicFlag = idr;
+	picture_info.flags.pic_output_flag = 1;
+	picture_info.flags.no_output_of_prior_pics_flag = idr;
+	picture_info.pic_type = idr ? STD_VIDEO_H265_PICTURE_TYPE_IDR : STD_VIDEO_H265_PICTURE_TYPE_P;
+	picture_info.PicOrderCntVal = poc;
+	picture_info.pRefLists = idr ? nullptr : &reference_lists;
+	picture_info.pShortTermRefPicSet = idr ? nullptr : &short_term_ref_pic_set;
+
+	StdVideoEncodeH265SliceSegmentHeader slice_header{};
+	slice_header.flags.first_slice_segment_in_pic_flag = 1;
+	slice_header.flags.slice_sao_luma_flag = 1;
+	slice_header.flags.slice_sao_chroma_flag = 1;
+	slice_header.slice_type = idr ? STD_VIDEO_H265_SLICE_TYPE_I : STD_VIDEO_H265_SLICE_TYPE_P;
+	slice_header.MaxNumMergeCand = 5;
+
+	vk::VideoEncodeH265NaluSliceSegmentInfoKHR slice_info{
+	        .pStdSliceSegmentHeader = &slice_header,
+	};
+	vk::VideoEncodeH265PictureInfoKHR h265_picture_info{
+	        .naluSliceSegmentEntryCount = 1,
+	        .pNaluSliceSegmentEntries = &slice_info,
+	        .pStdPictureInfo = &picture_info,
+	};
+
+	command_buffer.beginQuery(*query_pool, 0, {});
+	command_buffer.encodeVideoKHR(vk::VideoEncodeInfoKHR{
+	        .pNext = &h265_picture_info,
+	        .dstBuffer = bitstream,
+	        .dstBufferOffset = 0,
+	        .dstBufferRange = bitstream.info().size,
+	        .srcPictureResource = {
+	                .codedExtent = coded_extent,
+	                .imageViewBinding = *src_view,
+	        },
+	        .pSetupReferenceSlot = setup_slot >= 0 ? &reference_slots[setup_slot] : nullptr,
+	        .referenceSlotCount = reference_slot >= 0 ? 1u : 0u,
+	        .pReferenceSlots = reference_slot >= 0 ? &reference_slots[reference_slot] : nullptr,
+	});
+	command_buffer.endQuery(*query_pool, 0);
+
+	command_buffer.endVideoCodingKHR(vk::VideoEndCodingInfoKHR{});
+	command_buffer.end();
+
+	if (not non_reference)
+	{
+		last_slot = setup_slot;
+		last_poc = poc;
+		last_idr = idr;
+	}
+	++poc;
+}
+
+void VideoEncoderVulkan::Encode(bool idr, std::chrono::steady_clock::time_point pts, uint64_t frame_index)
+{
+	RecordEncode(idr, IsNonReference(frame_index));
+
+	uint64_t signal_value = ++encoded_frames;
+	vk::TimelineSemaphoreSubmitInfo timeline_info{
+	        .signalSemaphoreValueCount = 1,
+	        .pSignalSemaphoreValues = &signal_value,
+	};
+	vk::SubmitInfo submit_info{
+	        .pNext = &timeline_info,
+	        .commandBufferCount = 1,
+	        .pCommandBuffers = &*command_buffer,
+	        .signalSemaphoreCount = 1,
+	        .pSignalSemaphores = &*encode_done,
+	};
+	{
+		scoped_lock lock(vk.queue_mutex);
+		vk.encode_queue.submit(submit_info);
+	}
+
+	// The encode thread waits on the CPU for the whole GPU encode before reading the bitstream,
+	// the readback is not overlapped with the next frame
+	auto res = vk.device.waitSemaphores(
+	        vk::SemaphoreWaitInfo{
+	                .semaphoreCount = 1,
+	                .pSemaphores = &*encode_done,
+	                .pValues = &signal_value,
+	        },
+	        UINT64_MAX);
+	if (res != vk::Result::eSuccess)
+		throw std::runtime_error("vulkan: failed to wait for encoded frame");
+
+	// offset, size, status
+	auto [query_res, feedback] = query_pool.getResults<int32_t>(0, 1, 3 * sizeof(int32_t), 3 * sizeof(int32_t), vk::QueryResultFlagBits::eWithStatusKHR);
+	if (query_res != vk::Result::eSuccess or feedback[2] != VK_QUERY_RESULT_STATUS_COMPLETE_KHR)
+	{
+		// The reference is unusable, the next frame must not depend on it
+		last_slot = -1;
+		SyncNeeded();
+		throw std::runtime_error("vulkan: frame encoding failed, status " + std::to_string(feedback[2]));
+	}
+
+	uint32_t offset = feedback[0];
+	uint32_t size = feedback[1];
+	vmaInvalidateAllocation(vk_allocator::instance(), bitstream, offset, size);
+
+	if (idr)
+		SendData(parameter_sets, false, frame_index);
+	SendData(std::span(bitstream.data() + offset, size), true, frame_index);
+}
+
+void VideoEncoderVulkan::ApplyBitrate(uint64_t bitrate)
+{
+	this->bitrate = bitrate;
+	rate_control_layer.averageBitrate = bitrate;
+	rate_control_layer.maxBitrate = bitrate;
+
+	bool has_layer = rate_control_mode != vk::VideoEncodeRateControlModeFlagBitsKHR::eDefault;
+	rate_control = vk::VideoEncodeRateControlInfoKHR{
+	        .rateControlMode = rate_control_mode,
+	        .layerCount = has_layer ? 1u : 0u,
+	        .pLayers = has_layer ? &rate_control_layer : nullptr,
+	        // One frame of buffering, as for the other encoders
+	        .virtualBufferSizeInMs = has_layer ? uint32_t(std::ceil(1000 / fps)) : 0,
+	        .initialVirtualBufferSizeInMs = has_layer ? uint32_t(std::ceil(1000 / fps)) : 0,
+	};
+	rate_control_dirty = true;
+}
+
+} // namespace xrt::drivers::wivrn
@@ -0,0 +1,108 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "video_encoder.h"
+#include "vk/allocation.h"
+
+#include <array>
+#include <vector>
+#include <vulkan/vulkan_raii.hpp>
+
+namespace xrt::drivers::wivrn
+{
+
+// H.265 encoder using Vulkan Video on the compositor device:
+// the converted image is copied on the GPU, without going through another API
+class VideoEncoderVulkan : public VideoEncoder
+{
+	wivrn_vk_bundle & vk;
+	// relevant part of the input image to encode
+	vk::Rect2D rect;
+	vk::Extent2D coded_extent;
+	float fps;
+	uint64_t bitrate;
+
+	vk::VideoEncodeH265ProfileInfoKHR h265_profile;
+	vk::VideoEncodeUsageInfoKHR usage_info;
+	vk::VideoProfileInfoKHR profile;
+	vk::VideoProfileListInfoKHR profile_list;
+
+	vk::raii::VideoSessionKHR video_session = nullptr;
+	std::vector<vk::raii::DeviceMemory> session_memory;
+	vk::raii::VideoSessionParametersKHR session_parameters = nullptr;
+	// VPS, SPS and PPS, sent before IDR frames
+	std::vector<uint8_t> parameter_sets;
+
+	// NV12 image the converted planes are copied to
+	image_allocation src_image;
+	vk::raii::ImageView src_view = nullptr;
+
+	// Reconstructed pictures, the current frame references the previous reference frame
+	std::array<image_allocation, 2> dpb_images;
+	std::array<vk::raii::ImageView, 2> dpb_views = {nullptr, nullptr};
+	bool dpb_initialized = false;
+
+	buffer_allocation bitstream;
+	vk::raii::QueryPool query_pool = nullptr;
+
+	vk::raii::CommandPool command_pool = nullptr;
+	vk::raii::CommandBuffer command_buffer = nullptr;
+	// Signaled by the encode queue when a frame is encoded, value is the number of encoded frames
+	vk::raii::Semaphore encode_done = nullptr;
+	uint64_t encoded_frames = 0;
+
+	vk::VideoEncodeRateControlModeFlagBitsKHR rate_control_mode;
+	vk::VideoEncodeRateControlLayerInfoKHR rate_control_layer;
+	vk::VideoEncodeRateControlInfoKHR rate_control;
+	// Rate control state known by the implementation, must be given when coding begins
+	vk::VideoEncodeRateControlLayerInfoKHR active_rate_control_layer;
+	vk::VideoEncodeRateControlInfoKHR active_rate_control;
+	// Rate control must be sent on the next frame
+	bool rate_control_dirty = true;
+	// Video session has been reset, rate control state is known by the implementation
+	bool session_initialized = false;
+
+	// Picture order count of the current frame, reset on IDR frames
+	int32_t poc = 0;
+	// DPB slot of the last encoded reference frame
+	int32_t last_slot = -1;
+	// Picture order count and type of the picture in last_slot
+	int32_t last_poc = 0;
+	bool last_idr = false;
+
+public:
+	VideoEncoderVulkan(wivrn_vk_bundle & vk, encoder_settings & settings, float fps);
+	~VideoEncoderVulkan();
+
+	void PresentImage(yuv_converter & src_yuv, vk::raii::CommandBuffer & cmd_buf, uint64_t frame_index) override;
+	void Encode(bool idr, std::chrono::steady_clock::time_point pts, uint64_t frame_index) override;
+	void ApplyBitrate(uint64_t bitrate) override;
+	bool SupportsNonReferenceFrames() override
+	{
+		return true;
+	}
+
+private:
+	void CreateSessionParameters(const vk::VideoEncodeH265CapabilitiesKHR & h265_caps);
+	void RecordEncode(bool idr, bool non_reference);
+};
+
+} // namespace xrt::drivers::wivrn
@@ -23,10 +23,14 @@
 #include "utils/wivrn_vk_bundle.h"
 #include "yuv_converter.h"
 #include <stdexcept>
+#include <string>
 
 namespace xrt::drivers::wivrn
 {
 
+// Input frames being copied or encoded at the same time
+static const size_t staging_count = 3;
+
 VideoEncoderX265::VideoEncoderX265(
         wivrn_vk_bundle & vk,
         encoder_settings & settings,
@@ -54,25 +58,36 @@ VideoEncoderX265::VideoEncoderX265(
 	        },
 	};
 
-	luma = buffer_allocation(
-	        vk.device,
-	        {
-	                .size = vk::DeviceSize(settings.video_width * settings.video_height),
-	                .usage = vk::BufferUsageFlagBits::eTransferDst,
-	        },
-	        {
-	                .flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT,
-	                .usage = VMA_MEMORY_USAGE_AUTO,
-	        });
-	chroma = buffer_allocation(
-	        vk.device, {
-	                           .size = vk::DeviceSize(settings.video_width * settings.video_height / 2),
-	                           .usage = vk::BufferUsageFlagBits::eTransferDst,
-	                   },
-	        {
-	                .flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT,
-	                .usage = VMA_MEMORY_USAGE_AUTO,
-	        });
+	staging_buffers.resize(staging_count);
+	for (auto & [luma, chroma]: staging_buffers)
+	{
+		luma = buffer_allocation(
+		        vk.device,
+		        {
+		                .size = vk::DeviceSize(settings.video_width * settings.video_height),
+		                .usage = vk::BufferUsageFlagBits::eTransferDst,
+		        },
+		        {
+		                .flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT,
+		                .usage = VMA_MEMORY_USAGE_AUTO,
+		        },
+		        memory_pool::staging,
+		        "x265 luma staging");
+		chroma = buffer_allocation(
+		        vk.device, {
+		                           .size = vk::DeviceSize(settings.video_width * settings.video_height / 2),
+		                           .usage = vk::BufferUsageFlagBits::eTransferDst,
+		                   },
+		        {
+		                .flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT,
+		                .usage = VMA_MEMORY_USAGE_AUTO,
+		        },
+		        memory_pool::staging,
+		        "x265 chroma staging");
+		// Kept mapped for the lifetime of the encoder
+		luma.map();
+		chroma.map();
+	}
 
 	x265_param_default_preset(&param, "ultrafast", "zerolatency");
 	param.bEnableWavefront = 0;
@@ -84,6 +99,12 @@ VideoEncoderX265::VideoEncoderX265(
 	param.bRepeatHeaders = 1;
 	param.bEnableAccessUnitDelimiters = 0;
 	param.keyframeMax = -1;
+	if (settings.intra_refresh > 0)
+	{
+		// Columns of intra blocks sweep the image over keyframeMax frames
+		param.bIntraRefresh = 1;
+		param.keyframeMax = settings.intra_refresh;
+	}
 
 	// colour definitions, actually ignored by decoder
 	param.vui.bEnableVideoFullRangeFlag = 1;
@@ -98,6 +119,27 @@ VideoEncoderX265::VideoEncoderX265(
 	param.rc.rateControlMode = X265_RC_ABR;
 	param.rc.bitrate = settings.bitrate / 1000; // x265 uses kbit/s
 
+	// Any x265 option, such as wpp, frame-threads or pools
+	for (const auto & [name, value]: settings.options)
+	{
+		int err = x265_param_parse(&param, name.c_str(), value.c_str());
+		if (err == X265_PARAM_BAD_NAME)
+			U_LOG_W("x265: unknown option %s", name.c_str());
+		else if (err)
+			U_LOG_W("x265: invalid value %s for option %s", value.c_str(), name.c_str());
+	}
+	if (param.frameNumThreads > 1)
+		U_LOG_W("x265: frame-threads > 1 delays the output by %d frames", param.frameNumThreads - 1);
+
+	quant_offsets = QpOffsetMap(settings, 16);
+	if (not quant_offsets.empty() and param.rc.aqMode == X265_AQ_NONE)
+	{
+		// Quantizer offsets are only applied with adaptive quantization
+		param.rc.aqMode = X265_AQ_VARIANCE;
+		if (param.rc.aqStrength == 0)
+			param.rc.aqStrength = 1;
+	}
+
 	enc = x265_encoder_open(&param);
 	if (!enc)
 	{
@@ -108,14 +150,18 @@ VideoEncoderX265::VideoEncoderX265(
 	x265_picture_init(&param, pic_in);
 	pic_in->userData = this;
 	pic_in->colorSpace = X265_CSP_I420;
-	pic_in->planes[0] = static_cast<uint8_t *>(luma.map());
-	pic_in->planes[1] = static_cast<uint8_t *>(chroma.map());
 	pic_in->stride[0] = settings.video_width;
 	pic_in->stride[1] = settings.video_width;
+	if (not quant_offsets.empty())
+		pic_in->quantOffsets = quant_offsets.data();
+
+	pic_out = x265_picture_alloc();
+	x265_picture_init(&param, pic_out);
 }
 
-void VideoEncoderX265::PresentImage(yuv_converter & src_yuv, vk::raii::CommandBuffer & cmd_buf)
+void VideoEncoderX265::PresentImage(yuv_converter & src_yuv, vk::raii::CommandBuffer & cmd_buf, uint64_t frame_index)
 {
+	auto & [luma, chroma] = staging_buffers[frame_index % staging_buffers.size()];
 	cmd_buf.copyImageToBuffer(
 	        src_yuv.luma,
 	        vk::ImageLayout::eTransferSrcOptimal,
@@ -156,14 +202,19 @@ void VideoEncoderX265::PresentImage(yuv_converter & src_yuv, vk::raii::CommandBu
 	                }});
 }
 
-void VideoEncoderX265::Encode(bool idr, std::chrono::steady_clock::time_point pts)
+void VideoEncoderX265::Encode(bool idr, std::chrono::steady_clock::time_point pts, uint64_t frame_index)
 {
 	x265_nal * nals;
 	uint32_t num_nal;
+	auto & [luma, chroma] = staging_buffers[frame_index % staging_buffers.size()];
+	vmaInvalidateAllocation(vk_allocator::instance(), luma, 0, VK_WHOLE_SIZE);
+	vmaInvalidateAllocation(vk_allocator::instance(), chroma, 0, VK_WHOLE_SIZE);
+	pic_in->planes[0] = luma.data();
+	pic_in->planes[1] = chroma.data();
 	pic_in->sliceType = idr ? X265_TYPE_IDR : X265_TYPE_AUTO;
 	pic_in->pts = pts.time_since_epoch().count();
 
-	int size = x265_encoder_encode(enc, &nals, &num_nal, pic_in, nullptr);
+	int size = x265_encoder_encode(enc, &nals, &num_nal, pic_in, pic_out);
 	if (size < 0)
 	{
 		U_LOG_W("x265_encoder_encode failed: %d", size);
@@ -172,15 +223,23 @@ void VideoEncoderX265::Encode(bool idr, std::chrono::steady_clock::time_point pt
 
 	for (uint32_t i = 0; i < num_nal; i++)
 	{
-		std::vector<uint8_t> data(nals[i].payload, nals[i].payload + nals[i].sizeBytes);
 		bool is_last = (i == num_nal - 1);
-		SendData(data, is_last);
+		SendData({nals[i].payload, nals[i].sizeBytes}, is_last, frame_index, pic_out->frameData.qp);
 	}
 }
 
+void VideoEncoderX265::ApplyBitrate(uint64_t bitrate)
+{
+	param.rc.bitrate = bitrate / 1000; // x265 uses kbit/s
+	int err = x265_encoder_reconfig(enc, &param);
+	if (err < 0)
+		throw std::runtime_error("x265_encoder_reconfig failed: " + std::to_string(err));
+}
+
 VideoEncoderX265::~VideoEncoderX265()
 {
 	x265_picture_free(pic_in);
+	x265_picture_free(pic_out);
 	x265_encoder_close(enc);
 }
 
@@ -25,6 +25,7 @@
 
 #include <list>
 #include <mutex>
+#include <vector>
 #include <vulkan/vulkan_raii.hpp>
 
 namespace xrt::drivers::wivrn
@@ -37,9 +38,17 @@ class VideoEncoderX265 : public VideoEncoder
 
 	x265_picture * pic_in = nullptr;
 	x265_picture * pic_out = nullptr;
+	// QP offset for each 16x16 block, empty if disabled
+	std::vector<float> quant_offsets;
 
-	buffer_allocation luma;
-	buffer_allocation chroma;
+	// Host visible copy of the input, a ring indexed by frame index so that
+	// the next frame can be copied while x265 reads the previous one
+	struct staging
+	{
+		buffer_allocation luma;
+		buffer_allocation chroma;
+	};
+	std::vector<staging> staging_buffers;
 	uint32_t chroma_width;
 
 	vk::Rect2D rect;
@@ -47,9 +56,10 @@ class VideoEncoderX265 : public VideoEncoder
 public:
 	VideoEncoderX265(wivrn_vk_bundle & vk, encoder_settings & settings, float fps);
 
-	void PresentImage(yuv_converter & src_yuv, vk::raii::CommandBuffer & cmd_buf) override;
+	void PresentImage(yuv_converter & src_yuv, vk::raii::CommandBuffer & cmd_buf, uint64_t frame_index) override;
 
-	void Encode(bool idr, std::chrono::steady_clock::time_point pts) override;
+	void Encode(bool idr, std::chrono::steady_clock::time_point pts, uint64_t frame_index) override;
+	void ApplyBitrate(uint64_t bitrate) override;
 
 	~VideoEncoderX265();
 };
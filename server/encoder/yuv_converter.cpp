@@ -18,7 +18,10 @@
  */
 
 #include "yuv_converter.h"
+#include "foveated_mapping.h"
 
+#include <algorithm>
+#include <cstring>
 #include <map>
 #include <span>
 #include <vector>
@@ -44,6 +47,21 @@ const float COLORSPACE_BT709[3][4] = {
 };
 #endif
 
+struct push_constants
+{
+	float color_space[3][4];
+	uint32_t direct_output;
+	uint32_t pitch;
+	uint32_t chroma_offset;
+	uint32_t sampled_input;
+};
+
+// Uniform buffer of the source views
+struct source_parameters
+{
+	foveated_mapping eyes[2];
+};
+
 static vk::Format view_format(vk::Format image_format)
 {
 	switch (image_format)
@@ -58,12 +76,130 @@ static vk::Format view_format(vk::Format image_format)
 	};
 }
 
+yuv_pipeline::yuv_pipeline(vk::raii::Device & device, vk::raii::PipelineCache & pipeline_cache)
+{
+	sampler = device.createSampler({
+	        .magFilter = vk::Filter::eLinear,
+	        .minFilter = vk::Filter::eLinear,
+	        .mipmapMode = vk::SamplerMipmapMode::eNearest,
+	        .addressModeU = vk::SamplerAddressMode::eClampToEdge,
+	        .addressModeV = vk::SamplerAddressMode::eClampToEdge,
+	        .addressModeW = vk::SamplerAddressMode::eClampToEdge,
+	        .maxLod = VK_LOD_CLAMP_NONE,
+	});
+
+	// Descriptor set layout
+	{
+		std::array samplers{*sampler, *sampler};
+		std::array ds_layout_binding{
+		        vk::DescriptorSetLayoutBinding{
+		                .binding = 0,
+		                .descriptorType = vk::DescriptorType::eStorageImage,
+		                .descriptorCount = 1,
+		                .stageFlags = vk::ShaderStageFlagBits::eCompute,
+		        },
+		        vk::DescriptorSetLayoutBinding{
+		                .binding = 1,
+		                .descriptorType = vk::DescriptorType::eStorageImage,
+		                .descriptorCount = 1,
+		                .stageFlags = vk::ShaderStageFlagBits::eCompute,
+		        },
+		        vk::DescriptorSetLayoutBinding{
+		                .binding = 2,
+		                .descriptorType = vk::DescriptorType::eStorageImage,
+		                .descriptorCount = 1,
+		                .stageFlags = vk::ShaderStageFlagBits::eCompute,
+		        },
+		        vk::DescriptorSetLayoutBinding{
+		                .binding = 4,
+		                .descriptorType = vk::DescriptorType::eStorageBuffer,
+		                .descriptorCount = 1,
+		                .stageFlags = vk::ShaderStageFlagBits::eCompute,
+		        },
+		        vk::DescriptorSetLayoutBinding{
+		                .binding = 5,
+		                .descriptorType = vk::DescriptorType::eStorageBuffer,
+		                .descriptorCount = 1,
+		                .stageFlags = vk::ShaderStageFlagBits::eCompute,
+		        },
+		        vk::DescriptorSetLayoutBinding{
+		                .binding = 6,
+		                .descriptorType = vk::DescriptorType::eStorageBuffer,
+		                .descriptorCount = 1,
+		                .stageFlags = vk::ShaderStageFlagBits::eCompute,
+		        },
+		        vk::DescriptorSetLayoutBinding{
+		                .binding = 7,
+		                .descriptorType = vk::DescriptorType::eCombinedImageSampler,
+		                .descriptorCount = samplers.size(),
+		                .stageFlags = vk::ShaderStageFlagBits::eCompute,
+		                .pImmutableSamplers = samplers.data(),
+		        },
+		        vk::DescriptorSetLayoutBinding{
+		                .binding = 8,
+		                .descriptorType = vk::DescriptorType::eUniformBuffer,
+		                .descriptorCount = 1,
+		                .stageFlags = vk::ShaderStageFlagBits::eCompute,
+		        },
+		};
+		ds_layout = device.createDescriptorSetLayout({
+		        .bindingCount = ds_layout_binding.size(),
+		        .pBindings = ds_layout_binding.data(),
+		});
+	}
+
+	// Pipeline layout
+	{
+		vk::PushConstantRange push_constant_range{
+		        .stageFlags = vk::ShaderStageFlagBits::eCompute,
+		        .offset = 0,
+		        .size = sizeof(push_constants),
+		};
+		layout = device.createPipelineLayout({
+		        .setLayoutCount = 1,
+		        .pSetLayouts = &*ds_layout,
+		        .pushConstantRangeCount = 1,
+		        .pPushConstantRanges = &push_constant_range,
+		});
+	}
+
+	// Pipeline
+	{
+		auto & spirv = shaders.at("yuv.comp");
+		vk::raii::ShaderModule shader(device, {
+		                                              .codeSize = spirv.size() * sizeof(uint32_t),
+		                                              .pCode = spirv.data(),
+		                                      });
+
+		pipeline = vk::raii::Pipeline(device, pipeline_cache, vk::ComputePipelineCreateInfo{
+		                                                              .stage = {
+		                                                                      .stage = vk::ShaderStageFlagBits::eCompute,
+		                                                                      .module = *shader,
+		                                                                      .pName = "main",
+		                                                              },
+		                                                              .layout = *layout,
+		                                                      });
+	}
+}
+
 yuv_converter::yuv_converter() {}
-yuv_converter::yuv_converter(vk::PhysicalDevice physical_device, vk::raii::Device & device, vk::Image rgb, vk::Format fmt, vk::Extent2D extent) :
-        extent(extent), rgb(rgb)
+yuv_converter::yuv_converter(vk::PhysicalDevice physical_device, vk::raii::Device & device, vk::raii::PipelineCache & pipeline_cache, vk::Image rgb, vk::Format fmt, vk::Extent2D extent) :
+        yuv_converter(physical_device, device, std::make_shared<yuv_pipeline>(device, pipeline_cache), rgb, fmt, extent)
+{
+}
+
+yuv_converter::yuv_converter(vk::PhysicalDevice physical_device, vk::raii::Device & device, std::shared_ptr<yuv_pipeline> pipeline, vk::Image rgb, vk::Format fmt, vk::Extent2D extent, std::optional<vk::Rect2D> background) :
+        extent(extent), background(background), rgb(rgb), device(*device), shared(std::move(pipeline))
 {
 	auto view_fmt = view_format(fmt);
 
+	vk::Extent2D planes_extent = extent;
+	if (background)
+	{
+		planes_extent.width = std::max<uint32_t>(planes_extent.width, background->offset.x + background->extent.width);
+		planes_extent.height = std::max<uint32_t>(planes_extent.height, background->offset.y + background->extent.height);
+	}
+
 	struct plane_t
 	{
 		vk::Format format;
@@ -76,13 +212,13 @@ yuv_converter::yuv_converter(vk::PhysicalDevice physical_device, vk::raii::Devic
 	std::array planes = {
 	        plane_t{
 	                .format = vk::Format::eR8Unorm,
-	                .extent = {extent.width, extent.height, 1},
+	                .extent = {planes_extent.width, planes_extent.height, 1},
 	                .image = luma,
 	                .view = view_luma,
 	        },
 	        plane_t{
 	                .format = vk::Format::eR8G8Unorm,
-	                .extent = {extent.width / 2, extent.height / 2, 1},
+	                .extent = {planes_extent.width / 2, planes_extent.height / 2, 1},
 	                .image = chroma,
 	                .view = view_chroma,
 	        },
@@ -121,12 +257,15 @@ yuv_converter::yuv_converter(vk::PhysicalDevice physical_device, vk::raii::Devic
 		                .samples = vk::SampleCountFlagBits::e1,
 		                .tiling = vk::ImageTiling::eOptimal,
 		                .usage = vk::ImageUsageFlagBits::eStorage |
-		                         vk::ImageUsageFlagBits::eTransferSrc,
+		                         vk::ImageUsageFlagBits::eTransferSrc |
+		                         vk::ImageUsageFlagBits::eTransferDst,
 		                .sharingMode = vk::SharingMode::eExclusive,
 		        },
 			{
 			.usage = VMA_MEMORY_USAGE_AUTO,
-			});
+			},
+			memory_pool::frame,
+			"yuv plane");
 	}
 
 	// Output image views
@@ -145,66 +284,42 @@ yuv_converter::yuv_converter(vk::PhysicalDevice physical_device, vk::raii::Devic
 		        });
 	}
 
-	// Descriptor sets
-	{
-		std::array ds_layout_binding{
-		        vk::DescriptorSetLayoutBinding{
-		                .binding = 0,
-		                .descriptorType = vk::DescriptorType::eStorageImage,
-		                .descriptorCount = 1,
-		                .stageFlags = vk::ShaderStageFlagBits::eCompute,
-		        },
-		        vk::DescriptorSetLayoutBinding{
-		                .binding = 1,
-		                .descriptorType = vk::DescriptorType::eStorageImage,
-		                .descriptorCount = 1,
-		                .stageFlags = vk::ShaderStageFlagBits::eCompute,
-		        },
-		        vk::DescriptorSetLayoutBinding{
-		                .binding = 2,
-		                .descriptorType = vk::DescriptorType::eStorageImage,
-		                .descriptorCount = 1,
-		                .stageFlags = vk::ShaderStageFlagBits::eCompute,
-		        },
-		};
-		ds_layout = device.createDescriptorSetLayout({
-		        .bindingCount = ds_layout_binding.size(),
-		        .pBindings = ds_layout_binding.data(),
-		});
-	}
-
-	// Pipeline layout
-	{
-		vk::PushConstantRange push_constant_range{
-		        .stageFlags = vk::ShaderStageFlagBits::eCompute,
-		        .offset = 0,
-		        .size = sizeof(COLORSPACE_BT709),
-		};
-		layout = device.createPipelineLayout({
-		        .setLayoutCount = 1,
-		        .pSetLayouts = &*ds_layout,
-		        .pushConstantRangeCount = 1,
-		        .pPushConstantRanges = &push_constant_range,
-		});
-	}
+	// Checksums, one per workgroup
+	checksum_buffer = buffer_allocation(
+	        device,
+	        {
+	                .size = vk::DeviceSize(sizeof(uint32_t) *
+	                                       ((extent.width + checksum_tile_size - 1) / checksum_tile_size) *
+	                                       ((extent.height + checksum_tile_size - 1) / checksum_tile_size)),
+	                .usage = vk::BufferUsageFlagBits::eStorageBuffer,
+	        },
+	        {
+	                .flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT,
+	                .usage = VMA_MEMORY_USAGE_AUTO,
+	        });
 
-	// Pipeline
-	{
-		auto & spirv = shaders.at("yuv.comp");
-		vk::raii::ShaderModule shader(device, {
-		                                              .codeSize = spirv.size() * sizeof(uint32_t),
-		                                              .pCode = spirv.data(),
-		                                      });
+	// Thumbnail, one byte per texel
+	thumbnail_buffer = buffer_allocation(
+	        device,
+	        {
+	                .size = vk::DeviceSize(thumbnail_size().width * thumbnail_size().height),
+	                .usage = vk::BufferUsageFlagBits::eStorageBuffer,
+	        },
+	        {
+	                .flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT,
+	                .usage = VMA_MEMORY_USAGE_AUTO,
+	        });
 
-		pipeline = vk::raii::Pipeline(device, nullptr, vk::ComputePipelineCreateInfo{
-		                                                       .stage = {
-		                                                               .stage = vk::ShaderStageFlagBits::eCompute,
-		                                                               .module = *shader,
-		                                                               .pName = "main",
-		                                                       },
-		                                                       .layout = *layout,
-		                                               });
-	}
+	source_buffer = buffer_allocation(
+	        device,
+	        {
+	                .size = sizeof(source_parameters),
+	                .usage = vk::BufferUsageFlagBits::eUniformBuffer,
+	        },
+	        {
+	                .flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT,
+	                .usage = VMA_MEMORY_USAGE_AUTO,
+	        });
 
 	// Descriptor pool
 	{
@@ -215,11 +330,23 @@ yuv_converter::yuv_converter(vk::PhysicalDevice physical_device, vk::raii::Devic
 		        },
 		        vk::DescriptorPoolSize{
 		                .type = vk::DescriptorType::eStorageImage,
+		                .descriptorCount = 3,
+		        },
+		        vk::DescriptorPoolSize{
+		                .type = vk::DescriptorType::eStorageBuffer,
+		                .descriptorCount = 3,
+		        },
+		        vk::DescriptorPoolSize{
+		                .type = vk::DescriptorType::eCombinedImageSampler,
 		                .descriptorCount = 2,
+		        },
+		        vk::DescriptorPoolSize{
+		                .type = vk::DescriptorType::eUniformBuffer,
+		                .descriptorCount = 1,
 		        }};
 
 		dp = device.createDescriptorPool({
-		        .maxSets = 2,
+		        .maxSets = 1,
 		        .poolSizeCount = pool_size.size(),
 		        .pPoolSizes = pool_size.data(),
 		});
@@ -229,7 +356,7 @@ yuv_converter::yuv_converter(vk::PhysicalDevice physical_device, vk::raii::Devic
 	ds = device.allocateDescriptorSets({
 	        .descriptorPool = *dp,
 	        .descriptorSetCount = 1,
-	        .pSetLayouts = &*ds_layout,
+	        .pSetLayouts = &*shared->ds_layout,
 	})[0].release();
 
 	vk::DescriptorImageInfo rgb_desc_image_info{
@@ -244,6 +371,21 @@ yuv_converter::yuv_converter(vk::PhysicalDevice physical_device, vk::raii::Devic
 	        .imageView = *view_chroma,
 	        .imageLayout = vk::ImageLayout::eGeneral,
 	};
+	vk::DescriptorBufferInfo checksum_desc_buffer_info{
+	        .buffer = checksum_buffer,
+	        .range = vk::WholeSize,
+	};
+	vk::DescriptorBufferInfo thumbnail_desc_buffer_info{
+	        .buffer = thumbnail_buffer,
+	        .range = vk::WholeSize,
+	};
+	vk::DescriptorBufferInfo source_desc_buffer_info{
+	        .buffer = source_buffer,
+	        .range = vk::WholeSize,
+	};
+	// Placeholder until a direct output is used, not written to
+	output_buffer = checksum_buffer;
+	// The source views are only written when they are used
 
 	device.updateDescriptorSets(
 	        {
@@ -268,13 +410,88 @@ yuv_converter::yuv_converter(vk::PhysicalDevice physical_device, vk::raii::Devic
 	                        .descriptorType = vk::DescriptorType::eStorageImage,
 	                        .pImageInfo = &chroma_desc_img_info,
 	                },
+	                vk::WriteDescriptorSet{
+	                        .dstSet = ds,
+	                        .dstBinding = 4,
+	                        .descriptorCount = 1,
+	                        .descriptorType = vk::DescriptorType::eStorageBuffer,
+	                        .pBufferInfo = &checksum_desc_buffer_info,
+	                },
+	                vk::WriteDescriptorSet{
+	                        .dstSet = ds,
+	                        .dstBinding = 5,
+	                        .descriptorCount = 1,
+	                        .descriptorType = vk::DescriptorType::eStorageBuffer,
+	                        .pBufferInfo = &checksum_desc_buffer_info,
+	                },
+	                vk::WriteDescriptorSet{
+	                        .dstSet = ds,
+	                        .dstBinding = 6,
+	                        .descriptorCount = 1,
+	                        .descriptorType = vk::DescriptorType::eStorageBuffer,
+	                        .pBufferInfo = &thumbnail_desc_buffer_info,
+	                },
+	                vk::WriteDescriptorSet{
+	                        .dstSet = ds,
+	                        .dstBinding = 8,
+	                        .descriptorCount = 1,
+	                        .descriptorType = vk::DescriptorType::eUniformBuffer,
+	                        .pBufferInfo = &source_desc_buffer_info,
+	                },
 	        },
 	        nullptr);
 }
 
 void yuv_converter::record_draw_commands(
-        vk::raii::CommandBuffer & cmd_buf)
+        vk::raii::CommandBuffer & cmd_buf,
+        std::optional<direct_output> output,
+        const std::optional<std::array<source_view, 2>> & source)
 {
+	if (source)
+	{
+		// The descriptor set and the uniform buffer are not in use, the previous commands have completed
+		std::array<vk::DescriptorImageInfo, 2> image_info;
+		auto & params = *source_buffer.data<source_parameters>();
+		for (size_t i = 0; i < source->size(); ++i)
+		{
+			const auto & v = (*source)[i];
+			image_info[i] = {
+			        .imageView = v.image,
+			        .imageLayout = vk::ImageLayout::eShaderReadOnlyOptimal,
+			};
+			params.eyes[i].set_foveation(v.foveation);
+			params.eyes[i].set_mapping(v.stream_fov, v.image_fov, v.x, v.y, v.width, v.height);
+		}
+		device.updateDescriptorSets(
+		        vk::WriteDescriptorSet{
+		                .dstSet = ds,
+		                .dstBinding = 7,
+		                .descriptorCount = image_info.size(),
+		                .descriptorType = vk::DescriptorType::eCombinedImageSampler,
+		                .pImageInfo = image_info.data(),
+		        },
+		        nullptr);
+	}
+
+	if (output and output->buffer != output_buffer)
+	{
+		// The descriptor set is not in use, the previous commands have completed
+		vk::DescriptorBufferInfo output_info{
+		        .buffer = output->buffer,
+		        .range = vk::WholeSize,
+		};
+		device.updateDescriptorSets(
+		        vk::WriteDescriptorSet{
+		                .dstSet = ds,
+		                .dstBinding = 5,
+		                .descriptorCount = 1,
+		                .descriptorType = vk::DescriptorType::eStorageBuffer,
+		                .pBufferInfo = &output_info,
+		        },
+		        nullptr);
+		output_buffer = output->buffer;
+	}
+
 	std::array im_barriers = {
 	        vk::ImageMemoryBarrier{
 	                .srcAccessMask = vk::AccessFlagBits::eNone,
@@ -321,10 +538,73 @@ void yuv_converter::record_draw_commands(
 	        nullptr,
 	        im_barriers);
 
-	cmd_buf.bindPipeline(vk::PipelineBindPoint::eCompute, *pipeline);
-	cmd_buf.bindDescriptorSets(vk::PipelineBindPoint::eCompute, *layout, 0, ds, {});
-	cmd_buf.pushConstants<float[3][4]>(*layout, vk::ShaderStageFlagBits::eCompute, 0, COLORSPACE_BT709);
-	cmd_buf.dispatch(extent.width / 16, extent.height / 16, 1);
+	cmd_buf.bindPipeline(vk::PipelineBindPoint::eCompute, *shared->pipeline);
+	cmd_buf.bindDescriptorSets(vk::PipelineBindPoint::eCompute, *shared->layout, 0, ds, {});
+	push_constants pc{
+	        .direct_output = output ? 1u : 0u,
+	        .pitch = output ? output->pitch : 0,
+	        .chroma_offset = output ? uint32_t(output->chroma_offset) : 0,
+	        .sampled_input = source ? 1u : 0u,
+	};
+	memcpy(pc.color_space, COLORSPACE_BT709, sizeof(COLORSPACE_BT709));
+	cmd_buf.pushConstants<push_constants>(*shared->layout, vk::ShaderStageFlagBits::eCompute, 0, pc);
+	// Each invocation converts a 2x2 block, workgroups are 16x16 invocations
+	static_assert(checksum_tile_size == 32);
+	static_assert(thumbnail_scale == 8);
+	cmd_buf.dispatch((extent.width + 31) / 32, (extent.height + 31) / 32, 1);
+
+	vk::MemoryBarrier checksum_barrier{
+	        .srcAccessMask = vk::AccessFlagBits::eShaderWrite,
+	        .dstAccessMask = vk::AccessFlagBits::eHostRead,
+	};
+	cmd_buf.pipelineBarrier(
+	        vk::PipelineStageFlagBits::eComputeShader,
+	        vk::PipelineStageFlagBits::eHost,
+	        {},
+	        checksum_barrier,
+	        nullptr,
+	        nullptr);
+
+	vk::PipelineStageFlags written = vk::PipelineStageFlagBits::eComputeShader;
+	if (background and not output)
+	{
+		// Linear filtering of R8 and R8G8 images is always supported, the planes stay in the general
+		// layout so that the image is both the source and the destination of the blit
+		vk::MemoryBarrier planes_barrier{
+		        .srcAccessMask = vk::AccessFlagBits::eShaderWrite,
+		        .dstAccessMask = vk::AccessFlagBits::eTransferRead | vk::AccessFlagBits::eTransferWrite,
+		};
+		cmd_buf.pipelineBarrier(
+		        vk::PipelineStageFlagBits::eComputeShader,
+		        vk::PipelineStageFlagBits::eTransfer,
+		        {},
+		        planes_barrier,
+		        nullptr,
+		        nullptr);
+
+		// Chroma is subsampled by 2
+		std::array<std::pair<vk::Image, int32_t>, 2> planes{{{luma, 1}, {chroma, 2}}};
+		for (auto [image, scale]: planes)
+		{
+			vk::ImageBlit blit{
+			        .srcSubresource = {.aspectMask = vk::ImageAspectFlagBits::eColor, .layerCount = 1},
+			        .srcOffsets = std::array{
+			                vk::Offset3D{0, 0, 0},
+			                vk::Offset3D{int32_t(extent.width) / scale, int32_t(extent.height) / scale, 1},
+			        },
+			        .dstSubresource = {.aspectMask = vk::ImageAspectFlagBits::eColor, .layerCount = 1},
+			        .dstOffsets = std::array{
+			                vk::Offset3D{background->offset.x / scale, background->offset.y / scale, 0},
+			                vk::Offset3D{
+			                        (background->offset.x + int32_t(background->extent.width)) / scale,
+			                        (background->offset.y + int32_t(background->extent.height)) / scale,
+			                        1},
+			        },
+			};
+			cmd_buf.blitImage(image, vk::ImageLayout::eGeneral, image, vk::ImageLayout::eGeneral, blit, vk::Filter::eLinear);
+		}
+		written = vk::PipelineStageFlagBits::eTransfer;
+	}
 
 	for (auto & barrier: im_barriers)
 	{
@@ -334,7 +614,7 @@ void yuv_converter::record_draw_commands(
 		barrier.newLayout = vk::ImageLayout::eTransferSrcOptimal;
 	}
 	cmd_buf.pipelineBarrier(
-	        vk::PipelineStageFlagBits::eComputeShader,
+	        written,
 	        vk::PipelineStageFlagBits::eTransfer,
 	        {},
 	        nullptr,
@@ -379,7 +659,7 @@ void yuv_converter::assemble_planes(vk::Rect2D rect, vk::raii::CommandBuffer & c
 	                        .aspectMask = vk::ImageAspectFlagBits::ePlane0,
 	                        .layerCount = 1,
 	                },
-	                .extent = {extent.width, extent.height, 1},
+	                .extent = {rect.extent.width, rect.extent.height, 1},
 	        });
 	cmd_buf.copyImage(
 	        chroma,
@@ -396,6 +676,28 @@ void yuv_converter::assemble_planes(vk::Rect2D rect, vk::raii::CommandBuffer & c
 	                        .aspectMask = vk::ImageAspectFlagBits::ePlane1,
 	                        .layerCount = 1,
 	                },
-	                .extent = {extent.width / 2, extent.height / 2, 1},
+	                .extent = {rect.extent.width / 2, rect.extent.height / 2, 1},
 	        });
 }
+
+std::span<const uint32_t> yuv_converter::checksums()
+{
+	vmaInvalidateAllocation(vk_allocator::instance(), checksum_buffer, 0, VK_WHOLE_SIZE);
+	return {checksum_buffer.data<uint32_t>(), checksum_buffer.info().size / sizeof(uint32_t)};
+}
+
+vk::Extent2D yuv_converter::thumbnail_size() const
+{
+	// The shader writes 4x4 texels per tile
+	return {
+	        (extent.width + checksum_tile_size - 1) / checksum_tile_size * (checksum_tile_size / thumbnail_scale),
+	        (extent.height + checksum_tile_size - 1) / checksum_tile_size * (checksum_tile_size / thumbnail_scale),
+	};
+}
+
+std::span<const uint8_t> yuv_converter::thumbnail()
+{
+	vmaInvalidateAllocation(vk_allocator::instance(), thumbnail_buffer, 0, VK_WHOLE_SIZE);
+	auto size = thumbnail_size();
+	return {thumbnail_buffer.data<uint8_t>(), size_t(size.width) * size.height};
+}
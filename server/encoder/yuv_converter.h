@@ -20,27 +20,89 @@
 #pragma once
 
 #include "vk/allocation.h"
+#include "wivrn_packets.h"
+#include <array>
+#include <memory>
+#include <optional>
+#include <span>
 #include <vector>
 #include <vulkan/vulkan_raii.hpp>
 
+// Layouts and compute pipeline of the conversion. They do not depend on the image, so a single
+// one is shared by the converters of all the swapchain images.
+class yuv_pipeline
+{
+	friend class yuv_converter;
+
+	// For the projection layers of the application
+	vk::raii::Sampler sampler = nullptr;
+	vk::raii::DescriptorSetLayout ds_layout = nullptr;
+	vk::raii::PipelineLayout layout = nullptr;
+	vk::raii::Pipeline pipeline = nullptr;
+
+public:
+	yuv_pipeline(vk::raii::Device & device, vk::raii::PipelineCache & pipeline_cache);
+};
+
+// Converts the compositor output to NV12 luma and chroma planes, in a single compute pass.
+// The compositor output is already foveated: monado applies the foveation through
+// wivrn_hmd_compute_distortion while compositing layers, so the full resolution image
+// is never written and this pass only reads the foveated image once.
+// When the application submits a single opaque projection layer, the pass can instead sample
+// its images with the same foveation, and the compositor does not render anything.
 class yuv_converter
 {
 	vk::Extent2D extent;
+	// Where a copy of the image at half the resolution is written in the planes, outside of the image
+	std::optional<vk::Rect2D> background;
 
 	vk::Image rgb;
+	vk::Device device;
 
 public:
 	image_allocation luma;
 	image_allocation chroma;
 
+	// Size in pixels of the tiles covered by each checksum
+	static constexpr uint32_t checksum_tile_size = 32;
+	// Size in pixels of the blocks averaged in each texel of the thumbnail
+	static constexpr uint32_t thumbnail_scale = 8;
+
+	// Linear NV12 buffer of an encoder, written by the conversion instead of the luma and chroma images
+	struct direct_output
+	{
+		vk::Buffer buffer;
+		// In bytes, for both planes, multiple of 4
+		uint32_t pitch;
+		vk::DeviceSize chroma_offset;
+	};
+
+	// View of the projection layer of the application, converted instead of the compositor output
+	struct source_view
+	{
+		// In shader read only optimal layout
+		vk::ImageView image;
+		// Normalized rectangle of the image with the view
+		float x, y, width, height;
+		// Field of view of the stream and of the image, with the same pose
+		XrFovf stream_fov;
+		XrFovf image_fov;
+		xrt::drivers::wivrn::to_headset::video_stream_description::foveation_parameter foveation;
+	};
+
 private:
+	buffer_allocation checksum_buffer;
+	buffer_allocation thumbnail_buffer;
+	// Foveation and position of the source views
+	buffer_allocation source_buffer;
+	// Buffer in the descriptor set for direct output
+	vk::Buffer output_buffer;
+
 	vk::raii::ImageView view_rgb = nullptr;
 	vk::raii::ImageView view_luma = nullptr;
 	vk::raii::ImageView view_chroma = nullptr;
 
-	vk::raii::DescriptorSetLayout ds_layout = nullptr;
-	vk::raii::PipelineLayout layout = nullptr;
-	vk::raii::Pipeline pipeline = nullptr;
+	std::shared_ptr<yuv_pipeline> shared;
 	vk::raii::DescriptorPool dp = nullptr;
 	vk::DescriptorSet ds = nullptr;
 
@@ -48,11 +110,38 @@ private:
 
 public:
 	yuv_converter();
-	yuv_converter(vk::PhysicalDevice, vk::raii::Device & device, vk::Image rgb, vk::Format format, vk::Extent2D extent);
+	// The planes are enlarged to contain the background, if any
+	yuv_converter(vk::PhysicalDevice, vk::raii::Device & device, std::shared_ptr<yuv_pipeline> pipeline, vk::Image rgb, vk::Format format, vk::Extent2D extent, std::optional<vk::Rect2D> background = std::nullopt);
+	// With its own pipeline
+	yuv_converter(vk::PhysicalDevice, vk::raii::Device & device, vk::raii::PipelineCache & pipeline_cache, vk::Image rgb, vk::Format format, vk::Extent2D extent);
+
+	// Converts the given image, or the source views if set, to yuv, stored in luma and chroma images,
+	// or in output if set. The background is then downscaled from the luma and chroma images.
+	// The output images will be in transfer src optimal layout.
+	// The previous commands recorded for this converter must have completed.
+	void record_draw_commands(vk::raii::CommandBuffer & cmd_buf, std::optional<direct_output> output = std::nullopt, const std::optional<std::array<source_view, 2>> & source = std::nullopt);
+
+	vk::Extent2D size() const
+	{
+		return extent;
+	}
+
+	// Device memory of the planes and of the checksum and thumbnail buffers
+	vk::DeviceSize memory_size() const
+	{
+		return luma.allocated_size() + chroma.allocated_size() + checksum_buffer.allocated_size() + thumbnail_buffer.allocated_size();
+	}
+
+	// Checksums of the tiles of the converted image, in raster order.
+	// Only valid once the command buffer recorded by record_draw_commands has completed
+	std::span<const uint32_t> checksums();
+
+	// Size of the thumbnail, covering whole tiles, so it may extend past the image
+	vk::Extent2D thumbnail_size() const;
 
-	// Converts the given image to yuv, stored in luma and chroma images.
-	// The output images will be in transfer src optimal layout
-	void record_draw_commands(vk::raii::CommandBuffer & cmd_buf);
+	// Luma of the converted image downscaled by thumbnail_scale, one byte per texel in raster order.
+	// Only valid once the command buffer recorded by record_draw_commands has completed
+	std::span<const uint8_t> thumbnail();
 
 	void assemble_planes(vk::Rect2D, vk::raii::CommandBuffer &, vk::Image target);
 };
@@ -10,6 +10,7 @@
 #include "accept_connection.h"
 #include "active_runtime.h"
 #include "driver/configuration.h"
+#include "encoder/video_encoder.h"
 #include "pidfd.h"
 #include "start_application.h"
 #include "version.h"
@@ -160,6 +161,9 @@ int inner_main(int argc, char * argv[], bool use_systemd)
 	TXT["version"] = xrt::drivers::wivrn::git_version;
 	TXT["cookie"] = server_cookie();
 
+	// Not in a thread: the process forks for each connection
+	xrt::drivers::wivrn::VideoEncoder::Preload();
+
 	bool quit = false;
 	while (!quit)
 	{
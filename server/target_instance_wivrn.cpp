@@ -17,7 +17,9 @@
 
 #include <assert.h>
 
+#include "driver/configuration.h"
 #include "driver/wivrn_session.h"
+#include "encoder/video_encoder.h"
 
 /*
  *
@@ -76,6 +78,16 @@ xrt_instance_create(struct xrt_instance_info * ii, struct xrt_instance ** out_xi
 {
 	u_trace_marker_init();
 
+	// Overlaps the encoder device setup with the handshake and the compositor initialization
+	try
+	{
+		xrt::drivers::wivrn::VideoEncoder::Prewarm(configuration::read_user_configuration().encoders);
+	}
+	catch (const std::exception &)
+	{
+		// Reported when the encoders are created
+	}
+
 	struct xrt_instance * xinst = U_TYPED_CALLOC(struct xrt_instance);
 	xinst->create_system = wivrn_instance_create_system;
 	xinst->get_prober = wivrn_instance_get_prober;
@@ -0,0 +1,174 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "application_watcher.h"
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <unistd.h>
+#include <utility>
+
+namespace xrt::drivers::wivrn
+{
+
+namespace
+{
+const auto poll_interval = std::chrono::seconds(2);
+
+// Name of the library loaded by the applications
+const std::string runtime_library = "libopenxr_wivrn";
+
+bool uses_runtime(const std::filesystem::path & proc)
+{
+	std::ifstream maps(proc / "maps");
+	std::string line;
+	while (std::getline(maps, line))
+	{
+		if (line.find(runtime_library) != std::string::npos)
+			return true;
+	}
+	return false;
+}
+
+// Field 22 of /proc/<pid>/stat, the comm field in parentheses may contain spaces
+uint64_t start_time(const std::filesystem::path & proc)
+{
+	std::ifstream file(proc / "stat");
+	std::string stat((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	auto end_comm = stat.rfind(')');
+	if (end_comm == std::string::npos)
+		return 0;
+	std::istringstream fields(stat.substr(end_comm + 2));
+	std::string field;
+	// Fields after comm start at 3
+	for (int i = 3; i < 22; ++i)
+		fields >> field;
+	uint64_t res = 0;
+	fields >> res;
+	return res;
+}
+
+std::string basename(const std::string & path)
+{
+	// Windows paths when the application runs with Proton
+	auto pos = path.find_last_of("/\\");
+	return pos == std::string::npos ? path : path.substr(pos + 1);
+}
+
+std::vector<std::string> process_names(const std::filesystem::path & proc)
+{
+	std::vector<std::string> res;
+	auto add = [&](std::string name) {
+		if (not name.empty() and std::ranges::find(res, name) == res.end())
+			res.push_back(std::move(name));
+	};
+
+	std::error_code ec;
+	add(std::filesystem::read_symlink(proc / "exe", ec).filename());
+
+	std::ifstream comm(proc / "comm");
+	std::string line;
+	if (std::getline(comm, line))
+		add(line);
+
+	std::ifstream cmdline(proc / "cmdline");
+	if (std::getline(cmdline, line, '\0'))
+		add(basename(line));
+
+	return res;
+}
+
+std::vector<std::string> find_application()
+{
+	std::vector<std::string> res;
+	uint64_t newest = 0;
+	int self = getpid();
+	std::error_code ec;
+	for (const auto & entry: std::filesystem::directory_iterator("/proc", ec))
+	{
+		auto name = entry.path().filename().string();
+		int pid;
+		auto [ptr, err] = std::from_chars(name.data(), name.data() + name.size(), pid);
+		if (err != std::errc{} or ptr != name.data() + name.size() or pid == self)
+			continue;
+
+		// The process may have exited in the meantime, all reads fail silently
+		if (not uses_runtime(entry.path()))
+			continue;
+		if (uint64_t start = start_time(entry.path()); res.empty() or start > newest)
+		{
+			newest = start;
+			res = process_names(entry.path());
+		}
+	}
+	return res;
+}
+} // namespace
+
+application_watcher::application_watcher() :
+        names(find_application()),
+        thread([this]() { run(); })
+{
+}
+
+application_watcher::~application_watcher()
+{
+	{
+		std::lock_guard lock(mutex);
+		quit = true;
+	}
+	cv.notify_all();
+	thread.join();
+}
+
+void application_watcher::run()
+{
+	std::unique_lock lock(mutex);
+	while (not quit)
+	{
+		lock.unlock();
+		auto current = find_application();
+		lock.lock();
+		if (current != names)
+		{
+			names = std::move(current);
+			modified = true;
+		}
+		cv.wait_for(lock, poll_interval, [this]() { return quit; });
+	}
+}
+
+bool application_watcher::changed()
+{
+	std::lock_guard lock(mutex);
+	return std::exchange(modified, false);
+}
+
+std::vector<std::string> application_watcher::get_names()
+{
+	std::lock_guard lock(mutex);
+	return names;
+}
+
+} // namespace xrt::drivers::wivrn
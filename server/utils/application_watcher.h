@@ -0,0 +1,58 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace xrt::drivers::wivrn
+{
+
+// Reports the most recently started process that loaded the WiVRn OpenXR runtime.
+// Monado does not give the application name to the drivers, so the process is found in /proc.
+class application_watcher
+{
+	std::mutex mutex;
+	std::condition_variable cv;
+	bool quit = false;
+	bool modified = false;
+	std::vector<std::string> names;
+	std::thread thread;
+
+	void run();
+
+public:
+	application_watcher();
+	application_watcher(const application_watcher &) = delete;
+	application_watcher & operator=(const application_watcher &) = delete;
+	~application_watcher();
+
+	// Does not block, true if the application changed since the last call
+	bool changed();
+
+	// Executable name, command name and argv[0] of the application, empty if there is none
+	std::vector<std::string> get_names();
+};
+
+} // namespace xrt::drivers::wivrn
@@ -0,0 +1,117 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "os/os_time.h"
+#include "util/u_logging.h"
+#include "utils/metrics.h"
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+namespace xrt::drivers::wivrn
+{
+
+// Bounded queue of items handled by a dedicated thread.
+// When the queue is full, the oldest item is dropped.
+template <typename T>
+class dispatch_queue
+{
+	struct item
+	{
+		T value;
+		int64_t queued;
+	};
+
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::deque<item> items;
+	const size_t capacity;
+	bool closed = false;
+
+	metrics::histogram & delay;
+	metrics::counter & dropped;
+	std::function<void(T &&)> handler;
+	std::thread thread;
+
+	void run(const char * name)
+	{
+		pthread_setname_np(pthread_self(), name);
+		std::unique_lock lock(mutex);
+		while (true)
+		{
+			cv.wait(lock, [this]() { return closed or not items.empty(); });
+			if (closed)
+				return;
+
+			item i = std::move(items.front());
+			items.pop_front();
+			lock.unlock();
+
+			delay.observe((os_monotonic_get_ns() - i.queued) * 1e-9);
+			try
+			{
+				handler(std::move(i.value));
+			}
+			catch (const std::exception & e)
+			{
+				U_LOG_E("Exception in %s thread: %s", name, e.what());
+			}
+			lock.lock();
+		}
+	}
+
+public:
+	// delay measures the time items spend in the queue, dropped counts the items dropped when it is full
+	dispatch_queue(const char * name, size_t capacity, metrics::histogram & delay, metrics::counter & dropped, std::function<void(T &&)> handler) :
+	        capacity(capacity), delay(delay), dropped(dropped), handler(std::move(handler))
+	{
+		thread = std::thread(&dispatch_queue::run, this, name);
+	}
+
+	~dispatch_queue()
+	{
+		{
+			std::lock_guard lock(mutex);
+			closed = true;
+		}
+		cv.notify_all();
+		thread.join();
+	}
+
+	void push(T && value)
+	{
+		{
+			std::lock_guard lock(mutex);
+			if (items.size() >= capacity)
+			{
+				items.pop_front();
+				dropped.add();
+			}
+			items.push_back({std::move(value), int64_t(os_monotonic_get_ns())});
+		}
+		cv.notify_one();
+	}
+};
+
+} // namespace xrt::drivers::wivrn
@@ -0,0 +1,79 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "file_watcher.h"
+
+#include "util/u_logging.h"
+
+#include <cerrno>
+#include <cstring>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+namespace xrt::drivers::wivrn
+{
+
+file_watcher::file_watcher(const std::filesystem::path & path) :
+        filename(path.filename())
+{
+	fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd < 0)
+	{
+		U_LOG_W("Cannot watch %s: %s", path.c_str(), strerror(errno));
+		return;
+	}
+	// Watch the directory: editors often replace the file instead of writing it
+	auto dir = path.parent_path();
+	if (inotify_add_watch(fd, dir.empty() ? "." : dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+	{
+		U_LOG_W("Cannot watch %s: %s", path.c_str(), strerror(errno));
+		close(fd);
+		fd = -1;
+	}
+}
+
+file_watcher::~file_watcher()
+{
+	if (fd >= 0)
+		close(fd);
+}
+
+bool file_watcher::changed()
+{
+	if (fd < 0)
+		return false;
+
+	bool res = false;
+	alignas(inotify_event) char buffer[4096];
+	ssize_t size;
+	while ((size = read(fd, buffer, sizeof(buffer))) > 0)
+	{
+		for (char * ptr = buffer; ptr < buffer + size;)
+		{
+			auto event = reinterpret_cast<const inotify_event *>(ptr);
+			if (event->len and filename == event->name)
+				res = true;
+			ptr += sizeof(inotify_event) + event->len;
+		}
+	}
+	return res;
+}
+
+} // namespace xrt::drivers::wivrn
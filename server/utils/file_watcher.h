@@ -0,0 +1,46 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <filesystem>
+#include <string>
+
+namespace xrt::drivers::wivrn
+{
+
+// Reports modifications of a file, including replacement by rename as done by most editors.
+// The parent directory must exist when the watcher is created.
+class file_watcher
+{
+	int fd = -1;
+	std::string filename;
+
+public:
+	file_watcher(const std::filesystem::path & path);
+	file_watcher(const file_watcher &) = delete;
+	file_watcher & operator=(const file_watcher &) = delete;
+	~file_watcher();
+
+	// Does not block, true if the file was written since the last call
+	bool changed();
+};
+
+} // namespace xrt::drivers::wivrn
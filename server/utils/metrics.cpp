@@ -0,0 +1,246 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "metrics.h"
+
+#include "util/u_logging.h"
+
+#include <algorithm>
+#include <poll.h>
+#include <pthread.h>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+namespace xrt::drivers::wivrn::metrics
+{
+
+namespace
+{
+std::vector<const metric *> & registry()
+{
+	static std::vector<const metric *> metrics;
+	return metrics;
+}
+
+std::string format(double value)
+{
+	char buffer[32];
+	snprintf(buffer, sizeof(buffer), "%.9g", value);
+	return buffer;
+}
+
+void write_header(std::string & out, const char * name, const char * help, const char * type)
+{
+	out += "# HELP ";
+	out += name;
+	out += " ";
+	out += help;
+	out += "\n# TYPE ";
+	out += name;
+	out += " ";
+	out += type;
+	out += "\n";
+}
+} // namespace
+
+// Durations are in seconds
+counter frames_presented("wivrn_frames_presented_total", "Frames submitted to the encoders");
+counter frames_dropped("wivrn_frames_dropped_total", "Frames replaced before an encoder took them");
+counter frames_skipped("wivrn_frames_skipped_total", "Static frames that were not encoded");
+counter frames_bypassed("wivrn_frames_bypassed_total", "Frames converted from the application layer without compositing");
+counter encoder_failovers("wivrn_encoder_failovers_total", "Encoders replaced by another backend because they failed");
+histogram encode_duration("wivrn_encode_duration_seconds", "Time from the start of encoding to the last encoded data, per stream", {0.001, 0.002, 0.004, 0.006, 0.008, 0.011, 0.016, 0.022, 0.033, 0.05});
+histogram conversion_gpu_duration("wivrn_conversion_gpu_duration_seconds", "GPU time of the conversion and copies for the encoders, on the queue shared with the compositor", {1e-4, 2e-4, 5e-4, 1e-3, 1.5e-3, 2e-3, 3e-3, 5e-3, 1e-2, 2e-2});
+gauge swapchain_memory("wivrn_swapchain_memory_bytes", "Device memory of the images the compositor renders to");
+gauge conversion_memory("wivrn_conversion_memory_bytes", "Device memory of the YUV planes of the images that are in use");
+gauge staging_memory("wivrn_staging_memory_bytes", "Host visible buffers used by the encoders to read the images");
+gauge prepared_images("wivrn_prepared_images", "Compositor images with conversion resources, the others were not needed recently");
+counter video_bytes("wivrn_video_bytes_total", "Encoded video bytes sent");
+counter stale_video_bytes("wivrn_stale_video_bytes_total", "Encoded video bytes not sent because their frame was past its display time");
+counter ecn_marked_shards("wivrn_ecn_marked_shards_total", "Video shards the headset received with the Congestion Experienced mark");
+gauge bitrate("wivrn_bitrate_bits_per_second", "Target bitrate of all the encoders");
+gauge resolution_scale("wivrn_resolution_scale", "Factor applied to the stream resolution by dynamic_resolution");
+gauge clock_drift("wivrn_clock_drift_ppm", "Estimated drift of the headset clock");
+gauge clock_uncertainty("wivrn_clock_uncertainty_seconds", "Estimated error of the headset clock offset");
+counter tracking_packets("wivrn_tracking_packets_total", "Tracking packets received");
+counter hand_tracking_packets("wivrn_hand_tracking_packets_total", "Hand tracking packets received");
+histogram tracking_duration("wivrn_tracking_handler_seconds", "Time to handle a tracking packet on the network thread", {1e-6, 2e-6, 5e-6, 1e-5, 2e-5, 5e-5, 1e-4, 2e-4, 5e-4, 1e-3});
+histogram tracking_latency("wivrn_tracking_latency_seconds", "Time from the reception of a tracking packet to its poses being available", {1e-6, 2e-6, 5e-6, 1e-5, 2e-5, 5e-5, 1e-4, 2e-4, 5e-4, 1e-3, 2e-3, 5e-3});
+gauge head_prediction_offset("wivrn_head_prediction_offset_seconds", "How far in the future the headset samples the head pose");
+gauge hand_prediction_offset("wivrn_hand_prediction_offset_seconds", "How far in the future the headset samples the controllers and hands");
+histogram worker_queue_delay("wivrn_worker_queue_delay_seconds", "Time feedback and statistics packets wait before being handled", {1e-5, 5e-5, 1e-4, 2e-4, 5e-4, 1e-3, 2e-3, 5e-3, 1e-2, 5e-2});
+counter worker_queue_dropped("wivrn_worker_queue_dropped_total", "Feedback and statistics packets dropped because the worker queue was full");
+counter feedback_frames_missed("wivrn_feedback_frames_missed_total", "Frames whose feedback was in a lost batch");
+counter headset_frames_skipped("wivrn_headset_frames_skipped_total", "Decoded frames the headset did not display because a newer one was ready");
+counter concealed_frames("wivrn_headset_concealed_frames_total", "Frames the headset decoded with missing slices");
+counter audio_underruns("wivrn_audio_underruns_total", "Microphone periods that could not be filled");
+gauge speaker_latency("wivrn_audio_speaker_latency_seconds", "Speaker samples in the last PipeWire buffer and graph delay, before they are sent");
+gauge microphone_latency("wivrn_audio_microphone_latency_seconds", "Buffered microphone samples, last PipeWire buffer and graph delay");
+gauge headset_speaker_latency("wivrn_headset_speaker_latency_seconds", "Time from the speaker sample timestamps to when the headset plays them");
+gauge headset_output_latency("wivrn_headset_output_latency_seconds", "Buffer and hardware latency of the headset audio output");
+gauge headset_microphone_latency("wivrn_headset_microphone_latency_seconds", "Time from the capture of the microphone samples to when the headset gets them");
+counter headset_audio_xruns("wivrn_headset_audio_xruns_total", "Underruns of the headset audio output");
+gauge headset_gpu_duration("wivrn_headset_gpu_duration_seconds", "Average GPU time of the headset frames, from the last statistics report");
+summary headset_receive_duration("wivrn_headset_receive_duration_seconds", "Time between the first and last packet of the displayed frames");
+summary headset_decode_duration("wivrn_headset_decode_duration_seconds", "Decoding time of the displayed frames");
+summary headset_queue_duration("wivrn_headset_queue_duration_seconds", "Time between decoding and the first headset frame using the image");
+summary headset_display_duration("wivrn_headset_display_duration_seconds", "Time between the start of a headset frame and its predicted display");
+summary headset_render_cpu_duration("wivrn_headset_render_cpu_duration_seconds", "CPU time of the headset render thread per frame");
+summary headset_render_gpu_duration("wivrn_headset_render_gpu_duration_seconds", "GPU time of the headset frames");
+gauge headset_gpu_max_duration("wivrn_headset_gpu_max_duration_seconds", "Longest GPU time of a headset frame, from the last statistics report");
+gauge predicted_present_to_display("wivrn_pacer_predicted_present_to_display_seconds", "Time from present to display used for predictions");
+gauge vsync_phase_error("wivrn_pacer_vsync_phase_error_seconds", "Smoothed distance of the displayed frames to the headset vsync followed by the pacer");
+histogram present_to_display("wivrn_present_to_display_seconds", "Measured time from present to display", {0.01, 0.015, 0.02, 0.025, 0.03, 0.04, 0.05, 0.07, 0.1, 0.15});
+histogram compositor_wakeup_latency("wivrn_compositor_wakeup_latency_seconds", "Delay between the planned and actual wake up of the compositor", {1e-5, 2e-5, 5e-5, 1e-4, 2e-4, 5e-4, 1e-3, 2e-3, 5e-3, 1e-2});
+histogram encoder_wakeup_latency("wivrn_encoder_wakeup_latency_seconds", "Delay between an image handed to an idle encoder thread and the thread running", {1e-5, 2e-5, 5e-5, 1e-4, 2e-4, 5e-4, 1e-3, 2e-3, 5e-3, 1e-2});
+gauge wifi_rssi("wivrn_wifi_rssi_dbm", "Signal strength of the headset Wi-Fi connection");
+gauge wifi_tx_rate("wivrn_wifi_tx_rate_mbps", "Negotiated transmit PHY rate of the headset");
+gauge wifi_rx_rate("wivrn_wifi_rx_rate_mbps", "Negotiated receive PHY rate of the headset, the video direction");
+gauge wifi_frequency("wivrn_wifi_frequency_mhz", "Frequency of the headset Wi-Fi channel");
+
+metric::metric(const char * name, const char * help) :
+        name(name), help(help)
+{
+	// Metrics are global objects, constructed before any thread is started
+	registry().push_back(this);
+}
+
+void counter::write(std::string & out) const
+{
+	write_header(out, name, help, "counter");
+	out += name;
+	out += " " + std::to_string(value.load(std::memory_order_relaxed)) + "\n";
+}
+
+void gauge::write(std::string & out) const
+{
+	write_header(out, name, help, "gauge");
+	out += name;
+	out += " " + format(value.load(std::memory_order_relaxed)) + "\n";
+}
+
+histogram::histogram(const char * name, const char * help, std::initializer_list<double> bounds_) :
+        metric(name, help), bucket_count(bounds_.size())
+{
+	if (bucket_count > max_buckets)
+		throw std::logic_error("too many histogram buckets");
+	std::ranges::copy(bounds_, bounds.begin());
+}
+
+void histogram::observe(double value)
+{
+	auto bucket = std::lower_bound(bounds.begin(), bounds.begin() + bucket_count, value) - bounds.begin();
+	buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+	sum.fetch_add(value, std::memory_order_relaxed);
+}
+
+void histogram::write(std::string & out) const
+{
+	write_header(out, name, help, "histogram");
+	uint64_t count = 0;
+	for (size_t i = 0; i <= bucket_count; ++i)
+	{
+		count += buckets[i].load(std::memory_order_relaxed);
+		out += name;
+		out += "_bucket{le=\"" + (i < bucket_count ? format(bounds[i]) : "+Inf") + "\"} " + std::to_string(count) + "\n";
+	}
+	out += name;
+	out += "_sum " + format(sum.load(std::memory_order_relaxed)) + "\n";
+	out += name;
+	out += "_count " + std::to_string(count) + "\n";
+}
+
+void summary::set(double p50, double p95, double p99, double window_sum, uint64_t window_count)
+{
+	quantiles[0].store(p50, std::memory_order_relaxed);
+	quantiles[1].store(p95, std::memory_order_relaxed);
+	quantiles[2].store(p99, std::memory_order_relaxed);
+	sum.fetch_add(window_sum, std::memory_order_relaxed);
+	count.fetch_add(window_count, std::memory_order_relaxed);
+}
+
+void summary::write(std::string & out) const
+{
+	write_header(out, name, help, "summary");
+	for (size_t i = 0; i < levels.size(); ++i)
+	{
+		out += name;
+		out += std::string("{quantile=\"") + levels[i] + "\"} " + format(quantiles[i].load(std::memory_order_relaxed)) + "\n";
+	}
+	out += name;
+	out += "_sum " + format(sum.load(std::memory_order_relaxed)) + "\n";
+	out += name;
+	out += "_count " + std::to_string(count.load(std::memory_order_relaxed)) + "\n";
+}
+
+exporter::exporter(int port) :
+        listener(port)
+{
+	thread = std::thread(&exporter::run, this);
+	U_LOG_I("Metrics available on port %d", port);
+}
+
+exporter::~exporter()
+{
+	quit = true;
+	thread.join();
+}
+
+void exporter::run()
+{
+	pthread_setname_np(pthread_self(), "metrics");
+	while (not quit)
+	{
+		pollfd pfd{.fd = listener.get_fd(), .events = POLLIN};
+		if (poll(&pfd, 1, 100) <= 0)
+			continue;
+
+		int client = accept(listener.get_fd(), nullptr, nullptr);
+		if (client < 0)
+			continue;
+
+		// Read the request, which is not used: all paths return the metrics
+		timeval timeout{.tv_sec = 1};
+		setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		char request[1024];
+		(void)recv(client, request, sizeof(request), 0);
+
+		std::string body;
+		for (const auto * m: registry())
+			m->write(body);
+
+		std::string response = "HTTP/1.0 200 OK\r\n"
+		                       "Content-Type: text/plain; version=0.0.4\r\n"
+		                       "Content-Length: " +
+		                       std::to_string(body.size()) + "\r\n\r\n" + body;
+		for (size_t sent = 0; sent < response.size();)
+		{
+			ssize_t n = send(client, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+			if (n <= 0)
+				break;
+			sent += n;
+		}
+		::close(client);
+	}
+}
+
+} // namespace xrt::drivers::wivrn::metrics
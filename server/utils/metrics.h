@@ -0,0 +1,202 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <initializer_list>
+#include <string>
+#include <thread>
+
+#include "wivrn_sockets.h"
+
+namespace xrt::drivers::wivrn::metrics
+{
+
+// Metrics are updated with relaxed atomic operations only, so that they can
+// stay enabled: the text format is built when the endpoint is queried.
+class metric
+{
+protected:
+	const char * name;
+	const char * help;
+
+	metric(const char * name, const char * help);
+
+public:
+	virtual void write(std::string & out) const = 0;
+};
+
+class counter : public metric
+{
+	std::atomic<uint64_t> value = 0;
+
+public:
+	counter(const char * name, const char * help) :
+	        metric(name, help) {}
+
+	void add(uint64_t n = 1)
+	{
+		value.fetch_add(n, std::memory_order_relaxed);
+	}
+
+	uint64_t get() const
+	{
+		return value.load(std::memory_order_relaxed);
+	}
+
+	void write(std::string & out) const override;
+};
+
+class gauge : public metric
+{
+	std::atomic<double> value = 0;
+
+public:
+	gauge(const char * name, const char * help) :
+	        metric(name, help) {}
+
+	void set(double v)
+	{
+		value.store(v, std::memory_order_relaxed);
+	}
+
+	double get() const
+	{
+		return value.load(std::memory_order_relaxed);
+	}
+
+	void write(std::string & out) const override;
+};
+
+class histogram : public metric
+{
+	static constexpr size_t max_buckets = 16;
+	std::array<double, max_buckets> bounds;
+	size_t bucket_count;
+	// The last bucket is +Inf
+	std::array<std::atomic<uint64_t>, max_buckets + 1> buckets{};
+	std::atomic<double> sum = 0;
+
+public:
+	histogram(const char * name, const char * help, std::initializer_list<double> bounds);
+
+	void observe(double value);
+
+	void write(std::string & out) const override;
+};
+
+// Quantiles computed elsewhere over a recent window, for the headset statistics.
+// Sum and count are cumulative like in the other metrics.
+class summary : public metric
+{
+	static constexpr std::array<const char *, 3> levels = {"0.5", "0.95", "0.99"};
+	std::array<std::atomic<double>, levels.size()> quantiles{};
+	std::atomic<double> sum = 0;
+	std::atomic<uint64_t> count = 0;
+
+public:
+	summary(const char * name, const char * help) :
+	        metric(name, help) {}
+
+	void set(double p50, double p95, double p99, double window_sum, uint64_t window_count);
+
+	void write(std::string & out) const override;
+};
+
+// Frames
+extern counter frames_presented;
+extern counter frames_dropped;
+extern counter frames_skipped;
+extern counter frames_bypassed;
+extern counter encoder_failovers;
+extern histogram encode_duration;
+extern histogram conversion_gpu_duration;
+// Video memory
+extern gauge swapchain_memory;
+extern gauge conversion_memory;
+extern gauge staging_memory;
+extern gauge prepared_images;
+// Video stream
+extern counter video_bytes;
+extern counter stale_video_bytes;
+extern counter ecn_marked_shards;
+extern gauge bitrate;
+extern gauge resolution_scale;
+// Headset
+extern gauge clock_drift;
+extern gauge clock_uncertainty;
+extern counter tracking_packets;
+extern counter hand_tracking_packets;
+extern histogram tracking_duration;
+extern histogram tracking_latency;
+extern gauge head_prediction_offset;
+extern gauge hand_prediction_offset;
+extern histogram worker_queue_delay;
+extern counter worker_queue_dropped;
+extern counter feedback_frames_missed;
+extern counter headset_frames_skipped;
+extern counter concealed_frames;
+extern counter audio_underruns;
+// Audio
+extern gauge speaker_latency;
+extern gauge microphone_latency;
+extern gauge headset_speaker_latency;
+extern gauge headset_output_latency;
+extern gauge headset_microphone_latency;
+extern counter headset_audio_xruns;
+// Headset rendering
+extern gauge headset_gpu_duration;
+extern gauge headset_gpu_max_duration;
+extern summary headset_receive_duration;
+extern summary headset_decode_duration;
+extern summary headset_queue_duration;
+extern summary headset_display_duration;
+extern summary headset_render_cpu_duration;
+extern summary headset_render_gpu_duration;
+// Pacer
+extern gauge predicted_present_to_display;
+extern gauge vsync_phase_error;
+extern histogram present_to_display;
+// Threads
+extern histogram compositor_wakeup_latency;
+extern histogram encoder_wakeup_latency;
+// Headset Wi-Fi link
+extern gauge wifi_rssi;
+extern gauge wifi_tx_rate;
+extern gauge wifi_rx_rate;
+extern gauge wifi_frequency;
+
+// Serves the metrics in the Prometheus text format over HTTP
+class exporter
+{
+	TCPListener listener;
+	std::atomic<bool> quit = false;
+	std::thread thread;
+
+	void run();
+
+public:
+	exporter(int port);
+	~exporter();
+};
+
+} // namespace xrt::drivers::wivrn::metrics
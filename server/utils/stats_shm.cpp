@@ -0,0 +1,236 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+
+#include "stats_shm.h"
+#include "metrics.h"
+
+#include "os/os_time.h"
+#include "util/u_logging.h"
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <new>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <system_error>
+#include <unistd.h>
+
+namespace xrt::drivers::wivrn
+{
+
+namespace
+{
+template <typename T, typename F>
+void write(stats_shm_layout::section<T> & section, F && f)
+{
+	uint32_t sequence = section.sequence.load(std::memory_order_relaxed);
+	section.sequence.store(sequence + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	f(section.value);
+	section.sequence.store(sequence + 2, std::memory_order_release);
+}
+
+template <typename T>
+struct event_field
+{
+	const char * name;
+	stats_shm_layout::event T::*field;
+};
+
+using compositor_events = stats_shm_layout::compositor_events;
+using stream_events = stats_shm_layout::stream_events;
+using gpu_events = stats_shm_layout::gpu_events;
+
+const event_field<compositor_events> compositor_fields[] = {
+        {"wake_up", &compositor_events::wake_up},
+        {"begin", &compositor_events::begin},
+        {"submit", &compositor_events::submit},
+        {"present", &compositor_events::present},
+        {"tracking_produced", &compositor_events::tracking_produced},
+        {"tracking_received", &compositor_events::tracking_received},
+};
+
+const event_field<stream_events> stream_fields[] = {
+        {"encode_ready", &stream_events::encode_ready},
+        {"encode_begin", &stream_events::encode_begin},
+        {"encode_end", &stream_events::encode_end},
+        {"send_begin", &stream_events::send_begin},
+        {"send_end", &stream_events::send_end},
+        {"receive_begin", &stream_events::receive_begin},
+        {"receive_end", &stream_events::receive_end},
+        {"decode_begin", &stream_events::decode_begin},
+        {"decode_end", &stream_events::decode_end},
+        {"blit", &stream_events::blit},
+        {"display", &stream_events::display},
+        {"encode_skip", &stream_events::encode_skip},
+        {"encode_drop", &stream_events::encode_drop},
+};
+
+const event_field<gpu_events> gpu_fields[] = {
+        {"gpu_render_begin", &gpu_events::render_begin},
+        {"gpu_render_end", &gpu_events::render_end},
+        {"gpu_convert_begin", &gpu_events::convert_begin},
+        {"gpu_convert_end", &gpu_events::convert_end},
+        {"gpu_present_end", &gpu_events::present_end},
+};
+
+template <typename T, size_t N>
+stats_shm_layout::event T::*find(const event_field<T> (&fields)[N], const char * name)
+{
+	for (const auto & f: fields)
+	{
+		if (strcmp(f.name, name) == 0)
+			return f.field;
+	}
+	return nullptr;
+}
+} // namespace
+
+stats_shm::stats_shm(const std::string & name) :
+        name(name)
+{
+	int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		throw std::system_error(errno, std::system_category(), "shm_open");
+
+	if (ftruncate(fd, sizeof(stats_shm_layout)) < 0)
+	{
+		int error = errno;
+		close(fd);
+		shm_unlink(name.c_str());
+		throw std::system_error(error, std::system_category(), "ftruncate");
+	}
+
+	void * addr = mmap(nullptr, sizeof(stats_shm_layout), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED)
+	{
+		shm_unlink(name.c_str());
+		throw std::system_error(errno, std::system_category(), "mmap");
+	}
+
+	// The segment is zero filled, readers check the magic value last
+	layout = new (addr) stats_shm_layout{};
+	layout->version = stats_shm_layout::version_value;
+	layout->size = sizeof(stats_shm_layout);
+	std::atomic_thread_fence(std::memory_order_release);
+	layout->magic = stats_shm_layout::magic_value;
+
+	thread = std::thread(&stats_shm::run, this);
+	U_LOG_I("Statistics published in shared memory %s", name.c_str());
+}
+
+stats_shm::~stats_shm()
+{
+	quit = true;
+	thread.join();
+	munmap(layout, sizeof(stats_shm_layout));
+	shm_unlink(name.c_str());
+}
+
+void stats_shm::run()
+{
+	pthread_setname_np(pthread_self(), "stats_shm");
+	while (not quit)
+	{
+		write(layout->state, [](stats_shm_layout::server_state & state) {
+			state.frames_presented = metrics::frames_presented.get();
+			state.frames_dropped = metrics::frames_dropped.get();
+			state.frames_skipped = metrics::frames_skipped.get();
+			state.video_bytes = metrics::video_bytes.get();
+			state.bitrate = metrics::bitrate.get();
+			state.resolution_scale = metrics::resolution_scale.get();
+			state.predicted_present_to_display = metrics::predicted_present_to_display.get();
+			state.clock_drift = metrics::clock_drift.get();
+			state.clock_uncertainty = metrics::clock_uncertainty.get();
+			state.wifi_rssi = metrics::wifi_rssi.get();
+			state.wifi_rx_rate = metrics::wifi_rx_rate.get();
+		});
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	}
+}
+
+void stats_shm::record(const char * event, uint64_t frame, uint64_t time, uint8_t stream, const char * extra)
+{
+	if (stream == uint8_t(-1))
+	{
+		if (auto field = find(compositor_fields, event))
+		{
+			std::lock_guard lock(compositor_mutex);
+			write(layout->compositor, [&](compositor_events & events) { events.*field = {frame, time}; });
+		}
+		else if (auto field = find(gpu_fields, event))
+		{
+			std::lock_guard lock(gpu_mutex);
+			write(layout->gpu, [&](gpu_events & events) { events.*field = {frame, time}; });
+		}
+		return;
+	}
+
+	if (stream >= stats_shm_layout::max_streams)
+		return;
+
+	if (strcmp(event, "frame_stats") == 0)
+	{
+		// ,type,bytes,slices,qp,encode time
+		char type[4] = {};
+		uint32_t bytes = 0;
+		uint32_t slices = 0;
+		float qp = -1;
+		if (sscanf(extra, ",%3[^,],%" SCNu32 ",%" SCNu32 ",%f", type, &bytes, &slices, &qp) < 3)
+			return;
+		std::lock_guard lock(stream_mutexes[stream]);
+		write(layout->streams[stream], [&](stream_events & events) {
+			events.frame_bytes = bytes;
+			events.slices = slices;
+			events.qp = qp;
+			events.idr = strcmp(type, "idr") == 0;
+		});
+		return;
+	}
+
+	if (strcmp(event, "gpu_copy_end") == 0)
+	{
+		std::lock_guard lock(gpu_mutex);
+		write(layout->gpu, [&](gpu_events & events) { events.copy_end[stream] = {frame, time}; });
+		return;
+	}
+
+	if (auto field = find(stream_fields, event))
+	{
+		std::lock_guard lock(stream_mutexes[stream]);
+		write(layout->streams[stream], [&](stream_events & events) { events.*field = {frame, time}; });
+	}
+}
+
+void stats_shm::set_connected(bool connected)
+{
+	write(layout->connection, [&](stats_shm_layout::connection_state & state) {
+		if (connected and state.since)
+			++state.reconnections;
+		state.connected = connected;
+		state.since = os_monotonic_get_ns();
+	});
+}
+
+} // namespace xrt::drivers::wivrn
@@ -0,0 +1,172 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace xrt::drivers::wivrn
+{
+
+// Layout of the statistics shared memory segment, for external tools.
+// Every section is written with a seqlock: readers load the sequence (acquire), retry while
+// it is odd, copy the value, then check with an acquire fence that the sequence did not change.
+// Fields are only added at the end of a section or of the segment, other changes increase version.
+// Times are CLOCK_MONOTONIC in ns, headset events are converted to the server clock.
+// Streams that are not used keep all their events at 0.
+struct stats_shm_layout
+{
+	static constexpr uint32_t magic_value = 0x54535657; // "WVST"
+	static constexpr uint32_t version_value = 1;
+	static constexpr size_t max_streams = 8;
+
+	template <typename T>
+	struct section
+	{
+		std::atomic<uint32_t> sequence;
+		uint32_t padding;
+		T value;
+	};
+
+	// Latest occurrence of an event, or 0
+	struct event
+	{
+		uint64_t frame;
+		uint64_t time;
+	};
+
+	struct connection_state
+	{
+		// 1 while a headset is connected
+		uint32_t connected;
+		uint32_t reconnections;
+		// When the state last changed
+		uint64_t since;
+	};
+
+	struct compositor_events
+	{
+		event wake_up;
+		event begin;
+		event submit;
+		event present;
+		event tracking_produced;
+		event tracking_received;
+	};
+
+	struct stream_events
+	{
+		event encode_ready;
+		event encode_begin;
+		event encode_end;
+		event send_begin;
+		event send_end;
+		event receive_begin;
+		event receive_end;
+		event decode_begin;
+		event decode_end;
+		event blit;
+		event display;
+		event encode_skip;
+		event encode_drop;
+		// From the last sent frame
+		uint32_t frame_bytes;
+		uint32_t slices;
+		float qp;
+		uint32_t idr;
+	};
+
+	// Work on the GPU queue shared by the compositor and the conversion, with VK_EXT_calibrated_timestamps
+	struct gpu_events
+	{
+		event render_begin;
+		event render_end;
+		event convert_begin;
+		event convert_end;
+		event present_end;
+		// End of the copy to the input of each encoder, when it does not use the conversion output directly
+		std::array<event, max_streams> copy_end;
+	};
+
+	// Values of the metrics of the same name, updated every 100ms
+	struct server_state
+	{
+		uint64_t frames_presented;
+		uint64_t frames_dropped;
+		uint64_t frames_skipped;
+		uint64_t video_bytes;
+		double bitrate;
+		double resolution_scale;
+		double predicted_present_to_display;
+		double clock_drift;
+		double clock_uncertainty;
+		double wifi_rssi;
+		double wifi_rx_rate;
+	};
+
+	uint32_t magic;
+	uint32_t version;
+	// sizeof(stats_shm_layout) of the writer
+	uint32_t size;
+	uint32_t padding;
+	section<connection_state> connection;
+	section<compositor_events> compositor;
+	section<server_state> state;
+	std::array<section<stream_events>, max_streams> streams;
+	section<gpu_events> gpu;
+};
+
+// Writes the statistics to a POSIX shared memory segment, readable by any process of the user.
+// Writers only take a mutex per section, readers never block them.
+class stats_shm
+{
+	std::string name;
+	stats_shm_layout * layout = nullptr;
+
+	std::mutex compositor_mutex;
+	std::mutex gpu_mutex;
+	std::array<std::mutex, stats_shm_layout::max_streams> stream_mutexes;
+
+	std::atomic<bool> quit = false;
+	std::thread thread;
+
+	void run();
+
+public:
+	// name as in shm_open, for instance /wivrn-stats
+	stats_shm(const std::string & name);
+	stats_shm(const stats_shm &) = delete;
+	stats_shm & operator=(const stats_shm &) = delete;
+	~stats_shm();
+
+	// Same arguments as wivrn_session::dump_time, unknown events are ignored
+	void record(const char * event, uint64_t frame, uint64_t time, uint8_t stream, const char * extra);
+
+	// Only called by the session thread
+	void set_connected(bool connected);
+};
+
+} // namespace xrt::drivers::wivrn
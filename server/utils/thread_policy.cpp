@@ -0,0 +1,183 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "thread_policy.h"
+
+#include "driver/configuration.h"
+#include "util/u_logging.h"
+#include "wivrn_config.h"
+
+#include <algorithm>
+#include <cstring>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#ifdef WIVRN_USE_SYSTEMD
+#include <systemd/sd-bus.h>
+#endif
+
+namespace xrt::drivers::wivrn
+{
+
+namespace
+{
+const int64_t log_interval = 10'000'000'000;
+
+const char * role_name(thread_role role)
+{
+	switch (role)
+	{
+		case thread_role::compositor:
+			return "compositor";
+		case thread_role::encoder:
+			return "encoder";
+		case thread_role::session:
+			return "session";
+		case thread_role::audio:
+			return "audio";
+	}
+	return "unknown";
+}
+
+const configuration::thread_policy & role_policy(const configuration & config, thread_role role)
+{
+	switch (role)
+	{
+		case thread_role::compositor:
+			return config.scheduling.compositor;
+		case thread_role::encoder:
+			return config.scheduling.encoder;
+		case thread_role::session:
+			return config.scheduling.session;
+		case thread_role::audio:
+			return config.scheduling.audio;
+	}
+	throw std::invalid_argument("invalid thread role");
+}
+
+// Asks rtkit to make the thread real-time, for users without the permission to do it themselves
+bool make_realtime_rtkit(const char * name, int priority)
+{
+#ifdef WIVRN_USE_SYSTEMD
+	// rtkit only accepts threads with a limited real-time CPU time
+	rlimit limit{};
+	if (getrlimit(RLIMIT_RTTIME, &limit) == 0 and (limit.rlim_max == RLIM_INFINITY or limit.rlim_max > 200'000))
+	{
+		limit.rlim_cur = limit.rlim_max = 200'000;
+		setrlimit(RLIMIT_RTTIME, &limit);
+	}
+
+	sd_bus * bus;
+	if (sd_bus_default_system(&bus) < 0)
+	{
+		U_LOG_W("Failed to connect to system bus, cannot use rtkit for %s thread", name);
+		return false;
+	}
+
+	sd_bus_error error = SD_BUS_ERROR_NULL;
+	int32_t max_priority = 0;
+	if (sd_bus_get_property_trivial(bus, "org.freedesktop.RealtimeKit1", "/org/freedesktop/RealtimeKit1", "org.freedesktop.RealtimeKit1", "MaxRealtimePriority", &error, 'i', &max_priority) >= 0)
+		priority = std::min(priority, max_priority);
+	sd_bus_error_free(&error);
+
+	error = SD_BUS_ERROR_NULL;
+	int res = sd_bus_call_method(bus, "org.freedesktop.RealtimeKit1", "/org/freedesktop/RealtimeKit1", "org.freedesktop.RealtimeKit1", "MakeThreadRealtime", &error, nullptr, "tu", uint64_t(gettid()), uint32_t(priority));
+	if (res < 0)
+		U_LOG_W("rtkit failed to make %s thread real-time: %s", name, error.message ? error.message : strerror(-res));
+	else
+		U_LOG_I("%s thread: real-time priority %d through rtkit", name, priority);
+	sd_bus_error_free(&error);
+	sd_bus_unref(bus);
+	return res >= 0;
+#else
+	U_LOG_W("rtkit requires systemd support, %s thread keeps the default scheduling", name);
+	return false;
+#endif
+}
+} // namespace
+
+void apply_thread_policy(thread_role role)
+{
+	auto config = configuration::read_user_configuration();
+	const auto & policy = role_policy(config, role);
+	const char * name = role_name(role);
+
+	if (not policy.cpus.empty())
+	{
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for (int cpu: policy.cpus)
+		{
+			if (cpu >= 0 and cpu < CPU_SETSIZE)
+				CPU_SET(cpu, &set);
+		}
+		if (int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+			U_LOG_W("Failed to set CPU affinity of %s thread: %s", name, strerror(err));
+	}
+
+	switch (policy.policy)
+	{
+		case configuration::thread_policy::scheduler::other:
+			return;
+
+		case configuration::thread_policy::scheduler::fifo: {
+			sched_param param{
+			        .sched_priority = std::clamp(policy.priority, sched_get_priority_min(SCHED_FIFO), sched_get_priority_max(SCHED_FIFO)),
+			};
+			int err = pthread_setschedparam(pthread_self(), SCHED_FIFO | SCHED_RESET_ON_FORK, &param);
+			if (err == 0)
+			{
+				U_LOG_I("%s thread: SCHED_FIFO priority %d", name, param.sched_priority);
+				return;
+			}
+			U_LOG_W("Failed to set SCHED_FIFO on %s thread: %s, trying rtkit", name, strerror(err));
+			[[fallthrough]];
+		}
+
+		case configuration::thread_policy::scheduler::rtkit:
+			make_realtime_rtkit(name, policy.priority);
+			return;
+	}
+}
+
+void wakeup_latency::add(int64_t expected_ns, int64_t actual_ns)
+{
+	int64_t latency = std::max<int64_t>(0, actual_ns - expected_ns);
+	histogram.observe(latency * 1e-9);
+	sum += latency;
+	max = std::max(max, latency);
+	++count;
+
+	if (actual_ns - last_log < log_interval)
+		return;
+	last_log = actual_ns;
+	U_LOG_D("%s wake up latency over %ld samples: average %.1fµs, max %.1fµs",
+	        name.c_str(),
+	        count,
+	        sum * 1e-3 / count,
+	        max * 1e-3);
+	sum = 0;
+	max = 0;
+	count = 0;
+}
+
+} // namespace xrt::drivers::wivrn
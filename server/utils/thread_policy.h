@@ -0,0 +1,75 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "utils/metrics.h"
+#include "utils/named_thread.h"
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <thread>
+
+namespace xrt::drivers::wivrn
+{
+
+enum class thread_role
+{
+	compositor,
+	encoder,
+	session,
+	audio,
+};
+
+// Applies the scheduling policy and CPU affinity configured for the role to the calling thread
+void apply_thread_policy(thread_role role);
+
+// Starts a named thread, which applies the policy of the role before calling f
+template <typename F, typename... Args>
+std::thread role_thread(thread_role role, const std::string & name, F && f, Args &&... args)
+{
+	return utils::named_thread(
+	        name,
+	        [role, f = std::forward<F>(f), ... args = std::forward<Args>(args)]() mutable {
+		        apply_thread_policy(role);
+		        std::invoke(std::move(f), std::move(args)...);
+	        });
+}
+
+// Delay between the time a thread should run and the time it actually wakes up,
+// exported to a histogram and logged every 10 seconds
+class wakeup_latency
+{
+	std::string name;
+	metrics::histogram & histogram;
+	int64_t sum = 0;
+	int64_t max = 0;
+	int64_t count = 0;
+	int64_t last_log = 0;
+
+public:
+	wakeup_latency(std::string name, metrics::histogram & histogram) :
+	        name(std::move(name)), histogram(histogram) {}
+
+	void add(int64_t expected_ns, int64_t actual_ns);
+};
+
+} // namespace xrt::drivers::wivrn
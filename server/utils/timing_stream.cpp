@@ -0,0 +1,172 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "timing_stream.h"
+
+#include "util/u_logging.h"
+
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace xrt::drivers::wivrn
+{
+
+namespace
+{
+// Headset events arrive with the feedback packets, after the frame is displayed
+constexpr uint64_t frame_timeout_ns = 1'000'000'000;
+// Frames kept for a client that does not read them
+constexpr size_t max_pending = 1024 * 1024;
+
+void append_events(std::string & json, const std::map<std::string, uint64_t> & events)
+{
+	json += "{";
+	const char * separator = "";
+	for (const auto & [name, time]: events)
+	{
+		json += separator;
+		json += "\"" + name + "\":" + std::to_string(time);
+		separator = ",";
+	}
+	json += "}";
+}
+} // namespace
+
+timing_stream::timing_stream(int port) :
+        listener(port)
+{
+	U_LOG_I("Live timings available on port %d", port);
+}
+
+timing_stream::~timing_stream()
+{
+	for (auto & c: clients)
+		::close(c.fd);
+}
+
+void timing_stream::accept_clients()
+{
+	while (true)
+	{
+		pollfd pfd{.fd = listener.get_fd(), .events = POLLIN};
+		if (poll(&pfd, 1, 0) <= 0)
+			return;
+
+		int fd = accept(listener.get_fd(), nullptr, nullptr);
+		if (fd < 0)
+			return;
+
+		// Read the request, which is not used: all paths return the event stream
+		timeval timeout{.tv_usec = 100'000};
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		char request[1024];
+		(void)recv(fd, request, sizeof(request), 0);
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+		// timings.html is usually opened from a file, allow any origin
+		clients.push_back({
+		        .fd = fd,
+		        .pending = "HTTP/1.1 200 OK\r\n"
+		                   "Content-Type: text/event-stream\r\n"
+		                   "Cache-Control: no-cache\r\n"
+		                   "Access-Control-Allow-Origin: *\r\n\r\n",
+		});
+	}
+}
+
+void timing_stream::send(const std::string & message)
+{
+	for (auto it = clients.begin(); it != clients.end();)
+	{
+		auto & c = *it;
+		c.pending += message;
+		while (not c.pending.empty())
+		{
+			ssize_t n = ::send(c.fd, c.pending.data(), c.pending.size(), MSG_NOSIGNAL);
+			if (n <= 0)
+				break;
+			c.pending.erase(0, n);
+		}
+
+		bool closed = not c.pending.empty() and errno != EAGAIN and errno != EWOULDBLOCK;
+		if (closed or c.pending.size() > max_pending)
+		{
+			::close(c.fd);
+			it = clients.erase(it);
+		}
+		else
+			++it;
+	}
+}
+
+void timing_stream::add(const char * event, uint64_t frame_index, uint64_t time, uint8_t stream)
+{
+	// Statistics are not attached to a frame
+	if (not time or not strcmp(event, "network_stats") or not strcmp(event, "wifi_link") or not strcmp(event, "headset_gpu"))
+		return;
+	last_event = std::max(last_event, time);
+
+	auto [it, inserted] = frames.try_emplace(frame_index);
+	auto & f = it->second;
+	if (inserted)
+		f.first_event = time;
+	else
+		f.first_event = std::min(f.first_event, time);
+
+	if (stream == 255)
+		f.global[event] = time;
+	else
+		f.streams[stream][event] = time;
+}
+
+void timing_stream::flush()
+{
+	accept_clients();
+
+	std::string message;
+	for (auto it = frames.begin(); it != frames.end();)
+	{
+		const auto & [index, f] = *it;
+		if (f.first_event + frame_timeout_ns > last_event)
+		{
+			++it;
+			continue;
+		}
+
+		// Same structure as the data built from the csv by timings.js
+		message += "data: {\"frame\":" + std::to_string(index) + ",\"global\":";
+		append_events(message, f.global);
+		for (const auto & [stream, events]: f.streams)
+		{
+			message += ",\"stream-" + std::to_string(stream) + "\":";
+			append_events(message, events);
+		}
+		message += "}\n\n";
+		it = frames.erase(it);
+	}
+
+	if (not message.empty() or not clients.empty())
+		send(message);
+}
+
+} // namespace xrt::drivers::wivrn
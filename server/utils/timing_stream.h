@@ -0,0 +1,69 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "wivrn_sockets.h"
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace xrt::drivers::wivrn
+{
+
+// Streams the timing events grouped by frame as Server-Sent Events, for the live
+// view of tools/timings.html. Frames are sent once they are complete, when their
+// first event is older than the headset events can be.
+class timing_stream
+{
+	struct client
+	{
+		int fd;
+		// Data not accepted yet by the socket
+		std::string pending;
+	};
+
+	struct frame
+	{
+		uint64_t first_event;
+		std::map<std::string, uint64_t> global;
+		std::map<uint8_t, std::map<std::string, uint64_t>> streams;
+	};
+
+	TCPListener listener;
+	std::vector<client> clients;
+	std::map<uint64_t, frame> frames;
+	uint64_t last_event = 0;
+
+	void accept_clients();
+	void send(const std::string & message);
+
+public:
+	timing_stream(int port);
+	~timing_stream();
+
+	void add(const char * event, uint64_t frame, uint64_t time, uint8_t stream);
+	// Sends the complete frames
+	void flush();
+};
+
+} // namespace xrt::drivers::wivrn
@@ -0,0 +1,150 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "timing_tracer.h"
+#include "timing_stream.h"
+
+#include "util/u_logging.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iomanip>
+
+namespace xrt::drivers::wivrn
+{
+
+static std::atomic<uint64_t> next_id = 0;
+
+timing_tracer::timing_tracer(const std::optional<std::filesystem::path> & path, std::optional<int> live_port) :
+        id(next_id++)
+{
+	if (path)
+		file.open(*path);
+	if (live_port)
+	{
+		try
+		{
+			live = std::make_unique<timing_stream>(*live_port);
+		}
+		catch (const std::exception & e)
+		{
+			U_LOG_E("Failed to start live timings on port %d: %s", *live_port, e.what());
+		}
+	}
+	writer = std::thread(&timing_tracer::run, this);
+}
+
+timing_tracer::~timing_tracer()
+{
+	quit = true;
+	writer.join();
+}
+
+timing_tracer::ring & timing_tracer::local_ring()
+{
+	// The tracer id avoids using the ring of a destroyed tracer
+	thread_local uint64_t ring_owner = -1;
+	thread_local ring * local = nullptr;
+
+	if (ring_owner != id)
+	{
+		std::lock_guard lock(rings_mutex);
+		local = rings.emplace_back(std::make_unique<ring>()).get();
+		ring_owner = id;
+	}
+	return *local;
+}
+
+void timing_tracer::record(const char * name, uint64_t frame, uint64_t time, uint8_t stream, const char * extra)
+{
+	auto & r = local_ring();
+	size_t head = r.head.load(std::memory_order_relaxed);
+	if (head - r.tail.load(std::memory_order_acquire) >= ring::size)
+	{
+		r.dropped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	event & e = r.events[head % ring::size];
+	e.name = name;
+	e.frame = frame;
+	e.time = time;
+	e.stream = stream;
+	size_t length = strlen(extra);
+	if (length >= sizeof(e.extra))
+	{
+		r.truncated.fetch_add(1, std::memory_order_relaxed);
+		length = sizeof(e.extra) - 1;
+	}
+	memcpy(e.extra, extra, length);
+	e.extra[length] = 0;
+	r.head.store(head + 1, std::memory_order_release);
+}
+
+void timing_tracer::write_events()
+{
+	std::vector<event> events;
+	size_t dropped = 0;
+	size_t truncated = 0;
+	{
+		std::lock_guard lock(rings_mutex);
+		for (auto & r: rings)
+		{
+			size_t tail = r->tail.load(std::memory_order_relaxed);
+			size_t head = r->head.load(std::memory_order_acquire);
+			for (; tail != head; ++tail)
+				events.push_back(r->events[tail % ring::size]);
+			r->tail.store(tail, std::memory_order_release);
+			dropped += r->dropped.exchange(0, std::memory_order_relaxed);
+			truncated += r->truncated.exchange(0, std::memory_order_relaxed);
+		}
+	}
+
+	if (dropped)
+		U_LOG_W("Timing dump: %zu events dropped", dropped);
+	if (truncated)
+		U_LOG_W("Timing dump: %zu events with truncated columns", truncated);
+
+	std::ranges::sort(events, {}, &event::time);
+	if (file.is_open())
+	{
+		for (const auto & e: events)
+			file << std::quoted(e.name) << "," << e.frame << "," << e.time << "," << (int)e.stream << e.extra << "\n";
+		file.flush();
+	}
+
+	if (live)
+	{
+		for (const auto & e: events)
+			live->add(e.name, e.frame, e.time, e.stream);
+		live->flush();
+	}
+}
+
+void timing_tracer::run()
+{
+	while (not quit)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		write_events();
+	}
+	write_events();
+}
+
+} // namespace xrt::drivers::wivrn
@@ -0,0 +1,91 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+namespace xrt::drivers::wivrn
+{
+
+class timing_stream;
+
+// Records timing events without blocking the threads being measured: each thread
+// writes fixed size events in its own ring buffer, which a background thread
+// drains to the file in the WIVRN_DUMP_TIMINGS csv format and to the live stream.
+class timing_tracer
+{
+public:
+	struct event
+	{
+		// Must have static storage duration
+		const char * name;
+		uint64_t frame;
+		uint64_t time;
+		uint8_t stream;
+		// Additional csv columns, truncated: the longest, headset_gpu, has 8 numbers
+		char extra[111];
+	};
+
+private:
+	// Single producer, single consumer
+	struct ring
+	{
+		static constexpr size_t size = 4096;
+		std::array<event, size> events;
+		std::atomic<size_t> head = 0;
+		std::atomic<size_t> tail = 0;
+		// Events dropped because the ring was full
+		std::atomic<size_t> dropped = 0;
+		// Events with truncated extra columns
+		std::atomic<size_t> truncated = 0;
+	};
+
+	const uint64_t id;
+	std::mutex rings_mutex;
+	// Rings are only freed with the tracer, threads may exit before their events are written
+	std::vector<std::unique_ptr<ring>> rings;
+
+	std::ofstream file;
+	std::unique_ptr<timing_stream> live;
+	std::atomic<bool> quit = false;
+	std::thread writer;
+
+	ring & local_ring();
+	void write_events();
+	void run();
+
+public:
+	// Either may be unset
+	timing_tracer(const std::optional<std::filesystem::path> & file, std::optional<int> live_port);
+	~timing_tracer();
+
+	void record(const char * name, uint64_t frame, uint64_t time, uint8_t stream, const char * extra);
+};
+
+} // namespace xrt::drivers::wivrn
@@ -21,20 +21,49 @@
 
 #include "wivrn_vk_bundle.h"
 
+#include "util/u_logging.h"
+#include "utils/xdg_base_directory.h"
+#include "vk/pipeline_cache.h"
+
+#include <algorithm>
+#include <cinttypes>
 #include <string>
 
+static std::filesystem::path pipeline_cache_path()
+{
+	return xdg_cache_home() / "wivrn" / "pipeline_cache";
+}
+
+// VK_EXT_memory_budget is in the optional extensions given to monado
+static VmaAllocatorCreateFlags allocator_flags(vk::raii::PhysicalDevice & physical_device, std::span<const char *> requested_device_extensions)
+{
+#ifdef VK_EXT_memory_budget
+	bool requested = std::ranges::any_of(requested_device_extensions, [](const char * ext) {
+		return std::string(ext) == VK_EXT_MEMORY_BUDGET_EXTENSION_NAME;
+	});
+	bool available = std::ranges::any_of(physical_device.enumerateDeviceExtensionProperties(), [](const vk::ExtensionProperties & ext) {
+		return std::string(ext.extensionName) == VK_EXT_MEMORY_BUDGET_EXTENSION_NAME;
+	});
+	if (requested and available)
+		return VMA_ALLOCATOR_CREATE_EXT_MEMORY_BUDGET_BIT;
+#endif
+	return {};
+}
+
 wivrn_vk_bundle::wivrn_vk_bundle(vk_bundle & vk, std::span<const char *> requested_instance_extensions, std::span<const char *> requested_device_extensions) :
         instance(vk_ctx, vk.instance),
         physical_device(instance, vk.physical_device),
         device(physical_device, vk.device),
         allocator({
+                .flags = allocator_flags(physical_device, requested_device_extensions),
                 .physicalDevice = vk.physical_device,
                 .device = vk.device,
                 .instance = vk.instance,
                 .vulkanApiVersion = VK_MAKE_VERSION(1, 3, 0), // FIXME: sync with wivrn_session.cpp
         }),
         queue(device, vk.queue_family_index, vk.queue_index),
-        queue_family_index(vk.queue_family_index)
+        queue_family_index(vk.queue_family_index),
+        queue_mutex(vk.queue_mutex)
 {
 	// This is manually synced with monado code
 
@@ -144,6 +173,56 @@ wivrn_vk_bundle::wivrn_vk_bundle(vk_bundle & vk, std::span<const char *> request
 			}
 		}
 	}
+
+	// Optional device extensions are enabled by monado when available
+	bool has_video_encode = std::ranges::any_of(device_extensions, [](const char * ext) {
+		return std::string(ext) == VK_KHR_VIDEO_ENCODE_H265_EXTENSION_NAME;
+	});
+	if (has_video_encode)
+	{
+		auto queue_families = physical_device.getQueueFamilyProperties2<vk::StructureChain<vk::QueueFamilyProperties2, vk::QueueFamilyVideoPropertiesKHR>>();
+		if (queue_family_index < queue_families.size())
+		{
+			const auto & [props, video_props] = queue_families[queue_family_index].get<vk::QueueFamilyProperties2, vk::QueueFamilyVideoPropertiesKHR>();
+			if ((props.queueFamilyProperties.queueFlags & vk::QueueFlagBits::eVideoEncodeKHR) and
+			    (video_props.videoCodecOperations & vk::VideoCodecOperationFlagBitsKHR::eEncodeH265))
+			{
+				encode_queue = vk::raii::Queue(device, vk.queue_family_index, vk.queue_index);
+				encode_queue_family_index = queue_family_index;
+			}
+		}
+	}
+
+	vk::PipelineCacheCreateInfo pipeline_cache_info;
+	std::vector<std::byte> pipeline_cache_bytes = read_pipeline_cache(pipeline_cache_path(), physical_device.getProperties());
+	if (pipeline_cache_bytes.empty())
+		U_LOG_I("No valid pipeline cache for this device");
+	else
+		pipeline_cache_info.setInitialData<std::byte>(pipeline_cache_bytes);
+	pipeline_cache = vk::raii::PipelineCache(device, pipeline_cache_info);
+}
+
+wivrn_vk_bundle::~wivrn_vk_bundle()
+{
+	auto report = allocator.get_report();
+	for (size_t index = 0; index < report.heaps.size(); index++)
+	{
+		const auto & heap = report.heaps[index];
+		if (heap.allocations)
+			U_LOG_I("Memory heap %zu: %" PRIu64 "MB allocated in %u allocations, %" PRIu64 "MB/%" PRIu64 "MB used", index, heap.allocated >> 20, heap.allocations, heap.usage >> 20, heap.budget >> 20);
+	}
+	if (report.over_budget_allocations)
+		U_LOG_W("%" PRIu64 " allocations exceeded the memory budget", report.over_budget_allocations);
+
+	try
+	{
+		std::filesystem::create_directories(pipeline_cache_path().parent_path());
+		write_pipeline_cache(pipeline_cache_path(), physical_device.getProperties(), pipeline_cache.getData());
+	}
+	catch (std::exception & e)
+	{
+		U_LOG_W("Cannot save pipeline cache: %s", e.what());
+	}
 }
 
 uint32_t wivrn_vk_bundle::get_memory_type(uint32_t type_bits, vk::MemoryPropertyFlags memory_props)
@@ -19,6 +19,7 @@
 
 #pragma once
 
+#include "os/os_threading.h"
 #include "vk/vk_allocator.h"
 #include <cstdint>
 #include <span>
@@ -59,11 +60,20 @@ struct wivrn_vk_bundle
 	vk_allocator allocator;
 	vk::raii::Queue queue;
 	uint32_t queue_family_index;
+	// Loaded from and saved to the XDG cache directory
+	vk::raii::PipelineCache pipeline_cache = nullptr;
+	// Monado only creates one queue, shared by all submissions
+	os_mutex & queue_mutex;
+
+	// Same queue as above if its family supports video encode, else null
+	vk::raii::Queue encode_queue = nullptr;
+	uint32_t encode_queue_family_index = VK_QUEUE_FAMILY_IGNORED;
 
 	std::vector<const char *> instance_extensions;
 	std::vector<const char *> device_extensions;
 
 	wivrn_vk_bundle(vk_bundle & vk, std::span<const char *> requested_instance_extensions, std::span<const char *> requested_device_extensions);
+	~wivrn_vk_bundle();
 
 	uint32_t get_memory_type(uint32_t type_bits, vk::MemoryPropertyFlags memory_props);
 };
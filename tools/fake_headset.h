@@ -0,0 +1,325 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "wivrn_packets.h"
+#include "wivrn_sockets.h"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <optional>
+#include <poll.h>
+#include <random>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <vector>
+
+// Connects to a server like a headset does, for the tools that stand in for a headset
+
+namespace xrt::drivers::wivrn
+{
+using namespace std::chrono_literals;
+
+inline int64_t now()
+{
+	return std::chrono::steady_clock::now().time_since_epoch().count();
+}
+
+// Impairments of the stream socket, like netem on the network interface of the headset
+struct link_shaping
+{
+	// Fraction of the datagrams that are lost, in each direction
+	double loss = 0;
+	// Average number of consecutive lost datagrams
+	double loss_burst = 1;
+	// Added to the reception of each datagram from the server
+	std::chrono::microseconds delay{};
+	// Maximum random variation of the delay, datagrams stay in order
+	std::chrono::microseconds jitter{};
+
+	bool active() const
+	{
+		return loss > 0 or delay.count() > 0 or jitter.count() > 0;
+	}
+};
+
+// Gilbert model of the losses: every datagram is lost in the bad state,
+// the average time in the bad state is loss_burst datagrams
+class link_shaper
+{
+	link_shaping params;
+	std::mt19937_64 rng;
+	bool bad = false;
+	int64_t last_release = 0;
+
+public:
+	link_shaper(const link_shaping & params = {}, uint64_t seed = 0) :
+	        params(params), rng(seed) {}
+
+	bool active() const
+	{
+		return params.active();
+	}
+
+	bool lose()
+	{
+		if (params.loss <= 0)
+			return false;
+		double leave_bad = 1 / std::max(params.loss_burst, 1.);
+		double enter_bad = std::min(1., params.loss * leave_bad / std::max(1 - params.loss, 1e-6));
+		bad = std::bernoulli_distribution(bad ? 1 - leave_bad : enter_bad)(rng);
+		return bad;
+	}
+
+	// Time at which a datagram received at t is given to the application
+	int64_t release_time(int64_t t)
+	{
+		int64_t delay = std::chrono::nanoseconds(params.delay).count();
+		if (params.jitter.count() > 0)
+		{
+			int64_t jitter = std::chrono::nanoseconds(params.jitter).count();
+			delay += std::uniform_int_distribution<int64_t>(-jitter, jitter)(rng);
+		}
+		last_release = std::max(last_release, t + std::max<int64_t>(delay, 0));
+		return last_release;
+	}
+};
+
+class fake_headset
+{
+	typed_socket<TCP, to_headset::packets, from_headset::packets> control;
+	typed_socket<UDP, to_headset::packets, from_headset::packets> stream{-1};
+	// Last full frame index by stream
+	std::map<uint8_t, uint64_t> frame_indices;
+
+	link_shaper downlink;
+	link_shaper uplink;
+	// Datagrams from the server with the time they are released by the shaping
+	std::deque<std::pair<int64_t, to_headset::packets>> delayed;
+
+public:
+	uint64_t shards = 0;
+	uint64_t shard_bytes = 0;
+	uint64_t parity_shards = 0;
+	// Datagrams dropped by the link shaping
+	uint64_t shaped_downlink_losses = 0;
+	uint64_t shaped_uplink_losses = 0;
+	std::set<std::pair<uint8_t, uint64_t>> frames;
+
+	fake_headset(in6_addr address, int port) :
+	        control(address, port)
+	{
+		// Same sequence as the headset: server handshake on the control socket,
+		// ours on the stream socket, then the second server handshake
+		auto handshake = wait_for<to_headset::handshake>(5s);
+		if (handshake.stream_port > 0)
+		{
+			stream = decltype(stream)();
+			stream.connect(address, handshake.stream_port);
+			stream.set_receive_buffer_size(5 * 1024 * 1024);
+		}
+
+		auto deadline = std::chrono::steady_clock::now() + 5s;
+		while (true)
+		{
+			send(from_headset::handshake{});
+			if (std::chrono::steady_clock::now() > deadline)
+				throw std::runtime_error("Failed to establish connection");
+			bool received = false;
+			poll([&](auto && packet) {
+				if constexpr (std::is_same_v<std::remove_cvref_t<decltype(packet)>, to_headset::handshake>)
+					received = true;
+			},
+			     100);
+			if (received)
+				break;
+		}
+	}
+
+	// Only applies to the stream socket, once the connection is established.
+	// Over TCP, the kernel would retransmit the lost segments: the control socket is not shaped
+	void set_shaping(const link_shaping & shaping, uint64_t seed = 0)
+	{
+		downlink = link_shaper(shaping, seed);
+		uplink = link_shaper(shaping, seed + 1);
+	}
+
+	template <typename T>
+	void send(T && packet)
+	{
+		if (stream)
+		{
+			if (uplink.lose())
+			{
+				++shaped_uplink_losses;
+				return;
+			}
+			stream.send(std::forward<T>(packet));
+		}
+		else
+			control.send(std::forward<T>(packet));
+	}
+
+	template <typename T>
+	void send_control(T && packet)
+	{
+		control.send(std::forward<T>(packet));
+	}
+
+	template <typename T>
+	T wait_for(std::chrono::milliseconds timeout)
+	{
+		auto deadline = std::chrono::steady_clock::now() + timeout;
+		while (std::chrono::steady_clock::now() < deadline)
+		{
+			std::optional<T> res;
+			poll([&](auto && packet) {
+				if constexpr (std::is_same_v<std::remove_cvref_t<decltype(packet)>, T>)
+					res = packet;
+			},
+			     100);
+			if (res)
+				return *res;
+		}
+		throw std::runtime_error("Timeout waiting for server");
+	}
+
+	template <typename T>
+	void poll(T && visitor, int timeout_ms)
+	{
+		pollfd fds[2] = {};
+		fds[0].events = POLLIN;
+		fds[0].fd = stream.get_fd();
+		fds[1].events = POLLIN;
+		fds[1].fd = control.get_fd();
+
+		// Wake up for the next delayed datagram
+		if (not delayed.empty())
+		{
+			int64_t until = std::max<int64_t>(0, (delayed.front().first - now() + 999'999) / 1'000'000);
+			if (timeout_ms < 0 or until < timeout_ms)
+				timeout_ms = until;
+		}
+
+		if (::poll(fds, std::size(fds), timeout_ms) < 0)
+			throw std::system_error(errno, std::system_category());
+
+		if (fds[1].revents & (POLLHUP | POLLERR))
+			throw std::runtime_error("Error on control socket");
+
+		thread_local std::vector<to_headset::packets> packets;
+		packets.clear();
+		if (fds[0].revents & POLLIN)
+			stream.receive_many(packets);
+
+		if (downlink.active())
+		{
+			int64_t t = now();
+			for (auto & packet: packets)
+			{
+				if (downlink.lose())
+					++shaped_downlink_losses;
+				else
+					delayed.emplace_back(downlink.release_time(t), std::move(packet));
+			}
+			packets.clear();
+			while (not delayed.empty() and delayed.front().first <= t)
+			{
+				packets.push_back(std::move(delayed.front().second));
+				delayed.pop_front();
+			}
+		}
+
+		if (fds[1].revents & POLLIN)
+		{
+			if (auto packet = control.receive())
+				packets.push_back(std::move(*packet));
+		}
+
+		for (auto & packet: packets)
+			std::visit(visitor, std::move(packet));
+	}
+
+	// Handles the packets the server sends during the stream, on_shard is
+	// called for each video shard after it has been counted, and for each
+	// parity shard if it accepts them
+	template <typename F>
+	void handle_packets(int timeout_ms, F && on_shard)
+	{
+		poll([&](auto && packet) {
+			using T = std::remove_cvref_t<decltype(packet)>;
+			if constexpr (std::is_same_v<T, to_headset::timesync_query>)
+			{
+				send(from_headset::timesync_response{.query = packet.query, .response = now()});
+			}
+			else if constexpr (std::is_same_v<T, to_headset::video_stream_data_shard>)
+			{
+				// Only the first shard of a frame has the full index
+				auto & frame_index = frame_indices[packet.stream_item_idx];
+				if (packet.shard_idx == 0)
+					frame_index = packet.frame_idx;
+				else
+					packet.frame_idx = to_headset::extend_frame_index(packet.frame_idx, frame_index);
+				++shards;
+				shard_bytes += packet.payload.size();
+				frames.emplace(packet.stream_item_idx, packet.frame_idx);
+				on_shard(packet);
+			}
+			else if constexpr (std::is_same_v<T, to_headset::video_stream_parity_shard>)
+			{
+				// Parity shards have the full frame index
+				++parity_shards;
+				if constexpr (std::is_invocable_v<F &, const to_headset::video_stream_parity_shard &>)
+					on_shard(packet);
+			}
+		},
+		     timeout_ms);
+	}
+
+	void handle_packets(int timeout_ms)
+	{
+		handle_packets(timeout_ms, [](const to_headset::video_stream_data_shard &) {});
+	}
+};
+
+// Parses an IPv4 or IPv6 address, IPv4 addresses are mapped to IPv6
+inline std::optional<in6_addr> parse_address(const std::string & host)
+{
+	in6_addr address;
+	in_addr address4;
+	if (inet_pton(AF_INET, host.c_str(), &address4) == 1)
+	{
+		address = {};
+		address.s6_addr[10] = address.s6_addr[11] = 0xff;
+		memcpy(&address.s6_addr[12], &address4, sizeof(address4));
+		return address;
+	}
+	if (inet_pton(AF_INET6, host.c_str(), &address) == 1)
+		return address;
+	return std::nullopt;
+}
+} // namespace xrt::drivers::wivrn
@@ -0,0 +1,89 @@
+#!/usr/bin/env python3
+
+# Adds block compressed KTX2 versions of the images of a glTF file, with
+# precomputed mipmaps, so that the headset does not decode and upload RGBA8
+# images at startup. The original images are kept as a fallback for the
+# devices that do not support the compressed format.
+#
+# The KTX2 images are referenced with the KHR_texture_basisu extension, like
+# assets/ground.gltf, which is what the client looks for first.
+# Requires toktx from KTX-Software 4.x.
+
+import argparse
+import json
+import os
+import subprocess
+
+FORMATS = {
+    "astc": ["--encode", "astc", "--astc_blk_d"],
+    "uastc": ["--encode", "uastc"],
+    "etc1s": ["--encode", "etc1s"],
+}
+
+
+def srgb_textures(gltf):
+    # Only the base color and emissive textures contain colors
+    res = set()
+    for material in gltf.get("materials", []):
+        for texture in (material.get("pbrMetallicRoughness", {}).get("baseColorTexture"), material.get("emissiveTexture")):
+            if texture is not None:
+                res.add(texture["index"])
+    return res
+
+
+def compress(source, destination, srgb, encoding, block_size):
+    command = ["toktx", "--t2", "--genmipmap", "--assign_oetf", "srgb" if srgb else "linear"]
+    command += FORMATS[encoding]
+    if encoding == "astc":
+        command.append(block_size)
+    command += [destination, source]
+    subprocess.run(command, check=True)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Add compressed KTX2 images to a glTF file")
+    parser.add_argument("input", help="glTF file, the images must be external files")
+    parser.add_argument("--output", help="output glTF file, default to overwriting the input")
+    parser.add_argument("--encoding", choices=FORMATS.keys(), default="astc")
+    parser.add_argument("--block-size", default="6x6", help="ASTC block size")
+    parser.add_argument("--force", action="store_true", help="recompress the images that already have a KTX2 version")
+    args = parser.parse_args()
+
+    directory = os.path.dirname(os.path.abspath(args.input))
+    with open(args.input) as file:
+        gltf = json.load(file)
+
+    srgb = srgb_textures(gltf)
+    images = gltf.setdefault("images", [])
+    compressed = dict()
+
+    for index, texture in enumerate(gltf.get("textures", [])):
+        extensions = texture.setdefault("extensions", {})
+        if "KHR_texture_basisu" in extensions and not args.force:
+            continue
+        if "source" not in texture or "uri" not in images[texture["source"]]:
+            print(f"Skipping texture {index}: no external image")
+            continue
+
+        uri = images[texture["source"]]["uri"]
+        key = (uri, index in srgb)
+        if key not in compressed:
+            name = os.path.splitext(uri)[0] + ("" if index in srgb else "_linear") + ".ktx2"
+            compress(os.path.join(directory, uri), os.path.join(directory, name), index in srgb, args.encoding, args.block_size)
+            images.append({"uri": name})
+            compressed[key] = len(images) - 1
+            print(f"{uri} -> {name}: {os.path.getsize(os.path.join(directory, uri))} -> {os.path.getsize(os.path.join(directory, name))} bytes")
+
+        extensions["KHR_texture_basisu"] = {"source": compressed[key]}
+
+    if compressed:
+        used = gltf.setdefault("extensionsUsed", [])
+        if "KHR_texture_basisu" not in used:
+            used.append("KHR_texture_basisu")
+
+    with open(args.output or args.input, "w") as file:
+        json.dump(gltf, file, indent=2)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,457 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "fake_headset.h"
+#include "wivrn_quantization.h"
+
+#include <CLI/CLI.hpp>
+
+#include <algorithm>
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <map>
+#include <thread>
+#include <vector>
+
+// Synthetic headset for server load tests: it announces a fake headset,
+// sends generated tracking at a fixed rate and acknowledges the frames it
+// receives without decoding them. The stream socket can be impaired like
+// a lossy Wi-Fi link, see link_shaping.
+
+using namespace xrt::drivers::wivrn;
+
+namespace
+{
+template <class... Ts>
+struct overloaded : Ts...
+{
+	using Ts::operator()...;
+};
+template <class... Ts>
+overloaded(Ts...) -> overloaded<Ts...>;
+
+enum class motion
+{
+	still,
+	slow,
+	fast,
+};
+
+struct options
+{
+	uint32_t eye_width = 1832;
+	uint32_t eye_height = 1920;
+	float refresh_rate = 90;
+	float tracking_rate = 90;
+	std::vector<video_codec> codecs{h264, h265};
+	bool feedback = true;
+	motion movement = motion::slow;
+	link_shaping shaping;
+	// Report one received frame out of n as lost, 0 to report them all as decoded
+	uint32_t lost_frame_interval = 0;
+};
+
+struct results
+{
+	int instance;
+	bool connected = false;
+	std::string error;
+	uint64_t tracking_sent = 0;
+	uint64_t shards = 0;
+	uint64_t bytes = 0;
+	uint64_t parity_shards = 0;
+	uint64_t frames = 0;
+	uint64_t late_frames = 0;
+	// Frames with missing shards that the parity could not restore
+	uint64_t dropped_frames = 0;
+	// Received frames reported as lost because of lost_frame_interval
+	uint64_t reported_lost = 0;
+	uint64_t shaped_downlink_losses = 0;
+	uint64_t shaped_uplink_losses = 0;
+	// encode_begin to reception of the last shard, in headset clock
+	std::vector<int64_t> latencies;
+	double duration = 0;
+};
+
+const XrFovf fov{
+        .angleLeft = -0.87f,
+        .angleRight = 0.87f,
+        .angleUp = 0.87f,
+        .angleDown = -0.87f,
+};
+
+from_headset::headset_info_packet headset_info(const options & opts)
+{
+	from_headset::headset_info_packet info{
+	        .recommended_eye_width = opts.eye_width,
+	        .recommended_eye_height = opts.eye_height,
+	        .available_refresh_rates = {opts.refresh_rate},
+	        .preferred_refresh_rate = opts.refresh_rate,
+	        .fov = {fov, fov},
+	        .hand_tracking = false,
+	};
+	for (auto codec: opts.codecs)
+		info.decoders.push_back({.codec = codec, .decode_time = 0});
+	return info;
+}
+
+XrQuaternionf yaw(float angle)
+{
+	return {0, std::sin(angle / 2), 0, std::cos(angle / 2)};
+}
+
+// Head looking around, controllers in front of it: slow motion is up to
+// 0.5 rad/s, fast motion is up to 5 rad/s with the hands moving
+from_headset::tracking synthetic_tracking(int64_t timestamp, motion m)
+{
+	const float t = m == motion::still ? 0 : timestamp * 1e-9f;
+	const float speed = m == motion::fast ? 4 : 1;
+	const float amplitude = m == motion::fast ? 1.25f : 0.5f;
+	const XrQuaternionf head = yaw(amplitude * std::sin(speed * t));
+
+	from_headset::tracking packet{
+	        .production_timestamp = timestamp,
+	        .timestamp = timestamp,
+	        .flags = XR_VIEW_STATE_ORIENTATION_VALID_BIT | XR_VIEW_STATE_POSITION_VALID_BIT |
+	                 XR_VIEW_STATE_ORIENTATION_TRACKED_BIT | XR_VIEW_STATE_POSITION_TRACKED_BIT,
+	        .origin = {0, 1.6f, 0},
+	        .views = {{
+	                {.pose = {.orientation = {0, 0, 0, 1}, .position = {-0.032f, 0, 0}}, .fov = fov},
+	                {.pose = {.orientation = {0, 0, 0, 1}, .position = {0.032f, 0, 0}}, .fov = fov},
+	        }},
+	};
+
+	const uint8_t flags = from_headset::tracking::orientation_valid | from_headset::tracking::position_valid |
+	                      from_headset::tracking::orientation_tracked | from_headset::tracking::position_tracked;
+	auto add = [&](device_id device, XrQuaternionf orientation, XrVector3f position) {
+		packet.device_poses.push_back({
+		        .device = device,
+		        .orientation = pack(orientation),
+		        .position = pack(position, packet.origin),
+		        .flags = flags,
+		});
+	};
+
+	const XrQuaternionf hand = yaw(0.2f * amplitude * std::sin(2 * speed * t));
+	const float reach = m == motion::fast ? 0.2f * std::sin(3 * speed * t) : 0;
+	add(device_id::HEAD, head, packet.origin);
+	add(device_id::LEFT_GRIP, hand, {-0.2f, 1.2f, -0.3f - reach});
+	add(device_id::LEFT_AIM, hand, {-0.2f, 1.2f, -0.35f - reach});
+	add(device_id::RIGHT_GRIP, hand, {0.2f, 1.2f, -0.3f + reach});
+	add(device_id::RIGHT_AIM, hand, {0.2f, 1.2f, -0.35f + reach});
+	return packet;
+}
+
+// Reception state of a frame
+struct frame_state
+{
+	int64_t first_shard;
+	uint32_t data_shards = 0;
+	uint32_t parity_shards = 0;
+	// Number of data shards, known once the last one is received
+	std::optional<uint32_t> total;
+	std::optional<int64_t> encode_begin;
+};
+
+void run(const options & opts, in6_addr address, int port, std::chrono::seconds duration, results & res)
+{
+	fake_headset headset(address, port);
+	headset.send_control(headset_info(opts));
+	headset.set_shaping(opts.shaping, port);
+	res.connected = true;
+
+	// Frames being received, by stream
+	std::map<std::pair<uint8_t, uint64_t>, frame_state> pending;
+	// Shards of older frames are ignored once a frame is finished, by stream
+	std::map<uint8_t, uint64_t> next_frame;
+	from_headset::feedback_batch feedback{};
+	uint64_t decoded = 0;
+
+	// A frame is decoded if its shards were received, or if the parity can replace
+	// the missing ones. The parity of each block is not tracked separately, so a
+	// frame may be counted as decoded although a block lost more shards than its parity
+	auto finish = [&](std::pair<uint8_t, uint64_t> key, const frame_state & frame, int64_t t) {
+		auto [stream_index, frame_index] = key;
+		next_frame[stream_index] = std::max(next_frame[stream_index], frame_index + 1);
+		bool complete = frame.total and frame.data_shards + frame.parity_shards >= *frame.total;
+		bool lost = not complete;
+		if (complete)
+		{
+			++res.frames;
+			if (frame.encode_begin)
+				res.latencies.push_back(t - *frame.encode_begin);
+			if (opts.lost_frame_interval and ++decoded % opts.lost_frame_interval == 0)
+			{
+				++res.reported_lost;
+				lost = true;
+			}
+		}
+		else
+			++res.dropped_frames;
+
+		// The frame is reported as decoded and displayed as soon as it is received
+		if (not opts.feedback)
+			return;
+		feedback.frames = {{
+		        .frame_index = frame_index,
+		        .stream_index = stream_index,
+		        .received_first_packet = frame.first_shard,
+		        .received_last_packet = t,
+		        .sent_to_decoder = lost ? 0 : t,
+		        .received_from_decoder = lost ? 0 : t,
+		        .blitted = lost ? 0 : t,
+		        .displayed = lost ? 0 : t,
+		        .times_displayed = uint8_t(lost ? 0 : 1),
+		}};
+		if (feedback.streams.size() <= stream_index)
+			feedback.streams.resize(stream_index + 1);
+		auto & counters = feedback.streams[stream_index];
+		++counters.frames;
+		if (lost)
+		{
+			++counters.lost;
+			counters.last_lost = frame_index;
+		}
+		headset.send(feedback);
+		++feedback.sequence;
+	};
+
+	// Older frames of the stream will not receive more shards
+	auto finish_before = [&](std::pair<uint8_t, uint64_t> key, int64_t t) {
+		auto begin = pending.lower_bound({key.first, 0});
+		auto end = pending.lower_bound(key);
+		for (auto it = begin; it != end; ++it)
+			finish(it->first, it->second, t);
+		pending.erase(begin, end);
+	};
+
+	auto shard_received = [&](std::pair<uint8_t, uint64_t> key, int64_t t) -> frame_state & {
+		finish_before(key, t);
+		return pending.try_emplace(key, frame_state{.first_shard = t}).first->second;
+	};
+
+	auto try_finish = [&](std::pair<uint8_t, uint64_t> key, frame_state & frame, int64_t t) {
+		if (frame.total and frame.data_shards + frame.parity_shards >= *frame.total)
+		{
+			finish(key, frame, t);
+			pending.erase(key);
+		}
+	};
+
+	auto on_data = [&](const to_headset::video_stream_data_shard & shard) {
+		int64_t t = now();
+		auto key = std::make_pair(shard.stream_item_idx, shard.frame_idx);
+		if (shard.frame_idx < next_frame[shard.stream_item_idx])
+			return;
+		bool first = not pending.contains(key);
+		auto & frame = shard_received(key, t);
+		if (first and shard.view_info and shard.view_info->display_time < t)
+			++res.late_frames;
+		++frame.data_shards;
+		if (shard.timing_info)
+			frame.encode_begin = shard.timing_info->encode_begin;
+		if (shard.flags & to_headset::video_stream_data_shard::end_of_frame)
+			frame.total = shard.shard_idx + 1;
+		try_finish(key, frame, t);
+	};
+
+	auto on_parity = [&](const to_headset::video_stream_parity_shard & shard) {
+		int64_t t = now();
+		auto key = std::make_pair(shard.stream_item_idx, shard.frame_idx);
+		if (shard.frame_idx < next_frame[shard.stream_item_idx])
+			return;
+		auto & frame = shard_received(key, t);
+		++frame.parity_shards;
+		try_finish(key, frame, t);
+	};
+
+	overloaded on_shard{on_data, on_parity};
+
+	const int64_t period = 1e9 / opts.tracking_rate;
+	const int64_t start = now();
+	const int64_t end = start + std::chrono::nanoseconds(duration).count();
+	int64_t next_tracking = start;
+	try
+	{
+		while (now() < end)
+		{
+			int64_t t = now();
+			if (t >= next_tracking)
+			{
+				headset.send(synthetic_tracking(t, opts.movement));
+				++res.tracking_sent;
+				next_tracking = std::max(next_tracking + period, t);
+			}
+			headset.handle_packets(std::max<int64_t>(0, (next_tracking - now()) / 1'000'000), on_shard);
+		}
+	}
+	catch (std::exception & e)
+	{
+		// Keep the statistics up to the disconnection
+		res.error = e.what();
+	}
+
+	res.duration = (now() - start) * 1e-9;
+	res.shards = headset.shards;
+	res.parity_shards = headset.parity_shards;
+	res.bytes = headset.shard_bytes;
+	res.shaped_downlink_losses = headset.shaped_downlink_losses;
+	res.shaped_uplink_losses = headset.shaped_uplink_losses;
+}
+
+double percentile(std::vector<int64_t> & values, double p)
+{
+	if (values.empty())
+		return 0;
+	auto it = values.begin() + std::min<size_t>(values.size() - 1, p * values.size());
+	std::nth_element(values.begin(), it, values.end());
+	return *it * 1e-6;
+}
+
+void print(results & res)
+{
+	if (not res.connected)
+	{
+		printf("{\"instance\": %d, \"error\": \"%s\"}\n", res.instance, res.error.c_str());
+		return;
+	}
+	double duration = std::max(res.duration, 1e-9);
+	printf("{\"instance\": %d, \"duration\": %.3f, \"tracking_sent\": %" PRIu64 ", \"shards_received\": %" PRIu64 ", \"parity_shards_received\": %" PRIu64 ", \"frames_received\": %" PRIu64 ", \"frames_dropped\": %" PRIu64 ", \"frames_reported_lost\": %" PRIu64 ", \"late_frames\": %" PRIu64 ", \"shaped_losses\": {\"downlink\": %" PRIu64 ", \"uplink\": %" PRIu64 "}, \"fps\": %.2f, \"megabits_per_second\": %.3f, \"latency_ms\": {\"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f}%s%s%s}\n",
+	       res.instance,
+	       res.duration,
+	       res.tracking_sent,
+	       res.shards,
+	       res.parity_shards,
+	       res.frames,
+	       res.dropped_frames,
+	       res.reported_lost,
+	       res.late_frames,
+	       res.shaped_downlink_losses,
+	       res.shaped_uplink_losses,
+	       res.frames / duration,
+	       res.bytes * 8 / duration / 1e6,
+	       percentile(res.latencies, 0.5),
+	       percentile(res.latencies, 0.9),
+	       percentile(res.latencies, 0.99),
+	       res.error.empty() ? "" : ", \"error\": \"",
+	       res.error.c_str(),
+	       res.error.empty() ? "" : "\"");
+}
+} // namespace
+
+int main(int argc, char ** argv)
+{
+	CLI::App app{"Synthetic headset for WiVRn server load tests"};
+
+	options opts;
+	std::string host = "::1";
+	int port = default_port;
+	int instances = 1;
+	int duration = 30;
+	bool no_feedback = false;
+	std::vector<std::string> codecs;
+	std::string movement = "slow";
+	double delay_ms = 0;
+	double jitter_ms = 0;
+	app.add_option("-s,--server", host, "server address (default: ::1)");
+	app.add_option("-p,--port", port, "server port, instance i connects to port + i");
+	app.add_option("-n,--instances", instances, "number of simultaneous headsets");
+	app.add_option("-d,--duration", duration, "duration of the test in seconds");
+	app.add_option("-r,--tracking-rate", opts.tracking_rate, "tracking packets per second");
+	app.add_option("--refresh-rate", opts.refresh_rate, "display refresh rate");
+	app.add_option("--width", opts.eye_width, "recommended eye width");
+	app.add_option("--height", opts.eye_height, "recommended eye height");
+	app.add_option("-c,--codec", codecs, "supported codecs among h264, h265 and av1 (default: h264 and h265)");
+	app.add_flag("--no-feedback", no_feedback, "do not acknowledge the received frames");
+	app.add_option("-m,--motion", movement, "head and controller motion: still, slow or fast")->check(CLI::IsMember({"still", "slow", "fast"}))->capture_default_str();
+	app.add_option("--lost-frame-interval", opts.lost_frame_interval, "report one received frame out of n as lost, so that the encoder has to recover");
+	app.add_option("--loss", opts.shaping.loss, "fraction of the stream datagrams lost in each direction")->check(CLI::Range(0., 0.99));
+	app.add_option("--loss-burst", opts.shaping.loss_burst, "average number of consecutive lost datagrams")->check(CLI::PositiveNumber);
+	app.add_option("--delay", delay_ms, "delay added to the stream datagrams from the server, in ms")->check(CLI::NonNegativeNumber);
+	app.add_option("--jitter", jitter_ms, "maximum random variation of the delay, in ms")->check(CLI::NonNegativeNumber);
+
+	CLI11_PARSE(app, argc, argv);
+
+	auto address = parse_address(host);
+	if (not address)
+	{
+		fprintf(stderr, "Invalid server address %s\n", host.c_str());
+		return 1;
+	}
+	if (opts.tracking_rate <= 0)
+	{
+		fprintf(stderr, "Invalid tracking rate %f\n", opts.tracking_rate);
+		return 1;
+	}
+	if (not codecs.empty())
+	{
+		opts.codecs.clear();
+		for (const auto & codec: codecs)
+		{
+			if (codec == "h264")
+				opts.codecs.push_back(h264);
+			else if (codec == "h265")
+				opts.codecs.push_back(h265);
+			else if (codec == "av1")
+				opts.codecs.push_back(av1);
+			else
+			{
+				fprintf(stderr, "Unknown codec %s\n", codec.c_str());
+				return 1;
+			}
+		}
+	}
+	opts.feedback = not no_feedback;
+	if (movement == "still")
+		opts.movement = motion::still;
+	else if (movement == "fast")
+		opts.movement = motion::fast;
+	opts.shaping.delay = std::chrono::microseconds(int64_t(delay_ms * 1000));
+	opts.shaping.jitter = std::chrono::microseconds(int64_t(jitter_ms * 1000));
+
+	std::vector<results> res(instances);
+	{
+		std::vector<std::jthread> threads;
+		for (int i = 0; i < instances; ++i)
+		{
+			res[i].instance = i;
+			threads.emplace_back([&, i]() {
+				try
+				{
+					run(opts, *address, port + i, std::chrono::seconds(duration), res[i]);
+				}
+				catch (std::exception & e)
+				{
+					res[i].error = e.what();
+				}
+			});
+		}
+	}
+
+	int failed = 0;
+	for (auto & r: res)
+	{
+		print(r);
+		if (not r.error.empty())
+			++failed;
+	}
+	return failed ? 1 : 0;
+}
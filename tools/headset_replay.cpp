@@ -0,0 +1,161 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "fake_headset.h"
+#include "wivrn_recording.h"
+
+#include <CLI/CLI.hpp>
+
+#include <cinttypes>
+#include <cstdio>
+
+// Replays the packets recorded by a server with WIVRN_RECORD, as a headset would send them.
+// The server streams as if the headset was connected, the received video is discarded.
+
+using namespace xrt::drivers::wivrn;
+
+namespace
+{
+// Moves the headset timestamps of a packet from the recording clock to the replay clock
+struct rebase
+{
+	int64_t shift;
+
+	void operator()(from_headset::tracking & packet) const
+	{
+		packet.production_timestamp += shift;
+		packet.timestamp += shift;
+	}
+
+	void operator()(from_headset::hand_tracking & packet) const
+	{
+		packet.production_timestamp += shift;
+		packet.timestamp += shift;
+	}
+
+	void operator()(from_headset::inputs & packet) const
+	{
+		for (auto & value: packet.values)
+			value.last_change_time += shift;
+	}
+
+	void operator()(audio_data & packet) const
+	{
+		packet.timestamp += shift;
+	}
+
+	void operator()(auto &) const
+	{}
+};
+
+// Only the packets that describe what the user does are replayed: the others
+// refer to frames and network conditions of the recorded session
+bool replayed(const from_headset::packets & packet)
+{
+	return std::holds_alternative<from_headset::tracking>(packet) or
+	       std::holds_alternative<from_headset::hand_tracking>(packet) or
+	       std::holds_alternative<from_headset::inputs>(packet) or
+	       std::holds_alternative<audio_data>(packet);
+}
+} // namespace
+
+int main(int argc, char ** argv)
+{
+	CLI::App app{"Replay a headset recording to a WiVRn server"};
+
+	std::string file;
+	std::string host = "::1";
+	int port = default_port;
+	bool loop = false;
+	app.add_option("recording", file, "file written by the server with WIVRN_RECORD")->required();
+	app.add_option("-s,--server", host, "server address (default: ::1)");
+	app.add_option("-p,--port", port, "server port");
+	app.add_flag("-l,--loop", loop, "replay the recording until interrupted");
+
+	CLI11_PARSE(app, argc, argv);
+
+	auto address = parse_address(host);
+	if (not address)
+	{
+		fprintf(stderr, "Invalid server address %s\n", host.c_str());
+		return 1;
+	}
+
+	try
+	{
+		recording_reader reader(file);
+		auto first = reader.read();
+		if (not first or not std::holds_alternative<from_headset::headset_info_packet>(first->packet))
+			throw std::runtime_error("Recording does not start with the headset information");
+
+		fake_headset headset(*address, port);
+		headset.send_control(std::get<from_headset::headset_info_packet>(first->packet));
+
+		int64_t start = now();
+		uint64_t sent = 0;
+		do
+		{
+			// The recorded headset clock is estimated from the first tracking packet
+			std::optional<int64_t> shift;
+			int64_t loop_start = now();
+
+			while (auto record = reader.read())
+			{
+				if (not replayed(record->packet))
+					continue;
+
+				int64_t when = loop_start + record->time;
+				while (now() < when)
+					headset.handle_packets(std::max<int64_t>(0, (when - now()) / 1'000'000));
+
+				if (not shift)
+				{
+					if (auto tracking = std::get_if<from_headset::tracking>(&record->packet))
+						shift = when - tracking->production_timestamp;
+					else
+						continue;
+				}
+
+				std::visit(rebase{*shift}, record->packet);
+				std::visit([&](auto && packet) { headset.send(std::move(packet)); }, std::move(record->packet));
+				++sent;
+			}
+
+			if (loop)
+			{
+				reader = recording_reader(file);
+				reader.read();
+			}
+		} while (loop);
+
+		double duration = (now() - start) * 1e-9;
+		printf("{\"duration\": %.3f, \"packets_sent\": %" PRIu64 ", \"shards_received\": %" PRIu64 ", \"frames_received\": %zu, \"megabits_per_second\": %.3f}\n",
+		       duration,
+		       sent,
+		       headset.shards,
+		       headset.frames.size(),
+		       headset.shard_bytes * 8 / duration / 1e6);
+	}
+	catch (std::exception & e)
+	{
+		fprintf(stderr, "Replay failed: %s\n", e.what());
+		return 1;
+	}
+}
@@ -0,0 +1,342 @@
+#!/usr/bin/env python3
+
+# Streaming performance regression suite: runs a fixed set of scenarios with
+# wivrn-headless-client against a running server, optionally the encoder
+# benchmark and a recorded session with wivrn-headset-replay, and writes one
+# json file that can be compared with the one of another commit.
+#
+# The server must be started with metrics_port and an application that renders
+# continuously, with the same configuration for the runs that are compared.
+
+import argparse
+import glob
+import json
+import os
+import platform
+import shutil
+import subprocess
+import sys
+import threading
+import time
+import urllib.request
+
+VERSION = 1
+
+# name: arguments of the headless client
+SCENARIOS = {
+    "static": ["--motion", "still"],
+    "fast_motion": ["--motion", "fast", "--tracking-rate", "120"],
+    # The reported losses make the encoder send IDR frames, or refresh the image with intra_refresh
+    "idr_burst": ["--motion", "slow", "--lost-frame-interval", "30"],
+    "lossy_link": ["--motion", "slow", "--loss", "0.02", "--loss-burst", "3", "--delay", "5", "--jitter", "2"],
+    "congested_link": ["--motion", "fast", "--loss", "0.08", "--loss-burst", "8", "--delay", "20", "--jitter", "10"],
+}
+
+# name: arguments of the encoder benchmark
+ENCODER_SCENARIOS = {
+    "steady": [],
+    "idr_burst": ["--idr-interval", "10", "--bitrate", "200000000"],
+}
+
+# Compared values: path in the results, whether higher is better, and the
+# absolute difference below which a change is noise
+CHECKS = [
+    (("latency_ms", "p50"), False, 0.5),
+    (("latency_ms", "p90"), False, 1),
+    (("latency_ms", "p99"), False, 2),
+    (("fps",), True, 1),
+    (("drop_rate",), False, 0.005),
+    (("late_rate",), False, 0.01),
+    (("server", "cpu_percent"), False, 5),
+    (("server", "gpu_busy_percent"), False, 5),
+    (("server", "encode_ms"), False, 0.3),
+    (("server", "conversion_gpu_ms"), False, 0.1),
+    (("server", "tracking_latency_us"), False, 20),
+    (("latency", "p50"), False, 0.3),
+    (("latency", "p99"), False, 1),
+    (("throughput",), True, 5),
+]
+
+SERVER_METRICS = [
+    "wivrn_frames_presented_total",
+    "wivrn_frames_dropped_total",
+    "wivrn_frames_skipped_total",
+    "wivrn_video_bytes_total",
+    "wivrn_encode_duration_seconds_sum",
+    "wivrn_encode_duration_seconds_count",
+    "wivrn_conversion_gpu_duration_seconds_sum",
+    "wivrn_conversion_gpu_duration_seconds_count",
+    "wivrn_tracking_latency_seconds_sum",
+    "wivrn_tracking_latency_seconds_count",
+]
+
+
+def scrape(port):
+    try:
+        with urllib.request.urlopen(f"http://localhost:{port}/metrics", timeout=2) as response:
+            text = response.read().decode()
+    except OSError:
+        return None
+    values = {}
+    for line in text.splitlines():
+        if line.startswith("#"):
+            continue
+        try:
+            name, value = line.rsplit(" ", 1)
+            values[name] = float(value)
+        except ValueError:
+            pass
+    return values
+
+
+def cpu_seconds(pid):
+    # utime and stime, the fields after the parenthesis of the command name
+    with open(f"/proc/{pid}/stat") as f:
+        fields = f.read().rsplit(")", 1)[1].split()
+    return (int(fields[11]) + int(fields[12])) / os.sysconf("SC_CLK_TCK")
+
+
+def gpu_busy():
+    # amdgpu and some other drivers, nvidia-smi for the NVIDIA driver
+    values = []
+    for path in glob.glob("/sys/class/drm/card*/device/gpu_busy_percent"):
+        try:
+            with open(path) as f:
+                values.append(float(f.read()))
+        except (OSError, ValueError):
+            pass
+    if not values and shutil.which("nvidia-smi"):
+        try:
+            out = subprocess.run(["nvidia-smi", "--query-gpu=utilization.gpu", "--format=csv,noheader,nounits"], capture_output=True, text=True, timeout=2).stdout
+            values = [float(v) for v in out.split()]
+        except (OSError, ValueError, subprocess.TimeoutExpired):
+            pass
+    return max(values) if values else None
+
+
+class server_probe:
+    # Measures the server between start and stop, while a headset is connected:
+    # the metrics are only exported during a session
+
+    def __init__(self, pid, metrics_port):
+        self.pid = pid
+        self.metrics_port = metrics_port
+        self.samples = []
+        self.running = False
+
+    def start(self):
+        self.metrics = scrape(self.metrics_port) if self.metrics_port else None
+        self.cpu = cpu_seconds(self.pid) if self.pid else None
+        self.begin = time.monotonic()
+        self.running = True
+        self.thread = threading.Thread(target=self.sample)
+        self.thread.start()
+
+    def sample(self):
+        while self.running:
+            value = gpu_busy()
+            if value is not None:
+                self.samples.append(value)
+            time.sleep(0.5)
+
+    def stop(self):
+        self.running = False
+        self.thread.join()
+        duration = time.monotonic() - self.begin
+        res = {}
+        if self.cpu is not None:
+            # 100% is one core
+            res["cpu_percent"] = (cpu_seconds(self.pid) - self.cpu) / duration * 100
+        if self.samples:
+            res["gpu_busy_percent"] = sum(self.samples) / len(self.samples)
+
+        after = scrape(self.metrics_port) if self.metrics_port else None
+        if self.metrics and after:
+            delta = {name: after.get(name, 0) - self.metrics.get(name, 0) for name in SERVER_METRICS}
+
+            def ratio(num, den, scale):
+                return delta[num] / delta[den] * scale if delta[den] else None
+
+            res["frames_presented"] = delta["wivrn_frames_presented_total"]
+            res["frames_dropped"] = delta["wivrn_frames_dropped_total"]
+            res["frames_skipped"] = delta["wivrn_frames_skipped_total"]
+            res["megabits_per_second"] = delta["wivrn_video_bytes_total"] * 8 / duration / 1e6
+            res["encode_ms"] = ratio("wivrn_encode_duration_seconds_sum", "wivrn_encode_duration_seconds_count", 1e3)
+            res["conversion_gpu_ms"] = ratio("wivrn_conversion_gpu_duration_seconds_sum", "wivrn_conversion_gpu_duration_seconds_count", 1e3)
+            res["tracking_latency_us"] = ratio("wivrn_tracking_latency_seconds_sum", "wivrn_tracking_latency_seconds_count", 1e6)
+        return res
+
+
+def run_measured(command, duration, probe):
+    # The measurement skips the connection and the last second, when the headset disconnects
+    process = subprocess.Popen(command, stdout=subprocess.PIPE, text=True)
+    time.sleep(min(2, duration / 4))
+    probe.start()
+    time.sleep(max(duration - min(2, duration / 4) - 1, 1))
+    server = probe.stop()
+    out, _ = process.communicate()
+    lines = [line for line in out.splitlines() if line.startswith("{")]
+    if not lines:
+        return {"error": f"no result, exit code {process.returncode}", "server": server}
+    res = json.loads(lines[-1])
+    res["server"] = server
+    return res
+
+
+def headless_scenario(args, name, probe):
+    command = [args.headless_client, "--server", args.server, "--port", str(args.port), "--duration", str(args.duration)] + SCENARIOS[name]
+    res = run_measured(command, args.duration, probe)
+    frames = res.get("frames_received", 0) + res.get("frames_dropped", 0)
+    if frames:
+        res["drop_rate"] = res["frames_dropped"] / frames
+        res["late_rate"] = res.get("late_frames", 0) / frames
+    res["arguments"] = SCENARIOS[name]
+    return res
+
+
+def replay_scenario(args, probe):
+    command = [args.headset_replay, args.recording, "--server", args.server, "--port", str(args.port)]
+    # The duration of the replay is the one of the recording, it is measured until the end
+    process = subprocess.Popen(command, stdout=subprocess.PIPE, text=True)
+    time.sleep(2)
+    probe.start()
+    out, _ = process.communicate()
+    server = probe.stop()
+    lines = [line for line in out.splitlines() if line.startswith("{")]
+    res = json.loads(lines[-1]) if lines else {"error": f"no result, exit code {process.returncode}"}
+    res["server"] = server
+    return res
+
+
+def encoder_scenario(args, name):
+    command = [args.encoder_benchmark] + args.encoder_args + ENCODER_SCENARIOS[name]
+    process = subprocess.run(command, capture_output=True, text=True)
+    if process.returncode != 0:
+        return {"error": process.stderr.strip()}
+    res = json.loads(process.stdout)
+    # Only the summary is compared
+    for key in ("per_frame", "latency_histogram"):
+        res.pop(key, None)
+    return res
+
+
+def find_value(res, path):
+    for key in path:
+        if not isinstance(res, dict) or key not in res:
+            return None
+        res = res[key]
+    return res if isinstance(res, (int, float)) else None
+
+
+def compare(results, baseline, tolerance):
+    regressions = []
+    for group in ("scenarios", "encoder"):
+        for name, res in results.get(group, {}).items():
+            base = baseline.get(group, {}).get(name)
+            if base is None:
+                continue
+            for path, higher_is_better, noise in CHECKS:
+                value = find_value(res, path)
+                reference = find_value(base, path)
+                if value is None or reference is None:
+                    continue
+                change = reference - value if higher_is_better else value - reference
+                if change > noise and change > tolerance * abs(reference):
+                    regressions.append(f"{group}/{name}/{'.'.join(path)}: {reference:.3f} -> {value:.3f}")
+    return regressions
+
+
+def git_commit():
+    try:
+        directory = os.path.dirname(os.path.abspath(__file__))
+        return subprocess.run(["git", "-C", directory, "describe", "--always", "--dirty"], capture_output=True, text=True).stdout.strip() or None
+    except OSError:
+        return None
+
+
+def server_pid(args):
+    if args.server_pid:
+        return args.server_pid
+    try:
+        pids = subprocess.run(["pgrep", "-x", "wivrn-server"], capture_output=True, text=True).stdout.split()
+        return int(pids[0]) if len(pids) == 1 else None
+    except (OSError, ValueError):
+        return None
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Run the WiVRn streaming performance scenarios and compare them with a baseline")
+    parser.add_argument("--headless-client", default="wivrn-headless-client", help="path of wivrn-headless-client")
+    parser.add_argument("--server", default="::1", help="server address")
+    parser.add_argument("--port", type=int, default=9757, help="server port")
+    parser.add_argument("--server-pid", type=int, help="process of the server for the CPU usage, default to the only wivrn-server process")
+    parser.add_argument("--metrics-port", type=int, help="metrics_port of the server configuration")
+    parser.add_argument("--duration", type=int, default=30, help="duration of each scenario in seconds")
+    parser.add_argument("--settle", type=float, default=3, help="seconds between scenarios, for the server to end the session")
+    parser.add_argument("--scenario", action="append", choices=SCENARIOS.keys(), help="scenario to run, default to all of them")
+    parser.add_argument("--headset-replay", help="path of wivrn-headset-replay, to also replay --recording")
+    parser.add_argument("--recording", help="session recorded with WIVRN_RECORD")
+    parser.add_argument("--encoder-benchmark", help="path of wivrn-encoder-benchmark, to also run the encoder scenarios")
+    parser.add_argument("--encoder-args", default="", help="arguments given to the encoder benchmark, such as the encoder and the input")
+    parser.add_argument("--output", help="json file for the results, default to the standard output")
+    parser.add_argument("--baseline", help="results of a previous run, the exit code is 1 if a value regressed")
+    parser.add_argument("--tolerance", type=float, default=0.1, help="relative change in the wrong direction counted as a regression")
+    args = parser.parse_args()
+    args.encoder_args = args.encoder_args.split()
+
+    if args.duration < 5:
+        parser.error("--duration must be at least 5 seconds")
+
+    pid = server_pid(args)
+    if pid is None:
+        print("Server process not found, the CPU usage is not measured", file=sys.stderr)
+    probe = server_probe(pid, args.metrics_port)
+
+    results = {
+        "version": VERSION,
+        "commit": git_commit(),
+        "date": time.strftime("%Y-%m-%dT%H:%M:%S%z"),
+        "host": platform.node(),
+        "duration": args.duration,
+        "scenarios": {},
+        "encoder": {},
+    }
+
+    for name in args.scenario or SCENARIOS.keys():
+        print(f"Running {name}", file=sys.stderr)
+        results["scenarios"][name] = headless_scenario(args, name, probe)
+        time.sleep(args.settle)
+
+    if args.headset_replay and args.recording:
+        print("Running replay", file=sys.stderr)
+        results["scenarios"]["replay"] = replay_scenario(args, probe)
+
+    if args.encoder_benchmark:
+        for name in ENCODER_SCENARIOS:
+            print(f"Running encoder {name}", file=sys.stderr)
+            results["encoder"][name] = encoder_scenario(args, name)
+
+    text = json.dumps(results, indent=1)
+    if args.output:
+        with open(args.output, "w") as f:
+            f.write(text + "\n")
+    else:
+        print(text)
+
+    failed = [f"{group}/{name}: {res['error']}" for group in ("scenarios", "encoder") for name, res in results[group].items() if "error" in res]
+    for error in failed:
+        print(f"Failed: {error}", file=sys.stderr)
+
+    regressions = []
+    if args.baseline:
+        with open(args.baseline) as f:
+            baseline = json.load(f)
+        regressions = compare(results, baseline, args.tolerance)
+        for regression in regressions:
+            print(f"Regression: {regression}", file=sys.stderr)
+
+    return 1 if failed or regressions else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -8,6 +8,7 @@ class Frame:
         self.events = dict()
         self.streams = dict()
         self.flags = dict()
+        self.stats = dict()
 
     def set(self, event, timestamp, stream):
         if stream == 255:
@@ -20,6 +21,15 @@ class Frame:
     def flag(self, stream, flag):
         self.flags[stream if stream != 255 else None] = flag
 
+    def set_stats(self, stream, frame_type, size, slices, qp, encode_time):
+        self.flag(stream, frame_type)
+        self.stats[stream] = {
+            "bytes": int(size),
+            "slices": int(slices),
+            "qp": float(qp) if float(qp) >= 0 else None,
+            "encode_time": int(encode_time) / 1_000_000,
+        }
+
     def duration(self, begin="wake_up", end="display", stream=None, begin_selector=min, end_selector=max):
         try:
             if stream is None:
@@ -66,11 +76,19 @@ def read(file, skip=0, duration_ms=-1):
         while len(frames) < frame + 1:
             frames.append(Frame(len(frames)))
 
+        if event == "frame_stats":
+            frames[frame].set_stats(stream, *extra)
+            continue
+
         frames[frame].set(event, timestamp, stream)
         for x in extra:
             frames[frame].flag(stream, x)
     return frames
 
+def frame_stats(frames, stream, key):
+    res = [frame.stats.get(stream, {}).get(key) for frame in frames]
+    return [x for x in res if x is not None]
+
 def durations(frames, stream=None, flag=None, *args, **kwargs):
     def filter(frame):
         if flag is None:
@@ -0,0 +1,356 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "wivrn_packets.h"
+#include "wivrn_serialization.h"
+#include "wivrn_sockets.h"
+
+#include <CLI/CLI.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cinttypes>
+#include <cstdlib>
+#include <cxxabi.h>
+#include <new>
+#include <poll.h>
+#include <thread>
+#include <vector>
+
+// Measures serialization of every packet type and the loopback throughput of the sockets.
+// Results are printed as one json object per line.
+
+namespace
+{
+std::atomic<uint64_t> allocations = 0;
+}
+
+void * operator new(size_t size)
+{
+	++allocations;
+	if (void * ptr = std::malloc(size ? size : 1))
+		return ptr;
+	throw std::bad_alloc{};
+}
+
+void operator delete(void * ptr) noexcept
+{
+	std::free(ptr);
+}
+
+void operator delete(void * ptr, size_t) noexcept
+{
+	std::free(ptr);
+}
+
+using namespace xrt::drivers::wivrn;
+
+namespace
+{
+using clock = std::chrono::steady_clock;
+
+// Payloads referenced by the spans of the samples
+std::vector<uint8_t> payload_storage(1400, 0x55);
+std::vector<uint8_t> audio_storage(960 * 2 * 2, 0x55);
+
+// Packets of typical size, as sent during a stream
+template <typename T>
+T sample()
+{
+	return T{};
+}
+
+template <>
+audio_data sample()
+{
+	return {.timestamp = 1, .payload = audio_storage};
+}
+
+template <>
+from_headset::headset_info_packet sample()
+{
+	return {
+	        .recommended_eye_width = 1920,
+	        .recommended_eye_height = 1920,
+	        .available_refresh_rates = {72, 80, 90, 120},
+	        .preferred_refresh_rate = 90,
+	};
+}
+
+template <>
+from_headset::tracking sample()
+{
+	from_headset::tracking res{.production_timestamp = 1, .timestamp = 2};
+	for (int i = 0; i < 6; i++)
+		res.device_poses.push_back({.linear_velocity = XrVector3f{}, .angular_velocity = XrVector3f{}});
+	return res;
+}
+
+template <>
+from_headset::hand_tracking sample()
+{
+	from_headset::hand_tracking res{.production_timestamp = 1, .timestamp = 2};
+	res.joints.emplace();
+	return res;
+}
+
+template <>
+from_headset::inputs sample()
+{
+	return {.values = std::vector<from_headset::inputs::input_value>(8)};
+}
+
+template <>
+to_headset::video_stream_description sample()
+{
+	return {.items = std::vector<to_headset::video_stream_description::item>(3)};
+}
+
+template <>
+to_headset::video_stream_data_shard sample()
+{
+	to_headset::video_stream_data_shard res{.frame_idx = 1, .payload = payload_storage};
+	res.view_info.emplace();
+	return res;
+}
+
+template <>
+to_headset::video_stream_parity_shard sample()
+{
+	return {.frame_idx = 1, .payload = payload_storage};
+}
+
+template <>
+to_headset::video_stream_motion sample()
+{
+	return {.width = 30, .height = 30, .vectors = std::vector<int8_t>(2 * 30 * 30)};
+}
+
+template <>
+to_headset::video_stream_depth sample()
+{
+	return {.values = std::vector<uint8_t>(to_headset::video_stream_depth::grid_size * to_headset::video_stream_depth::grid_size)};
+}
+
+template <typename T>
+std::string type_name()
+{
+	int status;
+	char * demangled = abi::__cxa_demangle(typeid(T).name(), nullptr, nullptr, &status);
+	std::string name = status == 0 ? demangled : typeid(T).name();
+	free(demangled);
+	if (auto pos = name.rfind("::"); pos != std::string::npos)
+		return name.substr(pos + 2);
+	return name;
+}
+
+template <typename Variant, typename T, typename Tuple>
+void bench_serialization(const char * direction, size_t iterations)
+{
+	const T value = sample<T>();
+	const uint8_t index = details::Index<T, Tuple>::value;
+
+	// Serialization with a reused packet, as typed_socket does
+	serialization_packet packet;
+	uint64_t allocations_before = allocations;
+	auto start = clock::now();
+	for (size_t i = 0; i < iterations; i++)
+	{
+		packet.clear();
+		packet.serialize(index);
+		packet.serialize(value);
+	}
+	std::chrono::duration<double> serialize_time = clock::now() - start;
+	uint64_t serialize_allocations = allocations - allocations_before;
+
+	std::vector<uint8_t> bytes = packet.flatten();
+
+	allocations_before = allocations;
+	start = clock::now();
+	for (size_t i = 0; i < iterations; i++)
+	{
+		deserialization_packet p{bytes};
+		auto v = p.deserialize<Variant>();
+		if (v.index() != index)
+			abort();
+	}
+	std::chrono::duration<double> deserialize_time = clock::now() - start;
+	// Copying the bytes in the packet is one allocation, as receiving it would be
+	uint64_t deserialize_allocations = allocations - allocations_before;
+
+	printf("{\"benchmark\": \"serialization\", \"direction\": \"%s\", \"packet\": \"%s\", \"bytes\": %zu, "
+	       "\"serialize_ns\": %.1f, \"serialize_allocations\": %.2f, \"deserialize_ns\": %.1f, \"deserialize_allocations\": %.2f}\n",
+	       direction,
+	       type_name<T>().c_str(),
+	       bytes.size(),
+	       serialize_time.count() * 1e9 / iterations,
+	       double(serialize_allocations) / iterations,
+	       deserialize_time.count() * 1e9 / iterations,
+	       double(deserialize_allocations) / iterations);
+}
+
+template <typename Variant, typename... T>
+void bench_all(const char * direction, size_t iterations, std::variant<T...> *)
+{
+	(bench_serialization<Variant, T, std::tuple<T...>>(direction, iterations), ...);
+}
+
+bool wait_readable(int fd, int timeout_ms)
+{
+	pollfd pfd{.fd = fd, .events = POLLIN};
+	return ::poll(&pfd, 1, timeout_ms) > 0;
+}
+
+void print_socket_result(const char * socket, const char * mode, uint64_t sent, uint64_t received, uint64_t bytes, std::chrono::duration<double> duration)
+{
+	printf("{\"benchmark\": \"socket\", \"socket\": \"%s\", \"mode\": \"%s\", \"sent\": %" PRIu64 ", \"received\": %" PRIu64 ", "
+	       "\"packets_per_second\": %.0f, \"megabits_per_second\": %.1f}\n",
+	       socket,
+	       mode,
+	       sent,
+	       received,
+	       received / duration.count(),
+	       bytes * 8 / duration.count() / 1e6);
+}
+
+// Sends video shards from a thread, individually or queued in batches, and receives them
+void bench_udp(int port, size_t count, bool batched)
+{
+	typed_socket<UDP, to_headset::packets, from_headset::packets> receiver;
+	receiver.set_receive_buffer_size(8 * 1024 * 1024);
+	receiver.bind(port);
+
+	typed_socket<UDP, from_headset::packets, to_headset::packets> sender;
+	sender.connect(in6addr_loopback, port);
+
+	std::atomic<bool> done = false;
+	auto start = clock::now();
+	std::jthread t([&]() {
+		auto shard = sample<to_headset::video_stream_data_shard>();
+		for (size_t i = 0; i < count; i++)
+		{
+			shard.shard_idx = i;
+			if (batched)
+				sender.queue(shard);
+			else
+				sender.send(shard);
+			// Leave time for the receiver, loopback drops datagrams when its buffer is full
+			if (i % 64 == 63)
+			{
+				sender.flush();
+				std::this_thread::yield();
+			}
+		}
+		sender.flush();
+		done = true;
+	});
+
+	uint64_t received = 0;
+	std::vector<to_headset::packets> packets;
+	while (received < count)
+	{
+		if (not wait_readable(receiver.get_fd(), 100))
+		{
+			if (done)
+				break;
+			continue;
+		}
+		packets.clear();
+		receiver.receive_many(packets);
+		received += packets.size();
+	}
+	std::chrono::duration<double> duration = clock::now() - start;
+	t.join();
+
+	print_socket_result("udp", batched ? "queue" : "send", count, received, receiver.bytes_received(), duration);
+}
+
+void bench_tcp(int port, size_t count, bool async_writer)
+{
+	TCPListener listener(port);
+	typed_socket<TCP, from_headset::packets, to_headset::packets> sender(in6addr_loopback, port);
+	auto receiver = listener.accept<typed_socket<TCP, to_headset::packets, from_headset::packets>>().first;
+
+	if (async_writer)
+		sender.start_writer();
+
+	auto start = clock::now();
+	std::jthread t([&]() {
+		auto shard = sample<to_headset::video_stream_data_shard>();
+		for (size_t i = 0; i < count; i++)
+		{
+			shard.shard_idx = i;
+			sender.send(shard);
+		}
+	});
+
+	uint64_t received = 0;
+	while (received < count)
+	{
+		if (not wait_readable(receiver.get_fd(), 1000))
+			break;
+		// Each call reads at most one packet, and throws if there is nothing to read
+		do
+		{
+			if (receiver.receive())
+				++received;
+		} while (received < count and wait_readable(receiver.get_fd(), 0));
+	}
+	std::chrono::duration<double> duration = clock::now() - start;
+	t.join();
+
+	print_socket_result("tcp", async_writer ? "writer" : "send", count, received, receiver.bytes_received(), duration);
+}
+} // namespace
+
+int main(int argc, char ** argv)
+{
+	CLI::App app{"Packet serialization and socket benchmark"};
+
+	size_t iterations = 100'000;
+	size_t count = 100'000;
+	int port = 9758;
+	bool skip_sockets = false;
+	app.add_option("-i,--iterations", iterations, "serializations per packet type (default: 100000)");
+	app.add_option("-n,--count", count, "packets sent through each socket (default: 100000)");
+	app.add_option("-p,--port", port, "first loopback port (default: 9758)");
+	app.add_flag("--no-sockets", skip_sockets, "only measure serialization");
+
+	CLI11_PARSE(app, argc, argv);
+
+	bench_all<from_headset::packets>("from_headset", iterations, (from_headset::packets *)nullptr);
+	bench_all<to_headset::packets>("to_headset", iterations, (to_headset::packets *)nullptr);
+
+	if (skip_sockets)
+		return 0;
+
+	try
+	{
+		bench_udp(port, count, false);
+		bench_udp(port + 1, count, true);
+		bench_tcp(port + 2, count, false);
+		bench_tcp(port + 3, count, true);
+	}
+	catch (std::exception & e)
+	{
+		fprintf(stderr, "Socket benchmark failed: %s\n", e.what());
+		return 1;
+	}
+}
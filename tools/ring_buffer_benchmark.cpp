@@ -0,0 +1,120 @@
+/*
+ * WiVRn VR streaming
+ * Copyright (C) 2024  Guillaume Meunier <guillaume.meunier@centraliens.net>
+ * Copyright (C) 2024  Patrick Nicolas <patricknicolas@laposte.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "utils/ring_buffer.h"
+
+#include <CLI/CLI.hpp>
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <thread>
+#include <vector>
+
+// Measures the throughput of ring_buffer between two threads, one element at a time and in batches
+namespace
+{
+constexpr size_t capacity = 1024;
+using buffer = utils::ring_buffer<uint64_t, capacity>;
+
+// Returns the number of elements per second
+double run(uint64_t count, size_t batch)
+{
+	auto b = std::make_unique<buffer>();
+	bool valid = true;
+
+	auto start = std::chrono::steady_clock::now();
+
+	std::thread writer([&]() {
+		std::vector<uint64_t> items(batch);
+		uint64_t next = 0;
+		while (next < count)
+		{
+			if (batch == 1)
+			{
+				if (b->write(uint64_t(next)))
+					++next;
+				else
+					std::this_thread::yield();
+				continue;
+			}
+
+			size_t n = std::min<uint64_t>(batch, count - next);
+			for (size_t i = 0; i < n; ++i)
+				items[i] = next + i;
+			if (size_t written = b->write(std::span<const uint64_t>(items.data(), n)))
+				next += written;
+			else
+				std::this_thread::yield();
+		}
+	});
+
+	std::vector<uint64_t> items(batch);
+	uint64_t expected = 0;
+	while (expected < count)
+	{
+		if (batch == 1)
+		{
+			if (auto item = b->read())
+				valid &= *item == expected++;
+			else
+				std::this_thread::yield();
+			continue;
+		}
+
+		size_t n = b->read(std::span(items));
+		if (n == 0)
+			std::this_thread::yield();
+		for (size_t i = 0; i < n; ++i)
+			valid &= items[i] == expected++;
+	}
+
+	writer.join();
+
+	std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+
+	if (not valid)
+		fprintf(stderr, "elements received out of order with batch size %zu\n", batch);
+
+	return count / duration.count();
+}
+} // namespace
+
+int main(int argc, char ** argv)
+{
+	CLI::App app{"Ring buffer throughput benchmark"};
+
+	uint64_t count = 100'000'000;
+	std::vector<size_t> batches{1, 8, 64, 256};
+	app.add_option("-n,--count", count, "number of elements to transfer (default: 100000000)");
+	app.add_option("-b,--batch", batches, "batch sizes to test, 1 is the single element API (default: 1 8 64 256)");
+
+	CLI11_PARSE(app, argc, argv);
+
+	for (size_t batch: batches)
+	{
+		if (batch == 0 or batch > capacity)
+		{
+			fprintf(stderr, "batch size must be between 1 and %zu\n", capacity);
+			return 1;
+		}
+		printf("batch %4zu: %8.2f M elements/s\n", batch, run(count, batch) / 1e6);
+	}
+}
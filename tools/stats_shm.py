@@ -0,0 +1,123 @@
+#!/usr/bin/env python3
+
+# Reads the statistics shared memory segment of the server (the stats_shm
+# configuration item) and prints them periodically.
+# The layout is stats_shm_layout in server/utils/stats_shm.h.
+
+import argparse
+import mmap
+import os
+import struct
+import time
+
+MAGIC = 0x54535657
+VERSION = 1
+MAX_STREAMS = 8
+
+HEADER = struct.Struct("<IIII")
+SEQUENCE = struct.Struct("<II")
+EVENT = struct.Struct("<QQ")
+
+CONNECTION = struct.Struct("<IIQ")
+COMPOSITOR_EVENTS = ["wake_up", "begin", "submit", "present", "tracking_produced", "tracking_received"]
+STATE_FIELDS = ["frames_presented", "frames_dropped", "frames_skipped", "video_bytes", "bitrate", "resolution_scale", "predicted_present_to_display", "clock_drift", "clock_uncertainty", "wifi_rssi", "wifi_rx_rate"]
+STATE = struct.Struct("<QQQQddddddd")
+STREAM_EVENTS = ["encode_ready", "encode_begin", "encode_end", "send_begin", "send_end", "receive_begin", "receive_end", "decode_begin", "decode_end", "blit", "display", "encode_skip", "encode_drop"]
+STREAM_STATS = struct.Struct("<IIfI")
+GPU_EVENTS = ["render_begin", "render_end", "convert_begin", "convert_end", "present_end"]
+
+
+def section_size(value_size):
+    # The value is aligned on 8 bytes after the sequence
+    return SEQUENCE.size + (value_size + 7) // 8 * 8
+
+
+def read_section(buf, offset, size):
+    # Seqlock: retry while the writer is in the middle of an update
+    while True:
+        sequence, _ = SEQUENCE.unpack_from(buf, offset)
+        if sequence % 2:
+            continue
+        data = bytes(buf[offset + SEQUENCE.size:offset + SEQUENCE.size + size])
+        if SEQUENCE.unpack_from(buf, offset)[0] == sequence:
+            return data
+
+
+def read_events(data, names, offset=0):
+    return {name: EVENT.unpack_from(data, offset + i * EVENT.size) for i, name in enumerate(names)}
+
+
+def read(buf):
+    magic, version, size, _ = HEADER.unpack_from(buf, 0)
+    if magic != MAGIC or version != VERSION:
+        raise RuntimeError(f"unsupported segment: magic {magic:#x}, version {version}")
+
+    offset = HEADER.size
+    connected, reconnections, since = CONNECTION.unpack(read_section(buf, offset, CONNECTION.size))
+    offset += section_size(CONNECTION.size)
+
+    compositor_size = len(COMPOSITOR_EVENTS) * EVENT.size
+    compositor = read_events(read_section(buf, offset, compositor_size), COMPOSITOR_EVENTS)
+    offset += section_size(compositor_size)
+
+    state = dict(zip(STATE_FIELDS, STATE.unpack(read_section(buf, offset, STATE.size))))
+    offset += section_size(STATE.size)
+
+    streams = []
+    stream_size = len(STREAM_EVENTS) * EVENT.size + STREAM_STATS.size
+    for _ in range(MAX_STREAMS):
+        data = read_section(buf, offset, stream_size)
+        offset += section_size(stream_size)
+        events = read_events(data, STREAM_EVENTS)
+        if not any(t for _, t in events.values()):
+            continue
+        frame_bytes, slices, qp, idr = STREAM_STATS.unpack_from(data, len(STREAM_EVENTS) * EVENT.size)
+        streams.append((events, frame_bytes, qp))
+
+    # Added at the end of the segment, missing from older servers
+    gpu = None
+    gpu_size = (len(GPU_EVENTS) + MAX_STREAMS) * EVENT.size
+    if size >= offset + section_size(gpu_size):
+        data = read_section(buf, offset, gpu_size)
+        gpu = read_events(data, GPU_EVENTS)
+        gpu.update(read_events(data, [f"copy_end_{i}" for i in range(MAX_STREAMS)], len(GPU_EVENTS) * EVENT.size))
+
+    return {"connected": connected, "reconnections": reconnections, "since": since, "compositor": compositor, "state": state, "streams": streams, "gpu": gpu}
+
+
+def duration(events, begin, end):
+    # Only when both events are from the same frame
+    if events[begin][0] != events[end][0] or not events[begin][1] or not events[end][1]:
+        return "-"
+    return f"{(events[end][1] - events[begin][1]) / 1e6:.1f}ms"
+
+
+def print_stats(stats):
+    state = stats["state"]
+    print(f"{'connected' if stats['connected'] else 'disconnected'}, {stats['reconnections']} reconnections, "
+          f"bitrate {state['bitrate'] / 1e6:.1f}Mbps, resolution {state['resolution_scale']:.2f}, "
+          f"{state['frames_presented']} presented, {state['frames_dropped']} dropped, {state['frames_skipped']} skipped, "
+          f"present to display {state['predicted_present_to_display'] * 1e3:.1f}ms")
+    compositor = stats["compositor"]
+    print(f"  compositor: frame {compositor['submit'][0]}, render {duration(compositor, 'begin', 'submit')}")
+    gpu = stats["gpu"]
+    if gpu and gpu["convert_end"][1]:
+        print(f"  gpu: frame {gpu['convert_end'][0]}, render {duration(gpu, 'render_begin', 'render_end')}, "
+              f"conversion {duration(gpu, 'convert_begin', 'convert_end')}, copies and layers {duration(gpu, 'convert_end', 'present_end')}")
+    for index, (events, frame_bytes, qp) in enumerate(stats["streams"]):
+        print(f"  stream {index}: frame {max(frame for frame, _ in events.values())}, encode {duration(events, 'encode_begin', 'encode_end')}, "
+              f"send {duration(events, 'send_begin', 'send_end')}, decode {duration(events, 'decode_begin', 'decode_end')}, "
+              f"{frame_bytes} bytes, qp {qp:.1f}")
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description="Print the statistics published by the server in shared memory")
+    parser.add_argument("name", nargs="?", default="/wivrn-stats", help="stats_shm value of the configuration")
+    parser.add_argument("--interval", type=float, default=1, help="seconds between prints")
+    args = parser.parse_args()
+
+    with open(os.path.join("/dev/shm", args.name.lstrip("/")), "rb") as file:
+        buf = mmap.mmap(file.fileno(), 0, prot=mmap.PROT_READ)
+        while True:
+            print_stats(read(buf))
+            time.sleep(args.interval)
@@ -50,45 +50,7 @@ function load_timings(filename)
 					timing_data[frameindex][streamindex][event_name] = timestamp;
 				}
 
-				let min_timestamp = Number.MAX_VALUE;
-				for(let i in timing_data)
-				{
-					for(let j in timing_data[i])
-					{
-						for(let k in timing_data[i][j])
-						{
-							min_timestamp = Math.min(min_timestamp, timing_data[i][j][k]);
-						}
-					}
-				}
-
-				for(let i in timing_data)
-				{
-					var frame_begin = Number.MAX_VALUE;
-					var frame_end = -Number.MAX_VALUE;
-					for(let j in timing_data[i])
-					{
-						for(let k in timing_data[i][j])
-						{
-							frame_begin = Math.min(frame_begin, timing_data[i][j][k]);
-							frame_end = Math.max(frame_end, timing_data[i][j][k]);
-						}
-					}
-
-					for(let j in timing_data[i])
-					{
-						for(let k in timing_data[i][j])
-						{
-							timing_data[i][j][k] = (timing_data[i][j][k] - frame_begin) / 1000000; // nanoseconds to milliseconds
-						}
-					}
-
-					if (timing_data[i].global)
-					{
-						timing_data[i].global.frame_begin = (frame_begin - min_timestamp) / 1000000;
-						timing_data[i].global.frame_end = (frame_end - min_timestamp) / 1000000;
-					}
-				}
+				prepare_timings(timing_data);
 
 				document.getElementById('debug').innerHTML = JSON.stringify(timing_data, null, 4);
 
@@ -100,6 +62,94 @@ function load_timings(filename)
 	xhr.send(null);
 }
 
+// Converts the timestamps of each frame to milliseconds since its first event,
+// frame_begin and frame_end are relative to the first frame
+function prepare_timings(timing_data)
+{
+	let min_timestamp = Number.MAX_VALUE;
+	for(let i in timing_data)
+	{
+		for(let j in timing_data[i])
+		{
+			for(let k in timing_data[i][j])
+			{
+				min_timestamp = Math.min(min_timestamp, timing_data[i][j][k]);
+			}
+		}
+	}
+
+	for(let i in timing_data)
+	{
+		var frame_begin = Number.MAX_VALUE;
+		var frame_end = -Number.MAX_VALUE;
+		for(let j in timing_data[i])
+		{
+			for(let k in timing_data[i][j])
+			{
+				frame_begin = Math.min(frame_begin, timing_data[i][j][k]);
+				frame_end = Math.max(frame_end, timing_data[i][j][k]);
+			}
+		}
+
+		for(let j in timing_data[i])
+		{
+			for(let k in timing_data[i][j])
+			{
+				timing_data[i][j][k] = (timing_data[i][j][k] - frame_begin) / 1000000; // nanoseconds to milliseconds
+			}
+		}
+
+		if (timing_data[i].global)
+		{
+			timing_data[i].global.frame_begin = (frame_begin - min_timestamp) / 1000000;
+			timing_data[i].global.frame_end = (frame_end - min_timestamp) / 1000000;
+		}
+	}
+}
+
+// Live view of a server with timings_port set: frames are received as they complete
+// and the last ones are drawn
+function connect_timings(url, max_frames = 100)
+{
+	const svg = document.getElementById('timeline');
+	let frames = {};
+	let pending = false;
+
+	const source = new EventSource(url);
+	source.onmessage = (message) => {
+		const frame = JSON.parse(message.data);
+		const index = frame.frame;
+		delete frame.frame;
+		frames[index] = frame;
+
+		const indices = Object.keys(frames).map(Number).sort((a, b) => a - b);
+		for (let i = 0; i < indices.length - max_frames; i++)
+			delete frames[indices[i]];
+
+		if (pending)
+			return;
+		pending = true;
+		requestAnimationFrame(() => {
+			pending = false;
+			// prepare_timings modifies the data
+			let timing_data = [];
+			for (let i in frames)
+				timing_data[i] = structuredClone(frames[i]);
+			prepare_timings(timing_data);
+
+			while (svg.firstChild)
+				svg.removeChild(svg.firstChild);
+			draw_everything(svg, timing_data, true);
+		});
+	};
+	source.onerror = () => {
+		document.getElementById('debug').innerHTML = 'Connection to ' + url + ' lost, retrying';
+	};
+	source.onopen = () => {
+		document.getElementById('debug').innerHTML = '';
+	};
+}
+
 function draw_timescale(svg, t0, t1, dt, t_offset, t_scale, height)
 {
 	for(let t = t0; t < t1; t = t + dt)
@@ -224,6 +274,19 @@ function draw_frame(svg, frame_id, frame_data, t_offset, t_scale, line_height, l
 
 			y0 = y0 + dy;
 
+			// Time waiting for the previous encoders of the group
+			if ("encode_ready" in events)
+			{
+				var queue = document.createElementNS("http://www.w3.org/2000/svg", 'rect');
+				queue.setAttribute('x', events["encode_ready"] * t_scale);
+				queue.setAttribute('y', y0 - dy + line_height * 0.4);
+				queue.setAttribute('width', (encode_begin - events["encode_ready"]) * t_scale);
+				queue.setAttribute('height', line_height * 0.2);
+				queue.setAttribute('fill', '#808080');
+				queue.setAttribute('class', 'queue');
+				g.appendChild(queue);
+			}
+
 			g.appendChild(encode);
 			g.appendChild(text1);
 			g.appendChild(send);
@@ -376,7 +439,7 @@ function draw_frame(svg, frame_id, frame_data, t_offset, t_scale, line_height, l
 	svg.appendChild(g);
 }
 
-function draw_everything(svg, timing_data)
+function draw_everything(svg, timing_data, follow = false)
 {
 	t0 = 0;       // ms
 	t1 = 100;     // ms
@@ -407,6 +470,21 @@ function draw_everything(svg, timing_data)
 		draw_frame(svg, i, timing_data[i], t_offset, t_scale, line_height, line_margin)
 	}
 
+	if (follow)
+	{
+		// Keep the last frame visible
+		let frame_end = 0;
+		for (let i in timing_data)
+		{
+			if (timing_data[i].global)
+				frame_end = Math.max(frame_end, timing_data[i].global.frame_end);
+		}
+		svg.t0 = Math.max(0, frame_end - svg.clientWidth / t_scale);
+		for (const frame of svg.getElementsByClassName('frame'))
+			frame.setAttribute("transform", "translate(" + ((frame.frame_begin - svg.t0) * t_scale) + " 0)");
+		return;
+	}
+
 	svg.t0 = 0;
 
 	svg.addEventListener('wheel', (event) => {
@@ -0,0 +1,207 @@
+#!/usr/bin/env python3
+
+# Converts a WIVRN_DUMP_TIMINGS file to the Chrome trace event format, which
+# can be opened in https://ui.perfetto.dev or chrome://tracing.
+# Headset events are already converted to the server clock by the server.
+
+import argparse
+import csv
+import json
+
+SERVER = 0
+HEADSET = 1
+
+COMPOSITOR = 0
+RENDER = 1
+TRACKING = 2
+GPU = 3
+
+ENCODER = 0
+NETWORK = 1
+DECODER = 2
+
+
+def stream_thread(kind, stream):
+    # one track per stream and kind of work
+    return 100 * (1 + kind) + stream
+
+
+# (name, begin event, end event, process, kind of thread)
+STREAM_SPANS = [
+    ("queue", "encode_ready", "encode_begin", SERVER, ENCODER),
+    ("encode", "encode_begin", "encode_end", SERVER, ENCODER),
+    ("send", "send_begin", "send_end", SERVER, ENCODER),
+    ("receive", "receive_begin", "receive_end", HEADSET, NETWORK),
+    ("decode", "decode_begin", "decode_end", HEADSET, DECODER),
+]
+
+# Steps of each stream linked by flow events: event, process, kind of thread (None for the headset render thread)
+FLOW = [
+    ("encode_begin", SERVER, ENCODER),
+    ("send_begin", SERVER, ENCODER),
+    ("receive_begin", HEADSET, NETWORK),
+    ("decode_begin", HEADSET, DECODER),
+    ("blit", HEADSET, None),
+]
+
+
+def read(file):
+    frames = dict()
+    stats = []
+    origin = None
+    for event, frame, timestamp, stream, *extra in csv.reader(file):
+        frame = int(frame)
+        timestamp = int(timestamp)
+        stream = int(stream)
+        if not timestamp:
+            continue
+        if origin is None:
+            origin = timestamp
+        timestamp = (timestamp - origin) / 1000
+
+        if event in ("network_stats", "wifi_link", "headset_gpu"):
+            stats.append((timestamp, stream, event, extra))
+            continue
+
+        events = frames.setdefault(frame, dict()).setdefault(stream, dict())
+        events[event] = timestamp
+        if event == "frame_stats":
+            events["stats"] = extra
+        elif event == "encode_begin" and extra:
+            events["type"] = extra[0]
+    return frames, stats
+
+
+def span(name, pid, tid, begin, end, args=None):
+    res = {"name": name, "ph": "X", "pid": pid, "tid": tid, "ts": begin, "dur": max(end - begin, 0)}
+    if args:
+        res["args"] = args
+    return res
+
+
+def convert(frames, stats):
+    trace = []
+
+    def metadata(pid, tid, name):
+        if tid is None:
+            trace.append({"name": "process_name", "ph": "M", "pid": pid, "args": {"name": name}})
+        else:
+            trace.append({"name": "thread_name", "ph": "M", "pid": pid, "tid": tid, "args": {"name": name}})
+
+    metadata(SERVER, None, "Server")
+    metadata(HEADSET, None, "Headset")
+    metadata(SERVER, COMPOSITOR, "Compositor")
+    metadata(HEADSET, RENDER, "Render")
+    metadata(SERVER, TRACKING, "Tracking")
+    metadata(SERVER, GPU, "GPU")
+
+    streams = set()
+    for num, frame in sorted(frames.items()):
+        glob = frame.get(255, {})
+        args = {"frame": num}
+        if "wake_up" in glob and "submit" in glob:
+            trace.append(span(f"Frame {num}", SERVER, COMPOSITOR, glob["wake_up"], glob["submit"], args))
+            if "begin" in glob:
+                trace.append(span("render", SERVER, COMPOSITOR, glob["begin"], glob["submit"], args))
+        if "present" in glob:
+            trace.append({"name": "present", "ph": "i", "s": "t", "pid": SERVER, "tid": COMPOSITOR, "ts": glob["present"], "args": args})
+
+        # Work on the GPU queue, each copy starts when the previous one ends
+        if "gpu_render_begin" in glob and "gpu_render_end" in glob:
+            trace.append(span("render", SERVER, GPU, glob["gpu_render_begin"], glob["gpu_render_end"], args))
+        if "gpu_convert_begin" in glob and "gpu_convert_end" in glob:
+            trace.append(span("convert", SERVER, GPU, glob["gpu_convert_begin"], glob["gpu_convert_end"], args))
+            previous = glob["gpu_convert_end"]
+            for stream, events in sorted(frame.items()):
+                if stream != 255 and "gpu_copy_end" in events:
+                    trace.append(span(f"copy {stream}", SERVER, GPU, previous, events["gpu_copy_end"], dict(args, stream=stream)))
+                    previous = events["gpu_copy_end"]
+            if "gpu_present_end" in glob:
+                trace.append(span("layers", SERVER, GPU, previous, glob["gpu_present_end"], args))
+
+        # Motion to photons: from the tracking sample the views were computed from
+        if "tracking_produced" in glob and "tracking_received" in glob:
+            trace.append(span("uplink", SERVER, TRACKING, glob["tracking_produced"], glob["tracking_received"], args))
+            # Frames overlap, use async events so that they get their own rows
+            displays = [events["display"] for stream, events in frame.items() if stream != 255 and "display" in events]
+            if displays:
+                for ph, ts in (("b", glob["tracking_produced"]), ("e", max(displays))):
+                    trace.append({"name": "motion to photons", "cat": "latency", "ph": ph, "id": num, "pid": SERVER, "tid": TRACKING, "ts": ts, "args": args})
+
+        flow = []
+        if "tracking_produced" in glob:
+            flow.append((glob["tracking_produced"], SERVER, TRACKING))
+        if "wake_up" in glob:
+            flow.append((glob["wake_up"], SERVER, COMPOSITOR))
+
+        for stream, events in frame.items():
+            if stream == 255:
+                continue
+            streams.add(stream)
+            stream_args = dict(args, stream=stream)
+            if "type" in events:
+                stream_args["type"] = events["type"]
+            if "stats" in events:
+                frame_type, size, slices, qp, encode_time = events["stats"]
+                stream_args.update(bytes=int(size), slices=int(slices))
+                if float(qp) >= 0:
+                    stream_args["qp"] = float(qp)
+
+            for name, begin, end, pid, kind in STREAM_SPANS:
+                if begin in events and end in events:
+                    trace.append(span(name, pid, stream_thread(kind, stream), events[begin], events[end], stream_args))
+
+            if "blit" in events and "display" in events:
+                trace.append(span(f"display {stream}", HEADSET, RENDER, events["blit"], events["display"], stream_args))
+            for drop in ("encode_skip", "encode_drop"):
+                if drop in events:
+                    trace.append({"name": drop, "ph": "i", "s": "t", "pid": SERVER, "tid": stream_thread(ENCODER, stream), "ts": events[drop], "args": stream_args})
+
+            for step, pid, kind in FLOW:
+                if step in events:
+                    flow.append((events[step], pid, RENDER if kind is None else stream_thread(kind, stream)))
+
+        # Flow events bind to the enclosing span, link the frame from wake up to display
+        if len(flow) < 2:
+            continue
+        flow.sort()
+        for i, (ts, pid, tid) in enumerate(flow):
+            ph = "s" if i == 0 else "f" if i == len(flow) - 1 else "t"
+            trace.append({"name": "frame", "cat": "frame", "ph": ph, "id": num, "pid": pid, "tid": tid, "ts": ts, "bp": "e"})
+
+    for stream in streams:
+        metadata(SERVER, stream_thread(ENCODER, stream), f"Encoder {stream}")
+        metadata(HEADSET, stream_thread(NETWORK, stream), f"Network {stream}")
+        metadata(HEADSET, stream_thread(DECODER, stream), f"Decoder {stream}")
+
+    for timestamp, index, event, extra in stats:
+        if event == "wifi_link":
+            rssi, tx_rate, rx_rate, frequency = extra
+            trace.append({"name": "Wi-Fi RSSI (dBm)", "ph": "C", "pid": HEADSET, "ts": timestamp, "args": {"rssi": int(rssi)}})
+            trace.append({"name": "Wi-Fi rate (Mbps)", "ph": "C", "pid": HEADSET, "ts": timestamp, "args": {"tx": int(tx_rate), "rx": int(rx_rate)}})
+            continue
+        if event == "headset_gpu":
+            frames, quad_layers, transition, left, right, overlay, total, max_total = map(int, extra)
+            passes = {"quad layers": quad_layers, "transition": transition, "left eye": left, "right eye": right, "overlay": overlay}
+            trace.append({"name": "Headset GPU (ms)", "ph": "C", "pid": HEADSET, "ts": timestamp, "args": {k: v / 1e6 for k, v in passes.items()}})
+            trace.append({"name": "Headset GPU total (ms)", "ph": "C", "pid": HEADSET, "ts": timestamp, "args": {"average": total / 1e6, "max": max_total / 1e6}})
+            continue
+        received, lost, reordered, jitter = extra
+        # Socket 0 is the stream socket, 1 the low latency one, then the extra video sockets
+        name = "stream" if index == 0 else "low latency" if index == 1 else f"video {index - 2}"
+        trace.append({"name": f"{name} packets", "ph": "C", "pid": HEADSET, "ts": timestamp, "args": {"received": int(received), "lost": int(lost), "reordered": int(reordered)}})
+        trace.append({"name": f"{name} jitter (µs)", "ph": "C", "pid": HEADSET, "ts": timestamp, "args": {"jitter": float(jitter)}})
+
+    return {"traceEvents": trace, "displayTimeUnit": "ms"}
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description="Convert WIVRN_DUMP_TIMINGS output to a Chrome/Perfetto trace")
+    parser.add_argument("input", help="timings file written by the server")
+    parser.add_argument("output", help="json trace file")
+    args = parser.parse_args()
+
+    with open(args.input) as file:
+        frames, stats = read(file)
+    with open(args.output, "w") as file:
+        json.dump(convert(frames, stats), file)
@@ -690,6 +690,8 @@ int dissect_wivrn(tvbuff_t * tvb, packet_info * pinfo, proto_tree * tree _U_, vo
 
 	if (tcp)
 		start += sizeof(uint16_t);
+	else
+		start += 2 * sizeof(uint32_t); // UDP::datagram_header: sequence number and timestamp
 
 	if (pinfo->destport == xrt::drivers::wivrn::default_port)
 		tree_traits<"wivrn.from_headset", from_headset::packets>::dissect(subtree, tvb, start);